@@ -528,6 +528,94 @@ void Healpix_Base::pix2ang_z_phi (int pix, double &z, double &phi) const
     }
   }
 
+namespace {
+
+// Even bits of v, as ctab does for nest2xyf(), with shifts only
+inline int compress_bits (int v)
+  {
+  unsigned int x = v & 0x55555555u;
+  x = (x | (x>>1)) & 0x33333333u;
+  x = (x | (x>>2)) & 0x0f0f0f0fu;
+  x = (x | (x>>4)) & 0x00ff00ffu;
+  x = (x | (x>>8)) & 0x0000ffffu;
+  return int(x);
+  }
+
+} // unnamed namespace
+
+void Healpix_Base::pix2ang_z_phi (const int *pix, int n, double *z,
+  double *phi) const
+  {
+  if (scheme_==RING)
+    {
+    for (int i=0; i<n; ++i)
+      pix2ang_z_phi (pix[i], z[i], phi[i]);
+    return;
+    }
+
+  // The NEST branch of pix2ang_z_phi(), with selects instead of branches
+  // jrll[face] is 2 + face/4, and jpll[face] is 2*(face%4), plus 1 outside
+  // the equatorial faces 4 to 7
+  // (the members are copied, as z and phi might alias them for all the
+  // compiler knows)
+  const int order = order_, nside = nside_, npface = npface_, nl4 = nside_*4;
+  const double fact1 = fact1_, fact2 = fact2_;
+  for (int i=0; i<n; ++i)
+    {
+    int face_num = pix[i]>>(2*order);
+    int ipf = pix[i] & (npface-1);
+    int ix = compress_bits(ipf);
+    int iy = compress_bits(ipf>>1);
+
+    int jr = ((2+(face_num>>2))<<order) - ix - iy - 1;
+    int north = jr<nside, south = jr>3*nside, cap = north|south;
+    int nr = north ? jr : nside;
+    nr = south ? nl4-jr : nr;
+    int kshift = cap ? 0 : (jr-nside)&1;
+    // z is 1-nr*nr*fact2 in the north cap, nr*nr*fact2-1 in the south cap
+    // and (2*nside-jr)*fact1 in between: all exactly as 1 - m*c or 0 - m*c,
+    // negated for the south cap (selects of operations are not vectorised)
+    int m = cap ? nr*nr : jr-2*nside;
+    double c = cap ? fact2 : fact1;
+    z[i] = (1-2*south) * (cap - m*c);
+
+    int jpll = 2*(face_num&3) + ((face_num>>2)!=1);
+    int jp = (jpll*nr + ix - iy + 1 + kshift) / 2;
+    jp = (jp>nl4) ? jp-nl4 : jp;
+    jp = (jp<1) ? jp+nl4 : jp;
+    // jp-(kshift+1)*0.5, exactly
+    phi[i] = ((2*jp-kshift-1)*0.5)*(halfpi/nr);
+    }
+  }
+
+void Healpix_Base::pix2vec (const int *pix, int n, double *x, double *y,
+  double *z) const
+  {
+  // x holds phi until it is overwritten (as set_z_phi() of vec3)
+  pix2ang_z_phi (pix, n, z, x);
+  for (int i=0; i<n; ++i)
+    {
+    double sintheta = sqrt((1.-z[i])*(1.+z[i])), ph = x[i];
+    x[i] = sintheta*cos(ph);
+    y[i] = sintheta*sin(ph);
+    }
+  }
+
+void Healpix_Base::ang2pix_z_phi (const double *z, const double *phi, int n,
+  int *pix) const
+  {
+  for (int i=0; i<n; ++i)
+    pix[i] = ang2pix_z_phi (z[i], phi[i]);
+  }
+
+void Healpix_Base::vec2pix (const double *x, const double *y,
+  const double *z, int n, int *pix) const
+  {
+  for (int i=0; i<n; ++i)
+    pix[i] = ang2pix_z_phi (z[i]/sqrt(x[i]*x[i]+y[i]*y[i]+z[i]*z[i]),
+      safe_atan2(y[i],x[i]));
+  }
+
 void Healpix_Base::query_disc (const pointing &ptg, double radius,
   vector<int>& listpix) const
   {
@@ -678,6 +766,17 @@ void Healpix_Base::neighbors (int pix, fix_arr<int,8> &result) const
     }
   }
 
+void Healpix_Base::neighbors (const int *pix, int n, int *result) const
+  {
+  fix_arr<int,8> nb;
+  for (int i=0; i<n; ++i)
+    {
+    neighbors (pix[i], nb);
+    for (int m=0; m<8; ++m)
+      result[8*i+m] = nb[m];
+    }
+  }
+
 void Healpix_Base::get_ring_info2 (int ring, int &startpix, int &ringpix,
   double &theta, bool &shifted) const
   {
@@ -191,6 +191,25 @@ class Healpix_Base
       return res;
       }
 
+    /*! Computes \a z and \a phi of the \a n pixels \a pix[0..n-1], as
+        pix2ang_z_phi() does for every pixel.
+        \note In the NEST scheme, all pixels are done in one pass without
+          branches or table lookups, which the compiler can vectorise. */
+    void pix2ang_z_phi (const int *pix, int n, double *z, double *phi) const;
+    /*! Computes the vectors \a (x[i], y[i], z[i]) to the centers of the \a n
+        pixels \a pix[0..n-1]. */
+    void pix2vec (const int *pix, int n, double *x, double *y, double *z)
+      const;
+    /*! Computes the numbers \a pix[0..n-1] of the pixels which contain the
+        \a n angular coordinates \a (z[i], phi[i]). */
+    void ang2pix_z_phi (const double *z, const double *phi, int n, int *pix)
+      const;
+    /*! Computes the numbers \a pix[0..n-1] of the pixels which contain the
+        \a n vectors \a (x[i], y[i], z[i]) (which are normalized if
+        necessary). */
+    void vec2pix (const double *x, const double *y, const double *z, int n,
+      int *pix) const;
+
     /*! Returns the numbers of all pixels whose centers lie within \a radius
         of \a dir in \a listpix.
         \param dir the angular coordinates of the disc center
@@ -242,6 +261,9 @@ class Healpix_Base
         \note This method works in both RING and NEST schemes, but is
           considerably faster in the NEST scheme. */
     void neighbors (int pix, fix_arr<int,8> &result) const;
+    /*! Returns the neighbors (as neighbors() does) of the \a n pixels
+        \a pix[0..n-1]: those of \a pix[i] are \a result[8*i..8*i+7]. */
+    void neighbors (const int *pix, int n, int *result) const;
     /*! Returns interpolation information for the direction \a ptg.
         The surrounding pixels are returned in \a pix, their corresponding
         weights in \a wgt.
@@ -0,0 +1,1100 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * Micro-benchmarks of the core liblion kernels
+ *
+ * Every benchmark is run --repeats times (after one warm-up run); the output is one CSV line per benchmark:
+ *   benchmark,box,threads,items,best_s,mean_s,items_per_s
+ * where items is the number of images (or transforms, or STAR-file lines) processed per run,
+ * and items_per_s is calculated from the best run. Lines starting with # are comments.
+ *
+ * liblion_bench [--box 128] [--vol_box <box>] [--threads 1] [--repeats 5] [--images 200] [--particles 20000]
+ *               [--only <name>[,<name>...]] [--tmp <dir>] [--o <results.csv>] [--instrumentation <counters.json>]
+ *
+ * The results go to stdout, or to the file given with --o (some library functions print to stdout themselves).
+ * If liblion was built with RELION_INSTRUMENTATION, --instrumentation writes its timers and counters of all runs.
+ * The SIMD kernels may be lowered with the environment variable RELION_SIMD (see cpu_features.h).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "src/projector.h"
+#include "src/backprojector.h"
+#include "src/fftw.h"
+#include "src/ctf.h"
+#include "src/image.h"
+#include "src/image_stack_writer.h"
+#include "src/particle_pipeline.h"
+#include "src/particle_extractor.h"
+#include "src/rotated_reference_cache.h"
+#include "src/insertion_buffer.h"
+#include "src/checkpoint.h"
+#include "src/memory_planner.h"
+#include "src/healpix_sampling.h"
+#include "src/random.h"
+#include "src/planar_complex.h"
+#include "src/metadata_table.h"
+#include "src/euler.h"
+#include "src/funcs.h"
+#include "src/cpu_features.h"
+#include "src/instrumentation.h"
+
+using namespace relion;
+
+struct BenchOptions
+{
+	int box, vol_box, nr_threads, nr_repeats, nr_images;
+	long int nr_particles;
+	std::vector<std::string> only;
+	std::string tmp_dir, fn_out, fn_instrumentation;
+};
+
+// Base class of all benchmarks: setup() is not timed, run() is
+class Benchmark
+{
+public:
+	virtual ~Benchmark() {}
+	virtual const char* name() const = 0;
+	// Box size reported in the output
+	virtual int box(const BenchOptions &opt) const { return opt.box; }
+	// Prepare the input of run(); returns the number of items processed per run()
+	virtual long int setup(const BenchOptions &opt) = 0;
+	virtual void run(const BenchOptions &opt) = 0;
+	// Remove any files made in setup()
+	virtual void cleanup() {}
+};
+
+static int threadNumber()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+static void randomImage(MultidimArray<DOUBLE> &img, int dim, int box)
+{
+	if (dim == 3)
+		img.resize(box, box, box);
+	else
+		img.resize(box, box);
+	img.setXmippOrigin();
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+	{
+		DIRECT_MULTIDIM_ELEM(img, n) = rnd_gaus(0., 1.);
+	}
+}
+
+// nr row-major 3x3 rotation matrices of random orientations
+static void randomRotations(std::vector<DOUBLE> &A, int nr)
+{
+	A.resize(9 * nr);
+	Matrix2D<DOUBLE> R;
+	for (int i = 0; i < nr; i++)
+	{
+		Euler_angles2matrix(rnd_unif(-180., 180.), rnd_unif(0., 180.), rnd_unif(-180., 180.), R);
+		for (int j = 0; j < 9; j++)
+			A[9 * i + j] = MAT_ELEM(R, j / 3, j % 3);
+	}
+}
+
+static void getRotation(const std::vector<DOUBLE> &A, int i, Matrix2D<DOUBLE> &R)
+{
+	R.resize(3, 3);
+	for (int j = 0; j < 9; j++)
+		MAT_ELEM(R, j / 3, j % 3) = A[9 * i + j];
+}
+
+// Reference projector of a random map: the common part of the projection benchmarks
+class ProjectorBenchmark : public Benchmark
+{
+protected:
+	Projector projector;
+	std::vector<DOUBLE> A;
+	MultidimArray<Complex > slices;
+
+	// data_dim is 2 for projections, and 3 for rotations, of a 3D map
+	void setupProjector(const BenchOptions &opt, int ref_dim, int data_dim, int nr_orientations)
+	{
+		int box = (ref_dim == 3) ? opt.vol_box : opt.box;
+		MultidimArray<DOUBLE> ref, power_spectrum;
+		randomImage(ref, ref_dim, box);
+		projector = Projector(box, TRILINEAR, 2, 10, data_dim);
+		projector.computeFourierTransformMap(ref, power_spectrum, box, opt.nr_threads);
+		randomRotations(A, nr_orientations);
+		slices.resize(nr_orientations, (data_dim == 3) ? box : 1, box, box / 2 + 1);
+	}
+};
+
+class ProjectBenchmark : public ProjectorBenchmark
+{
+public:
+	const char* name() const { return "project"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupProjector(opt, 3, 2, opt.nr_images);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		slices.initZeros();
+		projector.projectBatch(slices, &A[0], opt.nr_images, false, opt.nr_threads);
+	}
+};
+
+class Rotate2DBenchmark : public ProjectorBenchmark
+{
+	std::vector<Matrix2D<DOUBLE> > R;
+public:
+	const char* name() const { return "rotate2D"; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupProjector(opt, 2, 2, opt.nr_images);
+		R.resize(opt.nr_images);
+		for (int i = 0; i < opt.nr_images; i++)
+			rotation2DMatrix(rnd_unif(-180., 180.), R[i], false);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		int box = opt.box;
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			MultidimArray<Complex > img(box, box / 2 + 1);
+			img.initZeros();
+			projector.rotate2D(img, R[i], false);
+			memcpy(&DIRECT_NZYX_ELEM(slices, i, 0, 0, 0), MULTIDIM_ARRAY(img), NZYXSIZE(img) * sizeof(Complex));
+		}
+	}
+};
+
+// All in-plane rotations of a 2D reference at once, into a RotatedReferenceCache
+class Rotate2DCacheBenchmark : public ProjectorBenchmark
+{
+	std::vector<DOUBLE> psi_A;
+	RotatedReferenceCache cache;
+public:
+	const char* name() const { return "rotate2D_cache"; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupProjector(opt, 2, 2, 0);
+		psi_A.resize(9 * opt.nr_images);
+		Matrix2D<DOUBLE> R;
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			Euler_angles2matrix(0., 0., i * 360. / opt.nr_images, R);
+			for (int j = 0; j < 9; j++)
+				psi_A[9 * i + j] = MAT_ELEM(R, j / 3, j % 3);
+		}
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		std::vector<Projector*> references(1, &projector);
+		cache.initialise(references, &psi_A[0], opt.nr_images, false, opt.box, opt.nr_threads);
+	}
+};
+
+class Rotate3DBenchmark : public ProjectorBenchmark
+{
+public:
+	const char* name() const { return "rotate3D"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		// Rotating all of a 3D map is far more work than a projection: use fewer
+		int nr = XMIPP_MAX(1, opt.nr_images / 50);
+		setupProjector(opt, 3, 3, nr);
+		return nr;
+	}
+	void run(const BenchOptions &opt)
+	{
+		int nr = NSIZE(slices), box = opt.vol_box;
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < nr; i++)
+		{
+			Matrix2D<DOUBLE> R;
+			getRotation(A, i, R);
+			MultidimArray<Complex > vol(box, box, box / 2 + 1);
+			vol.initZeros();
+			projector.rotate3D(vol, R, false);
+			memcpy(&DIRECT_NZYX_ELEM(slices, i, 0, 0, 0), MULTIDIM_ARRAY(vol), NZYXSIZE(vol) * sizeof(Complex));
+		}
+	}
+};
+
+// Random Fourier-space slices to insert into a BackProjector
+class BackProjectorBenchmark : public Benchmark
+{
+protected:
+	std::vector<DOUBLE> A;
+	MultidimArray<Complex > slices;
+
+	void setupSlices(const BenchOptions &opt)
+	{
+		int box = opt.vol_box;
+		randomRotations(A, opt.nr_images);
+		slices.resize(opt.nr_images, 1, box, box / 2 + 1);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(slices)
+		{
+			DIRECT_MULTIDIM_ELEM(slices, n) = Complex(rnd_gaus(0., 1.), rnd_gaus(0., 1.));
+		}
+	}
+};
+
+class BackprojectBenchmark : public BackProjectorBenchmark
+{
+	BackProjector *backprojector;
+public:
+	BackprojectBenchmark() : backprojector(NULL) {}
+	~BackprojectBenchmark() { delete backprojector; }
+	const char* name() const { return "backproject"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupSlices(opt);
+		backprojector = new BackProjector(opt.vol_box, 3, "C1");
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		backprojector->initZeros(opt.vol_box);
+		backprojector->backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, opt.nr_threads);
+	}
+};
+
+// As backproject, through an InsertionBuffer that sorts the slices by orientation
+class BackprojectSortedBenchmark : public BackProjectorBenchmark
+{
+	BackProjector *backprojector;
+public:
+	BackprojectSortedBenchmark() : backprojector(NULL) {}
+	~BackprojectSortedBenchmark() { delete backprojector; }
+	const char* name() const { return "backproject_sorted"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupSlices(opt);
+		backprojector = new BackProjector(opt.vol_box, 3, "C1");
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		backprojector->initZeros(opt.vol_box);
+		InsertionBuffer buffer(*backprojector, opt.nr_images, opt.nr_threads);
+		MultidimArray<Complex > img;
+		Matrix2D<DOUBLE> R;
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			slices.getImage(i, img);
+			getRotation(A, i, R);
+			buffer.add(img, R, false);
+		}
+		buffer.flush();
+	}
+};
+
+class ReconstructBenchmark : public BackProjectorBenchmark
+{
+	BackProjector *backprojector;
+	MultidimArray<Complex > data;
+	MultidimArray<DOUBLE> weight;
+public:
+	ReconstructBenchmark() : backprojector(NULL) {}
+	~ReconstructBenchmark() { delete backprojector; }
+	const char* name() const { return "reconstruct"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupSlices(opt);
+		backprojector = new BackProjector(opt.vol_box, 3, "C1");
+		backprojector->initZeros(opt.vol_box);
+		backprojector->backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, opt.nr_threads);
+		slices.clear();
+		// reconstruct() changes the data and weight arrays: keep a copy to start every run from
+		data = backprojector->data;
+		weight = backprojector->weight;
+		return 1;
+	}
+	void run(const BenchOptions &opt)
+	{
+		MultidimArray<DOUBLE> vol, tau2, sigma2, evidence_vs_prior, fsc;
+		backprojector->data = data;
+		backprojector->weight = weight;
+		backprojector->reconstruct(vol, 10, false, 1., tau2, sigma2, evidence_vs_prior, fsc, 1., false, false, opt.nr_threads);
+	}
+};
+
+// As reconstruct, with memory tracking on: also reports the peak of the temporaries against estimateReconstructionMemory()
+class ReconstructTrackedBenchmark : public ReconstructBenchmark
+{
+	size_t peak_bytes, estimate_bytes;
+public:
+	ReconstructTrackedBenchmark() : peak_bytes(0), estimate_bytes(0) {}
+	const char* name() const { return "reconstruct_tracked"; }
+	long int setup(const BenchOptions &opt)
+	{
+		long int nr_items = ReconstructBenchmark::setup(opt);
+		estimate_bytes = estimateReconstructionMemory(opt.vol_box, 2, 1).reconstruct;
+		peak_bytes = 0;
+		setMemoryTracking(true);
+		return nr_items;
+	}
+	void run(const BenchOptions &opt)
+	{
+		resetMemoryPeaks();
+		size_t before = getMemoryUsage().total;
+		ReconstructBenchmark::run(opt);
+		peak_bytes = XMIPP_MAX(peak_bytes, getMemoryUsage().total_peak - before);
+	}
+	void cleanup()
+	{
+		if (isMemoryTracking())
+			std::cerr << "# reconstruct_tracked: peak of the temporaries " << peak_bytes / (1024. * 1024.)
+				<< " MB, estimated " << estimate_bytes / (1024. * 1024.) << " MB" << std::endl;
+		setMemoryTracking(false);
+	}
+};
+
+// Four classes at once, as in one iteration of a 3D classification
+// Synchronous checkpoint of a BackProjector (as after backproject) to --tmp, and restore from it
+class CheckpointBenchmark : public BackProjectorBenchmark
+{
+	BackProjector *backprojector, *restored;
+	FileName fn_checkpoint;
+public:
+	CheckpointBenchmark() : backprojector(NULL), restored(NULL) {}
+	~CheckpointBenchmark() { delete backprojector; delete restored; }
+	const char* name() const { return "checkpoint"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupSlices(opt);
+		backprojector = new BackProjector(opt.vol_box, 3, "C1");
+		backprojector->initZeros(opt.vol_box);
+		backprojector->backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, opt.nr_threads);
+		slices.clear();
+		restored = new BackProjector(opt.vol_box, 3, "C1");
+		fn_checkpoint = opt.tmp_dir + "/liblion_bench_tmp.ckpt";
+		return 1;
+	}
+	void run(const BenchOptions &)
+	{
+		writeCheckpoint(*backprojector, fn_checkpoint);
+		readCheckpoint(*restored, fn_checkpoint);
+	}
+	void cleanup()
+	{
+		if (fn_checkpoint != "")
+			remove(fn_checkpoint.c_str());
+	}
+};
+
+class ReconstructBatchBenchmark : public BackProjectorBenchmark
+{
+	std::vector<BackProjector*> backprojectors;
+	MultidimArray<Complex > data;
+	MultidimArray<DOUBLE> weight;
+public:
+	~ReconstructBatchBenchmark()
+	{
+		for (size_t iclass = 0; iclass < backprojectors.size(); iclass++)
+			delete backprojectors[iclass];
+	}
+	const char* name() const { return "reconstruct_batch"; }
+	int box(const BenchOptions &opt) const { return opt.vol_box; }
+	long int setup(const BenchOptions &opt)
+	{
+		setupSlices(opt);
+		BackProjector backprojector(opt.vol_box, 3, "C1");
+		backprojector.initZeros(opt.vol_box);
+		backprojector.backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, opt.nr_threads);
+		slices.clear();
+		data = backprojector.data;
+		weight = backprojector.weight;
+		for (int iclass = 0; iclass < 4; iclass++)
+			backprojectors.push_back(new BackProjector(backprojector));
+		return backprojectors.size();
+	}
+	void run(const BenchOptions &opt)
+	{
+		int nr_classes = backprojectors.size();
+		std::vector<MultidimArray<DOUBLE> > vol(nr_classes), tau2(nr_classes), sigma2(nr_classes), evidence_vs_prior(nr_classes);
+		std::vector<ReconstructJob> jobs(nr_classes);
+		for (int iclass = 0; iclass < nr_classes; iclass++)
+		{
+			backprojectors[iclass]->data = data;
+			backprojectors[iclass]->weight = weight;
+			jobs[iclass].backprojector = backprojectors[iclass];
+			jobs[iclass].vol_out = &vol[iclass];
+			jobs[iclass].tau2 = &tau2[iclass];
+			jobs[iclass].sigma2 = &sigma2[iclass];
+			jobs[iclass].evidence_vs_prior = &evidence_vs_prior[iclass];
+		}
+		reconstructBatch(jobs, 10, false, 1., false, false, opt.nr_threads);
+	}
+};
+
+class FourierTransformBenchmark : public Benchmark
+{
+	int dim;
+	std::string myname;
+	std::vector<MultidimArray<DOUBLE> > imgs;
+	std::vector<FourierTransformer> transformers;
+public:
+	FourierTransformBenchmark(int _dim) : dim(_dim), myname(_dim == 3 ? "fft3D" : "fft2D") {}
+	const char* name() const { return myname.c_str(); }
+	int box(const BenchOptions &opt) const { return (dim == 3) ? opt.vol_box : opt.box; }
+	long int setup(const BenchOptions &opt)
+	{
+		// For 2D: many images over all threads; for 3D: a few maps with a multi-threaded FFTW
+		int nr = (dim == 3) ? XMIPP_MAX(1, opt.nr_images / 50) : opt.nr_images;
+		imgs.resize(nr);
+		for (int i = 0; i < nr; i++)
+			randomImage(imgs[i], dim, box(opt));
+		transformers.resize((dim == 3) ? 1 : opt.nr_threads);
+		if (dim == 3)
+			transformers[0].setThreadsNumber(opt.nr_threads);
+		return nr;
+	}
+	void run(const BenchOptions &opt)
+	{
+		int nr = imgs.size();
+		// Forward and backward transform of every image
+#pragma omp parallel for num_threads((dim == 3) ? 1 : opt.nr_threads)
+		for (int i = 0; i < nr; i++)
+		{
+			FourierTransformer &transformer = transformers[(dim == 3) ? 0 : threadNumber()];
+			MultidimArray<Complex > Fimg;
+			transformer.FourierTransform(imgs[i], Fimg, false);
+			transformer.inverseFourierTransform();
+		}
+	}
+};
+
+class CTFBenchmark : public Benchmark
+{
+	std::vector<CTF> ctfs;
+public:
+	const char* name() const { return "ctf"; }
+	long int setup(const BenchOptions &opt)
+	{
+		ctfs.resize(opt.nr_images);
+		for (int i = 0; i < opt.nr_images; i++)
+			ctfs[i].setValues(rnd_unif(10000., 30000.), rnd_unif(10000., 30000.), rnd_unif(0., 180.), 300., 2.7, 0.1, 0., 0., 1.);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		int box = opt.box;
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			MultidimArray<DOUBLE> Fctf(box, box / 2 + 1);
+			ctfs[i].getFftwImage(Fctf, box, box, 1.5);
+		}
+	}
+};
+
+class ShiftBenchmark : public Benchmark
+{
+	MultidimArray<Complex > Fimg;
+	std::vector<DOUBLE> shifts;
+public:
+	const char* name() const { return "shift"; }
+	long int setup(const BenchOptions &opt)
+	{
+		MultidimArray<DOUBLE> img;
+		randomImage(img, 2, opt.box);
+		FourierTransformer transformer;
+		transformer.FourierTransform(img, Fimg);
+		shifts.resize(2 * opt.nr_images);
+		for (size_t i = 0; i < shifts.size(); i++)
+			shifts[i] = rnd_unif(-10., 10.);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			MultidimArray<Complex > Fshifted;
+			Fshifted.resize(Fimg);
+			shiftImageInFourierTransform(Fimg, Fshifted, opt.box, shifts[2 * i], shifts[2 * i + 1]);
+		}
+	}
+};
+
+class BeamTiltGridBenchmark : public Benchmark
+{
+	MultidimArray<Complex > Fimg, Fref;
+public:
+	const char* name() const { return "beamtilt_grid"; }
+	long int setup(const BenchOptions &opt)
+	{
+		MultidimArray<DOUBLE> img;
+		FourierTransformer transformer;
+		randomImage(img, 2, opt.box);
+		transformer.FourierTransform(img, Fimg);
+		randomImage(img, 2, opt.box);
+		transformer.FourierTransform(img, Fref);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		// A beamtilt search from -4 to 4 mrad in steps of 0.2 mrad (as in the particle polisher)
+		MultidimArray<DOUBLE> Fweight, diff2;
+		for (int i = 0; i < opt.nr_images; i++)
+			computeBeamTiltDifferences(Fimg, Fref, Fweight, -4., -4., 0.2, 41, 41, 0.0197, 2.7, 1.1, opt.box, diff2, 0., opt.nr_threads);
+	}
+};
+
+class PlanarComplexBenchmark : public Benchmark
+{
+	PlanarComplexArray Fimg, Fref;
+	MultidimArray<DOUBLE> Fctf;
+	std::vector<DOUBLE> shifts;
+public:
+	const char* name() const { return "planar_complex"; }
+	long int setup(const BenchOptions &opt)
+	{
+		MultidimArray<DOUBLE> img;
+		FourierTransformer transformer;
+		randomImage(img, 2, opt.box);
+		FourierTransform(transformer, img, Fimg);
+		randomImage(img, 2, opt.box);
+		FourierTransform(transformer, img, Fref);
+		Fctf.resize(Fimg.re);
+		Fctf.initConstant(0.5);
+		shifts.resize(2 * opt.nr_images);
+		for (size_t i = 0; i < shifts.size(); i++)
+			shifts[i] = rnd_unif(-10., 10.);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		// CTF-weight and shift each image, and correlate it with the reference
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			PlanarComplexArray Fshifted = Fimg;
+			Fshifted.multiply(Fctf);
+			Fshifted.applyShift(opt.box, shifts[2 * i], shifts[2 * i + 1]);
+			dotProduct(Fshifted, Fref);
+		}
+	}
+};
+
+class MomentsBenchmark : public Benchmark
+{
+	std::vector<MultidimArray<DOUBLE> > images;
+	std::vector<DOUBLE> kurtosis;
+public:
+	const char* name() const { return "moments"; }
+	long int setup(const BenchOptions &opt)
+	{
+		images.resize(opt.nr_images);
+		kurtosis.resize(opt.nr_images);
+		for (int i = 0; i < opt.nr_images; i++)
+			randomImage(images[i], 2, opt.box);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			DOUBLE avg, stddev, skew;
+			images[i].computeMoments(avg, stddev, skew, kurtosis[i]);
+		}
+	}
+};
+
+// Gaussian noise for a stack of images, with the counter-based generator
+class RandomBenchmark : public Benchmark
+{
+	MultidimArray<DOUBLE> noise;
+public:
+	const char* name() const { return "random"; }
+	long int setup(const BenchOptions &opt)
+	{
+		noise.resize(opt.nr_images, 1, opt.box, opt.box);
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		fillRandomGaussian(noise, 0., 1., 1234, 0, opt.nr_threads);
+	}
+};
+
+// All oversampled orientations of a HEALPix order 3 sampling (oversampling order 2), as for the fine pass of an iteration
+class OrientationsBenchmark : public Benchmark
+{
+	HealpixSampling sampling;
+	std::vector<int> pointer_dir_nonzeroprior, pointer_psi_nonzeroprior;
+	std::vector<DOUBLE> directions_prior, psi_prior;
+public:
+	const char* name() const { return "orientations"; }
+	long int setup(const BenchOptions &)
+	{
+		sampling.clear();
+		sampling.healpix_order = 3;
+		sampling.psi_step = -1.;
+		sampling.limit_tilt = -91.;
+		sampling.offset_range = sampling.offset_step = 1.;
+		sampling.initialise(NOPRIOR, 3);
+		return sampling.NrDirections() * sampling.NrPsiSamplings() * sampling.oversamplingFactorOrientations(2);
+	}
+	void run(const BenchOptions &)
+	{
+		std::vector<DOUBLE> rot, tilt, psi;
+		for (long int idir = 0; idir < sampling.NrDirections(); idir++)
+			for (long int ipsi = 0; ipsi < sampling.NrPsiSamplings(); ipsi++)
+				sampling.getOrientations(idir, ipsi, 2, rot, tilt, psi,
+					pointer_dir_nonzeroprior, directions_prior, pointer_psi_nonzeroprior, psi_prior);
+	}
+};
+
+class MetaDataReadBenchmark : public Benchmark
+{
+	FileName fn_star;
+public:
+	const char* name() const { return "metadata_read"; }
+	int box(const BenchOptions &) const { return 0; }
+	long int setup(const BenchOptions &opt)
+	{
+		// A typical particle STAR file
+		MetaDataTable MD;
+		for (long int i = 0; i < opt.nr_particles; i++)
+		{
+			MD.addObject();
+			MD.setValue(EMDL_IMAGE_NAME, integerToString(i % 1000 + 1, 6) + "@Particles/mic" + integerToString(i / 1000, 4) + ".mrcs");
+			MD.setValue(EMDL_MICROGRAPH_NAME, "Micrographs/mic" + integerToString(i / 1000, 4) + ".mrc");
+			MD.setValue(EMDL_CTF_DEFOCUSU, (DOUBLE)rnd_unif(10000., 30000.));
+			MD.setValue(EMDL_CTF_DEFOCUSV, (DOUBLE)rnd_unif(10000., 30000.));
+			MD.setValue(EMDL_CTF_DEFOCUS_ANGLE, (DOUBLE)rnd_unif(0., 180.));
+			MD.setValue(EMDL_ORIENT_ROT, (DOUBLE)rnd_unif(-180., 180.));
+			MD.setValue(EMDL_ORIENT_TILT, (DOUBLE)rnd_unif(0., 180.));
+			MD.setValue(EMDL_ORIENT_PSI, (DOUBLE)rnd_unif(-180., 180.));
+			MD.setValue(EMDL_ORIENT_ORIGIN_X, (DOUBLE)rnd_unif(-10., 10.));
+			MD.setValue(EMDL_ORIENT_ORIGIN_Y, (DOUBLE)rnd_unif(-10., 10.));
+			MD.setValue(EMDL_PARTICLE_CLASS, (int)(i % 4 + 1));
+		}
+		fn_star = opt.tmp_dir + "/liblion_bench_tmp.star";
+		MD.write(fn_star);
+		return opt.nr_particles;
+	}
+	void run(const BenchOptions &opt)
+	{
+		MetaDataTable MD;
+		MD.read(fn_star);
+		if (MD.numberOfObjects() != opt.nr_particles)
+			REPORT_ERROR("metadata_read: wrong number of particles read from " + fn_star);
+	}
+	void cleanup()
+	{
+		if (fn_star != "")
+			remove(fn_star.c_str());
+	}
+};
+
+class MetaDataSortBenchmark : public Benchmark
+{
+	MetaDataTable MD;
+	std::vector<EMDLabel> labels;
+public:
+	const char* name() const { return "metadata_sort"; }
+	int box(const BenchOptions &) const { return 0; }
+	long int setup(const BenchOptions &opt)
+	{
+		// Particles in random order, to be sorted on micrograph, class and defocus
+		MD.clear();
+		for (long int i = 0; i < opt.nr_particles; i++)
+		{
+			int imic = (int)rnd_unif(0., 1000.);
+			MD.addObject();
+			MD.setValue(EMDL_MICROGRAPH_NAME, "Micrographs/mic" + integerToString(imic, 4) + ".mrc");
+			MD.setValue(EMDL_CTF_DEFOCUSU, (DOUBLE)rnd_unif(10000., 30000.));
+			MD.setValue(EMDL_PARTICLE_CLASS, (int)rnd_unif(1., 5.));
+		}
+		labels.clear();
+		labels.push_back(EMDL_MICROGRAPH_NAME);
+		labels.push_back(EMDL_PARTICLE_CLASS);
+		labels.push_back(EMDL_CTF_DEFOCUSU);
+		return opt.nr_particles;
+	}
+	void run(const BenchOptions &opt)
+	{
+		std::vector<long int> order;
+		MD.getSortOrder(labels, order);
+		if ((long int)order.size() != opt.nr_particles)
+			REPORT_ERROR("metadata_sort: wrong number of sorted particles");
+	}
+};
+
+class ImageReadBenchmark : public Benchmark
+{
+	FileName fn_stack;
+public:
+	const char* name() const { return "image_read"; }
+	long int setup(const BenchOptions &opt)
+	{
+		fn_stack = opt.tmp_dir + "/liblion_bench_tmp.mrcs";
+		ImageStackWriter writer(fn_stack, opt.box, opt.box);
+		MultidimArray<DOUBLE> img;
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			randomImage(img, 2, opt.box);
+			writer.write(img);
+		}
+		writer.close();
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		// Image by image, as from the rlnImageName of a STAR file
+#pragma omp parallel for num_threads(opt.nr_threads)
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			Image<DOUBLE> img;
+			img.read(integerToString(i + 1, 6) + "@" + fn_stack);
+		}
+	}
+	void cleanup()
+	{
+		if (fn_stack != "")
+			remove(fn_stack.c_str());
+	}
+};
+
+// Reading of a compressed stack of --images normalised noise images, quantised to 0.01, in batches of 256
+class CompressedReadBenchmark : public Benchmark
+{
+	FileName fn_stack;
+public:
+	const char* name() const { return "lcs_read"; }
+	long int setup(const BenchOptions &opt)
+	{
+		fn_stack = opt.tmp_dir + "/liblion_bench_tmp.lcs";
+		ImageStackWriter writer(fn_stack, opt.box, opt.box);
+		writer.setQuantisationStep(0.01);
+		MultidimArray<DOUBLE> img;
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			randomImage(img, 2, opt.box);
+			writer.write(img);
+		}
+		writer.close();
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		ImageStackReader reader(fn_stack);
+		reader.setThreadsNumber(opt.nr_threads);
+		MultidimArray<DOUBLE> batch;
+		reader.prefetch(0, 256);
+		for (long int first = 0; first < reader.getStackSize(); first += 256)
+		{
+			reader.read(first, 256, batch);
+			reader.prefetch(first + 256, 256);
+		}
+	}
+	void cleanup()
+	{
+		if (fn_stack != "")
+			remove(fn_stack.c_str());
+	}
+};
+
+// Extraction of --images boxes from one micrograph, downscaled to half the box and normalised
+class ExtractBenchmark : public Benchmark
+{
+	FileName fn_mic, fn_stack;
+	std::vector<DOUBLE> xcoords, ycoords;
+public:
+	const char* name() const { return "extract"; }
+	long int setup(const BenchOptions &opt)
+	{
+		fn_mic = opt.tmp_dir + "/liblion_bench_tmp_mic.mrc";
+		fn_stack = opt.tmp_dir + "/liblion_bench_tmp_extract.mrcs";
+		int mic_size = 8 * opt.box;
+		MultidimArray<DOUBLE> mic;
+		randomImage(mic, 2, mic_size);
+		ImageStackWriter writer(fn_mic, mic_size, mic_size);
+		writer.write(mic);
+		writer.close();
+		xcoords.resize(opt.nr_images);
+		ycoords.resize(opt.nr_images);
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			xcoords[i] = rnd_unif(0., mic_size);
+			ycoords[i] = rnd_unif(0., mic_size);
+		}
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		ParticleExtractor extractor;
+		extractor.extract_size = opt.box;
+		extractor.do_rescale = true;
+		extractor.scale = opt.box / 2;
+		extractor.do_normalise = true;
+		extractor.bg_radius = opt.box / 4 - 1;
+		extractor.do_invert_contrast = true;
+		extractor.nr_threads = opt.nr_threads;
+		extractor.extractToStack(fn_mic, xcoords, ycoords, fn_stack);
+	}
+	void cleanup()
+	{
+		if (fn_mic != "")
+			remove(fn_mic.c_str());
+		if (fn_stack != "")
+			remove(fn_stack.c_str());
+	}
+};
+
+// Read, FFT, CTF, project/compare and insert through a Pipeline (projections of vol_box, so use the same --box)
+class PipelineBenchmark : public ProjectorBenchmark
+{
+	FileName fn_stack;
+	std::vector<PipelineParticle> particles;
+public:
+	const char* name() const { return "pipeline"; }
+	long int setup(const BenchOptions &opt)
+	{
+		if (opt.vol_box != opt.box)
+			REPORT_ERROR("liblion_bench: the pipeline benchmark needs --vol_box equal to --box");
+		setupProjector(opt, 3, 2, opt.nr_images);
+		fn_stack = opt.tmp_dir + "/liblion_bench_tmp.mrcs";
+		ImageStackWriter writer(fn_stack, opt.box, opt.box);
+		MultidimArray<DOUBLE> img;
+		particles.resize(opt.nr_images);
+		for (int i = 0; i < opt.nr_images; i++)
+		{
+			randomImage(img, 2, opt.box);
+			writer.write(img);
+			PipelineParticle &particle = particles[i];
+			particle.fn_stack = fn_stack;
+			particle.image = i;
+			particle.ctf.setValues(rnd_unif(5000., 30000.), rnd_unif(5000., 30000.), rnd_unif(0., 180.), 300., 2.7, 0.1, 0., 0., 1.);
+			for (int j = 0; j < 9; j++)
+				particle.A[j] = A[9 * i + j];
+			particle.shift_x = rnd_unif(-3., 3.);
+			particle.shift_y = rnd_unif(-3., 3.);
+		}
+		writer.close();
+		return opt.nr_images;
+	}
+	void run(const BenchOptions &opt)
+	{
+		BackProjector backprojector(opt.box, 3, "C1");
+		backprojector.initZeros();
+		ParticleReader reader(particles, 32);
+		ParticleFourierStage fourier;
+		ParticleCTFStage ctf(1.);
+		ParticleCompareStage compare(projector);
+		ParticleInsertStage insert(backprojector);
+		int nr_stage_threads = XMIPP_MAX(1, opt.nr_threads / 2);
+		Pipeline pipeline;
+		pipeline.setSource(&reader, 2 * nr_stage_threads + 4);
+		pipeline.addStage(&fourier, nr_stage_threads);
+		pipeline.addStage(&ctf, 1);
+		pipeline.addStage(&compare, nr_stage_threads);
+		pipeline.addStage(&insert, 1);
+		pipeline.run();
+	}
+	void cleanup()
+	{
+		if (fn_stack != "")
+			remove(fn_stack.c_str());
+	}
+};
+
+static void usage()
+{
+	std::cerr << "Usage: liblion_bench [--box 128] [--vol_box <box>] [--threads 1] [--repeats 5] [--images 200]" << std::endl
+		<< "                     [--particles 20000] [--only <name>[,<name>...]] [--tmp <dir>] [--o <results.csv>]" << std::endl
+		<< "                     [--instrumentation <counters.json>]" << std::endl
+		<< "Benchmarks: project rotate2D rotate2D_cache rotate3D backproject backproject_sorted reconstruct reconstruct_tracked reconstruct_batch checkpoint fft2D fft3D ctf shift planar_complex beamtilt_grid moments random orientations metadata_read metadata_sort image_read lcs_read extract pipeline" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions &opt)
+{
+	opt.box = 128;
+	opt.vol_box = -1;
+	opt.nr_threads = 1;
+	opt.nr_repeats = 5;
+	opt.nr_images = 200;
+	opt.nr_particles = 20000;
+	opt.tmp_dir = ".";
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		std::string val = argv[++i];
+		if (arg == "--box")
+			opt.box = textToInteger(val);
+		else if (arg == "--vol_box")
+			opt.vol_box = textToInteger(val);
+		else if (arg == "--threads")
+			opt.nr_threads = textToInteger(val);
+		else if (arg == "--repeats")
+			opt.nr_repeats = textToInteger(val);
+		else if (arg == "--images")
+			opt.nr_images = textToInteger(val);
+		else if (arg == "--particles")
+			opt.nr_particles = textToInteger(val);
+		else if (arg == "--tmp")
+			opt.tmp_dir = val;
+		else if (arg == "--o")
+			opt.fn_out = val;
+		else if (arg == "--instrumentation")
+			opt.fn_instrumentation = val;
+		else if (arg == "--only")
+		{
+			size_t start = 0, end;
+			while ((end = val.find(',', start)) != std::string::npos)
+			{
+				opt.only.push_back(val.substr(start, end - start));
+				start = end + 1;
+			}
+			opt.only.push_back(val.substr(start));
+		}
+		else
+			return false;
+	}
+	if (opt.vol_box < 0)
+		opt.vol_box = opt.box;
+	return opt.box > 0 && opt.vol_box > 0 && opt.nr_threads > 0 && opt.nr_repeats > 0 && opt.nr_images > 0 && opt.nr_particles > 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage();
+		return 1;
+	}
+
+	std::vector<Benchmark*> benchmarks;
+	benchmarks.push_back(new ProjectBenchmark());
+	benchmarks.push_back(new Rotate2DBenchmark());
+	benchmarks.push_back(new Rotate2DCacheBenchmark());
+	benchmarks.push_back(new Rotate3DBenchmark());
+	benchmarks.push_back(new BackprojectBenchmark());
+	benchmarks.push_back(new BackprojectSortedBenchmark());
+	benchmarks.push_back(new ReconstructBenchmark());
+	benchmarks.push_back(new ReconstructTrackedBenchmark());
+	benchmarks.push_back(new ReconstructBatchBenchmark());
+	benchmarks.push_back(new CheckpointBenchmark());
+	benchmarks.push_back(new FourierTransformBenchmark(2));
+	benchmarks.push_back(new FourierTransformBenchmark(3));
+	benchmarks.push_back(new CTFBenchmark());
+	benchmarks.push_back(new ShiftBenchmark());
+	benchmarks.push_back(new PlanarComplexBenchmark());
+	benchmarks.push_back(new BeamTiltGridBenchmark());
+	benchmarks.push_back(new MomentsBenchmark());
+	benchmarks.push_back(new RandomBenchmark());
+	benchmarks.push_back(new OrientationsBenchmark());
+	benchmarks.push_back(new MetaDataReadBenchmark());
+	benchmarks.push_back(new MetaDataSortBenchmark());
+	benchmarks.push_back(new ImageReadBenchmark());
+	benchmarks.push_back(new CompressedReadBenchmark());
+	benchmarks.push_back(new ExtractBenchmark());
+	benchmarks.push_back(new PipelineBenchmark());
+
+	std::ofstream fh_out;
+	if (opt.fn_out != "")
+	{
+		fh_out.open(opt.fn_out.c_str());
+		if (!fh_out)
+		{
+			std::cerr << "liblion_bench: cannot open " << opt.fn_out << std::endl;
+			return 1;
+		}
+	}
+	std::ostream &out = (opt.fn_out != "") ? fh_out : std::cout;
+
+	out << "# liblion_bench simd=" << getSimdLevelName(getSimdLevel()) << " repeats=" << opt.nr_repeats << std::endl;
+	out << "benchmark,box,threads,items,best_s,mean_s,items_per_s" << std::endl;
+
+	int status = 0;
+	init_random_generator(1);
+	instrumentationReset();
+	for (size_t b = 0; b < benchmarks.size(); b++)
+	{
+		Benchmark *bench = benchmarks[b];
+		bool do_run = opt.only.empty();
+		for (size_t i = 0; i < opt.only.size(); i++)
+			do_run = do_run || opt.only[i] == bench->name();
+		if (!do_run)
+			continue;
+
+		try
+		{
+			long int nr_items = bench->setup(opt);
+			bench->run(opt); // warm-up (plans, page faults, caches)
+			double best = 0., total = 0.;
+			for (int r = 0; r < opt.nr_repeats; r++)
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				bench->run(opt);
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				best = (r == 0) ? seconds : XMIPP_MIN(best, seconds);
+				total += seconds;
+			}
+			char line[256];
+			snprintf(line, sizeof(line), "%s,%d,%d,%ld,%.6f,%.6f,%.2f", bench->name(), bench->box(opt), opt.nr_threads,
+				nr_items, best, total / opt.nr_repeats, (best > 0.) ? nr_items / best : 0.);
+			out << line << std::endl;
+		}
+		catch (RelionError &e)
+		{
+			std::cerr << "# " << bench->name() << " failed: " << e << std::endl;
+			status = 1;
+		}
+		bench->cleanup();
+	}
+
+	if (opt.fn_instrumentation != "")
+	{
+		std::ofstream fh_json(opt.fn_instrumentation.c_str());
+		instrumentationWriteJSON(fh_json);
+	}
+
+	for (size_t b = 0; b < benchmarks.size(); b++)
+		delete benchmarks[b];
+	return status;
+}
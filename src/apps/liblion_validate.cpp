@@ -0,0 +1,859 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * Correctness-vs-speed validation of the variants of the core liblion kernels
+ *
+ * Every variant of a kernel (each SIMD level up to the one in use, threaded, batched, bricked or half-precision
+ * storage, sparse or compensated accumulation, ...) is run on the same canned input: a phantom of Gaussian blobs
+ * with a little noise, and random orientations, CTFs and shifts from a fixed random seed. Its output is compared to a
+ * reference, and timed (best of --repeats runs). The output is one CSV line per variant:
+ *   kernel,variant,simd,threads,items,max_abs_err,rel_err,min_fsc,best_s,items_per_s,result
+ * where rel_err is the RMS error divided by the RMS of the reference, and min_fsc the lowest Fourier Shell Correlation
+ * between output and reference over all shells. result is FAIL if rel_err or min_fsc is outside the tolerance of the
+ * variant, and the program then exits with status 1.
+ *
+ * The references of project, backproject, ctf and shift are straightforward loops in double precision, written here
+ * and not in the library. The reference of reconstruct is the library itself, with the scalar kernels and one thread.
+ *
+ * liblion_validate [--box 64] [--threads 1] [--repeats 3] [--images 50] [--only <name>[,<name>...]] [--o <results.csv>]
+ *
+ * The SIMD levels that are tried may be lowered with the environment variable RELION_SIMD (see cpu_features.h).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <complex>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include "src/projector.h"
+#include "src/backprojector.h"
+#include "src/insertion_buffer.h"
+#include "src/fftw.h"
+#include "src/ctf.h"
+#include "src/planar_complex.h"
+#include "src/euler.h"
+#include "src/funcs.h"
+#include "src/cpu_features.h"
+
+using namespace relion;
+
+typedef std::complex<double> dcomplex;
+
+struct ValidateOptions
+{
+	int box, nr_threads, nr_repeats, nr_images;
+	std::vector<std::string> only;
+	std::string fn_out;
+};
+
+// Errors of an output against its reference, and their correlation per Fourier shell
+class ErrorStats
+{
+	double max_abs, sum_err2, sum_ref2, other_rel;
+	std::vector<double> cross, power_ref, power_out;
+public:
+	ErrorStats(int nr_shells) : max_abs(0.), sum_err2(0.), sum_ref2(0.), other_rel(0.),
+		cross(nr_shells, 0.), power_ref(nr_shells, 0.), power_out(nr_shells, 0.) {}
+
+	// Values outside the shells (shell < 0 or >= nr_shells) only count in the errors
+	void add(int shell, double ref_re, double ref_im, double out_re, double out_im)
+	{
+		double dre = out_re - ref_re, dim = out_im - ref_im;
+		double err2 = dre * dre + dim * dim;
+		max_abs = XMIPP_MAX(max_abs, sqrt(err2));
+		sum_err2 += err2;
+		sum_ref2 += ref_re * ref_re + ref_im * ref_im;
+		addToShell(shell, ref_re, ref_im, out_re, out_im);
+	}
+
+	// Only count the values in the FSC
+	void addToShell(int shell, double ref_re, double ref_im, double out_re, double out_im)
+	{
+		if (shell < 0 || shell >= (int)cross.size())
+			return;
+		cross[shell] += ref_re * out_re + ref_im * out_im;
+		power_ref[shell] += ref_re * ref_re + ref_im * ref_im;
+		power_out[shell] += out_re * out_re + out_im * out_im;
+	}
+
+	// Also count the errors of some other output (e.g. the weights next to the data) in maxAbsError and relativeError
+	void addErrorsOf(const ErrorStats &other)
+	{
+		max_abs = XMIPP_MAX(max_abs, other.maxAbsError());
+		other_rel = XMIPP_MAX(other_rel, other.relativeError());
+	}
+
+	double maxAbsError() const { return max_abs; }
+
+	double relativeError() const
+	{
+		double rel = (sum_ref2 > 0.) ? sqrt(sum_err2 / sum_ref2) : sqrt(sum_err2);
+		return XMIPP_MAX(rel, other_rel);
+	}
+
+	// Shells that are empty in both output and reference do not count
+	double minFSC() const
+	{
+		double min_fsc = 1.;
+		for (int shell = 0; shell < (int)cross.size(); shell++)
+		{
+			if (power_ref[shell] == 0. && power_out[shell] == 0.)
+				continue;
+			double denom = sqrt(power_ref[shell] * power_out[shell]);
+			min_fsc = XMIPP_MIN(min_fsc, (denom > 0.) ? cross[shell] / denom : 0.);
+		}
+		return min_fsc;
+	}
+};
+
+// One way of running a kernel, qualified if its errors are within max_rel_err and min_fsc
+struct Variant
+{
+	std::string name;
+	int mode; // meaning depends on the kernel
+	SimdLevel level;
+	int nr_threads;
+	double max_rel_err, min_fsc;
+};
+
+// Base class of all kernel validations: setup() makes the input and reference, run() is timed and compare() is not
+class Validation
+{
+protected:
+	std::vector<Variant> variants;
+
+	// Add the variant for every SIMD level up to max_level (or only for max_level, if the kernel does not dispatch),
+	// and for 1 and nr_threads threads (or only for 1, if the variant is not threaded)
+	void addVariant(const std::string &name, int mode, SimdLevel max_level, bool per_level, int nr_threads,
+		double max_rel_err, double min_fsc)
+	{
+		for (int level = (per_level) ? SIMD_SCALAR : max_level; level <= max_level; level++)
+			for (int threads = 1; threads <= nr_threads; threads = (threads == nr_threads) ? threads + 1 : nr_threads)
+			{
+				Variant v;
+				v.name = name;
+				v.mode = mode;
+				v.level = (SimdLevel)level;
+				v.nr_threads = threads;
+				v.max_rel_err = max_rel_err;
+				v.min_fsc = min_fsc;
+				variants.push_back(v);
+			}
+	}
+
+public:
+	virtual ~Validation() {}
+	virtual const char* name() const = 0;
+	// Prepare the input, the reference and the variants; returns the number of items processed per run()
+	virtual long int setup(const ValidateOptions &opt, SimdLevel max_level) = 0;
+	virtual void run(const ValidateOptions &opt, const Variant &v) = 0;
+	// Errors of the output of the last run() against the reference
+	virtual ErrorStats compare(const ValidateOptions &opt, const Variant &v) = 0;
+	const std::vector<Variant>& getVariants() const { return variants; }
+};
+
+// Sum of Gaussian blobs inside a sphere of radius box/4, plus white noise with a standard deviation of 0.01
+static void phantomVolume(MultidimArray<DOUBLE> &vol, int box)
+{
+	vol.initZeros(box, box, box);
+	vol.setXmippOrigin();
+	for (int iblob = 0; iblob < 24; iblob++)
+	{
+		DOUBLE x0, y0, z0;
+		do
+		{
+			x0 = rnd_unif(-box / 4., box / 4.);
+			y0 = rnd_unif(-box / 4., box / 4.);
+			z0 = rnd_unif(-box / 4., box / 4.);
+		} while (x0 * x0 + y0 * y0 + z0 * z0 > box * box / 16.);
+		DOUBLE sigma = rnd_unif(1., 1. + box / 16.);
+		DOUBLE amplitude = rnd_unif(0.5, 1.);
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(vol)
+		{
+			DOUBLE r2 = (j - x0) * (j - x0) + (i - y0) * (i - y0) + (k - z0) * (k - z0);
+			A3D_ELEM(vol, k, i, j) += amplitude * exp(-r2 / (2. * sigma * sigma));
+		}
+	}
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(vol)
+	{
+		DIRECT_MULTIDIM_ELEM(vol, n) += rnd_gaus(0., 0.01);
+	}
+}
+
+// nr row-major 3x3 rotation matrices of random orientations
+static void randomRotations(std::vector<DOUBLE> &A, int nr)
+{
+	A.resize(9 * nr);
+	Matrix2D<DOUBLE> R;
+	for (int i = 0; i < nr; i++)
+	{
+		Euler_angles2matrix(rnd_unif(-180., 180.), rnd_unif(0., 180.), rnd_unif(-180., 180.), R);
+		for (int j = 0; j < 9; j++)
+			A[9 * i + j] = MAT_ELEM(R, j / 3, j % 3);
+	}
+}
+
+static void getRotation(const std::vector<DOUBLE> &A, int i, Matrix2D<DOUBLE> &R)
+{
+	R.resize(3, 3);
+	for (int j = 0; j < 9; j++)
+		MAT_ELEM(R, j / 3, j % 3) = A[9 * i + j];
+}
+
+// Frequency (in pixels) of row i of a FFTW image or volume with ydim rows
+static inline int fftwFrequency(long int i, long int ydim)
+{
+	return (i < (ydim + 1) / 2) ? i : i - ydim;
+}
+
+static inline int shellOf(double r2)
+{
+	return ROUND(sqrt(r2));
+}
+
+// Trilinear interpolation of the (centered, half) Fourier transform in projector.data, in double precision.
+// out gets nr_A slices of xdim = box/2+1 by ydim = box pixels, as from Projector::projectBatch(out, A, nr_A, false)
+static void referenceProject(const Projector &projector, const std::vector<DOUBLE> &A, int nr_A, int box,
+	std::vector<dcomplex> &out)
+{
+	const MultidimArray<Complex > &data = projector.data;
+	long int xdim = box / 2 + 1, ydim = box;
+	int my_r_max = XMIPP_MIN(projector.r_max, xdim - 1);
+	out.assign(nr_A * ydim * xdim, dcomplex(0., 0.));
+	for (int n = 0; n < nr_A; n++)
+	{
+		double Ainv[9];
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 3; c++)
+				Ainv[3 * r + c] = projector.padding_factor * (double)A[9 * n + 3 * c + r];
+		for (long int i = 0; i < ydim; i++)
+		{
+			int y = (i <= my_r_max) ? i : i - ydim;
+			if (i > my_r_max && i < ydim - my_r_max)
+				continue;
+			for (int x = 0; x <= my_r_max; x++)
+			{
+				if (x * x + y * y > my_r_max * my_r_max)
+					continue;
+				double xp = Ainv[0] * x + Ainv[1] * y;
+				double yp = Ainv[3] * x + Ainv[4] * y;
+				double zp = Ainv[6] * x + Ainv[7] * y;
+				bool is_neg_x = xp < 0.;
+				if (is_neg_x)
+				{
+					xp = -xp;
+					yp = -yp;
+					zp = -zp;
+				}
+				int x0 = (int)floor(xp), y0 = (int)floor(yp), z0 = (int)floor(zp);
+				double fx = xp - x0, fy = yp - y0, fz = zp - z0;
+				dcomplex val(0., 0.);
+				for (int c = 0; c < 8; c++)
+				{
+					int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+					double w = ((dx) ? fx : 1. - fx) * ((dy) ? fy : 1. - fy) * ((dz) ? fz : 1. - fz);
+					const Complex &d = A3D_ELEM(data, z0 + dz, y0 + dy, x0 + dx);
+					val += w * dcomplex(d.real, d.imag);
+				}
+				out[(n * ydim + i) * xdim + x] = (is_neg_x) ? conj(val) : val;
+			}
+		}
+	}
+}
+
+// Projections of the phantom, as input for the backprojection and reconstruction
+static void phantomSlices(int box, int nr_A, std::vector<DOUBLE> &A, MultidimArray<Complex > &slices)
+{
+	MultidimArray<DOUBLE> vol, power_spectrum;
+	phantomVolume(vol, box);
+	Projector projector(box);
+	projector.computeFourierTransformMap(vol, power_spectrum, box);
+	randomRotations(A, nr_A);
+	std::vector<dcomplex> ref;
+	referenceProject(projector, A, nr_A, box, ref);
+	slices.resize(nr_A, 1, box, box / 2 + 1);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(slices)
+	{
+		DIRECT_MULTIDIM_ELEM(slices, n) = Complex(ref[n].real(), ref[n].imag());
+	}
+}
+
+class ProjectValidation : public Validation
+{
+	enum { SINGLE, BATCH, BRICKED, HALF };
+	Projector dense, bricked, half;
+	std::vector<DOUBLE> A;
+	std::vector<dcomplex> ref;
+	MultidimArray<Complex > slices;
+public:
+	ProjectValidation() : dense(1), bricked(1), half(1) {}
+	const char* name() const { return "project"; }
+	long int setup(const ValidateOptions &opt, SimdLevel max_level)
+	{
+		MultidimArray<DOUBLE> vol, power_spectrum;
+		phantomVolume(vol, opt.box);
+		dense = Projector(opt.box);
+		dense.computeFourierTransformMap(vol, power_spectrum, opt.box, opt.nr_threads);
+		bricked = dense;
+		bricked.setBrickedLayout(true, opt.nr_threads);
+		half = dense;
+		half.setHalfPrecision(true, opt.nr_threads);
+		randomRotations(A, opt.nr_images);
+		referenceProject(dense, A, opt.nr_images, opt.box, ref);
+
+		addVariant("project", SINGLE, max_level, true, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("projectBatch", BATCH, max_level, true, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("projectBatch_bricked", BRICKED, max_level, true, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("projectBatch_half", HALF, max_level, true, opt.nr_threads, 1e-3, 0.9999);
+		return opt.nr_images;
+	}
+	void run(const ValidateOptions &opt, const Variant &v)
+	{
+		int box = opt.box;
+		slices.initZeros(opt.nr_images, 1, box, box / 2 + 1);
+		if (v.mode == SINGLE)
+		{
+#pragma omp parallel for num_threads(v.nr_threads)
+			for (int n = 0; n < opt.nr_images; n++)
+			{
+				MultidimArray<Complex > f2d(box, box / 2 + 1);
+				Matrix2D<DOUBLE> R;
+				getRotation(A, n, R);
+				dense.project(f2d, R, false);
+				memcpy(MULTIDIM_ARRAY(slices) + n * YXSIZE(f2d), MULTIDIM_ARRAY(f2d), YXSIZE(f2d) * sizeof(Complex));
+			}
+			return;
+		}
+		Projector &projector = (v.mode == BRICKED) ? bricked : (v.mode == HALF) ? half : dense;
+		projector.projectBatch(slices, &A[0], opt.nr_images, false, v.nr_threads);
+	}
+	ErrorStats compare(const ValidateOptions &opt, const Variant &)
+	{
+		ErrorStats stats(opt.box / 2 + 1);
+		FOR_ALL_DIRECT_NZYX_ELEMENTS_IN_MULTIDIMARRAY(slices)
+		{
+			int x = j, y = fftwFrequency(i, YSIZE(slices));
+			const dcomplex &r = ref[((l * YSIZE(slices)) + i) * XSIZE(slices) + j];
+			const Complex &o = DIRECT_NZYX_ELEM(slices, l, 0, i, j);
+			stats.add(shellOf(x * x + y * y), r.real(), r.imag(), o.real, o.imag);
+		}
+		return stats;
+	}
+};
+
+class BackprojectValidation : public Validation
+{
+	enum { SINGLE, BATCH, SPARSE, COMPENSATED, BUFFERED };
+	std::vector<DOUBLE> A;
+	MultidimArray<Complex > slices;
+	std::vector<dcomplex> ref_data;
+	std::vector<double> ref_weight;
+	long int vol_zdim, vol_ydim, vol_xdim, vol_startz, vol_starty;
+	int padding_factor;
+	BackProjector *backprojector;
+
+	// Trilinear insertion of all slices into dense arrays, in double precision (as BackProjector::backproject)
+	void referenceBackproject(int r_max)
+	{
+		ref_data.assign(vol_zdim * vol_ydim * vol_xdim, dcomplex(0., 0.));
+		ref_weight.assign(ref_data.size(), 0.);
+		long int ydim = YSIZE(slices);
+		for (int n = 0; n < NSIZE(slices); n++)
+		{
+			double Ainv[9];
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					Ainv[3 * r + c] = padding_factor * (double)A[9 * n + 3 * c + r];
+			for (long int i = 0; i < ydim; i++)
+			{
+				// The x = 0 column of the negative-y rows is the Friedel mate of that of the positive ones
+				int y = (i <= r_max) ? i : i - ydim;
+				int first_x = (i <= r_max) ? 0 : 1;
+				if (i > r_max && i < ydim - r_max)
+					continue;
+				for (int x = first_x; x <= r_max; x++)
+				{
+					if (x * x + y * y > r_max * r_max)
+						continue;
+					const Complex &f = DIRECT_NZYX_ELEM(slices, n, 0, i, x);
+					dcomplex val(f.real, f.imag);
+					double xp = Ainv[0] * x + Ainv[1] * y;
+					double yp = Ainv[3] * x + Ainv[4] * y;
+					double zp = Ainv[6] * x + Ainv[7] * y;
+					if (xp < 0.)
+					{
+						xp = -xp;
+						yp = -yp;
+						zp = -zp;
+						val = conj(val);
+					}
+					int x0 = (int)floor(xp), y0 = (int)floor(yp), z0 = (int)floor(zp);
+					double fx = xp - x0, fy = yp - y0, fz = zp - z0;
+					for (int c = 0; c < 8; c++)
+					{
+						int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+						double w = ((dx) ? fx : 1. - fx) * ((dy) ? fy : 1. - fy) * ((dz) ? fz : 1. - fz);
+						long int idx = ((z0 + dz - vol_startz) * vol_ydim + (y0 + dy - vol_starty)) * vol_xdim + x0 + dx;
+						ref_data[idx] += w * val;
+						ref_weight[idx] += w;
+					}
+				}
+			}
+		}
+	}
+
+public:
+	BackprojectValidation() : backprojector(NULL) {}
+	~BackprojectValidation() { delete backprojector; }
+	const char* name() const { return "backproject"; }
+	long int setup(const ValidateOptions &opt, SimdLevel max_level)
+	{
+		phantomSlices(opt.box, opt.nr_images, A, slices);
+		BackProjector shape(opt.box, 3, "C1");
+		shape.initZeros(opt.box);
+		shape.getDataShape(vol_zdim, vol_ydim, vol_xdim, vol_startz, vol_starty);
+		padding_factor = shape.padding_factor;
+		referenceBackproject(shape.r_max);
+
+		// Backprojection does not dispatch on the SIMD level
+		addVariant("backproject", SINGLE, max_level, false, 1, 1e-5, 0.99999);
+		addVariant("backprojectBatch", BATCH, max_level, false, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("backprojectBatch_sparse", SPARSE, max_level, false, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("backprojectBatch_compensated", COMPENSATED, max_level, false, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("insertion_buffer", BUFFERED, max_level, false, opt.nr_threads, 1e-5, 0.99999);
+		return opt.nr_images;
+	}
+	void run(const ValidateOptions &opt, const Variant &v)
+	{
+		delete backprojector;
+		backprojector = new BackProjector(opt.box, 3, "C1");
+		backprojector->setSparseStorage(v.mode == SPARSE);
+		backprojector->setCompensatedSummation(v.mode == COMPENSATED);
+		backprojector->initZeros(opt.box);
+		if (v.mode == SINGLE)
+		{
+			for (int n = 0; n < opt.nr_images; n++)
+			{
+				Matrix2D<DOUBLE> R;
+				getRotation(A, n, R);
+				MultidimArray<Complex > f2d;
+				slices.getImage(n, f2d);
+				backprojector->backproject(f2d, R, false);
+			}
+		}
+		else if (v.mode == BUFFERED)
+		{
+			InsertionBuffer buffer(*backprojector, opt.nr_images, v.nr_threads);
+			for (int n = 0; n < opt.nr_images; n++)
+			{
+				Matrix2D<DOUBLE> R;
+				getRotation(A, n, R);
+				MultidimArray<Complex > f2d;
+				slices.getImage(n, f2d);
+				buffer.add(f2d, R, false);
+			}
+			buffer.flush();
+		}
+		else
+			backprojector->backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, v.nr_threads);
+	}
+	ErrorStats compare(const ValidateOptions &opt, const Variant &)
+	{
+		backprojector->expandToDense();
+		backprojector->foldCompensation();
+		ErrorStats stats(opt.box / 2 + 1), weight_stats(0);
+		for (long int k = 0; k < vol_zdim; k++)
+			for (long int i = 0; i < vol_ydim; i++)
+				for (long int j = 0; j < vol_xdim; j++)
+				{
+					long int idx = (k * vol_ydim + i) * vol_xdim + j;
+					double z = k + vol_startz, y = i + vol_starty, x = j;
+					const Complex &d = MULTIDIM_ARRAY(backprojector->data)[idx];
+					stats.add(shellOf((x * x + y * y + z * z) / (padding_factor * padding_factor)),
+						ref_data[idx].real(), ref_data[idx].imag(), d.real, d.imag);
+					weight_stats.add(-1, ref_weight[idx], 0., MULTIDIM_ARRAY(backprojector->weight)[idx], 0.);
+				}
+		stats.addErrorsOf(weight_stats);
+		return stats;
+	}
+};
+
+class ReconstructValidation : public Validation
+{
+	BackProjector *backprojector;
+	MultidimArray<Complex > data, Fref;
+	MultidimArray<DOUBLE> weight, ref, vol;
+
+	void reconstruct(int nr_threads)
+	{
+		MultidimArray<DOUBLE> tau2, sigma2, evidence_vs_prior, fsc;
+		backprojector->data = data;
+		backprojector->weight = weight;
+		backprojector->reconstruct(vol, 10, false, 1., tau2, sigma2, evidence_vs_prior, fsc, 1., false, false, nr_threads);
+	}
+
+public:
+	ReconstructValidation() : backprojector(NULL) {}
+	~ReconstructValidation() { delete backprojector; }
+	const char* name() const { return "reconstruct"; }
+	long int setup(const ValidateOptions &opt, SimdLevel max_level)
+	{
+		std::vector<DOUBLE> A;
+		MultidimArray<Complex > slices;
+		phantomSlices(opt.box, opt.nr_images, A, slices);
+		backprojector = new BackProjector(opt.box, 3, "C1");
+		backprojector->initZeros(opt.box);
+		backprojector->backprojectBatch(slices, &A[0], opt.nr_images, false, NULL, 1);
+		// reconstruct() changes the data and weight arrays: keep a copy to start every run from
+		data = backprojector->data;
+		weight = backprojector->weight;
+
+		// No independent double-precision reconstruction: the reference is the scalar, single-threaded one
+		setSimdLevel(SIMD_SCALAR);
+		reconstruct(1);
+		setSimdLevel(max_level);
+		ref = vol;
+		FourierTransformer transformer;
+		transformer.FourierTransform(ref, Fref);
+
+		addVariant("reconstruct", 0, max_level, true, opt.nr_threads, 1e-4, 0.9999);
+		return 1;
+	}
+	void run(const ValidateOptions &, const Variant &v)
+	{
+		reconstruct(v.nr_threads);
+	}
+	ErrorStats compare(const ValidateOptions &opt, const Variant &)
+	{
+		if (!vol.sameShape(ref))
+			REPORT_ERROR("ReconstructValidation: the reconstruction does not have the size of the reference");
+		// The errors are those of the real-space map, the FSC is calculated from the Fourier transforms
+		ErrorStats stats(opt.box / 2 + 1);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(vol)
+		{
+			stats.add(-1, DIRECT_MULTIDIM_ELEM(ref, n), 0., DIRECT_MULTIDIM_ELEM(vol, n), 0.);
+		}
+		MultidimArray<Complex > Fvol;
+		FourierTransformer transformer;
+		transformer.FourierTransform(vol, Fvol);
+		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fvol)
+		{
+			const Complex &r = DIRECT_A3D_ELEM(Fref, k, i, j);
+			const Complex &o = DIRECT_A3D_ELEM(Fvol, k, i, j);
+			stats.addToShell(shellOf(kp * kp + ip * ip + jp * jp), r.real, r.imag, o.real, o.imag);
+		}
+		return stats;
+	}
+};
+
+// The CTF of ctf at frequency (X, Y), from its parameters, in double precision (as CTF::initialise and CTF::getCTF)
+static double referenceCTF(const CTF &ctf, double X, double Y)
+{
+	double local_Cs = ctf.Cs * 1e7;
+	double local_kV = ctf.kV * 1e3;
+	double lambda = 12.2643247 / sqrt(local_kV * (1. + local_kV * 0.978466e-6));
+	double K1 = PI * lambda;
+	double K2 = PI / 2. * local_Cs * lambda * lambda * lambda;
+	double K3 = sqrt(1. - (double)ctf.Q0 * ctf.Q0);
+	double K4 = -ctf.Bfac / 4.;
+	double defocus_average = -((double)ctf.DeltafU + ctf.DeltafV) * 0.5;
+	double defocus_deviation = -((double)ctf.DeltafU - ctf.DeltafV) * 0.5;
+
+	double u2 = X * X + Y * Y;
+	double deltaf = (u2 > 0.) ? defocus_average + defocus_deviation * cos(2. * (atan2(Y, X) - DEG2RAD((double)ctf.azimuthal_angle))) : 0.;
+	double argument = K1 * deltaf * u2 + K2 * u2 * u2 - DEG2RAD((double)ctf.PhaseShift);
+	return ctf.scale * -(K3 * sin(argument) - ctf.Q0 * cos(argument)) * exp(K4 * u2);
+}
+
+class CTFValidation : public Validation
+{
+	std::vector<CTF> ctfs;
+	std::vector<MultidimArray<DOUBLE> > images;
+	std::vector<double> ref;
+	DOUBLE angpix;
+public:
+	const char* name() const { return "ctf"; }
+	long int setup(const ValidateOptions &opt, SimdLevel max_level)
+	{
+		int box = opt.box;
+		angpix = 1.5;
+		ctfs.resize(opt.nr_images);
+		images.resize(opt.nr_images);
+		for (int n = 0; n < opt.nr_images; n++)
+			ctfs[n].setValues(rnd_unif(10000., 30000.), rnd_unif(10000., 30000.), rnd_unif(0., 180.), 300., 2.7, 0.1,
+				rnd_unif(0., 100.), 0., 1.);
+
+		MultidimArray<DOUBLE> dummy(box, box / 2 + 1); // only for the loop bounds
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(dummy)
+			{
+				ref.push_back(referenceCTF(ctfs[n], (double)jp / (box * angpix), (double)ip / (box * angpix)));
+			}
+		}
+
+		addVariant("getFftwImage", 0, max_level, true, opt.nr_threads, 1e-4, 0.9999);
+		return opt.nr_images;
+	}
+	void run(const ValidateOptions &opt, const Variant &v)
+	{
+		int box = opt.box;
+#pragma omp parallel for num_threads(v.nr_threads)
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			images[n].resize(box, box / 2 + 1);
+			ctfs[n].getFftwImage(images[n], box, box, angpix);
+		}
+	}
+	ErrorStats compare(const ValidateOptions &opt, const Variant &)
+	{
+		ErrorStats stats(opt.box / 2 + 1);
+		long int idx = 0;
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(images[n])
+			{
+				stats.add(shellOf(ip * ip + jp * jp), ref[idx++], 0., DIRECT_A2D_ELEM(images[n], i, j), 0.);
+			}
+		}
+		return stats;
+	}
+};
+
+class ShiftValidation : public Validation
+{
+	enum { SINGLE, BATCH, PLANAR };
+	MultidimArray<Complex > Fimg;
+	std::vector<DOUBLE> shift_x, shift_y;
+	std::vector<MultidimArray<Complex > > shifted;
+	std::vector<dcomplex> ref;
+public:
+	const char* name() const { return "shift"; }
+	long int setup(const ValidateOptions &opt, SimdLevel max_level)
+	{
+		int box = opt.box;
+		std::vector<DOUBLE> A;
+		MultidimArray<Complex > slices;
+		phantomSlices(box, 1, A, slices);
+		slices.getImage(0, Fimg);
+		shift_x.resize(opt.nr_images);
+		shift_y.resize(opt.nr_images);
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			shift_x[n] = rnd_unif(-10., 10.);
+			shift_y[n] = rnd_unif(-10., 10.);
+		}
+
+		// The rows with i < XSIZE have the positive frequencies (as in shiftImageInFourierTransform)
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			double xshift = -shift_x[n] / box, yshift = -shift_y[n] / box;
+			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(Fimg)
+			{
+				double y = (i < XSIZE(Fimg)) ? i : i - YSIZE(Fimg);
+				double phase = 2. * PI * (j * xshift + y * yshift);
+				const Complex &f = DIRECT_A2D_ELEM(Fimg, i, j);
+				ref.push_back(dcomplex(f.real, f.imag) * dcomplex(cos(phase), sin(phase)));
+			}
+		}
+
+		addVariant("shiftImageInFourierTransform", SINGLE, max_level, true, opt.nr_threads, 1e-5, 0.99999);
+		addVariant("shiftImageInFourierTransformBatch", BATCH, max_level, true, 1, 1e-5, 0.99999);
+		// PlanarComplexArray only has compiled-in AVX code
+		addVariant("PlanarComplexArray::applyShift", PLANAR, max_level, false, opt.nr_threads, 1e-5, 0.99999);
+		return opt.nr_images;
+	}
+	void run(const ValidateOptions &opt, const Variant &v)
+	{
+		if (v.mode == BATCH)
+		{
+			shiftImageInFourierTransformBatch(Fimg, shifted, opt.box, shift_x, shift_y);
+			return;
+		}
+		shifted.resize(opt.nr_images);
+#pragma omp parallel for num_threads(v.nr_threads)
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			if (v.mode == PLANAR)
+			{
+				PlanarComplexArray Fshifted(Fimg);
+				Fshifted.applyShift(opt.box, shift_x[n], shift_y[n]);
+				Fshifted.toComplex(shifted[n]);
+			}
+			else
+				shiftImageInFourierTransform(Fimg, shifted[n], opt.box, shift_x[n], shift_y[n]);
+		}
+	}
+	ErrorStats compare(const ValidateOptions &opt, const Variant &)
+	{
+		ErrorStats stats(opt.box / 2 + 1);
+		long int idx = 0;
+		for (int n = 0; n < opt.nr_images; n++)
+		{
+			if (!shifted[n].sameShape(Fimg))
+				REPORT_ERROR("ShiftValidation: a shifted image does not have the size of the input");
+			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(shifted[n])
+			{
+				int y = fftwFrequency(i, YSIZE(Fimg));
+				const Complex &o = DIRECT_A2D_ELEM(shifted[n], i, j);
+				stats.add(shellOf(j * j + y * y), ref[idx].real(), ref[idx].imag(), o.real, o.imag);
+				idx++;
+			}
+		}
+		return stats;
+	}
+};
+
+static void usage()
+{
+	std::cerr << "Usage: liblion_validate [--box 64] [--threads 1] [--repeats 3] [--images 50] [--only <name>[,<name>...]]" << std::endl
+		<< "                        [--o <results.csv>]" << std::endl
+		<< "Kernels: project backproject reconstruct ctf shift" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, ValidateOptions &opt)
+{
+	opt.box = 64;
+	opt.nr_threads = 1;
+	opt.nr_repeats = 3;
+	opt.nr_images = 50;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		std::string val = argv[++i];
+		if (arg == "--box")
+			opt.box = textToInteger(val);
+		else if (arg == "--threads")
+			opt.nr_threads = textToInteger(val);
+		else if (arg == "--repeats")
+			opt.nr_repeats = textToInteger(val);
+		else if (arg == "--images")
+			opt.nr_images = textToInteger(val);
+		else if (arg == "--o")
+			opt.fn_out = val;
+		else if (arg == "--only")
+		{
+			size_t start = 0, end;
+			while ((end = val.find(',', start)) != std::string::npos)
+			{
+				opt.only.push_back(val.substr(start, end - start));
+				start = end + 1;
+			}
+			opt.only.push_back(val.substr(start));
+		}
+		else
+			return false;
+	}
+	// Even boxes only, as the references assume the FFTW layout of those
+	return opt.box > 0 && opt.box % 2 == 0 && opt.nr_threads > 0 && opt.nr_repeats > 0 && opt.nr_images > 0;
+}
+
+int main(int argc, char** argv)
+{
+	ValidateOptions opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage();
+		return 1;
+	}
+
+	std::vector<Validation*> validations;
+	validations.push_back(new ProjectValidation());
+	validations.push_back(new BackprojectValidation());
+	validations.push_back(new ReconstructValidation());
+	validations.push_back(new CTFValidation());
+	validations.push_back(new ShiftValidation());
+
+	std::ofstream fh_out;
+	if (opt.fn_out != "")
+	{
+		fh_out.open(opt.fn_out.c_str());
+		if (!fh_out)
+		{
+			std::cerr << "liblion_validate: cannot open " << opt.fn_out << std::endl;
+			return 1;
+		}
+	}
+	std::ostream &out = (opt.fn_out != "") ? fh_out : std::cout;
+
+	// All variants are run up to the level in use (the highest one of the CPU, unless lowered with RELION_SIMD)
+	SimdLevel max_level = getSimdLevel();
+	out << "# liblion_validate simd=" << getSimdLevelName(max_level) << " box=" << opt.box << " repeats=" << opt.nr_repeats << std::endl;
+	out << "kernel,variant,simd,threads,items,max_abs_err,rel_err,min_fsc,best_s,items_per_s,result" << std::endl;
+
+	int status = 0;
+	for (size_t b = 0; b < validations.size(); b++)
+	{
+		Validation *validation = validations[b];
+		bool do_run = opt.only.empty();
+		for (size_t i = 0; i < opt.only.size(); i++)
+			do_run = do_run || opt.only[i] == validation->name();
+		if (!do_run)
+			continue;
+
+		try
+		{
+			// The same canned input for every kernel, whichever others are run
+			init_random_generator(1);
+			long int nr_items = validation->setup(opt, max_level);
+			const std::vector<Variant> &variants = validation->getVariants();
+			for (size_t iv = 0; iv < variants.size(); iv++)
+			{
+				const Variant &v = variants[iv];
+				setSimdLevel(v.level);
+				validation->run(opt, v); // also the warm-up run
+				ErrorStats stats = validation->compare(opt, v);
+				double best = 0.;
+				for (int r = 0; r < opt.nr_repeats; r++)
+				{
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					validation->run(opt, v);
+					double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					best = (r == 0) ? seconds : XMIPP_MIN(best, seconds);
+				}
+				bool is_ok = stats.relativeError() <= v.max_rel_err && stats.minFSC() >= v.min_fsc;
+				if (!is_ok)
+					status = 1;
+				char line[512];
+				snprintf(line, sizeof(line), "%s,%s,%s,%d,%ld,%.3e,%.3e,%.8f,%.6f,%.2f,%s", validation->name(), v.name.c_str(),
+					getSimdLevelName(v.level), v.nr_threads, nr_items, stats.maxAbsError(), stats.relativeError(), stats.minFSC(),
+					best, (best > 0.) ? nr_items / best : 0., (is_ok) ? "ok" : "FAIL");
+				out << line << std::endl;
+			}
+		}
+		catch (RelionError &e)
+		{
+			std::cerr << "# " << validation->name() << " failed: " << e << std::endl;
+			status = 1;
+		}
+		setSimdLevel(max_level);
+	}
+
+	for (size_t b = 0; b < validations.size(); b++)
+		delete validations[b];
+	return status;
+}
@@ -33,7 +33,63 @@ namespace relion
 		return _mm256_hsub_pd(__c3, __c4);
 	}
 
+	// Product of 2 pairs of (interleaved) complex numbers (with FMA when compiled for it)
+	inline __m256d _avx_complex_mul_4(__m256d a, __m256d b)
+	{
+		__m256d __im = _mm256_mul_pd(_mm256_permute_pd(a, 0x5), _mm256_permute_pd(b, 0xF));
+#ifdef __FMA__
+		return _mm256_fmaddsub_pd(a, _mm256_movedup_pd(b), __im);
+#else
+		return _mm256_addsub_pd(_mm256_mul_pd(a, _mm256_movedup_pd(b)), __im);
+#endif
+	}
+
+	// Interleave 4 real and 4 imaginary parts and store them as 4 consecutive Complex
+	inline void _avx_store_complex_4(Complex* c, __m256d re, __m256d im)
+	{
+		__m256d __lo = _mm256_unpacklo_pd(re, im);
+		__m256d __hi = _mm256_unpackhi_pd(re, im);
+
+		_mm256_storeu_pd((double*)c, _mm256_permute2f128_pd(__lo, __hi, 0x20));
+		_mm256_storeu_pd((double*)(c + 2), _mm256_permute2f128_pd(__lo, __hi, 0x31));
+	}
+
+	// Load 4 consecutive Complex and split them into 4 real and 4 imaginary parts
+	inline void _avx_load_complex_4(const Complex* c, __m256d &re, __m256d &im)
+	{
+		__m256d __a = _mm256_loadu_pd((const double*)c);
+		__m256d __b = _mm256_loadu_pd((const double*)(c + 2));
+		__m256d __lo = _mm256_permute2f128_pd(__a, __b, 0x20);
+		__m256d __hi = _mm256_permute2f128_pd(__a, __b, 0x31);
+
+		re = _mm256_unpacklo_pd(__lo, __hi);
+		im = _mm256_unpackhi_pd(__lo, __hi);
+	}
+
+	// a * conj(b) of 2 pairs of (interleaved) complex numbers
+	inline __m256d _avx_complex_conj_mul_4(__m256d a, __m256d b)
+	{
+		__m256d __im = _mm256_mul_pd(_mm256_permute_pd(a, 0x5), _mm256_permute_pd(b, 0xF));
+#ifdef __FMA__
+		return _mm256_fmsubadd_pd(a, _mm256_movedup_pd(b), __im);
+#else
+		return _mm256_addsub_pd(_mm256_mul_pd(a, _mm256_movedup_pd(b)), _mm256_xor_pd(__im, _mm256_set1_pd(-0.)));
+#endif
+	}
+
+	// c, twice
+	inline __m256d _avx_broadcast_complex_2(const Complex &c)
+	{
+		return _mm256_broadcast_pd((const __m128d*)&c);
+	}
+
+	// l + (r - l) * a, for 2 complex numbers (or 4 reals)
 #define LIN_INTERP_AVX(l, r, a) _mm256_add_pd(l, _mm256_mul_pd(_mm256_sub_pd(r, l), a))
+#ifdef __FMA__
+#define LIN_INTERP_FMA(l, r, a) _mm256_fmadd_pd(_mm256_sub_pd(r, l), a, l)
+#else
+#define LIN_INTERP_FMA(l, r, a) LIN_INTERP_AVX(l, r, a)
+#endif
 
 #else
 
@@ -45,9 +101,133 @@ namespace relion
 		return _mm256_mul_ps(__c, __s);
 	}
 
-#define LIN_INTERP_AVX(l, r, a) _mm_add_ps(l, _mm_mul_ps(_mm_sub_ps(r, l), a))
+	// Product of 4 pairs of (interleaved) complex numbers (with FMA when compiled for it)
+	inline __m256 _avx_complex_mul_8(__m256 a, __m256 b)
+	{
+		__m256 __im = _mm256_mul_ps(_mm256_permute_ps(a, 0xB1), _mm256_movehdup_ps(b));
+#ifdef __FMA__
+		return _mm256_fmaddsub_ps(a, _mm256_moveldup_ps(b), __im);
+#else
+		return _mm256_addsub_ps(_mm256_mul_ps(a, _mm256_moveldup_ps(b)), __im);
+#endif
+	}
+
+	inline __m256 _avx_complex_mul_complex_4(Complex* c1, Complex* c2)
+	{
+		return _avx_complex_mul_8(_mm256_load_ps((float*)c1), _mm256_load_ps((float*)c2));
+	}
+
+	// Interleave 8 real and 8 imaginary parts and store them as 8 consecutive Complex
+	inline void _avx_store_complex_8(Complex* c, __m256 re, __m256 im)
+	{
+		__m256 __lo = _mm256_unpacklo_ps(re, im);
+		__m256 __hi = _mm256_unpackhi_ps(re, im);
+
+		_mm256_storeu_ps((float*)c, _mm256_permute2f128_ps(__lo, __hi, 0x20));
+		_mm256_storeu_ps((float*)(c + 4), _mm256_permute2f128_ps(__lo, __hi, 0x31));
+	}
+
+	// Load 8 consecutive Complex and split them into 8 real and 8 imaginary parts
+	inline void _avx_load_complex_8(const Complex* c, __m256 &re, __m256 &im)
+	{
+		__m256 __a = _mm256_loadu_ps((const float*)c);
+		__m256 __b = _mm256_loadu_ps((const float*)(c + 4));
+		__m256 __lo = _mm256_permute2f128_ps(__a, __b, 0x20);
+		__m256 __hi = _mm256_permute2f128_ps(__a, __b, 0x31);
+
+		re = _mm256_shuffle_ps(__lo, __hi, _MM_SHUFFLE(2, 0, 2, 0));
+		im = _mm256_shuffle_ps(__lo, __hi, _MM_SHUFFLE(3, 1, 3, 1));
+	}
+
+	// a * conj(b) of 4 pairs of (interleaved) complex numbers
+	inline __m256 _avx_complex_conj_mul_8(__m256 a, __m256 b)
+	{
+		__m256 __im = _mm256_mul_ps(_mm256_permute_ps(a, 0xB1), _mm256_movehdup_ps(b));
+#ifdef __FMA__
+		return _mm256_fmsubadd_ps(a, _mm256_moveldup_ps(b), __im);
+#else
+		return _mm256_addsub_ps(_mm256_mul_ps(a, _mm256_moveldup_ps(b)), _mm256_xor_ps(__im, _mm256_set1_ps(-0.f)));
+#endif
+	}
+
+	// c, 4 times
+	inline __m256 _avx_broadcast_complex_4(const Complex &c)
+	{
+		return _mm256_castpd_ps(_mm256_broadcast_sd((const double*)&c));
+	}
+
+	// l + (r - l) * a, for 4 complex numbers (or 8 reals), and for 2 complex numbers in SSE registers
+#define LIN_INTERP_AVX(l, r, a) _mm256_add_ps(l, _mm256_mul_ps(_mm256_sub_ps(r, l), a))
+#define LIN_INTERP_SSE(l, r, a) _mm_add_ps(l, _mm_mul_ps(_mm_sub_ps(r, l), a))
+#ifdef __FMA__
+#define LIN_INTERP_FMA(l, r, a) _mm256_fmadd_ps(_mm256_sub_ps(r, l), a, l)
+#else
+#define LIN_INTERP_FMA(l, r, a) LIN_INTERP_AVX(l, r, a)
+#endif
+
+	/* sin(x) of 8 floats (Cephes sinf: Cody-Waite reduction to [-pi/4, pi/4] and minimax polynomials)
+	 * Accurate to a few ulp for |x| < 8192; larger arguments lose precision.
+	 */
+	inline __m256 _avx_sin_8(__m256 x)
+	{
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		__m256 sign = _mm256_and_ps(x, signbit);
+		x = _mm256_andnot_ps(signbit, x);
+
+		// Octant j (made even) such that x - j * pi/4 lies in [-pi/4, pi/4]
+		__m256 j = _mm256_floor_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f)));
+		j = _mm256_add_ps(j, _mm256_sub_ps(j, _mm256_mul_ps(_mm256_set1_ps(2.f), _mm256_floor_ps(_mm256_mul_ps(j, _mm256_set1_ps(0.5f))))));
+		__m256 j8 = _mm256_sub_ps(j, _mm256_mul_ps(_mm256_set1_ps(8.f), _mm256_floor_ps(_mm256_mul_ps(j, _mm256_set1_ps(0.125f)))));
+		// j8 = 0: sin, 2: cos, 4: -sin, 6: -cos
+		__m256 use_cos = _mm256_or_ps(_mm256_cmp_ps(j8, _mm256_set1_ps(2.f), _CMP_EQ_OQ), _mm256_cmp_ps(j8, _mm256_set1_ps(6.f), _CMP_EQ_OQ));
+		sign = _mm256_xor_ps(sign, _mm256_and_ps(_mm256_cmp_ps(j8, _mm256_set1_ps(4.f), _CMP_GE_OQ), signbit));
+
+		// Extended precision x - j * pi/4
+		x = _mm256_sub_ps(x, _mm256_mul_ps(j, _mm256_set1_ps(0.78515625f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(j, _mm256_set1_ps(2.4187564849853515625e-4f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(j, _mm256_set1_ps(3.77489497744594108e-8f)));
+		__m256 z = _mm256_mul_ps(x, x);
+
+		__m256 c = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.443315711809948e-5f), z), _mm256_set1_ps(-1.388731625493765e-3f));
+		c = _mm256_add_ps(_mm256_mul_ps(c, z), _mm256_set1_ps(4.166664568298827e-2f));
+		c = _mm256_mul_ps(_mm256_mul_ps(c, z), z);
+		c = _mm256_add_ps(_mm256_sub_ps(c, _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_set1_ps(1.f));
+
+		__m256 s = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(-1.9515295891e-4f), z), _mm256_set1_ps(8.3321608736e-3f));
+		s = _mm256_add_ps(_mm256_mul_ps(s, z), _mm256_set1_ps(-1.6666654611e-1f));
+		s = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(s, z), x), x);
+
+		return _mm256_xor_ps(_mm256_blendv_ps(s, c, use_cos), sign);
+	}
+
+	/* exp(x) of 8 floats (Cephes expf: x = n ln2 + r, polynomial for exp(r), times 2^n)
+	 * Arguments are clamped to [-87.3, 88.3], so that the result is finite and not denormal.
+	 */
+	inline __m256 _avx_exp_8(__m256 x)
+	{
+		x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+		__m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+		__m256 z = _mm256_mul_ps(x, x);
+
+		__m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(1.9875691500e-4f), x), _mm256_set1_ps(1.3981999507e-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+		y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), x), _mm256_set1_ps(1.f));
+
+		// 2^n, built in the exponent bits (AVX has no 256-bit integer arithmetic)
+		__m256i e = _mm256_cvtps_epi32(n);
+		__m128i e_lo = _mm_slli_epi32(_mm_add_epi32(_mm256_castsi256_si128(e), _mm_set1_epi32(127)), 23);
+		__m128i e_hi = _mm_slli_epi32(_mm_add_epi32(_mm256_extractf128_si256(e, 1), _mm_set1_epi32(127)), 23);
+		__m256 pow2n = _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(e_lo), e_hi, 1));
+
+		return _mm256_mul_ps(y, pow2n);
+	}
 
 #endif
+}
 
 #endif
-}
\ No newline at end of file
@@ -25,52 +25,255 @@
   */
 
 #include "src/backprojector.h"
+#include "src/projector_kernels.h"
+#include "src/radial_bins.h"
+#include "src/cuda_backend.h"
+#include "src/thread_pool.h"
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 //#include "temp/IO.cuh"
 
 
 namespace relion
 {
+	// Kahan summation: add val to sum, carrying the lost low-order bits in comp
+	static inline void kahanAdd(DOUBLE &sum, DOUBLE &comp, DOUBLE val)
+	{
+		DOUBLE y = val - comp;
+		DOUBLE t = sum + y;
+		comp = (t - sum) - y;
+		sum = t;
+	}
+
+	static inline void kahanAdd(Complex &sum, Complex &comp, const Complex &val)
+	{
+		kahanAdd(sum.real, comp.real, val.real);
+		kahanAdd(sum.imag, comp.imag, val.imag);
+	}
+
+#ifdef FLOAT_PRECISION
+	/* row0[0..1] += dd[0..1] * val and row1[0..1] += dd[2..3] * val, in one AVX register
+	 * (the two x neighbours of a trilinear or bilinear corner pair are consecutive in memory)
+	 */
+	static inline void addWeightedPairs(Complex *row0, Complex *row1, DOUBLE dd0, DOUBLE dd1, DOUBLE dd2, DOUBLE dd3, __m256 __val)
+	{
+		__m256 __add = _mm256_mul_ps(_mm256_setr_ps(dd0, dd0, dd1, dd1, dd2, dd2, dd3, dd3), __val);
+		_mm_storeu_ps((float*)row0, _mm_add_ps(_mm_loadu_ps((float*)row0), _mm256_castps256_ps128(__add)));
+		_mm_storeu_ps((float*)row1, _mm_add_ps(_mm_loadu_ps((float*)row1), _mm256_extractf128_ps(__add, 1)));
+	}
+#endif
+
+	// Asym = R^T * Ainv: symmetrise() adds data(R * x) into x, so a slice inserted at Ainv * s should also go to R^T * Ainv * s
+	static inline void symmetryRelatedMatrix(const DOUBLE *R, const DOUBLE *Ainv, DOUBLE *Asym)
+	{
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 3; c++)
+				Asym[3 * r + c] = R[r] * Ainv[c] + R[3 + r] * Ainv[3 + c] + R[6 + r] * Ainv[6 + c];
+	}
+
+	void BackProjector::getSymmetryMatrices(std::vector<DOUBLE> &Rs)
+	{
+		const std::vector<Mat33> &R = SL.get_rotations();
+		Rs.resize(9 * R.size());
+		for (size_t isym = 0; isym < R.size(); isym++)
+			for (int n = 0; n < 9; n++)
+				Rs[9 * isym + n] = R[isym].m[n];
+	}
+
 	void BackProjector::initialiseDataAndWeight(int current_size)
 	{
+		MemoryCategoryScope memory_category(MEMORY_BACKPROJECTOR);
 
 		initialiseData(current_size);
 		weight.resize(data);
+		if (do_compensated_sum)
+		{
+			data_comp.resize(data);
+			weight_comp.resize(data);
+		}
 
 	}
 
 	void BackProjector::initZeros(int current_size)
 	{
+		clearSparseStorage();
+		if (do_sparse_storage)
+		{
+			// Only allocate the rows within reach of backprojection
+			initialiseSizes(current_size);
+			data.clear();
+			weight.clear();
+			data_comp.clear();
+			weight_comp.clear();
+			std::vector<long int> offsets;
+			getPackedRowOffsets(offsets);
+			sparse_data.assign(offsets.back(), Complex(0., 0.));
+			sparse_weight.assign(offsets.back(), 0.);
+			if (do_compensated_sum)
+			{
+				sparse_data_comp.assign(offsets.back(), Complex(0., 0.));
+				sparse_weight_comp.assign(offsets.back(), 0.);
+			}
+			sparse_offsets.swap(offsets);
+			return;
+		}
 
 		initialiseDataAndWeight(current_size);
 		data.initZeros();
 		weight.initZeros();
+		if (do_compensated_sum)
+		{
+			data_comp.initZeros();
+			weight_comp.initZeros();
+		}
+	}
+
+	void BackProjector::setSparseStorage(bool do_sparse)
+	{
+		if (do_sparse && ref_dim != 3)
+			REPORT_ERROR("BackProjector::setSparseStorage%%ERROR: sparse storage is only possible for 3D references");
+		do_sparse_storage = do_sparse;
+		if (!do_sparse_storage)
+			expandToDense();
+	}
+
+	void BackProjector::expandToDense()
+	{
+		if (!isSparse())
+			return;
+
+		foldCompensation();
+
+		std::vector<long int> offsets;
+		offsets.swap(sparse_offsets); // data is dense from here on
+		long int zdim, ydim, xdim, startz, starty;
+		getDataShape(zdim, ydim, xdim, startz, starty);
+		initialiseDataAndWeight(2 * r_max);
+		if (ZSIZE(data) != zdim || YSIZE(data) != ydim || XSIZE(data) != xdim)
+			REPORT_ERROR("BackProjector::expandToDense%%BUG: unexpected size of the data array");
+		data.initZeros();
+		weight.initZeros();
+		data_comp.clear();
+		weight_comp.clear();
+
+		long int nr_rows = offsets.size() - 1;
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			long int nx = offsets[r + 1] - offsets[r];
+			memcpy(MULTIDIM_ARRAY(data) + r * xdim, &sparse_data[offsets[r]], nx * sizeof(Complex));
+			memcpy(MULTIDIM_ARRAY(weight) + r * xdim, &sparse_weight[offsets[r]], nx * sizeof(DOUBLE));
+		}
+		clearSparseStorage();
+	}
+
+	// Subtract the compensation terms from plane z of data and weight (z in physical coordinates)
+	static void foldCompensationPlane(MultidimArray<Complex > &data, MultidimArray<DOUBLE> &weight,
+		const MultidimArray<Complex > &data_comp, const MultidimArray<DOUBLE> &weight_comp, long int z)
+	{
+		for (long int n = z * YXSIZE(data); n < (z + 1) * YXSIZE(data); n++)
+		{
+			DIRECT_MULTIDIM_ELEM(data, n) -= DIRECT_MULTIDIM_ELEM(data_comp, n);
+			DIRECT_MULTIDIM_ELEM(weight, n) -= DIRECT_MULTIDIM_ELEM(weight_comp, n);
+		}
+	}
+
+	/* Sum the points (iz, iy, 0) and (-iz, -iy, 0) of data and of weight (see enforceHermitianSymmetry) for one iz <= 0,
+	 * i.e. for all iy of plane iz < 0, or for iy > 0 in plane iz = 0, so that all points are only included once.
+	 * Only the planes iz and -iz are accessed, with direct indices. The z and y ranges should be symmetric around zero.
+	 */
+	static void enforceHermitianSymmetryPlanes(MultidimArray<Complex > &my_data, MultidimArray<DOUBLE> &my_weight, long int iz)
+	{
+		long int xdim = XSIZE(my_data);
+		long int ymax = FINISHINGY(my_data);
+		// Offsets of the points (iz, 0, 0) and (-iz, 0, 0)
+		long int n0 = (iz - STARTINGZ(my_data)) * YXSIZE(my_data) - STARTINGY(my_data) * xdim;
+		long int m0 = (-iz - STARTINGZ(my_data)) * YXSIZE(my_data) - STARTINGY(my_data) * xdim;
+		Complex *data = MULTIDIM_ARRAY(my_data);
+		DOUBLE *weight = MULTIDIM_ARRAY(my_weight);
+		for (long int iy = (iz < 0) ? -ymax : 1; iy <= ymax; iy++)
+		{
+			long int n = n0 + iy * xdim, m = m0 - iy * xdim;
+			// I just need to sum the two points, not divide by 2!
+			Complex fsum = data[n] + conj(data[m]);
+			data[n] = fsum;
+			data[m] = conj(fsum);
+			DOUBLE sum = weight[n] + weight[m];
+			weight[n] = sum;
+			weight[m] = sum;
+		}
+	}
+
+	void BackProjector::foldCompensation(int nr_threads, bool do_enforce_hermitian_symmetry)
+	{
+		if (isSparse())
+		{
+			if (do_enforce_hermitian_symmetry)
+				REPORT_ERROR("BackProjector::foldCompensation%%BUG: Hermitian symmetry can only be enforced on dense data");
+			if (!do_compensated_sum || sparse_data_comp.size() != sparse_data.size())
+				return;
+			for (size_t n = 0; n < sparse_data.size(); n++)
+			{
+				sparse_data[n] -= sparse_data_comp[n];
+				sparse_weight[n] -= sparse_weight_comp[n];
+			}
+			sparse_data_comp.assign(sparse_data.size(), Complex(0., 0.));
+			sparse_weight_comp.assign(sparse_weight.size(), 0.);
+			return;
+		}
+
+		bool do_fold = do_compensated_sum && data_comp.sameShape(data);
+		if (do_enforce_hermitian_symmetry)
+		{
+			// Fold the planes iz and -iz, and combine their x=0 lines while they are still in cache
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int iz = -FINISHINGZ(data); iz <= 0; iz++)
+			{
+				if (do_fold)
+				{
+					foldCompensationPlane(data, weight, data_comp, weight_comp, iz - STARTINGZ(data));
+					if (iz != 0)
+						foldCompensationPlane(data, weight, data_comp, weight_comp, -iz - STARTINGZ(data));
+				}
+				enforceHermitianSymmetryPlanes(data, weight, iz);
+			}
+		}
+		else if (do_fold)
+		{
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int z = 0; z < ZSIZE(data); z++)
+				foldCompensationPlane(data, weight, data_comp, weight_comp, z);
+		}
+
+		if (do_fold)
+		{
+			data_comp.initZeros();
+			weight_comp.initZeros();
+		}
 	}
 
 	void BackProjector::backproject(const MultidimArray<Complex > &f2d,
 		const Matrix2D<DOUBLE> &A, bool inv,
 		const MultidimArray<DOUBLE> *Mweight)
 	{
-		DOUBLE fx, fy, fz, mfx, mfy, mfz, xp, yp, zp;
-		int first_x, x0, x1, y0, y1, z0, z1, y, y2, r2;
-		bool is_neg_x;
-		DOUBLE dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
-		Complex my_val;
-		Matrix2D<DOUBLE> Ainv;
-		DOUBLE my_weight = 1.;
+		backproject(f2d, Mat33(A), inv, Mweight);
+	}
+
+	void BackProjector::backproject(const MultidimArray<Complex > &f2d,
+		const Mat33 &A, bool inv,
+		const MultidimArray<DOUBLE> *Mweight)
+	{
+		INSTRUMENT_TIMER(TIMER_BACKPROJECT);
 
 		// f2d should already be in the right size (ori_size,orihalfdim)
 		// AND the points outside max_r should already be zero...
 
 		// Use the inverse matrix
-		if (inv)
-			Ainv = A;
-		else
-			Ainv = A.transpose();
+		Mat33 Ainv = (inv) ? A : A.transpose();
 
 		// Go from the 2D slice coordinates to the 3D coordinates
 		Ainv *= (DOUBLE)padding_factor;  // take scaling into account directly
-		int max_r2 = r_max * r_max;
-		int min_r2_nn = r_min_nn * r_min_nn;
 
 		//#define DEBUG_BACKP
 #ifdef DEBUG_BACKP
@@ -85,7 +288,228 @@ namespace relion
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
 
-		for (int i = 0; i < YSIZE(f2d); i++)
+		Complex *mydata, *mydata_comp;
+		DOUBLE *myweight, *myweight_comp;
+		getAccumulators(mydata, myweight, mydata_comp, myweight_comp);
+
+		// Insert once for the identity, plus once for every other symmetry operator if do_symmetrise_on_insertion
+		// (the 3D operators do not apply to 2D references, which symmetrise() leaves alone as well)
+		std::vector<DOUBLE> Rs;
+		if (do_symmetrise_on_insertion && ref_dim == 3)
+			getSymmetryMatrices(Rs);
+		for (size_t isym = 0; isym <= Rs.size() / 9; isym++)
+		{
+			DOUBLE Asym[9];
+			if (isym > 0)
+				symmetryRelatedMatrix(&Rs[9 * (isym - 1)], Ainv.data(), Asym);
+
+			addSlice(MULTIDIM_ARRAY(f2d), XSIZE(f2d), YSIZE(f2d), (Mweight != NULL) ? MULTIDIM_ARRAY(*Mweight) : NULL,
+				(isym > 0) ? Asym : Ainv.data(), mydata, myweight, mydata_comp, myweight_comp);
+		}
+	}
+
+	void BackProjector::backprojectBatch(const MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv,
+		const MultidimArray<DOUBLE> *Mweight, int nr_threads)
+	{
+		INSTRUMENT_TIMER(TIMER_BACKPROJECT);
+		if (ref_dim != 3)
+			REPORT_ERROR("BackProjector::backprojectBatch%%ERROR: Dimension of the data array should be 3");
+		if (NSIZE(f2d) < nr_A || ZSIZE(f2d) != 1)
+			REPORT_ERROR("BackProjector::backprojectBatch%%ERROR: f2d should be a stack of at least nr_A 2D images");
+		if (Mweight != NULL && (NSIZE(*Mweight) < nr_A || !Mweight->sameShape(f2d)))
+			REPORT_ERROR("BackProjector::backprojectBatch%%ERROR: Mweight should have the same size as f2d");
+
+		long int xdim = XSIZE(f2d);
+		long int ydim = YSIZE(f2d);
+		long int slice_size = YXSIZE(f2d);
+		DOUBLE pad = (DOUBLE)padding_factor;
+		nr_threads = XMIPP_MAX(1, XMIPP_MIN(getTaskNrThreads(nr_threads), nr_A));
+
+		std::vector<DOUBLE> Rs;
+		if (do_symmetrise_on_insertion)
+			getSymmetryMatrices(Rs);
+		int nr_sym = Rs.size() / 9;
+
+		Complex *data_ptr, *data_comp_ptr;
+		DOUBLE *weight_ptr, *weight_comp_ptr;
+		getAccumulators(data_ptr, weight_ptr, data_comp_ptr, weight_comp_ptr);
+		long int nr_voxels = (isSparse()) ? sparse_data.size() : NZYXSIZE(data);
+
+		// Thread 0 adds directly into data and weight, all other threads into their own private copy
+		std::vector< std::vector<Complex > > thread_data(nr_threads - 1), thread_data_comp(nr_threads - 1);
+		std::vector< std::vector<DOUBLE> > thread_weight(nr_threads - 1), thread_weight_comp(nr_threads - 1);
+
+		// Every thread gets a fixed, contiguous part of the images, so that the result does not depend on the scheduling
+#pragma omp parallel for num_threads(nr_threads)
+		for (int thread_id = 0; thread_id < nr_threads; thread_id++)
+		{
+			Complex *mydata = data_ptr, *mydata_comp = data_comp_ptr;
+			DOUBLE *myweight = weight_ptr, *myweight_comp = weight_comp_ptr;
+			if (thread_id > 0)
+			{
+				// Allocated by the thread that uses them
+				thread_data[thread_id - 1].assign(nr_voxels, Complex(0., 0.));
+				thread_weight[thread_id - 1].assign(nr_voxels, 0.);
+				mydata = &thread_data[thread_id - 1][0];
+				myweight = &thread_weight[thread_id - 1][0];
+				if (do_compensated_sum)
+				{
+					thread_data_comp[thread_id - 1].assign(nr_voxels, Complex(0., 0.));
+					thread_weight_comp[thread_id - 1].assign(nr_voxels, 0.);
+					mydata_comp = &thread_data_comp[thread_id - 1][0];
+					myweight_comp = &thread_weight_comp[thread_id - 1][0];
+				}
+			}
+
+			int first_A = (int)(((long int)nr_A * thread_id) / nr_threads);
+			int last_A = (int)(((long int)nr_A * (thread_id + 1)) / nr_threads);
+			for (int n = first_A; n < last_A; n++)
+			{
+				const DOUBLE *An = A + 9 * n;
+				DOUBLE Ainv[9];
+				for (int r = 0; r < 3; r++)
+					for (int c = 0; c < 3; c++)
+						Ainv[3 * r + c] = pad * (inv ? An[3 * r + c] : An[3 * c + r]);
+
+				addSlice(MULTIDIM_ARRAY(f2d) + n * slice_size, xdim, ydim,
+					(Mweight != NULL) ? MULTIDIM_ARRAY(*Mweight) + n * slice_size : NULL, Ainv,
+					mydata, myweight, mydata_comp, myweight_comp);
+
+				for (int isym = 0; isym < nr_sym; isym++)
+				{
+					DOUBLE Asym[9];
+					symmetryRelatedMatrix(&Rs[9 * isym], Ainv, Asym);
+					addSlice(MULTIDIM_ARRAY(f2d) + n * slice_size, xdim, ydim,
+						(Mweight != NULL) ? MULTIDIM_ARRAY(*Mweight) + n * slice_size : NULL, Asym,
+						mydata, myweight, mydata_comp, myweight_comp);
+				}
+			}
+		}
+
+		// Sum the private accumulators into data and weight, in a fixed order
+		if (nr_threads > 1)
+		{
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int n = 0; n < nr_voxels; n++)
+			{
+				for (int t = 0; t < nr_threads - 1; t++)
+				{
+					if (do_compensated_sum)
+					{
+						kahanAdd(data_ptr[n], data_comp_ptr[n], thread_data[t][n] - thread_data_comp[t][n]);
+						kahanAdd(weight_ptr[n], weight_comp_ptr[n], thread_weight[t][n] - thread_weight_comp[t][n]);
+					}
+					else
+					{
+						data_ptr[n] += thread_data[t][n];
+						weight_ptr[n] += thread_weight[t][n];
+					}
+				}
+			}
+		}
+	}
+
+	void BackProjector::getAccumulators(Complex *&mydata, DOUBLE *&myweight, Complex *&mydata_comp, DOUBLE *&myweight_comp)
+	{
+		mydata_comp = NULL;
+		myweight_comp = NULL;
+		if (isSparse())
+		{
+			if (do_compensated_sum && sparse_data_comp.size() != sparse_data.size())
+			{
+				sparse_data_comp.assign(sparse_data.size(), Complex(0., 0.));
+				sparse_weight_comp.assign(sparse_weight.size(), 0.);
+			}
+			mydata = &sparse_data[0];
+			myweight = &sparse_weight[0];
+			if (do_compensated_sum)
+			{
+				mydata_comp = &sparse_data_comp[0];
+				myweight_comp = &sparse_weight_comp[0];
+			}
+		}
+		else
+		{
+			if (do_compensated_sum && !data_comp.sameShape(data))
+			{
+				MemoryCategoryScope memory_category(MEMORY_BACKPROJECTOR);
+				data_comp.initZeros(data);
+				weight_comp.initZeros(weight);
+			}
+			mydata = MULTIDIM_ARRAY(data);
+			myweight = MULTIDIM_ARRAY(weight);
+			if (do_compensated_sum)
+			{
+				mydata_comp = MULTIDIM_ARRAY(data_comp);
+				myweight_comp = MULTIDIM_ARRAY(weight_comp);
+			}
+		}
+	}
+
+	void BackProjector::backprojectSlice(const Complex *f2d, long int xdim, long int ydim, const DOUBLE *Mweight,
+		const DOUBLE *Ainv, MultidimArray<Complex > &mydata, MultidimArray<DOUBLE> &myweight,
+		MultidimArray<Complex > *mydata_comp, MultidimArray<DOUBLE> *myweight_comp)
+	{
+		if (!mydata.sameShape(data) || !myweight.sameShape(data))
+			REPORT_ERROR("BackProjector::backprojectSlice%%ERROR: mydata and myweight should have the size of data");
+
+		addSliceRows<false>(f2d, xdim, ydim, Mweight, Ainv, MULTIDIM_ARRAY(mydata), MULTIDIM_ARRAY(myweight),
+			(mydata_comp != NULL) ? MULTIDIM_ARRAY(*mydata_comp) : NULL, (myweight_comp != NULL) ? MULTIDIM_ARRAY(*myweight_comp) : NULL);
+	}
+
+	void BackProjector::addSlice(const Complex *f2d, long int xdim, long int ydim, const DOUBLE *Mweight, const DOUBLE *Ainv,
+		Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp)
+	{
+		if (isSparse())
+			addSliceRows<true>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+		else
+			addSliceRows<false>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+	}
+
+	template <bool SPARSE>
+	void BackProjector::addSliceRows(const Complex *f2d, long int xdim, long int ydim, const DOUBLE *Mweight, const DOUBLE *Ainv,
+		Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp)
+	{
+		bool do_compensate = (mydata_comp != NULL);
+		if (interpolator == TRILINEAR && do_compensate)
+			backprojectSliceRows<SPARSE, TRILINEAR, true>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+		else if (interpolator == TRILINEAR)
+			backprojectSliceRows<SPARSE, TRILINEAR, false>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+		else if (interpolator == NEAREST_NEIGHBOUR && do_compensate)
+			backprojectSliceRows<SPARSE, NEAREST_NEIGHBOUR, true>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+		else if (interpolator == NEAREST_NEIGHBOUR)
+			backprojectSliceRows<SPARSE, NEAREST_NEIGHBOUR, false>(f2d, xdim, ydim, Mweight, Ainv, mydata, myweight, mydata_comp, myweight_comp);
+		else
+			REPORT_ERROR("BackProjector::backproject%%ERROR: unrecognized interpolator ");
+	}
+
+	// Index of the first voxel of row (k, i) (physical indices): in a dense array with rows of vol_xdim,
+	// or in a sparse one with the row offsets of getPackedRowOffsets
+	template <bool SPARSE>
+	static inline long int rowStart(const long int *offsets, long int k, long int i, long int vol_xdim, long int vol_ydim)
+	{
+		return (SPARSE) ? offsets[k * vol_ydim + i] : (k * vol_ydim + i) * vol_xdim;
+	}
+
+	template <bool SPARSE, int INTERPOLATOR, bool COMPENSATED>
+	void BackProjector::backprojectSliceRows(const Complex *f2d, long int xdim, long int ydim, const DOUBLE *Mweight,
+		const DOUBLE *Ainv, Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp)
+	{
+		DOUBLE fx, fy, fz, mfx, mfy, mfz, xp, yp, zp;
+		int first_x, x0, y0, y1, z0, z1, y, y2, r2;
+		bool is_neg_x;
+		DOUBLE dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
+		Complex my_val;
+		DOUBLE my_weight = 1.;
+		int max_r2 = r_max * r_max;
+		int min_r2_nn = r_min_nn * r_min_nn;
+
+		// Shape of the data array (also while it is only stored sparsely)
+		long int vol_zdim, vol_ydim, vol_xdim, vol_startz, vol_starty;
+		getDataShape(vol_zdim, vol_ydim, vol_xdim, vol_startz, vol_starty);
+		const long int *offsets = (SPARSE) ? &sparse_offsets[0] : NULL;
+
+		for (int i = 0; i < ydim; i++)
 		{
 			// Dont search beyond square with side max_r
 			if (i <= r_max)
@@ -93,9 +517,9 @@ namespace relion
 				y = i;
 				first_x = 0;
 			}
-			else if (i >= YSIZE(f2d) - r_max)
+			else if (i >= ydim - r_max)
 			{
-				y = i - YSIZE(f2d);
+				y = i - ydim;
 				// x==0 plane is stored twice in the FFTW format. Dont set it twice in BACKPROJECTION!
 				first_x = 1;
 			}
@@ -111,22 +535,23 @@ namespace relion
 					continue;
 
 				// Get the relevant value in the input image
-				my_val = DIRECT_A2D_ELEM(f2d, i, x);
+				my_val = f2d[i * xdim + x];
 
 				// Get the weight
 				if (Mweight != NULL)
-					my_weight = DIRECT_A2D_ELEM(*Mweight, i, x);
+					my_weight = Mweight[i * xdim + x];
 				// else: my_weight was already initialised to 1.
 
 				if (my_weight > 0.)
 				{
+					INSTRUMENT_COUNT(COUNT_PIXELS_BACKPROJECTED, 1);
 
 					// Get logical coordinates in the 3D map
-					xp = Ainv(0, 0) * x + Ainv(0, 1) * y;
-					yp = Ainv(1, 0) * x + Ainv(1, 1) * y;
-					zp = Ainv(2, 0) * x + Ainv(2, 1) * y;
+					xp = Ainv[0] * x + Ainv[1] * y;
+					yp = Ainv[3] * x + Ainv[4] * y;
+					zp = Ainv[6] * x + Ainv[7] * y;
 
-					if (interpolator == TRILINEAR || r2 < min_r2_nn)
+					if (INTERPOLATOR == TRILINEAR || r2 < min_r2_nn)
 					{
 
 						// Only asymmetric half is stored
@@ -145,20 +570,19 @@ namespace relion
 
 						// Trilinear interpolation (with physical coords)
 						// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-						// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
 						x0 = FLOOR(xp);
 						fx = xp - x0;
-						x1 = x0 + 1;
 
 						y0 = FLOOR(yp);
 						fy = yp - y0;
-						y0 -= STARTINGY(data);
+						y0 -= vol_starty;
 						y1 = y0 + 1;
 
 						z0 = FLOOR(zp);
 						fz = zp - z0;
-						z0 -= STARTINGZ(data);
-						z1 = z0 + 1;
+						z0 -= vol_startz;
+						// 2D references only have a single plane (and fz = 0)
+						z1 = (vol_zdim > 1) ? z0 + 1 : z0;
 
 						mfx = 1. - fx;
 						mfy = 1. - fy;
@@ -176,49 +600,80 @@ namespace relion
 						if (is_neg_x)
 							my_val = conj(my_val);
 
+						// First voxel (x0) of the four rows (z0 or z1, y0 or y1) with neighbours
+						long int idx00 = rowStart<SPARSE>(offsets, z0, y0, vol_xdim, vol_ydim) + x0;
+						long int idx01 = rowStart<SPARSE>(offsets, z0, y1, vol_xdim, vol_ydim) + x0;
+						long int idx10 = rowStart<SPARSE>(offsets, z1, y0, vol_xdim, vol_ydim) + x0;
+						long int idx11 = rowStart<SPARSE>(offsets, z1, y1, vol_xdim, vol_ydim) + x0;
+
+						if (COMPENSATED)
+						{
+							// Compensated summation, one corner at a time
+							const long int idx[8] = { idx00, idx00 + 1, idx01, idx01 + 1, idx10, idx10 + 1, idx11, idx11 + 1 };
+							const DOUBLE dd[8] = { dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111 };
+							for (int c = 0; c < 8; c++)
+							{
+								kahanAdd(mydata[idx[c]], mydata_comp[idx[c]], dd[c] * my_val);
+								kahanAdd(myweight[idx[c]], myweight_comp[idx[c]], dd[c] * my_weight);
+							}
+							continue;
+						}
+
 						// Store slice in 3D weighted sum
-						DIRECT_A3D_ELEM(data, z0, y0, x0) += dd000 * my_val;
-						DIRECT_A3D_ELEM(data, z0, y0, x1) += dd001 * my_val;
-						DIRECT_A3D_ELEM(data, z0, y1, x0) += dd010 * my_val;
-						DIRECT_A3D_ELEM(data, z0, y1, x1) += dd011 * my_val;
-						DIRECT_A3D_ELEM(data, z1, y0, x0) += dd100 * my_val;
-						DIRECT_A3D_ELEM(data, z1, y0, x1) += dd101 * my_val;
-						DIRECT_A3D_ELEM(data, z1, y1, x0) += dd110 * my_val;
-						DIRECT_A3D_ELEM(data, z1, y1, x1) += dd111 * my_val;
+#ifdef FLOAT_PRECISION
+						__m256 __val = _avx_broadcast_complex_4(my_val);
+						addWeightedPairs(mydata + idx00, mydata + idx01, dd000, dd001, dd010, dd011, __val);
+						addWeightedPairs(mydata + idx10, mydata + idx11, dd100, dd101, dd110, dd111, __val);
+#else
+						mydata[idx00] += dd000 * my_val;
+						mydata[idx00 + 1] += dd001 * my_val;
+						mydata[idx01] += dd010 * my_val;
+						mydata[idx01 + 1] += dd011 * my_val;
+						mydata[idx10] += dd100 * my_val;
+						mydata[idx10 + 1] += dd101 * my_val;
+						mydata[idx11] += dd110 * my_val;
+						mydata[idx11 + 1] += dd111 * my_val;
+#endif
 						// Store corresponding weights
-						DIRECT_A3D_ELEM(weight, z0, y0, x0) += dd000 * my_weight;
-						DIRECT_A3D_ELEM(weight, z0, y0, x1) += dd001 * my_weight;
-						DIRECT_A3D_ELEM(weight, z0, y1, x0) += dd010 * my_weight;
-						DIRECT_A3D_ELEM(weight, z0, y1, x1) += dd011 * my_weight;
-						DIRECT_A3D_ELEM(weight, z1, y0, x0) += dd100 * my_weight;
-						DIRECT_A3D_ELEM(weight, z1, y0, x1) += dd101 * my_weight;
-						DIRECT_A3D_ELEM(weight, z1, y1, x0) += dd110 * my_weight;
-						DIRECT_A3D_ELEM(weight, z1, y1, x1) += dd111 * my_weight;
+						myweight[idx00] += dd000 * my_weight;
+						myweight[idx00 + 1] += dd001 * my_weight;
+						myweight[idx01] += dd010 * my_weight;
+						myweight[idx01 + 1] += dd011 * my_weight;
+						myweight[idx10] += dd100 * my_weight;
+						myweight[idx10 + 1] += dd101 * my_weight;
+						myweight[idx11] += dd110 * my_weight;
+						myweight[idx11 + 1] += dd111 * my_weight;
 
 					} // endif TRILINEAR
-					else if (interpolator == NEAREST_NEIGHBOUR)
+					else if (INTERPOLATOR == NEAREST_NEIGHBOUR)
 					{
 
 						x0 = ROUND(xp);
 						y0 = ROUND(yp);
 						z0 = ROUND(zp);
 
+						// Only asymmetric half is stored
 						if (x0 < 0)
 						{
-							A3D_ELEM(data, -z0, -y0, -x0) += conj(my_val);
-							A3D_ELEM(weight, -z0, -y0, -x0) += my_weight;
+							x0 = -x0;
+							y0 = -y0;
+							z0 = -z0;
+							my_val = conj(my_val);
+						}
+						long int idx = rowStart<SPARSE>(offsets, z0 - vol_startz, y0 - vol_starty, vol_xdim, vol_ydim) + x0;
+
+						if (COMPENSATED)
+						{
+							kahanAdd(mydata[idx], mydata_comp[idx], my_val);
+							kahanAdd(myweight[idx], myweight_comp[idx], my_weight);
 						}
 						else
 						{
-							A3D_ELEM(data, z0, y0, x0) += my_val;
-							A3D_ELEM(weight, z0, y0, x0) += my_weight;
+							mydata[idx] += my_val;
+							myweight[idx] += my_weight;
 						}
 
 					} // endif NEAREST_NEIGHBOUR
-					else
-					{
-						REPORT_ERROR("FourierInterpolator::backproject%%ERROR: unrecognized interpolator ");
-					}
 				} // endif weight>0.
 			} // endif x-loop
 		} // endif y-loop
@@ -228,13 +683,7 @@ namespace relion
 		const Matrix2D<DOUBLE> &A, bool inv,
 		const MultidimArray<DOUBLE> *Mweight)
 	{
-		DOUBLE fx, fy, mfx, mfy, xp, yp;
-		int first_x, x0, x1, y0, y1, y, y2, r2;
-		bool is_neg_x;
-		DOUBLE dd00, dd01, dd10, dd11;
-		Complex my_val;
 		Matrix2D<DOUBLE> Ainv;
-		DOUBLE my_weight = 1.;
 
 		// f2d should already be in the right size (ori_size,orihalfdim)
 		// AND the points outside max_r should already be zero...
@@ -263,6 +712,30 @@ namespace relion
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
 
+		switch (interpolator)
+		{
+		case TRILINEAR:
+			backrotate2DRows<TRILINEAR>(f2d, Ainv, Mweight, max_r2, min_r2_nn);
+			break;
+		case NEAREST_NEIGHBOUR:
+			backrotate2DRows<NEAREST_NEIGHBOUR>(f2d, Ainv, Mweight, max_r2, min_r2_nn);
+			break;
+		default:
+			REPORT_ERROR("BackProjector::backrotate2D%%ERROR: unrecognized interpolator ");
+		}
+	}
+
+	template <int INTERPOLATOR>
+	void BackProjector::backrotate2DRows(const MultidimArray<Complex > &f2d, const Matrix2D<DOUBLE> &Ainv,
+		const MultidimArray<DOUBLE> *Mweight, int max_r2, int min_r2_nn)
+	{
+		DOUBLE fx, fy, mfx, mfy, xp, yp;
+		int first_x, x0, x1, y0, y1, y, y2, r2;
+		bool is_neg_x;
+		DOUBLE dd00, dd01, dd10, dd11;
+		Complex my_val;
+		DOUBLE my_weight = 1.;
+
 		for (int i = 0; i < YSIZE(f2d); i++)
 		{
 			// Don't search beyond square with side max_r
@@ -302,7 +775,7 @@ namespace relion
 					xp = Ainv(0, 0) * x + Ainv(0, 1) * y;
 					yp = Ainv(1, 0) * x + Ainv(1, 1) * y;
 
-					if (interpolator == TRILINEAR || r2 < min_r2_nn)
+					if (INTERPOLATOR == TRILINEAR || r2 < min_r2_nn)
 					{
 						// Only asymmetric half is stored
 						if (xp < 0)
@@ -341,10 +814,14 @@ namespace relion
 							my_val = conj(my_val);
 
 						// Store slice in 3D weighted sum
+#ifdef FLOAT_PRECISION
+						addWeightedPairs(&DIRECT_A2D_ELEM(data, y0, x0), &DIRECT_A2D_ELEM(data, y1, x0), dd00, dd01, dd10, dd11, _avx_broadcast_complex_4(my_val));
+#else
 						DIRECT_A2D_ELEM(data, y0, x0) += dd00 * my_val;
 						DIRECT_A2D_ELEM(data, y0, x1) += dd01 * my_val;
 						DIRECT_A2D_ELEM(data, y1, x0) += dd10 * my_val;
 						DIRECT_A2D_ELEM(data, y1, x1) += dd11 * my_val;
+#endif
 
 						// Store corresponding weights
 						DIRECT_A2D_ELEM(weight, y0, x0) += dd00 * my_weight;
@@ -353,7 +830,7 @@ namespace relion
 						DIRECT_A2D_ELEM(weight, y1, x1) += dd11 * my_weight;
 
 					} // endif TRILINEAR
-					else if (interpolator == NEAREST_NEIGHBOUR)
+					else if (INTERPOLATOR == NEAREST_NEIGHBOUR)
 					{
 						x0 = ROUND(xp);
 						y0 = ROUND(yp);
@@ -368,10 +845,6 @@ namespace relion
 							A2D_ELEM(weight, y0, x0) += my_weight;
 						}
 					} // endif NEAREST_NEIGHBOUR
-					else
-					{
-						REPORT_ERROR("FourierInterpolator::backrotate2D%%ERROR: unrecognized interpolator ");
-					}
 				} // endif weight > 0.
 			} // endif x-loop
 		} // endif y-loop
@@ -381,17 +854,14 @@ namespace relion
 		const Matrix2D<DOUBLE> &A, bool inv,
 		const MultidimArray<DOUBLE> *Mweight)
 	{
-		DOUBLE fx, fy, fz, mfx, mfy, mfz, xp, yp, zp;
-		int first_x, x0, x1, y0, y1, z0, z1, y, y2, z, z2, r2;
-		bool is_neg_x;
-		DOUBLE dd000, dd010, dd100, dd110, dd001, dd011, dd101, dd111;
-		Complex my_val;
 		Matrix2D<DOUBLE> Ainv;
-		DOUBLE my_weight = 1.;
 
 		// f3d should already be in the right size (ori_size,orihalfdim)
 		// AND the points outside max_r should already be zero...
 
+		// Rotated volumes fill the whole cube
+		expandToDense();
+
 		// Use the inverse matrix
 		if (inv)
 			Ainv = A;
@@ -416,6 +886,30 @@ namespace relion
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
 
+		switch (interpolator)
+		{
+		case TRILINEAR:
+			backrotate3DRows<TRILINEAR>(f3d, Ainv, Mweight, max_r2, min_r2_nn);
+			break;
+		case NEAREST_NEIGHBOUR:
+			backrotate3DRows<NEAREST_NEIGHBOUR>(f3d, Ainv, Mweight, max_r2, min_r2_nn);
+			break;
+		default:
+			REPORT_ERROR("BackProjector::backrotate3D%%ERROR: unrecognized interpolator ");
+		}
+	}
+
+	template <int INTERPOLATOR>
+	void BackProjector::backrotate3DRows(const MultidimArray<Complex > &f3d, const Matrix2D<DOUBLE> &Ainv,
+		const MultidimArray<DOUBLE> *Mweight, int max_r2, int min_r2_nn)
+	{
+		DOUBLE fx, fy, fz, mfx, mfy, mfz, xp, yp, zp;
+		int first_x, x0, x1, y0, y1, z0, z1, y, y2, z, z2, r2;
+		bool is_neg_x;
+		DOUBLE dd000, dd010, dd100, dd110, dd001, dd011, dd101, dd111;
+		Complex my_val;
+		DOUBLE my_weight = 1.;
+
 		for (int k = 0; k < ZSIZE(f3d); k++)
 		{
 			// Don't search beyond square with side max_r
@@ -472,7 +966,7 @@ namespace relion
 						yp = Ainv(1, 0) * x + Ainv(1, 1) * y + Ainv(1, 2) * z;
 						zp = Ainv(2, 0) * x + Ainv(2, 1) * y + Ainv(2, 2) * z;
 
-						if (interpolator == TRILINEAR || r2 < min_r2_nn)
+						if (INTERPOLATOR == TRILINEAR || r2 < min_r2_nn)
 						{
 							// Only asymmetric half is stored
 							if (xp < 0)
@@ -522,6 +1016,11 @@ namespace relion
 								my_val = conj(my_val);
 
 							// Store slice in 3D weighted sum
+#ifdef FLOAT_PRECISION
+							__m256 __val = _avx_broadcast_complex_4(my_val);
+							addWeightedPairs(&DIRECT_A3D_ELEM(data, z0, y0, x0), &DIRECT_A3D_ELEM(data, z0, y1, x0), dd000, dd001, dd010, dd011, __val);
+							addWeightedPairs(&DIRECT_A3D_ELEM(data, z1, y0, x0), &DIRECT_A3D_ELEM(data, z1, y1, x0), dd100, dd101, dd110, dd111, __val);
+#else
 							DIRECT_A3D_ELEM(data, z0, y0, x0) += dd000 * my_val;
 							DIRECT_A3D_ELEM(data, z0, y0, x1) += dd001 * my_val;
 							DIRECT_A3D_ELEM(data, z0, y1, x0) += dd010 * my_val;
@@ -530,6 +1029,7 @@ namespace relion
 							DIRECT_A3D_ELEM(data, z1, y0, x1) += dd101 * my_val;
 							DIRECT_A3D_ELEM(data, z1, y1, x0) += dd110 * my_val;
 							DIRECT_A3D_ELEM(data, z1, y1, x1) += dd111 * my_val;
+#endif
 							// Store corresponding weights
 							DIRECT_A3D_ELEM(weight, z0, y0, x0) += dd000 * my_weight;
 							DIRECT_A3D_ELEM(weight, z0, y0, x1) += dd001 * my_weight;
@@ -542,7 +1042,7 @@ namespace relion
 
 
 						} // endif TRILINEAR
-						else if (interpolator == NEAREST_NEIGHBOUR)
+						else if (INTERPOLATOR == NEAREST_NEIGHBOUR)
 						{
 							x0 = ROUND(xp);
 							y0 = ROUND(yp);
@@ -560,10 +1060,6 @@ namespace relion
 							}
 
 						} // endif NEAREST_NEIGHBOUR
-						else
-						{
-							REPORT_ERROR("BackProjector::backrotate3D%%ERROR: unrecognized interpolator ");
-						}
 					} // endif weight > 0.
 				} // endif x-loop
 			} // endif y-loop
@@ -574,6 +1070,7 @@ namespace relion
 		int lowres_r_max)
 	{
 
+		expandToDense();
 		int lowres_r2_max = padding_factor * padding_factor * lowres_r_max * lowres_r_max;
 		int lowres_pad_size = 2 * (padding_factor * lowres_r_max + 1) + 1;
 
@@ -581,6 +1078,8 @@ namespace relion
 		if (ref_dim != 3)
 			REPORT_ERROR("BackProjector::getLowResDataAndWeight%%ERROR: only implemented for 3D case....");
 
+		foldCompensation();
+
 		// Check lowres_r_max is not too big
 		if (lowres_r_max > r_max)
 			REPORT_ERROR("BackProjector::getLowResDataAndWeight%%ERROR: lowres_r_max is bigger than r_max");
@@ -611,6 +1110,7 @@ namespace relion
 		int lowres_r_max)
 	{
 
+		expandToDense();
 		int lowres_r2_max = padding_factor * padding_factor * lowres_r_max * lowres_r_max;
 		int lowres_pad_size = 2 * (padding_factor * lowres_r_max + 1) + 1;
 
@@ -618,6 +1118,8 @@ namespace relion
 		if (ref_dim != 3)
 			REPORT_ERROR("BackProjector::getLowResDataAndWeight%%ERROR: only implemented for 3D case....");
 
+		foldCompensation();
+
 		// Check lowres_r_max is not too big
 		if (lowres_r_max > r_max)
 			REPORT_ERROR("BackProjector::getLowResDataAndWeight%%ERROR: lowres_r_max is bigger than r_max");
@@ -647,10 +1149,158 @@ namespace relion
 	}
 
 
+	void BackProjector::getReductionBuffers(std::vector<DOUBLE*> &buffers, std::vector<long int> &sizes, long int max_chunk)
+	{
+		if (max_chunk < 1)
+			REPORT_ERROR("BackProjector::getReductionBuffers%%ERROR: max_chunk should be positive");
+
+		foldCompensation();
+
+		buffers.clear();
+		sizes.clear();
+		DOUBLE *arrays[2];
+		long int array_sizes[2];
+		if (isSparse())
+		{
+			arrays[0] = (DOUBLE*)&sparse_data[0];
+			arrays[1] = &sparse_weight[0];
+			array_sizes[0] = 2 * sparse_data.size();
+			array_sizes[1] = sparse_weight.size();
+		}
+		else
+		{
+			arrays[0] = (DOUBLE*)MULTIDIM_ARRAY(data);
+			arrays[1] = MULTIDIM_ARRAY(weight);
+			array_sizes[0] = 2 * NZYXSIZE(data);
+			array_sizes[1] = NZYXSIZE(weight);
+		}
+		for (int a = 0; a < 2; a++)
+		{
+			for (long int start = 0; start < array_sizes[a]; start += max_chunk)
+			{
+				buffers.push_back(arrays[a] + start);
+				sizes.push_back(XMIPP_MIN(max_chunk, array_sizes[a] - start));
+			}
+		}
+	}
+
+	void BackProjector::getDataShape(long int &zdim, long int &ydim, long int &xdim, long int &startz, long int &starty)
+	{
+		if (isSparse() || NZYXSIZE(data) == 0)
+		{
+			// As set by initialiseData
+			zdim = (ref_dim == 3) ? pad_size : 1;
+			ydim = pad_size;
+			xdim = pad_size / 2 + 1;
+			startz = FIRST_XMIPP_INDEX(zdim);
+			starty = FIRST_XMIPP_INDEX(ydim);
+		}
+		else
+		{
+			zdim = ZSIZE(data);
+			ydim = YSIZE(data);
+			xdim = XSIZE(data);
+			startz = STARTINGZ(data);
+			starty = STARTINGY(data);
+		}
+	}
+
+	void BackProjector::getPackedRowOffsets(std::vector<long int> &offsets)
+	{
+		if (!isSparse() && !weight.sameShape(data))
+			REPORT_ERROR("BackProjector::getPackedRowOffsets%%ERROR: data and weight have different sizes");
+
+		long int zdim, ydim, xdim, startz, starty;
+		getDataShape(zdim, ydim, xdim, startz, starty);
+
+		// Slices are inserted up to radius padding_factor * r_max; their trilinear neighbours lie up to sqrt(3) further out
+		int max_r = padding_factor * r_max + 2;
+		int max_r2 = max_r * max_r;
+		offsets.resize(zdim * ydim + 1);
+		offsets[0] = 0;
+		long int r = 0;
+		for (long int k = startz; k < startz + zdim; k++)
+		{
+			for (long int i = starty; i < starty + ydim; i++, r++)
+				offsets[r + 1] = offsets[r] + getRowLength(xdim - 1, max_r2 - k * k - i * i);
+		}
+	}
+
+	long int BackProjector::getPackedSize()
+	{
+		std::vector<long int> offsets;
+		getPackedRowOffsets(offsets);
+		// Real and imaginary part of data, and weight
+		return 3 * offsets.back();
+	}
+
+	void BackProjector::packDataAndWeight(DOUBLE *buf, int nr_threads)
+	{
+		foldCompensation();
+
+		std::vector<long int> offsets;
+		getPackedRowOffsets(offsets);
+		long int nr_rows = offsets.size() - 1;
+		bool is_sparse = isSparse();
+		long int xdim = XSIZE(data);
+
+		// Each row is stored as its data followed by its weights
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			long int nx = offsets[r + 1] - offsets[r];
+			DOUBLE *out = buf + 3 * offsets[r];
+			const Complex *data_row = (is_sparse) ? &sparse_data[0] + offsets[r] : MULTIDIM_ARRAY(data) + r * xdim;
+			const DOUBLE *weight_row = (is_sparse) ? &sparse_weight[0] + offsets[r] : MULTIDIM_ARRAY(weight) + r * xdim;
+			memcpy(out, data_row, nx * sizeof(Complex));
+			memcpy(out + 2 * nx, weight_row, nx * sizeof(DOUBLE));
+		}
+	}
+
+	void BackProjector::unpackDataAndWeight(const DOUBLE *buf, bool do_add, int nr_threads)
+	{
+		foldCompensation();
+
+		std::vector<long int> offsets;
+		getPackedRowOffsets(offsets);
+		long int nr_rows = offsets.size() - 1;
+		bool is_sparse = isSparse();
+		long int xdim = XSIZE(data);
+
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			long int nx = offsets[r + 1] - offsets[r];
+			const DOUBLE *in = buf + 3 * offsets[r];
+			DOUBLE *data_row = (DOUBLE*)((is_sparse) ? &sparse_data[0] + offsets[r] : MULTIDIM_ARRAY(data) + r * xdim);
+			DOUBLE *weight_row = (is_sparse) ? &sparse_weight[0] + offsets[r] : MULTIDIM_ARRAY(weight) + r * xdim;
+			if (do_add)
+			{
+				for (long int x = 0; x < 2 * nx; x++)
+					data_row[x] += in[x];
+				for (long int x = 0; x < nx; x++)
+					weight_row[x] += in[2 * nx + x];
+			}
+			else
+			{
+				memcpy(data_row, in, 2 * nx * sizeof(DOUBLE));
+				memcpy(weight_row, in + 2 * nx, nx * sizeof(DOUBLE));
+				if (!is_sparse)
+				{
+					memset(data_row + 2 * nx, 0, 2 * (xdim - nx) * sizeof(DOUBLE));
+					memset(weight_row + nx, 0, (xdim - nx) * sizeof(DOUBLE));
+				}
+			}
+		}
+	}
+
 	void BackProjector::getDownsampledAverage(MultidimArray<Complex > &avg)
 	{
 		MultidimArray<DOUBLE> down_weight;
 
+		expandToDense();
+		foldCompensation();
+
 		// Pre-set down_data and down_weight sizes
 		int down_size = 2 * (r_max + 1) + 1;
 		int r2_max = r_max * r_max;
@@ -700,7 +1350,11 @@ namespace relion
 		// enforceHermitianSymmetry(avg, down_weight);
 
 		// And enforce symmetry in the downsampled arrays
+#ifdef _OPENMP
+		symmetrise(avg, down_weight, r2_max, getTaskNrThreads(omp_get_max_threads()));
+#else
 		symmetrise(avg, down_weight, r2_max);
+#endif
 
 		// Calculate the straightforward average in the downsampled arrays
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(avg)
@@ -722,32 +1376,10 @@ namespace relion
 		if (!avg1.sameShape(avg2))
 			REPORT_ERROR("ERROR BackProjector::calculateDownSampledFourierShellCorrelation: two arrays have different sizes");
 
-		MultidimArray<DOUBLE> num, den1, den2;
-		num.initZeros(ori_size / 2 + 1);
-		den1.initZeros(num);
-		den2.initZeros(num);
-		fsc.initZeros(num);
-
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(avg1)
-		{
-			DOUBLE R = sqrt(k*k + i * i + j * j);
-			if (R > r_max)
-				continue;
-			int idx = ROUND(R);
-			Complex z1 = A3D_ELEM(avg1, k, i, j);
-			Complex z2 = A3D_ELEM(avg2, k, i, j);
-			DOUBLE absz1 = abs(z1);
-			DOUBLE absz2 = abs(z2);
-			num(idx) += (conj(z1) * z2).real;
-			den1(idx) += absz1 * absz1;
-			den2(idx) += absz2 * absz2;
-		}
-
-		FOR_ALL_ELEMENTS_IN_ARRAY1D(fsc)
-		{
-			if (den1(i)*den2(i) > 0.)
-				fsc(i) = num(i) / sqrt(den1(i)*den2(i));
-		}
+		ShellSums sums;
+		sums.compute(*ShellIndexMap::get(avg1, ShellIndexMap::LOGICAL_LAYOUT, ori_size / 2 + 1, (long int)r_max * r_max + 1),
+			avg1, &avg2);
+		sums.getFSC(fsc);
 
 		// Always set zero-resolution shell to FSC=1
 		// Raimond Ravelli reported a problem with FSC=1 at res=0 on 13feb2013...
@@ -769,15 +1401,25 @@ namespace relion
 		bool update_tau2_with_fsc,
 		bool is_whole_instead_of_half,
 		int nr_threads,
-		int minres_map)
+		int minres_map,
+		DOUBLE preweight_tolerance)
 
 	{
+		INSTRUMENT_TIMER(TIMER_RECONSTRUCT);
+		nr_threads = getTaskNrThreads(nr_threads);
 
+		// Re-use the same-sized temporaries of the iterations below (e.g. Mconv in convoluteBlobRealSpace)
+		// rather than allocating them again every time. Declared first, so it ends after all other arrays have been freed
+		MemoryPoolScope memory_pool;
 
-		Image<float> debug_Fnewweight;
-		debug_Fnewweight().resize(weight);
-
+		// Make sure the accurate sums are in data and weight, and that these are dense.
+		// At the x=0 line, we have collected either the positive y-z coordinate, or its negative Friedel pair.
+		// Sum these two together for both the data and the weight arrays (in the same pass, see enforceHermitianSymmetry)
+		expandToDense();
+		foldCompensation(nr_threads, true);
 
+		// Everything below is a temporary of the reconstruction (vol_out is re-allocated as well)
+		MemoryCategoryScope memory_category(MEMORY_RECONSTRUCT);
 		FourierTransformer transformer;
 		// The threads are giving me a headache. Let's switch them off
 		// Somehow I get lots of bad/non-reproducible errors when having these...
@@ -794,25 +1436,14 @@ namespace relion
 		Image<DOUBLE> ttt;
 		FileName fnttt;
 		ttt() = weight;
-		ttt.write("reconstruct_initial_weight.spi");
+		ttt.write("reconstruct_hermitian_weight.spi");
 #endif
 
 		//gtom::WriteMRC(weight.data, gtom::toInt3(XSIZE(weight), YSIZE(weight), ZSIZE(weight)), "d_weight.mrc");
 
-		// At the x=0 line, we have collected either the positive y-z coordinate, or its negative Friedel pair.
-		// Sum these two together for both the data and the weight arrays
-		enforceHermitianSymmetry(data, weight);
-
-		//gtom::WriteMRC(weight.data, gtom::toInt3(XSIZE(weight), YSIZE(weight), ZSIZE(weight)), "d_weight.mrc");
-
-#ifdef DEBUG_RECONSTRUCT
-		ttt() = weight;
-		ttt.write("reconstruct_hermitian_weight.spi");
-#endif
-
 		// First enforce Hermitian symmetry, then symmetry!
 		// This way the redundancy at the x=0 plane is handled correctly
-		symmetrise(data, weight, max_r2);
+		symmetrise(data, weight, max_r2, nr_threads);
 #ifdef DEBUG_RECONSTRUCT
 		ttt() = weight;
 		ttt.write("reconstruct_symmetrised_weight.spi");
@@ -843,7 +1474,7 @@ namespace relion
 
 
 		// Go from projector-centered to FFTW-uncentered
-		decenter_ff(weight, Fweight, max_r2);
+		decenter(weight, Fweight, max_r2, 1., nr_threads);
 
 		//gtom::WriteMRC(Fweight.data, gtom::toInt3(XSIZE(Fweight), YSIZE(Fweight), ZSIZE(Fweight)), "d_Fweight.mrc");
 
@@ -856,15 +1487,19 @@ namespace relion
 		// This is the left-hand side term in the nominator of the Wiener-filter-like update formula
 		// and it is stored inside the weight vector
 		// Then, if (do_map) add the inverse of tau2-spectrum values to the weight
+		// The shell (at the original size) of every element inside max_r2 is only calculated once per reconstruction
+		std::shared_ptr<const ShellIndexMap> shell_map = ShellIndexMap::get(Fconv, ShellIndexMap::FFTW_LAYOUT, ori_size / 2 + 1,
+			max_r2, padding_factor);
+		const short *shell = MULTIDIM_ARRAY(shell_map->shell);
+
 		sigma2.initZeros(ori_size / 2 + 1);
 		counter.initZeros(ori_size / 2 + 1);
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
 		{
-			int r2 = kp * kp + ip * ip + jp * jp;
-			if (r2 < max_r2)
+			int ires = shell[n];
+			if (ires >= 0)
 			{
-				int ires = ROUND(sqrt((DOUBLE)r2) / padding_factor);
-				DOUBLE invw = oversampling_correction * DIRECT_A3D_ELEM(Fweight, k, i, j);
+				DOUBLE invw = oversampling_correction * DIRECT_MULTIDIM_ELEM(Fweight, n);
 				DIRECT_A1D_ELEM(sigma2, ires) += invw;
 				DIRECT_A1D_ELEM(counter, ires) += 1.;
 			}
@@ -925,13 +1560,12 @@ namespace relion
 			if (!update_tau2_with_fsc)
 				data_vs_prior.initZeros(ori_size / 2 + 1);
 			counter.initZeros(ori_size / 2 + 1);
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
 			{
-				int r2 = kp * kp + ip * ip + jp * jp;
-				if (r2 < max_r2)
+				int ires = shell[n];
+				if (ires >= 0)
 				{
-					int ires = ROUND(sqrt((DOUBLE)r2) / padding_factor);
-					DOUBLE invw = DIRECT_A3D_ELEM(Fweight, k, i, j);
+					DOUBLE invw = DIRECT_MULTIDIM_ELEM(Fweight, n);
 
 					DOUBLE invtau2;
 					if (DIRECT_A1D_ELEM(tau2, ires) > 0.)
@@ -963,7 +1597,7 @@ namespace relion
 						// Now add the inverse-of-tau2_class term
 						invw += invtau2;
 						// Store the new weight again in Fweight
-						DIRECT_A3D_ELEM(Fweight, k, i, j) = invw;
+						DIRECT_MULTIDIM_ELEM(Fweight, n) = invw;
 					}
 				}
 			}
@@ -985,101 +1619,98 @@ namespace relion
 		} //end if do_map
 
 		// Divide both data and Fweight by normalisation factor to prevent FFT's with very large values....
+		// This is done on the fly in the passes below that read them, rather than in passes of their own
 #ifdef DEBUG_RECONSTRUCT
 		std::cerr << " normalise= " << normalise << std::endl;
 #endif
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fweight)
-		{
-			DIRECT_MULTIDIM_ELEM(Fweight, n) /= normalise;
-		}
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data)
-		{
-			DIRECT_MULTIDIM_ELEM(data, n) /= normalise;
-		}
+		DOUBLE inv_normalise = 1. / normalise;
 
 		// Initialise Fnewweight with 1's and 0's. (also see comments below)
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(weight)
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = 0; k < ZSIZE(Fnewweight); k++)
 		{
-			if (k * k + i * i + j * j < max_r2)
-				A3D_ELEM(weight, k, i, j) = 1.;
-			else
-				A3D_ELEM(weight, k, i, j) = 0.;
+			long int kp = (k < XSIZE(Fnewweight)) ? k : k - ZSIZE(Fnewweight);
+			for (long int i = 0; i < YSIZE(Fnewweight); i++)
+			{
+				long int ip = (i < XSIZE(Fnewweight)) ? i : i - YSIZE(Fnewweight);
+				for (long int j = 0; j < XSIZE(Fnewweight); j++)
+					DIRECT_A3D_ELEM(Fnewweight, k, i, j) = (kp * kp + ip * ip + j * j < max_r2) ? 1. : 0.;
+			}
 		}
-		//decenter_ff(weight, Fnewweight, max_r2);
-		decenter_ff(weight, Fnewweight, max_r2);
 		//gtom::WriteMRC(Fnewweight.data, gtom::toInt3(XSIZE(Fnewweight), YSIZE(Fnewweight), ZSIZE(Fnewweight)), "d_Fnewweight.mrc");
 
 		// Iterative algorithm as in  Eq. [14] in Pipe & Menon (1999)
 		// or Eq. (4) in Matej (2001)
-		if (false)
-		for (int iter = 0; iter < max_iter_preweight; iter++)
+		// Without iterations, the data are divided by Fweight itself below
+		bool do_preweight = (max_iter_preweight > 0);
+		if (do_preweight)
 		{
-			//gtom::WriteMRC(Fnewweight.data, gtom::toInt3(XSIZE(Fnewweight), YSIZE(Fnewweight), ZSIZE(Fnewweight)), "d_Fnewweight_pre.mrc");
-			
+			INSTRUMENT_TIMER(TIMER_RECONSTRUCT_GRIDDING);
+
 			// Set Fnewweight * Fweight in the transformer
 			// In Matej et al (2001), weights w_P^i are convoluted with the kernel,
 			// and the initial w_P^0 are 1 at each sampling point
 			// Here the initial weights are also 1 (see initialisation Fnewweight above),
 			// but each "sampling point" counts "Fweight" times!
 			// That is why Fnewweight is multiplied by Fweight prior to the convolution
-//#pragma omp parallel for
+			// (for the following iterations, this is done in the same sweep as the weight update below)
+#pragma omp parallel for num_threads(nr_threads)
 			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
 			{
-				DIRECT_MULTIDIM_ELEM(Fconv, n) = DIRECT_MULTIDIM_ELEM(Fnewweight, n) * DIRECT_MULTIDIM_ELEM(Fweight, n);
+				DIRECT_MULTIDIM_ELEM(Fconv, n) = DIRECT_MULTIDIM_ELEM(Fnewweight, n) * DIRECT_MULTIDIM_ELEM(Fweight, n) * inv_normalise;
 			}
 
-			// convolute through Fourier-transform (as both grids are rectangular)
-			// Note that convoluteRealSpace acts on the complex array inside the transformer
-			convoluteBlobRealSpace(transformer);
+			// Largest relative change of Fnewweight in each z-slice
+			std::vector<DOUBLE> slice_change(ZSIZE(Fconv));
 
-//#pragma omp parallel for
-			for (long int k = 0; k < ZSIZE(Fconv); k++)
+			for (int iter = 0; iter < max_iter_preweight; iter++)
 			{
-				long int kp = (k < XSIZE(Fconv)) ? k : k - ZSIZE(Fconv);
+				// convolute through Fourier-transform (as both grids are rectangular)
+				// Note that convoluteRealSpace acts on the complex array inside the transformer
+				convoluteBlobRealSpace(transformer);
 
-				for (long int i = 0, ip = 0; i < YSIZE(Fconv); i++, ip = (i < XSIZE(Fconv)) ? i : i - YSIZE(Fconv)) \
-					for (long int j = 0, jp = 0; j < XSIZE(Fconv); j++, jp = j)
-					{
-						if (kp * kp + ip * ip + jp * jp < max_r2)
+#pragma omp parallel for num_threads(nr_threads)
+				for (long int k = 0; k < ZSIZE(Fconv); k++)
+				{
+					long int kp = (k < XSIZE(Fconv)) ? k : k - ZSIZE(Fconv);
+					DOUBLE my_change = 0.;
+
+					for (long int i = 0, ip = 0; i < YSIZE(Fconv); i++, ip = (i < XSIZE(Fconv)) ? i : i - YSIZE(Fconv))
+						for (long int j = 0, jp = 0; j < XSIZE(Fconv); j++, jp = j)
 						{
-							// Make sure no division by zero can occur....
-							DOUBLE w = XMIPP_MAX(1e-6, abs(DIRECT_A3D_ELEM(Fconv, k, i, j)));
-							// Apply division of Eq. [14] in Pipe & Menon (1999)
-							DIRECT_A3D_ELEM(Fnewweight, k, i, j) /= w;
+							if (kp * kp + ip * ip + jp * jp < max_r2)
+							{
+								// Make sure no division by zero can occur....
+								DOUBLE w = XMIPP_MAX(1e-6, abs(DIRECT_A3D_ELEM(Fconv, k, i, j)));
+								// Apply division of Eq. [14] in Pipe & Menon (1999)
+								DIRECT_A3D_ELEM(Fnewweight, k, i, j) /= w;
+								my_change = XMIPP_MAX(my_change, ABS(1. / w - 1.));
+							}
+							// Fnewweight * Fweight for the convolution in the next iteration
+							DIRECT_A3D_ELEM(Fconv, k, i, j) = DIRECT_A3D_ELEM(Fnewweight, k, i, j) * DIRECT_A3D_ELEM(Fweight, k, i, j) * inv_normalise;
 						}
-					}
-			}
 
-			//gtom::WriteMRC(Fnewweight.data, gtom::toInt3(XSIZE(Fnewweight), YSIZE(Fnewweight), ZSIZE(Fnewweight)), "d_Fnewweight_post.mrc");
-		}
-
-		// Clear memory
-
-		// Note that Fnewweight now holds the approximation of the inverse of the weights on a regular grid
+					slice_change[k] = my_change;
+				}
 
-		// Now do the actual reconstruction with the data array
-		// Apply the iteratively determined weight
-		Fconv.initZeros(); // to remove any stuff from the input volume
-		decenter_cc(data, Fconv, max_r2);
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
-		{
-#ifdef  FLOAT_PRECISION
-			// Prevent numerical instabilities in single-precision reconstruction with very unevenly sampled orientations
-			if (DIRECT_MULTIDIM_ELEM(Fnewweight, n) > 1e20)
-				DIRECT_MULTIDIM_ELEM(Fnewweight, n) = 1e20;
+				// Stop early if the weights no longer change
+				if (preweight_tolerance > 0.)
+				{
+					DOUBLE max_change = 0.;
+					for (long int k = 0; k < ZSIZE(Fconv); k++)
+						max_change = XMIPP_MAX(max_change, slice_change[k]);
+#ifdef DEBUG_RECONSTRUCT
+					std::cerr << " iter= " << iter << " max_change= " << max_change << std::endl;
 #endif
-			if (ABS(DIRECT_MULTIDIM_ELEM(Fweight, n)) > 1e-3)
-			{
-				DIRECT_MULTIDIM_ELEM(Fconv, n) *= 1 / DIRECT_MULTIDIM_ELEM(Fweight, n);
-				DIRECT_MULTIDIM_ELEM(Fweight, n) *= 1 / DIRECT_MULTIDIM_ELEM(Fweight, n);
+					if (max_change < preweight_tolerance)
+						break;
+				}
 			}
 		}
 
-		//gtom::WriteMRC(Fweight.data, gtom::toInt3(XSIZE(Fweight), YSIZE(Fweight), ZSIZE(Fweight)), "d_Fweight.mrc");
-
-		// Clear memory
-		Fweight.clear();
-		Fnewweight.clear();
+		// Note that Fnewweight now holds the approximation of the inverse of the weights on a regular grid
+		if (!do_preweight)
+			Fnewweight.clear();
 
 		// rather than doing the blob-convolution to downsample the data array, do a windowing operation:
 		// This is the same as convolution with a SINC. It seems to give better maps.
@@ -1091,10 +1722,56 @@ namespace relion
 		//	std::cout << " r= " << r << " sinc= " << sinc << " blob= " << blob_val(r, blob) << std::endl;
 		//}
 
-		// Now do inverse FFT and window to original size in real-space
-		// Pass the transformer to prevent making and clearing a new one before clearing the one declared above....
-		// The latter may give memory problems as detected by electric fence....
-		windowToOridimRealSpace(transformer, Fconv, vol_out, nr_threads);
+		// Now do the actual reconstruction with the data array
+		// Normalise, apply the iteratively determined weight (or divide by the weight) and go from projector-centered
+		// to FFTW-uncentered in a single pass, which writes straight into the transformer at the padded original size
+		// (i.e. also does the windowing in Fourier space)
+		{
+			INSTRUMENT_TIMER(TIMER_RECONSTRUCT_WINDOW);
+			setOridimFourierTransform(transformer, vol_out, Fconv);
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int k = 0; k < ZSIZE(Fconv); k++)
+			{
+				long int kp = (k < XSIZE(Fconv)) ? k : k - ZSIZE(Fconv);
+				long int kw = (kp < 0) ? kp + ZSIZE(Fweight) : kp;
+				for (long int i = 0; i < YSIZE(Fconv); i++)
+				{
+					long int ip = (i < XSIZE(Fconv)) ? i : i - YSIZE(Fconv);
+					long int iw = (ip < 0) ? ip + YSIZE(Fweight) : ip;
+					Complex *out = &DIRECT_A3D_ELEM(Fconv, k, i, 0);
+					for (long int j = 0; j < XSIZE(Fconv); j++)
+					{
+						if (kp * kp + ip * ip + j * j <= max_r2)
+						{
+							Complex val = A3D_ELEM(data, kp, ip, j) * inv_normalise;
+							if (do_preweight)
+							{
+								// Prevent numerical instabilities in single-precision reconstruction with very unevenly sampled orientations
+								val *= XMIPP_MIN((DOUBLE)1e20, (DOUBLE)DIRECT_A3D_ELEM(Fnewweight, kw, iw, j));
+							}
+							else
+							{
+								DOUBLE w = DIRECT_A3D_ELEM(Fweight, kw, iw, j) * inv_normalise;
+								if (ABS(w) > 1e-3)
+									val *= 1 / w;
+							}
+							out[j] = val;
+						}
+						else
+							out[j] = Complex(0., 0.);
+					}
+				}
+			}
+
+			// Clear memory
+			Fweight.clear();
+			Fnewweight.clear();
+
+			// Now do inverse FFT and window to original size in real-space
+			// Use the same transformer to prevent making and clearing a new one before clearing the one declared above....
+			// The latter may give memory problems as detected by electric fence....
+			oridimFourierToRealSpace(transformer, vol_out);
+		}
 
 		// Correct for the linear/nearest-neighbour interpolation that led to the data array
 		griddingCorrect(vol_out);
@@ -1104,21 +1781,16 @@ namespace relion
 		{
 
 			// New tau2 will be the power spectrum of the new map
-			MultidimArray<DOUBLE> spectrum, count;
+			MultidimArray<DOUBLE> spectrum;
 
 			// Calculate this map's power spectrum
 			// Don't call getSpectrum() because we want to use the same transformer object to prevent memory trouble....
-			spectrum.initZeros(XSIZE(vol_out));
-			count.initZeros(XSIZE(vol_out));
 			// recycle the same transformer for all images
 			transformer.FourierTransform(vol_out, Fconv, false);
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
-			{
-				long int idx = ROUND(sqrt(kp*kp + ip * ip + jp * jp));
-				spectrum(idx) += norm(dAkij(Fconv, k, i, j));
-				count(idx) += 1.;
-			}
-			spectrum /= count;
+			ShellSums sums;
+			sums.compute(*ShellIndexMap::get(Fconv, ShellIndexMap::FFTW_LAYOUT, XSIZE(vol_out)), Fconv, NULL, false, nr_threads);
+			spectrum = sums.sum_norm1;
+			spectrum /= sums.count;
 
 			// Factor two because of two-dimensionality of the complex plane
 			// (just like sigma2_noise estimates, the power spectra should be divided by 2)
@@ -1135,33 +1807,24 @@ namespace relion
 
 		// Completely empty the transformer object
 		//transformer.cleanup();
+
+		// The shell maps of this size are not needed again until the next reconstruction
+		ShellIndexMap::clearCache();
 	}
 
 	void BackProjector::enforceHermitianSymmetry(MultidimArray<Complex > &my_data,
-		MultidimArray<DOUBLE> &my_weight)
+		MultidimArray<DOUBLE> &my_weight, int nr_threads)
 	{
-
-		for (int iz = STARTINGZ(my_data); iz <= FINISHINGZ(my_data); iz++)
-		{
-			// Make sure all points are only included once.
-			int starty = (iz < 0) ? 0 : 1;
-			for (int iy = starty; iy <= FINISHINGY(my_data); iy++)
-			{
-				// I just need to sum the two points, not divide by 2!
-				Complex fsum = (A3D_ELEM(my_data, iz, iy, 0) + conj(A3D_ELEM(my_data, -iz, -iy, 0)));
-				A3D_ELEM(my_data, iz, iy, 0) = fsum;
-				A3D_ELEM(my_data, -iz, -iy, 0) = conj(fsum);
-				DOUBLE sum = (A3D_ELEM(my_weight, iz, iy, 0) + A3D_ELEM(my_weight, -iz, -iy, 0));
-				A3D_ELEM(my_weight, iz, iy, 0) = sum;
-				A3D_ELEM(my_weight, -iz, -iy, 0) = sum;
-			}
-		}
-
+		// Each pair of planes iz and -iz is done by a single thread
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int iz = -FINISHINGZ(my_data); iz <= 0; iz++)
+			enforceHermitianSymmetryPlanes(my_data, my_weight, iz);
 	}
 
 	void BackProjector::symmetrise(MultidimArray<Complex > &my_data,
-		MultidimArray<DOUBLE> &my_weight, int my_rmax2)
+		MultidimArray<DOUBLE> &my_weight, int my_rmax2, int nr_threads)
 	{
+		INSTRUMENT_TIMER(TIMER_RECONSTRUCT_SYMMETRISE);
 
 		//#define DEBUG_SYMM
 #ifdef DEBUG_SYMM
@@ -1169,142 +1832,156 @@ namespace relion
 		std::cerr << " SL.true_symNo= " << SL.true_symNo << std::endl;
 #endif
 
-		if (SL.SymsNo() > 0 && ref_dim == 3)
+		if (SL.SymsNo() > 0 && ref_dim == 3 && !do_symmetrise_on_insertion)
 		{
-			Matrix2D<DOUBLE> L(4, 4), R(4, 4); // A matrix from the list
 			MultidimArray<DOUBLE> sum_weight;
 			MultidimArray<Complex > sum_data;
 
-			// First symmetry operator (not stored in SL) is the identity matrix
-			sum_weight = my_weight;
-			sum_data = my_data;
-			// Loop over all other symmetry operators
+			// All operators but the identity, row-major one after the other
+			std::vector<DOUBLE> Rs;
+			getSymmetryMatrices(Rs);
+#ifdef DEBUG_SYMM
 			for (int isym = 0; isym < SL.SymsNo(); isym++)
 			{
-				SL.get_matrices(isym, L, R);
-#ifdef DEBUG_SYMM
-				std::cerr << " isym= " << isym << " R= " << R << std::endl;
+				std::cerr << " isym= " << isym << " R=";
+				for (int n = 0; n < 9; n++)
+					std::cerr << " " << Rs[9 * isym + n];
+				std::cerr << std::endl;
+			}
 #endif
 
-				// Loop over all points in the output (i.e. rotated, or summed) array
-#pragma omp parallel for
-				for (long int k = STARTINGZ(sum_weight); k <= FINISHINGZ(sum_weight); k++)
+			// First symmetry operator (not stored in SL) is the identity matrix
+			sum_weight = my_weight;
+			sum_data = my_data;
+
+			// Loop over all points in the output (i.e. rotated, or summed) array, and sum all other symmetry operators for each of them,
+			// so that sum_data and sum_weight are only read and written once, rather than once per operator
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int k = STARTINGZ(sum_weight); k <= FINISHINGZ(sum_weight); k++)
+			{
+				DOUBLE x, y, z, fx, fy, fz, xp, yp, zp, r2;
+				bool is_neg_x;
+				int x0, x1, y0, y1, z0, z1;
+				Complex d000, d001, d010, d011, d100, d101, d110, d111;
+				Complex dx00, dx01, dx10, dx11, dxy0, dxy1;
+				DOUBLE dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
+				DOUBLE ddx00, ddx01, ddx10, ddx11, ddxy0, ddxy1;
+
+				for (long int i = STARTINGY(sum_weight); i <= FINISHINGY(sum_weight); i++)
 				{
-					DOUBLE x, y, z, fx, fy, fz, xp, yp, zp, r2;
-					bool is_neg_x;
-					int x0, x1, y0, y1, z0, z1;
-					Complex d000, d001, d010, d011, d100, d101, d110, d111;
-					Complex dx00, dx01, dx10, dx11, dxy0, dxy1;
-					DOUBLE dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
-					DOUBLE ddx00, ddx01, ddx10, ddx11, ddxy0, ddxy1;
-
-					for (long int i = STARTINGY(sum_weight); i <= FINISHINGY(sum_weight); i++)
+					for (long int j = STARTINGX(sum_weight); j <= FINISHINGX(sum_weight); j++)
 					{
-						for (long int j = STARTINGX(sum_weight); j <= FINISHINGX(sum_weight); j++)
+
+						x = (DOUBLE)j; // STARTINGX(sum_weight) is zero!
+						y = (DOUBLE)i;
+						z = (DOUBLE)k;
+						r2 = x * x + y * y + z * z;
+						if (r2 > my_rmax2)
+							continue;
+
+						Complex fsum = A3D_ELEM(sum_data, k, i, j);
+						DOUBLE wsum = A3D_ELEM(sum_weight, k, i, j);
+						for (int isym = 0; isym < SL.SymsNo(); isym++)
 						{
+							const DOUBLE *R = &Rs[9 * isym];
+
+							// coords_output(x,y) = A * coords_input (xp,yp)
+							xp = x * R[0] + y * R[1] + z * R[2];
+							yp = x * R[3] + y * R[4] + z * R[5];
+							zp = x * R[6] + y * R[7] + z * R[8];
 
-							x = (DOUBLE)j; // STARTINGX(sum_weight) is zero!
-							y = (DOUBLE)i;
-							z = (DOUBLE)k;
-							r2 = x * x + y * y + z * z;
-							if (r2 <= my_rmax2)
+							// Only asymmetric half is stored
+							if (xp < 0)
 							{
-								// coords_output(x,y) = A * coords_input (xp,yp)
-								xp = x * R(0, 0) + y * R(0, 1) + z * R(0, 2);
-								yp = x * R(1, 0) + y * R(1, 1) + z * R(1, 2);
-								zp = x * R(2, 0) + y * R(2, 1) + z * R(2, 2);
-
-								// Only asymmetric half is stored
-								if (xp < 0)
-								{
-									// Get complex conjugated hermitian symmetry pair
-									xp = -xp;
-									yp = -yp;
-									zp = -zp;
-									is_neg_x = true;
-								}
-								else
-								{
-									is_neg_x = false;
-								}
-
-								// Trilinear interpolation (with physical coords)
-								// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-								// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-								x0 = FLOOR(xp);
-								fx = xp - x0;
-								x1 = x0 + 1;
-
-								y0 = FLOOR(yp);
-								fy = yp - y0;
-								y0 -= STARTINGY(my_data);
-								y1 = y0 + 1;
-
-								z0 = FLOOR(zp);
-								fz = zp - z0;
-								z0 -= STARTINGZ(my_data);
-								z1 = z0 + 1;
+								// Get complex conjugated hermitian symmetry pair
+								xp = -xp;
+								yp = -yp;
+								zp = -zp;
+								is_neg_x = true;
+							}
+							else
+							{
+								is_neg_x = false;
+							}
+
+							// Trilinear interpolation (with physical coords)
+							// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
+							// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
+							x0 = FLOOR(xp);
+							fx = xp - x0;
+							x1 = x0 + 1;
+
+							y0 = FLOOR(yp);
+							fy = yp - y0;
+							y0 -= STARTINGY(my_data);
+							y1 = y0 + 1;
+
+							z0 = FLOOR(zp);
+							fz = zp - z0;
+							z0 -= STARTINGZ(my_data);
+							z1 = z0 + 1;
 
 #ifdef CHECK_SIZE
-								if (x0 < 0 || y0 < 0 || z0 < 0 ||
-									x1 < 0 || y1 < 0 || z1 < 0 ||
-									x0 >= XSIZE(my_data) || y0 >= YSIZE(my_data) || z0 >= ZSIZE(my_data) ||
-									x1 >= XSIZE(my_data) || y1 >= YSIZE(my_data) || z1 >= ZSIZE(my_data))
-								{
-									std::cerr << " x0= " << x0 << " y0= " << y0 << " z0= " << z0 << std::endl;
-									std::cerr << " x1= " << x1 << " y1= " << y1 << " z1= " << z1 << std::endl;
-									my_data.printShape();
-									REPORT_ERROR("BackProjector::symmetrise: checksize!!!");
-								}
+							if (x0 < 0 || y0 < 0 || z0 < 0 ||
+								x1 < 0 || y1 < 0 || z1 < 0 ||
+								x0 >= XSIZE(my_data) || y0 >= YSIZE(my_data) || z0 >= ZSIZE(my_data) ||
+								x1 >= XSIZE(my_data) || y1 >= YSIZE(my_data) || z1 >= ZSIZE(my_data))
+							{
+								std::cerr << " x0= " << x0 << " y0= " << y0 << " z0= " << z0 << std::endl;
+								std::cerr << " x1= " << x1 << " y1= " << y1 << " z1= " << z1 << std::endl;
+								my_data.printShape();
+								REPORT_ERROR("BackProjector::symmetrise: checksize!!!");
+							}
 #endif
-								// First interpolate (complex) data
-								d000 = DIRECT_A3D_ELEM(my_data, z0, y0, x0);
-								d001 = DIRECT_A3D_ELEM(my_data, z0, y0, x1);
-								d010 = DIRECT_A3D_ELEM(my_data, z0, y1, x0);
-								d011 = DIRECT_A3D_ELEM(my_data, z0, y1, x1);
-								d100 = DIRECT_A3D_ELEM(my_data, z1, y0, x0);
-								d101 = DIRECT_A3D_ELEM(my_data, z1, y0, x1);
-								d110 = DIRECT_A3D_ELEM(my_data, z1, y1, x0);
-								d111 = DIRECT_A3D_ELEM(my_data, z1, y1, x1);
-
-								dx00 = LIN_INTERP(fx, d000, d001);
-								dx01 = LIN_INTERP(fx, d100, d101);
-								dx10 = LIN_INTERP(fx, d010, d011);
-								dx11 = LIN_INTERP(fx, d110, d111);
-								dxy0 = LIN_INTERP(fy, dx00, dx10);
-								dxy1 = LIN_INTERP(fy, dx01, dx11);
-
-								// Take complex conjugated for half with negative x
-								if (is_neg_x)
-									A3D_ELEM(sum_data, k, i, j) += conj(LIN_INTERP(fz, dxy0, dxy1));
-								else
-									A3D_ELEM(sum_data, k, i, j) += LIN_INTERP(fz, dxy0, dxy1);
-
-								// Then interpolate (real) weight
-								dd000 = DIRECT_A3D_ELEM(my_weight, z0, y0, x0);
-								dd001 = DIRECT_A3D_ELEM(my_weight, z0, y0, x1);
-								dd010 = DIRECT_A3D_ELEM(my_weight, z0, y1, x0);
-								dd011 = DIRECT_A3D_ELEM(my_weight, z0, y1, x1);
-								dd100 = DIRECT_A3D_ELEM(my_weight, z1, y0, x0);
-								dd101 = DIRECT_A3D_ELEM(my_weight, z1, y0, x1);
-								dd110 = DIRECT_A3D_ELEM(my_weight, z1, y1, x0);
-								dd111 = DIRECT_A3D_ELEM(my_weight, z1, y1, x1);
-
-								ddx00 = LIN_INTERP(fx, dd000, dd001);
-								ddx01 = LIN_INTERP(fx, dd100, dd101);
-								ddx10 = LIN_INTERP(fx, dd010, dd011);
-								ddx11 = LIN_INTERP(fx, dd110, dd111);
-								ddxy0 = LIN_INTERP(fy, ddx00, ddx10);
-								ddxy1 = LIN_INTERP(fy, ddx01, ddx11);
-
-								A3D_ELEM(sum_weight, k, i, j) += LIN_INTERP(fz, ddxy0, ddxy1);
-
-							} // end if r2 <= my_rmax2
-						}
+							// First interpolate (complex) data
+							d000 = DIRECT_A3D_ELEM(my_data, z0, y0, x0);
+							d001 = DIRECT_A3D_ELEM(my_data, z0, y0, x1);
+							d010 = DIRECT_A3D_ELEM(my_data, z0, y1, x0);
+							d011 = DIRECT_A3D_ELEM(my_data, z0, y1, x1);
+							d100 = DIRECT_A3D_ELEM(my_data, z1, y0, x0);
+							d101 = DIRECT_A3D_ELEM(my_data, z1, y0, x1);
+							d110 = DIRECT_A3D_ELEM(my_data, z1, y1, x0);
+							d111 = DIRECT_A3D_ELEM(my_data, z1, y1, x1);
+
+							dx00 = LIN_INTERP(fx, d000, d001);
+							dx01 = LIN_INTERP(fx, d100, d101);
+							dx10 = LIN_INTERP(fx, d010, d011);
+							dx11 = LIN_INTERP(fx, d110, d111);
+							dxy0 = LIN_INTERP(fy, dx00, dx10);
+							dxy1 = LIN_INTERP(fy, dx01, dx11);
+
+							// Take complex conjugated for half with negative x
+							if (is_neg_x)
+								fsum += conj(LIN_INTERP(fz, dxy0, dxy1));
+							else
+								fsum += LIN_INTERP(fz, dxy0, dxy1);
+
+							// Then interpolate (real) weight
+							dd000 = DIRECT_A3D_ELEM(my_weight, z0, y0, x0);
+							dd001 = DIRECT_A3D_ELEM(my_weight, z0, y0, x1);
+							dd010 = DIRECT_A3D_ELEM(my_weight, z0, y1, x0);
+							dd011 = DIRECT_A3D_ELEM(my_weight, z0, y1, x1);
+							dd100 = DIRECT_A3D_ELEM(my_weight, z1, y0, x0);
+							dd101 = DIRECT_A3D_ELEM(my_weight, z1, y0, x1);
+							dd110 = DIRECT_A3D_ELEM(my_weight, z1, y1, x0);
+							dd111 = DIRECT_A3D_ELEM(my_weight, z1, y1, x1);
+
+							ddx00 = LIN_INTERP(fx, dd000, dd001);
+							ddx01 = LIN_INTERP(fx, dd100, dd101);
+							ddx10 = LIN_INTERP(fx, dd010, dd011);
+							ddx11 = LIN_INTERP(fx, dd110, dd111);
+							ddxy0 = LIN_INTERP(fy, ddx00, ddx10);
+							ddxy1 = LIN_INTERP(fy, ddx01, ddx11);
+
+							wsum += LIN_INTERP(fz, ddxy0, ddxy1);
+
+						} // end loop over symmetry operators
+
+						A3D_ELEM(sum_data, k, i, j) = fsum;
+						A3D_ELEM(sum_weight, k, i, j) = wsum;
 					}
-				} // end loop over all elements of sum_weight
-
-			} // end loop over symmetry operators
+				}
+			} // end loop over all elements of sum_weight
 
 			my_data = sum_data;
 			my_weight = sum_weight;
@@ -1348,21 +2025,32 @@ namespace relion
 		//blob.alpha = 15;
 
 		// Multiply with FT of the blob kernel
-//#pragma omp parallel for
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Mconv)
+		// The blob values are looked up for a whole row of radii at a time (as tab_ftblob(r), without interpolation)
+#pragma omp parallel for num_threads(transformer.nthreads)
+		for (long int k = 0; k < ZSIZE(Mconv); k++)
 		{
+			std::vector<DOUBLE> rvals(XSIZE(Mconv)), blobvals(XSIZE(Mconv));
 			int kp = (k < padhdim) ? k : k - pad_size;
-			int ip = (i < padhdim) ? i : i - pad_size;
-			int jp = (j < padhdim) ? j : j - pad_size;
-			DOUBLE rval = sqrt((DOUBLE)(kp * kp + ip * ip + jp * jp)) / (ori_size * padding_factor);
-			//if (kp==0 && ip==0 && jp > 0)
-			//	std::cerr << " jp= " << jp << " rval= " << rval << " tab_ftblob(rval) / normftblob= " << tab_ftblob(rval) / normftblob << " ori_size/2= " << ori_size/2 << std::endl;
-			// In the final reconstruction: mask the real-space map beyond its original size to prevent aliasing ghosts
-			// Note that rval goes until 1/2 in the oversampled map
-			if (do_mask && rval > 1. / (2. * padding_factor))
-				DIRECT_A3D_ELEM(Mconv, k, i, j) = 0.;
-			else
-				DIRECT_A3D_ELEM(Mconv, k, i, j) *= (tab_ftblob(rval) / normftblob);
+			for (long int i = 0; i < YSIZE(Mconv); i++)
+			{
+				int ip = (i < padhdim) ? i : i - pad_size;
+				for (long int j = 0; j < XSIZE(Mconv); j++)
+				{
+					int jp = (j < padhdim) ? j : j - pad_size;
+					rvals[j] = sqrt((DOUBLE)(kp * kp + ip * ip + jp * jp)) / (ori_size * padding_factor);
+				}
+				tab_ftblob.getValues(&rvals[0], &blobvals[0], XSIZE(Mconv));
+
+				for (long int j = 0; j < XSIZE(Mconv); j++)
+				{
+					// In the final reconstruction: mask the real-space map beyond its original size to prevent aliasing ghosts
+					// Note that rval goes until 1/2 in the oversampled map
+					if (do_mask && rvals[j] > 1. / (2. * padding_factor))
+						DIRECT_A3D_ELEM(Mconv, k, i, j) = 0.;
+					else
+						DIRECT_A3D_ELEM(Mconv, k, i, j) *= (blobvals[j] / normftblob);
+				}
+			}
 		}
 
 		// forward FFT to go back to Fourier-space
@@ -1370,59 +2058,96 @@ namespace relion
 
 	}
 
-	void BackProjector::windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<Complex > &Fin, MultidimArray<DOUBLE> &Mout, int nr_threads)
+	// Copy the FFTW half-complex array in into the (pre-sized) out, cropping or zero-padding in Fourier space as windowFourierTransform
+	static void windowFourierTransformInto(const MultidimArray<Complex > &in, MultidimArray<Complex > &out, int nr_threads)
 	{
+		// When growing, make sure the windowed FT has nothing in the corners, otherwise we end up with an asymmetric FT!
+		long int max_r2 = (XSIZE(out) > XSIZE(in)) ? (XSIZE(in) - 1) * (XSIZE(in) - 1) : -1;
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = 0; k < ZSIZE(out); k++)
+		{
+			long int kp = (k < XSIZE(out)) ? k : k - ZSIZE(out);
+			long int kin = (kp < 0) ? kp + ZSIZE(in) : kp;
+			bool k_inside = (kp < 0) ? kin >= XSIZE(in) : kp < XMIPP_MIN(XSIZE(in), ZSIZE(in));
+			for (long int i = 0; i < YSIZE(out); i++)
+			{
+				long int ip = (i < XSIZE(out)) ? i : i - YSIZE(out);
+				long int iin = (ip < 0) ? ip + YSIZE(in) : ip;
+				bool i_inside = (ip < 0) ? iin >= XSIZE(in) : ip < XMIPP_MIN(XSIZE(in), YSIZE(in));
+				Complex *out_row = &DIRECT_A3D_ELEM(out, k, i, 0);
+				long int nx = 0;
+				if (k_inside && i_inside)
+				{
+					const Complex *in_row = &DIRECT_A3D_ELEM(in, kin, iin, 0);
+					nx = XMIPP_MIN(XSIZE(in), XSIZE(out));
+					for (long int j = 0; j < nx; j++)
+						out_row[j] = (max_r2 < 0 || kp * kp + ip * ip + j * j <= max_r2) ? in_row[j] : Complex(0., 0.);
+				}
+				for (long int j = nx; j < XSIZE(out); j++)
+					out_row[j] = Complex(0., 0.);
+			}
+		}
+	}
 
-		MultidimArray<Complex > Ftmp;
-		int padoridim = padding_factor * ori_size;
-		DOUBLE normfft;
+	void BackProjector::windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<Complex > &Fin, MultidimArray<DOUBLE> &Mout, int nr_threads)
+	{
+		INSTRUMENT_TIMER(TIMER_RECONSTRUCT_WINDOW);
 
-		//#define DEBUG_WINDOWORIDIMREALSPACE
-#ifdef DEBUG_WINDOWORIDIMREALSPACE
-		Image<DOUBLE> tt;
-		tt().resize(ZSIZE(Fin), YSIZE(Fin), XSIZE(Fin));
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fin)
+		// Fin may be the Fourier array of the transformer itself, which is resized below
+		MultidimArray<Complex > Fcopy, Fpad;
+		const MultidimArray<Complex > *Fsrc = &Fin;
+		if (MULTIDIM_ARRAY(Fin) == MULTIDIM_ARRAY(transformer.fFourier))
 		{
-			DIRECT_MULTIDIM_ELEM(tt(), n) = abs(DIRECT_MULTIDIM_ELEM(Fin, n));
+			Fcopy = Fin;
+			Fsrc = &Fcopy;
 		}
-		tt.write("windoworidim_Fin.spi");
-#endif
 
+		// Resize the incoming complex array to the correct size, straight into the transformer
+		setOridimFourierTransform(transformer, Mout, Fpad);
+		windowFourierTransformInto(*Fsrc, Fpad, nr_threads);
+		Fcopy.clear();
+
+		oridimFourierToRealSpace(transformer, Mout);
+	}
+
+	void BackProjector::setOridimFourierTransform(FourierTransformer &transformer, MultidimArray<DOUBLE> &Mout, MultidimArray<Complex > &Fout)
+	{
+		int padoridim = padding_factor * ori_size;
 		if (ref_dim == 2)
-		{
 			Mout.resize(padoridim, padoridim);
-			normfft = (DOUBLE)(padding_factor * padding_factor);
-		}
 		else
-		{
 			Mout.resize(padoridim, padoridim, padoridim);
-			if (data_dim == 3)
-				normfft = (DOUBLE)(padding_factor * padding_factor * padding_factor);
-			else
-				normfft = (DOUBLE)(padding_factor * padding_factor * padding_factor * ori_size);
-		}
-		Mout.setXmippOrigin();
+		transformer.setReal(Mout);
+		transformer.getFourierAlias(Fout);
+	}
 
-		// Resize incoming complex array to the correct size
-		windowFourierTransform(Fin, Ftmp, padoridim);
+	void BackProjector::oridimFourierToRealSpace(FourierTransformer &transformer, MultidimArray<DOUBLE> &Mout)
+	{
+		DOUBLE normfft;
+		if (ref_dim == 2)
+			normfft = (DOUBLE)(padding_factor * padding_factor);
+		else if (data_dim == 3)
+			normfft = (DOUBLE)(padding_factor * padding_factor * padding_factor);
+		else
+			normfft = (DOUBLE)(padding_factor * padding_factor * padding_factor * ori_size);
 
-#ifdef DEBUG_WINDOWORIDIMREALSPACE
-		tt().resize(ZSIZE(Ftmp), YSIZE(Ftmp), XSIZE(Ftmp));
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ftmp)
+		// Do the inverse FFT
+		if (useCudaFourierTransforms())
 		{
-			DIRECT_MULTIDIM_ELEM(tt(), n) = abs(DIRECT_MULTIDIM_ELEM(Ftmp, n));
+			MultidimArray<Complex > Faux;
+			transformer.getFourierAlias(Faux);
+			cudaFourierToRealSpace(Faux, Mout);
 		}
-		tt.write("windoworidim_Fresized.spi");
-#endif
-
-		// Do the inverse FFT
-		transformer.inverseFourierTransform(Ftmp, Mout);
+		else
+			transformer.inverseFourierTransform();
 		Mout.setXmippOrigin();
 
 		// Shift the map back to its origin
 		CenterFFT(Mout, true);
 
+		//#define DEBUG_WINDOWORIDIMREALSPACE
 #ifdef DEBUG_WINDOWORIDIMREALSPACE
+		Image<DOUBLE> tt;
 		tt() = Mout;
 		tt.write("windoworidim_Munwindowed.spi");
 #endif
@@ -1458,16 +2183,82 @@ namespace relion
 #ifdef DEBUG_WINDOWORIDIMREALSPACE
 		tt() = Mout;
 		tt.write("windoworidim_Mwindowed_masked.spi");
-		FourierTransformer ttf;
-		ttf.FourierTransform(Mout, Ftmp);
-		tt().resize(ZSIZE(Ftmp), YSIZE(Ftmp), XSIZE(Ftmp));
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ftmp)
+#endif
+	}
+
+	// The jobs of reconstructBatch(), as a parallelFor() body over the sorted job order
+	struct ReconstructBatchTasks
+	{
+		std::vector<ReconstructJob> *jobs;
+		std::vector<long int> order;
+		int nr_threads;
+
+		int max_iter_preweight, minres_map;
+		bool do_map, update_tau2_with_fsc, is_whole_instead_of_half;
+		DOUBLE tau2_fudge, preweight_tolerance;
+
+		void operator()(long int begin, long int end)
 		{
-			DIRECT_MULTIDIM_ELEM(tt(), n) = abs(DIRECT_MULTIDIM_ELEM(Ftmp, n));
+			for (long int i = begin; i < end; i++)
+			{
+				ReconstructJob &job = (*jobs)[order[i]];
+				job.backprojector->reconstruct(*job.vol_out, max_iter_preweight, do_map, tau2_fudge,
+					*job.tau2, *job.sigma2, *job.evidence_vs_prior, job.fsc, job.normalise, update_tau2_with_fsc,
+					is_whole_instead_of_half, getTaskNrThreads(nr_threads), minres_map, preweight_tolerance);
+			}
 		}
-		tt.write("windoworidim_Fnew.spi");
-#endif
+	};
 
+	// Sort jobs from the largest to the smallest backprojector
+	struct LargerReconstructJob
+	{
+		const std::vector<ReconstructJob> *jobs;
+		bool operator()(long int a, long int b) const
+		{
+			return NZYXSIZE((*jobs)[a].backprojector->data) > NZYXSIZE((*jobs)[b].backprojector->data);
+		}
+	};
 
+	void reconstructBatch(std::vector<ReconstructJob> &jobs,
+		int max_iter_preweight,
+		bool do_map,
+		DOUBLE tau2_fudge,
+		bool update_tau2_with_fsc,
+		bool is_whole_instead_of_half,
+		int nr_threads,
+		int minres_map,
+		DOUBLE preweight_tolerance)
+	{
+		for (size_t ijob = 0; ijob < jobs.size(); ijob++)
+		{
+			const ReconstructJob &job = jobs[ijob];
+			if (job.backprojector == NULL || job.vol_out == NULL || job.tau2 == NULL || job.sigma2 == NULL || job.evidence_vs_prior == NULL)
+				REPORT_ERROR("reconstructBatch: every job needs a backprojector and its output arrays");
+		}
+		if (jobs.empty())
+			return;
+
+		// Temporaries of finished jobs are re-used by the next ones
+		MemoryPoolScope memory_pool;
+
+		ReconstructBatchTasks tasks;
+		tasks.jobs = &jobs;
+		tasks.order.resize(jobs.size());
+		for (size_t ijob = 0; ijob < jobs.size(); ijob++)
+			tasks.order[ijob] = ijob;
+		LargerReconstructJob larger;
+		larger.jobs = &jobs;
+		std::stable_sort(tasks.order.begin(), tasks.order.end(), larger);
+		tasks.nr_threads = XMIPP_MAX(1, nr_threads);
+		tasks.max_iter_preweight = max_iter_preweight;
+		tasks.minres_map = minres_map;
+		tasks.do_map = do_map;
+		tasks.update_tau2_with_fsc = update_tau2_with_fsc;
+		tasks.is_whole_instead_of_half = is_whole_instead_of_half;
+		tasks.tau2_fudge = tau2_fudge;
+		tasks.preweight_tolerance = preweight_tolerance;
+
+		// One job per pool task; every task reconstructs with its share of the threads
+		parallelFor(0, jobs.size(), 1, tasks, tasks.nr_threads);
 	}
-}
\ No newline at end of file
+}
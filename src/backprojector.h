@@ -28,6 +28,7 @@
 #ifndef BACKPROJECTOR_H_
 #define BACKPROJECTOR_H_
 
+#include <vector>
 #include "src/projector.h"
 #include "src/mask.h"
 #include "src/tabfuncs.h"
@@ -49,6 +50,26 @@ namespace relion
 		// Symmetry object
 		SymList SL;
 
+		// Use compensated (Kahan) summation when backprojecting into data and weight
+		bool do_compensated_sum;
+
+		// Running compensation terms of the Kahan sums (only allocated if do_compensated_sum)
+		// The accurate sums are data - data_comp and weight - weight_comp, see foldCompensation()
+		MultidimArray<Complex > data_comp;
+		MultidimArray<DOUBLE> weight_comp;
+
+		// Apply the symmetry operators of SL while backprojecting, rather than afterwards in symmetrise()
+		bool do_symmetrise_on_insertion;
+
+		// Only store the voxels of data and weight that backprojection can reach, see setSparseStorage()
+		bool do_sparse_storage;
+
+		// While stored sparsely: the row offsets of getPackedRowOffsets, and the rows of data and weight
+		// (and of their compensation terms) one after the other. data and weight are empty meanwhile.
+		std::vector<long int> sparse_offsets;
+		std::vector<Complex > sparse_data, sparse_data_comp;
+		std::vector<DOUBLE> sparse_weight, sparse_weight_comp;
+
 	public:
 
 		/** Empty constructor
@@ -87,6 +108,15 @@ namespace relion
 			// Precalculate tabulated ftblob values
 			tab_ftblob.initialise(_blob_radius * padding_factor, _blob_alpha, _blob_order, 10000);
 
+			// Plain summation by default
+			do_compensated_sum = false;
+
+			// Symmetrise the summed data and weight (once) in symmetrise() by default
+			do_symmetrise_on_insertion = false;
+
+			// Dense data and weight arrays by default
+			do_sparse_storage = false;
+
 		}
 
 		/** Copy constructor
@@ -113,20 +143,22 @@ namespace relion
 		{
 			if (&op != this)
 			{
-				// Projector stuff (is this necessary in C++?)
-				data = op.data;
-				ori_size = op.ori_size;
-				pad_size = op.pad_size;
-				r_max = op.r_max;
-				r_min_nn = op.r_min_nn;
-				interpolator = op.interpolator;
-				padding_factor = op.padding_factor;
-				ref_dim = op.ref_dim;
-				data_dim = op.data_dim;
+				// Projector stuff (including the bricked and half-precision copies of data)
+				Projector::operator=(op);
 				// BackProjector stuff
 				weight = op.weight;
 				tab_ftblob = op.tab_ftblob;
 				SL = op.SL;
+				do_compensated_sum = op.do_compensated_sum;
+				data_comp = op.data_comp;
+				weight_comp = op.weight_comp;
+				do_symmetrise_on_insertion = op.do_symmetrise_on_insertion;
+				do_sparse_storage = op.do_sparse_storage;
+				sparse_offsets = op.sparse_offsets;
+				sparse_data = op.sparse_data;
+				sparse_data_comp = op.sparse_data_comp;
+				sparse_weight = op.sparse_weight;
+				sparse_weight_comp = op.sparse_weight_comp;
 			}
 			return *this;
 		}
@@ -147,15 +179,86 @@ namespace relion
 		void clear()
 		{
 			weight.clear();
+			data_comp.clear();
+			weight_comp.clear();
+			clearSparseStorage();
 			Projector::clear();
 		}
 
 		// Initialise data and weight arrays to the given size and set all values to zero
 		void initialiseDataAndWeight(int current_size = -1);
 
-		// Initialise data and weight arrays to the given size and set all values to zero
+		/*
+		 * Initialise data and weight arrays to the given size and set all values to zero
+		 * With setSparseStorage(true), only the sparse rows are allocated (3D references only).
+		 */
 		void initZeros(int current_size = -1);
 
+		/*
+		 * Store data and weight sparsely from the next initZeros() on: only the x-range of every (z, y)-row
+		 * that lies within the radius that backprojection can reach (see getPackedRowOffsets) is allocated.
+		 * This is about half of the padded cube. backproject() and backprojectBatch() insert into the sparse rows,
+		 * and getReductionBuffers() returns them, so memory and reduction traffic only grow with the sphere of r_max.
+		 * reconstruct() and the other functions that need the whole arrays call expandToDense() first;
+		 * call it yourself before accessing data or weight directly. Only for 3D references.
+		 * Switching it off expands any sparse arrays.
+		 */
+		void setSparseStorage(bool do_sparse);
+
+		// Whether data and weight are currently stored sparsely
+		bool isSparse() const
+		{
+			return !sparse_offsets.empty();
+		}
+
+		// Copy sparsely stored data and weight (and compensation terms) into the dense arrays (does nothing if not sparse)
+		void expandToDense();
+
+		/*
+		 * Switch compensated (Kahan) summation in backproject() and backprojectBatch() on or off.
+		 * This keeps float builds (FLOAT_PRECISION) close to double-precision accuracy over many insertions,
+		 * at the cost of one extra data- and weight-sized array. Call before initZeros().
+		 */
+		void setCompensatedSummation(bool do_compensate)
+		{
+			do_compensated_sum = do_compensate;
+			if (!do_compensated_sum)
+			{
+				data_comp.clear();
+				weight_comp.clear();
+				sparse_data_comp.clear();
+				sparse_weight_comp.clear();
+			}
+		}
+
+		/*
+		 * Subtract the accumulated compensation terms from data and weight and reset them to zero.
+		 * This is done automatically before data and weight are read by reconstruct() etc.
+		 * If do_enforce_hermitian_symmetry (dense storage only), enforceHermitianSymmetry is done on data and weight in the same pass.
+		 */
+		void foldCompensation(int nr_threads = 1, bool do_enforce_hermitian_symmetry = false);
+
+		/*
+		 * Switch symmetrisation on insertion on or off.
+		 * If on, backproject() and backprojectBatch() insert every slice once for each operator of the symmetry group,
+		 * and symmetrise() does nothing, as data and weight are symmetric already.
+		 * This avoids the (number of operators) full-volume interpolation sweeps of symmetrise() and the
+		 * additional interpolation error they introduce, at the cost of inserting each slice (number of operators) times.
+		 * For high-order groups and not too many images per map this is the faster option.
+		 * As symmetrise(), this does nothing for 2D references.
+		 * Call before backprojecting anything.
+		 */
+		void setSymmetriseOnInsertion(bool do_symmetrise)
+		{
+			do_symmetrise_on_insertion = do_symmetrise;
+		}
+
+		/*
+		 * Get the 3x3 rotation matrices of all symmetry operators in SL (but the identity),
+		 * row-major and one after the other, in Rs (9 * SL.SymsNo() elements)
+		 */
+		void getSymmetryMatrices(std::vector<DOUBLE> &Rs);
+
 		/*
 		* Set a 2D Fourier Transform back into the 2D or 3D data array
 		* Depending on the dimension of the map, this will be a backprojection or a rotation operation
@@ -203,6 +306,18 @@ namespace relion
 			const Matrix2D<DOUBLE> &A, bool inv,
 			const MultidimArray<DOUBLE> *Mweight = NULL);
 
+		/*
+		* backrotate2D and backrotate3D for a fixed interpolator (TRILINEAR or NEAREST_NEIGHBOUR)
+		* Ainv is the inverse rotation matrix, already multiplied by the padding_factor
+		*/
+		template <int INTERPOLATOR>
+		void backrotate2DRows(const MultidimArray<Complex > &img_in, const Matrix2D<DOUBLE> &Ainv,
+			const MultidimArray<DOUBLE> *Mweight, int max_r2, int min_r2_nn);
+
+		template <int INTERPOLATOR>
+		void backrotate3DRows(const MultidimArray<Complex > &img_in, const Matrix2D<DOUBLE> &Ainv,
+			const MultidimArray<DOUBLE> *Mweight, int max_r2, int min_r2_nn);
+
 		/*
 		* Set a 2D slice in the 3D map (backward projection)
 		* If a exp_Mweight is given, rather than adding 1 to all relevant pixels in the weight array, we use exp_Mweight
@@ -211,6 +326,72 @@ namespace relion
 			const Matrix2D<DOUBLE> &A, bool inv,
 			const MultidimArray<DOUBLE> *Mweight = NULL);
 
+		/*
+		* As above, for a 3x3 rotation matrix without any allocation
+		*/
+		void backproject(const MultidimArray<Complex > &img_in,
+			const Mat33 &A, bool inv,
+			const MultidimArray<DOUBLE> *Mweight = NULL);
+
+		/*
+		* Set 2D slices for many orientations in the 3D map in one call (backward projection)
+		* A holds nr_A row-major 3x3 rotation matrices, one after the other; image n of img_in is inserted with matrix n.
+		* If Mweight is given, it should be a stack of the same size as img_in.
+		* The images are distributed over nr_threads threads, each of which (but the first) accumulates into
+		* a private copy of the data and weight arrays, which are summed at the end. This costs nr_threads - 1 extra volumes of memory.
+		*/
+		void backprojectBatch(const MultidimArray<Complex > &img_in, const DOUBLE *A, int nr_A, bool inv,
+			const MultidimArray<DOUBLE> *Mweight = NULL, int nr_threads = 1);
+
+		/*
+		* Add one 2D slice of size ydim x xdim (FFTW half-complex layout) into mydata and myweight,
+		* which should have the same size and origin as data and weight
+		* If mydata_comp and myweight_comp are given, the additions are done with Kahan summation
+		* Ainv is the row-major 3x3 inverse rotation matrix, already multiplied by the padding_factor
+		* Shared by backproject() and backprojectBatch()
+		*/
+		void backprojectSlice(const Complex *img_in, long int xdim, long int ydim, const DOUBLE *Mweight,
+			const DOUBLE *Ainv, MultidimArray<Complex > &mydata, MultidimArray<DOUBLE> &myweight,
+			MultidimArray<Complex > *mydata_comp = NULL, MultidimArray<DOUBLE> *myweight_comp = NULL);
+
+		/*
+		 * The sparse encoding of packDataAndWeight (and of setSparseStorage): row (k, i) of data (counting from 0) holds
+		 * offsets[r + 1] - offsets[r] voxels in the encoding, with r = k * YSIZE(data) + i
+		 */
+		void getPackedRowOffsets(std::vector<long int> &offsets);
+
+		// Size and origin of data (also while it is stored sparsely); STARTINGX is 0
+		void getDataShape(long int &zdim, long int &ydim, long int &xdim, long int &startz, long int &starty);
+
+		// The arrays backproject() adds into: the dense or the sparse ones (the last two are NULL without do_compensated_sum)
+		void getAccumulators(Complex *&mydata, DOUBLE *&myweight, Complex *&mydata_comp, DOUBLE *&myweight_comp);
+
+		// backprojectSliceRows into the arrays of getAccumulators (or copies of them)
+		void addSlice(const Complex *img_in, long int xdim, long int ydim, const DOUBLE *Mweight, const DOUBLE *Ainv,
+			Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp);
+
+		// Dispatch to the backprojectSliceRows for the interpolator, and for compensated summation if mydata_comp is given
+		template <bool SPARSE>
+		void addSliceRows(const Complex *img_in, long int xdim, long int ydim, const DOUBLE *Mweight, const DOUBLE *Ainv,
+			Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp);
+
+		/*
+		 * The insertion of backprojectSlice, into dense arrays or (if SPARSE) into arrays with the rows of sparse_offsets,
+		 * for a fixed interpolator (TRILINEAR or NEAREST_NEIGHBOUR), with Kahan summation if COMPENSATED
+		 */
+		template <bool SPARSE, int INTERPOLATOR, bool COMPENSATED>
+		void backprojectSliceRows(const Complex *img_in, long int xdim, long int ydim, const DOUBLE *Mweight, const DOUBLE *Ainv,
+			Complex *mydata, DOUBLE *myweight, Complex *mydata_comp, DOUBLE *myweight_comp);
+
+		void clearSparseStorage()
+		{
+			sparse_offsets.clear();
+			sparse_data.clear();
+			sparse_data_comp.clear();
+			sparse_weight.clear();
+			sparse_weight_comp.clear();
+		}
+
 		/*
 		 * Get only the lowest resolution components from the data and weight array
 		 * (to be joined together for two independent halves in order to force convergence in the same orientation)
@@ -225,6 +406,37 @@ namespace relion
 		void setLowResDataAndWeight(MultidimArray<Complex > &lowres_data, MultidimArray<DOUBLE> &lowres_weight,
 			int lowres_r_max);
 
+		/*
+		 * Contiguous parts of the data and weight arrays, to be summed in place over all workers, e.g.
+		 *
+		 * BPref.getReductionBuffers(buffers, sizes);
+		 * for (int i = 0; i < buffers.size(); i++)
+		 *     MPI_Allreduce(MPI_IN_PLACE, buffers[i], sizes[i], MY_MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		 *
+		 * buffers[i] points at sizes[i] DOUBLEs inside data (as real, imaginary pairs) or weight; nothing is copied.
+		 * No part is longer than max_chunk values (the default stays within the int counts of MPI).
+		 * The compensation terms of do_compensated_sum are folded into data and weight first.
+		 */
+		void getReductionBuffers(std::vector<DOUBLE*> &buffers, std::vector<long int> &sizes, long int max_chunk = 268435456);
+
+		/*
+		 * Sparse encoding of data and weight for the reduction: only the voxels within the radius that backprojection can reach
+		 * (padding_factor * r_max, plus the reach of the trilinear interpolation) are stored, which skips
+		 * the corners of the array. The encoding only depends on the size of the data array and on r_max,
+		 * so it is the same for all BackProjectors with the same settings and packed buffers can be summed element by element.
+		 * getPackedSize() is the number of DOUBLEs of the encoding.
+		 */
+		long int getPackedSize();
+
+		// Copy data and weight into buf (of getPackedSize() DOUBLEs)
+		void packDataAndWeight(DOUBLE *buf, int nr_threads = 1);
+
+		/*
+		 * Set data and weight from buf (of getPackedSize() DOUBLEs), or add to them if do_add
+		 * When set, all voxels outside the packed radius become zero.
+		 */
+		void unpackDataAndWeight(const DOUBLE *buf, bool do_add = false, int nr_threads = 1);
+
 		/*
 		 *  Get complex array at the original size as the straightforward average
 		 *  padding_factor*padding_factor*padding_factor voxels
@@ -242,6 +454,10 @@ namespace relion
 		/* Get the 3D reconstruction
 			 * If do_map is true, 1 will be added to all weights
 			 * alpha will contain the noise-reduction spectrum
+			 * The data are multiplied by the inverse weights of max_iter_preweight gridding-correction iterations
+			 * (Pipe & Menon, 1999), or divided by the weights if max_iter_preweight is 0.
+			 * The iterations stop early once no weight changes by more than a relative preweight_tolerance anymore
+			 * (never if preweight_tolerance <= 0)
 			 */
 		void reconstruct(MultidimArray<DOUBLE> &vol_out,
 			int max_iter_preweight,
@@ -255,19 +471,24 @@ namespace relion
 			bool update_tau2_with_fsc = false,
 			bool is_whole_instead_of_half = false,
 			int nr_threads = 1,
-			int minres_map = -1);
+			int minres_map = -1,
+			DOUBLE preweight_tolerance = 0.);
 
 		/* Enforce hermitian symmetry on data and on weight (all points in the x==0 plane)
 		* Because the interpolations are numerical, hermitian symmetry may be broken.
 		* Repairing it here gives like a 2-fold averaging correction for interpolation errors...
+		* The pairs of planes z and -z are done in parallel on nr_threads threads.
 		*/
 		void enforceHermitianSymmetry(MultidimArray<Complex > &mydata,
-			MultidimArray<DOUBLE> &myweight);
+			MultidimArray<DOUBLE> &myweight, int nr_threads = 1);
 
 		/* Applies the symmetry from the SymList object to the weight and the data array
+		 * All operators are applied in a single sweep over the array, summing them for each point in turn
+		 * Does nothing if do_symmetrise_on_insertion, as the symmetry was applied during backprojection already
+		 * The planes z are done in parallel on nr_threads threads.
 		 */
 		void symmetrise(MultidimArray<Complex > &mydata,
-			MultidimArray<DOUBLE> &myweight, int my_rmax2);
+			MultidimArray<DOUBLE> &myweight, int my_rmax2, int nr_threads = 1);
 
 		/* Convolute in Fourier-space with the blob by multiplication in real-space
 		  * Note the convlution is done on the complex array inside the transformer object!!
@@ -279,81 +500,108 @@ namespace relion
 		 */
 		void windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<Complex > &Fin, MultidimArray<DOUBLE> &Mout, int nr_threads = 1);
 
+		/* Resize Mout to the padded original size, make it the real-space array of the transformer, and alias Fout to
+		 * the Fourier array of the transformer. Filling Fout windows in Fourier space without another copy
+		 */
+		void setOridimFourierTransform(FourierTransformer &transformer, MultidimArray<DOUBLE> &Mout, MultidimArray<Complex > &Fout);
+
+		/* Inverse FFT of the Fourier array of the transformer (see setOridimFourierTransform) into Mout,
+		 * and window, normalise and mask Mout to ori_size in real space
+		 */
+		void oridimFourierToRealSpace(FourierTransformer &transformer, MultidimArray<DOUBLE> &Mout);
+
 		/*
 		 * Go from the Projector-centered fourier transform back to FFTW-uncentered one
+		 * Mout should already have the right size, which may differ from that of Min. Its precision may also differ,
+		 * e.g. Fnewweight needs decentering, but has to be in double-precision for correct calculations!
+		 * Every voxel within my_rmax2 is multiplied by scale, all others are set to zero, in a single pass over Mout
 		 */
-		//template <typename T>
-		//void decenter(MultidimArray<T> &Min, MultidimArray<T> &Mout, int my_rmax2)
-		//{
-
-		//	// Mout should already have the right size
-		//	// Initialize to zero
-		//	Mout.initZeros();
-		//	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
-		//	{
-		//		if (kp*kp + ip*ip + jp*jp <= my_rmax2)
-		//			DIRECT_A3D_ELEM(Mout, k, i, j) = A3D_ELEM(Min, kp, ip, jp);
-		//	}
-		//}
-
-
-//#ifdef FLOAT_PRECISION
-		// Fnewweight needs decentering, but has to be in double-precision for correct calculations!
-		
-		void decenter_fd(MultidimArray<float> &Min, MultidimArray<double> &Mout, int my_rmax2)
+		template <typename TIN, typename TOUT>
+		void decenter(const MultidimArray<TIN> &Min, MultidimArray<TOUT> &Mout, int my_rmax2, DOUBLE scale = 1., int nr_threads = 1)
 		{
-
-			// Mout should already have the right size
-			// Initialize to zero
-			Mout.initZeros();
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int k = 0; k < ZSIZE(Mout); k++)
 			{
-				if (kp*kp + ip*ip + jp*jp <= my_rmax2)
-					DIRECT_A3D_ELEM(Mout, k, i, j) = (double)A3D_ELEM(Min, kp, ip, jp);
+				long int kp = (k < XSIZE(Mout)) ? k : k - ZSIZE(Mout);
+				for (long int i = 0; i < YSIZE(Mout); i++)
+				{
+					long int ip = (i < XSIZE(Mout)) ? i : i - YSIZE(Mout);
+					TOUT *out = &DIRECT_A3D_ELEM(Mout, k, i, 0);
+					long int r2 = kp * kp + ip * ip;
+					// Only the part of the row that lies within my_rmax2 and inside Min
+					long int jmax = -1;
+					if (r2 <= my_rmax2 && kp >= STARTINGZ(Min) && kp <= FINISHINGZ(Min) && ip >= STARTINGY(Min) && ip <= FINISHINGY(Min))
+					{
+						jmax = XMIPP_MIN(XSIZE(Mout), FINISHINGX(Min) + 1) - 1;
+						while (jmax >= 0 && r2 + jmax * jmax > my_rmax2)
+							jmax--;
+					}
+					for (long int j = 0; j <= jmax; j++)
+						out[j] = (TOUT)(A3D_ELEM(Min, kp, ip, j) * scale);
+					for (long int j = jmax + 1; j < XSIZE(Mout); j++)
+						out[j] = (TOUT)0.;
+				}
 			}
 		}
 
+		void decenter_fd(MultidimArray<float> &Min, MultidimArray<double> &Mout, int my_rmax2)
+		{
+			decenter(Min, Mout, my_rmax2);
+		}
+
 		void decenter_ff(MultidimArray<double> &Min, MultidimArray<double> &Mout, int my_rmax2)
 		{
+			decenter(Min, Mout, my_rmax2);
+		}
 
-			// Mout should already have the right size
-			// Initialize to zero
-			Mout.initZeros();
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
-			{
-				if (kp*kp + ip * ip + jp * jp <= my_rmax2)
-					DIRECT_A3D_ELEM(Mout, k, i, j) = A3D_ELEM(Min, kp, ip, jp);
-			}
+		void decenter_ff(MultidimArray<float> &Min, MultidimArray<float> &Mout, int my_rmax2)
+		{
+			decenter(Min, Mout, my_rmax2);
 		}
 
 		void decenter_ff(MultidimArray<double> &Min, MultidimArray<float> &Mout, int my_rmax2)
 		{
-
-			// Mout should already have the right size
-			// Initialize to zero
-			Mout.initZeros();
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
-			{
-				if (kp*kp + ip * ip + jp * jp <= my_rmax2)
-					DIRECT_A3D_ELEM(Mout, k, i, j) = A3D_ELEM(Min, kp, ip, jp);
-			}
+			decenter(Min, Mout, my_rmax2);
 		}
 
 		void decenter_cc(MultidimArray<Complex> &Min, MultidimArray<Complex> &Mout, int my_rmax2)
 		{
-
-			// Mout should already have the right size
-			// Initialize to zero
-			Mout.initZeros();
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
-			{
-				if (kp*kp + ip * ip + jp * jp <= my_rmax2)
-					DIRECT_A3D_ELEM(Mout, k, i, j) = A3D_ELEM(Min, kp, ip, jp);
-			}
+			decenter(Min, Mout, my_rmax2);
 		}
-//#endif
 
 	};
+
+	/** One reconstruction of a batch for reconstructBatch()
+	 * The arrays are the ones of BackProjector::reconstruct() for this backprojector (tau2, sigma2 and evidence_vs_prior
+	 * are input and output there) and should not be shared with the other jobs of the batch.
+	 */
+	struct ReconstructJob
+	{
+		BackProjector *backprojector;
+		MultidimArray<DOUBLE> *vol_out, *tau2, *sigma2, *evidence_vs_prior;
+		MultidimArray<DOUBLE> fsc; // only input
+		DOUBLE normalise;
+
+		ReconstructJob() : backprojector(NULL), vol_out(NULL), tau2(NULL), sigma2(NULL), evidence_vs_prior(NULL), normalise(1.) {}
+	};
+
+	/** Reconstruct several backprojectors at once, e.g. all classes (and half-sets) of an iteration
+	 *
+	 * The jobs are run by BackProjector::reconstruct() (with the remaining arguments given here) as tasks of the shared
+	 * thread pool (see thread_pool.h), on up to min(jobs.size(), nr_threads) threads, largest job first, which share the nr_threads.
+	 * All jobs share the cached FFTW plans and shell maps, and the memory pool re-uses the temporaries of finished jobs,
+	 * so that the wall-clock time approaches that of the largest job instead of the sum of all.
+	 * Errors are reported (the first one) after all workers have finished.
+	 */
+	void reconstructBatch(std::vector<ReconstructJob> &jobs,
+		int max_iter_preweight,
+		bool do_map,
+		DOUBLE tau2_fudge,
+		bool update_tau2_with_fsc = false,
+		bool is_whole_instead_of_half = false,
+		int nr_threads = 1,
+		int minres_map = -1,
+		DOUBLE preweight_tolerance = 0.);
 }
 
 #endif /* BACKPROJECTOR_H_ */
@@ -0,0 +1,93 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/bricked_volume.h"
+
+namespace relion
+{
+	void BrickedFourierVolume::clear()
+	{
+		xdim = ydim = zdim = starty = startz = 0;
+		bricks.clear();
+		xoff.clear();
+		yoff.clear();
+		zoff.clear();
+	}
+
+	void BrickedFourierVolume::initialise(const MultidimArray<Complex > &vol, int nr_threads)
+	{
+		if (vol.getDim() != 3)
+			REPORT_ERROR("BrickedFourierVolume::initialise: the volume should be 3D");
+		if (STARTINGX(vol) != 0)
+			REPORT_ERROR("BrickedFourierVolume::initialise: the volume should have STARTINGX = 0");
+
+		xdim = XSIZE(vol);
+		ydim = YSIZE(vol);
+		zdim = ZSIZE(vol);
+		starty = STARTINGY(vol);
+		startz = STARTINGZ(vol);
+
+		long int nbx = (xdim + BRICK - 1) / BRICK;
+		long int nby = (ydim + BRICK - 1) / BRICK;
+		long int nbz = (zdim + BRICK - 1) / BRICK;
+		const long int brick_size = BRICK * BRICK * BRICK;
+		if (nbx * nby * nbz * brick_size * 2 > 2147483647L)
+			REPORT_ERROR("BrickedFourierVolume::initialise: the volume is too large for 32-bit indices");
+
+		xoff.resize(xdim);
+		yoff.resize(ydim);
+		zoff.resize(zdim);
+		for (long int x = 0; x < xdim; x++)
+			xoff[x] = (x / BRICK) * brick_size + x % BRICK;
+		for (long int y = 0; y < ydim; y++)
+			yoff[y] = (y / BRICK) * nbx * brick_size + (y % BRICK) * BRICK;
+		for (long int z = 0; z < zdim; z++)
+			zoff[z] = (z / BRICK) * nby * nbx * brick_size + (z % BRICK) * BRICK * BRICK;
+
+		// (the padding of partial bricks stays zero)
+		bricks.assign(nbx * nby * nbz * brick_size, Complex(0., 0.));
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int z = 0; z < zdim; z++)
+			for (long int y = 0; y < ydim; y++)
+			{
+				const Complex *row = &DIRECT_A3D_ELEM(vol, z, y, 0);
+				Complex *dest = &bricks[zoff[z] + yoff[y]];
+				for (long int x = 0; x < xdim; x++)
+					dest[xoff[x]] = row[x];
+			}
+	}
+
+	void BrickedFourierVolume::getArray(MultidimArray<Complex > &vol, int nr_threads) const
+	{
+		vol.resize(zdim, ydim, xdim);
+		STARTINGX(vol) = 0;
+		STARTINGY(vol) = starty;
+		STARTINGZ(vol) = startz;
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int z = 0; z < zdim; z++)
+			for (long int y = 0; y < ydim; y++)
+			{
+				Complex *row = &DIRECT_A3D_ELEM(vol, z, y, 0);
+				const Complex *src = &bricks[zoff[z] + yoff[y]];
+				for (long int x = 0; x < xdim; x++)
+					row[x] = src[xoff[x]];
+			}
+	}
+}
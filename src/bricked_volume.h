@@ -0,0 +1,98 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef BRICKED_VOLUME_H
+#define BRICKED_VOLUME_H
+
+#include <vector>
+#include "src/multidim_array.h"
+
+namespace relion
+{
+	/** A 3D half-complex Fourier volume stored in bricks of 8 x 8 x 8 voxels
+	 *
+	 * In the row-major MultidimArray every sample of an oblique slice touches a different z-plane,
+	 * i.e. a different cache line and often a different page. Inside a brick (4 kB in single precision)
+	 * all 8 neighbours of a trilinear interpolation are usually in the same brick, and consecutive
+	 * samples of a slice stay within few bricks.
+	 *
+	 * The index of physical voxel (z, y, x) in bricks is zoff[z] + yoff[y] + xoff[x], so that the
+	 * interpolation kernels only need three table lookups per corner.
+	 *
+	 * @code
+	 * BrickedFourierVolume bricked(PPref.data);
+	 * Complex val = bricked.elem(k, i, j); // as A3D_ELEM(PPref.data, k, i, j)
+	 * @endcode
+	 */
+	class BrickedFourierVolume
+	{
+	public:
+		// Edge length of the bricks
+		static const int BRICK = 8;
+
+		// Size and logical origin (STARTINGX is 0) of the volume
+		long int xdim, ydim, zdim, starty, startz;
+
+		// All bricks, one after the other (x fastest, then y, then z)
+		std::vector<Complex> bricks;
+
+		// Offsets in bricks of the physical x, y and z indices
+		std::vector<int> xoff, yoff, zoff;
+
+		BrickedFourierVolume()
+		{
+			clear();
+		}
+
+		BrickedFourierVolume(const MultidimArray<Complex > &vol)
+		{
+			initialise(vol);
+		}
+
+		void clear();
+
+		bool isEmpty() const
+		{
+			return bricks.empty();
+		}
+
+		/** Copy a 3D volume with STARTINGX = 0 (as Projector::data) into bricks
+		 */
+		void initialise(const MultidimArray<Complex > &vol, int nr_threads = 1);
+
+		/** Copy the bricks back into a row-major volume with the same size and origin
+		 */
+		void getArray(MultidimArray<Complex > &vol, int nr_threads = 1) const;
+
+		/** Element access with logical indices, as A3D_ELEM
+		 */
+		Complex& elem(long int k, long int i, long int j)
+		{
+			return bricks[zoff[k - startz] + yoff[i - starty] + xoff[j]];
+		}
+
+		const Complex& elem(long int k, long int i, long int j) const
+		{
+			return bricks[zoff[k - startz] + yoff[i - starty] + xoff[j]];
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,449 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+#include "src/checkpoint.h"
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#endif
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_BYTE_ORDER 0x01020304
+#define CHECKPOINT_ALIGNMENT 4096
+#define CHECKPOINT_MAX_ARRAYS 16
+
+namespace relion
+{
+	enum CheckpointObject { CHECKPOINT_PROJECTOR = 0, CHECKPOINT_BACKPROJECTOR = 1 };
+
+	// Where one array is stored, and its shape and origin
+	struct CheckpointArrayHeader
+	{
+		char name[24];
+		int64_t offset, bytes;
+		int64_t ndim, zdim, ydim, xdim;
+		int64_t zinit, yinit, xinit;
+	};
+
+	// The header, at the start of the file (which is padded to CHECKPOINT_ALIGNMENT)
+	struct CheckpointHeader
+	{
+		char magic[8];                       // "LLCKPT\0\0"
+		int32_t version, byte_order;
+		int32_t real_size;                   // sizeof(DOUBLE) of the library that wrote the file
+		int32_t object;                      // CheckpointObject
+		int32_t ori_size, pad_size, r_max, r_min_nn;
+		int32_t interpolator, padding_factor, ref_dim, data_dim;
+		int32_t do_compensated_sum, do_symmetrise_on_insertion, do_sparse_storage, do_bricked;
+		double half_scale;                   // Projector::half_data, if its values are stored
+		int64_t half_xdim, half_ydim, half_zdim, half_starty, half_startz;
+		int32_t nr_arrays, unused;
+		CheckpointArrayHeader arrays[CHECKPOINT_MAX_ARRAYS];
+	};
+
+	struct CheckpointArray
+	{
+		CheckpointArrayHeader header;
+		const char* ptr;
+		std::vector<char> copy;
+	};
+
+	struct CheckpointData
+	{
+		CheckpointHeader header;
+		std::vector<CheckpointArray> arrays;
+
+		CheckpointData()
+		{
+			memset(&header, 0, sizeof(CheckpointHeader));
+			memcpy(header.magic, "LLCKPT\0\0", 8);
+			header.version = CHECKPOINT_VERSION;
+			header.byte_order = CHECKPOINT_BYTE_ORDER;
+			header.real_size = sizeof(DOUBLE);
+		}
+
+		void add(const char* name, const void* ptr, size_t bytes, long int ndim, long int zdim, long int ydim,
+			long int xdim, long int zinit = 0, long int yinit = 0, long int xinit = 0)
+		{
+			if (bytes == 0)
+				return;
+			if (arrays.size() >= CHECKPOINT_MAX_ARRAYS)
+				REPORT_ERROR("CheckpointData::add: BUG: too many arrays");
+			CheckpointArray array;
+			memset(&array.header, 0, sizeof(CheckpointArrayHeader));
+			strncpy(array.header.name, name, sizeof(array.header.name) - 1);
+			array.header.bytes = bytes;
+			array.header.ndim = ndim;
+			array.header.zdim = zdim;
+			array.header.ydim = ydim;
+			array.header.xdim = xdim;
+			array.header.zinit = zinit;
+			array.header.yinit = yinit;
+			array.header.xinit = xinit;
+			array.ptr = (const char*)ptr;
+			arrays.push_back(array);
+		}
+
+		template <typename T>
+		void add(const char* name, const MultidimArray<T> &v)
+		{
+			add(name, MULTIDIM_ARRAY(v), NZYXSIZE(v) * sizeof(T), NSIZE(v), ZSIZE(v), YSIZE(v), XSIZE(v),
+				STARTINGZ(v), STARTINGY(v), STARTINGX(v));
+		}
+
+		template <typename T>
+		void add(const char* name, const std::vector<T> &v)
+		{
+			if (!v.empty())
+				add(name, &v[0], v.size() * sizeof(T), 1, 1, 1, v.size());
+		}
+
+		// Keep copies of all arrays, so that the objects they come from may change
+		void makeCopies()
+		{
+			for (size_t i = 0; i < arrays.size(); i++)
+			{
+				arrays[i].copy.assign(arrays[i].ptr, arrays[i].ptr + arrays[i].header.bytes);
+				arrays[i].ptr = &arrays[i].copy[0];
+			}
+		}
+
+		// Write the header and all arrays to fn
+		void write(const FileName &fn)
+		{
+			// The arrays follow the header, each aligned
+			header.nr_arrays = arrays.size();
+			int64_t offset = CHECKPOINT_ALIGNMENT;
+			for (size_t i = 0; i < arrays.size(); i++)
+			{
+				arrays[i].header.offset = offset;
+				header.arrays[i] = arrays[i].header;
+				offset += (arrays[i].header.bytes + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+			}
+
+			FileName fn_tmp = fn + ".tmp";
+			FILE* fp;
+			if ((fp = fopen(fn_tmp.c_str(), "wb")) == NULL)
+				REPORT_ERROR((std::string)"writeCheckpoint: cannot open " + fn_tmp);
+			std::vector<char> first_page(CHECKPOINT_ALIGNMENT, 0);
+			memcpy(&first_page[0], &header, sizeof(CheckpointHeader));
+			bool ok = fwrite(&first_page[0], CHECKPOINT_ALIGNMENT, 1, fp) == 1;
+			for (size_t i = 0; i < arrays.size() && ok; i++)
+			{
+				ok = fseeko(fp, arrays[i].header.offset, SEEK_SET) == 0 &&
+					fwrite(arrays[i].ptr, arrays[i].header.bytes, 1, fp) == 1;
+			}
+			ok = fclose(fp) == 0 && ok;
+			if (!ok)
+			{
+				remove(fn_tmp.c_str());
+				REPORT_ERROR((std::string)"writeCheckpoint: error in writing to " + fn_tmp);
+			}
+#ifdef _WIN32
+			remove(fn.c_str());
+#endif
+			if (rename(fn_tmp.c_str(), fn.c_str()) != 0)
+				REPORT_ERROR((std::string)"writeCheckpoint: cannot rename " + fn_tmp + " to " + fn);
+		}
+	};
+
+	static void describeProjector(const Projector &P, CheckpointData &c)
+	{
+		CheckpointHeader &h = c.header;
+		h.object = CHECKPOINT_PROJECTOR;
+		h.ori_size = P.ori_size;
+		h.pad_size = P.pad_size;
+		h.r_max = P.r_max;
+		h.r_min_nn = P.r_min_nn;
+		h.interpolator = P.interpolator;
+		h.padding_factor = P.padding_factor;
+		h.ref_dim = P.ref_dim;
+		h.data_dim = P.data_dim;
+		h.do_bricked = !P.bricked_data.isEmpty();
+		c.add("data", P.data);
+		if (!P.half_data.isEmpty())
+		{
+			h.half_scale = P.half_data.scale;
+			h.half_xdim = P.half_data.xdim;
+			h.half_ydim = P.half_data.ydim;
+			h.half_zdim = P.half_data.zdim;
+			h.half_starty = P.half_data.starty;
+			h.half_startz = P.half_data.startz;
+			c.add("half_data", P.half_data.values);
+		}
+	}
+
+	static void describeBackProjector(const BackProjector &BP, CheckpointData &c)
+	{
+		describeProjector(BP, c);
+		CheckpointHeader &h = c.header;
+		h.object = CHECKPOINT_BACKPROJECTOR;
+		h.do_compensated_sum = BP.do_compensated_sum;
+		h.do_symmetrise_on_insertion = BP.do_symmetrise_on_insertion;
+		h.do_sparse_storage = BP.do_sparse_storage;
+		c.add("weight", BP.weight);
+		c.add("data_comp", BP.data_comp);
+		c.add("weight_comp", BP.weight_comp);
+		c.add("sparse_offsets", BP.sparse_offsets);
+		c.add("sparse_data", BP.sparse_data);
+		c.add("sparse_data_comp", BP.sparse_data_comp);
+		c.add("sparse_weight", BP.sparse_weight);
+		c.add("sparse_weight_comp", BP.sparse_weight_comp);
+	}
+
+	void writeCheckpoint(const Projector &P, const FileName &fn)
+	{
+		CheckpointData c;
+		describeProjector(P, c);
+		c.write(fn);
+	}
+
+	void writeCheckpoint(const BackProjector &BP, const FileName &fn)
+	{
+		CheckpointData c;
+		describeBackProjector(BP, c);
+		c.write(fn);
+	}
+
+	// An open checkpoint file, for reading its arrays
+	class CheckpointReader
+	{
+	public:
+		FileName fn;
+		FILE* fp;
+		CheckpointHeader header;
+
+		CheckpointReader(const FileName &_fn)
+		{
+			fn = _fn;
+			if ((fp = fopen(fn.c_str(), "rb")) == NULL)
+				REPORT_ERROR((std::string)"readCheckpoint: cannot open " + fn);
+			if (fread(&header, sizeof(CheckpointHeader), 1, fp) != 1)
+			{
+				fclose(fp);
+				REPORT_ERROR((std::string)"readCheckpoint: error in reading header of " + fn);
+			}
+			std::string error;
+			if (memcmp(header.magic, "LLCKPT\0\0", 8) != 0)
+				error = " is not a checkpoint";
+			else if (header.byte_order != CHECKPOINT_BYTE_ORDER)
+				error = " was written on a machine with a different byte order";
+			else if (header.version > CHECKPOINT_VERSION)
+				error = " was written by a newer version of this program";
+			else if (header.real_size != sizeof(DOUBLE))
+				error = " was written by a program with a different floating-point precision";
+			else if (header.nr_arrays < 0 || header.nr_arrays > CHECKPOINT_MAX_ARRAYS)
+				error = " has an invalid header";
+			if (error != "")
+			{
+				fclose(fp);
+				REPORT_ERROR((std::string)"readCheckpoint: " + fn + error);
+			}
+		}
+
+		~CheckpointReader()
+		{
+			fclose(fp);
+		}
+
+		const CheckpointArrayHeader* find(const char* name) const
+		{
+			for (int i = 0; i < header.nr_arrays; i++)
+				if (strncmp(header.arrays[i].name, name, sizeof(header.arrays[i].name)) == 0)
+					return &header.arrays[i];
+			return NULL;
+		}
+
+		void readBytes(const CheckpointArrayHeader* array, void* ptr, size_t bytes)
+		{
+			if ((size_t)array->bytes != bytes)
+				REPORT_ERROR((std::string)"readCheckpoint: invalid size of " + array->name + " in " + fn);
+			if (fseeko(fp, array->offset, SEEK_SET) != 0 || fread(ptr, bytes, 1, fp) != 1)
+				REPORT_ERROR((std::string)"readCheckpoint: error in reading " + array->name + " from " + fn);
+		}
+
+		// Arrays that are not in the file are left empty
+		template <typename T>
+		void read(const char* name, MultidimArray<T> &v)
+		{
+			const CheckpointArrayHeader* array = find(name);
+			if (array == NULL)
+			{
+				v.clear();
+				return;
+			}
+			v.resize(array->ndim, array->zdim, array->ydim, array->xdim);
+			STARTINGZ(v) = array->zinit;
+			STARTINGY(v) = array->yinit;
+			STARTINGX(v) = array->xinit;
+			readBytes(array, MULTIDIM_ARRAY(v), NZYXSIZE(v) * sizeof(T));
+		}
+
+		template <typename T>
+		void read(const char* name, std::vector<T> &v)
+		{
+			const CheckpointArrayHeader* array = find(name);
+			v.clear();
+			if (array == NULL)
+				return;
+			v.resize(array->xdim);
+			readBytes(array, &v[0], v.size() * sizeof(T));
+		}
+	};
+
+	static void restoreProjector(Projector &P, CheckpointReader &reader)
+	{
+		const CheckpointHeader &h = reader.header;
+		P.ori_size = h.ori_size;
+		P.pad_size = h.pad_size;
+		P.r_max = h.r_max;
+		P.r_min_nn = h.r_min_nn;
+		P.interpolator = h.interpolator;
+		P.padding_factor = h.padding_factor;
+		P.ref_dim = h.ref_dim;
+		P.data_dim = h.data_dim;
+		reader.read("data", P.data);
+		P.bricked_data.clear();
+		P.half_data.clear();
+		if (reader.find("half_data") != NULL)
+		{
+			P.half_data.scale = h.half_scale;
+			P.half_data.xdim = h.half_xdim;
+			P.half_data.ydim = h.half_ydim;
+			P.half_data.zdim = h.half_zdim;
+			P.half_data.starty = h.half_starty;
+			P.half_data.startz = h.half_startz;
+			reader.read("half_data", P.half_data.values);
+			if ((long int)P.half_data.values.size() != 2 * P.half_data.xdim * P.half_data.ydim * P.half_data.zdim)
+				REPORT_ERROR((std::string)"readCheckpoint: invalid size of half_data in " + reader.fn);
+		}
+	}
+
+	void readCheckpoint(Projector &P, const FileName &fn, int nr_threads)
+	{
+		CheckpointReader reader(fn);
+		MemoryCategoryScope memory_category(MEMORY_PROJECTOR);
+		P.clear();
+		restoreProjector(P, reader);
+		if (reader.header.do_bricked)
+			P.setBrickedLayout(true, nr_threads);
+	}
+
+	void readCheckpoint(BackProjector &BP, const FileName &fn)
+	{
+		CheckpointReader reader(fn);
+		const CheckpointHeader &h = reader.header;
+		if (h.object != CHECKPOINT_BACKPROJECTOR)
+			REPORT_ERROR((std::string)"readCheckpoint: " + fn + " is not a checkpoint of a BackProjector");
+		if (h.ori_size != BP.ori_size || h.ref_dim != BP.ref_dim || h.interpolator != BP.interpolator ||
+			h.padding_factor != BP.padding_factor)
+			REPORT_ERROR((std::string)"readCheckpoint: the BackProjector in " + fn + " has different parameters");
+
+		MemoryCategoryScope memory_category(MEMORY_BACKPROJECTOR);
+		BP.clear();
+		restoreProjector(BP, reader);
+		BP.do_compensated_sum = h.do_compensated_sum;
+		BP.do_symmetrise_on_insertion = h.do_symmetrise_on_insertion;
+		BP.do_sparse_storage = h.do_sparse_storage;
+		reader.read("weight", BP.weight);
+		reader.read("data_comp", BP.data_comp);
+		reader.read("weight_comp", BP.weight_comp);
+		reader.read("sparse_offsets", BP.sparse_offsets);
+		reader.read("sparse_data", BP.sparse_data);
+		reader.read("sparse_data_comp", BP.sparse_data_comp);
+		reader.read("sparse_weight", BP.sparse_weight);
+		reader.read("sparse_weight_comp", BP.sparse_weight_comp);
+	}
+
+	CheckpointWriter::CheckpointWriter()
+	{
+		pending = NULL;
+		write_error = false;
+		writer_thread = NULL;
+	}
+
+	CheckpointWriter::~CheckpointWriter()
+	{
+		// Do not throw from the destructor: call wait() explicitly to get write errors reported
+		try
+		{
+			wait();
+		}
+		catch (RelionError &)
+		{
+			std::cerr << " CheckpointWriter: error in writing " << fn_pending << std::endl;
+		}
+	}
+
+	void CheckpointWriter::write(const Projector &P, const FileName &fn)
+	{
+		wait();
+		pending = new CheckpointData();
+		describeProjector(P, *pending);
+		start(fn);
+	}
+
+	void CheckpointWriter::write(const BackProjector &BP, const FileName &fn)
+	{
+		wait();
+		pending = new CheckpointData();
+		describeBackProjector(BP, *pending);
+		start(fn);
+	}
+
+	void CheckpointWriter::start(const FileName &fn)
+	{
+		pending->makeCopies();
+		fn_pending = fn;
+		write_error = false;
+		writer_thread = new std::thread(writerThread, this);
+	}
+
+	void CheckpointWriter::writerThread(CheckpointWriter* writer)
+	{
+		try
+		{
+			writer->pending->write(writer->fn_pending);
+		}
+		catch (RelionError &)
+		{
+			writer->write_error = true;
+		}
+	}
+
+	void CheckpointWriter::wait()
+	{
+		if (writer_thread != NULL)
+		{
+			writer_thread->join();
+			delete writer_thread;
+			writer_thread = NULL;
+		}
+		delete pending;
+		pending = NULL;
+		if (write_error)
+		{
+			write_error = false;
+			REPORT_ERROR((std::string)"CheckpointWriter: error in writing " + fn_pending);
+		}
+	}
+}
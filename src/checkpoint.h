@@ -0,0 +1,115 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <thread>
+#include "src/backprojector.h"
+
+namespace relion
+{
+	/** Binary checkpoints of the state of a Projector or a BackProjector
+	 *
+	 * A checkpoint file has a header with the version, ori_size, pad_size, r_max, r_min_nn, interpolator,
+	 * padding_factor, ref_dim and data_dim (and for a BackProjector its storage options), and a table of the arrays
+	 * that follow: data, and for a BackProjector weight and any compensation terms or sparse rows. The arrays are
+	 * stored as they are in memory, each starting at a multiple of 4096 bytes, so that restoring them is a single
+	 * read per array (and the file could be memory-mapped). A file is written under a temporary name and only
+	 * renamed to its final name when complete, so an interrupted write never replaces the previous checkpoint.
+	 *
+	 * The symmetry and the blob table of a BackProjector are not stored: restore into a BackProjector that has
+	 * been constructed with the same parameters.
+	 *
+	 * @code
+	 * CheckpointWriter checkpointer;
+	 * for (int iter = 0; iter < nr_iter; iter++)
+	 * {
+	 *     ... backproject ...
+	 *     checkpointer.write(BPref, "run_bp.ckpt");  // copies the arrays, writes them in the background
+	 * }
+	 * checkpointer.wait();
+	 *
+	 * // after a restart
+	 * BackProjector BPref(ori_size, 3, "C1");
+	 * readCheckpoint(BPref, "run_bp.ckpt");
+	 * @endcode
+	 */
+
+	/// Write the state of P (or BP) to fn (synchronously)
+	void writeCheckpoint(const Projector &P, const FileName &fn);
+	void writeCheckpoint(const BackProjector &BP, const FileName &fn);
+
+	/** Restore P from a checkpoint of a Projector or of a BackProjector (of which only data is read)
+	 * A bricked copy of the data (see Projector::setBrickedLayout) is made again with nr_threads threads.
+	 */
+	void readCheckpoint(Projector &P, const FileName &fn, int nr_threads = 1);
+
+	/** Restore BP from a checkpoint of a BackProjector
+	 * BP should have the ori_size, ref_dim, interpolator and padding_factor of the checkpointed one.
+	 */
+	void readCheckpoint(BackProjector &BP, const FileName &fn);
+
+	// The parameters and arrays of one checkpoint
+	struct CheckpointData;
+
+	/** Writes checkpoints on a background thread
+	 *
+	 * write() copies the arrays (which takes a fraction of the time of writing them), and returns while the copy
+	 * is written to disc. The next write() first waits for the previous one to finish.
+	 */
+	class CheckpointWriter
+	{
+	public:
+		CheckpointWriter();
+
+		// Waits for any write in progress (errors are only printed, call wait() to get them reported)
+		~CheckpointWriter();
+
+		/// Copy the state of P (or BP) and start writing it to fn
+		void write(const Projector &P, const FileName &fn);
+		void write(const BackProjector &BP, const FileName &fn);
+
+		/// Wait for the write in progress (if any) to finish
+		void wait();
+
+		bool isWriting() const
+		{
+			return writer_thread != NULL;
+		}
+
+	private:
+		CheckpointData* pending;
+		FileName fn_pending;
+		bool write_error;
+		std::thread* writer_thread;
+
+		void start(const FileName &fn);
+
+		// Body of the writer thread
+		static void writerThread(CheckpointWriter* writer);
+
+		// Not copyable
+		CheckpointWriter(const CheckpointWriter&);
+		CheckpointWriter& operator=(const CheckpointWriter&);
+	};
+}
+
+#endif
@@ -0,0 +1,709 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <string.h>
+#include <cmath>
+#include "src/compressed_stack.h"
+#include "src/error.h"
+#include "src/instrumentation.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#endif
+
+#define LCS_HEADER_SIZE 64
+#define LCS_VERSION 1
+#define LCS_BYTE_ORDER 0x01020304
+#define LCS_BLOCK 32     // number of values coded with the same predictor and Rice parameter
+#define LCS_ESCAPE 24    // a quotient of (at least) LCS_ESCAPE is followed by the value itself in 32 bits
+#define LCS_MAX_QUANTISED 1073741824.
+
+namespace relion
+{
+	// The file header
+	struct LCShead
+	{
+		char magic[4];           // "LLCS"
+		int32_t byte_order;      // LCS_BYTE_ORDER on the machine that wrote the file
+		int32_t version;
+		int32_t xdim, ydim, zdim;
+		int64_t ndim;            // number of images
+		int64_t index_offset;    // where the ndim + 1 chunk offsets are stored
+		char unused[24];
+	};
+
+	// The start of every chunk
+	enum LCSMode { LCS_RAW = 0, LCS_QUANTISED = 1, LCS_LOSSLESS = 2 };
+	struct LCSchunk
+	{
+		int32_t mode;
+		float step, offset;      // quantised values are offset + q * step
+	};
+
+	// Bits are written from the least significant bit of 32-bit words on
+	class BitWriter
+	{
+	public:
+		std::vector<uint32_t> words;
+
+		BitWriter()
+		{
+			acc = 0;
+			nacc = 0;
+		}
+
+		// Write the nbits (at most 32) lowest bits of bits (all higher bits should be zero)
+		inline void put(uint32_t bits, int nbits)
+		{
+			acc |= (uint64_t)bits << nacc;
+			nacc += nbits;
+			if (nacc >= 32)
+			{
+				words.push_back((uint32_t)acc);
+				acc >>= 32;
+				nacc -= 32;
+			}
+		}
+
+		void flush()
+		{
+			if (nacc > 0)
+				words.push_back((uint32_t)acc);
+			acc = 0;
+			nacc = 0;
+		}
+
+	private:
+		uint64_t acc;
+		int nacc;
+	};
+
+	/* Reads what BitWriter wrote; beyond the end of the data only zero bits are returned
+	 * (The words are read as little-endian bytes, as they are written on all machines with AVX.)
+	 */
+	class BitReader
+	{
+	public:
+		BitReader(const char* _data, size_t _size)
+		{
+			data = _data;
+			size = _size;
+			pos = 0;
+		}
+
+		// The next (at least) 57 bits
+		inline uint64_t peek() const
+		{
+			size_t byte = pos >> 3;
+			uint64_t bits = 0;
+			if (byte + 8 <= size)
+				memcpy(&bits, data + byte, 8);
+			else if (byte < size)
+				memcpy(&bits, data + byte, size - byte);
+			return bits >> (pos & 7);
+		}
+
+		inline void skip(int nbits)
+		{
+			pos += nbits;
+		}
+
+		// Read nbits (at most 32) bits
+		inline uint32_t get(int nbits)
+		{
+			uint32_t bits = (uint32_t)(peek() & (((uint64_t)1 << nbits) - 1));
+			pos += nbits;
+			return bits;
+		}
+
+	private:
+		const char* data;
+		size_t size, pos;
+	};
+
+	static inline int countTrailingZeros(uint64_t x)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, x);
+		return (int)index;
+#else
+		return __builtin_ctzll(x);
+#endif
+	}
+
+	// Signed to unsigned with the small magnitudes first: 0, -1, 1, -2, ...
+	static inline uint32_t zigzag(uint32_t d)
+	{
+		return (d << 1) ^ (uint32_t)((int32_t)d >> 31);
+	}
+
+	static inline uint32_t unzigzag(uint32_t u)
+	{
+		return (u >> 1) ^ (0u - (u & 1));
+	}
+
+	// Number of bits of the Rice code with parameter k of the len values in u
+	static uint64_t riceCost(const uint32_t* u, int len, int k)
+	{
+		uint64_t bits = 0;
+		for (int j = 0; j < len; j++)
+		{
+			uint32_t q = u[j] >> k;
+			bits += (q < LCS_ESCAPE) ? q + 1 + k : LCS_ESCAPE + 32;
+		}
+		return bits;
+	}
+
+	/* Code the n integers in v in blocks of LCS_BLOCK values. Each block starts with 1 bit for the predictor
+	 * (0: none, 1: the previous value) and 5 bits for the Rice parameter k of the zigzagged residuals u.
+	 * Then follow the quotients u >> k of the block in unary (q zeros and a one, or LCS_ESCAPE zeros), and
+	 * after them the k remainder bits of every value (or, after an escape, all its 32 bits). Keeping the
+	 * quotients together lets the decoder read many of them from one 64-bit word.
+	 */
+	static void encodeValues(const int32_t* v, long int n, BitWriter &bw)
+	{
+		uint32_t u_plain[LCS_BLOCK], u_delta[LCS_BLOCK];
+		uint32_t prev = 0;
+		for (long int start = 0; start < n; start += LCS_BLOCK)
+		{
+			int len = (int)XMIPP_MIN((long int)LCS_BLOCK, n - start);
+			uint64_t sum_plain = 0, sum_delta = 0;
+			for (int j = 0; j < len; j++)
+			{
+				uint32_t val = (uint32_t)v[start + j];
+				u_plain[j] = zigzag(val);
+				u_delta[j] = zigzag(val - prev);
+				prev = val;
+				sum_plain += u_plain[j];
+				sum_delta += u_delta[j];
+			}
+			bool use_delta = sum_delta < sum_plain;
+			const uint32_t* u = (use_delta) ? u_delta : u_plain;
+			uint64_t sum = (use_delta) ? sum_delta : sum_plain;
+
+			// The optimal parameter is close to log2 of the mean value
+			int k_mean = 0;
+			while (k_mean < 31 && ((uint64_t)len << (k_mean + 1)) <= sum)
+				k_mean++;
+			int k = k_mean;
+			uint64_t best_cost = riceCost(u, len, k);
+			for (int kk = XMIPP_MAX(0, k_mean - 1); kk <= XMIPP_MIN(31, k_mean + 1); kk++)
+			{
+				uint64_t cost = (kk == k_mean) ? best_cost : riceCost(u, len, kk);
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					k = kk;
+				}
+			}
+
+			bw.put((use_delta ? 1u : 0u) | ((uint32_t)k << 1), 6);
+			for (int j = 0; j < len; j++)
+			{
+				uint32_t q = u[j] >> k;
+				if (q < LCS_ESCAPE)
+					bw.put(1u << q, q + 1);
+				else
+					bw.put(0, LCS_ESCAPE);
+			}
+			uint32_t mask = (1u << k) - 1;
+			for (int j = 0; j < len; j++)
+			{
+				if ((u[j] >> k) < LCS_ESCAPE)
+					bw.put(u[j] & mask, k);
+				else
+					bw.put(u[j], 32);
+			}
+		}
+	}
+
+	static void decodeValues(BitReader &br, long int n, uint32_t* v)
+	{
+		int q[LCS_BLOCK];
+		uint32_t prev = 0;
+		for (long int start = 0; start < n; start += LCS_BLOCK)
+		{
+			int len = (int)XMIPP_MIN((long int)LCS_BLOCK, n - start);
+			uint32_t block = br.get(6);
+			int k = (int)(block >> 1);
+
+			/* The quotients, from a window of 57 bits that is moved on once fewer than 25 are left. The ones
+			 * that end the codes are cleared from the window as they are used, so that the lowest one left
+			 * ends the current code.
+			 */
+			uint64_t bits = br.peek();
+			int used = 0;
+			bool has_escape = false;
+			for (int j = 0; j < len; j++)
+			{
+				if (used > 32)
+				{
+					br.skip(used);
+					bits = br.peek();
+					used = 0;
+				}
+				int qj = (bits == 0) ? LCS_ESCAPE : countTrailingZeros(bits) - used;
+				if (qj < LCS_ESCAPE)
+				{
+					q[j] = qj;
+					used += qj + 1;
+					bits &= bits - 1;
+				}
+				else
+				{
+					q[j] = LCS_ESCAPE;
+					used += LCS_ESCAPE;
+					has_escape = true;
+				}
+			}
+			br.skip(used);
+
+			// The remainders, without escapes also from a window of 57 bits
+			uint32_t* vb = v + start;
+			if (has_escape)
+			{
+				for (int j = 0; j < len; j++)
+					vb[j] = (q[j] < LCS_ESCAPE) ? (((uint32_t)q[j] << k) | br.get(k)) : br.get(32);
+			}
+			else
+			{
+				uint64_t mask = ((uint64_t)1 << k) - 1;
+				bits = br.peek();
+				used = 0;
+				for (int j = 0; j < len; j++)
+				{
+					if (used + k > 57)
+					{
+						br.skip(used);
+						bits = br.peek();
+						used = 0;
+					}
+					vb[j] = ((uint32_t)q[j] << k) | (uint32_t)((bits >> used) & mask);
+					used += k;
+				}
+				br.skip(used);
+			}
+
+			if (block & 1)
+			{
+				for (int j = 0; j < len; j++)
+					vb[j] = prev = prev + unzigzag(vb[j]);
+			}
+			else
+			{
+				for (int j = 0; j < len; j++)
+					vb[j] = unzigzag(vb[j]);
+				if (len > 0)
+					prev = vb[len - 1];
+			}
+		}
+	}
+
+	void compressImage(const float* in, long int n, DOUBLE step, std::vector<char> &chunk)
+	{
+		LCSchunk head;
+		head.mode = LCS_RAW;
+		head.step = head.offset = 0.f;
+
+		std::vector<int32_t> values(n);
+		BitWriter bw;
+		if (step > 0.)
+		{
+			// Quantise around the average value, unless there are values that cannot be quantised
+			bool is_finite = true;
+			double sum = 0.;
+			for (long int i = 0; i < n; i++)
+			{
+				if (!std::isfinite(in[i]))
+					is_finite = false;
+				sum += in[i];
+			}
+			head.step = (float)step;
+			head.offset = (n > 0 && is_finite) ? (float)(sum / n) : 0.f;
+			double inv_step = 1. / head.step;
+			for (long int i = 0; i < n && is_finite; i++)
+			{
+				double q = rint((in[i] - (double)head.offset) * inv_step);
+				if (fabs(q) > LCS_MAX_QUANTISED)
+					is_finite = false;
+				values[i] = (int32_t)q;
+			}
+			if (is_finite)
+			{
+				encodeValues(&values[0], n, bw);
+				head.mode = LCS_QUANTISED;
+			}
+		}
+
+		if (head.mode == LCS_RAW)
+		{
+			// Integer values (not -0) are quantised with step 1, without loss
+			bool is_integer = true;
+			for (long int i = 0; i < n && is_integer; i++)
+			{
+				if (in[i] != rint(in[i]) || fabs(in[i]) > LCS_MAX_QUANTISED || (in[i] == 0.f && std::signbit(in[i])))
+					is_integer = false;
+				else
+					values[i] = (int32_t)in[i];
+			}
+			if (is_integer)
+			{
+				head.mode = LCS_QUANTISED;
+				head.step = 1.f;
+				head.offset = 0.f;
+				encodeValues(&values[0], n, bw);
+			}
+			else
+			{
+				// Floats: exponent and sign as (exponent << 1 | sign), followed by all the mantissas
+				head.mode = LCS_LOSSLESS;
+				head.step = head.offset = 0.f;
+				std::vector<uint32_t> mantissas(n);
+				for (long int i = 0; i < n; i++)
+				{
+					uint32_t bits;
+					memcpy(&bits, &in[i], 4);
+					values[i] = (int32_t)((((bits >> 23) & 0xff) << 1) | (bits >> 31));
+					mantissas[i] = bits & 0x7fffff;
+				}
+				encodeValues(&values[0], n, bw);
+				for (long int i = 0; i < n; i++)
+					bw.put(mantissas[i], 23);
+			}
+		}
+		bw.flush();
+
+		size_t payload_size = bw.words.size() * sizeof(uint32_t);
+		if (payload_size >= n * sizeof(float))
+		{
+			head.mode = LCS_RAW;
+			head.step = head.offset = 0.f;
+			payload_size = n * sizeof(float);
+		}
+		chunk.resize(sizeof(LCSchunk) + payload_size);
+		memcpy(&chunk[0], &head, sizeof(LCSchunk));
+		if (payload_size > 0)
+			memcpy(&chunk[sizeof(LCSchunk)], (head.mode == LCS_RAW) ? (const void*)in : (const void*)&bw.words[0], payload_size);
+	}
+
+	// Returns false for a chunk that cannot have been made by compressImage for n values
+	static bool decodeChunk(const char* chunk, size_t size, long int n, float* out)
+	{
+		if (size < sizeof(LCSchunk))
+			return false;
+		LCSchunk head;
+		memcpy(&head, chunk, sizeof(LCSchunk));
+		const char* payload = chunk + sizeof(LCSchunk);
+		size_t payload_size = size - sizeof(LCSchunk);
+
+		switch (head.mode)
+		{
+		case LCS_RAW:
+			if (payload_size != n * sizeof(float))
+				return false;
+			if (n > 0)
+				memcpy(out, payload, payload_size);
+			break;
+		case LCS_QUANTISED:
+		{
+			std::vector<uint32_t> values(n);
+			BitReader br(payload, payload_size);
+			decodeValues(br, n, &values[0]);
+			double step = head.step, offset = head.offset;
+			for (long int i = 0; i < n; i++)
+				out[i] = (float)(offset + (int32_t)values[i] * step);
+			break;
+		}
+		case LCS_LOSSLESS:
+		{
+			std::vector<uint32_t> values(n);
+			BitReader br(payload, payload_size);
+			decodeValues(br, n, &values[0]);
+			for (long int i = 0; i < n; i++)
+			{
+				uint32_t bits = ((values[i] & 1) << 31) | (((values[i] >> 1) & 0xff) << 23) | br.get(23);
+				memcpy(&out[i], &bits, 4);
+			}
+			break;
+		}
+		default:
+			return false;
+		}
+		return true;
+	}
+
+	void decompressImage(const char* chunk, size_t size, long int n, float* out)
+	{
+		if (!decodeChunk(chunk, size, n, out))
+			REPORT_ERROR("decompressImage: invalid compressed image");
+	}
+
+	bool isCompressedStack(const FileName &fn)
+	{
+		return fn.getFileFormat() == "lcs";
+	}
+
+	CompressedStackFile::CompressedStackFile()
+	{
+		fimg = NULL;
+		owns_file = is_modified = false;
+		xdim = ydim = zdim = 0;
+		offsets.assign(1, LCS_HEADER_SIZE);
+	}
+
+	CompressedStackFile::~CompressedStackFile()
+	{
+		// Do not throw from the destructor: call close() explicitly to get write errors reported
+		try
+		{
+			close();
+		}
+		catch (RelionError &)
+		{
+			std::cerr << " CompressedStackFile: error in writing to " << fn << std::endl;
+		}
+	}
+
+	void CompressedStackFile::open(const FileName &fn_stack, bool for_append)
+	{
+		close();
+		std::unique_ptr<FILE, FileCloser> fp(fopen(fn_stack.c_str(), (for_append) ? "r+b" : "rb"));
+		if (!fp)
+			REPORT_ERROR((std::string)"CompressedStackFile::open: cannot open " + fn_stack);
+		open(fp.get(), fn_stack);
+		fp.release();
+		owns_file = true;
+	}
+
+	void CompressedStackFile::open(FILE* fp, const FileName &fn_stack)
+	{
+		close();
+		fimg = fp;
+		fn = fn_stack;
+		owns_file = false;
+		try
+		{
+			readHeader();
+		}
+		catch (RelionError &)
+		{
+			// Leave the file to the caller
+			fimg = NULL;
+			xdim = ydim = zdim = 0;
+			offsets.assign(1, LCS_HEADER_SIZE);
+			throw;
+		}
+	}
+
+	void CompressedStackFile::create(const FileName &fn_stack, long int _xdim, long int _ydim, long int _zdim)
+	{
+		close();
+		std::unique_ptr<FILE, FileCloser> fp(fopen(fn_stack.c_str(), "wb"));
+		if (!fp)
+			REPORT_ERROR((std::string)"CompressedStackFile::create: cannot open " + fn_stack);
+		create(fp.get(), fn_stack, _xdim, _ydim, _zdim);
+		fp.release();
+		owns_file = true;
+	}
+
+	void CompressedStackFile::create(FILE* fp, const FileName &fn_stack, long int _xdim, long int _ydim, long int _zdim)
+	{
+		close();
+		if (_xdim <= 0 || _ydim <= 0 || _zdim <= 0)
+			REPORT_ERROR("CompressedStackFile::create: invalid image dimensions");
+		fimg = fp;
+		fn = fn_stack;
+		owns_file = false;
+		xdim = _xdim;
+		ydim = _ydim;
+		zdim = _zdim;
+		offsets.assign(1, LCS_HEADER_SIZE);
+
+		// Placeholder for the header, which is written at close()
+		try
+		{
+			writeHeader();
+		}
+		catch (RelionError &)
+		{
+			fimg = NULL;
+			xdim = ydim = zdim = 0;
+			throw;
+		}
+		is_modified = true;
+	}
+
+	void CompressedStackFile::close()
+	{
+		if (fimg == NULL)
+			return;
+
+		bool ok = true;
+		if (is_modified)
+		{
+			// The index follows the last chunk
+			long int ndim = getStackSize();
+			ok = fseeko(fimg, offsets[ndim], SEEK_SET) == 0 &&
+				fwrite(&offsets[0], sizeof(uint64_t), ndim + 1, fimg) == (size_t)(ndim + 1);
+			if (ok)
+			{
+				try
+				{
+					writeHeader();
+				}
+				catch (RelionError &)
+				{
+					ok = false;
+				}
+			}
+			ok = fflush(fimg) == 0 && ok;
+		}
+		if (owns_file)
+			ok = fclose(fimg) == 0 && ok;
+		fimg = NULL;
+		owns_file = is_modified = false;
+		xdim = ydim = zdim = 0;
+		offsets.assign(1, LCS_HEADER_SIZE);
+		if (!ok)
+			REPORT_ERROR((std::string)"CompressedStackFile::close: error in writing to " + fn);
+	}
+
+	void CompressedStackFile::readHeader()
+	{
+		LCShead header;
+		if (fseeko(fimg, 0, SEEK_SET) != 0 || fread(&header, sizeof(LCShead), 1, fimg) != 1)
+			REPORT_ERROR((std::string)"CompressedStackFile: error in reading header of " + fn);
+		if (strncmp(header.magic, "LLCS", 4) != 0)
+			REPORT_ERROR((std::string)"CompressedStackFile: " + fn + " is not a compressed stack");
+		if (header.byte_order != LCS_BYTE_ORDER)
+			REPORT_ERROR((std::string)"CompressedStackFile: " + fn + " was written on a machine with a different byte order");
+		if (header.version > LCS_VERSION)
+			REPORT_ERROR((std::string)"CompressedStackFile: " + fn + " was written by a newer version of this program");
+		if (header.xdim <= 0 || header.ydim <= 0 || header.zdim <= 0 || header.ndim < 0)
+			REPORT_ERROR((std::string)"CompressedStackFile: invalid header in " + fn);
+
+		xdim = header.xdim;
+		ydim = header.ydim;
+		zdim = header.zdim;
+		offsets.resize(header.ndim + 1);
+		if (fseeko(fimg, header.index_offset, SEEK_SET) != 0 ||
+			fread(&offsets[0], sizeof(uint64_t), header.ndim + 1, fimg) != (size_t)(header.ndim + 1))
+			REPORT_ERROR((std::string)"CompressedStackFile: error in reading the index of " + fn);
+
+		// Every chunk has at least its own header
+		bool ok = offsets[0] == LCS_HEADER_SIZE && offsets[header.ndim] == (uint64_t)header.index_offset;
+		for (long int i = 0; i < header.ndim && ok; i++)
+			ok = offsets[i + 1] >= offsets[i] + sizeof(LCSchunk);
+		if (!ok)
+			REPORT_ERROR((std::string)"CompressedStackFile: invalid index in " + fn);
+	}
+
+	void CompressedStackFile::writeHeader()
+	{
+		LCShead header;
+		memset(&header, 0, sizeof(LCShead));
+		memcpy(header.magic, "LLCS", 4);
+		header.byte_order = LCS_BYTE_ORDER;
+		header.version = LCS_VERSION;
+		header.xdim = xdim;
+		header.ydim = ydim;
+		header.zdim = zdim;
+		header.ndim = getStackSize();
+		header.index_offset = offsets.back();
+		if (fseeko(fimg, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(LCShead), 1, fimg) != 1)
+			REPORT_ERROR((std::string)"CompressedStackFile: error in writing header of " + fn);
+	}
+
+	bool CompressedStackFile::readChunks(long int first, long int count, std::vector<char> &raw)
+	{
+		if (fimg == NULL || first < 0 || count < 0 || first + count > getStackSize())
+			return false;
+		size_t size = getCompressedSize(first, count);
+		raw.resize(size);
+		if (fseeko(fimg, offsets[first], SEEK_SET) != 0)
+			return false;
+		INSTRUMENT_COUNT(COUNT_BYTES_READ, size);
+		return size == 0 || fread(&raw[0], size, 1, fimg) == 1;
+	}
+
+	void CompressedStackFile::decompressChunks(long int first, long int count, const std::vector<char> &raw,
+		float* out, int nr_threads) const
+	{
+		if (first < 0 || count < 0 || first + count > getStackSize() || raw.size() != getCompressedSize(first, count))
+			REPORT_ERROR("CompressedStackFile::decompressChunks: the data do not correspond to these images");
+
+		long int image_size = getImageSize();
+		bool ok = true;
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int i = 0; i < count; i++)
+		{
+			size_t start = offsets[first + i] - offsets[first];
+			size_t size = offsets[first + i + 1] - offsets[first + i];
+			if (!decodeChunk(&raw[start], size, image_size, out + i * image_size))
+				ok = false;
+		}
+		if (!ok)
+			REPORT_ERROR((std::string)"CompressedStackFile: invalid compressed image in " + fn);
+	}
+
+	void CompressedStackFile::read(long int first, long int count, float* out, int nr_threads)
+	{
+		std::vector<char> raw;
+		if (!readChunks(first, count, raw))
+			REPORT_ERROR((std::string)"CompressedStackFile::read: error in reading data of " + fn);
+		decompressChunks(first, count, raw, out, nr_threads);
+	}
+
+	void CompressedStackFile::append(const float* in, long int count, DOUBLE step, int nr_threads)
+	{
+		// Compress batches of images in parallel, and write them in order
+		long int image_size = getImageSize();
+		long int batch_size = 64 * XMIPP_MAX(1, nr_threads);
+		std::vector< std::vector<char> > chunks(XMIPP_MIN(count, batch_size));
+		for (long int first = 0; first < count; first += batch_size)
+		{
+			long int nr = XMIPP_MIN(batch_size, count - first);
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int i = 0; i < nr; i++)
+				compressImage(in + (first + i) * image_size, image_size, step, chunks[i]);
+			for (long int i = 0; i < nr; i++)
+				appendChunk(chunks[i]);
+		}
+	}
+
+	void CompressedStackFile::appendChunk(const std::vector<char> &chunk)
+	{
+		if (fimg == NULL)
+			REPORT_ERROR("CompressedStackFile::appendChunk: no stack has been opened");
+		if (chunk.size() < sizeof(LCSchunk))
+			REPORT_ERROR("CompressedStackFile::appendChunk: invalid compressed image");
+
+		// (this overwrites the index, which is written again at close())
+		is_modified = true;
+		if (fseeko(fimg, offsets.back(), SEEK_SET) != 0 || fwrite(&chunk[0], chunk.size(), 1, fimg) != 1)
+			REPORT_ERROR((std::string)"CompressedStackFile::appendChunk: error in writing to " + fn);
+		offsets.push_back(offsets.back() + chunk.size());
+	}
+}
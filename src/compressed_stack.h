@@ -0,0 +1,156 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef COMPRESSED_STACK_H
+#define COMPRESSED_STACK_H
+
+#include <vector>
+#include <stdint.h>
+#include "src/filename.h"
+#include "src/macros.h"
+
+namespace relion
+{
+	/** Compressed image stacks (.lcs)
+	 *
+	 * A stack of float images, each stored as a separately compressed chunk, so that any range of images can be
+	 * read with a single seek and read and decoded in parallel. The file has a 64-byte header, the chunks in
+	 * image order, and at the end an index with the offset of every chunk.
+	 *
+	 * A chunk is stored in one of three ways, whichever is smallest:
+	 * - quantised: the integers q = ROUND((x - offset) / step), which reconstructs every value to within step / 2
+	 *   (apart from float rounding). Images with only integer values (e.g. counting data) are stored like this
+	 *   with step 1, i.e. without any loss.
+	 * - lossless: the sign and exponent of every float are coded as integers, the 23 mantissa bits are stored as they are.
+	 * - raw floats.
+	 * The integers are coded in blocks of 32, each block either as they are or as differences to the previous value,
+	 * with a Rice code whose parameter is chosen per block. No compression library is needed to read or write them.
+	 *
+	 * Image::read and Image::write use this format for files with the extension .lcs (all writes are lossless);
+	 * ImageStackReader and ImageStackWriter support it as well, the latter also with quantisation.
+	 */
+
+	/** Compress the n floats of one image into chunk (which is resized to the compressed size)
+	 * step > 0 quantises the values to within step / 2, step = 0 compresses without any loss.
+	 */
+	void compressImage(const float* in, long int n, DOUBLE step, std::vector<char> &chunk);
+
+	/** Decompress a chunk of size bytes (made by compressImage) into the n floats of out
+	 */
+	void decompressImage(const char* chunk, size_t size, long int n, float* out);
+
+	/// True if fn has the extension of a compressed stack (.lcs)
+	bool isCompressedStack(const FileName &fn);
+
+	/** A compressed stack on disc
+	 *
+	 * @code
+	 * CompressedStackFile out;
+	 * out.create("particles.lcs", 128, 128);
+	 * out.append(MULTIDIM_ARRAY(stack), NSIZE(stack), 0.01, nr_threads);
+	 * out.close();  // writes the index
+	 *
+	 * CompressedStackFile in;
+	 * in.open("particles.lcs");
+	 * std::vector<float> images(256 * in.getImageSize());
+	 * in.read(0, 256, &images[0], nr_threads);
+	 * @endcode
+	 */
+	class CompressedStackFile
+	{
+	public:
+		CompressedStackFile();
+
+		// Closes the file, if still open (errors are only printed, call close() to get them reported)
+		~CompressedStackFile();
+
+		/** Open an existing stack and read its header and index
+		 * With for_append, images can be appended to it.
+		 */
+		void open(const FileName &fn_stack, bool for_append = false);
+
+		/// Create (or overwrite) a stack for images of xdim x ydim x zdim pixels
+		void create(const FileName &fn_stack, long int xdim, long int ydim, long int zdim = 1);
+
+		/** As above, but on a file that has already been opened (for reading, or for writing from its start)
+		 * The file is not closed by close().
+		 */
+		void open(FILE* fp, const FileName &fn_stack);
+		void create(FILE* fp, const FileName &fn_stack, long int xdim, long int ydim, long int zdim = 1);
+
+		/// Write the index and the header (if any images have been appended) and close the file
+		void close();
+
+		bool isOpen() const
+		{
+			return fimg != NULL;
+		}
+
+		// Image dimensions, number of pixels per image and number of images
+		long int getXdim() const { return xdim; }
+		long int getYdim() const { return ydim; }
+		long int getZdim() const { return zdim; }
+		long int getImageSize() const { return xdim * ydim * zdim; }
+		long int getStackSize() const { return (long int)offsets.size() - 1; }
+
+		// Compressed size in bytes of images first ... first + count - 1
+		size_t getCompressedSize(long int first, long int count) const
+		{
+			return offsets[first + count] - offsets[first];
+		}
+
+		/** Read the chunks of images first ... first + count - 1 into raw, with a single seek and read
+		 * Returns false on an I/O error.
+		 */
+		bool readChunks(long int first, long int count, std::vector<char> &raw);
+
+		/** Decompress the chunks read by readChunks(first, count, raw) into count images in out
+		 */
+		void decompressChunks(long int first, long int count, const std::vector<char> &raw, float* out, int nr_threads = 1) const;
+
+		/// readChunks and decompressChunks
+		void read(long int first, long int count, float* out, int nr_threads = 1);
+
+		/** Compress count images from in (see compressImage) and append them to the stack
+		 */
+		void append(const float* in, long int count, DOUBLE step = 0., int nr_threads = 1);
+
+		/// Append one chunk made by compressImage
+		void appendChunk(const std::vector<char> &chunk);
+
+	private:
+		FileName fn;
+		FILE* fimg;
+		bool owns_file, is_modified;
+		long int xdim, ydim, zdim;
+
+		// Offset in the file of each chunk, and of the end of the last one (where the index is)
+		std::vector<uint64_t> offsets;
+
+		void readHeader();
+		void writeHeader();
+
+		// Not copyable
+		CompressedStackFile(const CompressedStackFile&);
+		CompressedStackFile& operator=(const CompressedStackFile&);
+	};
+}
+
+#endif
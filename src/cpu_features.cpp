@@ -0,0 +1,124 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/cpu_features.h"
+#include "src/simd_kernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace relion
+{
+	static SimdLevel detectCpuSimdLevel()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		int max_leaf = info[0];
+		__cpuid(info, 1);
+		bool has_fma = (info[2] & (1 << 12)) != 0;
+		bool has_f16c = (info[2] & (1 << 29)) != 0;
+		bool has_osxsave = (info[2] & (1 << 27)) != 0;
+		bool has_avx = (info[2] & (1 << 28)) != 0;
+		if (!has_osxsave || !has_avx)
+			return SIMD_SCALAR;
+
+		// The operating system should save the AVX (and AVX-512) registers
+		unsigned long long xcr0 = _xgetbv(0);
+		if ((xcr0 & 0x6) != 0x6)
+			return SIMD_SCALAR;
+		if (max_leaf < 7)
+			return SIMD_AVX;
+
+		__cpuidex(info, 7, 0);
+		bool has_avx2 = (info[1] & (1 << 5)) != 0;
+		bool has_avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 17)) != 0 && (info[1] & (1UL << 31)) != 0;
+		if (!has_avx2 || !has_fma || !has_f16c)
+			return SIMD_AVX;
+		if (!has_avx512 || (xcr0 & 0xE6) != 0xE6)
+			return SIMD_AVX2;
+		return SIMD_AVX512;
+#else
+		// (these also check that the operating system supports the registers)
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx"))
+			return SIMD_SCALAR;
+		if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma") || !__builtin_cpu_supports("f16c"))
+			return SIMD_AVX;
+		if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512dq") || !__builtin_cpu_supports("avx512vl"))
+			return SIMD_AVX2;
+		return SIMD_AVX512;
+#endif
+	}
+
+	SimdLevel getCpuSimdLevel()
+	{
+		static const SimdLevel level = detectCpuSimdLevel();
+		return level;
+	}
+
+	static SimdLevel getDefaultSimdLevel()
+	{
+		SimdLevel level = getCpuSimdLevel();
+		const char *env = getenv("RELION_SIMD");
+		if (env != NULL)
+		{
+			for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++)
+				if (strcmp(env, getSimdLevelName((SimdLevel)l)) == 0 && l < level)
+					level = (SimdLevel)l;
+		}
+		return level;
+	}
+
+	static SimdLevel& activeSimdLevel()
+	{
+		static SimdLevel level = getDefaultSimdLevel();
+		return level;
+	}
+
+	SimdLevel getSimdLevel()
+	{
+		return activeSimdLevel();
+	}
+
+	void setSimdLevel(SimdLevel level)
+	{
+		if (level > getCpuSimdLevel())
+			level = getCpuSimdLevel();
+		activeSimdLevel() = level;
+		updateSimdKernels();
+	}
+
+	const char* getSimdLevelName(SimdLevel level)
+	{
+		switch (level)
+		{
+		case SIMD_SCALAR: return "scalar";
+		case SIMD_AVX: return "avx";
+		case SIMD_AVX2: return "avx2";
+		case SIMD_AVX512: return "avx512";
+		}
+		return "unknown";
+	}
+}
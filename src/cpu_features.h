@@ -0,0 +1,55 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+namespace relion
+{
+	/** Instruction-set levels for which there are kernels (see SimdKernels)
+	 * Every level includes the ones below it. The library itself is compiled for AVX;
+	 * only the kernels of the higher levels are compiled for (and called on) newer CPUs.
+	 */
+	enum SimdLevel
+	{
+		SIMD_SCALAR = 0, // plain C++
+		SIMD_AVX = 1,
+		SIMD_AVX2 = 2,   // AVX2 + FMA + F16C (Haswell and later)
+		SIMD_AVX512 = 3  // AVX-512 F, DQ, VL (Skylake-X and later)
+	};
+
+	/// The highest level the CPU (and operating system) we are running on supports (checked once)
+	SimdLevel getCpuSimdLevel();
+
+	/** The level that is used: the CPU level, unless lowered by the environment variable RELION_SIMD
+	 * (scalar, avx, avx2 or avx512) or by setSimdLevel
+	 */
+	SimdLevel getSimdLevel();
+
+	/** Use the kernels of (at most) level
+	 * Levels above getCpuSimdLevel() are lowered to it. Call this before any kernel is running.
+	 */
+	void setSimdLevel(SimdLevel level);
+
+	/// "scalar", "avx", "avx2" or "avx512"
+	const char* getSimdLevelName(SimdLevel level);
+}
+
+#endif
@@ -44,6 +44,7 @@
 
 #include "src/ctf.h"
 #include "src/fftw.h"
+#include "src/simd_kernels.h"
 
 namespace relion
 {
@@ -77,6 +78,7 @@ namespace relion
 		DeltafU = DeltafV = azimuthal_angle = 0;
 		Cs = Bfac = 0;
 		Q0 = 0;
+		PhaseShift = 0;
 		scale = 1;
 	}
 
@@ -119,21 +121,76 @@ namespace relion
 
 	}
 
-	/* Generate a complete CTF Image ------------------------------------------------------ */
-	void CTF::getFftwImage(MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
-		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping)
+	/* Frequency terms of an FFTW image -------------------------------------------------- */
+	void CTFFrequencyTable::initialise(long int _xdim, long int _ydim, int _orixdim, int _oriydim, DOUBLE _angpix)
 	{
+		if (_xdim == xdim && _ydim == ydim && _orixdim == orixdim && _oriydim == oriydim && _angpix == angpix)
+			return;
+
+		xdim = _xdim;
+		ydim = _ydim;
+		orixdim = _orixdim;
+		oriydim = _oriydim;
+		angpix = _angpix;
+		u2.resize(xdim * ydim);
+		c2.resize(xdim * ydim);
+		s2.resize(xdim * ydim);
 
 		DOUBLE xs = (DOUBLE)orixdim * angpix;
 		DOUBLE ys = (DOUBLE)oriydim * angpix;
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(result)
+		MultidimArray<DOUBLE> dummy;
+		dummy.setDimensions(xdim, ydim, 1, 1); // only for the loop bounds
+		long int n = 0;
+		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(dummy)
 		{
 			DOUBLE x = (DOUBLE)jp / xs;
 			DOUBLE y = (DOUBLE)ip / ys;
-			DIRECT_A2D_ELEM(result, i, j) = getCTF(x, y, do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping);
+			DOUBLE my_u2 = x * x + y * y;
+			u2[n] = my_u2;
+			c2[n] = (my_u2 > 0.) ? (x * x - y * y) / my_u2 : 0.;
+			s2[n] = (my_u2 > 0.) ? 2. * x * y / my_u2 : 0.;
+			n++;
 		}
 	}
 
+	/* CTF values of many frequencies ------------------------------------------------------ */
+	void CTF::getCTFs(const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out,
+		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping) const
+	{
+		CTFRowParams p;
+		p.K1 = K1;
+		p.K2 = K2;
+		p.K4 = K4;
+		p.defocus_average = defocus_average;
+		p.defocus_deviation = defocus_deviation;
+		// cos(2 * (angle - azimuth)) = c2 * cos(2 * azimuth) + s2 * sin(2 * azimuth)
+		p.cos2az = cos(2. * rad_azimuth);
+		p.sin2az = sin(2. * rad_azimuth);
+		p.rad_phaseshift = rad_phaseshift;
+		// -(K3 * sin(argument) - Q0 * cos(argument)) = sin(amplitude_phase - argument), as K3 = cos(amplitude_phase) and Q0 = sin(amplitude_phase)
+		p.amplitude_phase = asin(Q0);
+		p.scale = scale;
+		p.do_abs = do_abs;
+		p.do_only_flip_phases = do_only_flip_phases;
+		p.do_intact_until_first_peak = do_intact_until_first_peak;
+		p.do_damping = do_damping;
+
+		getSimdKernels().ctf_row(p, u2, c2, s2, n, out);
+	}
+
+	/* Generate a complete CTF Image ------------------------------------------------------ */
+	void CTF::getFftwImage(MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
+		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping) const
+	{
+		// Images of the same size are mostly requested many times (one table per thread)
+		static thread_local CTFFrequencyTable table;
+		if (NZYXSIZE(result) == 0)
+			return;
+		table.initialise(XSIZE(result), YSIZE(result), orixdim, oriydim, angpix);
+		getCTFs(&table.u2[0], &table.c2[0], &table.s2[0], XSIZE(result) * YSIZE(result), MULTIDIM_ARRAY(result),
+			do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping);
+	}
+
 	void CTF::getCenteredImage(MultidimArray<DOUBLE> &result, DOUBLE Tm,
 		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping)
 	{
@@ -149,4 +206,102 @@ namespace relion
 		}
 
 	}
-}
\ No newline at end of file
+
+	/* CTF image cache -------------------------------------------------------------------- */
+	CTFImageCache::CTFImageCache(size_t _max_bytes)
+	{
+		max_bytes = _max_bytes;
+		nr_bytes = 0;
+		nr_hits = nr_misses = 0;
+	}
+
+	void CTFImageCache::setMemoryBudget(size_t _max_bytes)
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		max_bytes = _max_bytes;
+		shrink();
+	}
+
+	void CTFImageCache::clear()
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		images.clear();
+		index.clear();
+		nr_bytes = 0;
+	}
+
+	bool CTFImageCache::Key::operator<(const Key &other) const
+	{
+		// Byte-wise, so that NaN parameters still give a strict ordering
+		int cmp = memcmp(values, other.values, sizeof(values));
+		if (cmp != 0)
+			return cmp < 0;
+		return memcmp(sizes, other.sizes, sizeof(sizes)) < 0;
+	}
+
+	CTFImageCache::Key CTFImageCache::getKey(const CTF &ctf, const MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
+		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping)
+	{
+		Key key;
+		memset(&key, 0, sizeof(key));
+		DOUBLE *v = key.values;
+		v[0] = ctf.DeltafU;
+		v[1] = ctf.DeltafV;
+		v[2] = ctf.azimuthal_angle;
+		v[3] = ctf.kV;
+		v[4] = ctf.Cs;
+		v[5] = ctf.Q0;
+		v[6] = ctf.Bfac;
+		v[7] = ctf.PhaseShift;
+		v[8] = ctf.scale;
+		v[9] = angpix;
+		long int *s = key.sizes;
+		s[0] = XSIZE(result);
+		s[1] = YSIZE(result);
+		s[2] = orixdim;
+		s[3] = oriydim;
+		s[4] = do_abs + 2 * do_only_flip_phases + 4 * do_intact_until_first_peak + 8 * do_damping;
+		return key;
+	}
+
+	void CTFImageCache::getFftwImage(const CTF &ctf, MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
+		bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping)
+	{
+		Key key = getKey(ctf, result, orixdim, oriydim, angpix, do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping);
+		{
+			std::unique_lock<std::mutex> lock(cache_mutex);
+			std::map<Key, ImageList::iterator>::iterator it = index.find(key);
+			if (it != index.end())
+			{
+				// Move to the front of the list
+				images.splice(images.begin(), images, it->second);
+				const MultidimArray<DOUBLE> &img = it->second->second;
+				memcpy(MULTIDIM_ARRAY(result), MULTIDIM_ARRAY(img), NZYXSIZE(img) * sizeof(DOUBLE));
+				nr_hits++;
+				return;
+			}
+			nr_misses++;
+		}
+
+		ctf.getFftwImage(result, orixdim, oriydim, angpix, do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping);
+
+		size_t image_bytes = NZYXSIZE(result) * sizeof(DOUBLE);
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		if (image_bytes > max_bytes || index.find(key) != index.end())
+			return; // too large to cache, or meanwhile calculated by another thread
+		images.push_front(std::make_pair(key, result));
+		index[key] = images.begin();
+		nr_bytes += image_bytes;
+		shrink();
+	}
+
+	void CTFImageCache::shrink()
+	{
+		while (nr_bytes > max_bytes && !images.empty())
+		{
+			nr_bytes -= NZYXSIZE(images.back().second) * sizeof(DOUBLE);
+			index.erase(images.back().first);
+			images.pop_back();
+		}
+	}
+}
@@ -47,10 +47,31 @@
 
 #include "src/multidim_array.h"
 #include <map>
+#include <list>
+#include <vector>
+#include <mutex>
 
 
 namespace relion
 {
+	/** CTF-independent terms of all pixels of an FFTW-format CTF image (see CTF::getFftwImage)
+	 * For the spatial frequency (X, Y) of each pixel: u2 = X^2 + Y^2,
+	 * and the cosine and sine of twice its angle with the X-axis: c2 = (X^2 - Y^2) / u2 and s2 = 2XY / u2 (both 0 at the origin).
+	 */
+	class CTFFrequencyTable
+	{
+	public:
+		long int xdim, ydim;
+		int orixdim, oriydim;
+		DOUBLE angpix;
+		std::vector<DOUBLE> u2, c2, s2;
+
+		CTFFrequencyTable() : xdim(0), ydim(0), orixdim(0), oriydim(0), angpix(0.) {}
+
+		/// Fill the table for xdim x ydim FFTW images of orixdim x oriydim images with pixel size angpix (if it is not filled for these already)
+		void initialise(long int xdim, long int ydim, int orixdim, int oriydim, DOUBLE angpix);
+	};
+
 	class CTF
 	{
 	protected:
@@ -183,6 +204,12 @@ namespace relion
 			return scale * retval;
 		}
 
+		/** Compute the CTF at n frequencies, given by their terms u2, c2 and s2 (see CTFFrequencyTable)
+		 * Gives the same values as getCTF, but avoids atan2, and calculates 8 values at a time with polynomial sin and exp.
+		 */
+		void getCTFs(const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out,
+			bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false, bool do_damping = true) const;
+
 		/// Compute Deltaf at a given direction
 		inline DOUBLE getDeltaF(DOUBLE X, DOUBLE Y) const
 		{
@@ -207,7 +234,7 @@ namespace relion
 		/// Generate (Fourier-space, i.e. FFTW format) image with all CTF values.
 		/// The dimensions of the result array should have been set correctly already
 		void getFftwImage(MultidimArray < DOUBLE > &result, int orixdim, int oriydim, DOUBLE angpix,
-			bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false, bool do_damping = true);
+			bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false, bool do_damping = true) const;
 
 		/// Generate a centered image (with hermitian symmetry)
 		void getCenteredImage(MultidimArray < DOUBLE > &result, DOUBLE angpix,
@@ -215,6 +242,75 @@ namespace relion
 
 
 	};
+
+	/** Least-recently-used cache of FFTW-format CTF images
+	 *
+	 * All particles of a micrograph share their CTF parameters, so when they are processed in micrograph order
+	 * (e.g. after MetaDataTable::newSort on EMDL_MICROGRAPH_NAME) their CTF images only need to be calculated once.
+	 * Images are identified by all CTF parameters, the image size, the pixel size and the flags of CTF::getFftwImage.
+	 * When the cached images take more than the memory budget, the least recently used ones are removed.
+	 * All functions are thread-safe; images are calculated outside of the lock.
+	 *
+	 * @code
+	 * CTFImageCache ctf_cache(64 * 1024 * 1024);
+	 * for (long int ipart = 0; ipart < nr_particles; ipart++)
+	 * {
+	 *     ctf.setValues(...);
+	 *     ctf_cache.getFftwImage(ctf, Fctf, ori_size, ori_size, angpix);
+	 * }
+	 * @endcode
+	 */
+	class CTFImageCache
+	{
+	public:
+		/// Cache at most max_bytes of CTF images
+		CTFImageCache(size_t max_bytes = 256 * 1024 * 1024);
+
+		/// Change the memory budget (removes the least recently used images if needed)
+		void setMemoryBudget(size_t max_bytes);
+
+		/// Remove all images
+		void clear();
+
+		/** Same as ctf.getFftwImage(result, ...), but using (or adding to) the cache
+		 * The dimensions of the result array should have been set correctly already
+		 */
+		void getFftwImage(const CTF &ctf, MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
+			bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false, bool do_damping = true);
+
+		/// Number of images that were taken from the cache and that had to be calculated
+		long int getNrHits() const { return nr_hits; }
+		long int getNrMisses() const { return nr_misses; }
+
+	private:
+		// Everything the CTF image depends on
+		struct Key
+		{
+			// CTF parameters and pixel size
+			DOUBLE values[10];
+			// Size of the result and of the original image, and the flags (exact, unlike in a DOUBLE)
+			long int sizes[5];
+			bool operator<(const Key &other) const;
+		};
+		static Key getKey(const CTF &ctf, const MultidimArray<DOUBLE> &result, int orixdim, int oriydim, DOUBLE angpix,
+			bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak, bool do_damping);
+
+		// Images, most recently used first, and where each key is in that list
+		typedef std::list< std::pair<Key, MultidimArray<DOUBLE> > > ImageList;
+		ImageList images;
+		std::map<Key, ImageList::iterator> index;
+
+		size_t max_bytes, nr_bytes;
+		long int nr_hits, nr_misses;
+		std::mutex cache_mutex;
+
+		// Remove the least recently used images until they fit into max_bytes (call with cache_mutex locked)
+		void shrink();
+
+		// Not copyable
+		CTFImageCache(const CTFImageCache&);
+		CTFImageCache& operator=(const CTFImageCache&);
+	};
 }
 //@}
 #endif
@@ -0,0 +1,292 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/cuda_backend.h"
+
+namespace relion
+{
+#ifndef RELION_CUDA
+	// Without LIBLION_CUDA there are no kernels: the classes compile against these, which report an error
+	static void reportNoCuda()
+	{
+		REPORT_ERROR("liblion was built without the CUDA backend (configure with -DLIBLION_CUDA=ON)");
+	}
+
+	int cudaGetNrDevices()
+	{
+		return 0;
+	}
+
+	CudaReferenceTexture* cudaCreateReferenceTexture(const float * /*data*/, int /*xdim*/, int /*ydim*/, int /*zdim*/, int /*startz*/, int /*starty*/)
+	{
+		reportNoCuda();
+		return NULL;
+	}
+
+	void cudaFreeReferenceTexture(CudaReferenceTexture * /*reference*/)
+	{
+	}
+
+	void cudaProjectSlices(const CudaReferenceTexture * /*reference*/, const float * /*Ainv*/, int /*nr_slices*/,
+		int /*xdim*/, int /*ydim*/, int /*r_max*/, float * /*f2d*/)
+	{
+		reportNoCuda();
+	}
+
+	CudaAccumulator* cudaCreateAccumulator(int /*xdim*/, int /*ydim*/, int /*zdim*/, int /*startz*/, int /*starty*/)
+	{
+		reportNoCuda();
+		return NULL;
+	}
+
+	void cudaFreeAccumulator(CudaAccumulator * /*accumulator*/)
+	{
+	}
+
+	void cudaBackprojectSlices(CudaAccumulator * /*accumulator*/, const float * /*f2d*/, const float * /*Mweight*/, const float * /*Ainv*/,
+		int /*nr_slices*/, int /*xdim*/, int /*ydim*/, int /*r_max*/)
+	{
+		reportNoCuda();
+	}
+
+	void cudaAddAccumulator(CudaAccumulator * /*accumulator*/, float * /*data*/, float * /*weight*/, bool /*do_reset*/)
+	{
+		reportNoCuda();
+	}
+
+	void cudaInverseFourierTransform(const float * /*in*/, float * /*out*/, int /*ndim*/, const int * /*N*/)
+	{
+		reportNoCuda();
+	}
+#endif
+
+	bool isCudaAvailable()
+	{
+		return cudaGetNrDevices() > 0;
+	}
+
+	static bool do_cuda_fourier_transforms = false;
+
+	void setCudaFourierTransforms(bool do_cuda)
+	{
+		if (do_cuda && !isCudaAvailable())
+			REPORT_ERROR("setCudaFourierTransforms: no CUDA device available");
+		do_cuda_fourier_transforms = do_cuda;
+	}
+
+	bool useCudaFourierTransforms()
+	{
+		return do_cuda_fourier_transforms;
+	}
+
+	// The kernels work in single precision: copy only if DOUBLE is double
+	static const float* getFloats(const DOUBLE *in, size_t n, std::vector<float> &buffer)
+	{
+		if (sizeof(DOUBLE) == sizeof(float))
+			return (const float*)in;
+		buffer.assign(in, in + n);
+		return &buffer[0];
+	}
+
+	static float* getFloatOutput(DOUBLE *out, size_t n, std::vector<float> &buffer)
+	{
+		if (sizeof(DOUBLE) == sizeof(float))
+			return (float*)out;
+		buffer.resize(n);
+		return &buffer[0];
+	}
+
+	static void copyFloatOutput(const std::vector<float> &buffer, DOUBLE *out)
+	{
+		for (size_t i = 0; i < buffer.size(); i++)
+			out[i] = buffer[i];
+	}
+
+	// Inverse matrices scaled by the padding factor, as in Projector::projectBatch and BackProjector::backprojectBatch
+	static void getScaledInverseMatrices(const DOUBLE *A, int nr_A, bool inv, int padding_factor, std::vector<float> &Ainv)
+	{
+		Ainv.resize(9 * (size_t)nr_A);
+		DOUBLE pad = (DOUBLE)padding_factor;
+		for (int n = 0; n < nr_A; n++)
+		{
+			const DOUBLE *An = A + 9 * n;
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					Ainv[9 * n + 3 * r + c] = pad * (inv ? An[3 * r + c] : An[3 * c + r]);
+		}
+	}
+
+	void cudaFourierToRealSpace(const MultidimArray<Complex > &F, MultidimArray<DOUBLE> &Mout)
+	{
+		int ndim = (ZSIZE(Mout) > 1) ? 3 : 2;
+		int N[3];
+		if (ndim == 3)
+		{
+			N[0] = ZSIZE(Mout);
+			N[1] = YSIZE(Mout);
+			N[2] = XSIZE(Mout);
+		}
+		else
+		{
+			N[0] = YSIZE(Mout);
+			N[1] = XSIZE(Mout);
+		}
+		if (NSIZE(Mout) != 1 || XSIZE(F) != XSIZE(Mout) / 2 + 1 || YSIZE(F) != YSIZE(Mout) || ZSIZE(F) != ZSIZE(Mout))
+			REPORT_ERROR("cudaFourierToRealSpace: F does not have the half size of Mout");
+
+		std::vector<float> in_buffer, out_buffer;
+		const float *in = getFloats((const DOUBLE*)MULTIDIM_ARRAY(F), 2 * NZYXSIZE(F), in_buffer);
+		float *out = getFloatOutput(MULTIDIM_ARRAY(Mout), NZYXSIZE(Mout), out_buffer);
+		cudaInverseFourierTransform(in, out, ndim, N);
+		if (!out_buffer.empty())
+			copyFloatOutput(out_buffer, MULTIDIM_ARRAY(Mout));
+	}
+
+	CudaProjector::CudaProjector()
+	{
+		reference = NULL;
+		r_max = padding_factor = 0;
+	}
+
+	CudaProjector::~CudaProjector()
+	{
+		clear();
+	}
+
+	void CudaProjector::clear()
+	{
+		cudaFreeReferenceTexture(reference);
+		reference = NULL;
+	}
+
+	void CudaProjector::setReference(const Projector &projector)
+	{
+		if (projector.ref_dim != 3)
+			REPORT_ERROR("CudaProjector::setReference%%ERROR: only 3D references are supported");
+		if (projector.interpolator != TRILINEAR)
+			REPORT_ERROR("CudaProjector::setReference%%ERROR: only TRILINEAR interpolation is supported");
+		if (NZYXSIZE(projector.data) == 0)
+			REPORT_ERROR("CudaProjector::setReference%%ERROR: the projector has no data array (only bricked or half-precision data?)");
+
+		clear();
+		const MultidimArray<Complex > &data = projector.data;
+		std::vector<float> buffer;
+		const float *floats = getFloats((const DOUBLE*)MULTIDIM_ARRAY(data), 2 * NZYXSIZE(data), buffer);
+		reference = cudaCreateReferenceTexture(floats, XSIZE(data), YSIZE(data), ZSIZE(data), STARTINGZ(data), STARTINGY(data));
+		r_max = projector.r_max;
+		padding_factor = projector.padding_factor;
+	}
+
+	void CudaProjector::projectBatch(MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv)
+	{
+		if (reference == NULL)
+			REPORT_ERROR("CudaProjector::projectBatch%%ERROR: no reference has been set");
+		if (NSIZE(f2d) < nr_A || ZSIZE(f2d) != 1)
+			REPORT_ERROR("CudaProjector::projectBatch%%ERROR: f2d should be a stack of at least nr_A 2D images");
+		if (nr_A <= 0)
+			return;
+
+		std::vector<float> Ainv, out_buffer;
+		getScaledInverseMatrices(A, nr_A, inv, padding_factor, Ainv);
+		int my_r_max = XMIPP_MIN(r_max, XSIZE(f2d) - 1);
+		float *out = getFloatOutput((DOUBLE*)MULTIDIM_ARRAY(f2d), 2 * nr_A * YXSIZE(f2d), out_buffer);
+		cudaProjectSlices(reference, &Ainv[0], nr_A, XSIZE(f2d), YSIZE(f2d), my_r_max, out);
+		if (!out_buffer.empty())
+			copyFloatOutput(out_buffer, (DOUBLE*)MULTIDIM_ARRAY(f2d));
+	}
+
+	CudaBackProjector::CudaBackProjector()
+	{
+		accumulator = NULL;
+		r_max = padding_factor = 0;
+		zdim = ydim = xdim = startz = starty = 0;
+	}
+
+	CudaBackProjector::~CudaBackProjector()
+	{
+		clear();
+	}
+
+	void CudaBackProjector::clear()
+	{
+		cudaFreeAccumulator(accumulator);
+		accumulator = NULL;
+	}
+
+	void CudaBackProjector::init(BackProjector &backprojector)
+	{
+		if (backprojector.ref_dim != 3)
+			REPORT_ERROR("CudaBackProjector::init%%ERROR: only 3D references are supported");
+		if (backprojector.interpolator != TRILINEAR)
+			REPORT_ERROR("CudaBackProjector::init%%ERROR: only TRILINEAR interpolation is supported");
+		if (backprojector.do_symmetrise_on_insertion)
+			REPORT_ERROR("CudaBackProjector::init%%ERROR: symmetrisation on insertion is not supported");
+
+		clear();
+		backprojector.getDataShape(zdim, ydim, xdim, startz, starty);
+		accumulator = cudaCreateAccumulator(xdim, ydim, zdim, startz, starty);
+		r_max = backprojector.r_max;
+		padding_factor = backprojector.padding_factor;
+	}
+
+	void CudaBackProjector::backprojectBatch(const MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv,
+		const MultidimArray<DOUBLE> *Mweight)
+	{
+		if (accumulator == NULL)
+			REPORT_ERROR("CudaBackProjector::backprojectBatch%%ERROR: init() has not been called");
+		if (NSIZE(f2d) < nr_A || ZSIZE(f2d) != 1)
+			REPORT_ERROR("CudaBackProjector::backprojectBatch%%ERROR: f2d should be a stack of at least nr_A 2D images");
+		if (Mweight != NULL && (NSIZE(*Mweight) < nr_A || !Mweight->sameShape(f2d)))
+			REPORT_ERROR("CudaBackProjector::backprojectBatch%%ERROR: Mweight should have the same size as f2d");
+		if (nr_A <= 0)
+			return;
+
+		std::vector<float> Ainv, f2d_buffer, weight_buffer;
+		getScaledInverseMatrices(A, nr_A, inv, padding_factor, Ainv);
+		const float *in = getFloats((const DOUBLE*)MULTIDIM_ARRAY(f2d), 2 * nr_A * YXSIZE(f2d), f2d_buffer);
+		const float *in_weight = (Mweight != NULL) ? getFloats(MULTIDIM_ARRAY(*Mweight), nr_A * YXSIZE(f2d), weight_buffer) : NULL;
+		cudaBackprojectSlices(accumulator, in, in_weight, &Ainv[0], nr_A, XSIZE(f2d), YSIZE(f2d), r_max);
+	}
+
+	void CudaBackProjector::addTo(BackProjector &backprojector, bool do_reset)
+	{
+		if (accumulator == NULL)
+			REPORT_ERROR("CudaBackProjector::addTo%%ERROR: init() has not been called");
+		backprojector.expandToDense();
+		MultidimArray<Complex > &data = backprojector.data;
+		MultidimArray<DOUBLE> &weight = backprojector.weight;
+		if (ZSIZE(data) != zdim || YSIZE(data) != ydim || XSIZE(data) != xdim ||
+			STARTINGZ(data) != startz || STARTINGY(data) != starty || !weight.sameShape(data))
+			REPORT_ERROR("CudaBackProjector::addTo%%ERROR: the backprojector does not have the shape of init()");
+
+		if (sizeof(DOUBLE) == sizeof(float))
+			cudaAddAccumulator(accumulator, (float*)MULTIDIM_ARRAY(data), (float*)MULTIDIM_ARRAY(weight), do_reset);
+		else
+		{
+			std::vector<float> data_sums(2 * NZYXSIZE(data), 0.f), weight_sums(NZYXSIZE(weight), 0.f);
+			cudaAddAccumulator(accumulator, &data_sums[0], &weight_sums[0], do_reset);
+			DOUBLE *data_ptr = (DOUBLE*)MULTIDIM_ARRAY(data);
+			for (size_t i = 0; i < data_sums.size(); i++)
+				data_ptr[i] += data_sums[i];
+			for (size_t i = 0; i < weight_sums.size(); i++)
+				MULTIDIM_ARRAY(weight)[i] += weight_sums[i];
+		}
+	}
+}
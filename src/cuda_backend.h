@@ -0,0 +1,135 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef CUDA_BACKEND_H
+#define CUDA_BACKEND_H
+
+#include "src/projector.h"
+#include "src/backprojector.h"
+#include "src/cuda_kernels.h"
+
+namespace relion
+{
+	/*
+	 * Whether liblion was built with the CUDA backend (cmake -DLIBLION_CUDA=ON) and a CUDA device is present.
+	 * Without the backend, all functions and classes below report an error when they are used.
+	 */
+	bool isCudaAvailable();
+
+	/*
+	 * Do the inverse FFTs of BackProjector::reconstruct (and of the other functions that go through
+	 * BackProjector::oridimFourierToRealSpace) with cuFFT instead of FFTW. Off by default.
+	 */
+	void setCudaFourierTransforms(bool do_cuda);
+	bool useCudaFourierTransforms();
+
+	/*
+	 * Unnormalised inverse transform of the FFTW half-layout F into the 2D or 3D Mout (which keeps its size), as
+	 * FourierTransformer::inverseFourierTransform does
+	 */
+	void cudaFourierToRealSpace(const MultidimArray<Complex > &F, MultidimArray<DOUBLE> &Mout);
+
+	/** Projector::projectBatch on the GPU
+	 *
+	 * The reference is uploaded once into a 3D texture, so the GPU interpolates it trilinearly in hardware.
+	 * The texture unit has 9-bit fixed-point interpolation weights (steps of 1/256), so the slices differ from the
+	 * CPU ones by up to a few 1e-3 of the differences between neighbouring voxels.
+	 * Only 3D references with TRILINEAR interpolation, whose data array is kept (not only bricked or in half precision).
+	 *
+	 * @code
+	 * CudaProjector gpu_projector;
+	 * gpu_projector.setReference(projector);
+	 * gpu_projector.projectBatch(f2d, &A[0], nr_orientations, false);
+	 * @endcode
+	 */
+	class CudaProjector
+	{
+	public:
+		CudaProjector();
+		~CudaProjector();
+
+		// Upload the data array of the projector; its r_max and padding_factor are used for all projections
+		void setReference(const Projector &projector);
+
+		/*
+		 * Project nr_A orientations (row-major 3x3 matrices) into the first nr_A images of the stack f2d,
+		 * which has the size of the projections (as in Projector::projectBatch)
+		 */
+		void projectBatch(MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv);
+
+		// Free the device memory
+		void clear();
+
+		bool hasReference() const
+		{
+			return reference != 0;
+		}
+
+	private:
+		CudaReferenceTexture *reference;
+		int r_max, padding_factor;
+
+		// Not copyable
+		CudaProjector(const CudaProjector&);
+		CudaProjector& operator=(const CudaProjector&);
+	};
+
+	/** BackProjector::backprojectBatch on the GPU
+	 *
+	 * The sums of data and weight are kept on the device, where all pixels of a batch of slices are inserted
+	 * concurrently with atomic additions. addTo() adds them to the arrays of a BackProjector on the host, whose
+	 * reconstruct() then works as usual. Only 3D references with TRILINEAR interpolation, without
+	 * symmetrisation on insertion. The order of the atomic additions is not fixed, so results differ from run to run
+	 * in the last bits.
+	 */
+	class CudaBackProjector
+	{
+	public:
+		CudaBackProjector();
+		~CudaBackProjector();
+
+		// Allocate zero sums for the data array of backprojector (with its r_max and padding_factor)
+		void init(BackProjector &backprojector);
+
+		// As BackProjector::backprojectBatch; Mweight may be NULL
+		void backprojectBatch(const MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv,
+			const MultidimArray<DOUBLE> *Mweight = NULL);
+
+		/*
+		 * Add the sums to the data and weight arrays of backprojector, which must have the shape init() was called
+		 * with (sparse storage is expanded first); the device sums are set to zero if do_reset
+		 */
+		void addTo(BackProjector &backprojector, bool do_reset = true);
+
+		// Free the device memory
+		void clear();
+
+	private:
+		CudaAccumulator *accumulator;
+		int r_max, padding_factor;
+		long int zdim, ydim, xdim, startz, starty;
+
+		// Not copyable
+		CudaBackProjector(const CudaBackProjector&);
+		CudaBackProjector& operator=(const CudaBackProjector&);
+	};
+}
+
+#endif
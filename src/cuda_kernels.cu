@@ -0,0 +1,396 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * CUDA kernels of the optional GPU backend (see cuda_kernels.h and cuda_backend.h)
+ * Built on the gtom prerequisites in temp/ (types, CUDA headers and vector maths).
+ */
+
+#include <vector>
+#include <string>
+#include <string.h>
+#include "temp/Prerequisites.cuh"
+#include "src/error.h"
+#include "src/cuda_kernels.h"
+
+#define CUDA_CHECK(call) \
+	do \
+	{ \
+		cudaError_t cuda_status = (call); \
+		if (cuda_status != cudaSuccess) \
+			REPORT_ERROR((std::string)"CUDA error: " + cudaGetErrorString(cuda_status)); \
+	} while (0)
+
+#define CUFFT_CHECK(call) \
+	do \
+	{ \
+		cufftResult cufft_status = (call); \
+		if (cufft_status != CUFFT_SUCCESS) \
+			REPORT_ERROR((std::string)"cuFFT error " + std::to_string((int)cufft_status)); \
+	} while (0)
+
+// Threads per block (x and y) of the slice kernels, and the largest grid in z (number of slices per launch)
+#define SLICE_BLOCK_X 32
+#define SLICE_BLOCK_Y 8
+#define MAX_SLICES_PER_LAUNCH 65535
+
+namespace relion
+{
+	// Device memory that is freed when it goes out of scope (also when an error is reported)
+	template <typename T>
+	struct DeviceBuffer
+	{
+		T *ptr;
+
+		DeviceBuffer(size_t n) : ptr(NULL)
+		{
+			CUDA_CHECK(cudaMalloc((void**)&ptr, getBytes(n)));
+		}
+
+		~DeviceBuffer()
+		{
+			if (ptr != NULL)
+				cudaFree(ptr);
+		}
+
+	private:
+		static size_t getBytes(size_t n)
+		{
+			return (n > 0 ? n : 1) * sizeof(T);
+		}
+		DeviceBuffer(const DeviceBuffer&);
+		DeviceBuffer& operator=(const DeviceBuffer&);
+	};
+
+	int cudaGetNrDevices()
+	{
+		int count = 0;
+		if (cudaGetDeviceCount(&count) != cudaSuccess)
+		{
+			cudaGetLastError(); // clear the error
+			return 0;
+		}
+		return count;
+	}
+
+	struct CudaReferenceTexture
+	{
+		cudaArray_t array;
+		gtom::cudaTex texture;
+		int startz, starty;
+	};
+
+	CudaReferenceTexture* cudaCreateReferenceTexture(const float *data, int xdim, int ydim, int zdim, int startz, int starty)
+	{
+		CudaReferenceTexture *reference = new CudaReferenceTexture();
+		reference->array = NULL;
+		reference->texture = 0;
+		reference->startz = startz;
+		reference->starty = starty;
+
+		try
+		{
+			cudaChannelFormatDesc channel = cudaCreateChannelDesc<float2>();
+			cudaExtent extent = make_cudaExtent(xdim, ydim, zdim);
+			CUDA_CHECK(cudaMalloc3DArray(&reference->array, &channel, extent));
+
+			cudaMemcpy3DParms copy;
+			memset(&copy, 0, sizeof(copy));
+			copy.srcPtr = make_cudaPitchedPtr((void*)data, xdim * sizeof(float2), xdim, ydim);
+			copy.dstArray = reference->array;
+			copy.extent = extent;
+			copy.kind = cudaMemcpyHostToDevice;
+			CUDA_CHECK(cudaMemcpy3D(&copy));
+
+			cudaResourceDesc resource;
+			memset(&resource, 0, sizeof(resource));
+			resource.resType = cudaResourceTypeArray;
+			resource.res.array.array = reference->array;
+
+			// Unnormalised coordinates with hardware trilinear interpolation; voxel centres are at +0.5
+			cudaTextureDesc texture;
+			memset(&texture, 0, sizeof(texture));
+			texture.addressMode[0] = cudaAddressModeClamp;
+			texture.addressMode[1] = cudaAddressModeClamp;
+			texture.addressMode[2] = cudaAddressModeClamp;
+			texture.filterMode = cudaFilterModeLinear;
+			texture.readMode = cudaReadModeElementType;
+			texture.normalizedCoords = 0;
+			CUDA_CHECK(cudaCreateTextureObject(&reference->texture, &resource, &texture, NULL));
+		}
+		catch (RelionError &)
+		{
+			cudaFreeReferenceTexture(reference);
+			throw;
+		}
+		return reference;
+	}
+
+	void cudaFreeReferenceTexture(CudaReferenceTexture *reference)
+	{
+		if (reference == NULL)
+			return;
+		if (reference->texture != 0)
+			cudaDestroyTextureObject(reference->texture);
+		if (reference->array != NULL)
+			cudaFreeArray(reference->array);
+		delete reference;
+	}
+
+	// One thread per pixel (x, i) of slice blockIdx.z, as in Projector::projectSliceRows (TRILINEAR)
+	__global__ void projectSlicesKernel(gtom::cudaTex texture, const float *Ainv, int xdim, int ydim, int r_max, int max_r2,
+		float startz, float starty, float2 *f2d)
+	{
+		int x = blockIdx.x * blockDim.x + threadIdx.x;
+		int i = blockIdx.y * blockDim.y + threadIdx.y;
+		int n = blockIdx.z;
+		if (x >= xdim || i >= ydim)
+			return;
+
+		float2 value = make_float2(0.f, 0.f);
+		int y = (i <= r_max) ? i : i - ydim;
+		if ((i <= r_max || i >= ydim - r_max) && x <= r_max && x * x + y * y <= max_r2)
+		{
+			const float *A = Ainv + 9 * n;
+			float xp = A[0] * x + A[1] * y;
+			float yp = A[3] * x + A[4] * y;
+			float zp = A[6] * x + A[7] * y;
+
+			// Only the half with x >= 0 is stored: take the complex conjugate of the hermitian symmetry pair
+			bool is_neg_x = xp < 0.f;
+			if (is_neg_x)
+			{
+				xp = -xp;
+				yp = -yp;
+				zp = -zp;
+			}
+			value = tex3D<float2>(texture, xp + 0.5f, yp - starty + 0.5f, zp - startz + 0.5f);
+			if (is_neg_x)
+				value.y = -value.y;
+		}
+		f2d[((size_t)n * ydim + i) * xdim + x] = value;
+	}
+
+	void cudaProjectSlices(const CudaReferenceTexture *reference, const float *Ainv, int nr_slices,
+		int xdim, int ydim, int r_max, float *f2d)
+	{
+		if (nr_slices <= 0)
+			return;
+		size_t slice_size = (size_t)xdim * ydim;
+		DeviceBuffer<float> d_Ainv(9 * (size_t)nr_slices);
+		DeviceBuffer<float2> d_f2d(slice_size * nr_slices);
+		CUDA_CHECK(cudaMemcpy(d_Ainv.ptr, Ainv, 9 * (size_t)nr_slices * sizeof(float), cudaMemcpyHostToDevice));
+
+		dim3 block(SLICE_BLOCK_X, SLICE_BLOCK_Y);
+		for (int first = 0; first < nr_slices; first += MAX_SLICES_PER_LAUNCH)
+		{
+			int count = tmin(nr_slices - first, MAX_SLICES_PER_LAUNCH);
+			dim3 grid(NextMultipleOf(xdim, SLICE_BLOCK_X) / SLICE_BLOCK_X, NextMultipleOf(ydim, SLICE_BLOCK_Y) / SLICE_BLOCK_Y, count);
+			projectSlicesKernel<<<grid, block>>>(reference->texture, d_Ainv.ptr + 9 * (size_t)first, xdim, ydim, r_max, r_max * r_max,
+				(float)reference->startz, (float)reference->starty, d_f2d.ptr + slice_size * first);
+			CUDA_CHECK(cudaGetLastError());
+		}
+		CUDA_CHECK(cudaMemcpy(f2d, d_f2d.ptr, slice_size * nr_slices * sizeof(float2), cudaMemcpyDeviceToHost));
+	}
+
+	struct CudaAccumulator
+	{
+		float2 *data;
+		float *weight;
+		int xdim, ydim, zdim, startz, starty;
+		size_t nr_voxels;
+	};
+
+	CudaAccumulator* cudaCreateAccumulator(int xdim, int ydim, int zdim, int startz, int starty)
+	{
+		CudaAccumulator *accumulator = new CudaAccumulator();
+		accumulator->data = NULL;
+		accumulator->weight = NULL;
+		accumulator->xdim = xdim;
+		accumulator->ydim = ydim;
+		accumulator->zdim = zdim;
+		accumulator->startz = startz;
+		accumulator->starty = starty;
+		accumulator->nr_voxels = (size_t)xdim * ydim * zdim;
+		try
+		{
+			CUDA_CHECK(cudaMalloc((void**)&accumulator->data, accumulator->nr_voxels * sizeof(float2)));
+			CUDA_CHECK(cudaMalloc((void**)&accumulator->weight, accumulator->nr_voxels * sizeof(float)));
+			CUDA_CHECK(cudaMemset(accumulator->data, 0, accumulator->nr_voxels * sizeof(float2)));
+			CUDA_CHECK(cudaMemset(accumulator->weight, 0, accumulator->nr_voxels * sizeof(float)));
+		}
+		catch (RelionError &)
+		{
+			cudaFreeAccumulator(accumulator);
+			throw;
+		}
+		return accumulator;
+	}
+
+	void cudaFreeAccumulator(CudaAccumulator *accumulator)
+	{
+		if (accumulator == NULL)
+			return;
+		if (accumulator->data != NULL)
+			cudaFree(accumulator->data);
+		if (accumulator->weight != NULL)
+			cudaFree(accumulator->weight);
+		delete accumulator;
+	}
+
+	// One thread per pixel (x, i) of slice blockIdx.z, as in BackProjector::backprojectSliceRows (TRILINEAR)
+	__global__ void backprojectSlicesKernel(const float2 *f2d, const float *Mweight, const float *Ainv, int xdim, int ydim,
+		int r_max, int max_r2, int vol_xdim, int vol_ydim, int vol_startz, int vol_starty, float2 *data, float *weight)
+	{
+		int x = blockIdx.x * blockDim.x + threadIdx.x;
+		int i = blockIdx.y * blockDim.y + threadIdx.y;
+		int n = blockIdx.z;
+		if (x >= xdim || i >= ydim)
+			return;
+
+		// The x == 0 column of the rows with negative y is the hermitian pair of the one with positive y: only insert it once
+		int y, first_x;
+		if (i <= r_max)
+		{
+			y = i;
+			first_x = 0;
+		}
+		else if (i >= ydim - r_max)
+		{
+			y = i - ydim;
+			first_x = 1;
+		}
+		else
+			return;
+		if (x < first_x || x > r_max || x * x + y * y > max_r2)
+			return;
+
+		size_t pixel = ((size_t)n * ydim + i) * xdim + x;
+		float my_weight = (Mweight != NULL) ? Mweight[pixel] : 1.f;
+		if (!(my_weight > 0.f))
+			return;
+		float2 my_val = f2d[pixel];
+
+		const float *A = Ainv + 9 * n;
+		float xp = A[0] * x + A[1] * y;
+		float yp = A[3] * x + A[4] * y;
+		float zp = A[6] * x + A[7] * y;
+		if (xp < 0.f)
+		{
+			xp = -xp;
+			yp = -yp;
+			zp = -zp;
+			my_val.y = -my_val.y;
+		}
+
+		int x0 = (int)floorf(xp);
+		float fx = xp - x0;
+		int y0 = (int)floorf(yp);
+		float fy = yp - y0;
+		y0 -= vol_starty;
+		int z0 = (int)floorf(zp);
+		float fz = zp - z0;
+		z0 -= vol_startz;
+		float mfx = 1.f - fx;
+		float mfy = 1.f - fy;
+		float mfz = 1.f - fz;
+
+		for (int corner = 0; corner < 8; corner++)
+		{
+			int dz = corner >> 2, dy = (corner >> 1) & 1, dx = corner & 1;
+			float dd = (dz ? fz : mfz) * (dy ? fy : mfy) * (dx ? fx : mfx);
+			size_t idx = ((size_t)(z0 + dz) * vol_ydim + (y0 + dy)) * vol_xdim + x0 + dx;
+			atomicAdd(&data[idx].x, dd * my_val.x);
+			atomicAdd(&data[idx].y, dd * my_val.y);
+			atomicAdd(&weight[idx], dd * my_weight);
+		}
+	}
+
+	void cudaBackprojectSlices(CudaAccumulator *accumulator, const float *f2d, const float *Mweight, const float *Ainv,
+		int nr_slices, int xdim, int ydim, int r_max)
+	{
+		if (nr_slices <= 0)
+			return;
+		size_t slice_size = (size_t)xdim * ydim;
+		DeviceBuffer<float> d_Ainv(9 * (size_t)nr_slices);
+		DeviceBuffer<float2> d_f2d(slice_size * nr_slices);
+		DeviceBuffer<float> d_Mweight((Mweight != NULL) ? slice_size * nr_slices : 0);
+		CUDA_CHECK(cudaMemcpy(d_Ainv.ptr, Ainv, 9 * (size_t)nr_slices * sizeof(float), cudaMemcpyHostToDevice));
+		CUDA_CHECK(cudaMemcpy(d_f2d.ptr, f2d, slice_size * nr_slices * sizeof(float2), cudaMemcpyHostToDevice));
+		if (Mweight != NULL)
+			CUDA_CHECK(cudaMemcpy(d_Mweight.ptr, Mweight, slice_size * nr_slices * sizeof(float), cudaMemcpyHostToDevice));
+
+		dim3 block(SLICE_BLOCK_X, SLICE_BLOCK_Y);
+		for (int first = 0; first < nr_slices; first += MAX_SLICES_PER_LAUNCH)
+		{
+			int count = tmin(nr_slices - first, MAX_SLICES_PER_LAUNCH);
+			dim3 grid(NextMultipleOf(xdim, SLICE_BLOCK_X) / SLICE_BLOCK_X, NextMultipleOf(ydim, SLICE_BLOCK_Y) / SLICE_BLOCK_Y, count);
+			backprojectSlicesKernel<<<grid, block>>>(d_f2d.ptr + slice_size * first,
+				(Mweight != NULL) ? d_Mweight.ptr + slice_size * first : NULL, d_Ainv.ptr + 9 * (size_t)first,
+				xdim, ydim, r_max, r_max * r_max, accumulator->xdim, accumulator->ydim, accumulator->startz, accumulator->starty,
+				accumulator->data, accumulator->weight);
+			CUDA_CHECK(cudaGetLastError());
+		}
+		CUDA_CHECK(cudaDeviceSynchronize());
+	}
+
+	void cudaAddAccumulator(CudaAccumulator *accumulator, float *data, float *weight, bool do_reset)
+	{
+		size_t n = accumulator->nr_voxels;
+		std::vector<float> h_data(2 * n), h_weight(n);
+		CUDA_CHECK(cudaMemcpy(&h_data[0], accumulator->data, n * sizeof(float2), cudaMemcpyDeviceToHost));
+		CUDA_CHECK(cudaMemcpy(&h_weight[0], accumulator->weight, n * sizeof(float), cudaMemcpyDeviceToHost));
+		for (size_t i = 0; i < 2 * n; i++)
+			data[i] += h_data[i];
+		for (size_t i = 0; i < n; i++)
+			weight[i] += h_weight[i];
+		if (do_reset)
+		{
+			CUDA_CHECK(cudaMemset(accumulator->data, 0, n * sizeof(float2)));
+			CUDA_CHECK(cudaMemset(accumulator->weight, 0, n * sizeof(float)));
+		}
+	}
+
+	void cudaInverseFourierTransform(const float *in, float *out, int ndim, const int *N)
+	{
+		if (ndim != 2 && ndim != 3)
+			REPORT_ERROR("cudaInverseFourierTransform: only 2D and 3D transforms are supported");
+		size_t nreal = 1;
+		for (int d = 0; d < ndim; d++)
+			nreal *= N[d];
+		size_t ncomplex = nreal / N[ndim - 1] * ElementsFFT1(N[ndim - 1]);
+
+		// cuFFT overwrites the input of complex-to-real transforms: that is only the device copy here
+		DeviceBuffer<cufftComplex> d_in(ncomplex);
+		DeviceBuffer<cufftReal> d_out(nreal);
+		CUDA_CHECK(cudaMemcpy(d_in.ptr, in, ncomplex * sizeof(cufftComplex), cudaMemcpyHostToDevice));
+
+		cufftHandle plan;
+		if (ndim == 2)
+			CUFFT_CHECK(cufftPlan2d(&plan, N[0], N[1], CUFFT_C2R));
+		else
+			CUFFT_CHECK(cufftPlan3d(&plan, N[0], N[1], N[2], CUFFT_C2R));
+		cufftResult status = cufftExecC2R(plan, d_in.ptr, d_out.ptr);
+		cufftDestroy(plan);
+		CUFFT_CHECK(status);
+
+		CUDA_CHECK(cudaMemcpy(out, d_out.ptr, nreal * sizeof(cufftReal), cudaMemcpyDeviceToHost));
+	}
+}
@@ -0,0 +1,77 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef CUDA_KERNELS_H
+#define CUDA_KERNELS_H
+
+#include <cstddef>
+
+/*
+ * Device memory, kernels and cuFFT transforms of the CUDA backend (cuda_kernels.cu, only built with LIBLION_CUDA).
+ * Only plain types pass this interface, so that cuda_kernels.cu does not need the liblion headers (and nvcc
+ * never sees them) and the rest of liblion does not need the CUDA headers. See cuda_backend.h for the classes on top.
+ * Complex arrays are interleaved (real, imaginary) floats; Ainv are row-major 3x3 matrices, 9 floats per slice.
+ * All functions report CUDA errors with REPORT_ERROR.
+ */
+namespace relion
+{
+	// Number of CUDA devices (0 if there are none, or no driver)
+	int cudaGetNrDevices();
+
+	/*
+	 * Projector reference in a 3D float2 texture with hardware trilinear interpolation
+	 * data holds zdim x ydim x xdim complex voxels, of which voxel (0, 0, 0) has logical coordinates (startz, starty, 0)
+	 */
+	struct CudaReferenceTexture;
+	CudaReferenceTexture* cudaCreateReferenceTexture(const float *data, int xdim, int ydim, int zdim, int startz, int starty);
+	void cudaFreeReferenceTexture(CudaReferenceTexture *reference);
+
+	/*
+	 * Central slices of nr_slices orientations: f2d are nr_slices images of ydim x xdim complex pixels (FFTW half layout),
+	 * the pixels within r_max are interpolated from the reference, all others become zero
+	 */
+	void cudaProjectSlices(const CudaReferenceTexture *reference, const float *Ainv, int nr_slices,
+		int xdim, int ydim, int r_max, float *f2d);
+
+	/*
+	 * Data and weight sums on the device for a backprojector of zdim x ydim x xdim voxels, logical origin (startz, starty, 0)
+	 */
+	struct CudaAccumulator;
+	CudaAccumulator* cudaCreateAccumulator(int xdim, int ydim, int zdim, int startz, int starty);
+	void cudaFreeAccumulator(CudaAccumulator *accumulator);
+
+	/*
+	 * Trilinear insertion of nr_slices images (as in BackProjector::backproject) with atomic additions
+	 * Mweight may be NULL (all weights 1); it has ydim x xdim floats per slice.
+	 */
+	void cudaBackprojectSlices(CudaAccumulator *accumulator, const float *f2d, const float *Mweight, const float *Ainv,
+		int nr_slices, int xdim, int ydim, int r_max);
+
+	// Add the device sums to data (complex) and weight on the host, and optionally set the device sums to zero
+	void cudaAddAccumulator(CudaAccumulator *accumulator, float *data, float *weight, bool do_reset);
+
+	/*
+	 * Unnormalised complex-to-real transform (as FFTW's c2r) of a 2D (ndim = 2: N = {ydim, xdim}) or
+	 * 3D (N = {zdim, ydim, xdim}) array; in has the FFTW half layout and is not changed
+	 */
+	void cudaInverseFourierTransform(const float *in, float *out, int ndim, const int *N);
+}
+
+#endif
@@ -55,9 +55,6 @@ namespace relion
 	void Euler_angles2matrix(DOUBLE alpha, DOUBLE beta, DOUBLE gamma,
 		Matrix2D<DOUBLE> &A, bool homogeneous)
 	{
-		DOUBLE ca, sa, cb, sb, cg, sg;
-		DOUBLE cc, cs, sc, ss;
-
 		if (homogeneous)
 		{
 			A.initZeros(4, 4);
@@ -67,6 +64,18 @@ namespace relion
 			if (MAT_XSIZE(A) != 3 || MAT_YSIZE(A) != 3)
 				A.resize(3, 3);
 
+		Mat33 A33;
+		Euler_angles2matrix(alpha, beta, gamma, A33);
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				MAT_ELEM(A, i, j) = A33(i, j);
+	}
+
+	void Euler_angles2matrix(DOUBLE alpha, DOUBLE beta, DOUBLE gamma, Mat33 &A)
+	{
+		DOUBLE ca, sa, cb, sb, cg, sg;
+		DOUBLE cc, cs, sc, ss;
+
 		alpha = DEG2RAD(alpha);
 		beta = DEG2RAD(beta);
 		gamma = DEG2RAD(gamma);
@@ -215,11 +224,17 @@ namespace relion
 	void Euler_matrix2angles(const Matrix2D<DOUBLE> &A, DOUBLE &alpha,
 		DOUBLE &beta, DOUBLE &gamma)
 	{
-		DOUBLE abs_sb, sign_sb;
-
 		if (MAT_XSIZE(A) != 3 || MAT_YSIZE(A) != 3)
 			REPORT_ERROR("Euler_matrix2angles: The Euler matrix is not 3x3");
 
+		Euler_matrix2angles(Mat33(A), alpha, beta, gamma);
+	}
+
+	void Euler_matrix2angles(const Mat33 &A, DOUBLE &alpha,
+		DOUBLE &beta, DOUBLE &gamma)
+	{
+		DOUBLE abs_sb, sign_sb;
+
 		abs_sb = sqrt(A(0, 2) * A(0, 2) + A(1, 2) * A(1, 2));
 		if (abs_sb > 16 * FLT_EPSILON)
 		{
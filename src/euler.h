@@ -47,6 +47,7 @@
 
 #include "src/multidim_array.h"
 #include "src/transformations.h"
+#include "src/small_matrix.h"
 
 
 namespace relion
@@ -72,6 +73,12 @@ namespace relion
 	void Euler_angles2matrix(DOUBLE a, DOUBLE b, DOUBLE g, Matrix2D< DOUBLE >& A,
 		bool homogeneous = false);
 
+	/** Euler angles --> "Euler" matrix, without any allocation
+	 *
+	 * As the Matrix2D version (non-homogeneous).
+	 */
+	void Euler_angles2matrix(DOUBLE a, DOUBLE b, DOUBLE g, Mat33& A);
+
 	/** Euler angles2direction
 	 *
 	 * This function returns  a vector parallel to the  projection direction.
@@ -109,6 +116,12 @@ namespace relion
 		DOUBLE& beta,
 		DOUBLE& gamma);
 
+	/** "Euler" matrix --> angles, for a Mat33
+	 *
+	 * As the Matrix2D version.
+	 */
+	void Euler_matrix2angles(const Mat33& A, DOUBLE& alpha, DOUBLE& beta, DOUBLE& gamma);
+
 	/** Up-Down projection equivalence
 	 *
 	 * As you know a projection view from a point has got its homologous from its
@@ -44,13 +44,234 @@
  ***************************************************************************/
 
 #include "src/fftw.h"
+#include "src/simd_kernels.h"
+#include "src/instrumentation.h"
+#include "src/radial_bins.h"
 #include <string.h>
 #include <iostream>
+#include <map>
 
 namespace relion
 {
 	//#define DEBUG_PLANS
 
+	// Global plan cache -------------------------------------------------------
+#ifdef FLOAT_PRECISION
+	typedef fftwf_plan FFTWPlan;
+#else
+	typedef fftw_plan FFTWPlan;
+#endif
+
+	enum FFTWPlanKind { PLAN_R2C, PLAN_C2R, PLAN_DFT_FORWARD, PLAN_DFT_BACKWARD };
+
+	// Plans can be executed on any arrays with the same size, alignment and placement as the ones they were made for
+	struct FFTWPlanKey
+	{
+		int kind, ndim, N[3], howmany, align_in, align_out, in_place, nthreads;
+		unsigned int rigor;
+
+		bool operator<(const FFTWPlanKey &op) const
+		{
+			return memcmp(this, &op, sizeof(FFTWPlanKey)) < 0;
+		}
+	};
+
+	static std::map<FFTWPlanKey, FFTWPlan> plan_cache;
+	static unsigned int plan_rigor = FFTW_ESTIMATE;
+	static bool fftw_threads_initialised = false;
+
+	// Get a plan from the cache, or make it (on scratch arrays, as FFTW_MEASURE and up overwrite their arrays)
+	// Plans for more than one thread are made with the fftw threads library
+	// For howmany > 1 (only r2c and c2r), one plan transforms howmany consecutive arrays
+	static FFTWPlan getCachedPlan(int kind, int ndim, const int *N, void *in, void *out, int nthreads, int howmany = 1)
+	{
+		FFTWPlanKey key;
+		memset(&key, 0, sizeof(FFTWPlanKey));
+		key.kind = kind;
+		key.ndim = ndim;
+		for (int d = 0; d < ndim; d++)
+			key.N[d] = N[d];
+		key.howmany = howmany;
+#ifdef FLOAT_PRECISION
+		key.align_in = fftwf_alignment_of((float*)in);
+		key.align_out = fftwf_alignment_of((float*)out);
+#else
+		key.align_in = fftw_alignment_of((double*)in);
+		key.align_out = fftw_alignment_of((double*)out);
+#endif
+		key.in_place = (in == out);
+
+		FFTWPlan plan = NULL;
+#pragma omp critical(Plan)
+		{
+			// Both are set under the same lock (see setFFTWPlanningRigor and initFFTWThreads)
+			key.nthreads = (fftw_threads_initialised) ? nthreads : 1;
+			key.rigor = plan_rigor;
+			std::map<FFTWPlanKey, FFTWPlan>::iterator it = plan_cache.find(key);
+			if (it != plan_cache.end())
+			{
+				plan = it->second;
+			}
+			else
+			{
+				INSTRUMENT_TIMER(TIMER_FFT_PLANNING);
+				INSTRUMENT_COUNT(COUNT_FFT_PLANS, 1);
+
+				// Number of real and of complex elements of the transform
+				size_t nreal = 1;
+				for (int d = 0; d < ndim; d++)
+					nreal *= N[d];
+				size_t ncomplex = (kind == PLAN_R2C || kind == PLAN_C2R) ? (nreal / N[ndim - 1]) * (N[ndim - 1] / 2 + 1) : nreal;
+				size_t size_in = howmany * ((kind == PLAN_R2C) ? nreal * sizeof(DOUBLE) : ncomplex * 2 * sizeof(DOUBLE));
+				size_t size_out = howmany * ((kind == PLAN_C2R) ? nreal * sizeof(DOUBLE) : ncomplex * 2 * sizeof(DOUBLE));
+				if (key.in_place)
+					size_in = size_out = XMIPP_MAX(size_in, size_out);
+
+				// Scratch arrays with the same offset from the SIMD alignment as the real ones
+#ifdef FLOAT_PRECISION
+				if (fftw_threads_initialised)
+					fftwf_plan_with_nthreads(key.nthreads);
+				char *scratch_in = (char*)fftwf_malloc(size_in + 64);
+				char *scratch_out = (key.in_place) ? scratch_in : (char*)fftwf_malloc(size_out + 64);
+				DOUBLE *pin = (DOUBLE*)(scratch_in + key.align_in);
+				DOUBLE *pout = (DOUBLE*)(scratch_out + key.align_out);
+				switch (kind)
+				{
+				case PLAN_R2C:
+					if (howmany > 1)
+						plan = fftwf_plan_many_dft_r2c(ndim, N, howmany, pin, NULL, 1, (int)nreal,
+							(fftwf_complex*)pout, NULL, 1, (int)ncomplex, key.rigor);
+					else
+						plan = fftwf_plan_dft_r2c(ndim, N, pin, (fftwf_complex*)pout, key.rigor);
+					break;
+				case PLAN_C2R:
+					if (howmany > 1)
+						plan = fftwf_plan_many_dft_c2r(ndim, N, howmany, (fftwf_complex*)pin, NULL, 1, (int)ncomplex,
+							pout, NULL, 1, (int)nreal, key.rigor);
+					else
+						plan = fftwf_plan_dft_c2r(ndim, N, (fftwf_complex*)pin, pout, key.rigor);
+					break;
+				case PLAN_DFT_FORWARD:
+					plan = fftwf_plan_dft(ndim, N, (fftwf_complex*)pin, (fftwf_complex*)pout, FFTW_FORWARD, key.rigor);
+					break;
+				case PLAN_DFT_BACKWARD:
+					plan = fftwf_plan_dft(ndim, N, (fftwf_complex*)pin, (fftwf_complex*)pout, FFTW_BACKWARD, key.rigor);
+					break;
+				}
+				if (!key.in_place)
+					fftwf_free(scratch_out);
+				fftwf_free(scratch_in);
+#else
+				if (fftw_threads_initialised)
+					fftw_plan_with_nthreads(key.nthreads);
+				char *scratch_in = (char*)fftw_malloc(size_in + 64);
+				char *scratch_out = (key.in_place) ? scratch_in : (char*)fftw_malloc(size_out + 64);
+				DOUBLE *pin = (DOUBLE*)(scratch_in + key.align_in);
+				DOUBLE *pout = (DOUBLE*)(scratch_out + key.align_out);
+				switch (kind)
+				{
+				case PLAN_R2C:
+					if (howmany > 1)
+						plan = fftw_plan_many_dft_r2c(ndim, N, howmany, pin, NULL, 1, (int)nreal,
+							(fftw_complex*)pout, NULL, 1, (int)ncomplex, key.rigor);
+					else
+						plan = fftw_plan_dft_r2c(ndim, N, pin, (fftw_complex*)pout, key.rigor);
+					break;
+				case PLAN_C2R:
+					if (howmany > 1)
+						plan = fftw_plan_many_dft_c2r(ndim, N, howmany, (fftw_complex*)pin, NULL, 1, (int)ncomplex,
+							pout, NULL, 1, (int)nreal, key.rigor);
+					else
+						plan = fftw_plan_dft_c2r(ndim, N, (fftw_complex*)pin, pout, key.rigor);
+					break;
+				case PLAN_DFT_FORWARD:
+					plan = fftw_plan_dft(ndim, N, (fftw_complex*)pin, (fftw_complex*)pout, FFTW_FORWARD, key.rigor);
+					break;
+				case PLAN_DFT_BACKWARD:
+					plan = fftw_plan_dft(ndim, N, (fftw_complex*)pin, (fftw_complex*)pout, FFTW_BACKWARD, key.rigor);
+					break;
+				}
+				if (!key.in_place)
+					fftw_free(scratch_out);
+				fftw_free(scratch_in);
+#endif
+				if (plan != NULL)
+					plan_cache[key] = plan;
+			}
+		}
+
+		return plan;
+	}
+
+	// Initialise the fftw threads library (once for the whole program), returns false if that failed
+	static bool initFFTWThreads()
+	{
+		bool success;
+#pragma omp critical(Plan)
+		{
+			if (!fftw_threads_initialised)
+			{
+#ifdef FLOAT_PRECISION
+				fftw_threads_initialised = (fftwf_init_threads() != 0);
+#else
+				fftw_threads_initialised = (fftw_init_threads() != 0);
+#endif
+			}
+			success = fftw_threads_initialised;
+		}
+		return success;
+	}
+
+	void setFFTWPlanningRigor(unsigned int rigor)
+	{
+		if (rigor != FFTW_ESTIMATE && rigor != FFTW_MEASURE && rigor != FFTW_PATIENT && rigor != FFTW_EXHAUSTIVE)
+			REPORT_ERROR("setFFTWPlanningRigor: rigor should be one of FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT or FFTW_EXHAUSTIVE");
+#pragma omp critical(Plan)
+		plan_rigor = rigor;
+	}
+
+	void clearFFTWPlanCache()
+	{
+#pragma omp critical(Plan)
+		{
+			for (std::map<FFTWPlanKey, FFTWPlan>::iterator it = plan_cache.begin(); it != plan_cache.end(); ++it)
+#ifdef FLOAT_PRECISION
+				fftwf_destroy_plan(it->second);
+#else
+				fftw_destroy_plan(it->second);
+#endif
+			plan_cache.clear();
+		}
+	}
+
+	bool importFFTWWisdom(const FileName &fn_wisdom)
+	{
+		int success;
+#pragma omp critical(Plan)
+		{
+#ifdef FLOAT_PRECISION
+			success = fftwf_import_wisdom_from_filename(fn_wisdom.c_str());
+#else
+			success = fftw_import_wisdom_from_filename(fn_wisdom.c_str());
+#endif
+		}
+		return success != 0;
+	}
+
+	bool exportFFTWWisdom(const FileName &fn_wisdom)
+	{
+		int success;
+#pragma omp critical(Plan)
+		{
+#ifdef FLOAT_PRECISION
+			success = fftwf_export_wisdom_to_filename(fn_wisdom.c_str());
+#else
+			success = fftw_export_wisdom_to_filename(fn_wisdom.c_str());
+#endif
+		}
+		return success != 0;
+	}
+
 	// Constructors and destructors --------------------------------------------
 	FourierTransformer::FourierTransformer()
 	{
@@ -85,6 +306,7 @@ namespace relion
 		fPlanBackward    = NULL;
 		dataPtr          = NULL;
 		complexDataPtr   = NULL;
+		realTransform    = true;
 		threadsSetOn=false;
 		nthreads = 1;
 	}
@@ -101,74 +323,42 @@ namespace relion
 
 	void FourierTransformer::cleanup()
 	{
-		// First clear object and destroy plans
-		std::cout << "cleanup 1\n";
+		// Only this object is cleared: the cached plans and the rest of the fftw state are shared with all other
+		// transformers, which may still be using them (see clearFFTWPlanCache)
 		clear();
-		// Then clean up all the junk fftw keeps lying around
-		// SOMEHOW THE FOLLOWING IS NOT ALLOWED WHEN USING MULTPLE TRANSFORMER OBJECTS....
-		std::cout << "cleanup 2\n";
-	#ifdef FLOAT_PRECISION
-		/*if (threadsSetOn)
-    		fftwf_cleanup_threads();
-		else*/
-		std::cout << "cleanup 3\n";
-    	fftwf_cleanup();
-		std::cout << "cleanup 4\n";
-	#else
-		if (threadsSetOn)
-    		fftw_cleanup_threads();
-		else
-    		fftw_cleanup();
-	#endif
 
 	#ifdef DEBUG_PLANS
 		std::cerr << "CLEANED-UP this= "<<this<< std::endl;
 	#endif
-
-		std::cout << "cleanup 5\n";
 	}
 
 	void FourierTransformer::destroyPlans()
 	{
-#pragma omp critical(Plan)
-		{
-			// Anything to do with plans has to be protected for threads!
-#ifdef FLOAT_PRECISION
-			if (fPlanForward !=NULL)
-				fftwf_destroy_plan(fPlanForward);
-			if (fPlanBackward!=NULL)
-				fftwf_destroy_plan(fPlanBackward);
-#else
-			if (fPlanForward != NULL)
-				fftw_destroy_plan(fPlanForward);
-			if (fPlanBackward != NULL)
-				fftw_destroy_plan(fPlanBackward);
-
-			fPlanForward = NULL;
-			fPlanBackward = NULL;
-#endif
-		}
+		// The plans are shared with other transformers through the plan cache, so they are not destroyed here
+		fPlanForward = NULL;
+		fPlanBackward = NULL;
 	}
 
 	void FourierTransformer::setThreadsNumber(int tNumber)
 	{
-//#pragma omp critical(Plan)
-//		{
-//			if (tNumber != 1)
-//			{
-//				threadsSetOn = true;
-//				nthreads = tNumber;
-//#ifdef FLOAT_PRECISION
-//				if(fftwf_init_threads()==0)
-//					REPORT_ERROR("FFTW cannot init threads (setThreadsNumber)");
-//				fftwf_plan_with_nthreads(nthreads);
-//#else
-//				if (fftw_init_threads() == 0)
-//					REPORT_ERROR("FFTW cannot init threads (setThreadsNumber)");
-//				fftw_plan_with_nthreads(nthreads);
-//#endif
-//			}
-//		}
+		tNumber = getTaskNrThreads(tNumber);
+		if (tNumber < 1)
+			tNumber = 1;
+		if (tNumber == nthreads)
+			return;
+
+		if (tNumber != 1)
+		{
+			if (!initFFTWThreads())
+				REPORT_ERROR("FFTW cannot init threads (setThreadsNumber)");
+			threadsSetOn = true;
+		}
+		nthreads = tNumber;
+
+		// Force new plans (for the new number of threads) at the next setReal
+		destroyPlans();
+		dataPtr = NULL;
+		complexDataPtr = NULL;
 	}
 
 	// Initialization ----------------------------------------------------------
@@ -221,26 +411,13 @@ namespace relion
 				break;
 			}
 
-			// Destroy both forward and backward plans if they already exist
+			// Release both forward and backward plans if they already exist
 			destroyPlans();
 
-#pragma omp critical(Plan)
-			{
-				// Make new plans
-#ifdef FLOAT_PRECISION
-				fPlanForward = fftwf_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-					(fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-				fPlanBackward = fftwf_plan_dft_c2r(ndim, N,
-					(fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-					FFTW_ESTIMATE);
-#else
-				fPlanForward = fftw_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-					(fftw_complex*)MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-				fPlanBackward = fftw_plan_dft_c2r(ndim, N,
-					(fftw_complex*)MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-					FFTW_ESTIMATE);
-#endif
-			}
+			// Get plans for this size and alignment from the cache (or make them)
+			fPlanForward = getCachedPlan(PLAN_R2C, ndim, N, MULTIDIM_ARRAY(*fReal), MULTIDIM_ARRAY(fFourier), nthreads);
+			fPlanBackward = getCachedPlan(PLAN_C2R, ndim, N, MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal), nthreads);
+			realTransform = true;
 
 			if (fPlanForward == NULL || fPlanBackward == NULL)
 				REPORT_ERROR("FFTW plans cannot be created");
@@ -362,40 +539,17 @@ namespace relion
 				break;
 			}
 
-//#pragma omp critical(Plan)
-			{
-#ifdef FLOAT_PRECISION
-				if (fPlanForward!=NULL)
-					fftwf_destroy_plan(fPlanForward);
-				fPlanForward=NULL;
-				fPlanForward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
-					(fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-				if (fPlanBackward!=NULL)
-					fftwf_destroy_plan(fPlanBackward);
-				fPlanBackward=NULL;
-				fPlanBackward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(fFourier),
-					(fftwf_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-				if (fPlanForward == NULL || fPlanBackward == NULL)
-					REPORT_ERROR("FFTW plans cannot be created");
-				delete [] N;
-				complexDataPtr=MULTIDIM_ARRAY(*fComplex);
-#else
-				if (fPlanForward != NULL)
-					fftw_destroy_plan(fPlanForward);
-				fPlanForward = NULL;
-				fPlanForward = fftw_plan_dft(ndim, N, (fftw_complex*)MULTIDIM_ARRAY(*fComplex),
-					(fftw_complex*)MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-				if (fPlanBackward != NULL)
-					fftw_destroy_plan(fPlanBackward);
-				fPlanBackward = NULL;
-				fPlanBackward = fftw_plan_dft(ndim, N, (fftw_complex*)MULTIDIM_ARRAY(fFourier),
-					(fftw_complex*)MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-				if (fPlanForward == NULL || fPlanBackward == NULL)
-					REPORT_ERROR("FFTW plans cannot be created");
-				delete[] N;
-				complexDataPtr = MULTIDIM_ARRAY(*fComplex);
-#endif
-			}
+			// Release both forward and backward plans if they already exist
+			destroyPlans();
+
+			// Get plans for this size and alignment from the cache (or make them)
+			fPlanForward = getCachedPlan(PLAN_DFT_FORWARD, ndim, N, MULTIDIM_ARRAY(*fComplex), MULTIDIM_ARRAY(fFourier), nthreads);
+			fPlanBackward = getCachedPlan(PLAN_DFT_BACKWARD, ndim, N, MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fComplex), nthreads);
+			realTransform = false;
+			if (fPlanForward == NULL || fPlanBackward == NULL)
+				REPORT_ERROR("FFTW plans cannot be created");
+			delete [] N;
+			complexDataPtr=MULTIDIM_ARRAY(*fComplex);
 		}
 	}
 
@@ -408,12 +562,22 @@ namespace relion
 	// Transform ---------------------------------------------------------------
 	void FourierTransformer::Transform(int sign)
 	{
+		INSTRUMENT_TIMER(TIMER_FFT);
+		INSTRUMENT_COUNT(COUNT_FFTS, 1);
+
+		// The cached plans may have been made for other arrays, so always pass the current ones
 		if (sign == FFTW_FORWARD)
 		{
 	#ifdef FLOAT_PRECISION
-			fftwf_execute(fPlanForward);
+			if (realTransform)
+				fftwf_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(*fReal), (fftwf_complex*)MULTIDIM_ARRAY(fFourier));
+			else
+				fftwf_execute_dft(fPlanForward, (fftwf_complex*)MULTIDIM_ARRAY(*fComplex), (fftwf_complex*)MULTIDIM_ARRAY(fFourier));
 	#else
-			fftw_execute(fPlanForward);
+			if (realTransform)
+				fftw_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(*fReal), (fftw_complex*)MULTIDIM_ARRAY(fFourier));
+			else
+				fftw_execute_dft(fPlanForward, (fftw_complex*)MULTIDIM_ARRAY(*fComplex), (fftw_complex*)MULTIDIM_ARRAY(fFourier));
 	#endif
 			// Normalisation of the transform
 			unsigned long int size=0;
@@ -430,9 +594,15 @@ namespace relion
 		else if (sign == FFTW_BACKWARD)
 		{
 	#ifdef FLOAT_PRECISION
-			fftwf_execute(fPlanBackward);
+			if (realTransform)
+				fftwf_execute_dft_c2r(fPlanBackward, (fftwf_complex*)MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+			else
+				fftwf_execute_dft(fPlanBackward, (fftwf_complex*)MULTIDIM_ARRAY(fFourier), (fftwf_complex*)MULTIDIM_ARRAY(*fComplex));
 	#else
-			fftw_execute(fPlanBackward);
+			if (realTransform)
+				fftw_execute_dft_c2r(fPlanBackward, (fftw_complex*)MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+			else
+				fftw_execute_dft(fPlanBackward, (fftw_complex*)MULTIDIM_ARRAY(fFourier), (fftw_complex*)MULTIDIM_ARRAY(*fComplex));
 	#endif
 		}
 	}
@@ -477,6 +647,8 @@ namespace relion
 			}
 			break;
 		case 3:
+			// Every point is in at most one pair (k, i) - (ksym, isym), so the planes can be done in parallel
+#pragma omp parallel for num_threads(nthreads)
 			for (long int k=0; k<ZSIZE(*fReal); k++)
 			{
         		long int ksym=intWRAP(-k,0,ZSIZE(*fReal)-1);
@@ -504,6 +676,96 @@ namespace relion
 	}
 
 
+	// Batched 2D transforms ---------------------------------------------------
+	BatchFourierTransformer::BatchFourierTransformer()
+	{
+		fPlanForward = NULL;
+		fPlanBackward = NULL;
+		nthreads = 1;
+	}
+
+	void BatchFourierTransformer::setThreadsNumber(int tNumber)
+	{
+		tNumber = getTaskNrThreads(tNumber);
+		if (tNumber > 1 && !initFFTWThreads())
+			REPORT_ERROR("FFTW cannot init threads (BatchFourierTransformer::setThreadsNumber)");
+		nthreads = XMIPP_MAX(1, tNumber);
+	}
+
+	void BatchFourierTransformer::FourierTransform(MultidimArray<DOUBLE> &stack, MultidimArray<Complex > &Fstack, int current_size)
+	{
+		if (ZSIZE(stack) != 1 || YSIZE(stack) == 1)
+			REPORT_ERROR("BatchFourierTransformer::FourierTransform ERROR: input should be a stack of 2D images");
+
+		int N[2];
+		N[0] = YSIZE(stack);
+		N[1] = XSIZE(stack);
+		long int xdim_ft = XSIZE(stack) / 2 + 1;
+		bool do_window = (current_size > 0 && current_size < XSIZE(stack));
+		if (do_window && YSIZE(stack) != XSIZE(stack))
+			REPORT_ERROR("BatchFourierTransformer::FourierTransform ERROR: windowing is only possible for square images");
+
+		// Without windowing the transforms go straight into Fstack
+		MultidimArray<Complex > &Ffull = (do_window) ? fFourier : Fstack;
+		Ffull.resize(NSIZE(stack), 1, YSIZE(stack), xdim_ft);
+
+		fPlanForward = getCachedPlan(PLAN_R2C, 2, N, MULTIDIM_ARRAY(stack), MULTIDIM_ARRAY(Ffull), nthreads, NSIZE(stack));
+		if (fPlanForward == NULL)
+			REPORT_ERROR("FFTW plans cannot be created");
+		{
+			INSTRUMENT_TIMER(TIMER_FFT);
+			INSTRUMENT_COUNT(COUNT_FFTS, NSIZE(stack));
+#ifdef FLOAT_PRECISION
+			fftwf_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(stack), (fftwf_complex*)MULTIDIM_ARRAY(Ffull));
+#else
+			fftw_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(stack), (fftw_complex*)MULTIDIM_ARRAY(Ffull));
+#endif
+		}
+
+		// Same normalisation as FourierTransformer
+		DOUBLE size = (DOUBLE)YXSIZE(stack);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ffull)
+			DIRECT_MULTIDIM_ELEM(Ffull, n) /= size;
+
+		if (do_window)
+		{
+			// Keep the lowest frequencies of each transform, as in windowFourierTransform
+			long int newhdim = current_size / 2 + 1;
+			Fstack.resize(NSIZE(stack), 1, current_size, newhdim);
+			for (long int img = 0; img < NSIZE(stack); img++)
+			{
+				for (long int i = 0; i < current_size; i++)
+				{
+					long int ip = (i < newhdim) ? i : i - current_size;
+					long int iin = (ip < 0) ? ip + YSIZE(Ffull) : ip;
+					memcpy(&DIRECT_NZYX_ELEM(Fstack, img, 0, i, 0), &DIRECT_NZYX_ELEM(Ffull, img, 0, iin, 0), newhdim * sizeof(Complex));
+				}
+			}
+		}
+	}
+
+	void BatchFourierTransformer::inverseFourierTransform(MultidimArray<Complex > &Fstack, MultidimArray<DOUBLE> &stack)
+	{
+		if (ZSIZE(stack) != 1 || YSIZE(stack) == 1)
+			REPORT_ERROR("BatchFourierTransformer::inverseFourierTransform ERROR: output should be a stack of 2D images");
+		if (NSIZE(Fstack) != NSIZE(stack) || YSIZE(Fstack) != YSIZE(stack) || XSIZE(Fstack) != XSIZE(stack) / 2 + 1)
+			REPORT_ERROR("BatchFourierTransformer::inverseFourierTransform ERROR: Fstack and stack have incompatible sizes");
+
+		int N[2];
+		N[0] = YSIZE(stack);
+		N[1] = XSIZE(stack);
+		fPlanBackward = getCachedPlan(PLAN_C2R, 2, N, MULTIDIM_ARRAY(Fstack), MULTIDIM_ARRAY(stack), nthreads, NSIZE(stack));
+		if (fPlanBackward == NULL)
+			REPORT_ERROR("FFTW plans cannot be created");
+		INSTRUMENT_TIMER(TIMER_FFT);
+		INSTRUMENT_COUNT(COUNT_FFTS, NSIZE(stack));
+#ifdef FLOAT_PRECISION
+		fftwf_execute_dft_c2r(fPlanBackward, (fftwf_complex*)MULTIDIM_ARRAY(Fstack), MULTIDIM_ARRAY(stack));
+#else
+		fftw_execute_dft_c2r(fPlanBackward, (fftw_complex*)MULTIDIM_ARRAY(Fstack), MULTIDIM_ARRAY(stack));
+#endif
+	}
+
 	void randomizePhasesBeyond(MultidimArray<DOUBLE> &v, int index)
 	{
 		MultidimArray< Complex > FT;
@@ -534,36 +796,18 @@ namespace relion
 	// from precalculated Fourier Transforms, and without sampling rate etc.
 	void getFSC(MultidimArray< Complex > &FT1,
 				MultidimArray< Complex > &FT2,
-				MultidimArray< DOUBLE > &fsc)
+				MultidimArray< DOUBLE > &fsc,
+				int nr_threads)
 	{
 		if (!FT1.sameShape(FT2))
 			REPORT_ERROR("fourierShellCorrelation ERROR: MultidimArrays have different shapes!");
 
-		MultidimArray< int > radial_count(XSIZE(FT1));
-		MultidimArray<DOUBLE> num, den1, den2;
-		Matrix1D<DOUBLE> f(3);
-		num.initZeros(radial_count);
-		den1.initZeros(radial_count);
-		den2.initZeros(radial_count);
-		fsc.initZeros(radial_count);
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(FT1)
-		{
-    		int idx = ROUND(sqrt(kp*kp + ip*ip + jp*jp));
-			if (idx >= XSIZE(FT1))
-        		continue;
-			Complex z1=DIRECT_A3D_ELEM(FT1, k, i, j);
-			Complex z2=DIRECT_A3D_ELEM(FT2, k, i, j);
-			DOUBLE absz1=abs(z1);
-			DOUBLE absz2=abs(z2);
-			num(idx)+= (conj(z1) * z2).real;
-			den1(idx)+= absz1*absz1;
-			den2(idx)+= absz2*absz2;
-			radial_count(idx)++;
-		}
-
+		ShellSums sums;
+		sums.compute(*ShellIndexMap::get(FT1, ShellIndexMap::FFTW_LAYOUT, XSIZE(FT1)), FT1, &FT2, false, nr_threads);
+		fsc.initZeros(XSIZE(FT1));
 		FOR_ALL_ELEMENTS_IN_ARRAY1D(fsc)
 		{
-			fsc(i) = num(i)/sqrt(den1(i)*den2(i));
+			fsc(i) = sums.sum_cross(i)/sqrt(sums.sum_norm1(i)*sums.sum_norm2(i));
 		}
 
 	}
@@ -571,13 +815,14 @@ namespace relion
 
 	void getFSC(MultidimArray< DOUBLE > &m1,
 				MultidimArray< DOUBLE > &m2,
-				MultidimArray< DOUBLE > &fsc)
+				MultidimArray< DOUBLE > &fsc,
+				int nr_threads)
 	{
 		MultidimArray< Complex > FT1, FT2;
 		FourierTransformer transformer;
 		transformer.FourierTransform(m1, FT1);
 		transformer.FourierTransform(m2, FT2);
-		getFSC(FT1, FT2, fsc);
+		getFSC(FT1, FT2, fsc, nr_threads);
 	}
 
 	/*
@@ -693,253 +938,121 @@ namespace relion
 	}
 
 
-	// Shift an image through phase-shifts in its Fourier Transform
-	void shiftImageInFourierTransform(MultidimArray<Complex > &in,
-									  MultidimArray<Complex > &out,
-									  TabSine &tab_sin, TabCosine &tab_cos,
-									  DOUBLE oridim, DOUBLE xshift, DOUBLE yshift, DOUBLE zshift)
+	/* Apply nr_shifts phase shifts to all rows of in: out[ishift] = in shifted by -(xshift, yshift, zshift)[ishift] * oridim
+	 * (xshift etc. have already been divided by -oridim). Each row of in is read once for all shifts.
+	 */
+	static void shiftFourierRows(const MultidimArray<Complex > &in, Complex **out, int nr_shifts,
+		const DOUBLE *xshift, const DOUBLE *yshift, const DOUBLE *zshift)
 	{
-		out.resize(in);
-		DOUBLE dotp, a, b, c, d, ac, bd, ab_cd, x, y, z;
-		switch (in.getDim())
+		PhaseShiftRowKernel shiftFourierRow = getSimdKernels().phase_shift_row;
+		for (long int k = 0; k < ZSIZE(in); k++)
 		{
-		case 1:
-			xshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int j = 0; j < XSIZE(in); j++)
+			double z = (k < XSIZE(in)) ? k : k - ZSIZE(in);
+			for (long int i = 0; i < YSIZE(in); i++)
 			{
-				x = j;
-				dotp = 2 * PI * (x * xshift);
-				a = tab_cos(dotp);
-				b = tab_sin(dotp);
-				c = DIRECT_A1D_ELEM(in, j).real;
-				d = DIRECT_A1D_ELEM(in, j).imag;
-				ac = a * c;
-				bd = b * d;
-				ab_cd = (a + b) * (c + d); // (ab_cd-ac-bd = ad+bc : but needs 4 multiplications)
-				DIRECT_A1D_ELEM(out, j) = Complex(ac - bd, ab_cd - ac - bd);
-			}
-			break;
-		case 2:
-			xshift /= -oridim;
-			yshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY && ABS(yshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int i=0; i<XSIZE(in); i++)
-				for (long int j=0; j<XSIZE(in); j++)
-				{
-					x = j;
-					y = i;
-					dotp = 2 * PI * (x * xshift + y * yshift);
-					a = tab_cos(dotp);
-					b = tab_sin(dotp);
-					c = DIRECT_A2D_ELEM(in, i, j).real;
-					d = DIRECT_A2D_ELEM(in, i, j).imag;
-					ac = a * c;
-					bd = b * d;
-					ab_cd = (a + b) * (c + d);
-					DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
-				}
-			for (long int i=YSIZE(in)-1; i>=XSIZE(in); i--)
-			{
-				y = i - YSIZE(in);
-				for (long int j=0; j<XSIZE(in); j++)
+				double y = (i < XSIZE(in)) ? i : i - YSIZE(in);
+				long int offset = (k * YSIZE(in) + i) * XSIZE(in);
+				for (int ishift = 0; ishift < nr_shifts; ishift++)
 				{
-					x = j;
-					dotp = 2 * PI * (x * xshift + y * yshift);
-					a = tab_cos(dotp);
-					b = tab_sin(dotp);
-					c = DIRECT_A2D_ELEM(in, i, j).real;
-					d = DIRECT_A2D_ELEM(in, i, j).imag;
-					ac = a * c;
-					bd = b * d;
-					ab_cd = (a + b) * (c + d);
-					DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
+					double phase0 = 2 * PI * (y * (double)yshift[ishift] + z * (double)zshift[ishift]);
+					shiftFourierRow(MULTIDIM_ARRAY(in) + offset, out[ishift] + offset, XSIZE(in), phase0, 2 * PI * (double)xshift[ishift]);
 				}
 			}
-			break;
-		case 3:
-			xshift /= -oridim;
-			yshift /= -oridim;
-			zshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY && ABS(yshift) < XMIPP_EQUAL_ACCURACY && ABS(zshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int k=0; k<ZSIZE(in); k++)
-			{
-				z = (k < XSIZE(in)) ? k : k - ZSIZE(in);
-				for (long int i=0; i<YSIZE(in); i++)
-				{
-					y = (i < XSIZE(in)) ? i : i - YSIZE(in);
-					for (long int j=0; j<XSIZE(in); j++)
-					{
-						x = j;
-						dotp = 2 * PI * (x * xshift + y * yshift + z * zshift);
-						a = tab_cos(dotp);
-						b = tab_sin(dotp);
-						c = DIRECT_A3D_ELEM(in, k, i, j).real;
-						d = DIRECT_A3D_ELEM(in, k, i, j).imag;
-						ac = a * c;
-						bd = b * d;
-						ab_cd = (a + b) * (c + d);
-						DIRECT_A3D_ELEM(out, k, i, j) = Complex(ac - bd, ab_cd - ac - bd);
-					}
-				}
-			}
-			break;
-		default:
-			REPORT_ERROR("shiftImageInFourierTransform ERROR: dimension should be 1, 2 or 3!");
 		}
 	}
+
+	// Shift an image through phase-shifts in its Fourier Transform
+	// (the phase factors are calculated by recurrence, which is faster and more accurate than the tabulated sine and cosine,
+	// so the tables are not used)
+	void shiftImageInFourierTransform(MultidimArray<Complex > &in,
+									  MultidimArray<Complex > &out,
+									  TabSine &/*tab_sin*/, TabCosine &/*tab_cos*/,
+									  DOUBLE oridim, DOUBLE xshift, DOUBLE yshift, DOUBLE zshift)
+	{
+		shiftImageInFourierTransform(in, out, oridim, xshift, yshift, zshift);
+	}
+
 	// Shift an image through phase-shifts in its Fourier Transform (without pretabulated sine and cosine)
 	void shiftImageInFourierTransform(MultidimArray<Complex > &in,
 									  MultidimArray<Complex > &out,
 									  DOUBLE oridim, DOUBLE xshift, DOUBLE yshift, DOUBLE zshift)
 	{
+		if (in.getDim() < 1 || in.getDim() > 3)
+			REPORT_ERROR("shiftImageInFourierTransform ERROR: dimension should be 1, 2 or 3!");
+
 		out.resize(in);
-		DOUBLE dotp, a, b, c, d, ac, bd, ab_cd, x, y, z;
-		switch (in.getDim())
+		xshift /= -oridim;
+		yshift /= -oridim;
+		zshift /= -oridim;
+		// Only the shifts along the dimensions of the image count
+		if (in.getDim() < 2)
+			yshift = 0.;
+		if (in.getDim() < 3)
+			zshift = 0.;
+		if (ABS(xshift) < XMIPP_EQUAL_ACCURACY && ABS(yshift) < XMIPP_EQUAL_ACCURACY && ABS(zshift) < XMIPP_EQUAL_ACCURACY)
 		{
-		case 1:
-			xshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int j = 0; j < XSIZE(in); j++)
-			{
-				x = j;
-				dotp = 2 * PI * (x * xshift);
-				a = cos(dotp);
-				b = sin(dotp);
-				c = DIRECT_A1D_ELEM(in, j).real;
-				d = DIRECT_A1D_ELEM(in, j).imag;
-				ac = a * c;
-				bd = b * d;
-				ab_cd = (a + b) * (c + d); // (ab_cd-ac-bd = ad+bc : but needs 4 multiplications)
-				DIRECT_A1D_ELEM(out, j) = Complex(ac - bd, ab_cd - ac - bd);
-			}
-			break;
-		case 2:
-			xshift /= -oridim;
-			yshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY && ABS(yshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int i=0; i<XSIZE(in); i++)
-				for (long int j=0; j<XSIZE(in); j++)
-				{
-					x = j;
-					y = i;
-					dotp = 2 * PI * (x * xshift + y * yshift);
-					a = cos(dotp);
-					b = sin(dotp);
-					c = DIRECT_A2D_ELEM(in, i, j).real;
-					d = DIRECT_A2D_ELEM(in, i, j).imag;
-					ac = a * c;
-					bd = b * d;
-					ab_cd = (a + b) * (c + d);
-					DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
-				}
-			for (long int i=YSIZE(in)-1; i>=XSIZE(in); i--)
-			{
-				y = i - YSIZE(in);
-				for (long int j=0; j<XSIZE(in); j++)
-				{
-					x = j;
-					dotp = 2 * PI * (x * xshift + y * yshift);
-					a = cos(dotp);
-					b = sin(dotp);
-					c = DIRECT_A2D_ELEM(in, i, j).real;
-					d = DIRECT_A2D_ELEM(in, i, j).imag;
-					ac = a * c;
-					bd = b * d;
-					ab_cd = (a + b) * (c + d);
-					DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
-				}
-			}
-			break;
-		case 3:
-			xshift /= -oridim;
-			yshift /= -oridim;
-			zshift /= -oridim;
-			if (ABS(xshift) < XMIPP_EQUAL_ACCURACY && ABS(yshift) < XMIPP_EQUAL_ACCURACY && ABS(zshift) < XMIPP_EQUAL_ACCURACY)
-			{
-				out = in;
-				return;
-			}
-			for (long int k=0; k<ZSIZE(in); k++)
-			{
-				z = (k < XSIZE(in)) ? k : k - ZSIZE(in);
-				for (long int i=0; i<YSIZE(in); i++)
-				{
-					y = (i < XSIZE(in)) ? i : i - YSIZE(in);
-					for (long int j=0; j<XSIZE(in); j++)
-					{
-						x = j;
-						dotp = 2 * PI * (x * xshift + y * yshift + z * zshift);
-						a = cos(dotp);
-						b = sin(dotp);
-						c = DIRECT_A3D_ELEM(in, k, i, j).real;
-						d = DIRECT_A3D_ELEM(in, k, i, j).imag;
-						ac = a * c;
-						bd = b * d;
-						ab_cd = (a + b) * (c + d);
-						DIRECT_A3D_ELEM(out, k, i, j) = Complex(ac - bd, ab_cd - ac - bd);
-					}
-				}
-			}
-			break;
-		default:
-			REPORT_ERROR("shiftImageInFourierTransform ERROR: dimension should be 1, 2 or 3!");
+			out = in;
+			return;
 		}
+
+		Complex *dest = MULTIDIM_ARRAY(out);
+		shiftFourierRows(in, &dest, 1, &xshift, &yshift, &zshift);
+	}
+
+	void shiftImageInFourierTransformBatch(const MultidimArray<Complex > &in,
+										   std::vector<MultidimArray<Complex > > &out,
+										   DOUBLE oridim, const std::vector<DOUBLE> &xshift,
+										   const std::vector<DOUBLE> &yshift, const std::vector<DOUBLE> &zshift)
+	{
+		if (in.getDim() < 1 || in.getDim() > 3)
+			REPORT_ERROR("shiftImageInFourierTransformBatch ERROR: dimension should be 1, 2 or 3!");
+		int nr_shifts = xshift.size();
+		if ((in.getDim() > 1 && yshift.size() != xshift.size()) || (in.getDim() > 2 && zshift.size() != xshift.size()))
+			REPORT_ERROR("shiftImageInFourierTransformBatch ERROR: there should be as many x-, y- and z-shifts as nr of dimensions");
+
+		out.resize(nr_shifts);
+		std::vector<DOUBLE> xs(nr_shifts), ys(nr_shifts, 0.), zs(nr_shifts, 0.);
+		std::vector<Complex*> dest(nr_shifts);
+		for (int ishift = 0; ishift < nr_shifts; ishift++)
+		{
+			out[ishift].resize(in);
+			dest[ishift] = MULTIDIM_ARRAY(out[ishift]);
+			xs[ishift] = xshift[ishift] / -oridim;
+			if (in.getDim() > 1)
+				ys[ishift] = yshift[ishift] / -oridim;
+			if (in.getDim() > 2)
+				zs[ishift] = zshift[ishift] / -oridim;
+		}
+		if (nr_shifts > 0)
+			shiftFourierRows(in, &dest[0], nr_shifts, &xs[0], &ys[0], &zs[0]);
 	}
 
 	void getSpectrum(MultidimArray<DOUBLE> &Min,
 					 MultidimArray<DOUBLE> &spectrum,
-					 int spectrum_type)
+					 int spectrum_type,
+					 int nr_threads)
 	{
 
 		MultidimArray<Complex > Faux;
 		int xsize = XSIZE(Min);
-		Matrix1D<DOUBLE> f(3);
-		MultidimArray<DOUBLE> count(xsize);
 		FourierTransformer transformer;
 
-		spectrum.initZeros(xsize);
-		count.initZeros();
 		transformer.FourierTransform(Min, Faux, false);
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Faux)
-		{
-    		long int idx = ROUND(sqrt(kp*kp + ip*ip + jp*jp));
-			if (spectrum_type == AMPLITUDE_SPECTRUM)
-				spectrum(idx) += abs(dAkij(Faux, k, i, j));
-			else
-				spectrum(idx) += norm(dAkij(Faux, k, i, j));
-			count(idx) += 1.;
-		}
+		ShellSums sums;
+		sums.compute(*ShellIndexMap::get(Faux, ShellIndexMap::FFTW_LAYOUT, xsize), Faux, NULL,
+			spectrum_type == AMPLITUDE_SPECTRUM, nr_threads);
+		spectrum = (spectrum_type == AMPLITUDE_SPECTRUM) ? sums.sum_abs1 : sums.sum_norm1;
 
 		for (long int i = 0; i < xsize; i++)
-			if (count(i) > 0.)
-				spectrum(i) /= count(i);
+			if (sums.count(i) > 0.)
+				spectrum(i) /= sums.count(i);
 
 	}
 
 	void divideBySpectrum(MultidimArray<DOUBLE> &Min,
 						  MultidimArray<DOUBLE> &spectrum,
-						  bool leave_origin_intact)
+						  bool leave_origin_intact,
+						  int nr_threads)
 	{
 
 		MultidimArray<DOUBLE> div_spec(spectrum);
@@ -950,16 +1063,16 @@ namespace relion
 			else
 				dAi(div_spec,i) = 1.;
 		}
-		multiplyBySpectrum(Min,div_spec,leave_origin_intact);
+		multiplyBySpectrum(Min,div_spec,leave_origin_intact,nr_threads);
 	}
 
 	void multiplyBySpectrum(MultidimArray<DOUBLE> &Min,
 							MultidimArray<DOUBLE> &spectrum,
-							bool leave_origin_intact)
+							bool leave_origin_intact,
+							int nr_threads)
 	{
 
 		MultidimArray<Complex > Faux;
-		Matrix1D<DOUBLE> f(3);
 		MultidimArray<DOUBLE> lspectrum;
 		FourierTransformer transformer;
 		//DOUBLE dim3 = XSIZE(Min)*YSIZE(Min)*ZSIZE(Min);
@@ -967,11 +1080,9 @@ namespace relion
 		lspectrum=spectrum;
 		if (leave_origin_intact)
 			lspectrum(0)=1.;
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Faux)
-		{
-    		long int idx = ROUND(sqrt(kp*kp + ip*ip + jp*jp));
-			dAkij(Faux, k, i, j) *=  lspectrum(idx);// * dim3;
-		}
+		// Shells beyond the end of the spectrum are multiplied by its last value
+		multiplyByShellValues(*ShellIndexMap::get(Faux, ShellIndexMap::FFTW_LAYOUT, XMIPP_MAX(XSIZE(Min), XSIZE(lspectrum))),
+			Faux, lspectrum, nr_threads);
 		transformer.inverseFourierTransform();
 
 	}
@@ -980,13 +1091,14 @@ namespace relion
 	void whitenSpectrum(MultidimArray<DOUBLE> &Min,
 						MultidimArray<DOUBLE> &Mout,
 						int spectrum_type,
-						bool leave_origin_intact)
+						bool leave_origin_intact,
+						int nr_threads)
 	{
 
 		MultidimArray<DOUBLE> spectrum;
-		getSpectrum(Min,spectrum,spectrum_type);
+		getSpectrum(Min,spectrum,spectrum_type,nr_threads);
 		Mout=Min;
-		divideBySpectrum(Mout,spectrum,leave_origin_intact);
+		divideBySpectrum(Mout,spectrum,leave_origin_intact,nr_threads);
 
 	}
 
@@ -994,17 +1106,18 @@ namespace relion
 					   MultidimArray<DOUBLE> &Mout,
 					   const MultidimArray<DOUBLE> &spectrum_ref,
 					   int spectrum_type,
-					   bool leave_origin_intact)
+					   bool leave_origin_intact,
+					   int nr_threads)
 	{
 
 		MultidimArray<DOUBLE> spectrum;
-		getSpectrum(Min,spectrum,spectrum_type);
+		getSpectrum(Min,spectrum,spectrum_type,nr_threads);
 		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(spectrum)
 		{
 			dAi(spectrum, i) = (dAi(spectrum, i) > 0.) ? dAi(spectrum_ref,i)/ dAi(spectrum, i) : 1.;
 		}
 		Mout=Min;
-		multiplyBySpectrum(Mout,spectrum,leave_origin_intact);
+		multiplyBySpectrum(Mout,spectrum,leave_origin_intact,nr_threads);
 	}
 
 	/** Kullback-Leibner divergence */
@@ -1104,17 +1217,33 @@ namespace relion
 	}
 	void resizeMap(MultidimArray<DOUBLE > &img, int newsize)
 	{
+		MapResizer resizer;
+		resizer.resizeMap(img, newsize);
+	}
 
-		FourierTransformer transformer;
-		MultidimArray<Complex > FT, FT2;
-		transformer.FourierTransform(img, FT, false);
-		windowFourierTransform(FT, FT2, newsize);
-		if (img.getDim() == 2)
-    		img.resize(newsize, newsize);
-		else if (img.getDim() == 3)
-    		img.resize(newsize, newsize, newsize);
-		transformer.inverseFourierTransform(FT2, img);
+	void MapResizer::setThreadsNumber(int nr_threads)
+	{
+		transformer_in.setThreadsNumber(nr_threads);
+		transformer_out.setThreadsNumber(nr_threads);
+	}
 
+	void MapResizer::resizeMap(MultidimArray<DOUBLE> &img, int newsize)
+	{
+		// Transforming img itself would change the arrays of both transformers at every call
+		img_in = img;
+		resizeMap(img_in, img_out, newsize);
+		img = img_out;
+	}
+
+	void MapResizer::resizeMap(MultidimArray<DOUBLE> &in, MultidimArray<DOUBLE> &out, int newsize)
+	{
+		transformer_in.FourierTransform(in, FT_in, false);
+		windowFourierTransform(FT_in, FT_out, newsize);
+		if (in.getDim() == 2)
+			out.resize(newsize, newsize);
+		else if (in.getDim() == 3)
+			out.resize(newsize, newsize, newsize);
+		transformer_out.inverseFourierTransform(FT_out, out);
 	}
 
 	void applyBFactorToMap(MultidimArray<Complex > &FT, int ori_size, DOUBLE bfactor, DOUBLE angpix)
@@ -1259,14 +1388,90 @@ namespace relion
 		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(Fimg)
 		{
 			DOUBLE delta_phase = factor * (ip * ip + jp * jp) * (ip * beamtilt_y + jp * beamtilt_x);
+			// apply phase shift by multiplication with exp(i * delta_phase), rather than through atan2
+			double a = cos(DEG2RAD((double)delta_phase)), b = sin(DEG2RAD((double)delta_phase));
 			DOUBLE realval = DIRECT_A2D_ELEM(Fimg, i, j).real;
 			DOUBLE imagval = DIRECT_A2D_ELEM(Fimg, i, j).imag;
-			DOUBLE mag = sqrt(realval * realval + imagval * imagval);
-			DOUBLE phas = atan2(imagval, realval) + DEG2RAD(delta_phase); // apply phase shift!
-			realval = mag * cos(phas);
-			imagval = mag * sin(phas);
-			DIRECT_A2D_ELEM(Fimg, i, j) = Complex(realval, imagval);
+			DIRECT_A2D_ELEM(Fimg, i, j) = Complex(a * realval - b * imagval, a * imagval + b * realval);
 		}
 
 	}
+
+	/* The phase of selfApplyBeamTilt is linear in the beamtilt: for frequency (ip, jp) and trial (ix, iy) it is
+	 * phase0 + ix * dphase_x + iy * dphase_y. With c = w * conj(Fimg) * Fref, the weighted squared difference is
+	 * w * (|Fimg|^2 + |Fref|^2) - 2 * Re(c * exp(i * phase)), so that only the last term depends on the trial.
+	 * For each frequency, its values for all trials are obtained from exp(i * phase0), exp(i * dphase_x) and exp(i * dphase_y)
+	 * by complex multiplications (see the phase_grid_row kernels in simd_kernels.h), instead of one sincos per trial.
+	 * Each row of the transform gets its own partial sums, which are added up in order at the end.
+	 */
+	void computeBeamTiltDifferences(const MultidimArray<Complex > &Fimg, const MultidimArray<Complex > &Fref,
+		const MultidimArray<DOUBLE> &Fweight, DOUBLE beamtilt_x0, DOUBLE beamtilt_y0, DOUBLE beamtilt_step, int nr_x, int nr_y,
+		DOUBLE wavelength, DOUBLE Cs, DOUBLE angpix, int ori_size, MultidimArray<DOUBLE> &diff2,
+		DOUBLE min_radius, int nr_threads)
+	{
+		if (Fimg.getDim() != 2)
+			REPORT_ERROR("computeBeamTiltDifferences can only be done on 2D Fourier Transforms!");
+		if (!Fimg.sameShape(Fref) || (Fweight.nzyxdim > 0 && !Fimg.sameShape(Fweight)))
+			REPORT_ERROR("computeBeamTiltDifferences ERROR: Fimg, Fref and Fweight are not of the same size!");
+		if (nr_x < 1 || nr_y < 1)
+			REPORT_ERROR("computeBeamTiltDifferences ERROR: empty grid of beamtilts!");
+
+		if (diff2.getDim() != 2 || XSIZE(diff2) != nr_x || YSIZE(diff2) != nr_y)
+			diff2.initZeros(nr_y, nr_x);
+
+		DOUBLE boxsize = angpix * ori_size;
+		double factor = DEG2RAD(0.360 * Cs * 10000000 * wavelength * wavelength / (boxsize * boxsize * boxsize));
+		double min_r2 = (double)min_radius * min_radius;
+		long int ntrials = (long int)nr_x * nr_y;
+		long int xdim = XSIZE(Fimg);
+
+		// Per row: the trial-dependent sums followed by the sum of w * (|Fimg|^2 + |Fref|^2)
+		std::vector<double> row_sums(YSIZE(Fimg) * (ntrials + 1), 0.);
+		PhaseGridRowKernel phaseGridRow = getSimdKernels().phase_grid_row;
+
+#pragma omp parallel num_threads(nr_threads)
+		{
+			std::vector<DOUBLE> terms(6 * xdim), work(16 * ntrials);
+			DOUBLE *z_re = &terms[0], *z_im = z_re + xdim;
+			DOUBLE *sx_re = z_im + xdim, *sx_im = sx_re + xdim, *sy_re = sx_im + xdim, *sy_im = sy_re + xdim;
+
+#pragma omp for schedule(dynamic)
+			for (long int i = 0; i < YSIZE(Fimg); i++)
+			{
+				long int ip = (i < xdim) ? i : i - YSIZE(Fimg);
+				double *sums = &row_sums[i * (ntrials + 1)];
+				long int n = 0;
+				for (long int jp = 0; jp < xdim; jp++)
+				{
+					double r2 = (double)(ip * ip + jp * jp);
+					if (r2 < min_r2)
+						continue;
+					double w = (Fweight.nzyxdim > 0) ? DIRECT_A2D_ELEM(Fweight, i, jp) : 1.;
+					Complex F = DIRECT_A2D_ELEM(Fimg, i, jp), R = DIRECT_A2D_ELEM(Fref, i, jp);
+					sums[ntrials] += w * ((double)F.real * F.real + (double)F.imag * F.imag + (double)R.real * R.real + (double)R.imag * R.imag);
+					double cre = w * ((double)F.real * R.real + (double)F.imag * R.imag);
+					double cim = w * ((double)F.real * R.imag - (double)F.imag * R.real);
+					double phase0 = factor * r2 * (ip * (double)beamtilt_y0 + jp * (double)beamtilt_x0);
+					double dphase_x = factor * r2 * jp * beamtilt_step, dphase_y = factor * r2 * ip * beamtilt_step;
+					double a = cos(phase0), b = sin(phase0);
+					z_re[n] = cre * a - cim * b;
+					z_im[n] = cre * b + cim * a;
+					sx_re[n] = cos(dphase_x);
+					sx_im[n] = sin(dphase_x);
+					sy_re[n] = cos(dphase_y);
+					sy_im[n] = sin(dphase_y);
+					n++;
+				}
+				phaseGridRow(z_re, z_im, sx_re, sx_im, sy_re, sy_im, n, nr_x, nr_y, &work[0], sums);
+			}
+		}
+
+		for (long int k = 0; k < ntrials; k++)
+		{
+			double sum = 0.;
+			for (long int i = 0; i < YSIZE(Fimg); i++)
+				sum += row_sums[i * (ntrials + 1) + ntrials] - 2. * row_sums[i * (ntrials + 1) + k];
+			DIRECT_MULTIDIM_ELEM(diff2, k) += sum;
+		}
+	}
 }
\ No newline at end of file
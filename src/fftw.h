@@ -47,6 +47,7 @@
 #define __XmippFFTW_H
 
 #include <fftw/fftw3.h>
+#include <algorithm>
 //#include <cufftw.h>
 #include "src/multidim_array.h"
 #include "src/funcs.h"
@@ -337,19 +338,24 @@ namespace relion
 		/* Pointer to the array of complex<DOUBLE> with which the plan was computed */
 		Complex * complexDataPtr;
 
+		/* The current plans are for the real (r2c/c2r) transform of fReal, rather than the complex one of fComplex */
+		bool realTransform;
+
 		/* Initialise all pointers to NULL */
 		void init();
 
 		/** Clear object */
 		void clear();
 
-		/** This calls fftw_cleanup.
-		 * NOTE!! When using multiple threads, only ONE thread can call this function, as it cleans up things that are shared among all threads...
-		 *  Therefore, this cleanup is something that needs to be done manually...
+		/** Clear this object
+		 * The cached plans and the rest of the fftw state are shared by all transformers in the program, so they are
+		 * left alone. Call clearFFTWPlanCache() and fftw_cleanup() manually once no transformer is in use anymore.
 		 */
 		void cleanup();
 
-		/** Destroy both forward and backward fftw planes (mutex locked */
+		/** Release both forward and backward fftw plans
+		 * The plans themselves are owned by the global plan cache, see clearFFTWPlanCache()
+		 */
 		void destroyPlans();
 
 		/** Computes the transform, specified in Init() function
@@ -369,7 +375,7 @@ namespace relion
 			transforms it is not modified, but in backward transforms,
 			the result will be stored in img. This means that the size
 			of img cannot change between calls. */
-		void setReal(MultidimArray<double> &img);
+		void setReal(MultidimArray<DOUBLE> &img);
 		// void setReal(MultidimArray<float> &img);
 
 		/** Set a Multidimarray for input.
@@ -387,6 +393,82 @@ namespace relion
 		void setFourier(MultidimArray<Complex > &imgFourier);
 	};
 
+	/** Batched 2D Fourier transforms of all images in a stack.
+	 * @ingroup FourierW
+	 *
+	 * All NSIZE images of a stack (e.g. as read from an MRC stack by Image::read) are transformed
+	 * in one call with a single fftw_plan_many_dft_r2c plan, into one contiguous stack of Fourier transforms.
+	 * The normalisation is the same as for FourierTransformer, and the plans come from the same plan cache.
+	 * Each transform can be windowed to current_size on the fly.
+	 *
+	 * @code
+	 * BatchFourierTransformer batch;
+	 * MultidimArray<Complex > Fstack;
+	 * batch.FourierTransform(img(), Fstack, current_size);
+	 * @endcode
+	 */
+	class BatchFourierTransformer
+	{
+	public:
+#ifdef FLOAT_PRECISION
+		/* fftw Forward plan */
+		fftwf_plan fPlanForward;
+		/* fftw Backward plan */
+		fftwf_plan fPlanBackward;
+#else
+		/* fftw Forward plan */
+		fftw_plan fPlanForward;
+		/* fftw Backward plan */
+		fftw_plan fPlanBackward;
+#endif
+		/* number of threads*/
+		int nthreads;
+
+		/* Full-size transforms, only used when windowing */
+		MultidimArray<Complex > fFourier;
+
+	public:
+		/** Default constructor */
+		BatchFourierTransformer();
+
+		/** Set the number of threads FFTW uses for the plans of this object */
+		void setThreadsNumber(int tNumber);
+
+		/** Forward transforms of all images in stack (NSIZE x 1 x Y x X) into Fstack (NSIZE x 1 x Y x X/2+1).
+		 * If 0 < current_size < X, each transform is windowed to current_size x current_size/2+1
+		 * (only the lowest frequencies are kept, as in windowFourierTransform).
+		 */
+		void FourierTransform(MultidimArray<DOUBLE> &stack, MultidimArray<Complex > &Fstack, int current_size = -1);
+
+		/** Inverse transforms of all (full-size) transforms in Fstack into stack, which should already have the right size.
+		 * Note that the contents of Fstack are destroyed.
+		 */
+		void inverseFourierTransform(MultidimArray<Complex > &Fstack, MultidimArray<DOUBLE> &stack);
+	};
+
+	/** Set the planning rigor for all FFTW plans that are made from now on
+	 * One of FFTW_ESTIMATE (the default), FFTW_MEASURE, FFTW_PATIENT or FFTW_EXHAUSTIVE.
+	 * Plans are cached for the whole program, per transform size, kind, rigor and data alignment,
+	 * so the cost of the more rigorous planning is only paid once for each size.
+	 */
+	void setFFTWPlanningRigor(unsigned int rigor);
+
+	/** Destroy all cached FFTW plans
+	 * Only call this when no FourierTransformer, BatchFourierTransformer or MapResizer is in use anymore,
+	 * as they keep using the cached plans they got until they are re-planned.
+	 */
+	void clearFFTWPlanCache();
+
+	/** Read FFTW wisdom from a file (e.g. written by a previous run), so that planning becomes (nearly) free
+	 * Returns false if the file could not be read.
+	 */
+	bool importFFTWWisdom(const FileName &fn_wisdom);
+
+	/** Write all FFTW wisdom gathered so far to a file
+	 * Returns false if the file could not be written.
+	 */
+	bool exportFFTWWisdom(const FileName &fn_wisdom);
+
 	// Randomize phases beyond the given shell (index)
 	void randomizePhasesBeyond(MultidimArray<DOUBLE> &I, int index);
 
@@ -603,7 +685,33 @@ namespace relion
 
 
 
+	// Row (or plane) of frequency p in a dimension of size n of an FFTW-centered Fourier-transform
+	inline long int getFFTWRow(long int p, long int n)
+	{
+		return (p < 0) ? p + n : p;
+	}
+
+	// Frequency of row (or plane) i of a dimension of size n with half size xdim
+	inline long int getFFTWFrequency(long int i, long int n, long int xdim)
+	{
+		return (i < xdim) ? i : i - n;
+	}
+
+	// The number of elements of a row at squared distance yz2 from the origin with jp*jp + yz2 <= max_r2
+	inline long int getFFTWRowLength(long int max_r2, long int yz2, long int xdim)
+	{
+		if (yz2 > max_r2)
+			return 0;
+		long int n = (long int)sqrt((double)(max_r2 - yz2)) + 1;
+		while (n > 0 && (n - 1) * (n - 1) + yz2 > max_r2)
+			n--;
+		while (n * n + yz2 <= max_r2)
+			n++;
+		return XMIPP_MIN(n, xdim);
+	}
+
 	// Window an FFTW-centered Fourier-transform to a given size
+	// Rows are copied as a whole; out keeps its memory if it already has the new size
 	template<class T>
 	void windowFourierTransform(MultidimArray<T > &in,
 		MultidimArray<T > &out,
@@ -626,36 +734,128 @@ namespace relion
 		switch (in.getDim())
 		{
 		case 1:
-			out.initZeros(newhdim);
+			out.resize(newhdim);
 			break;
 		case 2:
-			out.initZeros(newdim, newhdim);
+			out.resize(newdim, newhdim);
 			break;
 		case 3:
-			out.initZeros(newdim, newdim, newhdim);
+			out.resize(newdim, newdim, newhdim);
 			break;
 		default:
 			REPORT_ERROR("windowFourierTransform ERROR: dimension should be 1, 2 or 3!");
 		}
 		if (newhdim > XSIZE(in))
 		{
+			// Make sure windowed FT has nothing in the corners, otherwise we end up with an asymmetric FT!
 			long int max_r2 = (XSIZE(in) - 1) * (XSIZE(in) - 1);
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(in)
+			std::fill(MULTIDIM_ARRAY(out), MULTIDIM_ARRAY(out) + MULTIDIM_SIZE(out), T());
+			for (long int k = 0; k < ZSIZE(in); k++)
 			{
-				// Make sure windowed FT has nothing in the corners, otherwise we end up with an asymmetric FT!
-				if (kp*kp + ip*ip + jp*jp <= max_r2)
-					FFTW_ELEM(out, kp, ip, jp) = FFTW_ELEM(in, kp, ip, jp);
+				long int kp = getFFTWFrequency(k, ZSIZE(in), XSIZE(in));
+				for (long int i = 0; i < YSIZE(in); i++)
+				{
+					long int ip = getFFTWFrequency(i, YSIZE(in), XSIZE(in));
+					long int n = getFFTWRowLength(max_r2, kp*kp + ip*ip, XSIZE(in));
+					if (n > 0)
+						memcpy(&DIRECT_A3D_ELEM(out, getFFTWRow(kp, ZSIZE(out)), getFFTWRow(ip, YSIZE(out)), 0),
+							&DIRECT_A3D_ELEM(in, k, i, 0), n * sizeof(T));
+				}
 			}
 		}
 		else
 		{
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(out)
+			for (long int k = 0; k < ZSIZE(out); k++)
 			{
-				FFTW_ELEM(out, kp, ip, jp) = FFTW_ELEM(in, kp, ip, jp);
+				long int kp = getFFTWFrequency(k, ZSIZE(out), XSIZE(out));
+				for (long int i = 0; i < YSIZE(out); i++)
+				{
+					long int ip = getFFTWFrequency(i, YSIZE(out), XSIZE(out));
+					memcpy(&DIRECT_A3D_ELEM(out, k, i, 0),
+						&DIRECT_A3D_ELEM(in, getFFTWRow(kp, ZSIZE(in)), getFFTWRow(ip, YSIZE(in)), 0), newhdim * sizeof(T));
+				}
 			}
 		}
 	}
 
+	/* Window an FFTW-centered Fourier-transform to a given size in place
+	 * Shrinking never allocates: the rows are moved to the front of the memory of V, which keeps its allocated size.
+	 * Growing only allocates when V has less memory than the new size needs (e.g. it was not shrunk before).
+	 * V should own its memory (not be an alias of another array).
+	 */
+	template<class T>
+	void windowFourierTransform(MultidimArray<T > &V, long int newdim)
+	{
+		if (YSIZE(V) > 1 && YSIZE(V) / 2 + 1 != XSIZE(V))
+			REPORT_ERROR("windowFourierTransform ERROR: the Fourier transform should be of an image with equal sizes in all dimensions!");
+		long int newhdim = newdim / 2 + 1;
+		if (newhdim == XSIZE(V))
+			return;
+
+		long int newydim, newzdim;
+		switch (V.getDim())
+		{
+		case 1:
+			newydim = newzdim = 1;
+			break;
+		case 2:
+			newydim = newdim;
+			newzdim = 1;
+			break;
+		case 3:
+			newydim = newzdim = newdim;
+			break;
+		default:
+			REPORT_ERROR("windowFourierTransform ERROR: dimension should be 1, 2 or 3!");
+		}
+
+		if (newzdim * newydim * newhdim > V.nzyxdimAlloc)
+		{
+			MultidimArray<T > aux(V);
+			windowFourierTransform(aux, V, newdim);
+			return;
+		}
+
+		long int oldxdim = XSIZE(V), oldydim = YSIZE(V), oldzdim = ZSIZE(V);
+		T *ptr = MULTIDIM_ARRAY(V);
+		if (newhdim < oldxdim)
+		{
+			// Every row moves to the same or a lower address: go forward
+			for (long int k = 0; k < newzdim; k++)
+			{
+				long int kp = getFFTWFrequency(k, newzdim, newhdim);
+				for (long int i = 0; i < newydim; i++)
+				{
+					long int ip = getFFTWFrequency(i, newydim, newhdim);
+					memmove(ptr + (k * newydim + i) * newhdim,
+						ptr + (getFFTWRow(kp, oldzdim) * oldydim + getFFTWRow(ip, oldydim)) * oldxdim, newhdim * sizeof(T));
+				}
+			}
+		}
+		else
+		{
+			// Every row moves to the same or a higher address: go backward, without the corners (as above)
+			long int max_r2 = (oldxdim - 1) * (oldxdim - 1);
+			for (long int k = newzdim - 1; k >= 0; k--)
+			{
+				long int kp = getFFTWFrequency(k, newzdim, newhdim);
+				for (long int i = newydim - 1; i >= 0; i--)
+				{
+					long int ip = getFFTWFrequency(i, newydim, newhdim);
+					T *row = ptr + (k * newydim + i) * newhdim;
+					// Only rows that exist in the old array (the first dimensions of 1D and 2D arrays only have row 0)
+					bool has_k = (oldzdim == 1) ? kp == 0 : (kp < oldxdim && kp >= oldxdim - oldzdim);
+					bool has_i = (oldydim == 1) ? ip == 0 : (ip < oldxdim && ip >= oldxdim - oldydim);
+					long int n = (has_k && has_i) ? getFFTWRowLength(max_r2, kp*kp + ip*ip, oldxdim) : 0;
+					if (n > 0)
+						memmove(row, ptr + (getFFTWRow(kp, oldzdim) * oldydim + getFFTWRow(ip, oldydim)) * oldxdim, n * sizeof(T));
+					std::fill(row + n, row + newhdim, T());
+				}
+			}
+		}
+		V.setDimensions(newhdim, newydim, newzdim, 1);
+	}
+
 	// A resize operation in Fourier-space (i.e. changing the sampling of the Fourier Transform) by windowing in real-space
 	// If recenter=true, the real-space array will be recentered to have its origin at the origin of the FT
 	template<class T>
@@ -744,7 +944,8 @@ namespace relion
 	 */
 	void getFSC(MultidimArray< Complex > &FT1,
 		MultidimArray< Complex > &FT2,
-		MultidimArray< DOUBLE > &fsc);
+		MultidimArray< DOUBLE > &fsc,
+		int nr_threads = 1);
 
 	/** Fourier-Ring-Correlation between two multidimArrays using FFT
 	 * @ingroup FourierOperations
@@ -752,7 +953,8 @@ namespace relion
 	 */
 	void getFSC(MultidimArray< DOUBLE > & m1,
 		MultidimArray< DOUBLE > & m2,
-		MultidimArray< DOUBLE > &fsc);
+		MultidimArray< DOUBLE > &fsc,
+		int nr_threads = 1);
 
 	/** Scale matrix using Fourier transform
 	 * @ingroup FourierOperations
@@ -770,6 +972,8 @@ namespace relion
 	// Note that in and out may be the same array, in that case in is overwritten with the result
 	// if oridim is in pixels, xshift, yshift and zshift should be in pixels as well!
 	// or both can be in Angstroms
+	// tab_sin and tab_cos are ignored: this is the same as the overload without them, which calculates
+	// the phase factors by recurrence. They are only kept for existing callers.
 	void shiftImageInFourierTransform(MultidimArray<Complex > &in,
 		MultidimArray<Complex > &out,
 		TabSine &tab_sin, TabCosine &tab_cos,
@@ -783,6 +987,14 @@ namespace relion
 		MultidimArray<Complex > &out,
 		DOUBLE oridim, DOUBLE shift_x, DOUBLE shift_y, DOUBLE shift_z = 0.);
 
+	// Shift an image by many translations at once: out[i] is in shifted by (shift_x[i], shift_y[i], shift_z[i])
+	// (as with shiftImageInFourierTransform, but each row of in is only read once for all translations)
+	// shift_y and shift_z are only needed for 2D and 3D arrays; out is resized to shift_x.size() arrays of the size of in
+	void shiftImageInFourierTransformBatch(const MultidimArray<Complex > &in,
+		std::vector<MultidimArray<Complex > > &out,
+		DOUBLE oridim, const std::vector<DOUBLE> &shift_x,
+		const std::vector<DOUBLE> &shift_y, const std::vector<DOUBLE> &shift_z = std::vector<DOUBLE>());
+
 #define POWER_SPECTRUM 0
 #define AMPLITUDE_SPECTRUM 1
 
@@ -792,7 +1004,8 @@ namespace relion
 	 */
 	void getSpectrum(MultidimArray<DOUBLE> &Min,
 		MultidimArray<DOUBLE> &spectrum,
-		int spectrum_type = POWER_SPECTRUM);
+		int spectrum_type = POWER_SPECTRUM,
+		int nr_threads = 1);
 
 	/** Divide the input map in Fourier-space by the spectrum provided.
 	 * @ingroup FourierOperations
@@ -800,7 +1013,8 @@ namespace relion
 	 */
 	void divideBySpectrum(MultidimArray<DOUBLE> &Min,
 		MultidimArray<DOUBLE> &spectrum,
-		bool leave_origin_intact = false);
+		bool leave_origin_intact = false,
+		int nr_threads = 1);
 
 	/** Multiply the input map in Fourier-space by the spectrum provided.
 	 * @ingroup FourierOperations
@@ -808,7 +1022,8 @@ namespace relion
 	 */
 	void multiplyBySpectrum(MultidimArray<DOUBLE> &Min,
 		MultidimArray<DOUBLE> &spectrum,
-		bool leave_origin_intact = false);
+		bool leave_origin_intact = false,
+		int nr_threads = 1);
 
 	/** Perform a whitening of the amplitude/power_class spectrum of a 3D map
 	 * @ingroup FourierOperations
@@ -817,7 +1032,8 @@ namespace relion
 	void whitenSpectrum(MultidimArray<DOUBLE> &Min,
 		MultidimArray<DOUBLE> &Mout,
 		int spectrum_type = AMPLITUDE_SPECTRUM,
-		bool leave_origin_intact = false);
+		bool leave_origin_intact = false,
+		int nr_threads = 1);
 
 	/** Adapts Min to have the same spectrum as spectrum_ref
 	 * @ingroup FourierOperations
@@ -827,7 +1043,8 @@ namespace relion
 		MultidimArray<DOUBLE> &Mout,
 		const MultidimArray<DOUBLE> &spectrum_ref,
 		int spectrum_type = AMPLITUDE_SPECTRUM,
-		bool leave_origin_intact = false);
+		bool leave_origin_intact = false,
+		int nr_threads = 1);
 
 	/** Kullback-Leibner divergence */
 	DOUBLE getKullbackLeibnerDivergence(MultidimArray<Complex > &Fimg,
@@ -839,6 +1056,44 @@ namespace relion
 	// Resize a map by windowing it's Fourier Transform
 	void resizeMap(MultidimArray<DOUBLE > &img, int newsize);
 
+	/** Repeated resizeMap of images (or maps) of the same sizes
+	 * @ingroup FourierW
+	 *
+	 * resizeMap() makes a transformer and two Fourier-transform arrays for every call. A MapResizer keeps them,
+	 * with the transformers' plans, so that e.g. downscaling every particle of a stack only costs the two FFTs.
+	 * The result is the same as that of resizeMap(). A MapResizer should only be used by one thread at a time.
+	 *
+	 * @code
+	 * MapResizer resizer;
+	 * MultidimArray<DOUBLE> small;
+	 * for (...)
+	 *     resizer.resizeMap(img(), small, newsize); // no allocations after the first image
+	 * @endcode
+	 */
+	class MapResizer
+	{
+	public:
+		void setThreadsNumber(int nr_threads);
+
+		/** Resize img to newsize (as resizeMap)
+		 * img is copied into and out of arrays of the MapResizer, so that the plans are re-used although
+		 * img itself is re-allocated for every call.
+		 */
+		void resizeMap(MultidimArray<DOUBLE> &img, int newsize);
+
+		/** Resize in into out (which keeps its memory if it already has the new size); in is not changed
+		 * The plans are only re-used while in and out keep their memory from call to call.
+		 */
+		void resizeMap(MultidimArray<DOUBLE> &in, MultidimArray<DOUBLE> &out, int newsize);
+
+	private:
+		FourierTransformer transformer_in, transformer_out;
+		MultidimArray<Complex > FT_in, FT_out;
+
+		// Copies of img for the in-place resizeMap
+		MultidimArray<DOUBLE> img_in, img_out;
+	};
+
 	// Apply a B-factor to a map (given it's Fourier transform)
 	void applyBFactorToMap(MultidimArray<Complex > &FT, int ori_size, DOUBLE bfactor, DOUBLE angpix);
 
@@ -863,5 +1118,18 @@ namespace relion
 
 	void applyBeamTilt(const MultidimArray<Complex > &Fin, MultidimArray<Complex > &Fout, DOUBLE beamtilt_x, DOUBLE beamtilt_y,
 		DOUBLE wavelength, DOUBLE Cs, DOUBLE angpix, int ori_size);
+
+	/*
+	 *  Weighted squared differences between Fimg and the beam-tilted Fref for a grid of nr_x * nr_y trial beamtilts:
+	 *  diff2(iy, ix) += sum_k Fweight(k) * |Fimg(k) - Fref(k) * exp(i * phase(k))|^2, with the phase of selfApplyBeamTilt
+	 *  for beamtilt_x = beamtilt_x0 + ix * beamtilt_step and beamtilt_y = beamtilt_y0 + iy * beamtilt_step.
+	 *  Only frequencies k with a radius of at least min_radius pixels are included, an empty Fweight means all weights are one.
+	 *  All trials are evaluated in a single pass over the images; diff2 is (re)set to zeros if it does not have size nr_y x nr_x.
+	 *  The result does not depend on nr_threads.
+	 */
+	void computeBeamTiltDifferences(const MultidimArray<Complex > &Fimg, const MultidimArray<Complex > &Fref,
+		const MultidimArray<DOUBLE> &Fweight, DOUBLE beamtilt_x0, DOUBLE beamtilt_y0, DOUBLE beamtilt_step, int nr_x, int nr_y,
+		DOUBLE wavelength, DOUBLE Cs, DOUBLE angpix, int ori_size, MultidimArray<DOUBLE> &diff2,
+		DOUBLE min_radius = 0., int nr_threads = 1);
 }
 #endif
@@ -56,6 +56,7 @@
 #include <algorithm>
 #include <vector>
 #include <typeinfo>
+#include <memory>
 
 #include "src/numerical_recipes.h"
 #include "src/macros.h"
@@ -516,6 +517,21 @@ namespace relion
 	/** Returns the base directory of the Xmipp installation
 	 */
 	FileName xmippBaseDir();
+
+	/** Deleter for a std::unique_ptr holding a FILE*, so that the file is closed if an error is thrown
+	 *
+	 * @code
+	 * std::unique_ptr<FILE, FileCloser> fp(fopen(fn.c_str(), "wb"));
+	 * @endcode
+	 */
+	struct FileCloser
+	{
+		void operator()(FILE* fp) const
+		{
+			if (fp != NULL)
+				fclose(fp);
+		}
+	};
 	//@}
 }
 #endif /* FILENAME_H_ */
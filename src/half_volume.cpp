@@ -0,0 +1,73 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/half_volume.h"
+
+namespace relion
+{
+	void HalfFourierVolume::clear()
+	{
+		xdim = ydim = zdim = starty = startz = 0;
+		scale = 1.;
+		values.clear();
+	}
+
+	void HalfFourierVolume::initialise(const MultidimArray<Complex > &vol, int nr_threads)
+	{
+		if (vol.getDim() != 3)
+			REPORT_ERROR("HalfFourierVolume::initialise: the volume should be 3D");
+		if (STARTINGX(vol) != 0)
+			REPORT_ERROR("HalfFourierVolume::initialise: the volume should have STARTINGX = 0");
+		if (NZYXSIZE(vol) * 2 > 2147483647L)
+			REPORT_ERROR("HalfFourierVolume::initialise: the volume is too large for 32-bit indices");
+
+		xdim = XSIZE(vol);
+		ydim = YSIZE(vol);
+		zdim = ZSIZE(vol);
+		starty = STARTINGY(vol);
+		startz = STARTINGZ(vol);
+
+		const DOUBLE *v = (const DOUBLE *)MULTIDIM_ARRAY(vol);
+		long int n = 2 * NZYXSIZE(vol);
+		DOUBLE maxval = 0.;
+		for (long int i = 0; i < n; i++)
+			maxval = XMIPP_MAX(maxval, ABS(v[i]));
+		scale = (maxval > 0.) ? maxval / 32768. : 1.;
+
+		values.resize(n);
+		float inv_scale = 1. / scale;
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int i = 0; i < n; i++)
+			values[i] = floatToHalf(v[i] * inv_scale);
+	}
+
+	void HalfFourierVolume::getArray(MultidimArray<Complex > &vol, int nr_threads) const
+	{
+		vol.resize(zdim, ydim, xdim);
+		STARTINGX(vol) = 0;
+		STARTINGY(vol) = starty;
+		STARTINGZ(vol) = startz;
+		DOUBLE *v = (DOUBLE *)MULTIDIM_ARRAY(vol);
+		long int n = values.size();
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int i = 0; i < n; i++)
+			v[i] = scale * halfToFloat(values[i]);
+	}
+}
@@ -0,0 +1,144 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef HALF_VOLUME_H
+#define HALF_VOLUME_H
+
+#include <vector>
+#include <string.h>
+#include "src/multidim_array.h"
+
+namespace relion
+{
+	// IEEE half-precision bits of f (rounded to nearest even; overflows become infinity)
+	inline unsigned short floatToHalf(float f)
+	{
+		unsigned int x;
+		memcpy(&x, &f, sizeof(x));
+		unsigned int sign = (x >> 16) & 0x8000;
+		unsigned int mant = x & 0x7fffff;
+		int exp = (x >> 23) & 0xff;
+		if (exp == 255)
+			return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+		int e = exp - 127 + 15;
+		if (e >= 31)
+			return sign | 0x7c00;
+		if (e <= 0)
+		{
+			// Subnormal half (or zero)
+			if (e < -10)
+				return sign;
+			mant |= 0x800000;
+			int shift = 14 - e;
+			unsigned int h = mant >> shift;
+			unsigned int rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+			if (rem > halfway || (rem == halfway && (h & 1)))
+				h++;
+			return sign | h;
+		}
+
+		unsigned int h = (e << 10) | (mant >> 13);
+		unsigned int rem = mant & 0x1fff;
+		if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+			h++; // (a carry into the exponent is correct)
+		return sign | h;
+	}
+
+	inline float halfToFloat(unsigned short h)
+	{
+		unsigned int x = (unsigned int)(h & 0x8000) << 16;
+		if ((h & 0x7c00) == 0x7c00)
+			x |= 0x7f800000 | ((unsigned int)(h & 0x3ff) << 13); // infinity or NaN
+		else
+		{
+			// Shift exponent and mantissa into place, and correct the exponent bias (also right for subnormals)
+			unsigned int y = (unsigned int)(h & 0x7fff) << 13;
+			float f;
+			memcpy(&f, &y, sizeof(f));
+			f *= 5.192296858534828e+33f; // 2^112
+			memcpy(&y, &f, sizeof(y));
+			x |= y;
+		}
+		float f;
+		memcpy(&f, &x, sizeof(f));
+		return f;
+	}
+
+	/** A 3D half-complex Fourier volume with its real and imaginary parts stored as IEEE half-precision floats
+	 *
+	 * Uses a quarter of the memory of a double-precision and half of a single-precision MultidimArray<Complex>.
+	 * To stay clear of the half-precision range (65504) all values are divided by a common scale,
+	 * so that the largest component is 32768. Interpolation is linear, so the interpolation kernels
+	 * multiply their result by the scale instead. The relative precision is about 5e-4.
+	 *
+	 * @code
+	 * HalfFourierVolume half(PPref.data);
+	 * Complex val = half.getElem(k, i, j); // as A3D_ELEM(PPref.data, k, i, j), up to rounding
+	 * @endcode
+	 */
+	class HalfFourierVolume
+	{
+	public:
+		// Size and logical origin (STARTINGX is 0) of the volume
+		long int xdim, ydim, zdim, starty, startz;
+
+		// Real and imaginary part of every voxel, row-major as in the MultidimArray
+		std::vector<unsigned short> values;
+
+		// Multiply the stored values by scale to get the original ones
+		DOUBLE scale;
+
+		HalfFourierVolume()
+		{
+			clear();
+		}
+
+		HalfFourierVolume(const MultidimArray<Complex > &vol)
+		{
+			initialise(vol);
+		}
+
+		void clear();
+
+		bool isEmpty() const
+		{
+			return values.empty();
+		}
+
+		/** Convert a 3D volume with STARTINGX = 0 (as Projector::data)
+		 */
+		void initialise(const MultidimArray<Complex > &vol, int nr_threads = 1);
+
+		/** Convert back into a volume with the same size and origin
+		 */
+		void getArray(MultidimArray<Complex > &vol, int nr_threads = 1) const;
+
+		/** Element with logical indices, as A3D_ELEM
+		 */
+		Complex getElem(long int k, long int i, long int j) const
+		{
+			long int idx = 2 * (((k - startz) * ydim + (i - starty)) * xdim + j);
+			return Complex(scale * halfToFloat(values[idx]), scale * halfToFloat(values[idx + 1]));
+		}
+	};
+}
+
+#endif
@@ -18,6 +18,14 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/healpix_sampling.h"
+#include <map>
+#include <mutex>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 namespace relion
 {
@@ -39,7 +47,13 @@ namespace relion
 		translations_z.clear();
 		L_repository.clear();
 		R_repository.clear();
+		L33_repository.clear();
+		R33t_repository.clear();
+		L_quaternions.clear();
+		R_quaternions.clear();
+		improper_repository.clear();
 		pgGroup = pgOrder = 0;
+		orientationsHaveChanged();
 
 	}
 
@@ -77,20 +91,28 @@ namespace relion
 			SL.read_sym_file(fn_sym);
 
 			// Precalculate (3x3) symmetry matrices
-			Matrix2D<DOUBLE>  L(4, 4), R(4, 4);
 			Matrix2D<DOUBLE>  Identity(3,3);
 			Identity.initIdentity();
-			R_repository.clear();
-			L_repository.clear();
-			R_repository.push_back(Identity);
-			L_repository.push_back(Identity);
+			R_repository.assign(SL.SymsNo() + 1, Identity);
+			L_repository.assign(SL.SymsNo() + 1, Identity);
 			for (int isym = 0; isym < SL.SymsNo(); isym++)
 			{
-				SL.get_matrices(isym, L, R);
-				R.resize(3, 3);
-				L.resize(3, 3);
-				R_repository.push_back(R);
-				L_repository.push_back(L);
+				SL.get_rotations()[isym].toMatrix2D(R_repository[isym + 1]);
+				SL.get_L_rotations()[isym].toMatrix2D(L_repository[isym + 1]);
+			}
+			L33_repository.assign(SL.SymsNo() + 1, Mat33::identity());
+			R33t_repository.assign(SL.SymsNo() + 1, Mat33::identity());
+			L_quaternions.assign(SL.SymsNo() + 1, Quaternion());
+			R_quaternions.assign(SL.SymsNo() + 1, Quaternion());
+			improper_repository.assign(SL.SymsNo() + 1, false);
+			for (int isym = 0; isym < SL.SymsNo(); isym++)
+			{
+				const Mat33 &L = SL.get_L_rotations()[isym];
+				L33_repository[isym + 1] = L;
+				R33t_repository[isym + 1] = SL.get_transposed_rotations()[isym];
+				L_quaternions[isym + 1] = Quaternion::fromMatrix(L.det() < 0. ? L * (DOUBLE)-1. : L);
+				R_quaternions[isym + 1] = SL.get_quaternions()[isym];
+				improper_repository[isym + 1] = (L.det() * SL.get_rotations()[isym].det() < 0.);
 			}
 		}
 		else
@@ -117,6 +139,7 @@ namespace relion
 		// Add to the random perturbation from the last iteration, so it keeps changing strongly...
 		random_perturbation += rnd_unif(0.5*perturbation_factor, perturbation_factor);
 		random_perturbation = realWRAP(random_perturbation, -perturbation_factor, perturbation_factor);
+		orientationsHaveChanged();
 
 	}
 
@@ -209,6 +232,7 @@ namespace relion
 		rot_angles.clear();
 		tilt_angles.clear();
 		psi_angles.clear();
+		orientationsHaveChanged();
 
 		// Setup the HealPix object
 		// For adaptive oversampling only precalculate the COARSE sampling!
@@ -221,37 +245,41 @@ namespace relion
 		// 3D directions
 		if (is_3D)
 		{
-			DOUBLE rot, tilt;
-			for (long int ipix = 0; ipix < healpix_base.Npix(); ipix++)
+			// Re-use the symmetry-reduced directions of an earlier run with the same sampling, if possible
+			if (!readDirectionCache())
 			{
-				getDirectionFromHealPix(ipix, rot, tilt);
-
-				// Push back as Matrix1D's in the vectors
-				rot_angles.push_back(rot);
-				tilt_angles.push_back(tilt);
-				directions_ipix.push_back(ipix);
-
-
+				long int nr_pix = healpix_base.Npix();
+				directions_ipix.resize(nr_pix);
+				for (long int ipix = 0; ipix < nr_pix; ipix++)
+					directions_ipix[ipix] = ipix;
+				rot_angles.resize(nr_pix);
+				tilt_angles.resize(nr_pix);
+				getDirectionsFromHealPix(&directions_ipix[0], nr_pix, &rot_angles[0], &tilt_angles[0]);
+		//#define DEBUG_SAMPLING
+		#ifdef  DEBUG_SAMPLING
+				writeAllOrientationsToBild("orients_all.bild", "1 0 0 ", 0.020);
+		#endif
+				// Now remove symmetry-related pixels
+				// TODO check size of healpix_base.max_pixrad
+				removeSymmetryEquivalentPoints(0.5 * RAD2DEG(healpix_base.max_pixrad()));
+
+		#ifdef  DEBUG_SAMPLING
+				writeAllOrientationsToBild("orients_sym.bild", "0 1 0 ", 0.021);
+		#endif
+
+				// Also remove limited tilt angles
+				removePointsOutsideLimitedTiltAngles();
+
+				#ifdef  DEBUG_SAMPLING
+				if (ABS(limit_tilt) < 90.)
+					writeAllOrientationsToBild("orients_tilt.bild", "1 1 0 ", 0.022);
+		#endif
+
+				writeDirectionCache();
 			}
-	//#define DEBUG_SAMPLING
-	#ifdef  DEBUG_SAMPLING
-			writeAllOrientationsToBild("orients_all.bild", "1 0 0 ", 0.020);
-	#endif
-			// Now remove symmetry-related pixels
-			// TODO check size of healpix_base.max_pixrad
-			removeSymmetryEquivalentPoints(0.5 * RAD2DEG(healpix_base.max_pixrad()));
 
-	#ifdef  DEBUG_SAMPLING
-			writeAllOrientationsToBild("orients_sym.bild", "0 1 0 ", 0.021);
-	#endif
-
-			// Also remove limited tilt angles
-			removePointsOutsideLimitedTiltAngles();
-
-			#ifdef  DEBUG_SAMPLING
-			if (ABS(limit_tilt) < 90.)
-				writeAllOrientationsToBild("orients_tilt.bild", "1 1 0 ", 0.022);
-	#endif
+			// Index the remaining directions for selectOrientationsWithNonZeroPriorProbability
+			updateDirectionIndex();
 
 
 		}
@@ -281,6 +309,7 @@ namespace relion
 	/* Set only a single orientation */
 	void HealpixSampling::addOneOrientation(DOUBLE rot, DOUBLE tilt, DOUBLE psi, bool do_clear)
 	{
+		orientationsHaveChanged();
 		if (do_clear)
 		{
 			directions_ipix.clear();
@@ -386,38 +415,33 @@ namespace relion
 		if (is_3D)
 		{
 
-			// Loop over all directions
+			// Get the direction of the prior
+			Matrix1D<DOUBLE> prior_direction, best_direction;
+			Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
+
+			// With a prior on both rot and tilt only the directions near the prior (or near one of its symmetry mates) can be selected:
+			// get these from the direction index instead of looping over all directions
+			bool use_index = (sigma_rot > 0. && sigma_tilt > 0. && sigma_cutoff * sigma_rot < 90.);
+			std::vector<int> candidates;
+			if (use_index)
+				getDirectionsNearPrior(prior_direction, sigma_cutoff * sigma_rot, candidates);
+			long int nr_candidates = (use_index) ? candidates.size() : rot_angles.size();
+
+			// Loop over all (candidate) directions
 			DOUBLE sumprior = 0.;
 			// Keep track of the closest distance to prevent 0 orientations
 			DOUBLE best_ang = 9999.;
 			long int best_idir = -999;
-			for (long int idir = 0; idir < rot_angles.size(); idir++)
+			for (long int icand = 0; icand < nr_candidates; icand++)
 			{
+				long int idir = (use_index) ? candidates[icand] : icand;
 
 				// Any prior involving rot and/or tilt.
 				if (sigma_rot > 0. || sigma_tilt > 0. )
 				{
 
-					Matrix1D<DOUBLE> prior_direction, my_direction, sym_direction, best_direction;
-					// Get the direction of the prior
-					Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
-
-					// Get the current direction in the loop
-					Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
-
-					// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
-					DOUBLE best_dotProduct = dotProduct(prior_direction, my_direction);
-					best_direction = my_direction;
-					for (int j = 0; j < R_repository.size(); j++)
-					{
-						sym_direction =  L_repository[j] * (my_direction.transpose() * R_repository[j]).transpose();
-						DOUBLE my_dotProduct = dotProduct(prior_direction, sym_direction);
-						if (my_dotProduct > best_dotProduct)
-						{
-							best_direction = sym_direction;
-							best_dotProduct = my_dotProduct;
-						}
-					}
+					// Find the symmetry operator that brings this direction nearest to the prior
+					getNearestSymmetryMate(idir, prior_direction, best_direction);
 
 					if (sigma_rot > 0. && sigma_tilt > 0.)
 					{
@@ -505,6 +529,45 @@ namespace relion
 
 			} // end for idir
 
+			// The nearest direction may lie outside the candidates: look for it in ever larger neighbourhoods
+			if (use_index && directions_prior.size() == 0)
+			{
+				best_idir = -999;
+				for (DOUBLE max_ang = XMIPP_MAX(2. * sigma_cutoff * sigma_rot, 1.); best_idir < 0; max_ang *= 2.)
+				{
+					// All directions within max_ang are among the candidates, so if the nearest one is within max_ang it is the nearest of all
+					bool is_complete = (max_ang >= 90.);
+					if (is_complete)
+					{
+						candidates.resize(rot_angles.size());
+						for (size_t idir = 0; idir < rot_angles.size(); idir++)
+							candidates[idir] = idir;
+					}
+					else
+						getDirectionsNearPrior(prior_direction, max_ang, candidates);
+
+					best_ang = 9999.;
+					long int my_best_idir = -999;
+					for (size_t icand = 0; icand < candidates.size(); icand++)
+					{
+						getNearestSymmetryMate(candidates[icand], prior_direction, best_direction);
+						DOUBLE diffang = ACOSD( dotProduct(best_direction, prior_direction) );
+						if (diffang > 180.) diffang = ABS(diffang - 360.);
+						if (diffang < best_ang)
+						{
+							my_best_idir = candidates[icand];
+							best_ang = diffang;
+						}
+					}
+					if (is_complete || best_ang < max_ang)
+					{
+						if (my_best_idir < 0)
+							REPORT_ERROR("HealpixSampling::selectOrientationsWithNonZeroPriorProbability BUG: no directions");
+						best_idir = my_best_idir;
+					}
+				}
+			}
+
 
 			//Normalise the prior probability distribution to have sum 1 over all psi-angles
 			for (long int idir = 0; idir < directions_prior.size(); idir++)
@@ -604,6 +667,107 @@ namespace relion
 
 	}
 
+	void HealpixSampling::getNearestSymmetryMate(long int idir, const Matrix1D<DOUBLE> &prior_direction, Matrix1D<DOUBLE> &best_direction)
+	{
+		DOUBLE my_direction[3], tmp[3], sym_direction[3], best[3];
+
+		// Get the current direction
+		eulerToDirections(&rot_angles[idir], &tilt_angles[idir], 1, &my_direction[0], &my_direction[1], &my_direction[2]);
+
+		// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
+		const DOUBLE *prior = MATRIX1D_ARRAY(prior_direction);
+		DOUBLE best_dotProduct = prior[0] * my_direction[0] + prior[1] * my_direction[1] + prior[2] * my_direction[2];
+		for (int i = 0; i < 3; i++)
+			best[i] = my_direction[i];
+		for (size_t j = 0; j < L33_repository.size(); j++)
+		{
+			// L * (d^T * R)^T
+			R33t_repository[j].multiply(my_direction, tmp);
+			L33_repository[j].multiply(tmp, sym_direction);
+			DOUBLE my_dotProduct = prior[0] * sym_direction[0] + prior[1] * sym_direction[1] + prior[2] * sym_direction[2];
+			if (my_dotProduct > best_dotProduct)
+			{
+				for (int i = 0; i < 3; i++)
+					best[i] = sym_direction[i];
+				best_dotProduct = my_dotProduct;
+			}
+		}
+		best_direction.resize(3);
+		XX(best_direction) = best[0];
+		YY(best_direction) = best[1];
+		ZZ(best_direction) = best[2];
+	}
+
+	void HealpixSampling::updateDirectionIndex()
+	{
+		if (direction_index_version == orientations_version)
+			return;
+
+		// Choose the coarse grid so that it has on average at least 4 directions per pixel
+		// (symmetry-equivalent directions have been removed, so only count the pixels of one asymmetric unit)
+		long int nr_dirs_sphere = rot_angles.size() * XMIPP_MAX(1, R_repository.size());
+		int order = 0;
+		while (order < 12 && 4 * 12 * (1L << (2 * (order + 1))) <= nr_dirs_sphere)
+			order++;
+		direction_index_base.Set(order, RING);
+
+		// Sort the directions by coarse pixel (counting sort, so that they remain in increasing order within each pixel)
+		long int nr_dirs = rot_angles.size();
+		std::vector<int> pixel(nr_dirs);
+		std::vector<double> x(nr_dirs), y(nr_dirs), z(nr_dirs);
+		Matrix1D<DOUBLE> my_direction;
+		for (long int idir = 0; idir < nr_dirs; idir++)
+		{
+			Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
+			x[idir] = XX(my_direction);
+			y[idir] = YY(my_direction);
+			z[idir] = ZZ(my_direction);
+		}
+		if (nr_dirs > 0)
+			direction_index_base.vec2pix(&x[0], &y[0], &z[0], nr_dirs, &pixel[0]);
+		direction_index_start.assign(direction_index_base.Npix() + 1, 0);
+		for (long int idir = 0; idir < nr_dirs; idir++)
+			direction_index_start[pixel[idir] + 1]++;
+		for (int ipix = 0; ipix < direction_index_base.Npix(); ipix++)
+			direction_index_start[ipix + 1] += direction_index_start[ipix];
+		direction_index_dirs.resize(rot_angles.size());
+		std::vector<int> fill(direction_index_start.begin(), direction_index_start.end() - 1);
+		for (size_t idir = 0; idir < rot_angles.size(); idir++)
+			direction_index_dirs[fill[pixel[idir]]++] = idir;
+
+		direction_index_version = orientations_version;
+	}
+
+	void HealpixSampling::getDirectionsNearPrior(const Matrix1D<DOUBLE> &prior_direction, DOUBLE max_ang, std::vector<int> &candidates)
+	{
+		updateDirectionIndex();
+		candidates.clear();
+
+		// Direction d has a symmetry mate L * R^T * d within max_ang of the prior if d lies within max_ang of R * L^T * prior
+		// (the identity is the first operator, unless there are no symmetry operators at all)
+		Matrix1D<DOUBLE> sym_prior;
+		std::vector<int> listpix;
+		int nr_sym = XMIPP_MAX(1, R_repository.size());
+		for (int j = 0; j < nr_sym; j++)
+		{
+			if (R_repository.size() > 0)
+				sym_prior = R_repository[j] * (L_repository[j].transpose() * prior_direction);
+			else
+				sym_prior = prior_direction;
+
+			// The inclusive query also returns pixels that only partially overlap with the disc
+			direction_index_base.query_disc_inclusive(pointing(vec3(XX(sym_prior), YY(sym_prior), ZZ(sym_prior))),
+				DEG2RAD(max_ang), listpix);
+			for (size_t i = 0; i < listpix.size(); i++)
+				for (int k = direction_index_start[listpix[i]]; k < direction_index_start[listpix[i] + 1]; k++)
+					candidates.push_back(direction_index_dirs[k]);
+		}
+
+		// Symmetry mates of the prior may overlap
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	}
+
 	FileName HealpixSampling::symmetryGroup()
 	{
 		return fn_sym;
@@ -659,6 +823,54 @@ namespace relion
 
 	}
 
+	void HealpixSampling::getDirectionsFromHealPix(const int *ipix, long int n, DOUBLE *rot, DOUBLE *tilt)
+	{
+		getDirectionsFromHealPix(healpix_base, ipix, n, rot, tilt);
+	}
+
+	void HealpixSampling::getDirectionsFromHealPix(const Healpix_Base &base, const int *ipix, long int n, DOUBLE *rot, DOUBLE *tilt)
+	{
+		// In batches that fit on the stack (these always have to be double, as in getDirectionFromHealPix)
+		const int batch = 256;
+		double zz[batch], phi[batch];
+		for (long int first = 0; first < n; first += batch)
+		{
+			int nr = (int)XMIPP_MIN((long int)batch, n - first);
+			base.pix2ang_z_phi(ipix + first, nr, zz, phi);
+			for (int i = 0; i < nr; i++)
+			{
+				rot[first + i] = RAD2DEG(phi[i]);
+				tilt[first + i] = ACOSD(zz[i]);
+				checkDirection(rot[first + i], tilt[first + i]);
+			}
+		}
+	}
+
+	// The neighbour lists of getHealPixNeighbours, by order
+	static std::map<int, std::vector<int> > healpix_neighbours;
+	static std::mutex healpix_neighbours_mutex;
+
+	const std::vector<int>& HealpixSampling::getHealPixNeighbours(int order)
+	{
+		if (order < 0 || order > 13)
+			REPORT_ERROR("HealpixSampling::getHealPixNeighbours: the HEALPix order should be between 0 and 13");
+
+		std::unique_lock<std::mutex> lock(healpix_neighbours_mutex);
+		std::map<int, std::vector<int> >::iterator it = healpix_neighbours.find(order);
+		if (it != healpix_neighbours.end())
+			return it->second;
+
+		// Map elements keep their address, so the list can be used after the lock is released
+		Healpix_Base base(order, NEST);
+		std::vector<int> pixels(base.Npix());
+		for (int ipix = 0; ipix < base.Npix(); ipix++)
+			pixels[ipix] = ipix;
+		std::vector<int> &neighbours = healpix_neighbours[order];
+		neighbours.resize(8 * (size_t)base.Npix());
+		base.neighbors(&pixels[0], base.Npix(), &neighbours[0]);
+		return neighbours;
+	}
+
 	DOUBLE HealpixSampling::getTranslationalSampling(int adaptive_oversampling)
 	{
 		return offset_step / std::pow(2., adaptive_oversampling);
@@ -933,28 +1145,19 @@ namespace relion
 			Healpix_Base HealPixOver(oversampling_order + healpix_order, NEST);
 			int fact = HealPixOver.Nside()/healpix_base.Nside();
 			int x, y, face;
-			DOUBLE rot, tilt;
 			// Get x, y and face for the original, coarse grid
 			long int ipix = directions_ipix[my_idir];
 			healpix_base.nest2xyf(ipix, x, y, face);
-			// Loop over the oversampled Healpix pixels on the fine grid
+			// The oversampled Healpix pixels on the fine grid, and their directions (in a single batch)
+			std::vector<int> overpix;
+			overpix.reserve(fact * fact);
 			for (int j = fact * y; j < fact * (y+1); ++j)
-			{
 				for (int i = fact * x; i < fact * (x+1); ++i)
-				{
-					long int overpix = HealPixOver.xyf2nest(i, j, face);
-									// this one always has to be double (also for SINGLE_PRECISION CALCULATIONS) for call to external library 
-					double zz, phi;
-					HealPixOver.pix2ang_z_phi(overpix, zz, phi);
-					rot = RAD2DEG(phi);
-					tilt = ACOSD(zz);
-
-					// The geometrical considerations about the symmetry below require that rot = [-180,180] and tilt [0,180]
-					checkDirection(rot, tilt);
-
-					pushbackOversampledPsiAngles(my_ipsi, oversampling_order, rot, tilt, my_rot, my_tilt, my_psi);
-				}
-			}
+					overpix.push_back(HealPixOver.xyf2nest(i, j, face));
+			std::vector<DOUBLE> over_rot(overpix.size()), over_tilt(overpix.size());
+			getDirectionsFromHealPix(HealPixOver, &overpix[0], overpix.size(), &over_rot[0], &over_tilt[0]);
+			for (size_t iover = 0; iover < overpix.size(); iover++)
+				pushbackOversampledPsiAngles(my_ipsi, oversampling_order, over_rot[iover], over_tilt[iover], my_rot, my_tilt, my_psi);
 		}
 
 
@@ -1022,35 +1225,17 @@ namespace relion
 
 		if (is_3D)
 		{
-			Matrix1D<DOUBLE>  direction1(3), direction1p(3), direction2(3);
-			Euler_angles2direction(rot1, tilt1, direction1);
-			Euler_angles2direction(rot2, tilt2, direction2);
-
 			// Find the symmetry operation where the Distance based on Euler axes is minimal
+			// L * E2 * R is the matrix of qL * q2 * qR, and the axes distance only needs the rotation between q1 and that
+			Quaternion q1 = eulerToQuaternion(rot1, tilt1, psi1);
+			Quaternion q2 = eulerToQuaternion(rot2, tilt2, psi2);
 			DOUBLE min_axes_dist = 3600.;
-			DOUBLE rot2p, tilt2p, psi2p;
-			Matrix2D<DOUBLE> E1, E2;
-			Matrix1D<DOUBLE> v1, v2;
-			for (int j = 0; j < R_repository.size(); j++)
+			for (size_t j = 0; j < R_quaternions.size(); j++)
 			{
-
-				Euler_apply_transf(L_repository[j], R_repository[j], rot2, tilt2, psi2, rot2p, tilt2p, psi2p);
-
-				// Distance based on Euler axes
-				Euler_angles2matrix(rot1, tilt1, psi1, E1);
-				Euler_angles2matrix(rot2p, tilt2p, psi2p, E2);
-				DOUBLE axes_dist = 0;
-				for (int i = 0; i < 3; i++)
-				{
-					E1.getRow(i, v1);
-					E2.getRow(i, v2);
-					axes_dist += ACOSD(CLIP(dotProduct(v1, v2), -1., 1.));
-				}
-				axes_dist /= 3.;
-
+				Quaternion q2p = getSymmetryMateQuaternion(j, rot2, tilt2, psi2, q2);
+				DOUBLE axes_dist = quaternionAxesDistance(q1 * q2p.conj());
 				if (axes_dist < min_axes_dist)
 					min_axes_dist = axes_dist;
-
 			}// for all symmetry operations j
 
 			return min_axes_dist;
@@ -1062,6 +1247,52 @@ namespace relion
 		}
 	}
 
+	Quaternion HealpixSampling::getSymmetryMateQuaternion(int j, DOUBLE rot, DOUBLE tilt, DOUBLE psi, const Quaternion &q)
+	{
+		if (!improper_repository[j])
+			return L_quaternions[j] * q * R_quaternions[j];
+
+		// An improper L * E * R has no quaternion: take the rotation of its Euler angles, as Euler_apply_transf does
+		Mat33 E;
+		DOUBLE rotp, tiltp, psip;
+		Euler_angles2matrix(rot, tilt, psi, E);
+		Euler_matrix2angles(L33_repository[j] * E * R33t_repository[j].transpose(), rotp, tiltp, psip);
+		return eulerToQuaternion(rotp, tiltp, psip);
+	}
+
+	void HealpixSampling::calculateAngularDistances(DOUBLE rot1, DOUBLE tilt1, DOUBLE psi1,
+		const DOUBLE *rot2, const DOUBLE *tilt2, const DOUBLE *psi2, long int n, DOUBLE *distances)
+	{
+		if (is_3D)
+		{
+			Quaternion q1 = eulerToQuaternion(rot1, tilt1, psi1);
+			QuaternionArray q2, q2p;
+			eulerToQuaternions(rot2, tilt2, psi2, n, q2);
+			std::vector<DOUBLE> axes_dist(n);
+			for (long int i = 0; i < n; i++)
+				distances[i] = 3600.;
+			for (size_t j = 0; j < R_quaternions.size(); j++)
+			{
+				if (improper_repository[j])
+				{
+					q2p.resize(n);
+					for (long int i = 0; i < n; i++)
+						q2p.set(i, getSymmetryMateQuaternion(j, rot2[i], tilt2[i], psi2[i], q2.get(i)));
+				}
+				else
+					transformQuaternions(L_quaternions[j], q2, R_quaternions[j], q2p);
+				quaternionAxesDistances(q1, q2p, axes_dist.data());
+				for (long int i = 0; i < n; i++)
+					distances[i] = XMIPP_MIN(distances[i], axes_dist[i]);
+			}
+		}
+		else
+		{
+			for (long int i = 0; i < n; i++)
+				distances[i] = realWRAP(ABS(psi2[i] - psi1), 0., 360.);
+		}
+	}
+
 	void HealpixSampling::writeBildFileOrientationalDistribution(MultidimArray<DOUBLE> &pdf_direction,
 			FileName &fn_bild, DOUBLE R, DOUBLE offset, DOUBLE Rmax_frac, DOUBLE width_frac)
 	{
@@ -1082,7 +1313,8 @@ namespace relion
 
 		// 2 * PI * R = 360 degrees, 2*radius should cover angular sampling at width_frac=1
 		DOUBLE width = width_frac * PI*R*(getAngularSampling()/360.);
-		Matrix1D<DOUBLE> v(3);
+		std::vector<DOUBLE> vx(rot_angles.size()), vy(rot_angles.size()), vz(rot_angles.size());
+		eulerToDirections(rot_angles.data(), tilt_angles.data(), rot_angles.size(), vx.data(), vy.data(), vz.data());
 
 		for (long int iang = 0; iang < rot_angles.size(); iang++)
 		{
@@ -1101,22 +1333,22 @@ namespace relion
 				// The length of the cylinder will depend on the pdf_direction
 				DOUBLE Rp = R + Rmax_frac * R * pdf / pdfmax;
 
-				Euler_angles2direction(rot_angles[iang], tilt_angles[iang], v);
+				DOUBLE x = vx[iang], y = vy[iang], z = vz[iang];
 
 				// Don't include cylinders with zero length, as chimera will complain about that....
-				if (ABS((R - Rp) * XX(v)) > 0.01 ||
-						ABS((R - Rp) * YY(v)) > 0.01 ||
-						ABS((R - Rp) * ZZ(v)) > 0.01)
+				if (ABS((R - Rp) * x) > 0.01 ||
+						ABS((R - Rp) * y) > 0.01 ||
+						ABS((R - Rp) * z) > 0.01)
 				{
 					// The width of the cylinders will be determined by the sampling:
 					fh_bild << ".color " << colscale << " 0 " << 1. - colscale << std::endl;
 					fh_bild << ".cylinder "
-							<< R  * XX(v) + offset << " "
-							<< R  * YY(v) + offset << " "
-							<< R  * ZZ(v) + offset << " "
-							<< Rp * XX(v) + offset << " "
-							<< Rp * YY(v) + offset << " "
-							<< Rp * ZZ(v) + offset << " "
+							<< R  * x + offset << " "
+							<< R  * y + offset << " "
+							<< R  * z + offset << " "
+							<< Rp * x + offset << " "
+							<< Rp * y + offset << " "
+							<< Rp * z + offset << " "
 							<< width
 							<<"\n";
 				}
@@ -1193,16 +1425,115 @@ namespace relion
 	 *  e-mail address 'xmipp@cnb.csic.es'
 	 ***************************************************************************/
 
+	FileName HealpixSampling::direction_cache_dir = "";
+
+	void HealpixSampling::setDirectionCache(const FileName &dir)
+	{
+		direction_cache_dir = dir;
+	}
+
+	FileName HealpixSampling::getDirectionCacheName()
+	{
+		// Symmetry groups may also be given as file names
+		std::string sym = fn_sym;
+		for (size_t i = 0; i < sym.size(); i++)
+			if (!isalnum(sym[i]))
+				sym[i] = '_';
+		return direction_cache_dir + "/relion_directions_o" + integerToString(healpix_order) + "_" + sym +
+			"_tilt" + floatToString(limit_tilt, 0, 3) + ".cache";
+	}
+
+	static const char direction_cache_magic[8] = { 'R', 'L', 'N', 'H', 'P', 'X', 'D', 'C' };
+	static const int direction_cache_version = 1;
+
+	bool HealpixSampling::readDirectionCache()
+	{
+		if (direction_cache_dir == "")
+			return false;
+
+		FILE *fh = fopen(getDirectionCacheName().c_str(), "rb");
+		if (fh == NULL)
+			return false;
+
+		// The key is stored in the file as well: names may be ambiguous
+		char magic[8];
+		int version, size_of_double, order, sym_length;
+		DOUBLE my_limit_tilt;
+		long long nr_dirs;
+		bool ok = fread(magic, 1, 8, fh) == 8 && memcmp(magic, direction_cache_magic, 8) == 0 &&
+			fread(&version, sizeof(int), 1, fh) == 1 && version == direction_cache_version &&
+			fread(&size_of_double, sizeof(int), 1, fh) == 1 && size_of_double == sizeof(DOUBLE) &&
+			fread(&order, sizeof(int), 1, fh) == 1 && order == healpix_order &&
+			fread(&my_limit_tilt, sizeof(DOUBLE), 1, fh) == 1 && my_limit_tilt == limit_tilt &&
+			fread(&sym_length, sizeof(int), 1, fh) == 1 && sym_length >= 0 && (size_t)sym_length == fn_sym.size();
+		if (ok)
+		{
+			std::string sym(sym_length, ' ');
+			ok = (sym_length == 0 || fread(&sym[0], 1, sym_length, fh) == (size_t)sym_length) && sym == fn_sym &&
+				fread(&nr_dirs, sizeof(long long), 1, fh) == 1 && nr_dirs > 0 && nr_dirs <= healpix_base.Npix();
+		}
+		if (ok)
+		{
+			rot_angles.resize(nr_dirs);
+			tilt_angles.resize(nr_dirs);
+			directions_ipix.resize(nr_dirs);
+			ok = fread(&rot_angles[0], sizeof(DOUBLE), nr_dirs, fh) == (size_t)nr_dirs &&
+				fread(&tilt_angles[0], sizeof(DOUBLE), nr_dirs, fh) == (size_t)nr_dirs &&
+				fread(&directions_ipix[0], sizeof(int), nr_dirs, fh) == (size_t)nr_dirs;
+		}
+		fclose(fh);
+
+		if (!ok)
+		{
+			rot_angles.clear();
+			tilt_angles.clear();
+			directions_ipix.clear();
+		}
+		return ok;
+	}
+
+	void HealpixSampling::writeDirectionCache()
+	{
+		if (direction_cache_dir == "" || rot_angles.size() == 0)
+			return;
+
+		// Write to a unique temporary file and rename it, so that other processes never see a partial cache
+		FileName fn_cache = getDirectionCacheName();
+		FileName fn_tmp = fn_cache + "." + integerToString(getpid()) + ".tmp";
+		FILE *fh = fopen(fn_tmp.c_str(), "wb");
+		if (fh == NULL)
+			return; // e.g. a read-only directory: simply do without a cache
+
+		int sym_length = fn_sym.size();
+		long long nr_dirs = rot_angles.size();
+		fwrite(direction_cache_magic, 1, 8, fh);
+		fwrite(&direction_cache_version, sizeof(int), 1, fh);
+		int size_of_double = sizeof(DOUBLE);
+		fwrite(&size_of_double, sizeof(int), 1, fh);
+		fwrite(&healpix_order, sizeof(int), 1, fh);
+		fwrite(&limit_tilt, sizeof(DOUBLE), 1, fh);
+		fwrite(&sym_length, sizeof(int), 1, fh);
+		fwrite(fn_sym.data(), 1, sym_length, fh);
+		fwrite(&nr_dirs, sizeof(long long), 1, fh);
+		fwrite(&rot_angles[0], sizeof(DOUBLE), nr_dirs, fh);
+		fwrite(&tilt_angles[0], sizeof(DOUBLE), nr_dirs, fh);
+		fwrite(&directions_ipix[0], sizeof(int), nr_dirs, fh);
+
+		bool ok = (ferror(fh) == 0);
+		ok = (fclose(fh) == 0) && ok;
+		if (!ok || rename(fn_tmp.c_str(), fn_cache.c_str()) != 0)
+			remove(fn_tmp.c_str());
+	}
+
 	void HealpixSampling::removeSymmetryEquivalentPoints(DOUBLE max_ang)
 	{
 		// Maximum distance
 		DOUBLE cos_max_ang = cos(DEG2RAD(max_ang));
-		DOUBLE my_dotProduct;
 		Matrix1D<DOUBLE>  direction(3), direction1(3);
 		std::vector<Matrix1D<DOUBLE> > directions_vector;
 
 		// Calculate all vectors and fill directions_vector
-		for (long int i = 0; i < rot_angles.size(); i++)
+		for (size_t i = 0; i < rot_angles.size(); i++)
 		{
     		Euler_angles2direction(rot_angles[i], tilt_angles[i], direction);
     		directions_vector.push_back(direction);
@@ -1221,42 +1552,91 @@ namespace relion
 		// Only a small fraction of the points at the border of the AU is thrown away anyway...
 		if (rot_angles.size() < 4000)
 		{
-    		// Create no_redundant vectors
-			std::vector <Matrix1D<DOUBLE> > no_redundant_directions_vector;
+			long int nr_dirs = rot_angles.size();
+			int nr_sym = R_repository.size();
+
+			// Precalculate all symmetry mates of all directions
+			std::vector<DOUBLE> mates(3 * nr_sym * nr_dirs);
+			#pragma omp parallel for
+			for (long int i = 0; i < nr_dirs; i++)
+			{
+				DOUBLE tmp[3];
+				for (int j = 0; j < nr_sym; j++)
+				{
+					// L * (d^T * R)^T
+					R33t_repository[j].multiply(MATRIX1D_ARRAY(directions_vector[i]), tmp);
+					L33_repository[j].multiply(tmp, &mates[3 * (i * nr_sym + j)]);
+				}
+			}
+
+			// Sort the mates into the pixels of a coarse HEALPix grid, with pixels larger than max_ang
+			Healpix_Base mate_grid(0, RING);
+			for (int order = 1; order < 13; order++)
+			{
+				Healpix_Base finer(order, RING);
+				if (RAD2DEG(finer.max_pixrad()) < max_ang)
+					break;
+				mate_grid.Set(order, RING);
+			}
+			std::vector<int> mate_pixel(nr_sym * nr_dirs), pixel_start(mate_grid.Npix() + 1, 0), pixel_mates(nr_sym * nr_dirs);
+			for (long int imate = 0; imate < nr_sym * nr_dirs; imate++)
+			{
+				mate_pixel[imate] = mate_grid.vec2pix(vec3(mates[3 * imate], mates[3 * imate + 1], mates[3 * imate + 2]));
+				pixel_start[mate_pixel[imate] + 1]++;
+			}
+			for (int ipix = 0; ipix < mate_grid.Npix(); ipix++)
+				pixel_start[ipix + 1] += pixel_start[ipix];
+			std::vector<int> fill(pixel_start.begin(), pixel_start.end() - 1);
+			for (long int imate = 0; imate < nr_sym * nr_dirs; imate++)
+				pixel_mates[fill[mate_pixel[imate]]++] = imate;
+
+			// For every direction i find all earlier directions k with a symmetry mate within max_ang of i
+			std::vector<std::vector<int> > equivalent_earlier(nr_dirs);
+			#pragma omp parallel for schedule(dynamic, 16) private(direction1)
+			for (long int i = 0; i < nr_dirs; i++)
+			{
+				direction1 = directions_vector[i];
+				std::vector<int> listpix;
+				mate_grid.query_disc_inclusive(pointing(vec3(XX(direction1), YY(direction1), ZZ(direction1))), DEG2RAD(max_ang), listpix);
+				for (size_t ip = 0; ip < listpix.size(); ip++)
+				{
+					for (int m = pixel_start[listpix[ip]]; m < pixel_start[listpix[ip] + 1]; m++)
+					{
+						long int k = pixel_mates[m] / nr_sym;
+						if (k >= i)
+							continue;
+						//Calculate distance (in the same order as dotProduct)
+						const DOUBLE *mate = &mates[3 * pixel_mates[m]];
+						DOUBLE my_dotProduct = 0;
+						my_dotProduct += mate[0] * XX(direction1);
+						my_dotProduct += mate[1] * YY(direction1);
+						my_dotProduct += mate[2] * ZZ(direction1);
+						if (my_dotProduct > cos_max_ang)
+							equivalent_earlier[i].push_back(k);
+					}
+				}
+			}
+
+			// Then keep each point that is not equivalent to any of the points kept before it
+			std::vector<char> is_kept(nr_dirs, 0);
 			std::vector <DOUBLE> no_redundant_rot_angles;
 			std::vector <DOUBLE> no_redundant_tilt_angles;
 			std::vector <int> no_redundant_directions_ipix;
-
-			// Then check all points versus each other
-			for (long int i = 0; i < rot_angles.size(); i++)
+			for (long int i = 0; i < nr_dirs; i++)
 			{
-
-				direction1=directions_vector[i];
 				bool uniq = true;
-
-				//for (long int k = 0; k < no_redundant_directions_vector.size(); k++)
-				// i is probably closer to latest additions: loop backwards over k....
-				for (long int k = no_redundant_directions_vector.size() -1; k >= 0; k--)
+				for (size_t ik = 0; ik < equivalent_earlier[i].size(); ik++)
 				{
-					for (int j = 0; j < R_repository.size(); j++)
+					if (is_kept[equivalent_earlier[i][ik]])
 					{
-						direction =  L_repository[j] *
-							(no_redundant_directions_vector[k].transpose() *
-							 R_repository[j]).transpose();
-						//Calculate distance
-						my_dotProduct = dotProduct(direction,direction1);
-						if (my_dotProduct > cos_max_ang)
-						{
-							uniq = false;
-							break;
-						}
-					}// for j
-					if (!uniq) break;
-				} // for k
+						uniq = false;
+						break;
+					}
+				}
 
 				if (uniq)
 				{
-					no_redundant_directions_vector.push_back(directions_vector[i]);
+					is_kept[i] = 1;
 					no_redundant_rot_angles.push_back(rot_angles[i]);
 					no_redundant_tilt_angles.push_back(tilt_angles[i]);
 					no_redundant_directions_ipix.push_back(directions_ipix[i]);
@@ -1862,4 +2242,68 @@ namespace relion
 
 
 	#undef DEBUG_SAMPLING
-}
\ No newline at end of file
+
+	void OrientationMatrixTable::clear()
+	{
+		sampling = NULL;
+		orientations_version = -1;
+		oversampling_order = prior_mode = -1;
+		dir_selection.clear();
+		psi_selection.clear();
+		nr_dir = nr_psi = 0;
+		nr_over = 0;
+		matrices.clear();
+		is_calculated.clear();
+	}
+
+	const DOUBLE* OrientationMatrixTable::getMatrices(HealpixSampling &_sampling, long int idir, long int ipsi, int _oversampling_order,
+			std::vector<int> &pointer_dir_nonzeroprior, std::vector<DOUBLE> &directions_prior,
+			std::vector<int> &pointer_psi_nonzeroprior, std::vector<DOUBLE> &psi_prior, int &nr_matrices)
+	{
+		// The selection of orientations only matters with a prior (see HealpixSampling::getOrientations)
+		bool with_prior = (_sampling.orientational_prior_mode != NOPRIOR);
+		if (sampling != &_sampling || orientations_version != _sampling.orientations_version ||
+			oversampling_order != _oversampling_order || prior_mode != _sampling.orientational_prior_mode ||
+			(with_prior && (dir_selection != pointer_dir_nonzeroprior || psi_selection != pointer_psi_nonzeroprior)))
+		{
+			sampling = &_sampling;
+			orientations_version = _sampling.orientations_version;
+			oversampling_order = _oversampling_order;
+			prior_mode = _sampling.orientational_prior_mode;
+			if (with_prior)
+			{
+				dir_selection = pointer_dir_nonzeroprior;
+				psi_selection = pointer_psi_nonzeroprior;
+			}
+			nr_dir = with_prior ? pointer_dir_nonzeroprior.size() : _sampling.NrDirections();
+			nr_psi = with_prior ? pointer_psi_nonzeroprior.size() : _sampling.NrPsiSamplings();
+			nr_over = _sampling.oversamplingFactorOrientations(oversampling_order);
+			matrices.resize(9 * nr_over * nr_dir * nr_psi);
+			is_calculated.assign(nr_dir * nr_psi, 0);
+		}
+
+		if (idir < 0 || idir >= nr_dir || ipsi < 0 || ipsi >= nr_psi)
+			REPORT_ERROR("OrientationMatrixTable::getMatrices: orientation out of range");
+
+		long int ientry = idir * nr_psi + ipsi;
+		DOUBLE *my_matrices = &matrices[9 * nr_over * ientry];
+		if (!is_calculated[ientry])
+		{
+			_sampling.getOrientations(idir, ipsi, oversampling_order, rot, tilt, psi,
+				pointer_dir_nonzeroprior, directions_prior, pointer_psi_nonzeroprior, psi_prior);
+			if (rot.size() != (size_t)nr_over)
+				REPORT_ERROR("OrientationMatrixTable::getMatrices BUG: unexpected number of oversampled orientations");
+			for (int iover = 0; iover < nr_over; iover++)
+			{
+				Euler_angles2matrix(rot[iover], tilt[iover], psi[iover], A);
+				for (int i = 0; i < 3; i++)
+					for (int j = 0; j < 3; j++)
+						my_matrices[9 * iover + 3 * i + j] = MAT_ELEM(A, i, j);
+			}
+			is_calculated[ientry] = 1;
+		}
+
+		nr_matrices = nr_over;
+		return my_matrices;
+	}
+}
@@ -77,6 +77,15 @@ namespace relion
 		/** List of symmetry operators */
 		std::vector <Matrix2D<DOUBLE> > R_repository, L_repository;
 
+		/** The same operators as fixed-size matrices (the R ones transposed), for rotating directions */
+		std::vector <Mat33> L33_repository, R33t_repository;
+
+		/** The same operators as quaternions (of -L and -R for improper operators), for the angular distances */
+		std::vector <Quaternion> L_quaternions, R_quaternions;
+
+		/** Whether L * E * R is improper for operator j (then it is not the rotation of a quaternion product) */
+		std::vector <bool> improper_repository;
+
 		/** Two numbers that describe the symmetry group */
 		int pgGroup;
 		int pgOrder;
@@ -96,12 +105,27 @@ namespace relion
 		/** vector with the X,Y(,Z)-translations */
 		std::vector<DOUBLE> translations_x, translations_y, translations_z;
 
+		/** Index of the (non-oversampled) directions in rot_angles and tilt_angles on a coarse RING-scheme HEALPix grid
+		 * The directions of coarse pixel ipix are direction_index_dirs[direction_index_start[ipix] ... direction_index_start[ipix+1] - 1].
+		 * It is (re-)built by selectOrientationsWithNonZeroPriorProbability whenever direction_index_version != orientations_version.
+		 */
+		Healpix_Base direction_index_base;
+		std::vector<int> direction_index_start, direction_index_dirs;
+		long int direction_index_version;
+
+		/** Incremented whenever the orientations (or their random perturbation) change
+		 * This tells an OrientationMatrixTable that its matrices are out of date.
+		 */
+		long int orientations_version;
+
 
 	public:
 
 		// Empty constructor
 		HealpixSampling()
 		{
+			orientations_version = 0;
+			direction_index_version = -1;
 			clear();
 		}
 
@@ -187,6 +211,11 @@ namespace relion
 			std::vector<int> &pointer_psi_nonzeroprior, std::vector<DOUBLE> &psi_prior,
 			DOUBLE sigma_cutoff = 3.);
 
+		/** Keep the symmetry-reduced directions of each sampling in a binary file in dir, and re-use these in later runs
+		 * Files are named after the HEALPix order, symmetry group and tilt limit. An empty dir (the default) switches the cache off.
+		 */
+		static void setDirectionCache(const FileName &dir);
+
 		/** Get the symmetry group of this sampling object
 		 */
 		FileName symmetryGroup();
@@ -206,6 +235,17 @@ namespace relion
 		 */
 		void getDirectionFromHealPix(long int ipix, DOUBLE &rot, DOUBLE &tilt);
 
+		/* Get the rot and tilt angles of n HEALPix pixels at once, as by getDirectionFromHealPix for each of them
+		 * The pixels are converted in batches by the vectorised Healpix_Base::pix2ang_z_phi
+		 */
+		void getDirectionsFromHealPix(const int *ipix, long int n, DOUBLE *rot, DOUBLE *tilt);
+
+		/** The 8 neighbours (as Healpix_Base::neighbors) of all pixels of the NEST-ordered HEALPix grid of order
+		 * The neighbours of pixel ipix are elements 8 * ipix to 8 * ipix + 7 (-1 where a pixel has only 7).
+		 * The lists are calculated once per order and kept until the end of the program (32 * 12 * 4^order bytes).
+		 */
+		static const std::vector<int>& getHealPixNeighbours(int order);
+
 		/* Get the translational sampling step in pixels */
 		DOUBLE getTranslationalSampling(int adaptive_oversampling = 0);
 
@@ -302,6 +342,12 @@ namespace relion
 		DOUBLE calculateAngularDistance(DOUBLE rot1, DOUBLE tilt1, DOUBLE psi1,
 			DOUBLE rot2, DOUBLE tilt2, DOUBLE psi2);
 
+		/* Angular distances (as calculateAngularDistance) between (rot1, tilt1, psi1) and n other sets of Euler angles
+		 * The n sets are converted to quaternions once, and their symmetry mates are calculated in batch per operator.
+		 */
+		void calculateAngularDistances(DOUBLE rot1, DOUBLE tilt1, DOUBLE psi1,
+			const DOUBLE *rot2, const DOUBLE *tilt2, const DOUBLE *psi2, long int n, DOUBLE *distances);
+
 		/* Write a BILD file describing the angular distribution
 		 *  R determines the radius of the sphere on which cylinders will be placed
 		 *  Rmax_frac determines the length of the longest cylinder (relative to R, 0.2 + +20%)
@@ -312,6 +358,45 @@ namespace relion
 
 	private:
 
+		// Increment orientations_version (new orientations)
+		void orientationsHaveChanged()
+		{
+			orientations_version++;
+		}
+
+		/* Find the symmetry mate of direction idir that lies nearest to prior_direction
+		 * Returns that mate in best_direction
+		 */
+		void getNearestSymmetryMate(long int idir, const Matrix1D<DOUBLE> &prior_direction, Matrix1D<DOUBLE> &best_direction);
+
+		/* Quaternion of the Euler angles of L_j * E * R_j, with E the Euler matrix of (rot, tilt, psi) and q its quaternion
+		 * (as Euler_apply_transf)
+		 */
+		Quaternion getSymmetryMateQuaternion(int j, DOUBLE rot, DOUBLE tilt, DOUBLE psi, const Quaternion &q);
+
+		// Directory for cached directions (empty if none)
+		static FileName direction_cache_dir;
+
+		// Name of the cache file for the current order, symmetry group and tilt limit
+		FileName getDirectionCacheName();
+
+		// Read the directions from the cache; false if there is no cache for these settings
+		bool readDirectionCache();
+
+		// Write the current directions to the cache (if switched on)
+		void writeDirectionCache();
+
+		// getDirectionsFromHealPix for the pixels of any HEALPix grid
+		void getDirectionsFromHealPix(const Healpix_Base &base, const int *ipix, long int n, DOUBLE *rot, DOUBLE *tilt);
+
+		// Build the coarse HEALPix index of all directions (if it is out of date)
+		void updateDirectionIndex();
+
+		/* Get (in increasing order) all directions that may lie within max_ang degrees of prior_direction or any of its symmetry mates
+		 * A few directions further away may also be returned.
+		 */
+		void getDirectionsNearPrior(const Matrix1D<DOUBLE> &prior_direction, DOUBLE max_ang, std::vector<int> &candidates);
+
 		/* Eliminate points from the sampling_points_vector and sampling_points_angles vectors
 		 * that are outside the allowed tilt range.
 		 * Let tilt angles range from -90 to 90, then:
@@ -336,6 +421,64 @@ namespace relion
 
 
 	};
+
+	/** Table with the rotation matrices of the (oversampled) orientations of a HealpixSampling
+	 *
+	 * HealpixSampling::getOrientations gives Euler angles, which every caller then converts into a rotation matrix for every
+	 * oversampled orientation. This table does the conversion only once: the matrices of (idir, ipsi) are calculated on their
+	 * first use, and kept until the orientations of the sampling, the oversampling order or the selection of orientations with
+	 * non-zero prior probability change, in which case the table is emptied.
+	 *
+	 * The matrices of one (idir, ipsi) are consecutive row-major 3x3 matrices (in the order of getOrientations),
+	 * so that they can be passed straight to Projector::projectBatch.
+	 * The table is not thread-safe: each thread should use its own.
+	 *
+	 * @code
+	 * OrientationMatrixTable table;
+	 * int nr_over;
+	 * const DOUBLE *A = table.getMatrices(sampling, idir, ipsi, adaptive_oversampling,
+	 *     pointer_dir_nonzeroprior, directions_prior, pointer_psi_nonzeroprior, psi_prior, nr_over);
+	 * projector.projectBatch(Fref, A, nr_over, false, nr_threads);
+	 * @endcode
+	 */
+	class OrientationMatrixTable
+	{
+	public:
+		OrientationMatrixTable()
+		{
+			clear();
+		}
+
+		// Empty the table
+		void clear();
+
+		/* Get the nr_matrices rotation matrices of the oversampled orientations of (idir, ipsi)
+		 * The arguments are the same as those of HealpixSampling::getOrientations.
+		 * The returned pointer is valid until the next call.
+		 */
+		const DOUBLE* getMatrices(HealpixSampling &sampling, long int idir, long int ipsi, int oversampling_order,
+			std::vector<int> &pointer_dir_nonzeroprior, std::vector<DOUBLE> &directions_prior,
+			std::vector<int> &pointer_psi_nonzeroprior, std::vector<DOUBLE> &psi_prior, int &nr_matrices);
+
+	private:
+		// What the matrices are for
+		const HealpixSampling *sampling;
+		long int orientations_version;
+		int oversampling_order, prior_mode;
+		std::vector<int> dir_selection, psi_selection;
+
+		// Table dimensions: directions, psi angles and oversampled orientations per (idir, ipsi)
+		long int nr_dir, nr_psi;
+		int nr_over;
+
+		// 9 * nr_over values for every (idir, ipsi), and whether these have been calculated
+		std::vector<DOUBLE> matrices;
+		std::vector<char> is_calculated;
+
+		// Re-used for calculating the matrices
+		std::vector<DOUBLE> rot, tilt, psi;
+		Matrix2D<DOUBLE> A;
+	};
 }
 //@}
 #endif
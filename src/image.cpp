@@ -18,6 +18,8 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/image.h"
+#include "src/random.h"
+#include "immintrin.h"
 
 
 
@@ -74,7 +76,178 @@ namespace relion
 	}
 
 	// Some image-specific operations
-	void normalise(Image<DOUBLE> &I, int bg_radius, DOUBLE white_dust_stddev, DOUBLE black_dust_stddev, bool do_ramp)
+	// Byte orders within each 16-bit and 32-bit element, reversed
+	static inline __m128i swapMask16()
+	{
+		return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	}
+	static inline __m128i swapMask32()
+	{
+		return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	}
+
+	// 2 x 4 ints to 8 floats
+	static inline __m256 cvtInt32x8(__m128i lo, __m128i hi)
+	{
+		return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+	}
+
+	// Clamp in the float domain before truncating, as the scalar loops do.
+	// _mm256_cvttps_epi32 would turn anything outside the int range into
+	// INT_MIN, which packus then saturates to 0 instead of to the maximum.
+	// NaN ends up at lo, again as XMIPP_MIN(XMIPP_MAX(x, lo), hi) does.
+	static inline __m256 clampFloat8(__m256 v, __m256 lo, __m256 hi)
+	{
+		return _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+	}
+
+	template <typename T> static inline T swappedValue(T val)
+	{
+		swapbytes((char*)&val, sizeof(T));
+		return val;
+	}
+
+	bool castPageToFloat(const char* page, float* dst, DataType datatype, size_t n, bool do_swap)
+	{
+		size_t i = 0;
+		switch (datatype)
+		{
+		case UChar:
+		{
+			const unsigned char* src = (const unsigned char*)page;
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i v = _mm_loadl_epi64((const __m128i*)(src + i));
+				_mm256_storeu_ps(dst + i, cvtInt32x8(_mm_cvtepu8_epi32(v), _mm_cvtepu8_epi32(_mm_srli_si128(v, 4))));
+			}
+			for (; i < n; i++)
+				dst[i] = (float)src[i];
+			return true;
+		}
+		case SChar:
+		{
+			const signed char* src = (const signed char*)page;
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i v = _mm_loadl_epi64((const __m128i*)(src + i));
+				_mm256_storeu_ps(dst + i, cvtInt32x8(_mm_cvtepi8_epi32(v), _mm_cvtepi8_epi32(_mm_srli_si128(v, 4))));
+			}
+			for (; i < n; i++)
+				dst[i] = (float)src[i];
+			return true;
+		}
+		case UShort:
+		{
+			const unsigned short* src = (const unsigned short*)page;
+			const __m128i mask = swapMask16();
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+				if (do_swap)
+					v = _mm_shuffle_epi8(v, mask);
+				_mm256_storeu_ps(dst + i, cvtInt32x8(_mm_cvtepu16_epi32(v), _mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+			}
+			for (; i < n; i++)
+				dst[i] = (float)(do_swap ? swappedValue(src[i]) : src[i]);
+			return true;
+		}
+		case Short:
+		{
+			const short* src = (const short*)page;
+			const __m128i mask = swapMask16();
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+				if (do_swap)
+					v = _mm_shuffle_epi8(v, mask);
+				_mm256_storeu_ps(dst + i, cvtInt32x8(_mm_cvtepi16_epi32(v), _mm_cvtepi16_epi32(_mm_srli_si128(v, 8))));
+			}
+			for (; i < n; i++)
+				dst[i] = (float)(do_swap ? swappedValue(src[i]) : src[i]);
+			return true;
+		}
+		case Float:
+		{
+			const float* src = (const float*)page;
+			if (!do_swap)
+			{
+				memcpy(dst, src, n * sizeof(float));
+				return true;
+			}
+			const __m128i mask = swapMask32();
+			for (; i + 4 <= n; i += 4)
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), mask));
+			for (; i < n; i++)
+				dst[i] = swappedValue(src[i]);
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	bool castFloatToPage(const float* src, char* page, DataType datatype, size_t n)
+	{
+		size_t i = 0;
+		switch (datatype)
+		{
+		case Float:
+		{
+			memcpy(page, src, n * sizeof(float));
+			return true;
+		}
+		case UShort:
+		{
+			unsigned short* dst = (unsigned short*)page;
+			const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(65535.f);
+			for (; i + 8 <= n; i += 8)
+			{
+				__m256i v = _mm256_cvttps_epi32(clampFloat8(_mm256_loadu_ps(src + i), lo, hi));
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extractf128_si256(v, 1)));
+			}
+			for (; i < n; i++)
+				dst[i] = (unsigned short)XMIPP_MIN(XMIPP_MAX(src[i], 0.f), 65535.f);
+			return true;
+		}
+		case UChar:
+		{
+			unsigned char* dst = (unsigned char*)page;
+			const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.f);
+			for (; i + 8 <= n; i += 8)
+			{
+				__m256i v = _mm256_cvttps_epi32(clampFloat8(_mm256_loadu_ps(src + i), lo, hi));
+				__m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extractf128_si256(v, 1));
+				_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(v16, v16));
+			}
+			for (; i < n; i++)
+				dst[i] = (unsigned char)XMIPP_MIN(XMIPP_MAX(src[i], 0.f), 255.f);
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	void castFloatToDouble(const float* src, double* dst, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+			_mm256_storeu_pd(dst + i, _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+		for (; i < n; i++)
+			dst[i] = (double)src[i];
+	}
+
+	void castDoubleToFloat(const double* src, float* dst, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+			_mm_storeu_ps(dst + i, _mm256_cvtpd_ps(_mm256_loadu_pd(src + i)));
+		for (; i < n; i++)
+			dst[i] = (float)src[i];
+	}
+
+	void normalise(Image<DOUBLE> &I, int bg_radius, DOUBLE white_dust_stddev, DOUBLE black_dust_stddev, bool do_ramp,
+		RandomGenerator *rng)
 	{
 		int bg_radius2 = bg_radius * bg_radius;
 		DOUBLE avg, stddev;
@@ -89,9 +262,9 @@ namespace relion
 
 			// Remove white and black noise
 			if (white_dust_stddev > 0.)
-				removeDust(I, true, white_dust_stddev, avg, stddev);
+				removeDust(I, true, white_dust_stddev, avg, stddev, rng);
 			if (black_dust_stddev > 0.)
-				removeDust(I, false, black_dust_stddev, avg, stddev);
+				removeDust(I, false, black_dust_stddev, avg, stddev, rng);
 		}
 
 		if (do_ramp)
@@ -177,15 +350,13 @@ namespace relion
 	}
 
 
-	void removeDust(Image<DOUBLE> &I, bool is_white, DOUBLE thresh, DOUBLE avg, DOUBLE stddev)
+	void removeDust(Image<DOUBLE> &I, bool is_white, DOUBLE thresh, DOUBLE avg, DOUBLE stddev, RandomGenerator *rng)
 	{
 		FOR_ALL_ELEMENTS_IN_ARRAY3D(I())
 		{
 			DOUBLE aux = A3D_ELEM(I(), k, i, j);
-			if (is_white && aux - avg > thresh * stddev)
-				A3D_ELEM(I(), k, i, j) = rnd_gaus(avg, stddev);
-			else if (!is_white && aux - avg < -thresh * stddev)
-				A3D_ELEM(I(), k, i, j) = rnd_gaus(avg, stddev);
+			if ((is_white && aux - avg > thresh * stddev) || (!is_white && aux - avg < -thresh * stddev))
+				A3D_ELEM(I(), k, i, j) = (rng != NULL) ? rng->gaussian(avg, stddev) : rnd_gaus(avg, stddev);
 		}
 	}
 
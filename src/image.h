@@ -58,10 +58,12 @@
 #include "src/funcs.h"
 #include "src/memory.h"
 #include "src/filename.h"
+#include "src/compressed_stack.h"
 #include "src/multidim_array.h"
 #include "src/transformations.h"
 #include "src/metadata_table.h"
 #include "src/fftw.h"
+#include "src/instrumentation.h"
 
 
 namespace relion
@@ -118,6 +120,25 @@ namespace relion
 	/** Convert datatype string to datatypr enun */
 	int datatypeString2Int(std::string s);
 
+	/** Vectorised (AVX) conversion of n elements of a file page to float, as used by Image::castPage2T
+	 *
+	 * Handles UChar, SChar, UShort, Short and Float pages; returns false for any other datatype (nothing is done then).
+	 * If do_swap, the bytes of every element are swapped in the same pass (the page itself is not modified).
+	 * A native-endian Float page is simply copied.
+	 */
+	bool castPageToFloat(const char* page, float* dst, DataType datatype, size_t n, bool do_swap);
+
+	/** Vectorised (AVX) conversion of n floats to a file datatype, as used by Image::castPage2Datatype
+	 *
+	 * Handles Float, UShort and UChar; returns false for any other datatype (nothing is done then).
+	 * Conversion to integer types truncates towards zero and saturates outside of their range.
+	 */
+	bool castFloatToPage(const float* src, char* page, DataType datatype, size_t n);
+
+	/** Vectorised (AVX) conversion between float and double, for double-precision builds */
+	void castFloatToDouble(const float* src, double* dst, size_t n);
+	void castDoubleToFloat(const double* src, float* dst, size_t n);
+
 	/** Swapping trigger.
 	 * Threshold file z size above which bytes are swapped.
 	 */
@@ -148,6 +169,7 @@ namespace relion
 		bool                mmapOn;      // Mapping when loading from file
 		int                 mFd;         // Handle the file in reading method and mmap
 		size_t              mappedSize;  // Size of the mapped file
+		char*               mappedData;  // Start of the mapped part of the file (NULL if none)
 
 	public:
 		/** Empty constructor
@@ -161,6 +183,7 @@ namespace relion
 		Image()
 		{
 			mmapOn = false;
+			mappedData = NULL;
 			clear();
 			//MDMainHeader.addObject();
 		}
@@ -177,22 +200,98 @@ namespace relion
 		Image(long int Xdim, long int Ydim, long int Zdim = 1, long int Ndim = 1)
 		{
 			mmapOn = false;
+			mappedData = NULL;
 			clear();
 			data.resize(Ndim, Zdim, Ydim, Xdim);
 			//MDMainHeader.addObject();
 		}
 
+		/** Copy constructor
+		 *
+		 * The data are copied into memory, also if op is memory-mapped
+		 */
+		Image(const Image<T> &op)
+		{
+			mmapOn = false;
+			mappedData = NULL;
+			clear();
+			*this = op;
+		}
+
+		/** Assignment
+		 *
+		 * The data are copied into memory, also if op is memory-mapped
+		 */
+		Image<T>& operator=(const Image<T> &op)
+		{
+			if (&op != this)
+			{
+				clear();
+				data = op.data;
+				filename = op.filename;
+				fimg = op.fimg;
+				fhed = op.fhed;
+				stayOpen = op.stayOpen;
+				dataflag = op.dataflag;
+				i = op.i;
+				offset = op.offset;
+				swap = op.swap;
+				replaceNsize = op.replaceNsize;
+				_exists = op._exists;
+			}
+			return *this;
+		}
+
+		/** Move constructor
+		 *
+		 * The data (and the file mapping, if any) of op are taken over, op is left empty
+		 */
+		Image(Image<T> &&op) noexcept
+		{
+			mmapOn = false;
+			mappedData = NULL;
+			clear();
+			*this = std::move(op);
+		}
+
+		/** Move assignment
+		 *
+		 * The data (and the file mapping, if any) of op are taken over, op is left empty
+		 */
+		Image<T>& operator=(Image<T> &&op)
+		{
+			if (&op != this)
+			{
+				clear();
+				data = std::move(op.data);
+				filename = op.filename;
+				fimg = op.fimg;
+				fhed = op.fhed;
+				stayOpen = op.stayOpen;
+				dataflag = op.dataflag;
+				i = op.i;
+				offset = op.offset;
+				swap = op.swap;
+				replaceNsize = op.replaceNsize;
+				_exists = op._exists;
+				mmapOn = op.mmapOn;
+				mFd = op.mFd;
+				mappedSize = op.mappedSize;
+				mappedData = op.mappedData;
+				// op no longer owns the mapping
+				op.mappedData = NULL;
+				op.clear();
+			}
+			return *this;
+		}
+
 		/** Clear.
 		 * Initialize everything to 0
 		 */
 		void clear()
 		{
-			if (mmapOn)
-			{
-				REPORT_ERROR("Not on Windows.");
-			}
-			else
-				data.clear();
+			unmapData();
+			data.clear();
 
 			dataflag = -1;
 			i = 0;
@@ -204,6 +303,31 @@ namespace relion
 			mmapOn = false;
 		}
 
+		/** Release the file mapping of read(..., mapData = true), if any
+		 * If data still points into the mapping, it is left empty (but with its dimensions)
+		 */
+		void unmapData()
+		{
+#ifndef _WIN32
+			if (mappedData != NULL)
+			{
+				if (data.data >= (T*)mappedData && data.data < (T*)(mappedData + mappedSize))
+					data.coreDeallocate();
+				munmap(mappedData, mappedSize);
+			}
+#endif
+			mappedData = NULL;
+			mappedSize = 0;
+			mmapOn = false;
+		}
+
+		/** Is the data of this image memory-mapped from its file?
+		 */
+		bool isMapped() const
+		{
+			return mappedData != NULL;
+		}
+
 		/** Clear the header of the image
 		 */
 		void clearHeader()
@@ -219,6 +343,7 @@ namespace relion
 		}
 
 		#include "src/rwMRC.h"
+		#include "src/rwLCS.h"
 
 		/** Is this file an image
 		 *
@@ -247,7 +372,7 @@ namespace relion
 		 */
 		int read(const FileName &name, bool readdata = true, long int select_img = -1, bool mapData = false, bool is_2D = false)
 		{
-
+			INSTRUMENT_TIMER(TIMER_IMAGE_READ);
 			int err = 0;
 			fImageHandler* hFile = openFile(name);
 			err = _read(name, hFile, readdata, select_img, mapData, is_2D);
@@ -289,9 +414,25 @@ namespace relion
 
 		/** Cast a page of data from type dataType to type Tdest
 		 *    input pointer  char *
+		 * If swap_bytes is non-zero, the bytes are swapped first (as in swapPage, the page may be modified)
+		 * For float T (and Float pages into double T) this is done by the vectorised kernels,
+		 * which swap and convert in one pass.
 		 */
-		void castPage2T(char * page, T * ptrDest, DataType datatype, size_t pageSize)
+		void castPage2T(char * page, T * ptrDest, DataType datatype, size_t pageSize, int swap_bytes = 0)
 		{
+			if (typeid(T) == typeid(float) && swap_bytes <= 1 &&
+				castPageToFloat(page, (float*)ptrDest, datatype, pageSize, swap_bytes == 1))
+				return;
+
+			if (swap_bytes)
+				swapPage(page, pageSize * gettypesize(datatype), datatype, swap_bytes);
+
+			if (typeid(T) == typeid(double) && datatype == Float)
+			{
+				castFloatToDouble((float*)page, (double*)ptrDest, pageSize);
+				return;
+			}
+
 			switch (datatype)
 			{
 			case Unknown_Type:
@@ -435,6 +576,16 @@ namespace relion
 		 */
 		void castPage2Datatype(T * srcPtr, char * page, DataType datatype, size_t pageSize)
 		{
+			// Vectorised kernels. The scalar loops below saturate in the same way,
+			// so the result does not depend on which path is taken.
+			if (typeid(T) == typeid(float) && castFloatToPage((float*)srcPtr, page, datatype, pageSize))
+				return;
+			if (typeid(T) == typeid(double) && datatype == Float)
+			{
+				castDoubleToFloat((double*)srcPtr, (float*)page, pageSize);
+				return;
+			}
+
 			switch (datatype)
 			{
 			case Float:
@@ -475,7 +626,7 @@ namespace relion
 				{
 					unsigned short * ptr = (unsigned short *)page;
 					for (int i = 0; i < pageSize; i++)
-						ptr[i] = (unsigned short)srcPtr[i];
+						ptr[i] = (unsigned short)XMIPP_MIN(XMIPP_MAX(srcPtr[i], (T)0), (T)65535);
 				}
 				break;
 			}
@@ -489,7 +640,7 @@ namespace relion
 				{
 					unsigned char * ptr = (unsigned char *)page;
 					for (int i = 0; i < pageSize; i++)
-						ptr[i] = (unsigned char)srcPtr[i];
+						ptr[i] = (unsigned char)XMIPP_MIN(XMIPP_MAX(srcPtr[i], (T)0), (T)255);
 				}
 				break;
 			}
@@ -610,14 +761,17 @@ namespace relion
 
 		/** Swap an entire page
 		  * input pointer char *
+		  * swap_bytes is as the swap member (which is used if swap_bytes < 0)
 		  */
-		void swapPage(char * page, size_t pageNrElements, DataType datatype)
+		void swapPage(char * page, size_t pageNrElements, DataType datatype, int swap_bytes = -1)
 		{
 			unsigned long datatypesize = gettypesize(datatype);
+			if (swap_bytes < 0)
+				swap_bytes = swap;
 #ifdef DEBUG
 
 			std::cerr<<"DEBUG swapPage: Swapping image data with swap= "
-				<< swap<<" datatypesize= "<<datatypesize
+				<< swap_bytes<<" datatypesize= "<<datatypesize
 				<< " pageNrElements " << pageNrElements
 				<< " datatype " << datatype
 				<<std::endl;
@@ -625,15 +779,15 @@ namespace relion
 #endif
 
 			// Swap bytes if required
-			if (swap == 1)
+			if (swap_bytes == 1)
 			{
 				for (unsigned long i = 0; i < pageNrElements; i += datatypesize)
 					swapbytes(page + i, datatypesize);
 			}
-			else if (swap > 1)
+			else if (swap_bytes > 1)
 			{
-				for (unsigned long i = 0; i < pageNrElements; i += swap)
-					swapbytes(page + i, swap);
+				for (unsigned long i = 0; i < pageNrElements; i += swap_bytes)
+					swapbytes(page + i, swap_bytes);
 			}
 		}
 
@@ -666,27 +820,47 @@ namespace relion
 				mmapOn = false;
 				mFd = -1;
 			}
+			// Only native-endian data without padding between the images can be used as they are on disc
+			if (mmapOn && (swap != 0 || (NSIZE(data) > 1 && pad > 0)))
+			{
+				std::cout << "WARNING: Image Class. File byte order or layout not compatible with mmap. Loading into memory." << std::endl;
+				mmapOn = false;
+				mFd = -1;
+			}
+#ifdef _WIN32
+			if (mmapOn)
+			{
+				std::cout << "WARNING: Image Class. mmap is not supported in the Windows port. Loading into memory." << std::endl;
+				mmapOn = false;
+				mFd = -1;
+			}
+#endif
 
 			if (mmapOn)
 			{
-				if (NSIZE(data) > 1)
+#ifndef _WIN32
+				// Map (privately, i.e. copy-on-write and read-only on disc) only the selected image(s).
+				// Nothing is read until a page is touched, and all processes mapping the same file share the page cache.
+				if (select_img < 0)
+					select_img = 0;
+				myoffset = offset + select_img*(pagesize + pad);
+				size_t mapstart = myoffset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+
+				data.coreDeallocate();
+				mappedSize = myoffset - mapstart + NSIZE(data) * pagesize;
+				mappedData = (char*)mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fimg), mapstart);
+				if (mappedData == (char*)MAP_FAILED)
 				{
-					REPORT_ERROR("Image Class::ReadData: mmap with multiple \
-								                              images file not compatible. Try selecting a unique image.");
+					mappedData = NULL;
+					REPORT_ERROR("Image Class::ReadData: mmap of image file failed.");
 				}
+				mFd = -1;
 
-				fclose(fimg);
-
-				//if ( ( mFd = open(filename.c_str(), O_RDWR, S_IREAD | S_IWRITE) ) == -1 )
-				if ((mFd = open(filename.c_str(), O_RDWR, S_IRUSR | S_IWUSR)) == -1)
-					REPORT_ERROR("Image Class::ReadData: Error opening the image file.");
-
-				char * map;
-				mappedSize = pagesize + offset;
-
-				if ((map = (char*)mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0)) == (void*)-1)
-					REPORT_ERROR("Image Class::ReadData: mmap of image file failed.");
-				data.data = reinterpret_cast<T*> (map + offset);
+				// The MultidimArray does not own this memory: it is unmapped by the Image
+				data.data = reinterpret_cast<T*> (mappedData + myoffset - mapstart);
+				data.destroyData = false;
+				data.nzyxdimAlloc = NZYXSIZE(data);
+#endif
 			}
 			else
 			{
@@ -733,12 +907,10 @@ namespace relion
 						size_t result = fread(page, readsize, 1, fimg);
 						if (result != 1)
 							return -2;
+						INSTRUMENT_COUNT(COUNT_BYTES_READ, readsize);
 
-						//swap per page
-						if (swap)
-							swapPage(page, readsize, datatype);
-						// cast to T per page
-						castPage2T(page, MULTIDIM_ARRAY(data) + haveread_n, datatype, readsize_n);
+						// swap and cast to T per page
+						castPage2T(page, MULTIDIM_ARRAY(data) + haveread_n, datatype, readsize_n, swap);
 						haveread_n += readsize_n;
 					}
 					if (pad > 0)
@@ -751,7 +923,7 @@ namespace relion
 				}
 				//if ( pad > 0 )
 				//    freeMemory(padpage, pad*sizeof(char));
-				if (page > 0)
+				if (page != NULL)
 					freeMemory(page, pagesize*sizeof(char));
 
 #ifdef DEBUG
@@ -1105,8 +1277,43 @@ namespace relion
 		int _read(const FileName &name, fImageHandler* hFile, bool readdata = true, long int select_img = -1,
 			bool mapData = false, bool is_2D = false)
 		{
-			REPORT_ERROR("Not on Windows.");
-			return -1;
+			int err = 0;
+
+			// Release the mapping of a previous read
+			unmapData();
+
+			// Check whether to read the data or only the header
+			dataflag = (readdata) ? 1 : -1;
+
+			// If we want to read the data, check whether the file is mapped
+			mmapOn = mapData;
+
+			FileName ext_name = hFile->ext_name;
+			fimg = hFile->fimg;
+			fhed = hFile->fhed;
+
+			long int dump;
+			name.decompose(dump, filename);
+			// Subtract 1 to have numbering 0...N-1 instead of 1...N
+			if (dump > 0)
+				dump--;
+			filename = name;
+
+			if (select_img == -1)
+				select_img = dump;
+
+			// Only MRC and compressed stacks are supported in this port; an mrcs stack MUST go BEFORE plain MRC
+			if (ext_name.contains("lcs"))
+				err = readLCS(select_img);
+			else if (ext_name.contains("mrcs"))
+				err = readMRC(select_img, true);
+			else if (ext_name.contains("mrc"))
+				err = readMRC(select_img, false);
+			else
+				err = readMRC(select_img, false);
+
+			// Negative errors are bad.
+			return err;
 		}
 
 
@@ -1213,7 +1420,9 @@ namespace relion
 			/*
 			 * SELECT FORMAT
 			 */
-			if (ext_name.contains("mrcs"))
+			if (ext_name.contains("lcs"))
+				writeLCS(select_img, mode);
+			else if (ext_name.contains("mrcs"))
 				writeMRC(select_img, true, mode);
 			else if (ext_name.contains("mrc"))
 				writeMRC(select_img, false, mode);
@@ -1236,14 +1445,16 @@ namespace relion
 	};
 
 	// Some image-specific operations
+	class RandomGenerator;
 
-	// For image normalisation
-	void normalise(Image<DOUBLE> &I, int bg_radius, DOUBLE white_dust_stddev, DOUBLE black_dust_stddev, bool do_ramp);
+	// For image normalisation (dust is replaced by noise from rng, or from rnd_gaus if it is NULL)
+	void normalise(Image<DOUBLE> &I, int bg_radius, DOUBLE white_dust_stddev, DOUBLE black_dust_stddev, bool do_ramp,
+		RandomGenerator *rng = NULL);
 	void calculateBackgroundAvgStddev(Image<DOUBLE> &I, DOUBLE &avg, DOUBLE &stddev, int bg_radius);
 	void subtractBackgroundRamp(Image<DOUBLE> &I, int bg_radius);
 
 	// For dust removal
-	void removeDust(Image<DOUBLE> &I, bool is_white, DOUBLE thresh, DOUBLE avg, DOUBLE stddev);
+	void removeDust(Image<DOUBLE> &I, bool is_white, DOUBLE thresh, DOUBLE avg, DOUBLE stddev, RandomGenerator *rng = NULL);
 
 	// for contrast inversion
 	void invert_contrast(Image<DOUBLE> &I);
@@ -0,0 +1,207 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/image_stack_reader.h"
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#endif
+
+namespace relion
+{
+	ImageStackReader::ImageStackReader()
+	{
+		fimg = NULL;
+		prefetch_thread = NULL;
+		xdim = ydim = ndim = 0;
+		prefetch_first = prefetch_count = 0;
+		prefetch_ok = false;
+		is_compressed = false;
+		nr_threads = 1;
+	}
+
+	ImageStackReader::ImageStackReader(const FileName &fn_stack)
+	{
+		fimg = NULL;
+		prefetch_thread = NULL;
+		xdim = ydim = ndim = 0;
+		prefetch_first = prefetch_count = 0;
+		prefetch_ok = false;
+		is_compressed = false;
+		nr_threads = 1;
+		open(fn_stack);
+	}
+
+	ImageStackReader::~ImageStackReader()
+	{
+		close();
+	}
+
+	void ImageStackReader::open(const FileName &fn_stack)
+	{
+		close();
+
+		fn = fn_stack;
+		if ((fimg = fopen(fn.c_str(), "rb")) == NULL)
+			REPORT_ERROR((std::string)"ImageStackReader::open: cannot open " + fn);
+
+		if (isCompressedStack(fn))
+		{
+			is_compressed = true;
+			compressed.open(fimg, fn);
+			if (compressed.getZdim() > 1)
+				REPORT_ERROR((std::string)"ImageStackReader::open: " + fn + " is not a stack of 2D images");
+			xdim = compressed.getXdim();
+			ydim = compressed.getYdim();
+			ndim = compressed.getStackSize();
+			datatype = Float;
+			datatypesize = gettypesize(datatype);
+			swap = 0;
+			offset = 0;
+			return;
+		}
+
+		Image<DOUBLE>::MRChead header;
+		if (fread(&header, MRCSIZE, 1, fimg) < 1)
+			REPORT_ERROR((std::string)"ImageStackReader::open: error in reading header of " + fn);
+
+		// Determine byte order and swap bytes if from little-endian machine (as in readMRC)
+		swap = 0;
+		if ((abs(header.mode) > SWAPTRIG) || (abs(header.nx) > SWAPTRIG))
+		{
+			swap = 1;
+			char* b = (char *)&header;
+			for (int i = 0; i < MRCSIZE - 800; i += 4)
+				swapbytes(b + i, 4);
+		}
+
+		switch (header.mode % 5)
+		{
+		case 1:
+			datatype = Short;
+			break;
+		case 2:
+			datatype = Float;
+			break;
+		case 3:
+		case 4:
+			REPORT_ERROR("ImageStackReader::open: only real-space images may be read into RELION.");
+			break;
+		default:
+			datatype = UChar;
+			break;
+		}
+
+		xdim = header.nx;
+		ydim = header.ny;
+		ndim = header.nz;
+		datatypesize = gettypesize(datatype);
+		offset = MRCSIZE + header.nsymbt;
+	}
+
+	void ImageStackReader::close()
+	{
+		waitForPrefetch();
+		prefetch_ok = false;
+		if (is_compressed)
+			compressed.close();
+		is_compressed = false;
+		if (fimg != NULL)
+			fclose(fimg);
+		fimg = NULL;
+		xdim = ydim = ndim = 0;
+	}
+
+	bool ImageStackReader::readRaw(long int first, long int count, std::vector<char> &buf)
+	{
+		if (is_compressed)
+			return compressed.readChunks(first, count, buf);
+
+		size_t pagesize = xdim * ydim * datatypesize;
+		buf.resize(count * pagesize);
+		if (fseeko(fimg, offset + first * pagesize, SEEK_SET) != 0)
+			return false;
+		INSTRUMENT_COUNT(COUNT_BYTES_READ, count * pagesize);
+		return count == 0 || fread(&buf[0], count * pagesize, 1, fimg) == 1;
+	}
+
+	void ImageStackReader::waitForPrefetch()
+	{
+		if (prefetch_thread != NULL)
+		{
+			prefetch_thread->join();
+			delete prefetch_thread;
+			prefetch_thread = NULL;
+		}
+	}
+
+	void ImageStackReader::prefetchThread(ImageStackReader* reader)
+	{
+		reader->prefetch_ok = reader->readRaw(reader->prefetch_first, reader->prefetch_count, reader->prefetch_raw);
+	}
+
+	void ImageStackReader::prefetch(long int first, long int count)
+	{
+		waitForPrefetch();
+		prefetch_ok = false;
+
+		if (fimg == NULL || first < 0 || first >= ndim || count <= 0)
+			return;
+		count = XMIPP_MIN(count, ndim - first);
+
+		prefetch_first = first;
+		prefetch_count = count;
+		prefetch_thread = new std::thread(prefetchThread, this);
+	}
+
+	void ImageStackReader::read(long int first, long int count, MultidimArray<DOUBLE> &stack)
+	{
+		INSTRUMENT_TIMER(TIMER_IMAGE_READ);
+		if (fimg == NULL)
+			REPORT_ERROR("ImageStackReader::read: no stack has been opened");
+		if (first < 0 || first >= ndim || count <= 0)
+			REPORT_ERROR((std::string)"ImageStackReader::read: images out of range of " + fn);
+		count = XMIPP_MIN(count, ndim - first);
+
+		// The file pointer is shared with the prefetch thread
+		waitForPrefetch();
+		if (prefetch_ok && prefetch_first == first && prefetch_count == count)
+			raw.swap(prefetch_raw);
+		else if (!readRaw(first, count, raw))
+			REPORT_ERROR((std::string)"ImageStackReader::read: error in reading data of " + fn);
+		prefetch_ok = false;
+
+		if (NSIZE(stack) != count || ZSIZE(stack) != 1 || YSIZE(stack) != ydim || XSIZE(stack) != xdim)
+			stack.resize(count, 1, ydim, xdim);
+
+		if (is_compressed)
+		{
+#ifdef FLOAT_PRECISION
+			compressed.decompressChunks(first, count, raw, MULTIDIM_ARRAY(stack), nr_threads);
+#else
+			decompressed.resize(NZYXSIZE(stack));
+			compressed.decompressChunks(first, count, raw, &decompressed[0], nr_threads);
+			converter.castPage2T((char*)&decompressed[0], MULTIDIM_ARRAY(stack), Float, NZYXSIZE(stack), 0);
+#endif
+		}
+		else
+			converter.castPage2T(&raw[0], MULTIDIM_ARRAY(stack), datatype, NZYXSIZE(stack), swap);
+	}
+}
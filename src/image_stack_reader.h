@@ -0,0 +1,137 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_STACK_READER_H
+#define IMAGE_STACK_READER_H
+
+#include <vector>
+#include <thread>
+#include "src/image.h"
+
+namespace relion
+{
+	/** Persistent reader for MRC stacks (.mrcs) and compressed stacks (.lcs)
+	 *
+	 * Image::read opens the file, parses the header and seeks for every single image.
+	 * This reader opens the stack once, keeps its header, and reads ranges of consecutive images
+	 * with a single seek and read. The next range can be read in the background on an I/O thread
+	 * while the current one is being processed. Compressed stacks are read in the same way, and the images of
+	 * a range are decompressed in parallel (see setThreadsNumber).
+	 *
+	 * @code
+	 * ImageStackReader reader("particles.mrcs");
+	 * MultidimArray<DOUBLE> batch;
+	 * reader.prefetch(0, 256);
+	 * for (long int first = 0; first < reader.getStackSize(); first += 256)
+	 * {
+	 *     reader.read(first, 256, batch);  // uses the prefetched data
+	 *     reader.prefetch(first + 256, 256);
+	 *     processBatch(batch);
+	 * }
+	 * @endcode
+	 */
+	class ImageStackReader
+	{
+	public:
+		ImageStackReader();
+
+		// Open fn_stack directly
+		ImageStackReader(const FileName &fn_stack);
+
+		~ImageStackReader();
+
+		/** Open a stack and read its header. Any previously opened stack is closed.
+		 * The z dimension of an MRC file is taken as the number of images.
+		 * Files with the extension .lcs are read as compressed stacks.
+		 */
+		void open(const FileName &fn_stack);
+
+		// Close the stack (waits for any prefetch to finish)
+		void close();
+
+		bool isOpen() const
+		{
+			return fimg != NULL;
+		}
+
+		// Image dimensions and number of images in the stack
+		long int getXdim() const { return xdim; }
+		long int getYdim() const { return ydim; }
+		long int getStackSize() const { return ndim; }
+
+		// Threads for decompressing the images of a compressed stack in read()
+		void setThreadsNumber(int _nr_threads)
+		{
+			nr_threads = XMIPP_MAX(1, _nr_threads);
+		}
+
+		/** Read images first ... first + count - 1 (counting from 0) into stack
+		 * stack is resized to count x 1 x ydim x xdim (its memory is re-used if it already has that size)
+		 * count is limited to the end of the stack
+		 */
+		void read(long int first, long int count, MultidimArray<DOUBLE> &stack);
+
+		/** Start reading images first ... first + count - 1 on a background thread
+		 * The next read() of exactly this range uses these data; any other read() simply discards them.
+		 * Does nothing if the range lies outside the stack.
+		 */
+		void prefetch(long int first, long int count);
+
+	private:
+		FileName fn;
+		FILE* fimg;
+
+		// From the header
+		long int xdim, ydim, ndim;
+		DataType datatype;
+		size_t datatypesize, offset;
+		int swap;
+
+		// For compressed stacks (which are read through fimg as well)
+		bool is_compressed;
+		CompressedStackFile compressed;
+		std::vector<float> decompressed;
+		int nr_threads;
+
+		// Raw (file datatype, or compressed) bytes of the last read and of the pending prefetch
+		std::vector<char> raw, prefetch_raw;
+		long int prefetch_first, prefetch_count;
+		bool prefetch_ok;
+		std::thread* prefetch_thread;
+
+		// Only used for its byte-swapping and datatype conversion
+		Image<DOUBLE> converter;
+
+		// Read count images from first on into buf; false on error
+		bool readRaw(long int first, long int count, std::vector<char> &buf);
+
+		// Body of the prefetch thread: reads prefetch_count images from prefetch_first on into prefetch_raw
+		static void prefetchThread(ImageStackReader* reader);
+
+		// Join the prefetch thread, if any
+		void waitForPrefetch();
+
+		// Not copyable
+		ImageStackReader(const ImageStackReader&);
+		ImageStackReader& operator=(const ImageStackReader&);
+	};
+}
+
+#endif
@@ -0,0 +1,299 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/image_stack_writer.h"
+
+namespace relion
+{
+	ImageStackWriter::ImageStackWriter()
+	{
+		fimg = NULL;
+		writer_thread = NULL;
+		xdim = ydim = zdim = nr_images = 0;
+		max_queued = 16;
+		is_compressed = false;
+		quantisation_step = 0.;
+	}
+
+	ImageStackWriter::ImageStackWriter(const FileName &fn_stack, long int _xdim, long int _ydim, long int _zdim, int _max_queued)
+	{
+		fimg = NULL;
+		writer_thread = NULL;
+		xdim = ydim = zdim = nr_images = 0;
+		max_queued = 16;
+		is_compressed = false;
+		quantisation_step = 0.;
+		open(fn_stack, _xdim, _ydim, _zdim, _max_queued);
+	}
+
+	ImageStackWriter::~ImageStackWriter()
+	{
+		// Do not throw from the destructor: call close() explicitly to get write errors reported
+		try
+		{
+			close();
+		}
+		catch (RelionError &)
+		{
+			std::cerr << " ImageStackWriter: error in writing to " << fn << std::endl;
+		}
+		for (size_t i = 0; i < spare.size(); i++)
+			delete spare[i];
+	}
+
+	void ImageStackWriter::open(const FileName &fn_stack, long int _xdim, long int _ydim, long int _zdim, int _max_queued)
+	{
+		close();
+
+		if (_xdim <= 0 || _ydim <= 0 || _zdim <= 0)
+			REPORT_ERROR("ImageStackWriter::open: invalid image dimensions");
+
+		fn = fn_stack;
+		// Closes the file again if writing the header placeholder fails
+		std::unique_ptr<FILE, FileCloser> fp(fopen(fn.c_str(), "wb"));
+		if (!fp)
+			REPORT_ERROR((std::string)"ImageStackWriter::open: cannot open " + fn);
+
+		xdim = _xdim;
+		ydim = _ydim;
+		zdim = _zdim;
+		max_queued = XMIPP_MAX(1, _max_queued);
+		nr_images = 0;
+		sum = sum2 = 0.;
+		minval = 99.e99;
+		maxval = -99.e99;
+		is_closing = write_error = false;
+
+		// Placeholder for the header, which is written at close()
+		is_compressed = isCompressedStack(fn);
+		fimg = fp.get();
+		try
+		{
+			if (is_compressed)
+				compressed.create(fimg, fn, xdim, ydim, zdim);
+			else
+				writeHeader();
+		}
+		catch (RelionError &)
+		{
+			fimg = NULL;
+			throw;
+		}
+		fp.release();
+
+		writer_thread = new std::thread(writerThread, this);
+	}
+
+	void ImageStackWriter::writerThread(ImageStackWriter* writer)
+	{
+		std::vector<char> chunk;
+		while (true)
+		{
+			std::vector<float>* page;
+			{
+				std::unique_lock<std::mutex> lock(writer->queue_mutex);
+				while (writer->pending.empty() && !writer->is_closing)
+					writer->queue_changed.wait(lock);
+				if (writer->pending.empty())
+					return; // closing, and all has been written
+				page = writer->pending.front();
+			}
+
+			// Write outside of the lock, so that write() can queue the next images meanwhile
+			bool ok = true;
+			if (writer->is_compressed)
+			{
+				try
+				{
+					compressImage(&(*page)[0], page->size(), writer->quantisation_step, chunk);
+					writer->compressed.appendChunk(chunk);
+				}
+				catch (RelionError &)
+				{
+					ok = false;
+				}
+			}
+			else
+				ok = fwrite(&(*page)[0], page->size() * sizeof(float), 1, writer->fimg) == 1;
+
+			{
+				std::unique_lock<std::mutex> lock(writer->queue_mutex);
+				writer->pending.pop_front();
+				writer->spare.push_back(page);
+				if (!ok)
+					writer->write_error = true;
+			}
+			writer->queue_changed.notify_all();
+		}
+	}
+
+	void ImageStackWriter::setQuantisationStep(DOUBLE step)
+	{
+		if (step < 0.)
+			REPORT_ERROR("ImageStackWriter::setQuantisationStep: the step should not be negative");
+		// The writer thread reads the step while compressing
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		while (!pending.empty() && !write_error)
+			queue_changed.wait(lock);
+		quantisation_step = step;
+	}
+
+	void ImageStackWriter::write(const MultidimArray<DOUBLE> &img)
+	{
+		if (fimg == NULL)
+			REPORT_ERROR("ImageStackWriter::write: no file has been opened");
+		if (XSIZE(img) != xdim || YSIZE(img) != ydim || ZSIZE(img) != zdim)
+			REPORT_ERROR((std::string)"ImageStackWriter::write: image has a different size than the images in " + fn);
+		if (zdim > 1 && nr_images + NSIZE(img) > 1)
+			REPORT_ERROR((std::string)"ImageStackWriter::write: only a single 3D map can be written into " + fn);
+
+		size_t page_size = xdim * ydim * zdim;
+		Image<DOUBLE> caster; // only for castPage2Datatype
+		for (long int n = 0; n < NSIZE(img); n++)
+		{
+			// Get a free page, waiting for the writer thread if too many are queued
+			std::vector<float>* page;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				while (pending.size() >= (size_t)max_queued && !write_error)
+					queue_changed.wait(lock);
+				if (write_error)
+					REPORT_ERROR((std::string)"ImageStackWriter::write: error in writing to " + fn);
+				if (spare.empty())
+					page = new std::vector<float>(page_size);
+				else
+				{
+					page = spare.back();
+					spare.pop_back();
+				}
+			}
+
+			const DOUBLE* ptr = MULTIDIM_ARRAY(img) + n * page_size;
+			for (size_t i = 0; i < page_size; i++)
+			{
+				double val = ptr[i];
+				sum += val;
+				sum2 += val * val;
+				minval = XMIPP_MIN(minval, val);
+				maxval = XMIPP_MAX(maxval, val);
+			}
+			caster.castPage2Datatype((DOUBLE*)ptr, (char*)&(*page)[0], Float, page_size);
+
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				pending.push_back(page);
+			}
+			queue_changed.notify_all();
+			nr_images++;
+		}
+	}
+
+	void ImageStackWriter::close()
+	{
+		if (writer_thread != NULL)
+		{
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				is_closing = true;
+			}
+			queue_changed.notify_all();
+			writer_thread->join();
+			delete writer_thread;
+			writer_thread = NULL;
+		}
+
+		if (fimg != NULL)
+		{
+			bool ok = !write_error;
+			try
+			{
+				if (is_compressed)
+					compressed.close();
+				else
+				{
+					fseek(fimg, 0, SEEK_SET);
+					writeHeader();
+				}
+			}
+			catch (RelionError &)
+			{
+				ok = false;
+			}
+			ok = fclose(fimg) == 0 && ok;
+			fimg = NULL;
+			if (!ok)
+				REPORT_ERROR((std::string)"ImageStackWriter::close: error in writing to " + fn);
+		}
+	}
+
+	void ImageStackWriter::writeHeader()
+	{
+		// Same header as Image::writeMRC, but with the statistics filled in
+		Image<DOUBLE>::MRChead header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.map, "MAP ", 4);
+		switch (Image<DOUBLE>().systype())
+		{
+		case BIGIEEE:
+			header.machst[0] = header.machst[1] = 17;
+			break;
+		case LITTLEIEEE:
+			header.machst[0] = 68;
+			header.machst[1] = 65;
+			break;
+		case LITTLEVAX:
+			header.machst[0] = 34;
+			header.machst[1] = 65;
+			break;
+		default:
+			REPORT_ERROR("Unkown system type in ImageStackWriter machine stamp determination.");
+			break;
+		}
+
+		header.nx = xdim;
+		header.ny = ydim;
+		header.nz = (zdim > 1) ? zdim : nr_images;
+		header.mode = 2;
+		header.mx = header.nx;
+		header.my = header.ny;
+		header.mz = header.nz;
+		header.mapc = 1;
+		header.mapr = 2;
+		header.maps = 3;
+		header.alpha = header.beta = header.gamma = 90.f;
+
+		double nr_pixels = (double)xdim * ydim * zdim * nr_images;
+		if (nr_pixels > 0)
+		{
+			double avg = sum / nr_pixels;
+			header.amin = (float)minval;
+			header.amax = (float)maxval;
+			header.amean = (float)avg;
+			header.arms = (float)sqrt(XMIPP_MAX(0., sum2 / nr_pixels - avg * avg));
+		}
+
+		header.nsymbt = 0;
+		header.nlabl = 1;
+		strncpy(header.labels, "Relion", 80);
+
+		if (fwrite(&header, MRCSIZE, 1, fimg) != 1)
+			REPORT_ERROR((std::string)"ImageStackWriter: error in writing header of " + fn);
+	}
+}
@@ -0,0 +1,129 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_STACK_WRITER_H
+#define IMAGE_STACK_WRITER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "src/image.h"
+
+namespace relion
+{
+	/** Asynchronous writer for MRC stacks (.mrcs), maps (.mrc) and compressed stacks (.lcs)
+	 *
+	 * Writing a stack image by image with Image::write(..., WRITE_APPEND) re-reads and re-writes
+	 * the header and does a synchronous fwrite for every image. This writer converts each image to float
+	 * in the calling thread, queues it, and writes the queue contiguously to disc on a background thread.
+	 * The header (with the final number of images and the statistics of all data) is only written at close().
+	 * The calling thread only waits if more than max_queued images are waiting to be written.
+	 * Images of a compressed stack are compressed on the writer thread as well (see setQuantisationStep).
+	 *
+	 * @code
+	 * ImageStackWriter writer("particles.mrcs", 128, 128);
+	 * for (long int ipart = 0; ipart < nr_particles; ipart++)
+	 * {
+	 *     extractParticle(ipart, img);
+	 *     writer.write(img);  // returns as soon as img has been copied
+	 * }
+	 * writer.close();
+	 * @endcode
+	 */
+	class ImageStackWriter
+	{
+	public:
+		ImageStackWriter();
+
+		// Open fn_stack directly
+		ImageStackWriter(const FileName &fn_stack, long int xdim, long int ydim, long int zdim = 1, int max_queued = 16);
+
+		// Closes the file, if still open (errors are only printed, call close() to get them reported)
+		~ImageStackWriter();
+
+		/** Create (or overwrite) an MRC file for images of xdim x ydim x zdim pixels
+		 * Stacks should have zdim = 1; a 3D map (zdim > 1) is a single image.
+		 * Files with the extension .lcs are written as compressed stacks.
+		 * At most max_queued images are buffered in memory.
+		 */
+		void open(const FileName &fn_stack, long int xdim, long int ydim, long int zdim = 1, int max_queued = 16);
+
+		/** Quantise the images of a compressed stack to within step / 2 (in the units of the images)
+		 * The default, 0, compresses them without any loss. Only applies to images written after this call.
+		 */
+		void setQuantisationStep(DOUBLE step);
+
+		/** Queue img (all its NSIZE images) for writing at the end of the file
+		 * img should be xdim x ydim x zdim; it may be re-used as soon as this returns.
+		 */
+		void write(const MultidimArray<DOUBLE> &img);
+
+		/** Write all queued images and the final header, and close the file
+		 */
+		void close();
+
+		bool isOpen() const
+		{
+			return fimg != NULL;
+		}
+
+		// Number of images written (or queued) so far
+		long int getStackSize() const
+		{
+			return nr_images;
+		}
+
+	private:
+		FileName fn;
+		FILE* fimg;
+		long int xdim, ydim, zdim, nr_images;
+		int max_queued;
+
+		// For compressed stacks
+		bool is_compressed;
+		CompressedStackFile compressed;
+		DOUBLE quantisation_step;
+
+		// Statistics of all data written, for the header
+		double sum, sum2, minval, maxval;
+
+		// Float pages waiting to be written, and written ones to be re-used
+		std::deque< std::vector<float>* > pending;
+		std::vector< std::vector<float>* > spare;
+		std::mutex queue_mutex;
+		std::condition_variable queue_changed;
+		bool is_closing, write_error;
+		std::thread* writer_thread;
+
+		// Body of the writer thread
+		static void writerThread(ImageStackWriter* writer);
+
+		// Write the MRC header for the current number of images at the start of the file
+		void writeHeader();
+
+		// Not copyable
+		ImageStackWriter(const ImageStackWriter&);
+		ImageStackWriter& operator=(const ImageStackWriter&);
+	};
+}
+
+#endif
@@ -0,0 +1,121 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <algorithm>
+#include "src/insertion_buffer.h"
+
+namespace relion
+{
+	InsertionBuffer::InsertionBuffer(BackProjector &_backprojector, int _max_images, int _nr_threads, int healpix_order) :
+		backprojector(_backprojector), healpix(healpix_order, NEST)
+	{
+		if (_max_images < 1)
+			REPORT_ERROR("InsertionBuffer: max_images should be at least 1");
+		max_images = _max_images;
+		nr_threads = _nr_threads;
+		nr_images = 0;
+		has_weights = false;
+	}
+
+	void InsertionBuffer::add(const MultidimArray<Complex > &img_in, const Matrix2D<DOUBLE> &An, bool inv,
+		const MultidimArray<DOUBLE> *Mweight)
+	{
+		if (img_in.getDim() != 2)
+			REPORT_ERROR("InsertionBuffer::add: only 2D images can be inserted");
+		if (nr_images == max_images)
+			flush();
+
+		if (nr_images == 0)
+		{
+			// (Re-)allocate only if the size of the images changes
+			if (NSIZE(images) != max_images || YSIZE(images) != YSIZE(img_in) || XSIZE(images) != XSIZE(img_in))
+				images.resize(max_images, 1, YSIZE(img_in), XSIZE(img_in));
+			has_weights = (Mweight != NULL);
+			if (has_weights && !weights.sameShape(images))
+				weights.resize(max_images, 1, YSIZE(img_in), XSIZE(img_in));
+			A.resize(9 * max_images);
+		}
+		else if (YSIZE(img_in) != YSIZE(images) || XSIZE(img_in) != XSIZE(images))
+			REPORT_ERROR("InsertionBuffer::add: all images should have the same size");
+		else if (has_weights != (Mweight != NULL))
+			REPORT_ERROR("InsertionBuffer::add: either all or none of the images should have a weight");
+		if (Mweight != NULL && !Mweight->sameShape(img_in))
+			REPORT_ERROR("InsertionBuffer::add: Mweight should have the same size as img_in");
+
+		memcpy(&DIRECT_NZYX_ELEM(images, nr_images, 0, 0, 0), MULTIDIM_ARRAY(img_in), YXSIZE(img_in) * sizeof(Complex));
+		if (has_weights)
+			memcpy(&DIRECT_NZYX_ELEM(weights, nr_images, 0, 0, 0), MULTIDIM_ARRAY(*Mweight), YXSIZE(img_in) * sizeof(DOUBLE));
+
+		// Keep the matrix for inv = false: the inverse of a rotation is its transpose
+		DOUBLE *Ai = &A[9 * nr_images];
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 3; c++)
+				Ai[3 * r + c] = inv ? MAT_ELEM(An, c, r) : MAT_ELEM(An, r, c);
+		nr_images++;
+	}
+
+	int InsertionBuffer::getOrientationKey(const DOUBLE *An) const
+	{
+		// The slice is spanned by the first two rows of A, so its normal is the third row
+		double x = An[6], y = An[7], z = An[8];
+		double norm = sqrt(x * x + y * y + z * z);
+		if (norm == 0.)
+			return 0;
+		if (z < 0.)
+		{
+			x = -x;
+			y = -y;
+			z = -z;
+		}
+		return healpix.ang2pix_z_phi(XMIPP_MIN(1., z / norm), atan2(y, x));
+	}
+
+	void InsertionBuffer::flush()
+	{
+		if (nr_images == 0)
+			return;
+
+		// Stable sort on the key: images in the same pixel keep their order
+		std::vector<std::pair<int, int> > order(nr_images);
+		for (int n = 0; n < nr_images; n++)
+			order[n] = std::make_pair(getOrientationKey(&A[9 * n]), n);
+		std::sort(order.begin(), order.end());
+
+		sorted_images.resize(nr_images, 1, YSIZE(images), XSIZE(images));
+		if (has_weights)
+			sorted_weights.resize(nr_images, 1, YSIZE(images), XSIZE(images));
+		sorted_A.resize(9 * nr_images);
+		long int slice_size = YXSIZE(images);
+		for (int n = 0; n < nr_images; n++)
+		{
+			int m = order[n].second;
+			memcpy(&DIRECT_NZYX_ELEM(sorted_images, n, 0, 0, 0), &DIRECT_NZYX_ELEM(images, m, 0, 0, 0), slice_size * sizeof(Complex));
+			if (has_weights)
+				memcpy(&DIRECT_NZYX_ELEM(sorted_weights, n, 0, 0, 0), &DIRECT_NZYX_ELEM(weights, m, 0, 0, 0), slice_size * sizeof(DOUBLE));
+			memcpy(&sorted_A[9 * n], &A[9 * m], 9 * sizeof(DOUBLE));
+		}
+
+		// Empty the buffer first, so that a failing insertion does not insert the same images twice
+		int nr_sorted = nr_images;
+		nr_images = 0;
+		backprojector.backprojectBatch(sorted_images, &sorted_A[0], nr_sorted, false,
+			(has_weights) ? &sorted_weights : NULL, nr_threads);
+	}
+}
@@ -0,0 +1,93 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef INSERTION_BUFFER_H
+#define INSERTION_BUFFER_H
+
+#include <vector>
+#include "src/backprojector.h"
+#include "src/Healpix_2.15a/healpix_base.h"
+
+namespace relion
+{
+	/** Buffer that inserts images into a 3D BackProjector in the order of their orientations
+	 *
+	 * Particles come in the order of the STAR file, so consecutive slices hit random planes of the 3D map and their
+	 * scattered additions miss the cache. The buffer keeps a copy of up to max_images (image, orientation) pairs, sorts
+	 * them by the direction of their slice on the nested HEALPix index (a space-filling curve over the sphere, on
+	 * which nearby pixels have nearby numbers), and inserts them in one BackProjector::backprojectBatch call. Slices
+	 * with opposite normals lie in the same plane, so the normals are taken on one hemisphere. In-plane rotations
+	 * keep their order of arrival.
+	 *
+	 * The sum of the inserted slices is the same as with backproject() in the order of arrival, up to rounding.
+	 * Call flush() after the last image: the destructor does not insert what is left.
+	 *
+	 * @code
+	 * InsertionBuffer buffer(backprojector, 256, nr_threads);
+	 * for (...)
+	 *     buffer.add(Fimg, A, false, &Fweight);
+	 * buffer.flush();
+	 * @endcode
+	 */
+	class InsertionBuffer
+	{
+	public:
+		/** healpix_order sets the resolution of the sort key (order 6 has pixels of about 1 degree)
+		 * nr_threads is passed on to backprojectBatch.
+		 */
+		InsertionBuffer(BackProjector &backprojector, int max_images = 256, int nr_threads = 1, int healpix_order = 6);
+
+		/** Add a copy of img_in (and of Mweight), to be inserted with A (as in BackProjector::backproject)
+		 * All images should have the same size, and either all or none should have a weight. A full buffer is flushed first.
+		 */
+		void add(const MultidimArray<Complex > &img_in, const Matrix2D<DOUBLE> &A, bool inv,
+			const MultidimArray<DOUBLE> *Mweight = NULL);
+
+		/// Sort and insert all buffered images
+		void flush();
+
+		/// The number of buffered images
+		int size() const
+		{
+			return nr_images;
+		}
+
+	private:
+		BackProjector &backprojector;
+		int max_images, nr_threads, nr_images;
+		Healpix_Base healpix;
+
+		// Buffered images (and weights) in order of arrival, with their row-major matrices (as for inv = false)
+		MultidimArray<Complex > images;
+		MultidimArray<DOUBLE> weights;
+		bool has_weights;
+		std::vector<DOUBLE> A;
+
+		// The images in order of insertion
+		MultidimArray<Complex > sorted_images;
+		MultidimArray<DOUBLE> sorted_weights;
+		std::vector<DOUBLE> sorted_A;
+
+		// HEALPix pixel of the slice normal of matrix An
+		int getOrientationKey(const DOUBLE *An) const;
+	};
+}
+
+#endif
@@ -0,0 +1,179 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/instrumentation.h"
+#include <vector>
+#include <mutex>
+#include <string.h>
+#include <stdio.h>
+
+namespace relion
+{
+	// The data of all threads that ever used a timer or counter: kept after a thread ends, so that its work is still reported
+	static std::vector<InstrumentationThreadData*> all_thread_data;
+	static std::mutex all_thread_data_mutex;
+
+	static const char* timer_names[NR_INSTRUMENTATION_TIMERS] =
+	{
+		"project", "rotate", "compute_fourier_map", "backproject", "reconstruct", "reconstruct_symmetrise",
+		"reconstruct_gridding", "reconstruct_window", "fft", "fft_planning", "image_read"
+	};
+
+	static const char* counter_names[NR_INSTRUMENTATION_COUNTERS] =
+	{
+		"pixels_projected", "pixels_backprojected", "ffts", "fft_plans", "bytes_read"
+	};
+
+	bool instrumentationEnabled()
+	{
+#ifdef RELION_INSTRUMENTATION
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	InstrumentationThreadData& getInstrumentationThreadData()
+	{
+		static thread_local InstrumentationThreadData* data = NULL;
+		if (data == NULL)
+		{
+			data = new InstrumentationThreadData;
+			memset(data, 0, sizeof(InstrumentationThreadData));
+			std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+			all_thread_data.push_back(data);
+		}
+		return *data;
+	}
+
+	void instrumentationReset()
+	{
+		std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+		for (size_t i = 0; i < all_thread_data.size(); i++)
+			memset(all_thread_data[i], 0, sizeof(InstrumentationThreadData));
+	}
+
+	double getInstrumentationSeconds(InstrumentationTimer timer)
+	{
+		std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+		long long sum = 0;
+		for (size_t i = 0; i < all_thread_data.size(); i++)
+			sum += all_thread_data[i]->nanoseconds[timer];
+		return 1e-9 * sum;
+	}
+
+	long long getInstrumentationCalls(InstrumentationTimer timer)
+	{
+		std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+		long long sum = 0;
+		for (size_t i = 0; i < all_thread_data.size(); i++)
+			sum += all_thread_data[i]->calls[timer];
+		return sum;
+	}
+
+	long long getInstrumentationCount(InstrumentationCounter counter)
+	{
+		std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+		long long sum = 0;
+		for (size_t i = 0; i < all_thread_data.size(); i++)
+			sum += all_thread_data[i]->counts[counter];
+		return sum;
+	}
+
+	const char* getInstrumentationName(InstrumentationTimer timer)
+	{
+		return timer_names[timer];
+	}
+
+	const char* getInstrumentationName(InstrumentationCounter counter)
+	{
+		return counter_names[counter];
+	}
+
+	void instrumentationReport(std::ostream &out)
+	{
+		if (!instrumentationEnabled())
+		{
+			out << " Instrumentation: not enabled (build with RELION_INSTRUMENTATION)" << std::endl;
+			return;
+		}
+
+		char line[256];
+		out << " Instrumentation timers (wall-clock seconds, summed over all threads):" << std::endl;
+		for (int t = 0; t < NR_INSTRUMENTATION_TIMERS; t++)
+		{
+			long long calls = getInstrumentationCalls((InstrumentationTimer)t);
+			if (calls == 0)
+				continue;
+			double seconds = getInstrumentationSeconds((InstrumentationTimer)t);
+			snprintf(line, sizeof(line), "  %-24s %12lld calls %12.6f s %12.3f us/call", timer_names[t], calls, seconds, 1e6 * seconds / calls);
+			out << line << std::endl;
+		}
+		out << " Instrumentation counters:" << std::endl;
+		for (int c = 0; c < NR_INSTRUMENTATION_COUNTERS; c++)
+		{
+			long long count = getInstrumentationCount((InstrumentationCounter)c);
+			if (count == 0)
+				continue;
+			snprintf(line, sizeof(line), "  %-24s %16lld", counter_names[c], count);
+			out << line << std::endl;
+		}
+	}
+
+	void instrumentationWriteJSON(std::ostream &out)
+	{
+		std::lock_guard<std::mutex> lock(all_thread_data_mutex);
+		size_t nr_threads = all_thread_data.size();
+		char value[64];
+
+		out << "{\"enabled\": " << (instrumentationEnabled() ? "true" : "false") << ", \"nr_threads\": " << nr_threads << "," << std::endl;
+		out << " \"timers\": {";
+		for (int t = 0; t < NR_INSTRUMENTATION_TIMERS; t++)
+		{
+			long long calls = 0, nanoseconds = 0;
+			for (size_t i = 0; i < nr_threads; i++)
+			{
+				calls += all_thread_data[i]->calls[t];
+				nanoseconds += all_thread_data[i]->nanoseconds[t];
+			}
+			snprintf(value, sizeof(value), "%.9f", 1e-9 * nanoseconds);
+			out << ((t > 0) ? "," : "") << std::endl << "  \"" << timer_names[t] << "\": {\"calls\": " << calls
+				<< ", \"seconds\": " << value << ", \"thread_seconds\": [";
+			for (size_t i = 0; i < nr_threads; i++)
+			{
+				snprintf(value, sizeof(value), "%.9f", 1e-9 * all_thread_data[i]->nanoseconds[t]);
+				out << ((i > 0) ? ", " : "") << value;
+			}
+			out << "]}";
+		}
+		out << std::endl << " }," << std::endl << " \"counters\": {";
+		for (int c = 0; c < NR_INSTRUMENTATION_COUNTERS; c++)
+		{
+			long long total = 0;
+			for (size_t i = 0; i < nr_threads; i++)
+				total += all_thread_data[i]->counts[c];
+			out << ((c > 0) ? "," : "") << std::endl << "  \"" << counter_names[c] << "\": {\"total\": " << total << ", \"thread_counts\": [";
+			for (size_t i = 0; i < nr_threads; i++)
+				out << ((i > 0) ? ", " : "") << all_thread_data[i]->counts[c];
+			out << "]}";
+		}
+		out << std::endl << " }" << std::endl << "}" << std::endl;
+	}
+}
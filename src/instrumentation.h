@@ -0,0 +1,138 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <iostream>
+#include <chrono>
+
+/** Timers and counters of the most expensive liblion functions
+ *
+ * Only compiled in when the library is built with RELION_INSTRUMENTATION defined (the CMake option
+ * LIBLION_INSTRUMENTATION); otherwise INSTRUMENT_TIMER and INSTRUMENT_COUNT compile to nothing and all
+ * timers and counters stay zero. Every thread adds to its own timers and counters, which are only summed
+ * when they are read, so instrumented functions may be called from many threads at once.
+ * Timers measure the wall-clock time spent inside a scope by each calling thread; nested timers overlap.
+ *
+ * @code
+ * instrumentationReset();
+ * for (long int ipart = 0; ipart < nr_particles; ipart++)
+ *     projector.project(Fref, A, false);
+ * instrumentationReport(std::cout);
+ * @endcode
+ */
+namespace relion
+{
+	enum InstrumentationTimer
+	{
+		TIMER_PROJECT = 0,               // Projector::project and projectBatch
+		TIMER_ROTATE,                    // Projector::rotate2D and rotate3D
+		TIMER_COMPUTE_FOURIER_MAP,       // Projector::computeFourierTransformMap
+		TIMER_BACKPROJECT,               // BackProjector::backproject and backprojectBatch
+		TIMER_RECONSTRUCT,               // BackProjector::reconstruct, in total
+		TIMER_RECONSTRUCT_SYMMETRISE,    // BackProjector::symmetrise
+		TIMER_RECONSTRUCT_GRIDDING,      // the iterative weight correction of reconstruct
+		TIMER_RECONSTRUCT_WINDOW,        // BackProjector::windowToOridimRealSpace
+		TIMER_FFT,                       // execution of FFTW plans (FourierTransformer, BatchFourierTransformer)
+		TIMER_FFT_PLANNING,              // making new FFTW plans
+		TIMER_IMAGE_READ,                // Image::read and ImageStackReader::read
+		NR_INSTRUMENTATION_TIMERS
+	};
+
+	enum InstrumentationCounter
+	{
+		COUNT_PIXELS_PROJECTED = 0,      // Fourier components interpolated by project and projectBatch
+		COUNT_PIXELS_BACKPROJECTED,      // Fourier components (with a positive weight) inserted by backproject and backprojectBatch
+		COUNT_FFTS,                      // forward and backward transforms (a batch of n images counts n times)
+		COUNT_FFT_PLANS,                 // FFTW plans made (i.e. not taken from the plan cache)
+		COUNT_BYTES_READ,                // image data read from files
+		NR_INSTRUMENTATION_COUNTERS
+	};
+
+	/// Timers and counters of one thread
+	struct InstrumentationThreadData
+	{
+		long long nanoseconds[NR_INSTRUMENTATION_TIMERS];
+		long long calls[NR_INSTRUMENTATION_TIMERS];
+		long long counts[NR_INSTRUMENTATION_COUNTERS];
+	};
+
+	/// Whether the library was built with RELION_INSTRUMENTATION
+	bool instrumentationEnabled();
+
+	/// The timers and counters of the calling thread (made on the first call in each thread)
+	InstrumentationThreadData& getInstrumentationThreadData();
+
+	/// Set all timers and counters of all threads to zero (do not call while instrumented functions are running)
+	void instrumentationReset();
+
+	/// Sums over all threads
+	double getInstrumentationSeconds(InstrumentationTimer timer);
+	long long getInstrumentationCalls(InstrumentationTimer timer);
+	long long getInstrumentationCount(InstrumentationCounter counter);
+
+	/// e.g. "project" or "pixels_projected"
+	const char* getInstrumentationName(InstrumentationTimer timer);
+	const char* getInstrumentationName(InstrumentationCounter counter);
+
+	/// Table of all timers and counters that were used, summed over all threads
+	void instrumentationReport(std::ostream &out);
+
+	/** All timers and counters as a JSON object: their totals, and the values of each thread
+	 * {"enabled": true, "nr_threads": 2,
+	 *  "timers": {"project": {"calls": 10, "seconds": 0.25, "thread_seconds": [0.125, 0.125]}, ...},
+	 *  "counters": {"pixels_projected": {"total": 81920, "thread_counts": [40960, 40960]}, ...}}
+	 */
+	void instrumentationWriteJSON(std::ostream &out);
+
+	/// Adds the time between its construction and destruction to timer (see INSTRUMENT_TIMER)
+	class InstrumentationScopedTimer
+	{
+	public:
+		InstrumentationScopedTimer(InstrumentationTimer _timer) : timer(_timer), start(std::chrono::steady_clock::now()) {}
+
+		~InstrumentationScopedTimer()
+		{
+			InstrumentationThreadData &data = getInstrumentationThreadData();
+			data.nanoseconds[timer] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			data.calls[timer]++;
+		}
+
+	private:
+		InstrumentationTimer timer;
+		std::chrono::steady_clock::time_point start;
+	};
+}
+
+#define INSTRUMENT_CONCAT_(a, b) a##b
+#define INSTRUMENT_CONCAT(a, b) INSTRUMENT_CONCAT_(a, b)
+
+#ifdef RELION_INSTRUMENTATION
+// Time the rest of the enclosing scope
+#define INSTRUMENT_TIMER(timer) relion::InstrumentationScopedTimer INSTRUMENT_CONCAT(instrument_timer_, __LINE__)(relion::timer)
+// Add n to counter
+#define INSTRUMENT_COUNT(counter, n) (relion::getInstrumentationThreadData().counts[relion::counter] += (n))
+#else
+#define INSTRUMENT_TIMER(timer)
+#define INSTRUMENT_COUNT(counter, n) ((void)0)
+#endif
+
+#endif
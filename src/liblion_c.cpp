@@ -0,0 +1,403 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <new>
+#include <exception>
+#include <string>
+#include <string.h>
+#include "src/liblion_c.h"
+#include "src/projector.h"
+#include "src/backprojector.h"
+#include "src/fftw.h"
+
+using namespace relion;
+
+static_assert(sizeof(lion_real) == sizeof(DOUBLE), "lion_real should be the DOUBLE of liblion");
+static_assert(sizeof(Complex) == 2 * sizeof(DOUBLE), "Complex should be a pair of DOUBLE");
+
+struct lion_projector
+{
+	Projector projector;
+	lion_projector(int ori_size, int interpolator, int padding_factor, int r_min_nn)
+		: projector(ori_size, interpolator, padding_factor, r_min_nn) {}
+};
+
+struct lion_backprojector
+{
+	BackProjector backprojector;
+	lion_backprojector(int ori_size, const char *symmetry, int interpolator, int padding_factor)
+		: backprojector(ori_size, 3, symmetry, interpolator, padding_factor) {}
+};
+
+static std::string& lastError()
+{
+	static thread_local std::string msg;
+	return msg;
+}
+
+static int setError(const std::string &msg)
+{
+	lastError() = msg;
+	return -1;
+}
+
+static void checkArray(const void *ptr, const char *name)
+{
+	if (ptr == NULL)
+		REPORT_ERROR((std::string)"liblion_c: " + name + " should not be NULL");
+}
+
+const char* lion_last_error(void)
+{
+	return lastError().c_str();
+}
+
+int lion_real_size(void)
+{
+	return sizeof(DOUBLE);
+}
+
+lion_projector* lion_projector_create(int ori_size, int interpolator, int padding_factor, int r_min_nn)
+{
+	try
+	{
+		if (ori_size <= 0 || padding_factor <= 0 || (interpolator != NEAREST_NEIGHBOUR && interpolator != TRILINEAR))
+			REPORT_ERROR("lion_projector_create: invalid size, padding factor or interpolator");
+		return new lion_projector(ori_size, interpolator, padding_factor, r_min_nn);
+	}
+	catch (RelionError &e)
+	{
+		setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		setError("lion_projector_create: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		setError((std::string)"lion_projector_create: " + e.what());
+	}
+	catch (...)
+	{
+		setError("lion_projector_create: unknown error");
+	}
+	return NULL;
+}
+
+void lion_projector_destroy(lion_projector *projector)
+{
+	delete projector;
+}
+
+int lion_projector_set_volume(lion_projector *projector, lion_real *vol, int box, int current_size, int nr_threads)
+{
+	try
+	{
+		checkArray(projector, "projector");
+		checkArray(vol, "vol");
+		MultidimArray<DOUBLE> Mvol, power_spectrum;
+		Mvol.borrow(vol, 1, box, box, box);
+		projector->projector.computeFourierTransformMap(Mvol, power_spectrum, (current_size < 0) ? box : current_size, nr_threads);
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_projector_set_volume: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_projector_set_volume: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_projector_set_volume: unknown error");
+	}
+	return 0;
+}
+
+int lion_projector_project(lion_projector *projector, const lion_real *A, int nr_A,
+	lion_real *slices, int ydim, int xdim, int nr_threads)
+{
+	try
+	{
+		checkArray(projector, "projector");
+		checkArray(A, "A");
+		checkArray(slices, "slices");
+		MultidimArray<Complex > Fslices;
+		Fslices.borrow((Complex*)slices, nr_A, 1, ydim, xdim);
+		// projectBatch only sets the pixels inside r_max
+		memset(slices, 0, NZYXSIZE(Fslices) * sizeof(Complex));
+		projector->projector.projectBatch(Fslices, A, nr_A, false, nr_threads);
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_projector_project: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_projector_project: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_projector_project: unknown error");
+	}
+	return 0;
+}
+
+lion_backprojector* lion_backprojector_create(int ori_size, const char *symmetry, int interpolator, int padding_factor)
+{
+	try
+	{
+		if (ori_size <= 0 || padding_factor <= 0 || (interpolator != NEAREST_NEIGHBOUR && interpolator != TRILINEAR))
+			REPORT_ERROR("lion_backprojector_create: invalid size, padding factor or interpolator");
+		return new lion_backprojector(ori_size, (symmetry != NULL) ? symmetry : "C1", interpolator, padding_factor);
+	}
+	catch (RelionError &e)
+	{
+		setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		setError("lion_backprojector_create: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		setError((std::string)"lion_backprojector_create: " + e.what());
+	}
+	catch (...)
+	{
+		setError("lion_backprojector_create: unknown error");
+	}
+	return NULL;
+}
+
+void lion_backprojector_destroy(lion_backprojector *backprojector)
+{
+	delete backprojector;
+}
+
+int lion_backprojector_init_zeros(lion_backprojector *backprojector, int current_size)
+{
+	try
+	{
+		checkArray(backprojector, "backprojector");
+		backprojector->backprojector.initZeros(current_size);
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_backprojector_init_zeros: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_backprojector_init_zeros: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_backprojector_init_zeros: unknown error");
+	}
+	return 0;
+}
+
+int lion_backprojector_backproject(lion_backprojector *backprojector, const lion_real *slices,
+	const lion_real *weights, const lion_real *A, int nr_A, int ydim, int xdim, int nr_threads)
+{
+	try
+	{
+		checkArray(backprojector, "backprojector");
+		checkArray(slices, "slices");
+		checkArray(A, "A");
+		// Only read by backprojectBatch
+		MultidimArray<Complex > Fslices;
+		MultidimArray<DOUBLE> Mweights;
+		Fslices.borrow((Complex*)slices, nr_A, 1, ydim, xdim);
+		if (weights != NULL)
+			Mweights.borrow((DOUBLE*)weights, nr_A, 1, ydim, xdim);
+		backprojector->backprojector.backprojectBatch(Fslices, A, nr_A, false, (weights != NULL) ? &Mweights : NULL, nr_threads);
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_backprojector_backproject: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_backprojector_backproject: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_backprojector_backproject: unknown error");
+	}
+	return 0;
+}
+
+int lion_backprojector_get_data(lion_backprojector *backprojector, lion_real **data, lion_real **weight,
+	long int *zdim, long int *ydim, long int *xdim)
+{
+	try
+	{
+		checkArray(backprojector, "backprojector");
+		BackProjector &bp = backprojector->backprojector;
+		bp.expandToDense();
+		bp.foldCompensation();
+		if (data != NULL)
+			*data = (lion_real*)MULTIDIM_ARRAY(bp.data);
+		if (weight != NULL)
+			*weight = MULTIDIM_ARRAY(bp.weight);
+		if (zdim != NULL)
+			*zdim = ZSIZE(bp.data);
+		if (ydim != NULL)
+			*ydim = YSIZE(bp.data);
+		if (xdim != NULL)
+			*xdim = XSIZE(bp.data);
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_backprojector_get_data: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_backprojector_get_data: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_backprojector_get_data: unknown error");
+	}
+	return 0;
+}
+
+int lion_backprojector_reconstruct(lion_backprojector *backprojector, lion_real *vol_out,
+	int max_iter_preweight, int nr_threads)
+{
+	try
+	{
+		checkArray(backprojector, "backprojector");
+		checkArray(vol_out, "vol_out");
+		BackProjector &bp = backprojector->backprojector;
+		MultidimArray<DOUBLE> vol, tau2, sigma2, evidence_vs_prior, fsc;
+		// reconstruct() re-allocates its output at the padded size on the way, so the result is copied at the end
+		bp.reconstruct(vol, max_iter_preweight, false, 1., tau2, sigma2, evidence_vs_prior, fsc, 1., false, false, nr_threads);
+		if (NZYXSIZE(vol) != (long int)bp.ori_size * bp.ori_size * bp.ori_size)
+			REPORT_ERROR("lion_backprojector_reconstruct: the reconstruction is not of ori_size^3 voxels");
+		memcpy(vol_out, MULTIDIM_ARRAY(vol), NZYXSIZE(vol) * sizeof(DOUBLE));
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_backprojector_reconstruct: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_backprojector_reconstruct: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_backprojector_reconstruct: unknown error");
+	}
+	return 0;
+}
+
+int lion_fourier_transform(const lion_real *real, int zdim, int ydim, int xdim, lion_real *fourier, int nr_threads)
+{
+	try
+	{
+		checkArray(real, "real");
+		checkArray(fourier, "fourier");
+		// FFTW's real-to-complex transforms do not change their input
+		MultidimArray<DOUBLE> Mreal;
+		Mreal.borrow((DOUBLE*)real, 1, zdim, ydim, xdim);
+		FourierTransformer transformer;
+		transformer.setThreadsNumber(nr_threads);
+		// The transform goes straight into fourier, which has the shape setReal asks for
+		transformer.fFourier.borrow((Complex*)fourier, 1, zdim, ydim, xdim / 2 + 1);
+		transformer.setReal(Mreal);
+		transformer.FourierTransform();
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_fourier_transform: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_fourier_transform: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_fourier_transform: unknown error");
+	}
+	return 0;
+}
+
+int lion_inverse_fourier_transform(lion_real *fourier, int zdim, int ydim, int xdim, lion_real *real, int nr_threads)
+{
+	try
+	{
+		checkArray(fourier, "fourier");
+		checkArray(real, "real");
+		MultidimArray<DOUBLE> Mreal;
+		Mreal.borrow(real, 1, zdim, ydim, xdim);
+		FourierTransformer transformer;
+		transformer.setThreadsNumber(nr_threads);
+		transformer.fFourier.borrow((Complex*)fourier, 1, zdim, ydim, xdim / 2 + 1);
+		transformer.setReal(Mreal);
+		transformer.inverseFourierTransform();
+	}
+	catch (RelionError &e)
+	{
+		return setError(e.msg);
+	}
+	catch (std::bad_alloc &)
+	{
+		return setError("lion_inverse_fourier_transform: out of memory");
+	}
+	catch (std::exception &e)
+	{
+		return setError((std::string)"lion_inverse_fourier_transform: " + e.what());
+	}
+	catch (...)
+	{
+		return setError("lion_inverse_fourier_transform: unknown error");
+	}
+	return 0;
+}
@@ -0,0 +1,117 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef LIBLION_C_H
+#define LIBLION_C_H
+
+/*
+ * C interface to the Projector, BackProjector and FourierTransformer (built as the shared library lion_c)
+ *
+ * All arrays are passed as pointers to the caller's memory, which the library reads and writes in place: nothing is
+ * copied on the way in or out (except the result of lion_backprojector_reconstruct, which is written once into vol_out).
+ * The memory is only used during the call, unless stated otherwise.
+ *
+ * Arrays are C-contiguous (row-major, x fastest), as NumPy arrays in the default order. Real values are lion_real,
+ * complex values are pairs of lion_real (real, imaginary): numpy.float32 and numpy.complex64. Fourier transforms have
+ * the FFTW layout of liblion: ydim x (xdim / 2 + 1) (or zdim x ydim x (xdim / 2 + 1)) values, the origin at [0].
+ * Rotation matrices are row-major 3x3 arrays of lion_real, nr_A of them one after the other.
+ * Arrays should be aligned to at least sizeof(lion_real); 64-byte alignment gives the fastest SIMD code.
+ *
+ * All functions returning int return 0 on success, and -1 on an error, whose message is given by lion_last_error.
+ * Handles can be used from one thread at a time; nr_threads is the number of OpenMP threads used inside a call.
+ *
+ * From Python:
+ *   lib = ctypes.CDLL("liblion_c.so")
+ *   vol = numpy.ascontiguousarray(vol, dtype=numpy.float32)
+ *   projector = lib.lion_projector_create(box, 1, 2, 10)
+ *   lib.lion_projector_set_volume(projector, vol.ctypes.data, box, -1, nr_threads)
+ */
+
+/* Real values of liblion, which is built in single precision (FLOAT_PRECISION) */
+typedef float lion_real;
+
+#if defined(_WIN32) && defined(LIBLION_C_EXPORTS)
+#define LIBLION_C_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define LIBLION_C_API __declspec(dllimport)
+#else
+#define LIBLION_C_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lion_projector lion_projector;
+typedef struct lion_backprojector lion_backprojector;
+
+/* The message of the last error in this thread ("" if there was none) */
+LIBLION_C_API const char* lion_last_error(void);
+
+/* sizeof(lion_real) of the library, to check the interface against */
+LIBLION_C_API int lion_real_size(void);
+
+/* Projection of 3D maps. interpolator is 0 for nearest neighbour, 1 for trilinear (as in projector.h).
+ * Returns NULL on an error. */
+LIBLION_C_API lion_projector* lion_projector_create(int ori_size, int interpolator, int padding_factor, int r_min_nn);
+LIBLION_C_API void lion_projector_destroy(lion_projector *projector);
+
+/* Calculate the Fourier-space map of the box^3 volume vol, up to current_size (-1 for box).
+ * vol is gridding-corrected in place (as by Projector::computeFourierTransformMap). */
+LIBLION_C_API int lion_projector_set_volume(lion_projector *projector, lion_real *vol, int box, int current_size, int nr_threads);
+
+/* Project the map in nr_A orientations A into slices: nr_A Fourier transforms of ydim x xdim complex values
+ * (xdim = ydim / 2 + 1), which are overwritten */
+LIBLION_C_API int lion_projector_project(lion_projector *projector, const lion_real *A, int nr_A,
+	lion_real *slices, int ydim, int xdim, int nr_threads);
+
+/* Backprojection into 3D maps, with symmetry group symmetry (e.g. "C1"). interpolator is as for lion_projector_create.
+ * Returns NULL on an error. */
+LIBLION_C_API lion_backprojector* lion_backprojector_create(int ori_size, const char *symmetry, int interpolator, int padding_factor);
+LIBLION_C_API void lion_backprojector_destroy(lion_backprojector *backprojector);
+
+/* Zero the data and weight arrays, for slices up to current_size (-1 for ori_size) */
+LIBLION_C_API int lion_backprojector_init_zeros(lion_backprojector *backprojector, int current_size);
+
+/* Insert nr_A slices (as for lion_projector_project) with orientations A, and if weights is not NULL with the
+ * (nr_A x ydim x xdim real) weights */
+LIBLION_C_API int lion_backprojector_backproject(lion_backprojector *backprojector, const lion_real *slices,
+	const lion_real *weights, const lion_real *A, int nr_A, int ydim, int xdim, int nr_threads);
+
+/* The accumulated data (complex) and weight (real) arrays of zdim x ydim x xdim values, for example to sum them over
+ * processes. The pointers stay valid until the next call with this backprojector. */
+LIBLION_C_API int lion_backprojector_get_data(lion_backprojector *backprojector, lion_real **data, lion_real **weight,
+	long int *zdim, long int *ydim, long int *xdim);
+
+/* Reconstruct the ori_size^3 map vol_out from the data and weight (without a prior, see BackProjector::reconstruct) */
+LIBLION_C_API int lion_backprojector_reconstruct(lion_backprojector *backprojector, lion_real *vol_out,
+	int max_iter_preweight, int nr_threads);
+
+/* Fourier transform of the real zdim x ydim x xdim array real (zdim = 1 for 2D) into the complex array fourier */
+LIBLION_C_API int lion_fourier_transform(const lion_real *real, int zdim, int ydim, int xdim, lion_real *fourier, int nr_threads);
+
+/* Inverse of lion_fourier_transform. fourier is overwritten (as by FFTW's complex-to-real transforms). */
+LIBLION_C_API int lion_inverse_fourier_transform(lion_real *fourier, int zdim, int ydim, int xdim, lion_real *real, int nr_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
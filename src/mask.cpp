@@ -22,10 +22,20 @@
 
 namespace relion
 {
+	// Largest squared distance of any element of vol to (x, y, z) (in logical coordinates)
+	static long int maxSquaredRadius(const MultidimArray<DOUBLE> &vol, long int x = 0, long int y = 0, long int z = 0)
+	{
+		long int dx = XMIPP_MAX(ABS(STARTINGX(vol) - x), ABS(FINISHINGX(vol) - x));
+		long int dy = XMIPP_MAX(ABS(STARTINGY(vol) - y), ABS(FINISHINGY(vol) - y));
+		long int dz = XMIPP_MAX(ABS(STARTINGZ(vol) - z), ABS(FINISHINGZ(vol) - z));
+		return dx * dx + dy * dy + dz * dz;
+	}
+
 	// Mask out corners outside sphere (replace by average value)
 	// Apply a soft mask (raised cosine with cosine_width pixels width)
-	void softMaskOutsideMap(MultidimArray<DOUBLE> &vol, DOUBLE radius, DOUBLE cosine_width, MultidimArray<DOUBLE> *Mnoise)
+	void softMaskOutsideMap(MultidimArray<DOUBLE> &vol, DOUBLE radius, DOUBLE cosine_width, MultidimArray<DOUBLE> *Mnoise, int nr_threads)
 	{
+		nr_threads = getTaskNrThreads(nr_threads);
 
 		vol.setXmippOrigin();
 		DOUBLE r, radius_p, raisedcos, sum_bg = 0., sum = 0.;
@@ -33,49 +43,58 @@ namespace relion
 			radius = (DOUBLE)XSIZE(vol) / 2.;
 		radius_p = radius + cosine_width;
 
+		// The weight of the background at each (integer) squared radius r2 = k*k + i*i + j*j:
+		// 0 inside radius, 1 outside radius_p and a raised cosine in between
+		long int max_r2 = maxSquaredRadius(vol);
+		std::vector<DOUBLE> weight(max_r2 + 1);
+		for (long int r2 = 0; r2 <= max_r2; r2++)
+		{
+			r = sqrt((DOUBLE)r2);
+			if (r < radius)
+				weight[r2] = 0.;
+			else if (r > radius_p)
+				weight[r2] = 1.;
+			else
+				weight[r2] = 0.5 + 0.5 * cos(PI * (radius_p - r) / cosine_width);
+		}
 
+		// Along a row, r2 grows by 2 * j + 1 from j to j + 1
 		if (Mnoise == NULL)
 		{
 			// Calculate average background value
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(vol)
-			{
-				r = sqrt((DOUBLE)(k*k + i*i + j*j));
-				if (r < radius)
-					continue;
-				else if (r > radius_p)
-				{
-					sum += 1.;
-					sum_bg += A3D_ELEM(vol, k, i, j);
-				}
-				else
+#pragma omp parallel for num_threads(nr_threads) reduction(+:sum, sum_bg)
+			for (long int k = STARTINGZ(vol); k <= FINISHINGZ(vol); k++)
+				for (long int i = STARTINGY(vol); i <= FINISHINGY(vol); i++)
 				{
-					raisedcos = 0.5 + 0.5 * cos(PI * (radius_p - r) / cosine_width);
-					sum += raisedcos;
-					sum_bg += raisedcos * A3D_ELEM(vol, k, i, j);
+					long int r2 = k * k + i * i + STARTINGX(vol) * STARTINGX(vol);
+					const DOUBLE *row = &A3D_ELEM(vol, k, i, STARTINGX(vol));
+					for (long int j = STARTINGX(vol); j <= FINISHINGX(vol); r2 += 2 * j + 1, j++)
+					{
+						DOUBLE w = weight[r2];
+						sum += w;
+						sum_bg += w * row[j - STARTINGX(vol)];
+					}
 				}
-			}
 			sum_bg /= sum;
 		}
 
 		// Apply noisy or average background value
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(vol)
-		{
-			r = sqrt((DOUBLE)(k*k + i*i + j*j));
-			if (r < radius)
-			{
-				continue;
-			}
-			else if (r > radius_p)
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = STARTINGZ(vol); k <= FINISHINGZ(vol); k++)
+			for (long int i = STARTINGY(vol); i <= FINISHINGY(vol); i++)
 			{
-				A3D_ELEM(vol, k, i, j) = (Mnoise == NULL) ? sum_bg : A3D_ELEM(*Mnoise, k, i, j);
-			}
-			else
-			{
-				raisedcos = 0.5 + 0.5 * cos(PI * (radius_p - r) / cosine_width);
-				DOUBLE add = (Mnoise == NULL) ? sum_bg : A3D_ELEM(*Mnoise, k, i, j);
-				A3D_ELEM(vol, k, i, j) = (1 - raisedcos) * A3D_ELEM(vol, k, i, j) + raisedcos * add;
+				long int r2 = k * k + i * i + STARTINGX(vol) * STARTINGX(vol);
+				DOUBLE *row = &A3D_ELEM(vol, k, i, STARTINGX(vol));
+				const DOUBLE *noise = (Mnoise == NULL) ? NULL : &A3D_ELEM(*Mnoise, k, i, STARTINGX(vol));
+				for (long int j = STARTINGX(vol); j <= FINISHINGX(vol); r2 += 2 * j + 1, j++)
+				{
+					DOUBLE w = weight[r2];
+					if (w == 0.)
+						continue;
+					DOUBLE add = (noise == NULL) ? sum_bg : noise[j - STARTINGX(vol)];
+					row[j - STARTINGX(vol)] = (w == 1.) ? add : (1 - w) * row[j - STARTINGX(vol)] + w * add;
+				}
 			}
-		}
 
 	}
 
@@ -102,20 +121,104 @@ namespace relion
 		}
 		sum_bg /= sum;
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(msk)
+		// vol = (1 - solv) * vol + solv * sum_bg, in a single pass over vol and msk
+		if (invert_mask)
+			vol = (1. - msk) * vol + msk * sum_bg;
+		else
+			vol = msk * vol + (1. - msk) * sum_bg;
+
+	}
+
+	// Squared distances larger than any inside a map
+#define EDT_INF 1e30
+
+	// Lower envelope of the parabolas (x - p)^2 + f[p] in one line of n values (Felzenszwalb & Huttenlocher, 2012)
+	// Entries of f that are >= EDT_INF do not contribute; d receives the minimum over p for each x
+	static void distanceTransformLine(const DOUBLE *f, DOUBLE *d, int n, int *v, double *z)
+	{
+		int k = -1;
+		for (int q = 0; q < n; q++)
 		{
-			solv = (invert_mask) ? DIRECT_A3D_ELEM(msk, k, i, j) : 1. - DIRECT_A3D_ELEM(msk, k, i, j);
-			DIRECT_A3D_ELEM(vol, k, i, j) = (1. - solv) * DIRECT_A3D_ELEM(vol, k, i, j) + solv * sum_bg;
+			if (f[q] >= EDT_INF)
+				continue;
+			double s = -EDT_INF;
+			while (k >= 0)
+			{
+				s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2. * (q - v[k]));
+				if (s > z[k])
+					break;
+				k--;
+			}
+			k++;
+			v[k] = q;
+			z[k] = (k == 0) ? -EDT_INF : s;
 		}
 
+		if (k < 0)
+		{
+			for (int q = 0; q < n; q++)
+				d[q] = EDT_INF;
+			return;
+		}
 
+		int j = 0;
+		for (int q = 0; q < n; q++)
+		{
+			while (j < k && z[j + 1] < q)
+				j++;
+			d[q] = (DOUBLE)(q - v[j]) * (q - v[j]) + f[v[j]];
+		}
+	}
+
+	void squaredDistanceTransform(const MultidimArray<DOUBLE> &msk, bool to_ones, MultidimArray<DOUBLE> &dist2, int nr_threads)
+	{
+		nr_threads = getTaskNrThreads(nr_threads);
+		dist2.resize(msk);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(msk)
+		{
+			bool is_feature = (to_ones) ? DIRECT_MULTIDIM_ELEM(msk, n) > 0.999 : DIRECT_MULTIDIM_ELEM(msk, n) < 0.001;
+			DIRECT_MULTIDIM_ELEM(dist2, n) = (is_feature) ? 0. : EDT_INF;
+		}
+
+		// One pass of 1D transforms along each axis; the lines of each pass are independent
+		long int dims[3] = { XSIZE(dist2), YSIZE(dist2), ZSIZE(dist2) };
+		long int strides[3] = { 1, XSIZE(dist2), YXSIZE(dist2) };
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int n = dims[axis];
+			long int stride = strides[axis];
+			if (n < 2)
+				continue;
+			long int nr_lines = NZYXSIZE(dist2) / n;
+
+#pragma omp parallel num_threads(nr_threads)
+			{
+				std::vector<DOUBLE> f(n), d(n);
+				std::vector<int> v(n);
+				std::vector<double> z(n);
+#pragma omp for
+				for (long int line = 0; line < nr_lines; line++)
+				{
+					// First element of this line: lines run over all indices of the other two axes
+					long int start = (axis == 0) ? line * n :
+						(axis == 1) ? (line / XSIZE(dist2)) * YXSIZE(dist2) + line % XSIZE(dist2) : line;
+					DOUBLE *ptr = MULTIDIM_ARRAY(dist2) + start;
+					for (int q = 0; q < n; q++)
+						f[q] = ptr[q * stride];
+					distanceTransformLine(&f[0], &d[0], n, &v[0], &z[0]);
+					for (int q = 0; q < n; q++)
+						ptr[q * stride] = d[q];
+				}
+			}
+		}
 	}
 
 	void autoMask(MultidimArray<DOUBLE> &img_in, MultidimArray<DOUBLE> &msk_out,
-		DOUBLE ini_mask_density_threshold, DOUBLE extend_ini_mask, DOUBLE width_soft_mask_edge, bool verb)
+		DOUBLE ini_mask_density_threshold, DOUBLE extend_ini_mask, DOUBLE width_soft_mask_edge, bool verb, int nr_threads)
 
 	{
-		MultidimArray<DOUBLE> msk_cp;
+		nr_threads = getTaskNrThreads(nr_threads);
+		MultidimArray<DOUBLE> dist2;
 
 		// Resize output mask
 		img_in.setXmippOrigin();
@@ -123,6 +226,8 @@ namespace relion
 		msk_out.resize(img_in);
 
 		// A. Calculate initial binary mask based on density threshold
+		if (verb)
+			std::cout << "== Calculating initial binary mask at density threshold " << ini_mask_density_threshold << " ..." << std::endl;
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img_in)
 		{
 			if (DIRECT_MULTIDIM_ELEM(img_in, n) >= ini_mask_density_threshold)
@@ -131,151 +236,72 @@ namespace relion
 				DIRECT_MULTIDIM_ELEM(msk_out, n) = 0.;
 		}
 
-		// B. extend/shrink initial binary mask. To save memory store a temporary copy of Im in I1
+		// B. extend/shrink initial binary mask
+		// A zero voxel becomes one if a one voxel lies within extend_ini_mask (or vice versa for shrinking)
 		if (extend_ini_mask > 0. || extend_ini_mask < 0.)
 		{
-			int extend_size = ABS(CEIL(extend_ini_mask));
 			DOUBLE extend_ini_mask2 = extend_ini_mask * extend_ini_mask;
-			msk_cp = msk_out;
-			if (extend_ini_mask > 0.)
-			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(msk_cp)
-				{
-					// only extend zero values to 1.
-					if (A3D_ELEM(msk_cp, k, i, j) < 0.001)
-					{
-						bool already_done = false;
-						for (long int kp = k - extend_size; kp <= k + extend_size; kp++)
-						{
-							for (long int ip = i - extend_size; ip <= i + extend_size; ip++)
-							{
-								for (long int jp = j - extend_size; jp <= j + extend_size; jp++)
-								{
-									if ((kp >= STARTINGZ(msk_cp) && kp <= FINISHINGZ(msk_cp)) &&
-										(ip >= STARTINGY(msk_cp) && ip <= FINISHINGY(msk_cp)) &&
-										(jp >= STARTINGX(msk_cp) && jp <= FINISHINGX(msk_cp)))
-									{
-										// only check distance if neighbouring Im() is one
-										if (A3D_ELEM(msk_cp, kp, ip, jp) > 0.999)
-										{
-											DOUBLE r2 = (DOUBLE)((kp - k)*(kp - k) + (ip - i)*(ip - i) + (jp - j)*(jp - j));
-											// Set original voxel to 1 if a neghouring with Im()=1 is within distance extend_ini_mask
-											if (r2 < extend_ini_mask2)
-											{
-												A3D_ELEM(msk_out, k, i, j) = 1.;
-												already_done = true;
-											}
-										}
-									}
-									if (already_done) break;
-								}
-								if (already_done) break;
-							}
-							if (already_done) break;
-						}
-					}
-				}
-			}
-			else
+			bool do_extend = (extend_ini_mask > 0.);
+			if (verb)
+				std::cout << "== " << ((do_extend) ? "Extending" : "Shrinking") << " initial binary mask by "
+					<< ABS(extend_ini_mask) << " pixels ..." << std::endl;
+			squaredDistanceTransform(msk_out, do_extend, dist2, nr_threads);
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int n = 0; n < NZYXSIZE(msk_out); n++)
 			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(msk_cp)
-				{
-					// only extend one values to zero.
-					if (A3D_ELEM(msk_cp, k, i, j) > 0.999)
-					{
-						bool already_done = false;
-						for (long int kp = k - extend_size; kp <= k + extend_size; kp++)
-						{
-							for (long int ip = i - extend_size; ip <= i + extend_size; ip++)
-							{
-								for (long int jp = j - extend_size; jp <= j + extend_size; jp++)
-								{
-									if ((kp >= STARTINGZ(msk_cp) && kp <= FINISHINGZ(msk_cp)) &&
-										(ip >= STARTINGY(msk_cp) && ip <= FINISHINGY(msk_cp)) &&
-										(jp >= STARTINGX(msk_cp) && jp <= FINISHINGX(msk_cp)))
-									{
-										// only check distance if neighbouring Im() is one
-										if (A3D_ELEM(msk_cp, kp, ip, jp) < 0.001)
-										{
-											DOUBLE r2 = (DOUBLE)((kp - k)*(kp - k) + (ip - i)*(ip - i) + (jp - j)*(jp - j));
-											// Set original voxel to 1 if a neghouring with Im()=1 is within distance extend_ini_mask
-											if (r2 < extend_ini_mask2)
-											{
-												A3D_ELEM(msk_out, k, i, j) = 0.;
-												already_done = true;
-											}
-										}
-									}
-									if (already_done) break;
-								}
-								if (already_done) break;
-							}
-							if (already_done) break;
-						}
-					}
-				}
+				if (DIRECT_MULTIDIM_ELEM(dist2, n) < extend_ini_mask2)
+					DIRECT_MULTIDIM_ELEM(msk_out, n) = (do_extend) ? 1. : 0.;
 			}
 		}
 
 		if (width_soft_mask_edge > 0.)
 		{
 			// C. Make a soft edge to the mask
-			// Note that the extended mask is now in I1, and we'll put the soft-edge mask again into Im
-
-			msk_cp = msk_out;
-			int extend_size = CEIL(width_soft_mask_edge);
+			// Zero voxels within width_soft_mask_edge of the (extended) mask get a raised-cosine value of their distance to it
 			DOUBLE width_soft_mask_edge2 = width_soft_mask_edge * width_soft_mask_edge;
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(msk_cp)
+			if (verb)
+				std::cout << "== Making a soft edge of " << width_soft_mask_edge << " pixels on the mask ..." << std::endl;
+			squaredDistanceTransform(msk_out, true, dist2, nr_threads);
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int n = 0; n < NZYXSIZE(msk_out); n++)
 			{
-				// only extend zero values to values between 0 and 1.
-				if (A3D_ELEM(msk_cp, k, i, j) < 0.001)
-				{
-					DOUBLE min_r2 = 9999.;
-					for (long int kp = k - extend_size; kp <= k + extend_size; kp++)
-					{
-						for (long int ip = i - extend_size; ip <= i + extend_size; ip++)
-						{
-							for (long int jp = j - extend_size; jp <= j + extend_size; jp++)
-							{
-								if ((kp >= STARTINGZ(msk_cp) && kp <= FINISHINGZ(msk_cp)) &&
-									(ip >= STARTINGY(msk_cp) && ip <= FINISHINGY(msk_cp)) &&
-									(jp >= STARTINGX(msk_cp) && jp <= FINISHINGX(msk_cp)))
-								{
-									// only update distance to a neighbouring msk_cp is one
-									if (A3D_ELEM(msk_cp, kp, ip, jp) > 0.999)
-									{
-										DOUBLE r2 = (DOUBLE)((kp - k)*(kp - k) + (ip - i)*(ip - i) + (jp - j)*(jp - j));
-										// Set original voxel to 1 if a neghouring with Im()=1 is within distance extend_ini_mask
-										if (r2 < min_r2)
-											min_r2 = r2;
-									}
-								}
-							}
-						}
-					}
-					if (min_r2 < width_soft_mask_edge2)
-					{
-						A3D_ELEM(msk_out, k, i, j) = 0.5 + 0.5 * cos(PI * sqrt(min_r2) / width_soft_mask_edge);
-					}
-				}
+				DOUBLE min_r2 = DIRECT_MULTIDIM_ELEM(dist2, n);
+				if (DIRECT_MULTIDIM_ELEM(msk_out, n) < 0.001 && min_r2 < width_soft_mask_edge2)
+					DIRECT_MULTIDIM_ELEM(msk_out, n) = 0.5 + 0.5 * cos(PI * sqrt(min_r2) / width_soft_mask_edge);
 			}
 		}
 
 	}
-	void raisedCosineMask(MultidimArray<DOUBLE> &mask, DOUBLE radius, DOUBLE radius_p, int x, int y, int z)
+
+	void raisedCosineMask(MultidimArray<DOUBLE> &mask, DOUBLE radius, DOUBLE radius_p, int x, int y, int z, int nr_threads)
 	{
+		nr_threads = getTaskNrThreads(nr_threads);
 		mask.setXmippOrigin();
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(mask)
+
+		// The mask value at each (integer) squared distance to (x, y, z)
+		long int max_r2 = maxSquaredRadius(mask, x, y, z);
+		std::vector<DOUBLE> value(max_r2 + 1);
+		for (long int r2 = 0; r2 <= max_r2; r2++)
 		{
-			// calculate distance from the origin
-			DOUBLE d = sqrt((DOUBLE)((z - k)*(z - k) + (y - i)*(y - i) + (x - j)*(x - j)));
+			DOUBLE d = sqrt((DOUBLE)r2);
 			if (d > radius_p)
-				A3D_ELEM(mask, k, i, j) = 0.;
+				value[r2] = 0.;
 			else if (d < radius)
-				A3D_ELEM(mask, k, i, j) = 1.;
+				value[r2] = 1.;
 			else
-				A3D_ELEM(mask, k, i, j) = 0.5 - 0.5 * cos(PI * (radius_p - d) / (radius_p - radius));
+				value[r2] = 0.5 - 0.5 * cos(PI * (radius_p - d) / (radius_p - radius));
 		}
 
+		// Along a row, the squared distance grows by 2 * (j - x) + 1 from j to j + 1
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = STARTINGZ(mask); k <= FINISHINGZ(mask); k++)
+			for (long int i = STARTINGY(mask); i <= FINISHINGY(mask); i++)
+			{
+				long int r2 = (z - k) * (z - k) + (y - i) * (y - i) + (x - STARTINGX(mask)) * (x - STARTINGX(mask));
+				DOUBLE *row = &A3D_ELEM(mask, k, i, STARTINGX(mask));
+				for (long int j = STARTINGX(mask); j <= FINISHINGX(mask); r2 += 2 * (j - x) + 1, j++)
+					row[j - STARTINGX(mask)] = value[r2];
+			}
+
 	}
 }
\ No newline at end of file
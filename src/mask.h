@@ -29,7 +29,8 @@ namespace relion
 {
 	// Mask out corners outside sphere (replace by average value)
 	// Apply a soft mask (raised cosine with cosine_width pixels width)
-	void softMaskOutsideMap(MultidimArray<DOUBLE> &vol, DOUBLE radius = -1., DOUBLE cosine_width = 3, MultidimArray<DOUBLE> *Mnoise = NULL);
+	// The mask is tabulated per squared radius; the rows of vol are distributed over nr_threads threads
+	void softMaskOutsideMap(MultidimArray<DOUBLE> &vol, DOUBLE radius = -1., DOUBLE cosine_width = 3, MultidimArray<DOUBLE> *Mnoise = NULL, int nr_threads = 1);
 
 	// Apply a soft mask and set density outside the mask at the average value of those pixels in the original map
 	void softMaskOutsideMap(MultidimArray<DOUBLE> &vol, MultidimArray<DOUBLE> &msk, bool invert_mask = false);
@@ -38,12 +39,18 @@ namespace relion
 	// 1. initial binarization (based on ini_mask_density_threshold)
 	// 2. Growing extend_ini_mask in all directions
 	// 3. Putting a raised-cosine edge on the mask with width width_soft_mask_edge
-	// If verb, then output description of steps and progress bars
+	// If verb, then output a description of each step on std::cout
+	// Steps 2 and 3 use exact Euclidean distance transforms, which take linear time, on nr_threads threads
 	void autoMask(MultidimArray<DOUBLE> &img_in, MultidimArray<DOUBLE> &msk_out,
-		DOUBLE  ini_mask_density_threshold, DOUBLE extend_ini_mask, DOUBLE width_soft_mask_edge, bool verb = false);
+		DOUBLE  ini_mask_density_threshold, DOUBLE extend_ini_mask, DOUBLE width_soft_mask_edge, bool verb = false, int nr_threads = 1);
+
+	// Squared Euclidean distance (in pixels) of every pixel of msk to the nearest one with a value > 0.999 (to_ones) or < 0.001
+	// (otherwise); pixels without any such pixel in msk get 1e30. Takes linear time, on nr_threads threads.
+	void squaredDistanceTransform(const MultidimArray<DOUBLE> &msk, bool to_ones, MultidimArray<DOUBLE> &dist2, int nr_threads = 1);
 
 	// Fills mask with a soft-edge circular mask (soft-edge in between radius and radius_p), centred at (x, y, z)
-	void raisedCosineMask(MultidimArray<DOUBLE> &mask, DOUBLE radius, DOUBLE radius_p, int x, int y, int z = 0);
+	// The mask is tabulated per squared radius; the rows are distributed over nr_threads threads
+	void raisedCosineMask(MultidimArray<DOUBLE> &mask, DOUBLE radius, DOUBLE radius_p, int x, int y, int z = 0, int nr_threads = 1);
 
 }
 #endif /* MASK_H_ */
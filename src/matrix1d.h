@@ -344,6 +344,20 @@ namespace relion
 			*this = v;
 		}
 
+		/** Move constructor
+		 *
+		 * Takes over the memory of v, which is left empty. If v is an alias
+		 * (destroyData is false), the new vector is an alias of the same memory.
+		 */
+		Matrix1D(Matrix1D<T>&& v) noexcept
+		{
+			vdata = v.vdata;
+			destroyData = v.destroyData;
+			vdim = v.vdim;
+			row = v.row;
+			v.coreInit();
+		}
+
 		/** Destructor.
 		 */
 		 ~Matrix1D()
@@ -373,6 +387,28 @@ namespace relion
 
 			 return *this;
 		 }
+
+		 /** Move assignment.
+		  *
+		  * Takes over the memory of op1, which is left empty. If this vector is an
+		  * alias, op1 is copied into the aliased memory as by the normal assignment.
+		  */
+		 Matrix1D<T>& operator=(Matrix1D<T>&& op1)
+		 {
+			 if (&op1 != this)
+			 {
+				 if (!destroyData && vdata != NULL)
+					 return *this = static_cast<const Matrix1D<T>&>(op1);
+				 coreDeallocate();
+				 vdata = op1.vdata;
+				 destroyData = op1.destroyData;
+				 vdim = op1.vdim;
+				 row = op1.row;
+				 op1.coreInit();
+			 }
+
+			 return *this;
+		 }
 		 //@}
 
 		 /// @name Core memory operations for Matrix1D
@@ -175,6 +175,21 @@ namespace relion
 			*this = v;
 		}
 
+		/** Move constructor
+		 *
+		 * Takes over the memory of v, which is left empty. If v is an alias
+		 * (destroyData is false), the new matrix is an alias of the same memory.
+		 */
+		Matrix2D(Matrix2D<T>&& v) noexcept
+		{
+			mdata = v.mdata;
+			destroyData = v.destroyData;
+			mdimx = v.mdimx;
+			mdimy = v.mdimy;
+			mdim = v.mdim;
+			v.coreInit();
+		}
+
 		/** Destructor.
 		 */
 		~Matrix2D()
@@ -204,6 +219,29 @@ namespace relion
 
 			return *this;
 		}
+
+		/** Move assignment.
+		 *
+		 * Takes over the memory of op1, which is left empty. If this matrix is an
+		 * alias, op1 is copied into the aliased memory as by the normal assignment.
+		 */
+		Matrix2D<T>& operator=(Matrix2D<T>&& op1)
+		{
+			if (&op1 != this)
+			{
+				if (!destroyData && mdata != NULL)
+					return *this = static_cast<const Matrix2D<T>&>(op1);
+				coreDeallocate();
+				mdata = op1.mdata;
+				destroyData = op1.destroyData;
+				mdimx = op1.mdimx;
+				mdimy = op1.mdimy;
+				mdim = op1.mdim;
+				op1.coreInit();
+			}
+
+			return *this;
+		}
 		//@}
 
 		/// @name Core memory operations for Matrix2D
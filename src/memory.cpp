@@ -18,6 +18,21 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/memory.h"
+#include "src/macros.h"
+#include <string.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <map>
+#include <vector>
+#include <iomanip>
+#include <atomic>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 namespace relion
@@ -56,4 +71,365 @@ namespace relion
 		ptr = NULL;
 		return(0);
 	}
-}
\ No newline at end of file
+
+	// Blocks of at least this size get the large-block placement policy
+	#define LARGE_BLOCK_SIZE (4 << 20)
+	// 2 MB, the size of a transparent huge page on x86-64
+	#define HUGE_PAGE_SIZE (2 << 20)
+
+	static bool alloc_first_touch = false;
+	static bool alloc_huge_pages = false;
+	static int alloc_nr_threads = 0;
+
+	void setAllocationPolicy(bool first_touch, bool huge_pages, int nr_threads)
+	{
+		alloc_first_touch = first_touch;
+		alloc_huge_pages = huge_pages;
+		alloc_nr_threads = nr_threads;
+	}
+
+	// The memory pool: free blocks by (rounded) size, only used while pool_nr_scopes > 0
+	// All access is inside omp critical(MemoryPool). pool_nr_scopes is only changed there as well, but it is
+	// atomic, so that allocations can skip the lock when no pool is in use
+	static std::map<size_t, std::vector<void*> > pool_blocks;
+	static size_t pool_bytes = 0;
+	static size_t pool_max_bytes = (size_t)1 << 30;
+	static std::atomic<int> pool_nr_scopes(0);
+
+	// The memory accounting (see setMemoryTracking): the size and category of every block taken from the system
+	// since tracking was switched on. All access is inside omp critical(MemoryPool) as well
+	struct TrackedBlock
+	{
+		size_t size;
+		int category;
+	};
+	static bool memory_tracking = false;
+	static std::map<void*, TrackedBlock> tracked_blocks;
+	static MemoryUsage tracked_usage = MemoryUsage();
+
+	// The category of the innermost MemoryCategoryScope of the calling thread, -1 if it has none
+	static thread_local int thread_category = -1;
+
+	// The categories of all MemoryCategoryScopes alive, by the order in which they were opened, for the threads
+	// without a scope of their own (the OpenMP workers). Access inside omp critical(MemoryPool)
+	static std::map<long int, int> alive_scopes;
+	static long int next_scope_id = 0;
+
+	// The category that memory allocated by the calling thread is accounted to
+	// Should be called inside omp critical(MemoryPool)
+	static int currentCategory()
+	{
+		if (thread_category >= 0)
+			return thread_category;
+		if (alive_scopes.empty())
+			return MEMORY_OTHER;
+		return alive_scopes.rbegin()->second;
+	}
+
+	// Account block ptr (of size bytes) to category, moving it out of its previous category if it is known already
+	// Should be called inside omp critical(MemoryPool)
+	static void trackBlock(void* ptr, size_t size, int category)
+	{
+		std::map<void*, TrackedBlock>::iterator it = tracked_blocks.find(ptr);
+		if (it != tracked_blocks.end())
+		{
+			tracked_usage.current[it->second.category] -= it->second.size;
+			tracked_usage.total -= it->second.size;
+			it->second.size = size;
+			it->second.category = category;
+		}
+		else
+		{
+			TrackedBlock block = { size, category };
+			tracked_blocks[ptr] = block;
+		}
+		tracked_usage.current[category] += size;
+		tracked_usage.total += size;
+		tracked_usage.peak[category] = XMIPP_MAX(tracked_usage.peak[category], tracked_usage.current[category]);
+		tracked_usage.total_peak = XMIPP_MAX(tracked_usage.total_peak, tracked_usage.total);
+	}
+
+	// Block ptr is returned to the system (nothing happens for blocks that are not tracked)
+	// Should be called inside omp critical(MemoryPool)
+	static void untrackBlock(void* ptr)
+	{
+		std::map<void*, TrackedBlock>::iterator it = tracked_blocks.find(ptr);
+		if (it == tracked_blocks.end())
+			return;
+		tracked_usage.current[it->second.category] -= it->second.size;
+		tracked_usage.total -= it->second.size;
+		tracked_blocks.erase(it);
+	}
+
+	static inline size_t roundedSize(size_t size)
+	{
+		size = (size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+		return (size == 0) ? MEMORY_ALIGNMENT : size;
+	}
+
+	static void freeBlock(void* ptr)
+	{
+#ifdef _WIN32
+		_aligned_free(ptr);
+#else
+		free(ptr);
+#endif
+	}
+
+	// Should be called inside omp critical(MemoryPool)
+	static void emptyMemoryPool()
+	{
+		for (std::map<size_t, std::vector<void*> >::iterator it = pool_blocks.begin(); it != pool_blocks.end(); ++it)
+			for (size_t i = 0; i < it->second.size(); i++)
+			{
+				if (memory_tracking)
+					untrackBlock(it->second[i]);
+				freeBlock(it->second[i]);
+			}
+		pool_blocks.clear();
+		pool_bytes = 0;
+	}
+
+	void setMemoryPoolLimit(size_t max_bytes)
+	{
+#pragma omp critical(MemoryPool)
+		{
+			pool_max_bytes = max_bytes;
+			if (pool_bytes > pool_max_bytes)
+				emptyMemoryPool();
+		}
+	}
+
+	MemoryPoolScope::MemoryPoolScope()
+	{
+#pragma omp critical(MemoryPool)
+		pool_nr_scopes++;
+	}
+
+	MemoryPoolScope::~MemoryPoolScope()
+	{
+#pragma omp critical(MemoryPool)
+		{
+			pool_nr_scopes--;
+			if (pool_nr_scopes == 0)
+				emptyMemoryPool();
+		}
+	}
+
+	void* askAlignedMemory(size_t size)
+	{
+		size = roundedSize(size);
+		bool is_large = (size >= LARGE_BLOCK_SIZE);
+
+		void* ptr = NULL;
+		if (pool_nr_scopes > 0)
+		{
+#pragma omp critical(MemoryPool)
+			{
+				// Check again, the last scope may have ended in the meantime
+				if (pool_nr_scopes > 0)
+				{
+					std::map<size_t, std::vector<void*> >::iterator it = pool_blocks.find(size);
+					if (it != pool_blocks.end() && it->second.size() > 0)
+					{
+						ptr = it->second.back();
+						it->second.pop_back();
+						pool_bytes -= size;
+						if (memory_tracking)
+							trackBlock(ptr, size, currentCategory());
+					}
+				}
+			}
+		}
+		// Re-used blocks have been placed (and touched) already
+		if (ptr != NULL)
+			return ptr;
+
+#ifdef _WIN32
+		ptr = _aligned_malloc(size, MEMORY_ALIGNMENT);
+#else
+		size_t alignment = (is_large && alloc_huge_pages) ? HUGE_PAGE_SIZE : MEMORY_ALIGNMENT;
+		if (posix_memalign(&ptr, alignment, size) != 0)
+			ptr = NULL;
+#endif
+		if (ptr == NULL)
+		{
+			std::cerr << "Memory allocation of " << size << " bytes failed" << std::endl;
+			REPORT_ERROR("Error in askAlignedMemory: no space left");
+		}
+
+		if (memory_tracking)
+		{
+#pragma omp critical(MemoryPool)
+			trackBlock(ptr, size, currentCategory());
+		}
+
+		if (is_large)
+		{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+			if (alloc_huge_pages)
+				madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+			if (alloc_first_touch)
+			{
+				// One page-aligned chunk per thread, in the same (static) order as "omp parallel for" uses
+				char* cptr = (char*)ptr;
+				long int nr_pages = (long int)((size + 4095) / 4096);
+				int nr_threads = alloc_nr_threads;
+#ifdef _OPENMP
+				if (nr_threads <= 0)
+					nr_threads = omp_get_max_threads();
+#endif
+				nr_threads = XMIPP_MAX(1, nr_threads);
+#pragma omp parallel for num_threads(nr_threads) schedule(static)
+				for (long int ipage = 0; ipage < nr_pages; ipage++)
+				{
+					size_t offset = (size_t)ipage * 4096;
+					memset(cptr + offset, 0, (offset + 4096 <= size) ? 4096 : size - offset);
+				}
+			}
+		}
+
+		return ptr;
+	}
+
+	void freeAlignedMemory(void* ptr, size_t size)
+	{
+		if (ptr == NULL)
+			return;
+
+		bool is_pooled = false;
+		if (size > 0 && pool_nr_scopes > 0)
+		{
+			size = roundedSize(size);
+#pragma omp critical(MemoryPool)
+			{
+				if (pool_nr_scopes > 0 && pool_bytes + size <= pool_max_bytes)
+				{
+					pool_blocks[size].push_back(ptr);
+					pool_bytes += size;
+					is_pooled = true;
+					if (memory_tracking && tracked_blocks.count(ptr) > 0)
+						trackBlock(ptr, size, MEMORY_POOL);
+				}
+			}
+		}
+
+		if (!is_pooled)
+		{
+			if (memory_tracking)
+			{
+#pragma omp critical(MemoryPool)
+				untrackBlock(ptr);
+			}
+			freeBlock(ptr);
+		}
+	}
+
+	size_t getMemoryPoolLimit()
+	{
+		size_t max_bytes;
+#pragma omp critical(MemoryPool)
+		max_bytes = pool_max_bytes;
+		return max_bytes;
+	}
+
+	const char* getMemoryCategoryName(int category)
+	{
+		switch (category)
+		{
+		case MEMORY_OTHER:
+			return "other";
+		case MEMORY_PROJECTOR:
+			return "projector";
+		case MEMORY_BACKPROJECTOR:
+			return "backprojector";
+		case MEMORY_RECONSTRUCT:
+			return "reconstruct";
+		case MEMORY_SHELL_MAPS:
+			return "shell maps";
+		case MEMORY_POOL:
+			return "pool";
+		default:
+			REPORT_ERROR("getMemoryCategoryName: unknown memory category");
+		}
+		return "";
+	}
+
+	void setMemoryTracking(bool do_track)
+	{
+#pragma omp critical(MemoryPool)
+		{
+			if (do_track && !memory_tracking)
+			{
+				tracked_blocks.clear();
+				tracked_usage = MemoryUsage();
+			}
+			memory_tracking = do_track;
+		}
+	}
+
+	bool isMemoryTracking()
+	{
+		return memory_tracking;
+	}
+
+	MemoryUsage getMemoryUsage()
+	{
+		MemoryUsage usage;
+#pragma omp critical(MemoryPool)
+		usage = tracked_usage;
+		return usage;
+	}
+
+	void resetMemoryPeaks()
+	{
+#pragma omp critical(MemoryPool)
+		{
+			for (int c = 0; c < NR_MEMORY_CATEGORIES; c++)
+				tracked_usage.peak[c] = tracked_usage.current[c];
+			tracked_usage.total_peak = tracked_usage.total;
+		}
+	}
+
+	void reportMemoryUsage(std::ostream &out)
+	{
+		MemoryUsage usage = getMemoryUsage();
+		const double MB = 1024. * 1024.;
+		out << " memory (MB):       current       peak" << std::endl;
+		out << std::fixed << std::setprecision(1);
+		for (int c = 0; c < NR_MEMORY_CATEGORIES; c++)
+			out << std::setw(15) << getMemoryCategoryName(c) << std::setw(12) << usage.current[c] / MB
+				<< std::setw(11) << usage.peak[c] / MB << std::endl;
+		out << std::setw(15) << "total" << std::setw(12) << usage.total / MB << std::setw(11) << usage.total_peak / MB << std::endl;
+		out.unsetf(std::ios_base::floatfield);
+	}
+
+	MemoryCategory getMemoryCategory()
+	{
+		if (thread_category >= 0)
+			return (MemoryCategory)thread_category;
+		int category;
+#pragma omp critical(MemoryPool)
+		category = currentCategory();
+		return (MemoryCategory)category;
+	}
+
+	MemoryCategoryScope::MemoryCategoryScope(MemoryCategory category)
+	{
+		previous = thread_category;
+		thread_category = category;
+#pragma omp critical(MemoryPool)
+		{
+			id = next_scope_id++;
+			alive_scopes[id] = category;
+		}
+	}
+
+	MemoryCategoryScope::~MemoryCategoryScope()
+	{
+		thread_category = previous;
+#pragma omp critical(MemoryPool)
+		alive_scopes.erase(id);
+	}
+}
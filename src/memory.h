@@ -186,6 +186,157 @@ namespace relion
 	 * returns int: 0 = success, -1 = failure.
 	 */
 	int freeMemory(void* ptr, unsigned long memsize);
+
+	/// Alignment (in bytes) of all memory returned by askAlignedMemory: one cache line, and enough for any AVX(-512) load
+	#define MEMORY_ALIGNMENT 64
+
+	/** Set the placement policy of askAlignedMemory for large blocks (of at least 4 MB).
+	 *
+	 * - first_touch: the pages of a new block are zeroed by nr_threads OpenMP threads (all available ones if nr_threads <= 0)
+	 *   in contiguous, statically scheduled chunks. On NUMA machines every page then lives on the memory node of
+	 *   the thread that will process that part of the block in a similarly scheduled "omp parallel for"
+	 * - huge_pages: large blocks are aligned to 2 MB and (on Linux) marked for transparent huge pages,
+	 *   which reduces the TLB misses of random access into large volumes
+	 *
+	 * Both are off by default.
+	 */
+	void setAllocationPolicy(bool first_touch, bool huge_pages, int nr_threads = 0);
+
+	/** Allocates memory aligned to MEMORY_ALIGNMENT bytes.
+	 *
+	 * The size is rounded up to a multiple of MEMORY_ALIGNMENT, so SIMD loops may safely run over the end of the last vector.
+	 * The memory is not initialised, unless it is large and the first-touch policy is on (see setAllocationPolicy).
+	 * An exception is thrown if no memory is available.
+	 * The memory must be freed with freeAlignedMemory.
+	 */
+	void* askAlignedMemory(size_t size);
+
+	/** Frees memory allocated by askAlignedMemory.
+	 *
+	 * If size (the size passed to askAlignedMemory) is given and a MemoryPoolScope is alive,
+	 * the block is kept in the memory pool instead, to be handed out again by askAlignedMemory for the same size.
+	 */
+	void freeAlignedMemory(void* ptr, size_t size = 0);
+
+	/** Set the maximum number of bytes kept in the memory pool (default 1 GB).
+	 * Blocks that are freed while the pool is full are returned to the system.
+	 */
+	void setMemoryPoolLimit(size_t max_bytes);
+
+	/** Scoped guard that switches the memory pool on.
+	 *
+	 * While at least one MemoryPoolScope exists (in any thread), memory freed by freeAlignedMemory
+	 * (which includes all MultidimArray data) is kept in a pool, bucketed by size, and re-used for the next
+	 * allocation of the same size. This removes the allocator and page-fault costs of temporaries that
+	 * are allocated and freed again for every particle. The pool is emptied once the last scope ends.
+	 *
+	 * @code
+	 * {
+	 *     MemoryPoolScope pool;
+	 *     for (long int ipart = 0; ipart < nr_particles; ipart++)
+	 *         processParticle(ipart); // its same-sized temporaries are only allocated once
+	 * }
+	 * @endcode
+	 */
+	class MemoryPoolScope
+	{
+	public:
+		MemoryPoolScope();
+		~MemoryPoolScope();
+
+	private:
+		// Not copyable
+		MemoryPoolScope(const MemoryPoolScope&);
+		MemoryPoolScope& operator=(const MemoryPoolScope&);
+	};
+
+	/// Get the maximum number of bytes kept in the memory pool (see setMemoryPoolLimit)
+	size_t getMemoryPoolLimit();
+
+	/** The subsystems that memory from askAlignedMemory is accounted to while memory tracking is on.
+	 *
+	 * MEMORY_POOL holds the blocks that have been freed into the memory pool: they are still taken from the system.
+	 */
+	enum MemoryCategory
+	{
+		MEMORY_OTHER = 0,
+		MEMORY_PROJECTOR,
+		MEMORY_BACKPROJECTOR,
+		MEMORY_RECONSTRUCT,
+		MEMORY_SHELL_MAPS,
+		MEMORY_POOL,
+		NR_MEMORY_CATEGORIES
+	};
+
+	/// Short name of a memory category, e.g. "backprojector"
+	const char* getMemoryCategoryName(int category);
+
+	/** Number of bytes per category that askAlignedMemory has taken from the system, current and highest.
+	 * The totals are over all categories: total_peak is the peak of the sum, not the sum of the peaks.
+	 */
+	struct MemoryUsage
+	{
+		size_t current[NR_MEMORY_CATEGORIES];
+		size_t peak[NR_MEMORY_CATEGORIES];
+		size_t total, total_peak;
+	};
+
+	/** Switch the accounting of askAlignedMemory and freeAlignedMemory on or off (default off).
+	 *
+	 * While it is on, every block (i.e. all MultidimArray data) is counted in the category of the allocating thread
+	 * at the time it was allocated (see MemoryCategoryScope), until it is freed.
+	 * This costs a lookup in a locked table per allocation, so leave it off in production runs that do not report.
+	 * Switching it on resets all counters: only blocks allocated from then on are counted.
+	 * Memory that does not come from askAlignedMemory (std::vector, FFTW plans, ...) is never counted.
+	 */
+	void setMemoryTracking(bool do_track);
+
+	/// Whether the accounting of setMemoryTracking is on
+	bool isMemoryTracking();
+
+	/// Get the current and peak byte counts (all zero if memory tracking has never been on)
+	MemoryUsage getMemoryUsage();
+
+	/// Set all peaks to the current byte counts, e.g. to measure the peak of the next step only
+	void resetMemoryPeaks();
+
+	/** Print the current and peak bytes of all categories, in MB, e.g.
+	 *
+	 * @code
+	 *  memory (MB):       current       peak
+	 *      projector       168.6      421.6
+	 *  ...
+	 * @endcode
+	 */
+	void reportMemoryUsage(std::ostream &out);
+
+	/// The category that memory allocated by the calling thread is accounted to (see MemoryCategoryScope)
+	MemoryCategory getMemoryCategory();
+
+	/** Scoped guard that accounts the memory allocated by the calling thread during its lifetime to a category
+	 * (see setMemoryTracking).
+	 *
+	 * The category is per thread, and scopes nest: the previous category of the thread is restored at the end.
+	 * The tasks of parallelFor() run in the category of the thread that called it. Threads without a scope of
+	 * their own, such as the OpenMP workers of a parallel region, allocate into the category of the most recently
+	 * opened scope that is still alive (of any thread), or MEMORY_OTHER if there is none.
+	 */
+	class MemoryCategoryScope
+	{
+	public:
+		MemoryCategoryScope(MemoryCategory category);
+		~MemoryCategoryScope();
+
+	private:
+		int previous;
+
+		// Entry of this scope in the list of alive scopes
+		long int id;
+
+		// Not copyable
+		MemoryCategoryScope(const MemoryCategoryScope&);
+		MemoryCategoryScope& operator=(const MemoryCategoryScope&);
+	};
 }
 //@}
 #endif
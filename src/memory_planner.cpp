@@ -0,0 +1,108 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/memory_planner.h"
+#include "src/memory.h"
+#include "src/complex.h"
+#include <iomanip>
+
+namespace relion
+{
+	// Bytes of an array of n elements of elsize bytes, as taken by askAlignedMemory
+	static size_t arrayBytes(size_t n, size_t elsize)
+	{
+		size_t size = n * elsize;
+		size = (size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+		return (size == 0) ? MEMORY_ALIGNMENT : size;
+	}
+
+	// Number of elements of a real-space array of size dim, and of its half-complex transform
+	static size_t realElements(long int dim, int ref_dim)
+	{
+		return (ref_dim == 2) ? dim * dim : dim * dim * dim;
+	}
+
+	static size_t fourierElements(long int dim, int ref_dim)
+	{
+		return (ref_dim == 2) ? dim * (dim / 2 + 1) : dim * dim * (dim / 2 + 1);
+	}
+
+	ReconstructionMemoryEstimate estimateReconstructionMemory(int ori_size, int padding_factor, int nr_classes,
+		int ref_dim, int current_size, bool do_compensated_sum, int nr_parallel_reconstructions, bool update_tau2_with_fsc)
+	{
+		if (ref_dim != 2 && ref_dim != 3)
+			REPORT_ERROR("estimateReconstructionMemory: ref_dim should be 2 or 3");
+		if (ori_size <= 0 || padding_factor <= 0 || nr_classes <= 0)
+			REPORT_ERROR("estimateReconstructionMemory: ori_size, padding_factor and nr_classes should be positive");
+		nr_parallel_reconstructions = XMIPP_MAX(1, XMIPP_MIN(nr_parallel_reconstructions, nr_classes));
+
+		// As in Projector::initialiseSizes
+		int r_max = (current_size < 0) ? ori_size / 2 : current_size / 2;
+		r_max = XMIPP_MIN(r_max, ori_size / 2);
+		long int pad_size = 2 * (padding_factor * r_max + 1) + 1;
+		long int padoridim = padding_factor * ori_size;
+
+		size_t nr_data = fourierElements(pad_size, ref_dim);
+		size_t data_bytes = arrayBytes(nr_data, sizeof(Complex));
+		size_t weight_bytes = arrayBytes(nr_data, sizeof(DOUBLE));
+		size_t padded_bytes = arrayBytes(realElements(pad_size, ref_dim), sizeof(DOUBLE));
+		size_t padori_bytes = arrayBytes(realElements(padoridim, ref_dim), sizeof(DOUBLE));
+		size_t padori_fourier_bytes = arrayBytes(fourierElements(padoridim, ref_dim), sizeof(Complex));
+		size_t map_bytes = arrayBytes(realElements(ori_size, ref_dim), sizeof(DOUBLE));
+
+		ReconstructionMemoryEstimate mem;
+		mem.maps = nr_classes * map_bytes;
+		mem.projectors = nr_classes * data_bytes;
+		mem.backprojectors = nr_classes * (data_bytes + weight_bytes) * (do_compensated_sum ? 2 : 1);
+		mem.shell_maps = nr_data * sizeof(short);
+
+		// The padded map and its transform
+		mem.fourier_map = padori_bytes + padori_fourier_bytes;
+
+		// The largest set that reconstruct() uses at once: Fweight, Fnewweight (always in float), the transformer's
+		// array of the padded size while it is re-sized to the padded original size, and the real-space map of that size
+		size_t live = weight_bytes + arrayBytes(nr_data, sizeof(float)) + data_bytes + padori_fourier_bytes + padori_bytes;
+		// The others are freed before, or allocated after that, but kept by the memory pool:
+		// the first vol_out of pad_size (only used to set up the transform) and the windowed map
+		// (allocated twice by MultidimArray::window)
+		size_t pooled = padded_bytes + 2 * map_bytes;
+		if (update_tau2_with_fsc)
+			pooled += arrayBytes(fourierElements(ori_size, ref_dim), sizeof(Complex));
+		mem.reconstruct = nr_parallel_reconstructions * live +
+			XMIPP_MIN(nr_parallel_reconstructions * pooled, getMemoryPoolLimit());
+
+		mem.peak = mem.maps + mem.projectors + mem.backprojectors + mem.shell_maps + XMIPP_MAX(mem.fourier_map, mem.reconstruct);
+		return mem;
+	}
+
+	void ReconstructionMemoryEstimate::print(std::ostream &out) const
+	{
+		const double MB = 1024. * 1024.;
+		out << std::fixed << std::setprecision(1);
+		out << " maps           : " << std::setw(10) << maps / MB << " MB" << std::endl;
+		out << " projectors     : " << std::setw(10) << projectors / MB << " MB" << std::endl;
+		out << " backprojectors : " << std::setw(10) << backprojectors / MB << " MB" << std::endl;
+		out << " shell maps     : " << std::setw(10) << shell_maps / MB << " MB" << std::endl;
+		out << " fourier map    : " << std::setw(10) << fourier_map / MB << " MB (temporary)" << std::endl;
+		out << " reconstruct    : " << std::setw(10) << reconstruct / MB << " MB (temporary)" << std::endl;
+		out << " peak           : " << std::setw(10) << peak / MB << " MB" << std::endl;
+		out.unsetf(std::ios_base::floatfield);
+	}
+}
@@ -0,0 +1,78 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <iostream>
+#include "src/macros.h"
+
+namespace relion
+{
+	/** Estimated memory (in bytes) of a refinement or classification with nr_classes references
+	 *
+	 * The estimate follows the allocations of Projector::computeFourierTransformMap(), BackProjector::initZeros()
+	 * and BackProjector::reconstruct() for dense storage (no half precision, bricked or sparse arrays).
+	 * The arrays that are held for the whole run are counted for all classes together. Of the temporaries, only
+	 * those of one computeFourierTransformMap() or of nr_parallel_reconstructions reconstructions (as by
+	 * reconstructBatch()) are alive at any time: peak is the sum of the former and the larger of the latter.
+	 * The temporaries of a reconstruction include the blocks that its MemoryPoolScope keeps until the end,
+	 * up to getMemoryPoolLimit() bytes for all parallel reconstructions together.
+	 *
+	 * Not included are the particle images, FFTW's own plan and scratch memory, and anything below a few
+	 * times ori_size elements (spectra, tables): leave a margin of a few percent for these.
+	 * Apart from the shell maps, the estimate covers the memory counted by setMemoryTracking (see memory.h).
+	 *
+	 * @code
+	 * ReconstructionMemoryEstimate mem = estimateReconstructionMemory(400, 2, 4);
+	 * if (mem.peak > node_bytes)
+	 *     ... use fewer classes, padding_factor 1 or another node ...
+	 * @endcode
+	 */
+	struct ReconstructionMemoryEstimate
+	{
+		// Held during the whole run, for all classes
+		size_t maps;           // the real-space references (or reconstructions) of ori_size, kept by the caller
+		size_t projectors;     // Projector::data
+		size_t backprojectors; // BackProjector::data and weight, and the compensation terms
+		size_t shell_maps;     // the ShellIndexMap that reconstruct() keeps in its cache (the same for all classes)
+
+		// Temporaries, of which only one set is alive at a time
+		size_t fourier_map;    // of one Projector::computeFourierTransformMap()
+		size_t reconstruct;    // of nr_parallel_reconstructions calls of BackProjector::reconstruct()
+
+		// maps + projectors + backprojectors + shell_maps + max(fourier_map, reconstruct)
+		size_t peak;
+
+		/// Print all components, in MB
+		void print(std::ostream &out) const;
+	};
+
+	/** Estimate the memory of nr_classes Projectors and BackProjectors of ori_size (see ReconstructionMemoryEstimate)
+	 *
+	 * current_size and do_compensated_sum are those of Projector::initZeros() (or computeFourierTransformMap())
+	 * and BackProjector::setCompensatedSummation(), and with update_tau2_with_fsc reconstruct() also transforms its result.
+	 */
+	ReconstructionMemoryEstimate estimateReconstructionMemory(int ori_size, int padding_factor, int nr_classes,
+		int ref_dim = 3, int current_size = -1, bool do_compensated_sum = false, int nr_parallel_reconstructions = 1,
+		bool update_tau2_with_fsc = false);
+}
+
+#endif
@@ -131,6 +131,21 @@ namespace relion
 		copy(MDc);
 	}
 
+	MetaDataContainer::MetaDataContainer(MetaDataContainer &&MDc) noexcept
+	{
+		values.swap(MDc.values);
+	}
+
+	MetaDataContainer& MetaDataContainer::operator =(MetaDataContainer &&MDc)
+	{
+		if (&MDc != this)
+		{
+			clear();
+			values.swap(MDc.values);
+		}
+		return *this;
+	}
+
 
 	void MetaDataContainer::addValueFromString(const EMDLabel &lCode, const std::string &value)
 	{
@@ -480,4 +495,314 @@ namespace relion
 
 		return result;
 	}
-}
\ No newline at end of file
+
+	MetaDataColumn::MetaDataColumn(EMDLabel _label, long int nr_objects, bool with_defaults)
+	{
+		label = _label;
+		if (EMDL::isDouble(label))
+			type = EMDL_DOUBLE;
+		else if (EMDL::isInt(label))
+			type = EMDL_INT;
+		else if (EMDL::isLong(label))
+			type = EMDL_LONG;
+		else if (EMDL::isBool(label))
+			type = EMDL_BOOL;
+		else if (EMDL::isString(label))
+			type = EMDL_STRING;
+		else
+			REPORT_ERROR("MetaDataColumn: unrecognised data type for label " + EMDL::label2Str(label));
+
+		resize(nr_objects);
+		if (with_defaults)
+			has_value.assign(nr_objects, 1);
+	}
+
+	void MetaDataColumn::resize(long int nr_objects)
+	{
+		switch (type)
+		{
+		case EMDL_DOUBLE: doubles.resize(nr_objects, 0.); break;
+		case EMDL_INT: ints.resize(nr_objects, 0); break;
+		case EMDL_LONG: longs.resize(nr_objects, 0); break;
+		case EMDL_BOOL: bools.resize(nr_objects, 0); break;
+		default: strings.resize(nr_objects); break;
+		}
+		has_value.resize(nr_objects, 0);
+	}
+
+	void MetaDataColumn::erase(long int objectID)
+	{
+		switch (type)
+		{
+		case EMDL_DOUBLE: doubles.erase(doubles.begin() + objectID); break;
+		case EMDL_INT: ints.erase(ints.begin() + objectID); break;
+		case EMDL_LONG: longs.erase(longs.begin() + objectID); break;
+		case EMDL_BOOL: bools.erase(bools.begin() + objectID); break;
+		default: strings.erase(strings.begin() + objectID); break;
+		}
+		has_value.erase(has_value.begin() + objectID);
+	}
+
+	template<class T>
+	static void reorderVector(std::vector<T> &v, const std::vector<long int> &order)
+	{
+		std::vector<T> aux(order.size());
+		for (size_t i = 0; i < order.size(); i++)
+			aux[i] = v[order[i]];
+		v.swap(aux);
+	}
+
+	void MetaDataColumn::reorder(const std::vector<long int> &order)
+	{
+		switch (type)
+		{
+		case EMDL_DOUBLE: reorderVector(doubles, order); break;
+		case EMDL_INT: reorderVector(ints, order); break;
+		case EMDL_LONG: reorderVector(longs, order); break;
+		case EMDL_BOOL: reorderVector(bools, order); break;
+		default:
+		{
+			// Swap the strings rather than copying them
+			std::vector<std::string> aux(order.size());
+			for (size_t i = 0; i < order.size(); i++)
+				aux[i].swap(strings[order[i]]);
+			strings.swap(aux);
+			break;
+		}
+		}
+		reorderVector(has_value, order);
+	}
+
+	void MetaDataColumn::typeError(const std::string &type_name) const
+	{
+		REPORT_ERROR("MetaDataColumn: label " + EMDL::label2Str(label) + " is not of type " + type_name + "!");
+	}
+
+#ifdef FLOAT_PRECISION
+	void MetaDataColumn::setValue(long int objectID, const double &value)
+	{
+		if (type != EMDL_DOUBLE)
+			typeError("float");
+		doubles[objectID] = value;
+		has_value[objectID] = 1;
+	}
+#endif
+
+	void MetaDataColumn::setValue(long int objectID, const DOUBLE &value)
+	{
+		if (type != EMDL_DOUBLE)
+			typeError("DOUBLE");
+		doubles[objectID] = value;
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setValue(long int objectID, const int &value)
+	{
+		if (type != EMDL_INT)
+			typeError("int");
+		ints[objectID] = value;
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setValue(long int objectID, const long int &value)
+	{
+		if (type != EMDL_LONG)
+			typeError("long");
+		longs[objectID] = value;
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setValue(long int objectID, const bool &value)
+	{
+		if (type != EMDL_BOOL)
+			typeError("bool");
+		bools[objectID] = value;
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setValue(long int objectID, const std::string &value)
+	{
+		if (type != EMDL_STRING)
+			typeError("string");
+		strings[objectID] = value;
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setValueFromString(long int objectID, const std::string &value)
+	{
+		if (type == EMDL_STRING)
+		{
+			strings[objectID] = value;
+		}
+		else
+		{
+			std::istringstream i(value);
+			switch (type)
+			{
+			case EMDL_DOUBLE: i >> doubles[objectID]; break;
+			case EMDL_INT: i >> ints[objectID]; break;
+			case EMDL_LONG: i >> longs[objectID]; break;
+			default:
+			{
+				bool boolValue;
+				i >> boolValue;
+				bools[objectID] = boolValue;
+				break;
+			}
+			}
+		}
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::setDefaultValue(long int objectID)
+	{
+		switch (type)
+		{
+		case EMDL_DOUBLE: doubles[objectID] = 0.; break;
+		case EMDL_INT: ints[objectID] = 0; break;
+		case EMDL_LONG: longs[objectID] = 0; break;
+		case EMDL_BOOL: bools[objectID] = 0; break;
+		default: strings[objectID] = ""; break;
+		}
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::copyValue(long int objectID, const MetaDataColumn &src, long int srcID)
+	{
+		if (!src.hasValue(srcID))
+		{
+			has_value[objectID] = 0;
+			return;
+		}
+		switch (type)
+		{
+		case EMDL_DOUBLE: doubles[objectID] = src.doubles[srcID]; break;
+		case EMDL_INT: ints[objectID] = src.ints[srcID]; break;
+		case EMDL_LONG: longs[objectID] = src.longs[srcID]; break;
+		case EMDL_BOOL: bools[objectID] = src.bools[srcID]; break;
+		default: strings[objectID] = src.strings[srcID]; break;
+		}
+		has_value[objectID] = 1;
+	}
+
+	void MetaDataColumn::addValueToContainer(long int objectID, MetaDataContainer &MDc) const
+	{
+		if (!hasValue(objectID))
+			return;
+		switch (type)
+		{
+		case EMDL_DOUBLE: MDc.addValue(label, doubles[objectID]); break;
+		case EMDL_INT: MDc.addValue(label, ints[objectID]); break;
+		case EMDL_LONG: MDc.addValue(label, longs[objectID]); break;
+		case EMDL_BOOL: MDc.addValue(label, (bool)(bools[objectID] != 0)); break;
+		default: MDc.addValue(label, strings[objectID]); break;
+		}
+	}
+
+	// Append the n characters of str to buffer, right-aligned in a field of width characters
+	static inline void appendRightAligned(std::string &buffer, const char *str, int n, int width)
+	{
+		if (n < width)
+			buffer.append(width - n, ' ');
+		buffer.append(str, n);
+	}
+
+	// Print value as printf("%lld") does; returns the number of characters
+	static int printInteger(char *buf, long long value)
+	{
+		char digits[24];
+		int nr_digits = 0;
+		unsigned long long u = (value < 0) ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+		do
+		{
+			digits[nr_digits++] = '0' + (char)(u % 10);
+			u /= 10;
+		} while (u != 0);
+
+		int n = 0;
+		if (value < 0)
+			buf[n++] = '-';
+		while (nr_digits > 0)
+			buf[n++] = digits[--nr_digits];
+		return n;
+	}
+
+	static const double fixed_scales[10] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+	static const unsigned long long fixed_divisors[10] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL,
+		100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL };
+
+	/* Print value as printf("%.*f", precision, value) does; returns the number of characters (at most 63)
+	 * value is scaled and rounded in double precision. Only if the scaled value is so close to halfway between two
+	 * integers that its rounding error could matter, or if it is out of range, snprintf has to decide.
+	 */
+	static int printFixed(char *buf, double value, int precision)
+	{
+		double a = fabs(value);
+		if (precision >= 0 && precision <= 9 && a < 1e6)
+		{
+			double x = a * fixed_scales[precision];
+			double fx = floor(x);
+			double halfway_distance = fabs(x - fx - 0.5);
+			if (halfway_distance > x * 4.5e-16 + 1e-300)
+			{
+				unsigned long long r = (unsigned long long)fx + ((x - fx > 0.5) ? 1 : 0);
+				unsigned long long divisor = fixed_divisors[precision];
+				int n = 0;
+				if (value < 0. || (value == 0. && 1. / value < 0.))
+					buf[n++] = '-';
+				n += printInteger(buf + n, (long long)(r / divisor));
+				if (precision > 0)
+				{
+					buf[n++] = '.';
+					unsigned long long frac = r % divisor;
+					for (int i = precision - 1; i >= 0; i--)
+					{
+						buf[n + i] = '0' + (char)(frac % 10);
+						frac /= 10;
+					}
+					n += precision;
+				}
+				return n;
+			}
+		}
+		return snprintf(buf, 64, "%.*f", precision, value);
+	}
+
+	bool MetaDataColumn::appendValue(std::string &buffer, long int objectID, int precision) const
+	{
+		if (!hasValue(objectID))
+			return false;
+
+		// Same formatting as MetaDataContainer::writeValueToStream after setting the stream width to 10
+		char buf[64];
+		int n;
+		switch (type)
+		{
+		case EMDL_DOUBLE:
+		{
+			DOUBLE d = doubles[objectID];
+			if ((ABS(d) > 0. && ABS(d) < 0.001) || ABS(d) > 100000.)
+				n = snprintf(buf, 64, "%.*e", precision, (double)d);
+			else
+				n = printFixed(buf, d, precision);
+			appendRightAligned(buffer, buf, n, 12);
+			break;
+		}
+		case EMDL_STRING:
+			appendRightAligned(buffer, strings[objectID].data(), strings[objectID].size(), 10);
+			break;
+		case EMDL_INT:
+			n = printInteger(buf, ints[objectID]);
+			appendRightAligned(buffer, buf, n, 12);
+			break;
+		case EMDL_LONG:
+			n = printInteger(buf, longs[objectID]);
+			appendRightAligned(buffer, buf, n, 12);
+			break;
+		default:
+			appendRightAligned(buffer, (bools[objectID] != 0) ? "1" : "0", 1, 12);
+			break;
+		}
+		return true;
+	}
+}
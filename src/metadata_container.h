@@ -46,6 +46,7 @@
 #define METADATA_CONTAINER_H
 
 #include <map>
+#include <vector>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -84,6 +85,12 @@ namespace relion
 		/** Copy constructor */
 		MetaDataContainer(const MetaDataContainer &MDc);
 
+		/** Move constructor: takes over the values of MDc, which is left empty */
+		MetaDataContainer(MetaDataContainer &&MDc) noexcept;
+
+		/** Move assignment: takes over the values of MDc, which is left empty */
+		MetaDataContainer& operator =(MetaDataContainer &&MDc);
+
 		/** Destructor */
 		~MetaDataContainer()
 		{
@@ -179,5 +186,116 @@ namespace relion
 		bool writeValueToStream(std::ostream &outstream, EMDLabel inputLabel);
 		bool writeValueToString(std::string &outString, EMDLabel inputLabel);
 	};
+
+	/** Contiguous storage of the values of a single label for all objects in a MetaDataTable
+	 *
+	 * Only the vector that corresponds to the type of the label is used.
+	 * The type is looked up once, so that access does not need any map lookups.
+	 */
+	class MetaDataColumn
+	{
+	public:
+		EMDLabel label;
+		EMDLabelType type;
+
+		std::vector<DOUBLE> doubles;
+		std::vector<int> ints;
+		std::vector<long int> longs;
+		std::vector<char> bools;
+		std::vector<std::string> strings;
+
+		// Whether each object has a value for this label
+		std::vector<char> has_value;
+
+		/** Column for nr_objects objects
+		 * If with_defaults, all objects get the default value of the type, otherwise they have no value
+		 */
+		MetaDataColumn(EMDLabel label, long int nr_objects, bool with_defaults);
+
+		long int size() const
+		{
+			return has_value.size();
+		}
+
+		bool hasValue(long int objectID) const
+		{
+			return has_value[objectID] != 0;
+		}
+
+		void clearValue(long int objectID)
+		{
+			has_value[objectID] = 0;
+		}
+
+		// Change the number of objects; new objects have no value
+		void resize(long int nr_objects);
+
+		// Remove one object
+		void erase(long int objectID);
+
+		// Re-order the objects: new object i is old object order[i]
+		void reorder(const std::vector<long int> &order);
+
+		/** Set the value for one object, and check the type of value against that of the label */
+#ifdef FLOAT_PRECISION
+		void setValue(long int objectID, const double &value);
+#endif
+		void setValue(long int objectID, const DOUBLE &value);
+		void setValue(long int objectID, const int &value);
+		void setValue(long int objectID, const long int &value);
+		void setValue(long int objectID, const bool &value);
+		void setValue(long int objectID, const std::string &value);
+		void setValueFromString(long int objectID, const std::string &value);
+		void setDefaultValue(long int objectID);
+
+		// Copy the value of object srcID in src (which should have the same label)
+		void copyValue(long int objectID, const MetaDataColumn &src, long int srcID);
+
+		/** Get the value of one object (which should have one, see hasValue)
+		 * Reports an error if the type of value does not match that of the label
+		 */
+		void getValue(long int objectID, DOUBLE &value) const
+		{
+			if (type != EMDL_DOUBLE)
+				typeError("DOUBLE");
+			value = doubles[objectID];
+		}
+		void getValue(long int objectID, int &value) const
+		{
+			if (type != EMDL_INT)
+				typeError("int");
+			value = ints[objectID];
+		}
+		void getValue(long int objectID, long int &value) const
+		{
+			if (type != EMDL_LONG)
+				typeError("long int");
+			value = longs[objectID];
+		}
+		void getValue(long int objectID, bool &value) const
+		{
+			if (type != EMDL_BOOL)
+				typeError("bool");
+			value = bools[objectID] != 0;
+		}
+		void getValue(long int objectID, std::string &value) const
+		{
+			if (type != EMDL_STRING)
+				typeError("string");
+			value = strings[objectID];
+		}
+
+		// Add the value of one object (if it has one) to a container
+		void addValueToContainer(long int objectID, MetaDataContainer &MDc) const;
+
+		/** Append the value of one object to buffer, formatted for a STAR loop
+		 * Numbers are printed with the given precision (as in fixed or scientific format) in 12 characters, strings in 10.
+		 * Returns false (and appends nothing) if the object has no value.
+		 */
+		bool appendValue(std::string &buffer, long int objectID, int precision = 6) const;
+
+	private:
+		void typeError(const std::string &type_name) const;
+	};
 }
 #endif
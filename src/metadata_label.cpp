@@ -47,13 +47,18 @@
 namespace relion
 {
 	//This is needed for static memory allocation
-	std::map<EMDLabel, EMDLabelData> EMDL::data;
+	EMDLabelData EMDL::data[EMDL_LAST_LABEL];
 	std::map<std::string, EMDLabel> EMDL::names;
 	std::map<std::string, std::string> EMDL::definitions;
+	std::vector<short> EMDL::name_table;
+	std::vector<unsigned int> EMDL::name_hashes;
+	unsigned int EMDL::name_mask = 0;
 	StaticInitialization EMDL::initialization; //Just for initialization
 
 	void EMDL::addLabel(EMDLabel label, EMDLabelType type, std::string name, std::string definition)
 	{
+		if (!isValidLabel(label))
+			REPORT_ERROR("EMDL::addLabel: label out of range for " + name);
 		data[label] = EMDLabelData(type, name);
 		names[name] = label;
 		definitions[name] = definition;
@@ -84,43 +89,88 @@ namespace relion
 
 
 
-	EMDLabel  EMDL::str2Label(const std::string &labelName)
+	// FNV-1a
+	unsigned int EMDL::hashName(const char *name, size_t length)
+	{
+		unsigned int hash = 2166136261u;
+		for (size_t i = 0; i < length; i++)
+			hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+		return hash;
+	}
+
+	void EMDL::buildNameTable()
 	{
-		if (names.find(labelName) == names.end())
+		unsigned int size = 64;
+		while (size < 4 * names.size())
+			size *= 2;
+		name_mask = size - 1;
+		name_table.assign(size, 0);
+		name_hashes.assign(size, 0);
+		for (std::map<std::string, EMDLabel>::const_iterator it = names.begin(); it != names.end(); ++it)
+		{
+			unsigned int hash = hashName(it->first.c_str(), it->first.size());
+			unsigned int slot = hash & name_mask;
+			while (name_table[slot] != 0)
+				slot = (slot + 1) & name_mask;
+			name_table[slot] = (short)(it->second + 1);
+			name_hashes[slot] = hash;
+		}
+	}
+
+	EMDLabel  EMDL::str2Label(const char *name, size_t length)
+	{
+		if (name_table.empty())
 			return EMDL_UNDEFINED;
-		return names[labelName];
+		unsigned int hash = hashName(name, length);
+		for (unsigned int slot = hash & name_mask; name_table[slot] != 0; slot = (slot + 1) & name_mask)
+		{
+			if (name_hashes[slot] != hash)
+				continue;
+			const std::string &str = data[name_table[slot] - 1].str;
+			if (str.size() == length && str.compare(0, length, name, length) == 0)
+				return (EMDLabel)(name_table[slot] - 1);
+		}
+		return EMDL_UNDEFINED;
+	}
+
+	EMDLabel  EMDL::str2Label(const std::string &labelName)
+	{
+		return str2Label(labelName.c_str(), labelName.size());
 	}//close function str2Label
 
 	std::string  EMDL::label2Str(const EMDLabel &label)
 	{
-		if (data.find(label) == data.end())
+		if (!isValidLabel(label))
 			return "";
 		return data[label].str;
 	}//close function label2Str
 
 	bool EMDL::isInt(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_INT);
+		return (isValidLabel(label) && data[label].type == EMDL_INT);
 	}
 	bool EMDL::isLong(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_LONG);
+		return (isValidLabel(label) && data[label].type == EMDL_LONG);
 	}
 	bool EMDL::isBool(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_BOOL);
+		return (isValidLabel(label) && data[label].type == EMDL_BOOL);
 	}
 	bool EMDL::isString(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_STRING);
+		return (isValidLabel(label) && data[label].type == EMDL_STRING);
 	}
 	bool EMDL::isDouble(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_DOUBLE);
+		return (isValidLabel(label) && data[label].type == EMDL_DOUBLE);
 	}
 	bool EMDL::isNumber(const EMDLabel &label)
 	{
-		return (data[label].type == EMDL_DOUBLE || data[label].type == EMDL_LONG || data[label].type == EMDL_INT);
+		if (!isValidLabel(label))
+			return false;
+		EMDLabelType type = data[label].type;
+		return (type == EMDL_DOUBLE || type == EMDL_LONG || type == EMDL_INT);
 	}
 
 	bool EMDL::isValidLabel(const EMDLabel &label)
@@ -46,6 +46,7 @@
 #define METADATA_LABEL_H
 
 #include <map>
+#include <vector>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -343,6 +344,8 @@ namespace relion
 		//
 
 		static EMDLabel str2Label(const std::string &labelName);
+		// The same for the length characters from name on (which need not be 0-terminated)
+		static EMDLabel str2Label(const char *name, size_t length);
 		static std::string label2Str(const EMDLabel &label);
 
 		static bool isInt(const EMDLabel &label);
@@ -357,9 +360,21 @@ namespace relion
 		static void printDefinitions(std::ostream& out);
 
 	private:
-		static std::map<EMDLabel, EMDLabelData> data;
+		// Type and name of every label, indexed by the label itself
+		static EMDLabelData data[EMDL_LAST_LABEL];
 		static std::map<std::string, EMDLabel> names;
 		static std::map<std::string, std::string> definitions;
+
+		/* Open-addressing hash table of all names, at most a quarter full: label + 1 per slot (0 = empty)
+		 * Built once all labels have been added, so that str2Label needs (nearly always) a single probe and
+		 * string comparison instead of a walk down the names map.
+		 */
+		static std::vector<short> name_table;
+		static std::vector<unsigned int> name_hashes;
+		static unsigned int name_mask;
+		static void buildNameTable();
+		static unsigned int hashName(const char *name, size_t length);
+
 		static StaticInitialization initialization; //Just for initialization
 
 		static void addLabel(EMDLabel label, EMDLabelType type, std::string name, std::string definition = "undocumented");
@@ -374,9 +389,10 @@ namespace relion
 	public:
 		EMDLabelType type;
 		std::string str;
-		//Default constructor
+		//Default constructor (for labels that were never added)
 		EMDLabelData()
 		{
+			type = EMDL_STRING;
 		}
 		EMDLabelData(EMDLabelType t, std::string s)
 		{
@@ -639,6 +655,7 @@ namespace relion
 			EMDL::addLabel(EMDL_SPECTRAL_IDX, EMDL_INT, "rlnSpectralIndex", "Spectral index (i.e. distance in pixels to the origin in Fourier space) ");
 
 
+			EMDL::buildNameTable();
 		}
 
 		~StaticInitialization()
@@ -43,76 +43,300 @@
  ***************************************************************************/
 
 #include "src/metadata_table.h"
+#include "src/thread_pool.h"
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
 
 namespace relion
 {
 	
 
-	// Label for sorting
-	static EMDLabel sortlabel;
-	bool compareString(MetaDataContainer *lh, MetaDataContainer *rh)
+	// Tables with fewer objects are sorted and reordered on one thread
+	#define METADATA_SORT_PARALLEL_MIN 65536
+
+	static int getSortThreads(long int nr_objects)
 	{
-		std::string lhstr, rhstr;
-		lh->getValue(sortlabel, lhstr);
-		rh->getValue(sortlabel, rhstr);
-		return lhstr < rhstr;
+#ifdef _OPENMP
+		if (nr_objects >= METADATA_SORT_PARALLEL_MIN)
+			return getTaskNrThreads(omp_get_max_threads());
+#endif
+		return 1;
 	}
-	bool compareStringNoAt(MetaDataContainer *lh, MetaDataContainer *rh)
+
+	// Order-preserving unsigned keys for the radix sort
+	static inline unsigned long long getRadixKey(long int value)
 	{
-		std::string lhstr, rhstr;
-		lh->getValue(sortlabel, lhstr);
-		rh->getValue(sortlabel, rhstr);
-		lhstr = lhstr.substr(lhstr.find("@") + 1);
-		rhstr = rhstr.substr(rhstr.find("@") + 1);
-		return lhstr < rhstr;
+		return (unsigned long long)value ^ (1ULL << 63);
 	}
-	bool compareDouble(MetaDataContainer *lh, MetaDataContainer *rh)
+
+	static inline unsigned long long getRadixKey(double value)
 	{
-		DOUBLE lhstr, rhstr;
-		lh->getValue(sortlabel, lhstr);
-		rh->getValue(sortlabel, rhstr);
-		return lhstr < rhstr;
+		value += 0.; // -0 as +0
+		unsigned long long bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return (bits >> 63) ? ~bits : bits ^ (1ULL << 63);
 	}
-	bool compareInteger(MetaDataContainer *lh, MetaDataContainer *rh)
+
+	/* Stable LSD radix sort of order on keys (keys[i] belongs to order[i]), 8 bits per pass
+	 * Every pass counts the digits per chunk of the array in parallel and scatters the chunks in parallel;
+	 * passes in which all keys have the same digit are skipped.
+	 */
+	static void radixSortOrder(std::vector<unsigned long long> &keys, std::vector<long int> &order, int nr_threads)
 	{
-		int lhstr, rhstr;
-		lh->getValue(sortlabel, lhstr);
-		rh->getValue(sortlabel, rhstr);
-		return lhstr < rhstr;
+		long int n = keys.size();
+		int nr_chunks = XMIPP_MAX(1, nr_threads);
+		std::vector<unsigned long long> keys_out(n);
+		std::vector<long int> order_out(n);
+		std::vector<long int> count(nr_chunks * 256);
+
+		for (int shift = 0; shift < 64; shift += 8)
+		{
+			std::fill(count.begin(), count.end(), 0);
+#pragma omp parallel for num_threads(nr_threads) schedule(static)
+			for (int c = 0; c < nr_chunks; c++)
+			{
+				long int *mycount = &count[c * 256];
+				for (long int i = n * c / nr_chunks; i < n * (c + 1) / nr_chunks; i++)
+					mycount[(keys[i] >> shift) & 255]++;
+			}
+
+			// Start of each digit for each chunk: all lower digits, then this digit in the earlier chunks
+			long int start = 0;
+			bool is_constant = false;
+			for (int d = 0; d < 256; d++)
+			{
+				long int total = 0;
+				for (int c = 0; c < nr_chunks; c++)
+				{
+					long int nd = count[c * 256 + d];
+					count[c * 256 + d] = start + total;
+					total += nd;
+				}
+				if (total == n)
+					is_constant = true;
+				start += total;
+			}
+			if (is_constant)
+				continue;
+
+#pragma omp parallel for num_threads(nr_threads) schedule(static)
+			for (int c = 0; c < nr_chunks; c++)
+			{
+				long int *mynext = &count[c * 256];
+				for (long int i = n * c / nr_chunks; i < n * (c + 1) / nr_chunks; i++)
+				{
+					long int dest = mynext[(keys[i] >> shift) & 255]++;
+					keys_out[dest] = keys[i];
+					order_out[dest] = order[i];
+				}
+			}
+			keys.swap(keys_out);
+			order.swap(order_out);
+		}
 	}
-	bool compareLong(MetaDataContainer *lh, MetaDataContainer *rh)
+
+	// Compares objects on the part of their strings from an offset on
+	class CompareStringsFrom
+	{
+		const std::vector<std::string> &strings;
+		const std::vector<size_t> &offsets;
+	public:
+		CompareStringsFrom(const std::vector<std::string> &_strings, const std::vector<size_t> &_offsets) :
+			strings(_strings), offsets(_offsets) {}
+		bool operator()(long int lh, long int rh) const
+		{
+			return strings[lh].compare(offsets[lh], std::string::npos, strings[rh], offsets[rh], std::string::npos) < 0;
+		}
+	};
+
+	// Stable parallel merge sort of order: chunks are sorted in parallel, then merged pairwise in parallel
+	template<class Compare>
+	static void mergeSortOrder(std::vector<long int> &order, const Compare &compare, int nr_threads)
 	{
-		long lhstr, rhstr;
-		lh->getValue(sortlabel, lhstr);
-		rh->getValue(sortlabel, rhstr);
-		return lhstr < rhstr;
+		long int n = order.size();
+		int nr_chunks = XMIPP_MAX(1, nr_threads);
+		std::vector<long int> bounds(nr_chunks + 1);
+		for (int c = 0; c <= nr_chunks; c++)
+			bounds[c] = n * c / nr_chunks;
+
+#pragma omp parallel for num_threads(nr_threads) schedule(static)
+		for (int c = 0; c < nr_chunks; c++)
+			std::stable_sort(order.begin() + bounds[c], order.begin() + bounds[c + 1], compare);
+
+		std::vector<long int> merged(n);
+		for (int width = 1; width < nr_chunks; width *= 2)
+		{
+			int nr_pairs = (nr_chunks + 2 * width - 1) / (2 * width);
+#pragma omp parallel for num_threads(nr_threads) schedule(static)
+			for (int p = 0; p < nr_pairs; p++)
+			{
+				long int first = bounds[2 * p * width];
+				long int middle = bounds[XMIPP_MIN(nr_chunks, (2 * p + 1) * width)];
+				long int last = bounds[XMIPP_MIN(nr_chunks, (2 * p + 2) * width)];
+				std::merge(order.begin() + first, order.begin() + middle, order.begin() + middle, order.begin() + last,
+					merged.begin() + first, compare);
+			}
+			order.swap(merged);
+		}
 	}
 
-	void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at)
+	void MetaDataTable::getSortOrder(const std::vector<EMDLabel> &labels, std::vector<long int> &order, bool do_sort_after_at) const
 	{
+		for (size_t ilabel = 0; ilabel < labels.size(); ilabel++)
+		{
+			EMDLabel label = labels[ilabel];
+			if (!(EMDL::isString(label) || EMDL::isDouble(label) || EMDL::isInt(label) || EMDL::isLong(label)))
+				REPORT_ERROR("Cannot sort this label: " + EMDL::label2Str(label));
+		}
+
+		order.resize(nr_objects);
+		for (long int i = 0; i < nr_objects; i++)
+			order[i] = i;
+		int nr_threads = getSortThreads(nr_objects);
 
-		sortlabel = label;
-		if (EMDL::isString(label))
+		// Least significant label first: each stable pass keeps the order of the later labels within its ties
+		for (int ilabel = (int)labels.size() - 1; ilabel >= 0; ilabel--)
 		{
-			if (do_sort_after_at)
-				std::stable_sort(objects.begin(), objects.end(), compareStringNoAt);
+			EMDLabel label = labels[ilabel];
+			int icol = column_of[label];
+			if (icol < 0)
+				continue; // all objects have the default value
+			const MetaDataColumn &column = columns[icol];
+
+			if (EMDL::isString(label))
+			{
+				// Objects without a value compare as "": an empty string without offset
+				static const std::string empty;
+				std::vector<size_t> offsets(nr_objects, 0);
+				std::vector<std::string> no_values;
+				bool has_all_values = true;
+				for (long int i = 0; i < nr_objects; i++)
+					if (!column.hasValue(i))
+						has_all_values = false;
+				const std::vector<std::string> *strings = &column.strings;
+				if (!has_all_values)
+				{
+					no_values = column.strings;
+					for (long int i = 0; i < nr_objects; i++)
+						if (!column.hasValue(i))
+							no_values[i] = empty;
+					strings = &no_values;
+				}
+				if (do_sort_after_at)
+				{
+#pragma omp parallel for num_threads(nr_threads)
+					for (long int i = 0; i < nr_objects; i++)
+					{
+						size_t at = (*strings)[i].find("@");
+						offsets[i] = (at == std::string::npos) ? 0 : at + 1;
+					}
+				}
+				mergeSortOrder(order, CompareStringsFrom(*strings, offsets), nr_threads);
+			}
 			else
-				std::stable_sort(objects.begin(), objects.end(), compareString);
-		}
-		else if (EMDL::isDouble(label))
-			std::stable_sort(objects.begin(), objects.end(), compareDouble);
-		else if (EMDL::isInt(label))
-			std::stable_sort(objects.begin(), objects.end(), compareInteger);
-		else if (EMDL::isLong(label))
-			std::stable_sort(objects.begin(), objects.end(), compareLong);
-		else
-			REPORT_ERROR("Cannot sort this label: " + EMDL::label2Str(label));
+			{
+				std::vector<unsigned long long> keys(nr_objects);
+#pragma omp parallel for num_threads(nr_threads)
+				for (long int i = 0; i < nr_objects; i++)
+				{
+					long int obj = order[i];
+					if (!column.hasValue(obj))
+						keys[i] = (EMDL::isDouble(label)) ? getRadixKey(0.) : getRadixKey(0L);
+					else if (EMDL::isDouble(label))
+						keys[i] = getRadixKey((double)column.doubles[obj]);
+					else if (EMDL::isInt(label))
+						keys[i] = getRadixKey((long int)column.ints[obj]);
+					else
+						keys[i] = getRadixKey(column.longs[obj]);
+				}
+				radixSortOrder(keys, order, nr_threads);
+			}
+		}
+	}
 
+	void MetaDataTable::newSort(const std::vector<EMDLabel> &labels, bool do_reverse, bool do_sort_after_at)
+	{
+		std::vector<long int> order;
+		getSortOrder(labels, order, do_sort_after_at);
 		if (do_reverse)
-			std::reverse(objects.begin(), objects.end());
+			std::reverse(order.begin(), order.end());
+		reorderObjects(order);
+	}
 
+	void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at)
+	{
+		std::vector<EMDLabel> labels(1, label);
+		newSort(labels, do_reverse, do_sort_after_at);
 	}
 
+	void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index)
+	{
+		if (!(EMDL::isInt(name) || EMDL::isLong(name) || EMDL::isDouble(name)))
+			REPORT_ERROR("MetadataTable::sort%% ERROR: can only sorted numbers");
+
+		std::vector<long int> order;
+		std::vector<EMDLabel> labels(1, name);
+		getSortOrder(labels, order);
+		if (do_reverse)
+			std::reverse(order.begin(), order.end());
+
+		if (only_set_index)
+		{
+			// Add an extra column with the sorted position of each entry
+			for (size_t j = 0; j < order.size(); j++)
+				setValue(EMDL_SORTED_IDX, (long int)j, order[j]);
+		}
+		else
+		{
+			// Change the actual order in the MetaDataTable
+			reorderObjects(order);
+		}
+		// return pointer to the beginning of the table
+		firstObject();
+	}
+
+	void MetaDataTable::reorderObjects(const std::vector<long int> &order)
+	{
+		int nr_threads = getSortThreads(nr_objects);
+#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].reorder(order);
+	}
+
+	MetaDataColumn& MetaDataTable::getColumn(EMDLabel label)
+	{
+		if (column_of[label] < 0)
+		{
+			column_of[label] = columns.size();
+			columns.push_back(MetaDataColumn(label, nr_objects, false));
+		}
+		return columns[column_of[label]];
+	}
+
+	MetaDataColumn& MetaDataTable::activateLabel(EMDLabel label)
+	{
+		MetaDataColumn &column = getColumn(label);
+		if (!containsLabel(label))
+		{
+			activeLabels.push_back(label);
+			// Add this label with default values to the rest of the objects in this class
+			for (long int idx = 0; idx < nr_objects; idx++)
+			{
+				if (!column.hasValue(idx))
+					column.setDefaultValue(idx);
+			}
+		}
+		return column;
+	}
 
 	MetaDataTable::MetaDataTable()
 	{
@@ -126,13 +350,9 @@ namespace relion
 		this->setName(MD.getName());
 		this->isList = MD.isList;
 		this->activeLabels = MD.activeLabels;
-		this->objects.clear();
-		this->objects.resize(MD.objects.size());
-		for (unsigned long int idx = 0; idx < MD.objects.size(); idx++)
-		{
-			//long int idx = this->addObject();
-			this->objects[idx] = new MetaDataContainer(*(MD.objects[idx]));
-		}
+		this->nr_objects = MD.nr_objects;
+		this->columns = MD.columns;
+		this->column_of = MD.column_of;
 		current_objectID = 0;
 
 	}
@@ -146,13 +366,9 @@ namespace relion
 			this->setName(MD.getName());
 			this->isList = MD.isList;
 			this->activeLabels = MD.activeLabels;
-			this->objects.clear();
-			this->objects.resize(MD.objects.size());
-			for (long int idx = 0; idx < MD.objects.size(); idx++)
-			{
-				//long int idx = this->addObject();
-				this->objects[idx] = new MetaDataContainer(*(MD.objects[idx]));
-			}
+			this->nr_objects = MD.nr_objects;
+			this->columns = MD.columns;
+			this->column_of = MD.column_of;
 			current_objectID = 0;
 		}
 		return *this;
@@ -170,26 +386,19 @@ namespace relion
 
 	bool MetaDataTable::isEmpty() const
 	{
-		return (objects.size() == 0);
+		return (nr_objects == 0);
 	}
 
 	long int MetaDataTable::numberOfObjects() const
 	{
-		return objects.size();
+		return nr_objects;
 	}
 
 	void MetaDataTable::clear()
 	{
-		for (unsigned long int i = 0; i < objects.size(); i++)
-		{
-			if (objects[i])
-			{
-				objects[i]->clear();
-				delete objects[i];
-			}
-		}
-
-		objects.clear();
+		nr_objects = 0;
+		columns.clear();
+		column_of.assign(EMDL_LAST_LABEL, -1);
 		comment.clear();
 		name.clear();
 
@@ -233,10 +442,11 @@ namespace relion
 		if (objectID == -1)
 			objectID = current_objectID;
 
-		if (objectID >= objects.size())
+		if (objectID >= nr_objects)
 			REPORT_ERROR("MetaDataTable::setValueFromString: objectID >= objects.size()");
 
-		objects[objectID]->addValueFromString(label, value);
+		if (EMDL::isValidLabel(label))
+			getColumn(label).setValueFromString(objectID, value);
 
 		return true;
 
@@ -260,11 +470,27 @@ namespace relion
 
 	void MetaDataTable::append(MetaDataTable &app)
 	{
-		// Go to the end of the table
-		current_objectID = objects.size();
-		FOR_ALL_OBJECTS_IN_METADATA_TABLE(app)
+		if (&app == this)
 		{
-			addObject(app.getObject());
+			MetaDataTable aux(app);
+			append(aux);
+			return;
+		}
+
+		// Copy whole columns, rather than one object at a time
+		long int offset = nr_objects;
+		nr_objects += app.nr_objects;
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].resize(nr_objects);
+		for (size_t icol = 0; icol < app.columns.size(); icol++)
+		{
+			const MetaDataColumn &appcol = app.columns[icol];
+			if (std::find(appcol.has_value.begin(), appcol.has_value.end(), 1) == appcol.has_value.end())
+				continue;
+			// Labels that were not active yet get default values for the existing objects (as in addObject)
+			MetaDataColumn &column = activateLabel(appcol.label);
+			for (long int i = 0; i < app.nr_objects; i++)
+				column.copyValue(offset + i, appcol, i);
 		}
 		// Reset pointer to the beginning of the table
 		current_objectID = 0;
@@ -285,84 +511,71 @@ namespace relion
 
 		if (objectID == -1)
 		{
-			result = objects.size();
-			objects.resize(result + 1);
+			result = nr_objects;
+			nr_objects++;
+			for (size_t icol = 0; icol < columns.size(); icol++)
+				columns[icol].resize(nr_objects);
 		}
 		else
 		{
-			if (objectID >= objects.size())
+			if (objectID >= nr_objects)
 				REPORT_ERROR("MetaDataTable::addObject: objectID >= objects.size()");
 
 			result = objectID;
-			// First free memory of old container if it existed
-			if (objects[result])
-			{
-				objects[result]->clear();
-				delete objects[result];
-			}
+			// First remove the values of the old object
+			for (size_t icol = 0; icol < columns.size(); icol++)
+				columns[icol].clearValue(result);
 		}
 
-		if (data == NULL)
-			objects[result] = new MetaDataContainer();
-		else
-			objects[result] = new MetaDataContainer(*(data));
-
 		// Set iterator pointing to the newly added object
 		current_objectID = result;
 
-		// Set default values for the existing labels
-		if (data == NULL)
+		// A new object without data has no values (also not for the existing labels)
+		if (data != NULL)
+			setObjectValues(data, result);
+
+		return result;
+	}
+
+	void MetaDataTable::setObjectValues(const MetaDataContainer * data, long int objectID)
+	{
+		// Set all the labels from the data MDC as active
+		MetaDataContainer &MDc = const_cast<MetaDataContainer &>(*data);
+		std::vector<EMDLabel> newlabels = MDc.getLabels();
+		for (size_t i = 0; i < newlabels.size(); i++)
 		{
-			/* Sjors 21nov2014: I don't see why this would be necessary...
-			std::vector<EMDLabel>::iterator It;
-			for (It = activeLabels.begin(); It != activeLabels.end(); It++)
+			EMDLabel label = newlabels[i];
+			MetaDataColumn &column = activateLabel(label);
+			switch (column.type)
 			{
-				(objects[result])->addDefaultValue(*It);
-			}
-			*/
-		}
-		else
-		{
-			// Set all the labels from the data MDC as active
-			std::vector<EMDLabel> newlabels;
-			newlabels = data->getLabels();
-			for (int i = 0; i < newlabels.size(); i++)
+			case EMDL_DOUBLE: MDc.getValue(label, column.doubles[objectID]); break;
+			case EMDL_INT: MDc.getValue(label, column.ints[objectID]); break;
+			case EMDL_LONG: MDc.getValue(label, column.longs[objectID]); break;
+			case EMDL_BOOL:
 			{
-				std::vector<EMDLabel>::iterator location;
-				EMDLabel label = newlabels[i];
-				location = std::find(activeLabels.begin(), activeLabels.end(), label);
-				if (location == activeLabels.end())
-				{
-					activeLabels.push_back(label);
-
-					// Add this label to the rest of the objects in this class
-					for (long int idx = 0; idx < objects.size(); idx++)
-					{
-						if (idx != result)
-							objects[idx]->addDefaultValue(label);
-					}
-				}
+				bool value;
+				MDc.getValue(label, value);
+				column.bools[objectID] = value;
+				break;
+			}
+			default: MDc.getValue(label, column.strings[objectID]); break;
 			}
+			column.has_value[objectID] = 1;
 		}
-
-		return result;
 	}
 
 	long int MetaDataTable::removeObject(long int objectID)
 	{
 		long int i = (objectID == -1) ? current_objectID : objectID;
 
-		if (objects[i])
-		{
-			objects[i]->clear();
-			delete objects[i];
-		}
-		objects.erase(objects.begin() + i);
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].erase(i);
+		nr_objects--;
 
 		return lastObject();
 	}
 
-	MetaDataContainer * MetaDataTable::getObject(const long int objectID) const
+	MetaDataContainer MetaDataTable::getObject(const long int objectID) const
 	{
 		if (isEmpty())
 		{
@@ -370,28 +583,18 @@ namespace relion
 			REPORT_ERROR("Requested objectID not found (no objects stored). Exiting... ");
 		}
 
-		MetaDataContainer * aux;
-		if (objectID == -1)
-			aux = objects[current_objectID];
-		else
-		{
-#ifdef DEBUG_CHECKSIZES
-			if (objectID >= objects.size())
-			{
-				std::cerr << "objectID= " << objectID << " objects.size()= " << objects.size() << std::endl;
-				REPORT_ERROR("MetaDataTable::getObject: objectID >= objects.size()");
-			}
-#endif
-			aux = objects[objectID];
-		}
-
-		if (aux == NULL)
+		long int idx = (objectID == -1) ? current_objectID : objectID;
+		if (idx < 0 || idx >= nr_objects)
 		{
 			// This objectID does not exist, finish execution
 			REPORT_ERROR("Requested objectID not found. Exiting... ");
 		}
 
-		return aux;
+		MetaDataContainer object;
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].addValueToContainer(idx, object);
+
+		return object;
 	}
 
 	void MetaDataTable::setObject(MetaDataContainer * data, long int objectID)
@@ -400,40 +603,15 @@ namespace relion
 		long int idx = (objectID == -1) ? current_objectID : objectID;
 
 #ifdef DEBUG_CHECKSIZES
-		if (idx >= objects.size())
+		if (idx >= nr_objects)
 			REPORT_ERROR("MetaDataTable::setObject: idx >= objects.size()");
 #endif
 
-		// First delete old container if it exists
-		if (this->objects[idx])
-		{
-			this->objects[idx]->clear();
-			delete this->objects[idx];
-		}
-		this->objects[idx] = new MetaDataContainer(*data);
-
-		// Set all the labels from the data MDC as active
-		std::vector<EMDLabel>::iterator location;
-		std::vector<EMDLabel> newlabels;
-		newlabels = data->getLabels();
-		for (int i = 0; i < newlabels.size(); i++)
-		{
-			EMDLabel label = newlabels[i];
-			location = std::find(activeLabels.begin(), activeLabels.end(), label);
-			if (location == activeLabels.end())
-			{
-				activeLabels.push_back(label);
-
-				// Add this label with default values to the rest of the objects in this class
-				for (long int idx2 = 0; idx2 < objects.size(); idx2++)
-				{
-					if (idx2 != idx)
-						objects[idx2]->addDefaultValue(label);
-				}
-			}
-		}
-
+		// First remove the values of the old object
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].clearValue(idx);
 
+		setObjectValues(data, idx);
 	}
 
 	long int MetaDataTable::firstObject()
@@ -461,7 +639,7 @@ namespace relion
 		{
 			current_objectID++;
 
-			if (current_objectID < objects.size())
+			if (current_objectID < nr_objects)
 			{
 				result = current_objectID;
 			}
@@ -487,7 +665,7 @@ namespace relion
 
 		if (!isEmpty())
 		{
-			result = objects.size() - 1;
+			result = nr_objects - 1;
 			current_objectID = result;
 		}
 		else
@@ -502,7 +680,7 @@ namespace relion
 
 	long int MetaDataTable::goToObject(long int objectID)
 	{
-		if (objectID < objects.size())
+		if (objectID < nr_objects)
 		{
 			current_objectID = objectID;
 			return current_objectID;
@@ -513,6 +691,153 @@ namespace relion
 		}
 	}
 
+	// Whitespace that separates the values on a line of a STAR loop
+	static inline bool isStarSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	// A line [p, e) of a loop is empty (end of the loop), a comment, or a data line
+	static inline int starLineType(const char *p, const char *e)
+	{
+		while (p < e && isStarSpace(*p))
+			p++;
+		if (p == e)
+			return 0;
+		return (*p == '#') ? 1 : 2;
+	}
+
+	// Exact powers of ten for the fast path of parseStarDouble
+	static const double star_powers_of_ten[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	/* Convert [s, e) to a double without a stream or a copy
+	 * Numbers with at most 15 significant digits and a small exponent (all numbers that RELION writes)
+	 * are converted exactly with a single multiplication or division; anything else goes through strtod.
+	 */
+	static double parseStarDouble(const char *s, const char *e)
+	{
+		const char *p = s;
+		bool negative = false;
+		if (p < e && (*p == '-' || *p == '+'))
+			negative = (*p++ == '-');
+
+		unsigned long long mantissa = 0;
+		int nr_digits = 0, exponent = 0;
+		bool has_digits = false;
+		for (; p < e && *p >= '0' && *p <= '9'; p++)
+		{
+			has_digits = true;
+			if (nr_digits < 19)
+			{
+				mantissa = 10 * mantissa + (*p - '0');
+				if (mantissa != 0)
+					nr_digits++;
+			}
+			else
+				exponent++;
+		}
+		if (p < e && *p == '.')
+		{
+			for (p++; p < e && *p >= '0' && *p <= '9'; p++)
+			{
+				has_digits = true;
+				if (nr_digits < 19)
+				{
+					mantissa = 10 * mantissa + (*p - '0');
+					if (mantissa != 0)
+						nr_digits++;
+					exponent--;
+				}
+			}
+		}
+		if (has_digits && p < e && (*p == 'e' || *p == 'E'))
+		{
+			const char *q = p + 1;
+			bool negative_exponent = false;
+			if (q < e && (*q == '-' || *q == '+'))
+				negative_exponent = (*q++ == '-');
+			if (q < e && *q >= '0' && *q <= '9')
+			{
+				int exp = 0;
+				for (; q < e && *q >= '0' && *q <= '9'; q++)
+					exp = (exp < 10000) ? 10 * exp + (*q - '0') : exp;
+				exponent += negative_exponent ? -exp : exp;
+				p = q;
+			}
+		}
+
+		if (has_digits && p == e && nr_digits <= 15 && exponent >= -22 && exponent <= 22)
+		{
+			double value = (double)mantissa;
+			value = (exponent < 0) ? value / star_powers_of_ten[-exponent] : value * star_powers_of_ten[exponent];
+			return negative ? -value : value;
+		}
+
+		// Slow path (long mantissas, large exponents, inf, nan, garbage)
+		std::string token(s, e);
+		return strtod(token.c_str(), NULL);
+	}
+
+	// Convert the integer at the start of [p, e), like istream >> int does
+	static long long parseStarInteger(const char *p, const char *e)
+	{
+		bool negative = false;
+		if (p < e && (*p == '-' || *p == '+'))
+			negative = (*p++ == '-');
+		long long value = 0;
+		for (; p < e && *p >= '0' && *p <= '9'; p++)
+			value = 10 * value + (*p - '0');
+		return negative ? -value : value;
+	}
+
+	/* Parse the data lines in [begin, end), the first of which is object first_object
+	 * column_for_position has the column for every value on a line (NULL for ignored columns)
+	 */
+	static void parseStarLoopLines(const char *begin, const char *end, long int first_object,
+		const std::vector<MetaDataColumn *> &column_for_position)
+	{
+		long int object = first_object;
+		const char *line = begin;
+		while (line < end)
+		{
+			const char *line_end = (const char *)memchr(line, '\n', end - line);
+			if (line_end == NULL)
+				line_end = end;
+
+			if (starLineType(line, line_end) == 2)
+			{
+				const char *p = line;
+				for (size_t pos = 0; pos < column_for_position.size(); pos++)
+				{
+					while (p < line_end && isStarSpace(*p))
+						p++;
+					if (p == line_end || *p == '#')
+						break; // missing values, or the rest of the line is a comment
+					const char *token = p;
+					while (p < line_end && !isStarSpace(*p))
+						p++;
+
+					MetaDataColumn *column = column_for_position[pos];
+					if (column == NULL)
+						continue;
+					switch (column->type)
+					{
+					case EMDL_DOUBLE: column->doubles[object] = (DOUBLE)parseStarDouble(token, p); break;
+					case EMDL_INT: column->ints[object] = (int)parseStarInteger(token, p); break;
+					case EMDL_LONG: column->longs[object] = (long int)parseStarInteger(token, p); break;
+					case EMDL_BOOL: column->bools[object] = (parseStarInteger(token, p) != 0); break;
+					default: column->strings[object].assign(token, p); break;
+					}
+					column->has_value[object] = 1;
+				}
+				object++;
+			}
+
+			line = line_end + 1;
+		}
+	}
+
 	void MetaDataTable::readStarLoop(std::ifstream& in, std::vector<EMDLabel> *desiredLabels)
 	{
 		setIsList(false);
@@ -520,12 +845,14 @@ namespace relion
 		//Read column labels
 		int labelPosition = 0;
 		EMDLabel label;
-		std::string line, token, value;
+		std::string raw_line, line, token, value;
+		std::vector<EMDLabel> position_labels;
+		bool have_data_line = false;
 
 		// First read all the column labels
-		while (getline(in, line, '\n'))
+		while (getline(in, raw_line, '\n'))
 		{
-			line = simplify(line);
+			line = simplify(raw_line);
 			// TODO: handle comments...
 			if (line[0] == '#' || line[0] == '\0' || line[0] == ';')
 				continue;
@@ -547,49 +874,106 @@ namespace relion
 				}
 				else
 					activeLabels.push_back(label);
+				position_labels.push_back(label);
 
 				labelPosition++;
 			}
 			else // found first data line
 			{
+				have_data_line = true;
 				break;
 			}
 		}
+		if (!have_data_line)
+			return;
 
-		// Then fill the table (dont read another line until the one from above has been handled)
-		bool is_first = true;
-		while (is_first || getline(in, line, '\n'))
+		// Position of the first data line in the file, to put the stream back at the end of the table afterwards
+		std::streamoff data_start = in.eof() ? 0 : (std::streamoff)in.tellg() - (std::streamoff)(raw_line.size() + 1);
+
+		// Then read the data lines in large blocks, up to the empty line that ends the table (or the end of the file).
+		// While looking for the end, remember where each chunk of ~1MB of lines starts and which object it begins with.
+		// This reads past the end of the table, so the stream is put back there once the end has been found.
+		const size_t read_size = 16 << 20, chunk_size = 1 << 20;
+		std::vector<char> buffer(raw_line.begin(), raw_line.end());
+		buffer.push_back('\n'); // the first data line has been read already
+
+		std::vector<size_t> chunk_start(1, 0);
+		std::vector<long int> chunk_object(1, nr_objects);
+		long int object = nr_objects;
+		size_t scanned = 0, block_end = 0;
+		bool found_end = false;
+		while (true)
 		{
-			is_first = false;
-			line = simplify(line);
-			// Stop at empty line
-			if (line[0] == '\0')
-				break;
-
-			// Add a new line to the table
-			addObject();
-
-			// Parse data values
-			std::stringstream os2(line);
-			std::string value;
-			labelPosition = 0;
-			int counterIgnored = 0;
-			while (os2 >> value)
+			const char *data = &buffer[0];
+			while (scanned < buffer.size())
 			{
-				// TODO: handle comments here...
-				if (std::find(ignoreLabels.begin(), ignoreLabels.end(), labelPosition) != ignoreLabels.end())
+				const char *nl = (const char *)memchr(data + scanned, '\n', buffer.size() - scanned);
+				if (nl == NULL)
+					break;
+				int type = starLineType(data + scanned, nl);
+				if (type == 0)
 				{
-					// Ignore this column
-					counterIgnored++;
-					labelPosition++;
-					continue;
+					found_end = true;
+					break;
 				}
-				setValueFromString(activeLabels[labelPosition - counterIgnored], value);
-				labelPosition++;
+				if (scanned - chunk_start.back() >= chunk_size)
+				{
+					chunk_start.push_back(scanned);
+					chunk_object.push_back(object);
+				}
+				if (type == 2)
+					object++;
+				scanned = nl - data + 1;
 			}
+			if (found_end || !in.good())
+				break;
 
+			size_t old_size = buffer.size();
+			buffer.resize(old_size + read_size);
+			in.read(&buffer[old_size], read_size);
+			buffer.resize(old_size + in.gcount());
+		}
+		if (found_end)
+		{
+			block_end = scanned;
+		}
+		else
+		{
+			// The file may not end with a newline
+			block_end = buffer.size();
+			if (scanned < block_end && starLineType(&buffer[scanned], &buffer[0] + block_end) == 2)
+				object++;
+		}
+		chunk_start.push_back(block_end);
+
+		// Leave the stream at the empty line that ends the table, as reading it line by line would have
+		in.clear();
+		if (found_end)
+			in.seekg(data_start + (std::streamoff)block_end);
+		else
+			in.seekg(0, std::ios::end);
+
+		// Make room for the new objects, and look up the column for every position on a line
+		long int nr_new_objects = object - nr_objects;
+		nr_objects = object;
+		for (size_t icol = 0; icol < columns.size(); icol++)
+			columns[icol].resize(nr_objects);
+		std::vector<MetaDataColumn *> column_for_position(position_labels.size(), (MetaDataColumn *)NULL);
+		for (size_t pos = 0; pos < position_labels.size(); pos++)
+		{
+			if (position_labels[pos] != EMDL_UNDEFINED)
+				column_for_position[pos] = &getColumn(position_labels[pos]);
 		}
 
+		// Parse the chunks in parallel: each chunk writes its own objects in the columns
+		int nr_chunks = chunk_start.size() - 1;
+		const char *data = &buffer[0];
+#pragma omp parallel for schedule(dynamic)
+		for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
+			parseStarLoopLines(data + chunk_start[ichunk], data + chunk_start[ichunk + 1], chunk_object[ichunk], column_for_position);
+
+		if (nr_new_objects > 0)
+			current_objectID = nr_objects - 1;
 	}
 
 	bool MetaDataTable::readStarList(std::ifstream& in, std::vector<EMDLabel> *desiredLabels)
@@ -616,7 +1000,7 @@ namespace relion
 			// Get label-value pairs
 			if (firstword[0] == '_')
 			{
-				label = EMDL::str2Label(firstword.substr(1)); // get rid of leading underscore
+				label = EMDL::str2Label(firstword.c_str() + 1, firstword.size() - 1); // get rid of leading underscore
 				if (words.size() != 2)
 					REPORT_ERROR("MetaDataTable::readStarList: did not encounter a single word after " + firstword);
 				value = words[1];
@@ -660,7 +1044,8 @@ namespace relion
 		clear();
 		bool also_has_loop;
 
-		// Start reading the ifstream at the top
+		// Start reading the ifstream at the top (a previous read may have left it at the end of the file)
+		in.clear();
 		in.seekg(0);
 
 		// Proceed until the next data_ or _loop statement
@@ -701,6 +1086,320 @@ namespace relion
 		return 0;
 	}
 
+	bool MetaDataTable::use_star_cache = false;
+
+	void MetaDataTable::setStarCache(bool do_cache)
+	{
+		use_star_cache = do_cache;
+	}
+
+	// Identifies the format (and its version) of a binary cache of a STAR table
+	static const char star_cache_magic[8] = { 'R', 'L', 'N', 'S', 'T', 'A', 'R', 'C' };
+	static const int star_cache_version = 1;
+
+	// Size and modification time of a file, to check whether a cache is stale
+	static bool getStarFileStamp(const FileName &fn, long long &size, long long &mtime_sec, long long &mtime_nsec)
+	{
+		struct stat info;
+		if (stat(fn.c_str(), &info) != 0)
+			return false;
+		size = info.st_size;
+		mtime_sec = info.st_mtime;
+#if defined(__linux__)
+		mtime_nsec = info.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+		mtime_nsec = info.st_mtimespec.tv_nsec;
+#else
+		mtime_nsec = 0;
+#endif
+		return true;
+	}
+
+	FileName MetaDataTable::getStarCacheName(const FileName &fn_star, const std::string &name)
+	{
+		return (name == "") ? fn_star + ".cache" : fn_star + "." + name + ".cache";
+	}
+
+	template<class T>
+	static void writeCacheValue(FILE *fh, const T &value)
+	{
+		fwrite(&value, sizeof(T), 1, fh);
+	}
+
+	static void writeCacheString(FILE *fh, const std::string &str)
+	{
+		writeCacheValue(fh, (int)str.size());
+		fwrite(str.data(), 1, str.size(), fh);
+	}
+
+	template<class T>
+	static void writeCacheArray(FILE *fh, const std::vector<T> &v)
+	{
+		if (v.size() > 0)
+			fwrite(&v[0], sizeof(T), v.size(), fh);
+	}
+
+	void MetaDataTable::writeStarCache(const FileName &fn_star, const std::string &name, int read_result,
+		long long size, long long mtime_sec, long long mtime_nsec) const
+	{
+		// Write to a unique temporary file and rename it, so that other processes never see a partial cache
+		FileName fn_cache = getStarCacheName(fn_star, name);
+		FileName fn_tmp = fn_cache + "." + integerToString(getpid()) + ".tmp";
+		FILE *fh = fopen(fn_tmp.c_str(), "wb");
+		if (fh == NULL)
+			return; // e.g. a read-only directory: simply do without a cache
+
+		fwrite(star_cache_magic, 1, 8, fh);
+		writeCacheValue(fh, star_cache_version);
+		writeCacheValue(fh, (int)sizeof(DOUBLE));
+		writeCacheValue(fh, size);
+		writeCacheValue(fh, mtime_sec);
+		writeCacheValue(fh, mtime_nsec);
+		writeCacheValue(fh, read_result);
+		writeCacheValue(fh, (long long)nr_objects);
+		writeCacheValue(fh, (int)isList);
+		writeCacheString(fh, this->name);
+		writeCacheString(fh, comment);
+
+		// Schema: labels by name, since the EMDLabel values may change between versions
+		writeCacheValue(fh, (int)activeLabels.size());
+		for (size_t i = 0; i < activeLabels.size(); i++)
+			writeCacheString(fh, EMDL::label2Str(activeLabels[i]));
+		writeCacheValue(fh, (int)columns.size());
+		for (size_t icol = 0; icol < columns.size(); icol++)
+		{
+			const MetaDataColumn &column = columns[icol];
+			writeCacheString(fh, EMDL::label2Str(column.label));
+			writeCacheValue(fh, (int)column.type);
+			writeCacheArray(fh, column.has_value);
+			switch (column.type)
+			{
+			case EMDL_DOUBLE: writeCacheArray(fh, column.doubles); break;
+			case EMDL_INT: writeCacheArray(fh, column.ints); break;
+			case EMDL_LONG:
+			{
+				// long int has a different size on different platforms
+				std::vector<long long> longs(column.longs.begin(), column.longs.end());
+				writeCacheArray(fh, longs);
+				break;
+			}
+			case EMDL_BOOL: writeCacheArray(fh, column.bools); break;
+			default:
+			{
+				std::vector<int> lengths(nr_objects);
+				for (long int i = 0; i < nr_objects; i++)
+					lengths[i] = column.strings[i].size();
+				writeCacheArray(fh, lengths);
+				for (long int i = 0; i < nr_objects; i++)
+					fwrite(column.strings[i].data(), 1, lengths[i], fh);
+				break;
+			}
+			}
+		}
+
+		bool ok = (ferror(fh) == 0);
+		ok = (fclose(fh) == 0) && ok;
+		if (ok)
+		{
+			// rename does not replace an existing file on Windows
+			remove(fn_cache.c_str());
+			ok = (rename(fn_tmp.c_str(), fn_cache.c_str()) == 0);
+		}
+		if (!ok)
+			remove(fn_tmp.c_str());
+	}
+
+	// Sequential reading from a cache in memory, with bounds checking
+	class StarCacheReader
+	{
+		const char *p, *end;
+	public:
+		bool ok;
+
+		StarCacheReader(const char *data, size_t size) : p(data), end(data + size), ok(true) {}
+
+		size_t remaining() const
+		{
+			return end - p;
+		}
+
+		const char* take(size_t nbytes)
+		{
+			if (!ok || (size_t)(end - p) < nbytes)
+			{
+				ok = false;
+				return NULL;
+			}
+			const char *result = p;
+			p += nbytes;
+			return result;
+		}
+
+		template<class T>
+		T value()
+		{
+			T result = T();
+			const char *src = take(sizeof(T));
+			if (src != NULL)
+				memcpy(&result, src, sizeof(T));
+			return result;
+		}
+
+		std::string string()
+		{
+			int length = value<int>();
+			const char *src = (length >= 0) ? take(length) : NULL;
+			return (src == NULL) ? std::string("") : std::string(src, length);
+		}
+
+		template<class T>
+		void array(std::vector<T> &v, size_t n)
+		{
+			v.resize(n);
+			const char *src = take(n * sizeof(T));
+			if (src != NULL && n > 0)
+				memcpy(&v[0], src, n * sizeof(T));
+		}
+	};
+
+	bool MetaDataTable::readStarCache(const FileName &fn_star, const std::string &name, int &read_result)
+	{
+		long long size, mtime_sec, mtime_nsec;
+		if (!getStarFileStamp(fn_star, size, mtime_sec, mtime_nsec))
+			return false;
+
+		FileName fn_cache = getStarCacheName(fn_star, name);
+		FILE *fh = fopen(fn_cache.c_str(), "rb");
+		if (fh == NULL)
+			return false;
+		fseek(fh, 0, SEEK_END);
+		long int cache_size = ftell(fh);
+		if (cache_size <= 0)
+		{
+			fclose(fh);
+			return false;
+		}
+
+		const char *data;
+#ifndef _WIN32
+		void *map = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+		if (map == MAP_FAILED)
+		{
+			fclose(fh);
+			return false;
+		}
+		data = (const char*)map;
+#else
+		std::vector<char> contents(cache_size);
+		fseek(fh, 0, SEEK_SET);
+		if (fread(&contents[0], cache_size, 1, fh) != 1)
+		{
+			fclose(fh);
+			return false;
+		}
+		data = &contents[0];
+#endif
+
+		StarCacheReader cache(data, cache_size);
+		const char *magic = cache.take(8);
+		bool valid = magic != NULL && memcmp(magic, star_cache_magic, 8) == 0 &&
+			cache.value<int>() == star_cache_version &&
+			cache.value<int>() == (int)sizeof(DOUBLE) &&
+			cache.value<long long>() == size &&
+			cache.value<long long>() == mtime_sec &&
+			cache.value<long long>() == mtime_nsec;
+
+		// The stamp matches, so from here on a bad value means a corrupt cache rather than a stale one
+		bool corrupt = false;
+		if (valid)
+		{
+			read_result = cache.value<int>();
+			long long nr_cached = cache.value<long long>();
+			// Every object has at least one byte (its presence flag) in every column
+			corrupt = nr_cached < 0 || (unsigned long long)nr_cached > cache.remaining();
+			nr_objects = (corrupt) ? 0 : nr_cached;
+			isList = (cache.value<int>() != 0);
+			this->name = cache.string();
+			comment = cache.string();
+
+			int nr_active = cache.value<int>();
+			for (int i = 0; i < nr_active && cache.ok; i++)
+			{
+				EMDLabel label = EMDL::str2Label(cache.string());
+				valid = valid && EMDL::isValidLabel(label);
+				activeLabels.push_back(label);
+			}
+			int nr_columns = cache.value<int>();
+			for (int icol = 0; icol < nr_columns && cache.ok && valid && !corrupt; icol++)
+			{
+				EMDLabel label = EMDL::str2Label(cache.string());
+				int type = cache.value<int>();
+				if (!EMDL::isValidLabel(label) || column_of[label] >= 0)
+				{
+					valid = false;
+					break;
+				}
+				MetaDataColumn &column = getColumn(label);
+				if (column.type != type)
+				{
+					// The type of a label has changed since the cache was written
+					valid = false;
+					break;
+				}
+				if ((unsigned long long)nr_objects > cache.remaining())
+				{
+					corrupt = true;
+					break;
+				}
+				cache.array(column.has_value, nr_objects);
+				switch (column.type)
+				{
+				case EMDL_DOUBLE: cache.array(column.doubles, nr_objects); break;
+				case EMDL_INT: cache.array(column.ints, nr_objects); break;
+				case EMDL_LONG:
+				{
+					std::vector<long long> longs;
+					cache.array(longs, nr_objects);
+					column.longs.assign(longs.begin(), longs.end());
+					break;
+				}
+				case EMDL_BOOL: cache.array(column.bools, nr_objects); break;
+				default:
+				{
+					std::vector<int> lengths;
+					cache.array(lengths, nr_objects);
+					for (long int i = 0; i < nr_objects && cache.ok; i++)
+					{
+						const char *src = (lengths[i] >= 0) ? cache.take(lengths[i]) : NULL;
+						if (src != NULL)
+							column.strings[i].assign(src, lengths[i]);
+					}
+					break;
+				}
+				}
+			}
+			valid = valid && cache.ok;
+		}
+
+#ifndef _WIN32
+		munmap(map, cache_size);
+#endif
+		fclose(fh);
+
+		if (corrupt)
+		{
+			clear();
+			REPORT_ERROR((std::string)"MetaDataTable::readStarCache: the number of objects in " + fn_cache +
+				" does not fit its size; remove the corrupt cache");
+		}
+		if (!valid)
+			clear();
+		else
+			current_objectID = nr_objects - 1; // as after readStar
+
+		return valid;
+	}
+
 	int MetaDataTable::read(const FileName &filename, const std::string &name, std::vector<EMDLabel> *desiredLabels)
 	{
 
@@ -715,7 +1414,17 @@ namespace relion
 		if (ext == "star")
 		{
 			//REPORT_ERROR("readSTAR not implemented yet...");
-			return readStar(in, name, desiredLabels);
+			// The cache always has all labels, so it is not used for reading a selection of them
+			long long size, mtime_sec, mtime_nsec;
+			bool do_cache = use_star_cache && desiredLabels == NULL && getStarFileStamp(filename, size, mtime_sec, mtime_nsec);
+			int result;
+			if (do_cache && readStarCache(filename, name, result))
+				return result;
+
+			result = readStar(in, name, desiredLabels);
+			if (do_cache)
+				writeStarCache(filename, name, result, size, mtime_sec, mtime_nsec);
+			return result;
 		}
 		else
 		{
@@ -757,29 +1466,57 @@ namespace relion
 				}
 			}
 
-			// Write actual data block
-			for (long int idx = 0; idx < objects.size(); idx++)
+			// Look up the columns of the active labels only once (NULL if not stored)
+			std::vector<const MetaDataColumn *> write_columns;
+			const MetaDataColumn *comment_column = NULL;
+			for (strIt = activeLabels.begin(); strIt != activeLabels.end(); strIt++)
 			{
-				entryComment = "";
-				for (strIt = activeLabels.begin(); strIt != activeLabels.end(); strIt++)
+				const MetaDataColumn *column = (column_of[*strIt] < 0) ? NULL : &columns[column_of[*strIt]];
+				if (*strIt == EMDL_COMMENT)
+					comment_column = column;
+				else if (*strIt != EMDL_SORTED_IDX)
+					write_columns.push_back(column);
+			}
+
+			// Write actual data block: chunks of objects are formatted in parallel into text buffers,
+			// which are then written in order (and re-used for the next chunks)
+			const long int chunk_size = 4096;
+			int nr_buffers = 1;
+#ifdef _OPENMP
+			if (nr_objects > chunk_size)
+				nr_buffers = 4 * omp_get_max_threads();
+#endif
+			std::vector<std::string> buffers(nr_buffers);
+			int precision = out.precision();
+			for (long int first = 0; first < nr_objects; first += nr_buffers * chunk_size)
+			{
+				int nr_chunks = XMIPP_MIN((long int)nr_buffers, (nr_objects - first + chunk_size - 1) / chunk_size);
+#pragma omp parallel for schedule(dynamic) if (nr_chunks > 1)
+				for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
 				{
-					if (*strIt != EMDL_COMMENT && *strIt != EMDL_SORTED_IDX)
-						//if (*strIt != EMDL_COMMENT)
+					long int begin = first + ichunk * chunk_size;
+					long int end = XMIPP_MIN(nr_objects, begin + chunk_size);
+					std::string &buffer = buffers[ichunk];
+					buffer.clear();
+					for (long int idx = begin; idx < end; idx++)
 					{
-						out.width(10);
-						objects[idx]->writeValueToStream(out, *strIt);
-						out << " ";
-					}
-					if (*strIt == EMDL_COMMENT)
-					{
-						objects[idx]->getValue(EMDL_COMMENT, entryComment);
+						for (size_t i = 0; i < write_columns.size(); i++)
+						{
+							if (write_columns[i] != NULL && write_columns[i]->appendValue(buffer, idx, precision))
+								buffer += ' ';
+							else
+								buffer.append(10, ' '); // as when the stream width is still that for the missing value
+						}
+						if (comment_column != NULL && comment_column->hasValue(idx) && comment_column->strings[idx] != "")
+						{
+							buffer += "# ";
+							buffer += comment_column->strings[idx];
+						}
+						buffer += '\n';
 					}
 				}
-				if (entryComment != std::string(""))
-				{
-					out << "# " << entryComment;
-				}
-				out << "\n";
+				for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
+					out.write(buffers[ichunk].data(), buffers[ichunk].size());
 			}
 			// Finish table with a white-line
 			out << " \n";
@@ -788,7 +1525,7 @@ namespace relion
 		else
 		{
 			// Get first object. In this case (row format) there is a single object
-			MetaDataContainer * object = getObject();
+			MetaDataContainer object = getObject();
 
 			entryComment = "";
 			int maxWidth = 10;
@@ -801,7 +1538,7 @@ namespace relion
 						maxWidth = w;
 				}
 				else
-					object->getValue(EMDL_COMMENT, entryComment);
+					object.getValue(EMDL_COMMENT, entryComment);
 			}
 
 			for (strIt = activeLabels.begin(); strIt != activeLabels.end(); strIt++)
@@ -810,7 +1547,7 @@ namespace relion
 				{
 					int w = EMDL::label2Str(*strIt).length();
 					out << "_" << EMDL::label2Str(*strIt) << std::setw(12 + maxWidth - w) << " ";
-					object->writeValueToStream(out, *strIt);
+					object.writeValueToStream(out, *strIt);
 					out << "\n";
 				}
 			}
@@ -838,8 +1575,20 @@ namespace relion
 	void MetaDataTable::writeValueToString(std::string & result,
 		const std::string &inputLabel)
 	{
-		MetaDataContainer * aux = getObject();
-		aux->writeValueToString(result, EMDL::str2Label(inputLabel));
+		EMDLabel label = EMDL::str2Label(inputLabel);
+		result = "";
+		if (!isEmpty() && EMDL::isValidLabel(label) && column_of[label] >= 0)
+		{
+			// As MetaDataContainer::writeValueToString: numbers are padded to 12 characters, strings are not padded
+			const MetaDataColumn &column = columns[column_of[label]];
+			if (column.type == EMDL_STRING)
+			{
+				if (column.hasValue(current_objectID))
+					result = column.strings[current_objectID];
+			}
+			else
+				column.appendValue(result, current_objectID);
+		}
 	}
 
 
@@ -917,7 +1666,8 @@ namespace relion
 					{
 						have_in_2 = true;
 						to_remove_from_only2.push_back(current_object2);
-						MDboth.addObject(MD1.getObject());
+						MetaDataContainer object = MD1.getObject();
+						MDboth.addObject(&object);
 						break;
 					}
 				}
@@ -928,7 +1678,8 @@ namespace relion
 					{
 						have_in_2 = true;
 						to_remove_from_only2.push_back(current_object2);
-						MDboth.addObject(MD1.getObject());
+						MetaDataContainer object = MD1.getObject();
+						MDboth.addObject(&object);
 						break;
 					}
 				}
@@ -950,7 +1701,8 @@ namespace relion
 						//std::cerr << " current_object1= " << current_object1 << std::endl;
 						//std::cerr << " myd1= " << myd1 << " myd2= " << myd2 << " mydy1= " << mydy1 << " mydy2= " << mydy2 << " dist= "<<dist<<std::endl;
 						//std::cerr << " to be removed current_object2= " << current_object2 << std::endl;
-						MDboth.addObject(MD1.getObject());
+						MetaDataContainer object = MD1.getObject();
+						MDboth.addObject(&object);
 						break;
 					}
 				}
@@ -958,7 +1710,8 @@ namespace relion
 
 			if (!have_in_2)
 			{
-				MDonly1.addObject(MD1.getObject());
+				MetaDataContainer object = MD1.getObject();
+				MDonly1.addObject(&object);
 			}
 		}
 
@@ -981,7 +1734,8 @@ namespace relion
 			if (!to_be_removed)
 			{
 				//std::cerr << " doNOT remove current_object2= " << current_object2 << std::endl;
-				MDonly2.addObject(MD2.getObject(current_object2));
+				MetaDataContainer object = MD2.getObject(current_object2);
+				MDonly2.addObject(&object);
 			}
 		}
 
@@ -47,6 +47,7 @@
 
 #include <map>
 #include <vector>
+#include <deque>
 #include <iostream>
 #include <iterator>
 #include <sstream>
@@ -180,8 +181,16 @@ namespace relion
 	  */
 	class MetaDataTable
 	{
-		// Effectively stores all metadata
-		std::vector<MetaDataContainer *> objects;
+		// Number of objects (rows) in the table
+		long int nr_objects;
+
+		/* Effectively stores all metadata: one column with contiguous values per label.
+		 * A deque, so that adding a column does not copy the existing ones.
+		 */
+		std::deque<MetaDataColumn> columns;
+
+		// Index in columns for every EMDLabel (-1 if there is no column for that label)
+		std::vector<int> column_of;
 
 		// Current object id
 		long int current_objectID;
@@ -274,7 +283,7 @@ namespace relion
 
 		size_t size(void)
 		{
-			return objects.size();
+			return nr_objects;
 		}
 
 		/*  Get value for any label.
@@ -286,14 +295,20 @@ namespace relion
 		bool getValue(EMDLabel name, T &value,
 			long int objectID = -1) const
 		{
-			if (isEmpty())
+			if (isEmpty() || !EMDL::isValidLabel(name))
 				return false;
 
-			MetaDataContainer * aux = getObject(objectID);
+			long int idx = (objectID == -1) ? current_objectID : objectID;
+			if (idx < 0 || idx >= nr_objects)
+				REPORT_ERROR("Requested objectID not found. Exiting... ");
+
+			int icol = column_of[name];
+			if (icol < 0 || !columns[icol].hasValue(idx))
+				return false;
 
-			// Inside getValue of the container there will be a check of the correct type
-			bool result = aux->getValue(name, value);
-			return result;
+			// Inside getValue of the column there will be a check of the correct type
+			columns[icol].getValue(idx, value);
+			return true;
 		}
 
 		// Read/set a new pair/value for an specified object. If no objectID is given, that
@@ -307,27 +322,12 @@ namespace relion
 			{
 
 				long int auxID = (objectID == -1) ? current_objectID : objectID;
-				MetaDataContainer * aux = objects[auxID];
-
-				// Check whether label is correct (belongs to the enum in the metadata_container header
-				// and whether it is present in the activeLabels vector. If not, add it to all the other
-				// objects with default values
-				std::vector<EMDLabel>::iterator location;
-				std::map<long int, MetaDataContainer *>::iterator It;
-				location = std::find(activeLabels.begin(), activeLabels.end(), name);
-				if (location == activeLabels.end())
-				{
-					activeLabels.push_back(name);
-					// Add this label to the rest of the objects in this class
-					for (long int idx = 0; idx < objects.size(); idx++)
-					{
-						if (objects[idx] != aux)
-						{
-							objects[idx]->addValue(name, T());
-						}
-					}
-				}
-				aux->addValue(name, value);
+				if (auxID < 0 || auxID >= nr_objects)
+					REPORT_ERROR("MetaDataTable::setValue: objectID >= objects.size()");
+
+				// If the label is not yet in the activeLabels vector, it is added with default values
+				// for all the other objects
+				activateLabel(name).setValue(auxID, value);
 				return true;
 			}
 			else
@@ -343,69 +343,27 @@ namespace relion
 		// No copying of entire MetaDataTable involved!
 		void newSort(const EMDLabel name, bool do_reverse = false, bool do_sort_after_at = false);
 
-		// Sort the order of the elements based on the values in the input label (only numbers, no strings/bools!)
-		// Have to pass dummy T parameter to get the template thing running?
-		void sort(EMDLabel name, bool do_reverse = false, bool only_set_index = false)
-		{
-			if (!(EMDL::isInt(name) || EMDL::isLong(name) || EMDL::isDouble(name)))
-				REPORT_ERROR("MetadataTable::sort%% ERROR: can only sorted numbers");
-			std::vector<std::pair<DOUBLE, long int> > vp;
-			vp.reserve(objects.size());
-			long int i = 0;
-			FOR_ALL_OBJECTS_IN_METADATA_TABLE(*this)
-			{
-				DOUBLE dval;
-				if (EMDL::isInt(name))
-				{
-					int val;
-					getValue(name, val);
-					dval = (DOUBLE)val;
-				}
-				else if (EMDL::isLong(name))
-				{
-					long int val;
-					getValue(name, val);
-					dval = (DOUBLE)val;
-				}
-				else
-				{
-					//  EMDL::isDouble(name)
-					getValue(name, dval);
-				}
-				vp.push_back(std::make_pair(dval, i));
-				i++;
-			}
+		/** Stable sort on several labels: on labels[0], ties on labels[1], and so on (e.g. micrograph, then image number)
+		 * See getSortOrder; only the columns are permuted, no objects are copied.
+		 */
+		void newSort(const std::vector<EMDLabel> &labels, bool do_reverse = false, bool do_sort_after_at = false);
 
-			std::sort(vp.begin(), vp.end());
-			if (do_reverse)
-				std::reverse(vp.begin(), vp.end());
+		/** The order of the objects after a stable sort on labels[0], then labels[1], ...: order[i] is the i-th object
+		 * The table itself is not changed, so this can also be used to process the objects in another order (e.g. to
+		 * read the images stack by stack). The keys are extracted in parallel into a typed array and sorted with a
+		 * parallel radix sort (numbers) or merge sort (strings). Objects without a value sort as if they had the default
+		 * value. With do_sort_after_at, strings are only compared from their first '@' on.
+		 */
+		void getSortOrder(const std::vector<EMDLabel> &labels, std::vector<long int> &order, bool do_sort_after_at = false) const;
 
-			if (only_set_index)
-			{
-				// Add an extra column with the sorted position of each entry
-				for (long int j = 0; j < vp.size(); j++)
-				{
-					(*this).setValue(EMDL_SORTED_IDX, j, vp[j].second);
-				}
-			}
-			else
-			{
-				// Change the actual order in the MetaDataTable
-				MetaDataTable MDaux;
-				for (long int j = 0; j < vp.size(); j++)
-				{
-					MDaux.addObject();
-					MDaux.setObject((*this).getObject(vp[j].second));
-				}
-				*this = MDaux;
-			}
-			// return pointer to the beginning of the table
-			firstObject();
-		}
+		// Sort the order of the elements based on the values in the input label (only numbers, no strings/bools!)
+		// With only_set_index, the objects stay where they are and get their sorted position in EMDL_SORTED_IDX
+		void sort(EMDLabel name, bool do_reverse = false, bool only_set_index = false);
 
 		bool valueExists(EMDLabel name)
 		{
-			return (objects[current_objectID])->valueExists(name);
+			int icol = EMDL::isValidLabel(name) ? column_of[name] : -1;
+			return icol >= 0 && columns[icol].hasValue(current_objectID);
 		}
 
 		/** Check whether a label is contained in metadata.
@@ -436,9 +394,9 @@ namespace relion
 		 * This function resets the current pointer to the last entry and returns the lastObject in the table */
 		long int removeObject(long int objectID = -1);
 
-		/* Get metadatacontainer for objectID (is current_objectID when -1)
+		/* Get a copy of object objectID (is current_objectID when -1) as a metadatacontainer
 		 */
-		MetaDataContainer * getObject(long int objectID = -1) const;
+		MetaDataContainer getObject(long int objectID = -1) const;
 
 		/* Set metadatacontainer for current metadata object
 		 * This function assumes there already exists an object with objectID
@@ -462,6 +420,8 @@ namespace relion
 		long int goToObject(long int objectID);
 
 		/* Read a STAR loop structure
+		 * The data lines are read in large blocks and parsed in parallel (with OpenMP) straight into the columns.
+		 * The stream is left somewhere behind the end of the loop.
 		  */
 		void readStarLoop(std::ifstream& in, std::vector<EMDLabel> *labelsVector = NULL);
 
@@ -484,9 +444,19 @@ namespace relion
 		 */
 		int readStar(std::ifstream& in, const std::string &name = "", std::vector<EMDLabel> *labelsVector = NULL);
 
-		// Read a MetaDataTable (get fileformat from extension)
+		/* Read a MetaDataTable (get fileformat from extension)
+		 *
+		 * If the STAR cache is switched on (see setStarCache), a binary copy of the table is kept next to the STAR file
+		 * (filename.cache, or filename.name.cache), and a next read of the same table uses it as long as the size and modification
+		 * time of the STAR file are unchanged.
+		 */
 		int read(const FileName &filename, const std::string &name = "", std::vector<EMDLabel> *labelsVector = NULL);
 
+		/* Switch the binary cache of tables read from STAR files on or off (off by default)
+		 * Only reading tables with all their labels (labelsVector == NULL) uses the cache.
+		 */
+		static void setStarCache(bool do_cache);
+
 		// Write a MetaDataTable in STAR format
 		void write(std::ostream& out = std::cout);
 
@@ -497,6 +467,32 @@ namespace relion
 		void writeValueToString(std::string & result,
 			const std::string & inputLabel);
 
+	private:
+
+		// Whether read() uses (and writes) binary caches of STAR files
+		static bool use_star_cache;
+
+		// Name of the cache of data block name in fn_star
+		static FileName getStarCacheName(const FileName &fn_star, const std::string &name);
+
+		// Read this table from the cache of data block name in fn_star; false (and an empty table) if there is no valid cache
+		bool readStarCache(const FileName &fn_star, const std::string &name, int &read_result);
+
+		// Write the cache of data block name in fn_star, which had the given size and modification time when it was read
+		void writeStarCache(const FileName &fn_star, const std::string &name, int read_result,
+			long long size, long long mtime_sec, long long mtime_nsec) const;
+
+		// Get the column for label, adding one without values if it does not exist yet
+		MetaDataColumn& getColumn(EMDLabel label);
+
+		// Get the column for label, and add label to activeLabels (with default values for all objects) if it was not active yet
+		MetaDataColumn& activateLabel(EMDLabel label);
+
+		// Store the values in data as object objectID (and activate its labels)
+		void setObjectValues(const MetaDataContainer * data, long int objectID);
+
+		// Re-order the objects: new object i is old object order[i]
+		void reorderObjects(const std::vector<long int> &order);
 
 	};
 
@@ -47,6 +47,18 @@
 
 namespace relion
 {
+	static int multidim_array_threads = 1;
+
+	void setMultidimArrayThreads(int nr_threads)
+	{
+		multidim_array_threads = XMIPP_MAX(1, nr_threads);
+	}
+
+	int getMultidimArrayThreads()
+	{
+		return multidim_array_threads;
+	}
+
 	// Show a complex array ---------------------------------------------------
 	std::ostream& operator<<(std::ostream& ostrm,
 		const MultidimArray< Complex >& v)
@@ -46,14 +46,21 @@
 #define MULTIDIM_ARRAY_H
 
 #include <typeinfo>
+#include <new>
+#include <utility>
 #include <fcntl.h>
-//#include <unistd.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include <sys/stat.h>
 #include "src/funcs.h"
 #include "src/error.h"
 #include "src/matrix1d.h"
 #include "src/matrix2d.h"
 #include "src/complex.h"
+#include "src/memory.h"
+#include "src/thread_pool.h"
 
 namespace relion
 {
@@ -432,6 +439,228 @@ namespace relion
 		for (long int i=0; i<v.xdim; i++)
 	//@}
 
+	/** @name MultidimArraysThreads Threads for large arrays
+	 *
+	 * The element-wise operations (initZeros, initConstant and the arithmetic operators) and the reductions
+	 * (sum, sum2, computeAvg, computeStddev, computeStats, computeMoments, computeMin, computeMax, computeDoubleMinMax) of arrays
+	 * with at least MULTIDIM_PARALLEL_MIN elements run on getMultidimArrayThreads() OpenMP threads.
+	 * This is off (1 thread) by default.
+	 *
+	 * The reductions sum blocks of MULTIDIM_SUM_BLOCK elements in double precision and add the block sums pairwise,
+	 * so their results are accurate also in single-precision builds, and do not depend on the number of threads.
+	 */
+	//@{
+	#define MULTIDIM_PARALLEL_MIN 262144
+	#define MULTIDIM_SUM_BLOCK 4096
+
+	/// Set the number of threads for the operations on large arrays (1 switches this off)
+	void setMultidimArrayThreads(int nr_threads);
+
+	/// The number of threads set by setMultidimArrayThreads
+	int getMultidimArrayThreads();
+
+	/// The number of threads for an operation on size elements (limited to the share of a thread-pool task, see thread_pool.h)
+	inline int multidimArrayThreads(long int size)
+	{
+		return (size < MULTIDIM_PARALLEL_MIN) ? 1 : getTaskNrThreads(getMultidimArrayThreads());
+	}
+
+	/// Pairwise sum of x[0] ... x[n-1]
+	inline double pairwiseSum(const double* x, long int n)
+	{
+		if (n <= 8)
+		{
+			double sum = 0.;
+			for (long int i = 0; i < n; i++)
+				sum += x[i];
+			return sum;
+		}
+		return pairwiseSum(x, n / 2) + pairwiseSum(x + n / 2, n - n / 2);
+	}
+
+	/// Sum, sum of squares, minimum and maximum of ptr[0] ... ptr[size-1] (size > 0), each only if asked for
+	template<typename T>
+	void blockStats(const T* ptr, long int size, bool do_sum, bool do_sum2, bool do_minmax,
+					double& sum, double& sum2, T& minval, T& maxval)
+	{
+		// Four partial sums, so that the additions do not have to wait for each other
+		double s[4] = { 0., 0., 0., 0. }, s2[4] = { 0., 0., 0., 0. };
+		long int n = 0;
+		if (do_sum || do_sum2)
+		{
+			for (; n + 4 <= size; n += 4)
+				for (int u = 0; u < 4; u++)
+				{
+					double val = static_cast< double >(ptr[n + u]);
+					s[u] += val;
+					s2[u] += val * val;
+				}
+			for (; n < size; n++)
+			{
+				double val = static_cast< double >(ptr[n]);
+				s[0] += val;
+				s2[0] += val * val;
+			}
+		}
+		sum = (s[0] + s[1]) + (s[2] + s[3]);
+		sum2 = (s2[0] + s2[1]) + (s2[2] + s2[3]);
+
+		if (do_minmax)
+		{
+			minval = maxval = ptr[0];
+			for (n = 1; n < size; n++)
+			{
+				if (ptr[n] > maxval)
+					maxval = ptr[n];
+				else if (ptr[n] < minval)
+					minval = ptr[n];
+			}
+		}
+	}
+
+	/// blockStats of a whole array, see MultidimArraysThreads
+	template<typename T>
+	void arrayStats(const T* ptr, long int size, bool do_sum, bool do_sum2, bool do_minmax,
+					double& sum, double& sum2, T& minval, T& maxval)
+	{
+		long int nr_blocks = (size + MULTIDIM_SUM_BLOCK - 1) / MULTIDIM_SUM_BLOCK;
+		if (nr_blocks <= 1)
+		{
+			blockStats(ptr, size, do_sum, do_sum2, do_minmax, sum, sum2, minval, maxval);
+			return;
+		}
+
+		std::vector<double> block_sum(nr_blocks), block_sum2(nr_blocks);
+		std::vector<T> block_min(nr_blocks), block_max(nr_blocks);
+		int nr_threads = multidimArrayThreads(size);
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+		for (long int b = 0; b < nr_blocks; b++)
+		{
+			long int first = b * MULTIDIM_SUM_BLOCK;
+			T block_minval, block_maxval;
+			blockStats(ptr + first, XMIPP_MIN(MULTIDIM_SUM_BLOCK, size - first), do_sum, do_sum2, do_minmax,
+				block_sum[b], block_sum2[b], block_minval, block_maxval);
+			if (do_minmax)
+			{
+				block_min[b] = block_minval;
+				block_max[b] = block_maxval;
+			}
+		}
+
+		sum = pairwiseSum(&block_sum[0], nr_blocks);
+		sum2 = pairwiseSum(&block_sum2[0], nr_blocks);
+		if (do_minmax)
+		{
+			minval = block_min[0];
+			maxval = block_max[0];
+			for (long int b = 1; b < nr_blocks; b++)
+			{
+				if (block_max[b] > maxval)
+					maxval = block_max[b];
+				if (block_min[b] < minval)
+					minval = block_min[b];
+			}
+		}
+	}
+
+	/// Number of values, mean and sums of the 2nd, 3rd and 4th powers of the deviations from the mean
+	struct CentralMoments
+	{
+		double n, mean, m2, m3, m4;
+		CentralMoments() : n(0.), mean(0.), m2(0.), m3(0.), m4(0.) {}
+	};
+
+	/// The central moments of the union of the values of a and b (Pebay's update formulas)
+	inline CentralMoments combineMoments(const CentralMoments &a, const CentralMoments &b)
+	{
+		if (a.n == 0.)
+			return b;
+		if (b.n == 0.)
+			return a;
+		CentralMoments c;
+		c.n = a.n + b.n;
+		double delta = b.mean - a.mean, delta_n = delta / c.n;
+		double term = delta * delta_n * a.n * b.n;
+		c.mean = a.mean + delta_n * b.n;
+		c.m2 = a.m2 + b.m2 + term;
+		c.m3 = a.m3 + b.m3 + term * delta_n * (a.n - b.n) + 3. * delta_n * (a.n * b.m2 - b.n * a.m2);
+		c.m4 = a.m4 + b.m4 + term * delta_n * delta_n * (a.n * a.n - a.n * b.n + b.n * b.n) +
+			6. * delta_n * delta_n * (a.n * a.n * b.m2 + b.n * b.n * a.m2) + 4. * delta_n * (a.n * b.m3 - b.n * a.m3);
+		return c;
+	}
+
+	/// Pairwise combination of the moments x[0] ... x[n-1]
+	inline CentralMoments pairwiseMoments(const CentralMoments* x, long int n)
+	{
+		if (n == 1)
+			return x[0];
+		return combineMoments(pairwiseMoments(x, n / 2), pairwiseMoments(x + n / 2, n - n / 2));
+	}
+
+	/** Central moments of ptr[0] ... ptr[size-1] (size > 0)
+	 * The block is read twice (for the mean, and for the deviations from it), but it is small enough to stay in cache.
+	 */
+	template<typename T>
+	CentralMoments blockMoments(const T* ptr, long int size)
+	{
+		double sum, sum2;
+		T minval, maxval;
+		blockStats(ptr, size, true, false, false, sum, sum2, minval, maxval);
+		double mean = sum / size;
+
+		double s1[4] = { 0., 0., 0., 0. }, s2[4] = { 0., 0., 0., 0. }, s3[4] = { 0., 0., 0., 0. }, s4[4] = { 0., 0., 0., 0. };
+		long int n = 0;
+		for (; n + 4 <= size; n += 4)
+			for (int u = 0; u < 4; u++)
+			{
+				double d = static_cast< double >(ptr[n + u]) - mean, d2 = d * d;
+				s1[u] += d;
+				s2[u] += d2;
+				s3[u] += d2 * d;
+				s4[u] += d2 * d2;
+			}
+		for (; n < size; n++)
+		{
+			double d = static_cast< double >(ptr[n]) - mean, d2 = d * d;
+			s1[0] += d;
+			s2[0] += d2;
+			s3[0] += d2 * d;
+			s4[0] += d2 * d2;
+		}
+		double S1 = (s1[0] + s1[1]) + (s1[2] + s1[3]), S2 = (s2[0] + s2[1]) + (s2[2] + s2[3]);
+		double S3 = (s3[0] + s3[1]) + (s3[2] + s3[3]), S4 = (s4[0] + s4[1]) + (s4[2] + s4[3]);
+
+		// Correct for the rounding error c of the mean
+		CentralMoments result;
+		double c = S1 / size;
+		result.n = size;
+		result.mean = mean + c;
+		result.m2 = S2 - size * c * c;
+		result.m3 = S3 - 3. * c * S2 + 2. * size * c * c * c;
+		result.m4 = S4 - 4. * c * S3 + 6. * c * c * S2 - 3. * size * c * c * c * c;
+		return result;
+	}
+
+	/// blockMoments of a whole array: per block of MULTIDIM_SUM_BLOCK elements, combined pairwise (see MultidimArraysThreads)
+	template<typename T>
+	CentralMoments arrayMoments(const T* ptr, long int size)
+	{
+		long int nr_blocks = (size + MULTIDIM_SUM_BLOCK - 1) / MULTIDIM_SUM_BLOCK;
+		if (nr_blocks <= 1)
+			return blockMoments(ptr, size);
+
+		std::vector<CentralMoments> block_moments(nr_blocks);
+		int nr_threads = multidimArrayThreads(size);
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+		for (long int b = 0; b < nr_blocks; b++)
+		{
+			long int first = b * MULTIDIM_SUM_BLOCK;
+			block_moments[b] = blockMoments(ptr + first, XMIPP_MIN(MULTIDIM_SUM_BLOCK, size - first));
+		}
+		return pairwiseMoments(&block_moments[0], nr_blocks);
+	}
+	//@}
+
 	// Forward declarations ====================================================
 	template<typename T>
 	class MultidimArray;
@@ -448,11 +677,176 @@ namespace relion
 	void coreArrayByArray(const MultidimArray<T>& op1, const MultidimArray<T>& op2,
 						  MultidimArray<T>& result, char operation);
 
+	/** @name MultidimArrayExpressions Lazy element-wise expressions
+	 *
+	 * The arithmetic operators +, -, * and / between arrays of the same type and between arrays and
+	 * scalars do not compute anything, but return a small expression object that refers to its operands.
+	 * Assigning the expression to a MultidimArray (or constructing one from it) evaluates the whole
+	 * expression in a single loop over the elements, without a temporary array per operator:
+	 *
+	 * @code
+	 * A = B * c + D;  // one pass over B and D, no temporaries
+	 * A += B * c;     // idem
+	 * @endcode
+	 *
+	 * An expression only holds references to its arrays, so it should not outlive the statement it is
+	 * written in (do not store it in an auto variable). Convert it to a MultidimArray to call member
+	 * functions on the result, e.g. MultidimArray<DOUBLE>(A - B).sum().
+	 */
+	//@{
+
+	/// Base of all expressions (and of MultidimArray itself): E is the expression type, T its element type
+	template<typename T, typename E>
+	class MultidimExpr
+	{
+	public:
+		typedef T value_type;
+
+		inline const E& derived() const
+		{
+			return static_cast<const E&>(*this);
+		}
+	};
+
+	/// How an expression holds its operands: arrays by reference, (small) expressions by value
+	template<typename T, typename E>
+	struct MultidimExprOperand
+	{
+		typedef const E type;
+	};
+
+	template<typename T>
+	struct MultidimExprOperand<T, MultidimArray<T> >
+	{
+		typedef const MultidimArray<T>& type;
+	};
+
+	/// The element-wise operations
+	struct MultidimExprAdd
+	{
+		static const char symbol = '+';
+		template<typename T>
+		static inline T apply(const T& a, const T& b)
+		{
+			return a + b;
+		}
+	};
+
+	struct MultidimExprSubtract
+	{
+		static const char symbol = '-';
+		template<typename T>
+		static inline T apply(const T& a, const T& b)
+		{
+			return a - b;
+		}
+	};
+
+	struct MultidimExprMultiply
+	{
+		static const char symbol = '*';
+		template<typename T>
+		static inline T apply(const T& a, const T& b)
+		{
+			return a * b;
+		}
+	};
+
+	struct MultidimExprDivide
+	{
+		static const char symbol = '/';
+		template<typename T>
+		static inline T apply(const T& a, const T& b)
+		{
+			return a / b;
+		}
+	};
+
+	/// op1 OP op2 for two expressions of the same shape
+	template<typename T, typename E1, typename E2, typename OP>
+	class MultidimBinaryExpr: public MultidimExpr<T, MultidimBinaryExpr<T, E1, E2, OP> >
+	{
+		typename MultidimExprOperand<T, E1>::type op1;
+		typename MultidimExprOperand<T, E2>::type op2;
+
+	public:
+		MultidimBinaryExpr(const E1& _op1, const E2& _op2): op1(_op1), op2(_op2)
+		{
+			if (!op1.exprShape().sameShape(op2.exprShape()))
+				REPORT_ERROR( (std::string) "Array_by_array: different shapes (" + OP::symbol + ")");
+		}
+
+		inline T evalAt(long int n) const
+		{
+			return OP::template apply<T>(op1.evalAt(n), op2.evalAt(n));
+		}
+
+		inline const MultidimArray<T>& exprShape() const
+		{
+			return op1.exprShape();
+		}
+	};
+
+	/// op1 OP k (SCALAR_FIRST=false) or k OP op1 (SCALAR_FIRST=true)
+	template<typename T, typename E, typename OP, bool SCALAR_FIRST>
+	class MultidimScalarExpr: public MultidimExpr<T, MultidimScalarExpr<T, E, OP, SCALAR_FIRST> >
+	{
+		typename MultidimExprOperand<T, E>::type op1;
+		const T k;
+
+	public:
+		MultidimScalarExpr(const E& _op1, const T& _k): op1(_op1), k(_k)
+		{
+		}
+
+		inline T evalAt(long int n) const
+		{
+			return (SCALAR_FIRST) ? OP::template apply<T>(k, op1.evalAt(n)) : OP::template apply<T>(op1.evalAt(n), k);
+		}
+
+		inline const MultidimArray<T>& exprShape() const
+		{
+			return op1.exprShape();
+		}
+	};
+
+	// The scalar is a non-deduced MultidimExpr<T, E>::value_type, so that v * 2. also works for float arrays
+	#define MULTIDIM_EXPR_OPERATOR(OPERATOR, OP) \
+	template<typename T, typename E1, typename E2> \
+	inline MultidimBinaryExpr<T, E1, E2, OP> operator OPERATOR(const MultidimExpr<T, E1>& op1, \
+		const MultidimExpr<T, E2>& op2) \
+	{ \
+		return MultidimBinaryExpr<T, E1, E2, OP>(op1.derived(), op2.derived()); \
+	} \
+	template<typename T, typename E> \
+	inline MultidimScalarExpr<T, E, OP, false> operator OPERATOR(const MultidimExpr<T, E>& op1, \
+		typename MultidimExpr<T, E>::value_type op2) \
+	{ \
+		return MultidimScalarExpr<T, E, OP, false>(op1.derived(), op2); \
+	} \
+	template<typename T, typename E> \
+	inline MultidimScalarExpr<T, E, OP, true> operator OPERATOR(typename MultidimExpr<T, E>::value_type op1, \
+		const MultidimExpr<T, E>& op2) \
+	{ \
+		return MultidimScalarExpr<T, E, OP, true>(op2.derived(), op1); \
+	}
+
+	MULTIDIM_EXPR_OPERATOR(+, MultidimExprAdd)
+	MULTIDIM_EXPR_OPERATOR(-, MultidimExprSubtract)
+	MULTIDIM_EXPR_OPERATOR(*, MultidimExprMultiply)
+	MULTIDIM_EXPR_OPERATOR(/, MultidimExprDivide)
+	#undef MULTIDIM_EXPR_OPERATOR
+	//@}
+
+	/** Frees memory that was handed to a MultidimArray with adopt(): called as deleter(ptr, context)
+	 */
+	typedef void (*MultidimArrayDeleter)(void *ptr, void *context);
+
 	/** Template class for Xmipp arrays.
 	  * This class provides physical and logical access.
 	*/
 	template<typename T>
-	class MultidimArray
+	class MultidimArray: public MultidimExpr<T, MultidimArray<T> >
 	{
 	public:
 		/* The array itself.
@@ -504,6 +898,10 @@ namespace relion
 		// Number of elements in NZYX in allocated memory
 		long int nzyxdimAlloc;
 
+		// Frees data instead of freeElements, if the memory was adopted (see adopt)
+		MultidimArrayDeleter externalDeleter;
+		void *externalContext;
+
 	public:
 		/// @name Constructors
 		//@{
@@ -572,6 +970,35 @@ namespace relion
 			*this = V;
 		}
 
+		/** Move constructor.
+		 *
+		 * Takes over the memory (or the file mapping) of V, which is left empty.
+		 * If V is an alias (destroyData is false), the new array is an alias of the same memory.
+		 *
+		 * @code
+		 * std::vector< MultidimArray<Complex> > Fstack;
+		 * Fstack.push_back(std::move(Faux));  // Faux is not copied
+		 * @endcode
+		 */
+		MultidimArray(MultidimArray<T>&& V) noexcept
+		{
+			coreInit();
+			coreTakeOver(V);
+		}
+
+		/** Constructor from an expression, see MultidimArrayExpressions.
+		 *
+		 * @code
+		 * MultidimArray<DOUBLE> V3(V1 * 2. + V2);
+		 * @endcode
+		 */
+		template<typename E>
+		MultidimArray(const MultidimExpr<T, E>& op1)
+		{
+			coreInit();
+			*this = op1;
+		}
+
 		/** Copy constructor from a Matrix1D.
 		 * The Size constructor creates an array with memory associated,
 		 * and fills it with zeros.
@@ -636,6 +1063,69 @@ namespace relion
 			destroyData=true;
 			mmapOn = false;
 			mFd=0;
+			externalDeleter = NULL;
+			externalContext = NULL;
+		}
+
+		/** Allocate and default-construct n elements.
+		 *
+		 * The memory comes from askAlignedMemory, so the first element is aligned to MEMORY_ALIGNMENT bytes
+		 * and the block is padded to a multiple of it. Large blocks follow the placement policy set
+		 * with setAllocationPolicy (first-touch/NUMA-local placement, huge pages).
+		 * Rows are not padded: the elements are contiguous, as everything else expects.
+		 */
+		static T* allocateElements(long int n)
+		{
+			T* ptr = (T*)askAlignedMemory(n * sizeof(T));
+			for (long int i = 0; i < n; i++)
+				new (ptr + i) T;
+			return ptr;
+		}
+
+		/** Destruct and free n elements allocated with allocateElements
+		 * (into the memory pool, if a MemoryPoolScope is alive)
+		 */
+		static void freeElements(T* ptr, long int n)
+		{
+			for (long int i = 0; i < n; i++)
+				ptr[i].~T();
+			freeAlignedMemory(ptr, n * sizeof(T));
+		}
+
+		/** Allocate n elements in a (new) temporary file, which is memory-mapped (for setMmap(true))
+		 * The file descriptor and name are returned in fd and fn, to be passed to unmapElements.
+		 */
+		static T* mapElements(long int n, int &fd, FileName &fn)
+		{
+#ifdef _WIN32
+			REPORT_ERROR("MultidimArray::mapElements: Not supported in Windows port.");
+			return NULL;
+#else
+			size_t size = XMIPP_MAX(n, 1) * sizeof(T);
+			// mkstemp rather than FileName::initRandom, which would re-seed the random generator
+			char tmpname[] = "relion_mmap_XXXXXX";
+			if ((fd = mkstemp(tmpname)) == -1)
+				REPORT_ERROR("MultidimArray::mapElements: Error creating map file");
+			fn = tmpname;
+			if (ftruncate(fd, size) == -1)
+				REPORT_ERROR("MultidimArray::mapElements: Error resizing map file " + fn);
+			void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (ptr == MAP_FAILED)
+				REPORT_ERROR("MultidimArray::mapElements: mmap of map file failed");
+			// A new file is all zeros, which is what default construction gives for all element types used
+			return (T*)ptr;
+#endif
+		}
+
+		/** Unmap n elements allocated with mapElements, and remove their file
+		 */
+		static void unmapElements(T* ptr, long int n, int fd, const FileName &fn)
+		{
+#ifndef _WIN32
+			munmap(ptr, XMIPP_MAX(n, 1) * sizeof(T));
+			close(fd);
+			remove(fn.c_str());
+#endif
 		}
 
 		/** Core allocate with dimensions.
@@ -675,23 +1165,9 @@ namespace relion
 				REPORT_ERROR("coreAllocate:Cannot allocate a negative number of bytes");
 
 			if (mmapOn)
-			{
-				REPORT_ERROR("MultidimArray::coreAllocate: Not supported in Windows port.");
-			}
+				data = mapElements(nzyxdim, mFd, mapFile);
 			else
-			{
-				////cudaMallocHost((void**)&data, NEXT_MULT_OF_16(nzyxdim) * sizeof(T));
-				//data = (T*)_aligned_malloc(NEXT_MULT_OF_16(nzyxdim) * sizeof(T), 64);
-				//if (data == NULL)
-				//	REPORT_ERROR("Could not allocate memory");
-				//memset(data + NEXT_MULT_OF_16(nzyxdim) - 15, 0, 15 * sizeof(T));
-				//if (data == NULL)
-				//	REPORT_ERROR( "Allocate: No space left");
-
-				data = new T[nzyxdim];
-				if (data == NULL)
-					REPORT_ERROR("Allocate: No space left");
-			}
+				data = allocateElements(nzyxdim);
 			nzyxdimAlloc = nzyxdim;
 
 		}
@@ -713,23 +1189,9 @@ namespace relion
 				REPORT_ERROR("coreAllocateReuse:Cannot allocate a negative number of bytes");
 
 			if (mmapOn)
-			{
-				REPORT_ERROR("MultidimArray::coreAllocateReuse: Not supported in Windows port.");
-			}
+				data = mapElements(nzyxdim, mFd, mapFile);
 			else
-			{
-				////cudaMallocHost((void**)&data, NEXT_MULT_OF_16(nzyxdim) * sizeof(T));
-				//data = (T*)_aligned_malloc(NEXT_MULT_OF_16(nzyxdim) * sizeof(T), 64);
-				//if (data == NULL)
-				//	REPORT_ERROR("Could not allocate memory");
-				//memset(data + NEXT_MULT_OF_16(nzyxdim) - 15, 0, 15 * sizeof(T));
-				//if (data == NULL)
-				//	REPORT_ERROR( "Allocate: No space left");
-
-				data = new T[nzyxdim];
-				if (data == NULL)
-					REPORT_ERROR("Allocate: No space left");
-			}
+				data = allocateElements(nzyxdim);
 			nzyxdimAlloc = nzyxdim;
 		}
 
@@ -750,17 +1212,37 @@ namespace relion
 		{
 			if (data != NULL && destroyData)
 			{
-				if (mmapOn)
-				{
-					REPORT_ERROR("Not on Windows");
-				}
+				if (externalDeleter != NULL)
+					externalDeleter(data, externalContext);
+				else if (mmapOn)
+					unmapElements(data, nzyxdimAlloc, mFd, mapFile);
 				else
-					delete[] data;
-					//_aligned_free(data);
-					////cudaFreeHost(data);
+					freeElements(data, nzyxdimAlloc);
 			}
 			data=NULL;
 			nzyxdimAlloc = 0;
+			// Whatever is allocated next (e.g. after an alias) is ours again
+			destroyData = true;
+			externalDeleter = NULL;
+			externalContext = NULL;
+		}
+
+		/** Take over the memory and the shape of m, leaving m empty.
+		 * This array should not hold any memory.
+		 */
+		void coreTakeOver(MultidimArray<T> &m) noexcept
+		{
+			copyShape(m);
+			data = m.data;
+			destroyData = m.destroyData;
+			nzyxdimAlloc = m.nzyxdimAlloc;
+			mmapOn = m.mmapOn;
+			mapFile.swap(m.mapFile);
+			mFd = m.mFd;
+			externalDeleter = m.externalDeleter;
+			externalContext = m.externalContext;
+			m.coreInit();
+			m.mapFile.clear();
 		}
 
 		/** Alias a multidimarray.
@@ -776,6 +1258,74 @@ namespace relion
 			this->data=m.data;
 			this->destroyData=false;
 		}
+
+		/** Borrow external memory.
+		 *
+		 * Make this an Ndim x Zdim x Ydim x Xdim array of the (row-major, X fastest) elements at ptr, without
+		 * copying them. The memory is not freed by the array, and should stay valid for as long as the array uses it.
+		 * Any memory the array held is released first; the origin is not changed.
+		 * Everything that keeps the shape works in the borrowed memory (also resize() to the same size, and
+		 * assignment of arrays of the same shape), anything that changes the shape allocates memory of the array's own.
+		 * ptr should be aligned to the element type; for the fastest SIMD code, align it to MEMORY_ALIGNMENT.
+		 *
+		 * @code
+		 * MultidimArray<DOUBLE> vol;
+		 * vol.borrow(buffer, 1, box, box, box); // buffer holds box^3 values
+		 * @endcode
+		 */
+		void borrow(T *ptr, long int Ndim, long int Zdim, long int Ydim, long int Xdim)
+		{
+			useExternalElements(ptr, Ndim, Zdim, Ydim, Xdim);
+			destroyData = false;
+		}
+
+		/** Adopt external memory.
+		 *
+		 * As borrow(), but the array owns the memory: deleter(ptr, context) is called when the array releases it
+		 * (in clear(), in the destructor, or when the shape changes). A move passes the ownership on,
+		 * a copy gets memory of its own.
+		 *
+		 * @code
+		 * static void freeBuffer(void *ptr, void *context) { free(ptr); }
+		 * vol.adopt((DOUBLE*)malloc(size * sizeof(DOUBLE)), 1, 1, 1, size, freeBuffer);
+		 * @endcode
+		 */
+		void adopt(T *ptr, long int Ndim, long int Zdim, long int Ydim, long int Xdim,
+			MultidimArrayDeleter deleter, void *context = NULL)
+		{
+			if (deleter == NULL)
+				REPORT_ERROR("MultidimArray::adopt: a deleter is needed to free the adopted memory");
+			useExternalElements(ptr, Ndim, Zdim, Ydim, Xdim);
+			externalDeleter = deleter;
+			externalContext = context;
+		}
+
+		/** Whether the array uses memory that it does not own (see alias and borrow)
+		 */
+		bool isBorrowed() const
+		{
+			return data != NULL && !destroyData;
+		}
+
+		/** Release the memory of the array and use the ptr for its data instead (see borrow and adopt)
+		 */
+		void useExternalElements(T *ptr, long int Ndim, long int Zdim, long int Ydim, long int Xdim)
+		{
+			if (ptr == NULL || Ndim <= 0 || Zdim <= 0 || Ydim <= 0 || Xdim <= 0)
+				REPORT_ERROR("MultidimArray: external memory should not be NULL and hold at least one element");
+			if ((size_t)ptr % alignof(T) != 0)
+				REPORT_ERROR("MultidimArray: external memory should be aligned to its element type");
+			coreDeallocate();
+			ndim = Ndim;
+			zdim = Zdim;
+			ydim = Ydim;
+			xdim = Xdim;
+			yxdim = ydim * xdim;
+			zyxdim = zdim * yxdim;
+			nzyxdim = ndim * zyxdim;
+			data = ptr;
+			nzyxdimAlloc = nzyxdim;
+		}
 		//@}
 
 		/// @name Size
@@ -876,7 +1426,9 @@ namespace relion
 		 */
 		virtual void resize(long int Ndim, long int Zdim, long int Ydim, long int Xdim)
 		{
-			if (Ndim*Zdim*Ydim*Xdim == nzyxdimAlloc && data != NULL)
+			// Arrays that were shrunk in place (see windowFourierTransform) are re-allocated when their shape changes
+			if (Ndim*Zdim*Ydim*Xdim == nzyxdimAlloc && data != NULL &&
+				Ndim == ndim && Zdim == zdim && Ydim == ydim && Xdim == xdim)
 				return;
 
 			if (Xdim <= 0 || Ydim <= 0 || Zdim <= 0 || Ndim <= 0)
@@ -906,18 +1458,9 @@ namespace relion
 			try
 			{
 				if (mmapOn)
-				{
-					REPORT_ERROR("Not on Windows.");
-				}
+					new_data = mapElements(NZYXdim, new_mFd, newMapFile);
 				else
-				{
-					/*new_data = (T*)_aligned_malloc(NEXT_MULT_OF_16(NZYXdim) * sizeof(T), 64);
-					if (new_data == NULL)
-						REPORT_ERROR("Could not allocate memory");
-					memset(new_data + NEXT_MULT_OF_16(NZYXdim) - 15, 0, 15 * sizeof(T));*/
-
-					new_data = new T[NZYXdim];
-				}
+					new_data = allocateElements(NZYXdim);
 			}
 			catch (std::bad_alloc &)
 			{
@@ -2122,13 +2665,9 @@ namespace relion
 			if (NZYXSIZE(*this) <= 0)
 				return static_cast< T >(0);
 
-			T maxval = data[0];
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			if (*ptr > maxval)
-				maxval = *ptr;
+			double sum, sum2;
+			T minval, maxval;
+			arrayStats(data, NZYXSIZE(*this), false, false, true, sum, sum2, minval, maxval);
 
 			return maxval;
 		}
@@ -2142,13 +2681,9 @@ namespace relion
 			if (NZYXSIZE(*this) <= 0)
 				return static_cast< T >(0);
 
-			T minval = data[0];
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			if (*ptr < minval)
-				minval = *ptr;
+			double sum, sum2;
+			T minval, maxval;
+			arrayStats(data, NZYXSIZE(*this), false, false, true, sum, sum2, minval, maxval);
 
 			return minval;
 		}
@@ -2284,18 +2819,11 @@ namespace relion
 			if (NZYXSIZE(*this) <= 0)
 				return;
 
-			minval = maxval = static_cast< DOUBLE >(data[0]);
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			{
-				T val=*ptr;
-				if (val < minval)
-					minval = static_cast< DOUBLE >(val);
-				else if (val > maxval)
-					maxval = static_cast< DOUBLE >(val);
-			}
+			double sum, sum2;
+			T Tminval, Tmaxval;
+			arrayStats(data, NZYXSIZE(*this), false, false, true, sum, sum2, Tminval, Tmaxval);
+			minval = static_cast< DOUBLE >(Tminval);
+			maxval = static_cast< DOUBLE >(Tmaxval);
 		}
 
 		/** Average of the values in the array.
@@ -2308,12 +2836,9 @@ namespace relion
 			if (NZYXSIZE(*this) <= 0)
 				return 0;
 
-			DOUBLE sum = 0;
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			sum += static_cast< DOUBLE >(*ptr);
+			double sum, sum2;
+			T minval, maxval;
+			arrayStats(data, NZYXSIZE(*this), true, false, false, sum, sum2, minval, maxval);
 
 			return sum / NZYXSIZE(*this);
 		}
@@ -2329,19 +2854,13 @@ namespace relion
 			if (NZYXSIZE(*this) <= 1)
 				return 0;
 
-			DOUBLE avg = 0, stddev = 0;
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			{
-				DOUBLE val=static_cast< DOUBLE >(*ptr);
-				avg += val;
-				stddev += val * val;
-			}
+			double sum, sum2;
+			T minval, maxval;
+			arrayStats(data, NZYXSIZE(*this), true, true, false, sum, sum2, minval, maxval);
 
-			avg /= NZYXSIZE(*this);
-			stddev = stddev / NZYXSIZE(*this) - avg * avg;
+			// The variance in double precision, to prevent cancellation
+			double avg = sum / NZYXSIZE(*this);
+			DOUBLE stddev = sum2 / NZYXSIZE(*this) - avg * avg;
 			stddev *= NZYXSIZE(*this) / (NZYXSIZE(*this) - 1);
 
 			// Foreseeing numerical instabilities
@@ -2360,31 +2879,15 @@ namespace relion
 			if (NZYXSIZE(*this) <= 0)
 				return;
 
-			avg = 0;
-			stddev = 0;
-
-			minval = maxval = data[0];
-
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			{
-				T Tval=*ptr;
-				DOUBLE val=static_cast< DOUBLE >(Tval);
-				avg += val;
-				stddev += val * val;
-
-				if (Tval > maxval)
-					maxval = Tval;
-				else if (Tval < minval)
-					minval = Tval;
-			}
+			double sum, sum2;
+			arrayStats(data, NZYXSIZE(*this), true, true, true, sum, sum2, minval, maxval);
 
-			avg /= NZYXSIZE(*this);
+			avg = sum / NZYXSIZE(*this);
 
 			if (NZYXSIZE(*this) > 1)
 			{
-				stddev = stddev / NZYXSIZE(*this) - avg * avg;
+				// The variance in double precision, to prevent cancellation
+				stddev = sum2 / NZYXSIZE(*this) - (sum / NZYXSIZE(*this)) * (sum / NZYXSIZE(*this));
 				stddev *= NZYXSIZE(*this) / (NZYXSIZE(*this) - 1);
 
 				// Foreseeing numerical instabilities
@@ -2394,6 +2897,29 @@ namespace relion
 				stddev = 0;
 		}
 
+		/** Compute the mean, standard deviation, skewness and kurtosis.
+		 *
+		 * In one sweep over the data (see arrayMoments), with standard deviation sqrt(sum((x - mean)^2) / N),
+		 * skewness sum((x - mean)^3) / (N stddev^3) and excess kurtosis sum((x - mean)^4) / (N stddev^4) - 3.
+		 * Skewness and kurtosis are 0 for a constant array.
+		 */
+		void computeMoments(DOUBLE& avg, DOUBLE& stddev, DOUBLE& skew, DOUBLE& kurt) const
+		{
+			avg = stddev = skew = kurt = 0.;
+			if (NZYXSIZE(*this) <= 0)
+				return;
+
+			CentralMoments moments = arrayMoments(data, NZYXSIZE(*this));
+			double var = moments.m2 / moments.n;
+			avg = moments.mean;
+			stddev = sqrt(var);
+			if (var > 0.)
+			{
+				skew = moments.m3 / (moments.n * var * sqrt(var));
+				kurt = moments.m4 / (moments.n * var * var) - 3.;
+			}
+		}
+
 		/** Median
 		 *
 		 * Calculate the median element.
@@ -2617,6 +3143,9 @@ namespace relion
 		 * homologous in array 2, it is very important that both have got the
 		 * same size and starting origins. The result has also got the same
 		 * shape as the two operated arrays and its former content is lost.
+		 *
+		 * The operators v1 + v2, v1 - v2, v1 * v2 and v1 / v2 (and those with scalars)
+		 * are lazy expressions, see MultidimArrayExpressions.
 		 */
 		//@{
 
@@ -2628,27 +3157,34 @@ namespace relion
 											const MultidimArray<T>& op2, MultidimArray<T>& result,
 											char operation)
 		{
-			T* ptrResult=NULL;
-			T* ptrOp1=NULL;
-			T* ptrOp2=NULL;
-			long int n;
-			for (n=0, ptrResult=result.data, ptrOp1=op1.data,ptrOp2=op2.data;
-				 n<op1.zyxdim; ++n, ++ptrResult, ++ptrOp1, ++ptrOp2)
-				switch (operation)
-				{
-				case '+':
-					*ptrResult = *ptrOp1 + *ptrOp2;
-					break;
-				case '-':
-					*ptrResult = *ptrOp1 - *ptrOp2;
-					break;
-				case '*':
-					*ptrResult = *ptrOp1 * *ptrOp2;
-					break;
-				case '/':
-					*ptrResult = *ptrOp1 / *ptrOp2;
-					break;
-				}
+			T* ptrResult = result.data;
+			const T* ptrOp1 = op1.data;
+			const T* ptrOp2 = op2.data;
+			long int size = op1.zyxdim;
+			int nr_threads = multidimArrayThreads(size);
+			switch (operation)
+			{
+			case '+':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] + ptrOp2[n];
+				break;
+			case '-':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] - ptrOp2[n];
+				break;
+			case '*':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] * ptrOp2[n];
+				break;
+			case '/':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] / ptrOp2[n];
+				break;
+			}
 		}
 
 		/** Array by array
@@ -2672,68 +3208,39 @@ namespace relion
 			coreArrayByArray(op1, op2, result, operation);
 		}
 
-		/** v3 = v1 + v2.
-		 */
-		MultidimArray<T> operator+(const MultidimArray<T>& op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByArray(*this, op1, tmp, '+');
-			return tmp;
-		}
-
-		/** v3 = v1 - v2.
-		 */
-		MultidimArray<T> operator-(const MultidimArray<T>& op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByArray(*this, op1, tmp, '-');
-			return tmp;
-		}
-
-		/** v3 = v1 * v2.
-		 */
-		MultidimArray<T> operator*(const MultidimArray<T>& op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByArray(*this, op1, tmp, '*');
-			return tmp;
-		}
-
-		/** v3 = v1 / v2.
-		 */
-		MultidimArray<T> operator/(const MultidimArray<T>& op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByArray(*this, op1, tmp, '/');
-			return tmp;
-		}
-
 		/** v3 += v2.
+		 *
+		 * v2 may also be an expression, see MultidimArrayExpressions:
+		 * v3 += v1 * k is evaluated in one pass.
 		 */
-		void operator+=(const MultidimArray<T>& op1)
+		template<typename E>
+		void operator+=(const MultidimExpr<T, E>& op1)
 		{
-			arrayByArray(*this, op1, *this, '+');
+			*this = *this + op1;
 		}
 
 		/** v3 -= v2.
 		 */
-		void operator-=(const MultidimArray<T>& op1)
+		template<typename E>
+		void operator-=(const MultidimExpr<T, E>& op1)
 		{
-			arrayByArray(*this, op1, *this, '-');
+			*this = *this - op1;
 		}
 
 		/** v3 *= v2.
 		 */
-		void operator*=(const MultidimArray<T>& op1)
+		template<typename E>
+		void operator*=(const MultidimExpr<T, E>& op1)
 		{
-			arrayByArray(*this, op1, *this, '*');
+			*this = *this * op1;
 		}
 
 		/** v3 /= v2.
 		 */
-		void operator/=(const MultidimArray<T>& op1)
+		template<typename E>
+		void operator/=(const MultidimExpr<T, E>& op1)
 		{
-			arrayByArray(*this, op1, *this, '/');
+			*this = *this / op1;
 		}
 		//@}
 
@@ -2760,26 +3267,34 @@ namespace relion
 											 MultidimArray<T>& result,
 											 char operation)
 		{
-			T* ptrResult=NULL;
-			T* ptrOp1=NULL;
-			long int n;
-			for (n=0, ptrResult=result.data, ptrOp1=op1.data;
-				 n<op1.zyxdim; ++n, ++ptrResult, ++ptrOp1)
-				switch (operation)
-				{
-				case '+':
-					*ptrResult = *ptrOp1 + op2;
-					break;
-				case '-':
-					*ptrResult = *ptrOp1 - op2;
-					break;
-				case '*':
-					*ptrResult = *ptrOp1 * op2;
-					break;
-				case '/':
-					*ptrResult = *ptrOp1 / op2;
-					break;
-				}
+			T* ptrResult = result.data;
+			const T* ptrOp1 = op1.data;
+			const T val = op2;
+			long int size = op1.zyxdim;
+			int nr_threads = multidimArrayThreads(size);
+			switch (operation)
+			{
+			case '+':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] + val;
+				break;
+			case '-':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] - val;
+				break;
+			case '*':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] * val;
+				break;
+			case '/':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = ptrOp1[n] / val;
+				break;
+			}
 		}
 
 		/** Array by scalar.
@@ -2802,42 +3317,6 @@ namespace relion
 			coreArrayByScalar(op1, op2, result, operation);
 		}
 
-		/** v3 = v1 + k.
-		 */
-		MultidimArray<T> operator+(T op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByScalar(*this, op1, tmp, '+');
-			return tmp;
-		}
-
-		/** v3 = v1 - k.
-		 */
-		MultidimArray<T> operator-(T op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByScalar(*this, op1, tmp, '-');
-			return tmp;
-		}
-
-		/** v3 = v1 * k.
-		 */
-		MultidimArray<T> operator*(T op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByScalar(*this, op1, tmp, '*');
-			return tmp;
-		}
-
-		/** v3 = v1 / k.
-		 */
-		MultidimArray<T> operator/(T op1) const
-		{
-			MultidimArray<T> tmp;
-			arrayByScalar(*this, op1, tmp, '/');
-			return tmp;
-		}
-
 		/** v3 += k.
 		 *
 		 * This function is not ported to Python.
@@ -2899,26 +3378,34 @@ namespace relion
 											 MultidimArray<T>& result,
 											 char operation)
 		{
-			T* ptrResult=NULL;
-			T* ptrOp2=NULL;
-			long int n;
-			for (n=0, ptrResult=result.data, ptrOp2=op2.data;
-				 n<op2.zyxdim; ++n, ++ptrResult, ++ptrOp2)
-				switch (operation)
-				{
-				case '+':
-					*ptrResult = op1 + *ptrOp2;
-					break;
-				case '-':
-					*ptrResult = op1 - *ptrOp2;
-					break;
-				case '*':
-					*ptrResult = op1 * *ptrOp2;
-					break;
-				case '/':
-					*ptrResult = op1 / *ptrOp2;
-					break;
-				}
+			T* ptrResult = result.data;
+			const T* ptrOp2 = op2.data;
+			const T val = op1;
+			long int size = op2.zyxdim;
+			int nr_threads = multidimArrayThreads(size);
+			switch (operation)
+			{
+			case '+':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = val + ptrOp2[n];
+				break;
+			case '-':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = val - ptrOp2[n];
+				break;
+			case '*':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = val * ptrOp2[n];
+				break;
+			case '/':
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+				for (long int n = 0; n < size; n++)
+					ptrResult[n] = val / ptrOp2[n];
+				break;
+			}
 		}
 
 		/** Scalar by array.
@@ -2940,42 +3427,6 @@ namespace relion
 				result.resize(op2);
 			coreScalarByArray(op1, op2, result, operation);
 		}
-
-		/** v3 = k + v2.
-		 */
-		friend MultidimArray<T> operator+(T op1, const MultidimArray<T>& op2)
-		{
-			MultidimArray<T> tmp;
-			scalarByArray(op1, op2, tmp, '+');
-			return tmp;
-		}
-
-		/** v3 = k - v2.
-		 */
-		friend MultidimArray<T> operator-(T op1, const MultidimArray<T>& op2)
-		{
-			MultidimArray<T> tmp;
-			scalarByArray(op1, op2, tmp, '-');
-			return tmp;
-		}
-
-		/** v3 = k * v2.
-		 */
-		friend MultidimArray<T> operator*(T op1, const MultidimArray<T>& op2)
-		{
-			MultidimArray<T> tmp;
-			scalarByArray(op1, op2, tmp, '*');
-			return tmp;
-		}
-
-		/** v3 = k / v2
-		 */
-		friend MultidimArray<T> operator/(T op1, const MultidimArray<T>& op2)
-		{
-			MultidimArray<T> tmp;
-			scalarByArray(op1, op2, tmp, '/');
-			return tmp;
-		}
 		//@}
 
 		/// @name Initialization
@@ -2993,10 +3444,11 @@ namespace relion
 		 */
 		void initConstant(T val)
 		{
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			*ptr = val;
+			long int size = NZYXSIZE(*this);
+			int nr_threads = multidimArrayThreads(size);
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+			for (long int n = 0; n < size; n++)
+				data[n] = val;
 		}
 
 		/** Initialize to zeros following a pattern.
@@ -3013,7 +3465,7 @@ namespace relion
 		{
 			if (data == NULL || !sameShape(op))
 				resize(op);
-			memset(data,0,nzyxdim*sizeof(T));
+			initZeros();
 		}
 
 		/** Initialize to zeros with current size.
@@ -3027,7 +3479,21 @@ namespace relion
 		 */
 		inline void initZeros()
 		{
-			memset(data,0,nzyxdim*sizeof(T));
+			// T may be Complex, which is not a trivial type but a plain pair of numbers
+			// for which all-zero bytes are zero: hence the casts to void*
+			int nr_threads = multidimArrayThreads(nzyxdim);
+			if (nr_threads <= 1)
+			{
+				memset((void*)data,0,nzyxdim*sizeof(T));
+				return;
+			}
+			long int nr_chunks = (nzyxdim + MULTIDIM_PARALLEL_MIN - 1) / MULTIDIM_PARALLEL_MIN;
+#pragma omp parallel for num_threads(nr_threads)
+			for (long int c = 0; c < nr_chunks; c++)
+			{
+				long int first = c * MULTIDIM_PARALLEL_MIN;
+				memset((void*)(data + first), 0, XMIPP_MIN(MULTIDIM_PARALLEL_MIN, nzyxdim - first) * sizeof(T));
+			}
 		}
 
 		/** Initialize to zeros with a given size.
@@ -3036,7 +3502,7 @@ namespace relion
 		{
 			if (xdim!=Xdim || ydim!=Ydim || zdim!=Zdim || ndim!=Ndim)
 				resize(Ndim, Zdim,Ydim,Xdim);
-			memset(data,0,nzyxdim*sizeof(T));
+			initZeros();
 		}
 
 		/** Initialize to zeros with a given size.
@@ -3705,11 +4171,10 @@ namespace relion
 		 */
 		DOUBLE sum() const
 		{
-			DOUBLE sum = 0;
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			sum += *ptr;
+			double sum = 0., sum2;
+			T minval, maxval;
+			if (NZYXSIZE(*this) > 0)
+				arrayStats(data, NZYXSIZE(*this), true, false, false, sum, sum2, minval, maxval);
 			return sum;
 		}
 
@@ -3724,12 +4189,11 @@ namespace relion
 		 */
 		DOUBLE sum2() const
 		{
-			DOUBLE sum = 0;
-			T* ptr=NULL;
-			long int n;
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY_ptr(*this,n,ptr)
-			sum += *ptr * *ptr;
-			return sum;
+			double sum, sum2 = 0.;
+			T minval, maxval;
+			if (NZYXSIZE(*this) > 0)
+				arrayStats(data, NZYXSIZE(*this), false, true, false, sum, sum2, minval, maxval);
+			return sum2;
 		}
 
 		/** Log10.
@@ -4059,6 +4523,59 @@ namespace relion
 			return *this;
 		}
 
+		/** Move assignment.
+		 *
+		 * Takes over the memory of op1, which is left empty. If this array is an alias,
+		 * op1 is copied into the aliased memory as by the normal assignment.
+		 */
+		MultidimArray<T>& operator=(MultidimArray<T>&& op1)
+		{
+			if (&op1 != this)
+			{
+				if (!destroyData && data != NULL)
+					return *this = static_cast<const MultidimArray<T>&>(op1);
+				coreDeallocate();
+				coreTakeOver(op1);
+			}
+			return *this;
+		}
+
+		/** Assignment of an expression, see MultidimArrayExpressions.
+		 *
+		 * The whole expression is evaluated element by element in a single loop.
+		 * The array may be an operand of the expression itself (v1 = v1 * k + v2).
+		 */
+		template<typename E>
+		MultidimArray<T>& operator=(const MultidimExpr<T, E>& op1)
+		{
+			const E& expr = op1.derived();
+			const MultidimArray<T>& shape = expr.exprShape();
+			if (data == NULL || !sameShape(shape))
+				resize(shape);
+
+			T* ptr = data;
+			long int size = NZYXSIZE(*this);
+			int nr_threads = multidimArrayThreads(size);
+#pragma omp parallel for num_threads(nr_threads) if (nr_threads > 1)
+			for (long int n = 0; n < size; n++)
+				ptr[n] = expr.evalAt(n);
+			return *this;
+		}
+
+		/** Element n of the array, as an operand of an expression
+		 */
+		inline const T& evalAt(long int n) const
+		{
+			return data[n];
+		}
+
+		/** The array itself, as the shape of an expression
+		 */
+		inline const MultidimArray<T>& exprShape() const
+		{
+			return *this;
+		}
+
 		/** Unary minus.
 		 *
 		 * It is used to build arithmetic expressions. You can make a minus
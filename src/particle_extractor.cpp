@@ -0,0 +1,192 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/particle_extractor.h"
+#include "src/image_stack_writer.h"
+#include "src/random.h"
+
+namespace relion
+{
+	ParticleExtractor::ParticleExtractor()
+	{
+		extract_size = 0;
+		do_rescale = do_rewindow = false;
+		scale = window = 0;
+		do_normalise = do_ramp = false;
+		bg_radius = 0;
+		white_dust_stddev = black_dust_stddev = -1.;
+		random_seed = 0;
+		do_invert_contrast = false;
+		nr_threads = 1;
+		quantisation_step = 0.;
+		nr_images_done = 0;
+	}
+
+	int ParticleExtractor::getOutputSize() const
+	{
+		if (do_rewindow)
+			return window;
+		if (do_rescale)
+			return scale;
+		return extract_size;
+	}
+
+	void ParticleExtractor::extract(const MultidimArray<DOUBLE> &micrograph, const std::vector<DOUBLE> &xcoords,
+		const std::vector<DOUBLE> &ycoords, MultidimArray<DOUBLE> &stack) const
+	{
+		if (micrograph.getDim() != 2)
+			REPORT_ERROR("ParticleExtractor::extract ERROR: only 2D micrographs can be used");
+		if (xcoords.size() != ycoords.size())
+			REPORT_ERROR("ParticleExtractor::extract ERROR: xcoords and ycoords have different sizes");
+		if (extract_size <= 0)
+			REPORT_ERROR("ParticleExtractor::extract ERROR: extract_size has not been set");
+
+		long int nr_particles = xcoords.size();
+		int size = extract_size;
+		stack.resize(nr_particles, 1, size, size);
+		if (nr_particles == 0)
+			return;
+
+		// The fill value is only needed for boxes that stick out of the micrograph
+		bool is_outside = false;
+		for (long int ipart = 0; ipart < nr_particles; ipart++)
+		{
+			long int x0 = ROUND(xcoords[ipart]) + FIRST_XMIPP_INDEX(size);
+			long int y0 = ROUND(ycoords[ipart]) + FIRST_XMIPP_INDEX(size);
+			if (x0 < 0 || y0 < 0 || x0 + size > XSIZE(micrograph) || y0 + size > YSIZE(micrograph))
+				is_outside = true;
+		}
+		DOUBLE fill = (is_outside) ? micrograph.computeAvg() : 0.;
+
+		int nr_extract_threads = getTaskNrThreads(nr_threads);
+#pragma omp parallel for num_threads(nr_extract_threads)
+		for (long int ipart = 0; ipart < nr_particles; ipart++)
+		{
+			long int x0 = ROUND(xcoords[ipart]) + FIRST_XMIPP_INDEX(size);
+			long int y0 = ROUND(ycoords[ipart]) + FIRST_XMIPP_INDEX(size);
+			long int jmin = XMIPP_MAX(0L, -x0), jmax = XMIPP_MIN((long int)size, XSIZE(micrograph) - x0);
+			for (long int i = 0; i < size; i++)
+			{
+				DOUBLE *out = &DIRECT_NZYX_ELEM(stack, ipart, 0, i, 0);
+				long int ip = y0 + i;
+				if (ip < 0 || ip >= YSIZE(micrograph) || jmin >= jmax)
+				{
+					for (long int j = 0; j < size; j++)
+						out[j] = fill;
+					continue;
+				}
+				for (long int j = 0; j < jmin; j++)
+					out[j] = fill;
+				memcpy(out + jmin, &DIRECT_A2D_ELEM(micrograph, ip, x0 + jmin), (jmax - jmin) * sizeof(DOUBLE));
+				for (long int j = jmax; j < size; j++)
+					out[j] = fill;
+			}
+		}
+	}
+
+	void ParticleExtractor::performPerImageOperations(MultidimArray<DOUBLE> &stack)
+	{
+		long int nr_images = NSIZE(stack);
+		if (nr_images == 0)
+			return;
+		unsigned long long first_image = nr_images_done;
+		nr_images_done += nr_images;
+
+		// Re-scaling of all images at once: one windowing FFT (or a padding one per image for upscaling)
+		if (do_rescale && scale != XSIZE(stack))
+		{
+			if (scale < XSIZE(stack))
+			{
+				forward_transformer.setThreadsNumber(nr_threads);
+				inverse_transformer.setThreadsNumber(nr_threads);
+				forward_transformer.FourierTransform(stack, Fstack, scale);
+				stack.resize(nr_images, 1, scale, scale);
+				inverse_transformer.inverseFourierTransform(Fstack, stack);
+			}
+			else
+			{
+				MultidimArray<DOUBLE> rescaled(nr_images, 1, scale, scale);
+				int nr_rescale_threads = getTaskNrThreads(nr_threads);
+#pragma omp parallel num_threads(nr_rescale_threads)
+				{
+					// One resizer per thread: its plans and buffers are made for the first image only
+					MapResizer resizer;
+					MultidimArray<DOUBLE> img, img_scaled;
+#pragma omp for
+					for (long int n = 0; n < nr_images; n++)
+					{
+						stack.getImage(n, img);
+						resizer.resizeMap(img, img_scaled, scale);
+						memcpy(&DIRECT_NZYX_ELEM(rescaled, n, 0, 0, 0), MULTIDIM_ARRAY(img_scaled), YXSIZE(img_scaled) * sizeof(DOUBLE));
+					}
+				}
+				stack = std::move(rescaled);
+			}
+		}
+
+		// The other operations image by image
+		if (!do_rewindow && !do_normalise && !do_invert_contrast)
+			return;
+		int out_size = (do_rewindow) ? window : XSIZE(stack);
+		MultidimArray<DOUBLE> result;
+		MultidimArray<DOUBLE> &out = (out_size == XSIZE(stack)) ? stack : result;
+		if (out_size != XSIZE(stack))
+			result.resize(nr_images, 1, out_size, out_size);
+		// Every image has its own random stream for the dust removal, so the result does not depend on the threads
+		int nr_image_threads = getTaskNrThreads(nr_threads);
+#pragma omp parallel for num_threads(nr_image_threads)
+		for (long int n = 0; n < nr_images; n++)
+		{
+			Image<DOUBLE> Ipart;
+			RandomGenerator rng(random_seed, first_image + n);
+			stack.getImage(n, Ipart());
+			Ipart().setXmippOrigin();
+			if (do_rewindow)
+				rewindow(Ipart, window);
+			if (do_normalise)
+				normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp, &rng);
+			if (do_invert_contrast)
+				invert_contrast(Ipart);
+			memcpy(&DIRECT_NZYX_ELEM(out, n, 0, 0, 0), MULTIDIM_ARRAY(Ipart()), YXSIZE(Ipart()) * sizeof(DOUBLE));
+		}
+		if (out_size != XSIZE(stack))
+			stack = std::move(result);
+	}
+
+	long int ParticleExtractor::extractToStack(const FileName &fn_mic, const std::vector<DOUBLE> &xcoords,
+		const std::vector<DOUBLE> &ycoords, const FileName &fn_stack)
+	{
+		MultidimArray<DOUBLE> stack;
+		{
+			Image<DOUBLE> Imic;
+			Imic.read(fn_mic, true, -1, true);
+			extract(Imic(), xcoords, ycoords, stack);
+		}
+		performPerImageOperations(stack);
+
+		int out_size = getOutputSize();
+		ImageStackWriter writer(fn_stack, out_size, out_size);
+		writer.setQuantisationStep(quantisation_step);
+		if (NSIZE(stack) > 0)
+			writer.write(stack);
+		writer.close();
+		return NSIZE(stack);
+	}
+}
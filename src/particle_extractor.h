@@ -0,0 +1,109 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PARTICLE_EXTRACTOR_H
+#define PARTICLE_EXTRACTOR_H
+
+#include <vector>
+#include "src/image.h"
+#include "src/fftw.h"
+
+namespace relion
+{
+	/** Extraction of all particles of a micrograph as one batch, with the per-image operations of Preprocessing
+	 *
+	 * The micrograph is read once (memory-mapped when its data can be used as it is), all boxes are cut out in
+	 * parallel, re-scaling is done with two batched FFTs over the whole stack, and re-windowing, normalisation and
+	 * contrast inversion run in parallel over the images. The resulting stack is written with a single asynchronous
+	 * ImageStackWriter::write. The operations are those of Preprocessing::performPerImageOperations, in the same order:
+	 * rescale, rewindow, normalise, invert contrast.
+	 *
+	 * @code
+	 * ParticleExtractor extractor;
+	 * extractor.extract_size = 256;
+	 * extractor.do_rescale = true;
+	 * extractor.scale = 128;
+	 * extractor.do_normalise = true;
+	 * extractor.bg_radius = 50;
+	 * extractor.nr_threads = 8;
+	 * extractor.extractToStack("mic001.mrc", xcoords, ycoords, "Particles/mic001.mrcs");
+	 * @endcode
+	 */
+	class ParticleExtractor
+	{
+	public:
+		// Box size to extract the particles in (in micrograph pixels)
+		int extract_size;
+
+		// Re-scaling and re-windowing of the extracted boxes
+		bool do_rescale, do_rewindow;
+		int scale, window;
+
+		// Normalisation (see normalise), with the background radius in pixels of the re-scaled and re-windowed boxes
+		bool do_normalise, do_ramp;
+		int bg_radius;
+		DOUBLE white_dust_stddev, black_dust_stddev;
+
+		// Noise for the dust removal: image n (counting over all calls) gets stream n of random_seed
+		unsigned long long random_seed;
+
+		// Contrast inversion
+		bool do_invert_contrast;
+
+		// Threads for the extraction, the FFTs and the per-image operations
+		int nr_threads;
+
+		// Quantisation step of compressed (.lcs) output stacks (see ImageStackWriter::setQuantisationStep)
+		DOUBLE quantisation_step;
+
+		// Defaults: no operations, 1 thread
+		ParticleExtractor();
+
+		/// The box size of the images after all operations
+		int getOutputSize() const;
+
+		/** Cut out the boxes of extract_size pixels centred on (ROUND(xcoords[i]), ROUND(ycoords[i])) into stack
+		 * The coordinates are in pixels from the first pixel of the micrograph (as rlnCoordinateX and rlnCoordinateY).
+		 * Pixels of a box that fall outside the micrograph get the average value of the micrograph.
+		 */
+		void extract(const MultidimArray<DOUBLE> &micrograph, const std::vector<DOUBLE> &xcoords,
+			const std::vector<DOUBLE> &ycoords, MultidimArray<DOUBLE> &stack) const;
+
+		/// The per-image operations on all images of stack (which is resized to getOutputSize())
+		void performPerImageOperations(MultidimArray<DOUBLE> &stack);
+
+		/** Read fn_mic, extract all particles, perform the per-image operations and write them to the stack fn_stack
+		 * This is an MRC stack, or a compressed stack if fn_stack has the extension .lcs.
+		 * Returns the number of particles written.
+		 */
+		long int extractToStack(const FileName &fn_mic, const std::vector<DOUBLE> &xcoords,
+			const std::vector<DOUBLE> &ycoords, const FileName &fn_stack);
+
+	private:
+		// For re-scaling the whole stack at once
+		BatchFourierTransformer forward_transformer, inverse_transformer;
+		MultidimArray<Complex > Fstack;
+
+		// Images processed by performPerImageOperations so far
+		unsigned long long nr_images_done;
+	};
+}
+
+#endif
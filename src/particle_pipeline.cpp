@@ -0,0 +1,274 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/particle_pipeline.h"
+
+namespace relion
+{
+	// The projection matrices of the particles of a batch
+	static void getBatchMatrices(const ParticleBatch &batch, std::vector<DOUBLE> &A)
+	{
+		A.resize(9 * batch.count);
+		for (long int n = 0; n < batch.count; n++)
+			for (int i = 0; i < 9; i++)
+				A[9 * n + i] = batch.particles[batch.first + n].A[i];
+	}
+
+	ParticleReader::ParticleReader(const std::vector<PipelineParticle> &_particles, int _batch_size) : particles(_particles)
+	{
+		batch_size = XMIPP_MAX(1, _batch_size);
+		next = 0;
+	}
+
+	PipelineBatch* ParticleReader::newBatch()
+	{
+		return new ParticleBatch();
+	}
+
+	long int ParticleReader::getBatchCount(long int first) const
+	{
+		long int count = 1;
+		while (count < batch_size && first + count < (long int)particles.size() &&
+			particles[first + count].fn_stack == particles[first].fn_stack &&
+			particles[first + count].image == particles[first].image + count)
+			count++;
+		return count;
+	}
+
+	bool ParticleReader::fill(PipelineBatch &_batch)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+		if (next >= (long int)particles.size())
+			return false;
+
+		const PipelineParticle &particle = particles[next];
+		long int count = getBatchCount(next);
+		if (!reader.isOpen() || fn_open != particle.fn_stack)
+		{
+			reader.open(particle.fn_stack);
+			fn_open = particle.fn_stack;
+		}
+		if (particle.image < 0 || particle.image + count > reader.getStackSize())
+			REPORT_ERROR((std::string)"ParticleReader: image out of range of " + particle.fn_stack);
+		reader.read(particle.image, count, batch.images);
+
+		batch.particles = &particles[0];
+		batch.first = next;
+		batch.count = count;
+		next += count;
+
+		// Read the next batch in the background while the stages work on this one
+		if (next < (long int)particles.size() && particles[next].fn_stack == fn_open)
+			reader.prefetch(particles[next].image, getBatchCount(next));
+		return true;
+	}
+
+	ParticleFourierStage::ParticleFourierStage(int _current_size)
+	{
+		current_size = _current_size;
+	}
+
+	void ParticleFourierStage::start(int nr_threads)
+	{
+		transformers.resize(nr_threads);
+	}
+
+	void ParticleFourierStage::process(PipelineBatch &_batch, int thread_id)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+		MultidimArray<DOUBLE> &images = batch.images;
+		long int image_size = YXSIZE(images);
+		DOUBLE ori_size = (DOUBLE)XSIZE(images);
+
+		// Centre every image in its place in the stack, as CenterFFT(img, true) before a FourierTransformer
+		MultidimArray<DOUBLE> img;
+		for (long int n = 0; n < batch.count; n++)
+		{
+			images.getImage(n, img);
+			CenterFFT(img, true);
+			memcpy(MULTIDIM_ARRAY(images) + n * image_size, MULTIDIM_ARRAY(img), image_size * sizeof(DOUBLE));
+		}
+
+		transformers[thread_id].FourierTransform(images, batch.Fimages, current_size);
+
+		// Origin offsets as phase shifts
+		MultidimArray<Complex > &Fimages = batch.Fimages;
+		long int fimage_size = YXSIZE(Fimages);
+		MultidimArray<Complex > Fimg;
+		for (long int n = 0; n < batch.count; n++)
+		{
+			const PipelineParticle &particle = batch.particles[batch.first + n];
+			if (particle.shift_x == 0. && particle.shift_y == 0.)
+				continue;
+			Fimages.getImage(n, Fimg);
+			shiftImageInFourierTransform(Fimg, Fimg, ori_size, particle.shift_x, particle.shift_y);
+			memcpy(MULTIDIM_ARRAY(Fimages) + n * fimage_size, MULTIDIM_ARRAY(Fimg), fimage_size * sizeof(Complex));
+		}
+	}
+
+	ParticleCTFStage::ParticleCTFStage(DOUBLE _angpix, CTFImageCache *_cache)
+	{
+		angpix = _angpix;
+		cache = _cache;
+	}
+
+	void ParticleCTFStage::process(PipelineBatch &_batch, int /*thread_id*/)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+		int ori_size = XSIZE(batch.images);
+		batch.Fctfs.resize(batch.count, 1, YSIZE(batch.Fimages), XSIZE(batch.Fimages));
+		long int fimage_size = YXSIZE(batch.Fctfs);
+
+		MultidimArray<DOUBLE> Fctf(YSIZE(batch.Fctfs), XSIZE(batch.Fctfs));
+		for (long int n = 0; n < batch.count; n++)
+		{
+			const CTF &ctf = batch.particles[batch.first + n].ctf;
+			if (cache != NULL)
+				cache->getFftwImage(ctf, Fctf, ori_size, ori_size, angpix);
+			else
+				ctf.getFftwImage(Fctf, ori_size, ori_size, angpix);
+			memcpy(MULTIDIM_ARRAY(batch.Fctfs) + n * fimage_size, MULTIDIM_ARRAY(Fctf), fimage_size * sizeof(DOUBLE));
+		}
+	}
+
+	ParticleCompareStage::ParticleCompareStage(Projector &_projector, int _nr_threads_per_batch) : projector(_projector)
+	{
+		nr_threads_per_batch = _nr_threads_per_batch;
+	}
+
+	void ParticleCompareStage::process(PipelineBatch &_batch, int /*thread_id*/)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+		const MultidimArray<Complex > &Fimages = batch.Fimages;
+		std::vector<DOUBLE> A;
+		getBatchMatrices(batch, A);
+		batch.Frefs.resize(batch.count, 1, YSIZE(Fimages), XSIZE(Fimages));
+		projector.projectBatch(batch.Frefs, &A[0], batch.count, false, nr_threads_per_batch);
+
+		// Without a CTF stage, the CTF is 1
+		bool has_ctf = batch.Fctfs.sameShape(Fimages);
+		long int fimage_size = YXSIZE(Fimages);
+		batch.diff2.resize(batch.count);
+		for (long int n = 0; n < batch.count; n++)
+		{
+			const Complex *fimg = MULTIDIM_ARRAY(Fimages) + n * fimage_size;
+			const Complex *fref = MULTIDIM_ARRAY(batch.Frefs) + n * fimage_size;
+			const DOUBLE *fctf = (has_ctf) ? MULTIDIM_ARRAY(batch.Fctfs) + n * fimage_size : NULL;
+			double sum = 0.;
+			for (long int i = 0; i < fimage_size; i++)
+			{
+				DOUBLE ctf = (has_ctf) ? fctf[i] : 1.;
+				DOUBLE dr = fimg[i].real - ctf * fref[i].real;
+				DOUBLE di = fimg[i].imag - ctf * fref[i].imag;
+				sum += dr * dr + di * di;
+			}
+			batch.diff2[n] = sum;
+		}
+	}
+
+	ParticleInsertStage::ParticleInsertStage(BackProjector &_backprojector, int _nr_threads_per_batch) : backprojector(_backprojector)
+	{
+		nr_threads_per_batch = _nr_threads_per_batch;
+	}
+
+	// CTF * image with weight CTF^2 for the insertion stages (false without a CTF stage: then insert the images with weight 1)
+	static bool getWeightedImages(const ParticleBatch &batch, MultidimArray<Complex > &Fweighted, MultidimArray<DOUBLE> &Fweight)
+	{
+		if (!batch.Fctfs.sameShape(batch.Fimages))
+			return false;
+
+		Fweighted.resize(batch.Fimages);
+		Fweight.resize(batch.Fctfs);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fweighted)
+		{
+			DOUBLE ctf = DIRECT_MULTIDIM_ELEM(batch.Fctfs, n);
+			DIRECT_MULTIDIM_ELEM(Fweighted, n) = DIRECT_MULTIDIM_ELEM(batch.Fimages, n) * ctf;
+			DIRECT_MULTIDIM_ELEM(Fweight, n) = ctf * ctf;
+		}
+		return true;
+	}
+
+	void ParticleInsertStage::process(PipelineBatch &_batch, int /*thread_id*/)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+		std::vector<DOUBLE> A;
+		getBatchMatrices(batch, A);
+
+		MultidimArray<Complex > Fweighted;
+		MultidimArray<DOUBLE> Fweight;
+		bool has_ctf = getWeightedImages(batch, Fweighted, Fweight);
+
+		std::unique_lock<std::mutex> lock(insert_mutex);
+		backprojector.backprojectBatch((has_ctf) ? Fweighted : batch.Fimages, &A[0], batch.count, false,
+			(has_ctf) ? &Fweight : NULL, nr_threads_per_batch);
+	}
+
+	ParticleFrameInsertStage::ParticleFrameInsertStage(const std::vector<BackProjector*> &_backprojectors, int _nr_threads_per_batch) :
+		backprojectors(_backprojectors), insert_mutexes(_backprojectors.size())
+	{
+		nr_threads_per_batch = _nr_threads_per_batch;
+	}
+
+	void ParticleFrameInsertStage::process(PipelineBatch &_batch, int /*thread_id*/)
+	{
+		ParticleBatch &batch = static_cast<ParticleBatch&>(_batch);
+
+		MultidimArray<Complex > Fweighted;
+		MultidimArray<DOUBLE> Fweight;
+		bool has_ctf = getWeightedImages(batch, Fweighted, Fweight);
+		const MultidimArray<Complex > &Fins = (has_ctf) ? Fweighted : batch.Fimages;
+
+		// Gather the images of each frame into one sub-batch
+		long int imgsize = YXSIZE(Fins);
+		MultidimArray<Complex > Fframe;
+		MultidimArray<DOUBLE> Fframe_weight;
+		std::vector<DOUBLE> A;
+		for (int iframe = 0; iframe < (int)backprojectors.size(); iframe++)
+		{
+			long int nr_frame_images = 0;
+			for (long int n = 0; n < batch.count; n++)
+				if (batch.particles[batch.first + n].frame == iframe)
+					nr_frame_images++;
+			if (nr_frame_images == 0)
+				continue;
+
+			Fframe.resize(nr_frame_images, 1, YSIZE(Fins), XSIZE(Fins));
+			if (has_ctf)
+				Fframe_weight.resize(nr_frame_images, 1, YSIZE(Fins), XSIZE(Fins));
+			A.resize(9 * nr_frame_images);
+			for (long int n = 0, m = 0; n < batch.count; n++)
+			{
+				const PipelineParticle &particle = batch.particles[batch.first + n];
+				if (particle.frame != iframe)
+					continue;
+				memcpy(MULTIDIM_ARRAY(Fframe) + m * imgsize, MULTIDIM_ARRAY(Fins) + n * imgsize, imgsize * sizeof(Complex));
+				if (has_ctf)
+					memcpy(MULTIDIM_ARRAY(Fframe_weight) + m * imgsize, MULTIDIM_ARRAY(Fweight) + n * imgsize, imgsize * sizeof(DOUBLE));
+				for (int i = 0; i < 9; i++)
+					A[9 * m + i] = particle.A[i];
+				m++;
+			}
+
+			std::unique_lock<std::mutex> lock(insert_mutexes[iframe]);
+			backprojectors[iframe]->backprojectBatch(Fframe, &A[0], nr_frame_images, false,
+				(has_ctf) ? &Fframe_weight : NULL, nr_threads_per_batch);
+		}
+	}
+}
@@ -0,0 +1,195 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PARTICLE_PIPELINE_H
+#define PARTICLE_PIPELINE_H
+
+#include <vector>
+#include <mutex>
+#include "src/pipeline.h"
+#include "src/image_stack_reader.h"
+#include "src/fftw.h"
+#include "src/ctf.h"
+#include "src/projector.h"
+#include "src/backprojector.h"
+
+namespace relion
+{
+	/// One particle for the stages below: where its image is, its CTF, orientation and origin offset
+	struct PipelineParticle
+	{
+		// MRC stack, and the image in it (counting from 0)
+		FileName fn_stack;
+		long int image;
+
+		CTF ctf;
+
+		// Projection direction (row-major 3x3 matrix, as for Projector::projectBatch with inv = false)
+		DOUBLE A[9];
+
+		// Origin offset in pixels (as rlnOriginX and rlnOriginY): the image is shifted by this much
+		DOUBLE shift_x, shift_y;
+
+		// Movie frame of the image (counting from 0), for ParticleFrameInsertStage
+		int frame;
+
+		PipelineParticle() : image(0), shift_x(0.), shift_y(0.), frame(0) {}
+	};
+
+	/** The data of a batch of consecutive particles while it goes through the stages
+	 * Which stage fills which member is given below; stages only work on the particles first ... first + count - 1.
+	 */
+	class ParticleBatch : public PipelineBatch
+	{
+	public:
+		// From ParticleReader
+		const PipelineParticle *particles;
+		long int first, count;
+		MultidimArray<DOUBLE> images; // count x 1 x ori_size x ori_size (centred in place by ParticleFourierStage)
+
+		// From ParticleFourierStage: centred (as after CenterFFT), shifted and windowed to current_size
+		MultidimArray<Complex > Fimages;
+
+		// From ParticleCTFStage: the CTFs of Fimages
+		MultidimArray<DOUBLE> Fctfs;
+
+		// From ParticleCompareStage: the projections of the reference, and for every particle the sum of
+		// |Fimage - CTF * projection|^2 over all pixels of its (half) transform
+		MultidimArray<Complex > Frefs;
+		std::vector<DOUBLE> diff2;
+
+		ParticleBatch() : particles(NULL), first(0), count(0) {}
+	};
+
+	/** Source that reads the images of a list of particles in batches from their MRC stacks
+	 * A batch holds at most batch_size particles, which are consecutive images in the same stack
+	 * (so sort the particles on stack and image number for batches of the full size). Each batch is read
+	 * with a single read, and the next one is prefetched in the background (see ImageStackReader).
+	 */
+	class ParticleReader : public PipelineSource
+	{
+	public:
+		// particles must stay unchanged during Pipeline::run
+		ParticleReader(const std::vector<PipelineParticle> &particles, int batch_size = 64);
+
+		PipelineBatch* newBatch();
+		bool fill(PipelineBatch &batch);
+
+	private:
+		const std::vector<PipelineParticle> &particles;
+		int batch_size;
+		long int next;
+		ImageStackReader reader;
+
+		// The stack that is open in reader
+		FileName fn_open;
+
+		// Number of particles from first on that are consecutive images of the same stack (at most batch_size)
+		long int getBatchCount(long int first) const;
+	};
+
+	/// Forward FFTs of the images (centred first), origin shifts, and windowing to current_size
+	class ParticleFourierStage : public PipelineStage
+	{
+	public:
+		// current_size <= 0 keeps the full size
+		ParticleFourierStage(int current_size = -1);
+
+		const char* getName() const { return "fourier"; }
+		void start(int nr_threads);
+		void process(PipelineBatch &batch, int thread_id);
+
+	private:
+		int current_size;
+		std::vector<BatchFourierTransformer> transformers;
+	};
+
+	/// CTF images for the Fourier transforms of the particles (through a cache if one is given)
+	class ParticleCTFStage : public PipelineStage
+	{
+	public:
+		ParticleCTFStage(DOUBLE angpix, CTFImageCache *cache = NULL);
+
+		const char* getName() const { return "ctf"; }
+		void process(PipelineBatch &batch, int thread_id);
+
+	private:
+		DOUBLE angpix;
+		CTFImageCache *cache;
+	};
+
+	/// Projections of the reference in the particle orientations, and their squared differences with the images
+	class ParticleCompareStage : public PipelineStage
+	{
+	public:
+		// Projector::projectBatch runs on nr_threads_per_batch threads; the projector is only read
+		ParticleCompareStage(Projector &projector, int nr_threads_per_batch = 1);
+
+		const char* getName() const { return "project/compare"; }
+		void process(PipelineBatch &batch, int thread_id);
+
+	private:
+		Projector &projector;
+		int nr_threads_per_batch;
+	};
+
+	/** Insertion of CTF * image with weight CTF^2 into a backprojector (BackProjector::backprojectBatch)
+	 * Batches are inserted one at a time (each on nr_threads_per_batch threads), so more threads for this stage
+	 * do not help; the order of insertion follows the order in which batches arrive.
+	 */
+	class ParticleInsertStage : public PipelineStage
+	{
+	public:
+		ParticleInsertStage(BackProjector &backprojector, int nr_threads_per_batch = 1);
+
+		const char* getName() const { return "insert"; }
+		void process(PipelineBatch &batch, int thread_id);
+
+	private:
+		BackProjector &backprojector;
+		int nr_threads_per_batch;
+		std::mutex insert_mutex;
+	};
+
+	/** Insertion of movie frames into one backprojector per frame, as for single-frame reconstructions
+	 * Like ParticleInsertStage, but every image goes into backprojectors[frame] of its PipelineParticle (images of frames
+	 * outside the vector are skipped). With the frames of each movie particle stored as consecutive images of a stack,
+	 * ParticleReader reads all frames of a particle at once, so all single-frame reconstructions need only one pass
+	 * over the data. Different frames are inserted concurrently, so this stage may have several threads. Afterwards the
+	 * backprojectors can be reconstructed together with reconstructBatch().
+	 */
+	class ParticleFrameInsertStage : public PipelineStage
+	{
+	public:
+		ParticleFrameInsertStage(const std::vector<BackProjector*> &backprojectors, int nr_threads_per_batch = 1);
+
+		const char* getName() const { return "insert frames"; }
+		void process(PipelineBatch &batch, int thread_id);
+
+	private:
+		std::vector<BackProjector*> backprojectors;
+		int nr_threads_per_batch;
+
+		// One per backprojector
+		std::vector<std::mutex> insert_mutexes;
+	};
+}
+
+#endif
@@ -0,0 +1,289 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include "src/pipeline.h"
+#include "src/error.h"
+
+namespace relion
+{
+	typedef PipelineQueue<PipelineBatch> PipelineBatchQueue;
+
+	// State shared by the threads of one Pipeline::run
+	struct PipelineRun
+	{
+		PipelineSource *source;
+		std::vector<PipelineStage*> stages;
+
+		// queues[s] is the input of stage s; queues[nr_stages] holds the free batches for the source
+		std::vector<PipelineBatchQueue*> queues;
+
+		std::atomic<bool> do_abort;
+
+		// Guards the rest
+		std::mutex mutex;
+		std::vector<int> nr_running;
+		std::vector<RelionError> errors;
+		std::vector<PipelineStageStatistics> statistics;
+	};
+
+	struct PipelineThreadArgs
+	{
+		PipelineRun *run;
+		int stage, thread_id;
+	};
+
+	static double getPipelineSeconds()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void recordPipelineError(PipelineRun *run, const RelionError &error)
+	{
+		std::unique_lock<std::mutex> lock(run->mutex);
+		run->errors.push_back(error);
+		run->do_abort = true;
+	}
+
+	// Wait for the next batch of queue; false when it is closed and empty, or the pipeline is stopped
+	static bool popBatch(PipelineRun *run, PipelineBatchQueue *queue, PipelineBatch *&batch)
+	{
+		for (int attempt = 0; ; attempt++)
+		{
+			if (run->do_abort)
+				return false;
+			if (queue->tryPop(batch))
+				return true;
+			if (queue->isClosed())
+				return queue->tryPop(batch); // an item may have been pushed just before the queue was closed
+
+			// Spin briefly, then give the core away
+			if (attempt < 64)
+				continue;
+			else if (attempt < 128)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	// Every queue can hold all batches, so this never has to wait
+	static void pushBatch(PipelineBatchQueue *queue, PipelineBatch *batch)
+	{
+		if (!queue->tryPush(batch))
+			REPORT_ERROR("Pipeline%%BUG: queue is full");
+	}
+
+	static void runPipelineStage(PipelineThreadArgs *args)
+	{
+		PipelineRun *run = args->run;
+		int s = args->stage;
+		PipelineStage *stage = run->stages[s];
+		PipelineBatchQueue *in = run->queues[s];
+		PipelineBatchQueue *out = run->queues[s + 1];
+		double busy = 0., wait = 0.;
+		long int nr_batches = 0;
+
+		PipelineBatch *batch;
+		double t0 = getPipelineSeconds();
+		while (popBatch(run, in, batch))
+		{
+			double t1 = getPipelineSeconds();
+			wait += t1 - t0;
+			try
+			{
+				stage->process(*batch, args->thread_id);
+			}
+			catch (RelionError &error)
+			{
+				recordPipelineError(run, error);
+			}
+			catch (std::exception &error)
+			{
+				recordPipelineError(run, RelionError((std::string)"Pipeline stage " + stage->getName() + ": " + error.what(), __FILE__, __LINE__));
+			}
+			pushBatch(out, batch);
+			t0 = getPipelineSeconds();
+			busy += t0 - t1;
+			nr_batches++;
+		}
+		wait += getPipelineSeconds() - t0;
+
+		std::unique_lock<std::mutex> lock(run->mutex);
+		PipelineStageStatistics &stats = run->statistics[s + 1];
+		stats.busy_seconds += busy;
+		stats.wait_seconds += wait;
+		stats.nr_batches += nr_batches;
+
+		// The last thread of a stage closes the queue to the next one (the free queue is never closed)
+		if (--run->nr_running[s] == 0 && s + 1 < (int)run->stages.size())
+			out->close();
+	}
+
+	Pipeline::Pipeline()
+	{
+		source = NULL;
+		nr_batches = 4;
+	}
+
+	void Pipeline::setSource(PipelineSource *_source, int _nr_batches)
+	{
+		source = _source;
+		nr_batches = (_nr_batches < 2) ? 2 : _nr_batches;
+	}
+
+	void Pipeline::addStage(PipelineStage *stage, int nr_threads)
+	{
+		if (stage == NULL)
+			REPORT_ERROR("Pipeline::addStage: no stage given");
+		stages.push_back(stage);
+		stage_threads.push_back((nr_threads < 1) ? 1 : nr_threads);
+	}
+
+	void Pipeline::run()
+	{
+		if (source == NULL || stages.empty())
+			REPORT_ERROR("Pipeline::run: the pipeline needs a source and at least one stage");
+
+		int nr_stages = stages.size();
+		PipelineRun state;
+		state.source = source;
+		state.stages = stages;
+		state.do_abort = false;
+		state.nr_running = stage_threads;
+		state.statistics.resize(nr_stages + 1);
+		state.statistics[0].name = "source";
+		state.statistics[0].nr_threads = 1;
+		for (int s = 0; s < nr_stages; s++)
+		{
+			state.statistics[s + 1].name = stages[s]->getName();
+			state.statistics[s + 1].nr_threads = stage_threads[s];
+		}
+		for (int s = 0; s <= nr_stages; s++)
+		{
+			state.statistics[s].nr_batches = 0;
+			state.statistics[s].busy_seconds = state.statistics[s].wait_seconds = 0.;
+			state.queues.push_back(new PipelineBatchQueue(nr_batches));
+		}
+
+		std::vector<PipelineBatch*> batches;
+		std::vector<PipelineThreadArgs> args;
+		std::vector<std::thread*> threads;
+		try
+		{
+			for (int b = 0; b < nr_batches; b++)
+			{
+				batches.push_back(source->newBatch());
+				pushBatch(state.queues[nr_stages], batches.back());
+			}
+			for (int s = 0; s < nr_stages; s++)
+				stages[s]->start(stage_threads[s]);
+		}
+		catch (RelionError &error)
+		{
+			recordPipelineError(&state, error);
+		}
+
+		if (!state.do_abort)
+		{
+			// Reserved beforehand, as the threads keep pointers to their arguments
+			for (int s = 0; s < nr_stages; s++)
+			{
+				for (int t = 0; t < stage_threads[s]; t++)
+				{
+					PipelineThreadArgs arg;
+					arg.run = &state;
+					arg.stage = s;
+					arg.thread_id = t;
+					args.push_back(arg);
+				}
+			}
+			for (size_t i = 0; i < args.size(); i++)
+				threads.push_back(new std::thread(runPipelineStage, &args[i]));
+
+			// The source runs on this thread
+			PipelineStageStatistics &stats = state.statistics[0];
+			long int index = 0;
+			PipelineBatch *batch;
+			double t0 = getPipelineSeconds();
+			while (popBatch(&state, state.queues[nr_stages], batch))
+			{
+				double t1 = getPipelineSeconds();
+				stats.wait_seconds += t1 - t0;
+				bool has_more = false;
+				try
+				{
+					has_more = source->fill(*batch);
+				}
+				catch (RelionError &error)
+				{
+					recordPipelineError(&state, error);
+				}
+				catch (std::exception &error)
+				{
+					recordPipelineError(&state, RelionError((std::string)"Pipeline source: " + error.what(), __FILE__, __LINE__));
+				}
+				t0 = getPipelineSeconds();
+				stats.busy_seconds += t0 - t1;
+				if (!has_more)
+				{
+					pushBatch(state.queues[nr_stages], batch);
+					break;
+				}
+				batch->index = index++;
+				stats.nr_batches++;
+				pushBatch(state.queues[0], batch);
+			}
+			state.queues[0]->close();
+
+			for (size_t i = 0; i < threads.size(); i++)
+			{
+				threads[i]->join();
+				delete threads[i];
+			}
+		}
+
+		for (size_t b = 0; b < batches.size(); b++)
+			delete batches[b];
+		for (size_t q = 0; q < state.queues.size(); q++)
+			delete state.queues[q];
+		statistics = state.statistics;
+
+		if (!state.errors.empty())
+			throw state.errors[0];
+	}
+
+	void Pipeline::printStatistics(std::ostream &out) const
+	{
+		out << " Pipeline stage         threads   batches   busy (s)   waiting (s)" << std::endl;
+		for (size_t s = 0; s < statistics.size(); s++)
+		{
+			const PipelineStageStatistics &stats = statistics[s];
+			out << " " << std::left << std::setw(22) << stats.name << std::right
+				<< std::setw(8) << stats.nr_threads << std::setw(10) << stats.nr_batches
+				<< std::fixed << std::setprecision(3) << std::setw(11) << stats.busy_seconds
+				<< std::setw(14) << stats.wait_seconds << std::endl;
+		}
+	}
+}
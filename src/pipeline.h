@@ -0,0 +1,237 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <iostream>
+#include <stdint.h>
+
+namespace relion
+{
+	/** Bounded lock-free queue of pointers, for any number of producer and consumer threads
+	 *
+	 * A ring of capacity cells (rounded up to a power of two), each with a sequence number that tells the producers and
+	 * consumers whose turn it is (D. Vyukov's bounded MPMC queue). tryPush and tryPop never block nor take a lock.
+	 */
+	template <typename T>
+	class PipelineQueue
+	{
+	public:
+		PipelineQueue(size_t capacity) : cells(getRingSize(capacity))
+		{
+			for (size_t i = 0; i < cells.size(); i++)
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			mask = cells.size() - 1;
+			enqueue_pos.store(0, std::memory_order_relaxed);
+			dequeue_pos.store(0, std::memory_order_relaxed);
+			closed.store(false, std::memory_order_relaxed);
+		}
+
+		// Add item; false if the queue is full
+		bool tryPush(T *item)
+		{
+			Cell *cell;
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell = &cells[pos & mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)sequence - (intptr_t)pos;
+				if (dif == 0)
+				{
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false;
+				else
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+			cell->item = item;
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Take the oldest item; false if the queue is empty
+		bool tryPop(T *&item)
+		{
+			Cell *cell;
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell = &cells[pos & mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)sequence - (intptr_t)(pos + 1);
+				if (dif == 0)
+				{
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false;
+				else
+					pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+			item = cell->item;
+			cell->sequence.store(pos + mask + 1, std::memory_order_release);
+			return true;
+		}
+
+		// No more items will be pushed (consumers stop when the queue is closed and empty)
+		void close()
+		{
+			closed.store(true, std::memory_order_release);
+		}
+
+		bool isClosed() const
+		{
+			return closed.load(std::memory_order_acquire);
+		}
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T *item;
+		};
+
+		static size_t getRingSize(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size *= 2;
+			return size;
+		}
+
+		std::vector<Cell> cells;
+		size_t mask;
+		std::atomic<size_t> enqueue_pos, dequeue_pos;
+		std::atomic<bool> closed;
+	};
+
+	/// Work item that travels through a Pipeline (derive the data of an application from it)
+	class PipelineBatch
+	{
+	public:
+		// Sequence number given by the pipeline, in the order in which the source filled the batches
+		long int index;
+
+		PipelineBatch() : index(-1) {}
+		virtual ~PipelineBatch() {}
+	};
+
+	/// The first stage of a Pipeline, which fills batches (e.g. reads them from disc); runs on the thread that calls Pipeline::run
+	class PipelineSource
+	{
+	public:
+		virtual ~PipelineSource() {}
+
+		// A new, empty batch (the pipeline owns it and re-uses it for the next fill)
+		virtual PipelineBatch* newBatch() = 0;
+
+		// Fill batch with the next work; false when there is no more work left
+		virtual bool fill(PipelineBatch &batch) = 0;
+	};
+
+	/// A processing stage of a Pipeline
+	class PipelineStage
+	{
+	public:
+		virtual ~PipelineStage() {}
+
+		virtual const char* getName() const = 0;
+
+		// Called before the batches start, with the number of threads the stage will run on
+		virtual void start(int /*nr_threads*/) {}
+
+		/** Process batch on thread thread_id (0 ... nr_threads - 1)
+		 * Different batches are processed concurrently on the threads of the stage, not necessarily in order of their index.
+		 */
+		virtual void process(PipelineBatch &batch, int thread_id) = 0;
+	};
+
+	/// Where the time of the threads of a stage went during Pipeline::run
+	struct PipelineStageStatistics
+	{
+		std::string name;
+		int nr_threads;
+		long int nr_batches;
+
+		// Summed over the threads of the stage: processing, and waiting for input (or for a free batch, for the source)
+		double busy_seconds, wait_seconds;
+	};
+
+	/** Staged asynchronous processing of a stream of batches
+	 *
+	 * The source and every stage run on their own threads, connected by PipelineQueues, so that e.g. reading from disc
+	 * overlaps the FFTs and projections of earlier batches. A fixed set of nr_batches batches circulates: the source takes
+	 * a free one, the stages pass it on, and the last stage returns it to the source. This bounds the memory use, and a
+	 * fast stage can run at most nr_batches ahead of a slow one. Give slow stages more threads (or fewer, larger batches)
+	 * until getStatistics() shows no stage waiting much longer than the others.
+	 *
+	 * The first error (RelionError or std::exception) of any stage stops the pipeline, and is reported by run()
+	 * after all threads have stopped.
+	 *
+	 * @code
+	 * Pipeline pipeline;
+	 * pipeline.setSource(&reader, 8);
+	 * pipeline.addStage(&fourier, 2);
+	 * pipeline.addStage(&ctf, 1);
+	 * pipeline.addStage(&insert, 1);
+	 * pipeline.run();
+	 * pipeline.printStatistics(std::cout);
+	 * @endcode
+	 */
+	class Pipeline
+	{
+	public:
+		Pipeline();
+
+		// At most nr_batches batches are in flight at any time (at least 2)
+		void setSource(PipelineSource *source, int nr_batches = 4);
+
+		// Append a stage that runs on nr_threads threads; the pipeline does not take ownership
+		void addStage(PipelineStage *stage, int nr_threads = 1);
+
+		// Process all batches of the source through all stages
+		void run();
+
+		// Of the last run: the source first, then the stages in order
+		const std::vector<PipelineStageStatistics>& getStatistics() const
+		{
+			return statistics;
+		}
+
+		void printStatistics(std::ostream &out) const;
+
+	private:
+		PipelineSource *source;
+		int nr_batches;
+		std::vector<PipelineStage*> stages;
+		std::vector<int> stage_threads;
+		std::vector<PipelineStageStatistics> statistics;
+	};
+}
+
+#endif
@@ -0,0 +1,274 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/planar_complex.h"
+#include "src/avx_helper.h"
+
+// DOUBLEs per AVX register, and the operations on them
+#ifdef FLOAT_PRECISION
+#define PLANAR_WIDTH 8
+typedef __m256 PlanarVector;
+#define PLANAR_LOAD _mm256_loadu_ps
+#define PLANAR_STORE _mm256_storeu_ps
+#define PLANAR_SET1 _mm256_set1_ps
+#define PLANAR_ADD _mm256_add_ps
+#define PLANAR_SUB _mm256_sub_ps
+#define PLANAR_MUL _mm256_mul_ps
+#define PLANAR_LOAD_COMPLEX _avx_load_complex_8
+#define PLANAR_STORE_COMPLEX _avx_store_complex_8
+#else
+#define PLANAR_WIDTH 4
+typedef __m256d PlanarVector;
+#define PLANAR_LOAD _mm256_loadu_pd
+#define PLANAR_STORE _mm256_storeu_pd
+#define PLANAR_SET1 _mm256_set1_pd
+#define PLANAR_ADD _mm256_add_pd
+#define PLANAR_SUB _mm256_sub_pd
+#define PLANAR_MUL _mm256_mul_pd
+#define PLANAR_LOAD_COMPLEX _avx_load_complex_4
+#define PLANAR_STORE_COMPLEX _avx_store_complex_4
+#endif
+
+namespace relion
+{
+	// Sum of the lanes of v
+	static inline double sumLanes(PlanarVector v)
+	{
+		DOUBLE lanes[PLANAR_WIDTH];
+		PLANAR_STORE(lanes, v);
+		double sum = 0.;
+		for (int l = 0; l < PLANAR_WIDTH; l++)
+			sum += lanes[l];
+		return sum;
+	}
+
+	// (are + i aim) *= (bre + i bim) for n elements
+	static void multiplyRow(DOUBLE *are, DOUBLE *aim, const DOUBLE *bre, const DOUBLE *bim, long int n)
+	{
+		long int i = 0;
+		for (; i + PLANAR_WIDTH <= n; i += PLANAR_WIDTH)
+		{
+			PlanarVector ar = PLANAR_LOAD(are + i), ai = PLANAR_LOAD(aim + i);
+			PlanarVector br = PLANAR_LOAD(bre + i), bi = PLANAR_LOAD(bim + i);
+			PLANAR_STORE(are + i, PLANAR_SUB(PLANAR_MUL(ar, br), PLANAR_MUL(ai, bi)));
+			PLANAR_STORE(aim + i, PLANAR_ADD(PLANAR_MUL(ar, bi), PLANAR_MUL(ai, br)));
+		}
+		for (; i < n; i++)
+		{
+			DOUBLE ar = are[i];
+			are[i] = ar * bre[i] - aim[i] * bim[i];
+			aim[i] = ar * bim[i] + aim[i] * bre[i];
+		}
+	}
+
+	void PlanarComplexArray::fromComplex(const MultidimArray<Complex > &in)
+	{
+		resize(in);
+		const Complex *src = MULTIDIM_ARRAY(in);
+		DOUBLE *dre = MULTIDIM_ARRAY(re), *dim = MULTIDIM_ARRAY(im);
+		long int n = MULTIDIM_SIZE(in), i = 0;
+		for (; i + PLANAR_WIDTH <= n; i += PLANAR_WIDTH)
+		{
+			PlanarVector r, m;
+			PLANAR_LOAD_COMPLEX(src + i, r, m);
+			PLANAR_STORE(dre + i, r);
+			PLANAR_STORE(dim + i, m);
+		}
+		for (; i < n; i++)
+		{
+			dre[i] = src[i].real;
+			dim[i] = src[i].imag;
+		}
+	}
+
+	void PlanarComplexArray::toComplex(MultidimArray<Complex > &out) const
+	{
+		out.resize(re);
+		Complex *dest = MULTIDIM_ARRAY(out);
+		const DOUBLE *sre = MULTIDIM_ARRAY(re), *sim = MULTIDIM_ARRAY(im);
+		long int n = size(), i = 0;
+		for (; i + PLANAR_WIDTH <= n; i += PLANAR_WIDTH)
+			PLANAR_STORE_COMPLEX(dest + i, PLANAR_LOAD(sre + i), PLANAR_LOAD(sim + i));
+		for (; i < n; i++)
+			dest[i] = Complex(sre[i], sim[i]);
+	}
+
+	void PlanarComplexArray::multiply(const PlanarComplexArray &b)
+	{
+		if (!sameShape(b))
+			REPORT_ERROR("PlanarComplexArray::multiply ERROR: arrays of different shapes");
+		multiplyRow(MULTIDIM_ARRAY(re), MULTIDIM_ARRAY(im), MULTIDIM_ARRAY(b.re), MULTIDIM_ARRAY(b.im), size());
+	}
+
+	void PlanarComplexArray::multiplyConjugate(const PlanarComplexArray &b)
+	{
+		if (!sameShape(b))
+			REPORT_ERROR("PlanarComplexArray::multiplyConjugate ERROR: arrays of different shapes");
+		DOUBLE *are = MULTIDIM_ARRAY(re), *aim = MULTIDIM_ARRAY(im);
+		const DOUBLE *bre = MULTIDIM_ARRAY(b.re), *bim = MULTIDIM_ARRAY(b.im);
+		long int n = size(), i = 0;
+		for (; i + PLANAR_WIDTH <= n; i += PLANAR_WIDTH)
+		{
+			PlanarVector ar = PLANAR_LOAD(are + i), ai = PLANAR_LOAD(aim + i);
+			PlanarVector br = PLANAR_LOAD(bre + i), bi = PLANAR_LOAD(bim + i);
+			PLANAR_STORE(are + i, PLANAR_ADD(PLANAR_MUL(ar, br), PLANAR_MUL(ai, bi)));
+			PLANAR_STORE(aim + i, PLANAR_SUB(PLANAR_MUL(ai, br), PLANAR_MUL(ar, bi)));
+		}
+		for (; i < n; i++)
+		{
+			DOUBLE ar = are[i];
+			are[i] = ar * bre[i] + aim[i] * bim[i];
+			aim[i] = aim[i] * bre[i] - ar * bim[i];
+		}
+	}
+
+	void PlanarComplexArray::multiply(const MultidimArray<DOUBLE> &w)
+	{
+		if (!sameShape(w))
+			REPORT_ERROR("PlanarComplexArray::multiply ERROR: weights of a different shape");
+		DOUBLE *are = MULTIDIM_ARRAY(re), *aim = MULTIDIM_ARRAY(im);
+		const DOUBLE *pw = MULTIDIM_ARRAY(w);
+		long int n = size(), i = 0;
+		for (; i + PLANAR_WIDTH <= n; i += PLANAR_WIDTH)
+		{
+			PlanarVector wi = PLANAR_LOAD(pw + i);
+			PLANAR_STORE(are + i, PLANAR_MUL(PLANAR_LOAD(are + i), wi));
+			PLANAR_STORE(aim + i, PLANAR_MUL(PLANAR_LOAD(aim + i), wi));
+		}
+		for (; i < n; i++)
+		{
+			are[i] *= pw[i];
+			aim[i] *= pw[i];
+		}
+	}
+
+	/* The phase of element (k, i, j) is phase_z(k) + phase_y(i) + phase_x(j): every row is multiplied by
+	 * the (pre-calculated) phase factors of its x-coordinates, times the scalar factor of its y- and z-coordinates.
+	 */
+	void PlanarComplexArray::applyShift(DOUBLE oridim, DOUBLE xshift, DOUBLE yshift, DOUBLE zshift)
+	{
+		if (re.getDim() < 1 || re.getDim() > 3)
+			REPORT_ERROR("PlanarComplexArray::applyShift ERROR: dimension should be 1, 2 or 3!");
+		// Same conventions as shiftImageInFourierTransform
+		double dx = 2 * PI * xshift / -oridim, dy = 2 * PI * yshift / -oridim, dz = 2 * PI * zshift / -oridim;
+		if (re.getDim() < 2)
+			dy = 0.;
+		if (re.getDim() < 3)
+			dz = 0.;
+
+		long int xdim = XSIZE(re);
+		MultidimArray<DOUBLE> row_re(xdim), row_im(xdim), fac_re(xdim), fac_im(xdim);
+		for (long int j = 0; j < xdim; j++)
+		{
+			DIRECT_A1D_ELEM(row_re, j) = cos(j * dx);
+			DIRECT_A1D_ELEM(row_im, j) = sin(j * dx);
+		}
+
+		for (long int k = 0; k < ZSIZE(re); k++)
+		{
+			double z = (k < xdim) ? k : k - ZSIZE(re);
+			for (long int i = 0; i < YSIZE(re); i++)
+			{
+				double y = (i < xdim) ? i : i - YSIZE(re);
+				double a = cos(y * dy + z * dz), b = sin(y * dy + z * dz);
+				// Phase factors of this row
+				for (long int j = 0; j < xdim; j++)
+				{
+					DIRECT_A1D_ELEM(fac_re, j) = a * DIRECT_A1D_ELEM(row_re, j) - b * DIRECT_A1D_ELEM(row_im, j);
+					DIRECT_A1D_ELEM(fac_im, j) = a * DIRECT_A1D_ELEM(row_im, j) + b * DIRECT_A1D_ELEM(row_re, j);
+				}
+				long int offset = (k * YSIZE(re) + i) * xdim;
+				multiplyRow(MULTIDIM_ARRAY(re) + offset, MULTIDIM_ARRAY(im) + offset,
+					MULTIDIM_ARRAY(fac_re), MULTIDIM_ARRAY(fac_im), xdim);
+			}
+		}
+	}
+
+	// The sums are kept per lane in blocks of this many elements, and added up in double precision after each block
+	#define PLANAR_SUM_BLOCK 1024
+
+	double dotProduct(const PlanarComplexArray &a, const PlanarComplexArray &b)
+	{
+		if (!a.sameShape(b))
+			REPORT_ERROR("dotProduct ERROR: arrays of different shapes");
+		const DOUBLE *are = MULTIDIM_ARRAY(a.re), *aim = MULTIDIM_ARRAY(a.im);
+		const DOUBLE *bre = MULTIDIM_ARRAY(b.re), *bim = MULTIDIM_ARRAY(b.im);
+		long int n = a.size(), i = 0;
+		double sum = 0.;
+		while (i + PLANAR_WIDTH <= n)
+		{
+			long int iend = XMIPP_MIN(n, i + PLANAR_SUM_BLOCK);
+			PlanarVector acc = PLANAR_SET1(0.);
+			for (; i + PLANAR_WIDTH <= iend; i += PLANAR_WIDTH)
+				acc = PLANAR_ADD(acc, PLANAR_ADD(PLANAR_MUL(PLANAR_LOAD(are + i), PLANAR_LOAD(bre + i)),
+					PLANAR_MUL(PLANAR_LOAD(aim + i), PLANAR_LOAD(bim + i))));
+			sum += sumLanes(acc);
+		}
+		for (; i < n; i++)
+			sum += (double)are[i] * bre[i] + (double)aim[i] * bim[i];
+		return sum;
+	}
+
+	double squaredDifference(const PlanarComplexArray &a, const PlanarComplexArray &b)
+	{
+		if (!a.sameShape(b))
+			REPORT_ERROR("squaredDifference ERROR: arrays of different shapes");
+		const DOUBLE *are = MULTIDIM_ARRAY(a.re), *aim = MULTIDIM_ARRAY(a.im);
+		const DOUBLE *bre = MULTIDIM_ARRAY(b.re), *bim = MULTIDIM_ARRAY(b.im);
+		long int n = a.size(), i = 0;
+		double sum = 0.;
+		while (i + PLANAR_WIDTH <= n)
+		{
+			long int iend = XMIPP_MIN(n, i + PLANAR_SUM_BLOCK);
+			PlanarVector acc = PLANAR_SET1(0.);
+			for (; i + PLANAR_WIDTH <= iend; i += PLANAR_WIDTH)
+			{
+				PlanarVector dr = PLANAR_SUB(PLANAR_LOAD(are + i), PLANAR_LOAD(bre + i));
+				PlanarVector di = PLANAR_SUB(PLANAR_LOAD(aim + i), PLANAR_LOAD(bim + i));
+				acc = PLANAR_ADD(acc, PLANAR_ADD(PLANAR_MUL(dr, dr), PLANAR_MUL(di, di)));
+			}
+			sum += sumLanes(acc);
+		}
+		for (; i < n; i++)
+		{
+			double dr = are[i] - bre[i], di = aim[i] - bim[i];
+			sum += dr * dr + di * di;
+		}
+		return sum;
+	}
+
+	void FourierTransform(FourierTransformer &transformer, MultidimArray<DOUBLE> &v, PlanarComplexArray &V)
+	{
+		MultidimArray<Complex > Faux;
+		transformer.FourierTransform(v, Faux, false);
+		V.fromComplex(Faux);
+	}
+
+	void inverseFourierTransform(FourierTransformer &transformer, const PlanarComplexArray &V, MultidimArray<DOUBLE> &v)
+	{
+		transformer.setReal(v);
+		MultidimArray<Complex > Faux;
+		transformer.getFourierAlias(Faux);
+		if (!V.sameShape(Faux))
+			REPORT_ERROR("inverseFourierTransform ERROR: the Fourier transform does not fit the real-space array");
+		V.toComplex(Faux);
+		transformer.inverseFourierTransform();
+	}
+}
@@ -0,0 +1,134 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PLANAR_COMPLEX_H
+#define PLANAR_COMPLEX_H
+
+#include "src/multidim_array.h"
+#include "src/fftw.h"
+
+namespace relion
+{
+	/** Complex array with the real and the imaginary parts in two separate (planar) arrays
+	 *
+	 * Element n of the interleaved MultidimArray<Complex> it is made from is (re.data[n], im.data[n]); re and im
+	 * have the shape and origin of that array. Products, weighting and phase shifts are then plain streams of
+	 * multiplications and additions over re and im, without the shuffles the interleaved layout needs.
+	 * Convert at the boundaries, e.g. right after the Fourier transform and just before the inverse one:
+	 *
+	 * @code
+	 * PlanarComplexArray Fimg, Fref;
+	 * FourierTransform(transformer, img, Fimg);
+	 * Fimg.multiply(Fctf);
+	 * Fimg.applyShift(ori_size, xshift, yshift);
+	 * DOUBLE cc = dotProduct(Fref, Fimg);
+	 * @endcode
+	 */
+	class PlanarComplexArray
+	{
+	public:
+		MultidimArray<DOUBLE> re, im;
+
+		PlanarComplexArray() {}
+
+		PlanarComplexArray(const MultidimArray<Complex > &in)
+		{
+			fromComplex(in);
+		}
+
+		/// Shape (and origin) of v, the contents are undefined
+		template <typename T>
+		void resize(const MultidimArray<T> &v)
+		{
+			re.resize(v);
+			im.resize(v);
+		}
+
+		void resize(const PlanarComplexArray &v)
+		{
+			resize(v.re);
+		}
+
+		void initZeros()
+		{
+			re.initZeros();
+			im.initZeros();
+		}
+
+		void clear()
+		{
+			re.clear();
+			im.clear();
+		}
+
+		/// Number of (complex) elements
+		long int size() const
+		{
+			return MULTIDIM_SIZE(re);
+		}
+
+		template <typename T>
+		bool sameShape(const MultidimArray<T> &v) const
+		{
+			return re.sameShape(v);
+		}
+
+		bool sameShape(const PlanarComplexArray &v) const
+		{
+			return re.sameShape(v.re);
+		}
+
+		/// Split the interleaved array in into re and im (resized to in)
+		void fromComplex(const MultidimArray<Complex > &in);
+
+		/// Interleave re and im into out (resized to this array)
+		void toComplex(MultidimArray<Complex > &out) const;
+
+		/// this *= b (element by element)
+		void multiply(const PlanarComplexArray &b);
+
+		/// this *= conj(b) (element by element)
+		void multiplyConjugate(const PlanarComplexArray &b);
+
+		/// this *= w, with real w of the same shape (e.g. a CTF or another weight)
+		void multiply(const MultidimArray<DOUBLE> &w);
+
+		/** Shift the image this is the (FFTW half-complex) Fourier transform of, by (xshift, yshift, zshift) pixels
+		 * As shiftImageInFourierTransform in fftw.h, with oridim the size of the image in real space.
+		 */
+		void applyShift(DOUBLE oridim, DOUBLE xshift, DOUBLE yshift = 0., DOUBLE zshift = 0.);
+	};
+
+	/// Sum of Re(conj(a) * b) over all elements (the cross-correlation of a and b)
+	double dotProduct(const PlanarComplexArray &a, const PlanarComplexArray &b);
+
+	/// Sum of |a - b|^2 over all elements
+	double squaredDifference(const PlanarComplexArray &a, const PlanarComplexArray &b);
+
+	/// Fourier transform of v (see FourierTransformer::FourierTransform), split into V
+	void FourierTransform(FourierTransformer &transformer, MultidimArray<DOUBLE> &v, PlanarComplexArray &V);
+
+	/** Inverse Fourier transform of V into v, which should already have its real-space size
+	 * (see FourierTransformer::inverseFourierTransform). V is interleaved into the transformer's own Fourier array.
+	 */
+	void inverseFourierTransform(FourierTransformer &transformer, const PlanarComplexArray &V, MultidimArray<DOUBLE> &v);
+}
+
+#endif
@@ -18,12 +18,14 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/projector.h"
+#include "src/projector_kernels.h"
+#include "src/simd_kernels.h"
 //#define DEBUG
 
 
 namespace relion
 {
-	void Projector::initialiseData(int current_size)
+	void Projector::initialiseSizes(int current_size)
 	{
 		// By default r_max is half ori_size
 		if (current_size < 0)
@@ -36,6 +38,11 @@ namespace relion
 
 		// Set pad_size
 		pad_size = 2 * (padding_factor * r_max + 1) + 1;
+	}
+
+	void Projector::initialiseData(int current_size)
+	{
+		initialiseSizes(current_size);
 
 		// Short side of data array
 		switch (ref_dim)
@@ -80,16 +87,83 @@ namespace relion
 	}
 
 	// Fill data array with oversampled Fourier transform, and calculate its power spectrum
+	// Tabulate the gridding correction of the interpolator as a function of the radius (in pixels) of vol_in
+	static void getGriddingCorrection(const MultidimArray<DOUBLE> &vol_in, int interpolator, int r_min_nn, int padoridim, TabLinear &tab_corr)
+	{
+		// Interpolation (goes with "interpolator") to go from arbitrary to fine grid
+		int sinc_power;
+		if (interpolator == NEAREST_NEIGHBOUR && r_min_nn == 0)
+		{
+			// NN interpolation is convolution with a rectangular pulse, which FT is a sinc function
+			sinc_power = 1;
+		}
+		else if (interpolator == TRILINEAR || (interpolator == NEAREST_NEIGHBOUR && r_min_nn > 0))
+		{
+			// trilinear interpolation is convolution with a triangular pulse, which FT is a sinc^2 function
+			sinc_power = 2;
+		}
+		else
+			REPORT_ERROR("BUG Projector::griddingCorrect: unrecognised interpolator scheme.");
+
+		// if r==0: do nothing (i.e. divide by 1)
+		const DOUBLE tab_sampling = 0.01;
+		DOUBLE max_r = sqrt((DOUBLE)(XMIPP_MAX(-STARTINGZ(vol_in), FINISHINGZ(vol_in)) * XMIPP_MAX(-STARTINGZ(vol_in), FINISHINGZ(vol_in)) +
+			XMIPP_MAX(-STARTINGY(vol_in), FINISHINGY(vol_in)) * XMIPP_MAX(-STARTINGY(vol_in), FINISHINGY(vol_in)) +
+			XMIPP_MAX(-STARTINGX(vol_in), FINISHINGX(vol_in)) * XMIPP_MAX(-STARTINGX(vol_in), FINISHINGX(vol_in))));
+		std::vector<DOUBLE> corr(CEIL(max_r / tab_sampling) + 2);
+		corr[0] = 1.;
+		for (size_t n = 1; n < corr.size(); n++)
+		{
+			DOUBLE rval = n * tab_sampling / padoridim;
+			DOUBLE sinc = sin(PI * rval) / (PI * rval);
+			corr[n] = (sinc_power == 1) ? 1. / sinc : 1. / (sinc * sinc);
+		}
+		tab_corr.setTable(corr, tab_sampling);
+	}
+
+	// Direct index of logical index x of an array of size l after CenterFFT(forward)
+	static inline long int getCenteredIndex(long int x, long int l)
+	{
+		long int idx = x - FIRST_XMIPP_INDEX(l) + l / 2;
+		return (idx >= l) ? idx - l : idx;
+	}
+
+	/* Radial average of the power spectrum from the partial sums of the slabs (z-planes) of a transform
+	 * The slabs are added in order, so the result does not depend on the number of threads that made them.
+	 */
+	static void sumPowerSpectrumSlabs(const MultidimArray<DOUBLE> &slab_spectra, const MultidimArray<DOUBLE> &slab_counts,
+		MultidimArray<DOUBLE> &power_spectrum)
+	{
+		power_spectrum.initZeros(XSIZE(slab_spectra));
+		MultidimArray<DOUBLE> counter(power_spectrum);
+		counter.initZeros();
+		for (long int k = 0; k < YSIZE(slab_spectra); k++)
+			for (long int i = 0; i < XSIZE(slab_spectra); i++)
+			{
+				DIRECT_A1D_ELEM(power_spectrum, i) += DIRECT_A2D_ELEM(slab_spectra, k, i);
+				DIRECT_A1D_ELEM(counter, i) += DIRECT_A2D_ELEM(slab_counts, k, i);
+			}
+
+		// Calculate radial average of power spectrum
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(power_spectrum)
+		{
+			if (DIRECT_A1D_ELEM(counter, i) < 1.)
+				DIRECT_A1D_ELEM(power_spectrum, i) = 0.;
+			else
+				DIRECT_A1D_ELEM(power_spectrum, i) /= DIRECT_A1D_ELEM(counter, i);
+		}
+	}
+
 	void Projector::computeFourierTransformMap(MultidimArray<DOUBLE> &vol_in, MultidimArray<DOUBLE> &power_spectrum, int current_size, int nr_threads, bool do_gridding, bool do_statistics, bool output_centered)
 	{
+		INSTRUMENT_TIMER(TIMER_COMPUTE_FOURIER_MAP);
+		nr_threads = getTaskNrThreads(nr_threads);
+		MemoryCategoryScope memory_category(MEMORY_PROJECTOR);
 
 		MultidimArray<DOUBLE> Mpad;
 		MultidimArray<Complex > Faux;
 		FourierTransformer transformer;
-		//transformer.setThreadsNumber(nr_threads);
-		// DEBUGGING: multi-threaded FFTWs are giving me a headache?
-		// For a long while: switch them off!
-		//transformer.setThreadsNumber(nr_threads);
+		transformer.setThreadsNumber(nr_threads);
 		DOUBLE normfft;
 
 		// Size of padded real-space volume
@@ -98,15 +172,15 @@ namespace relion
 		// Initialize data array of the oversampled transform
 		ref_dim = vol_in.getDim();
 
-		// Make Mpad
+		// Make Mpad (zeroed in parallel below)
 		switch (ref_dim)
 		{
 		case 2:
-			Mpad.initZeros(padoridim, padoridim);
+			Mpad.resize(padoridim, padoridim);
 			normfft = (DOUBLE)(padding_factor * padding_factor);
 			break;
 		case 3:
-			Mpad.initZeros(padoridim, padoridim, padoridim);
+			Mpad.resize(padoridim, padoridim, padoridim);
 			if (data_dim == 3)
 				normfft = (DOUBLE)(padding_factor * padding_factor * padding_factor);
 			else
@@ -122,21 +196,45 @@ namespace relion
 		// Divide by the inverse Fourier transform of the interpolator in Fourier-space
 		// 10feb11: at least in 2D case, this seems to be the wrong thing to do!!!
 		// TODO: check what is best for subtomo!
+		TabLinear tab_corr;
+		vol_in.setXmippOrigin();
 		if (do_gridding)// && data_dim != 3)
-			griddingCorrect(vol_in);
+			getGriddingCorrection(vol_in, interpolator, r_min_nn, padoridim, tab_corr);
 
-		// Pad translated map with zeros
-		vol_in.setXmippOrigin();
-		Mpad.setXmippOrigin();
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = 0; k < ZSIZE(Mpad); k++)
+			memset(&DIRECT_A3D_ELEM(Mpad, k, 0, 0), 0, YXSIZE(Mpad) * sizeof(DOUBLE));
 
-#pragma omp parallel for
+		// One pass for the gridding correction (which is also applied to vol_in, as by griddingCorrect),
+		// padding with zeros, and translating the padded map to put the origin of the FT in the center (as by CenterFFT)
+		Mpad.setXmippOrigin();
+#pragma omp parallel for num_threads(nr_threads)
 		for (long int k = STARTINGZ(vol_in); k <= FINISHINGZ(vol_in); k++)
+		{
+			std::vector<DOUBLE> rvals(XSIZE(vol_in)), corrvals(XSIZE(vol_in), 1.);
+			std::vector<long int> jpad(XSIZE(vol_in));
+			for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
+				jpad[j - STARTINGX(vol_in)] = getCenteredIndex(j, XSIZE(Mpad));
+			long int kpad = getCenteredIndex(k, ZSIZE(Mpad));
 			for (long int i = STARTINGY(vol_in); i <= FINISHINGY(vol_in); i++)
-				for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
-					A3D_ELEM(Mpad, k, i, j) = A3D_ELEM(vol_in, k, i, j);
+			{
+				if (do_gridding)
+				{
+					for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
+						rvals[j - STARTINGX(vol_in)] = sqrt((DOUBLE)(k*k + i*i + j*j));
+					tab_corr.getValues(&rvals[0], &corrvals[0], XSIZE(vol_in), true);
+				}
 
-		// Translate padded map to put origin of FT in the center
-		CenterFFT(Mpad, true);
+				DOUBLE *row = &DIRECT_A3D_ELEM(Mpad, kpad, getCenteredIndex(i, YSIZE(Mpad)), 0);
+				for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
+				{
+					DOUBLE &v = A3D_ELEM(vol_in, k, i, j);
+					if (do_gridding)
+						v *= corrvals[j - STARTINGX(vol_in)];
+					row[jpad[j - STARTINGX(vol_in)]] = v;
+				}
+			}
+		}
 
 		// Calculate the oversampled Fourier transform
 		transformer.FourierTransform(Mpad, Faux, false);
@@ -151,135 +249,193 @@ namespace relion
 		// Resize data array to the right size and initialise to zero
 		initZeros(current_size);
 
+		// Fill data only for those points with distance to origin less than max_r
+		// (other points will be zero because of initZeros() call above)
+		// Also calculate radial power spectrum, from partial sums per z-plane of Faux
 		int max_r2 = r_max * r_max * padding_factor * padding_factor;
+		MultidimArray<DOUBLE> slab_spectra, slab_counts;
 		if (do_statistics)
 		{
-			// Fill data only for those points with distance to origin less than max_r
-			// (other points will be zero because of initZeros() call above
-			// Also calculate radial power spectrum
-			power_spectrum.initZeros(ori_size / 2 + 1);
-			MultidimArray<DOUBLE> counter(power_spectrum);
-			counter.initZeros();
-
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Faux) // This will also work for 2D
-			{
-				int r2 = kp*kp + ip*ip + jp*jp;
-				// The Fourier Transforms are all "normalised" for 2D transforms of size = ori_size x ori_size
-				if (r2 <= max_r2)
-				{
-					// Set data array
-					A3D_ELEM(data, kp, ip, jp) = DIRECT_A3D_ELEM(Faux, k, i, j) * normfft;
-
-					// Calculate power spectrum
-					int ires = ROUND(sqrt((DOUBLE)r2) / padding_factor);
-					// Factor two because of two-dimensionality of the complex plane
-					DIRECT_A1D_ELEM(power_spectrum, ires) += norm(A3D_ELEM(data, kp, ip, jp)) / 2.;
-					DIRECT_A1D_ELEM(counter, ires) += 1.;
-				}
-			}
-
-			// Calculate radial average of power spectrum
-			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(power_spectrum)
-			{
-				if (DIRECT_A1D_ELEM(counter, i) < 1.)
-					DIRECT_A1D_ELEM(power_spectrum, i) = 0.;
-				else
-					DIRECT_A1D_ELEM(power_spectrum, i) /= DIRECT_A1D_ELEM(counter, i);
-			}
+			slab_spectra.initZeros(ZSIZE(Faux), ori_size / 2 + 1);
+			slab_counts.initZeros(ZSIZE(Faux), ori_size / 2 + 1);
 		}
-		else
+
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int k = 0; k < ZSIZE(Faux); k++)
 		{
-			if (output_centered)
+			long int kp = (k < XSIZE(Faux)) ? k : k - ZSIZE(Faux);
+			if (kp * kp > max_r2)
+				continue;
+			for (long int i = 0; i < YSIZE(Faux); i++)
 			{
-				FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Faux)
+				long int ip = (i < XSIZE(Faux)) ? i : i - YSIZE(Faux);
+				for (long int j = 0, jp = 0; j < XSIZE(Faux); j++, jp = j)
 				{
 					int r2 = kp*kp + ip*ip + jp*jp;
 					// The Fourier Transforms are all "normalised" for 2D transforms of size = ori_size x ori_size
 					if (r2 <= max_r2)
 					{
 						// Set data array
-						A3D_ELEM(data, kp, ip, jp) = DIRECT_A3D_ELEM(Faux, k, i, j) * normfft;
+						Complex val = DIRECT_A3D_ELEM(Faux, k, i, j) * normfft;
+						if (output_centered || do_statistics)
+							A3D_ELEM(data, kp, ip, jp) = val;
+						else
+						{
+							int jj = j;
+							int ii = ip < 0 ? YSIZE(data) + ip : ip;
+							int kk = kp < 0 ? ZSIZE(data) + kp : kp;
+							DIRECT_A3D_ELEM(data, kk, ii, jj) = val;
+						}
+
+						if (do_statistics)
+						{
+							// Factor two because of two-dimensionality of the complex plane
+							int ires = ROUND(sqrt((DOUBLE)r2) / padding_factor);
+							DIRECT_A2D_ELEM(slab_spectra, k, ires) += norm(val) / 2.;
+							DIRECT_A2D_ELEM(slab_counts, k, ires) += 1.;
+						}
 					}
 				}
 			}
-			else
+		}
+
+		if (do_statistics)
+			sumPowerSpectrumSlabs(slab_spectra, slab_counts, power_spectrum);
+
+		// Keep the bricked copy in sync (it assumes the centered layout)
+		if (!bricked_data.isEmpty())
+			setBrickedLayout(ref_dim == 3 && output_centered, nr_threads);
+		if (!half_data.isEmpty())
+		{
+			half_data.clear();
+			setHalfPrecision(true, nr_threads);
+		}
+	}
+
+	void Projector::windowFourierTransformMap(Projector &out, MultidimArray<DOUBLE> &power_spectrum, int current_size, int nr_threads, bool do_statistics) const
+	{
+		if (data.getDim() != ref_dim || MULTIDIM_SIZE(data) == 0)
+			REPORT_ERROR("Projector::windowFourierTransformMap%%ERROR: the data array has not been calculated (or is stored in half precision)");
+		MemoryCategoryScope memory_category(MEMORY_PROJECTOR);
+
+		out.clear();
+		out.ori_size = ori_size;
+		out.padding_factor = padding_factor;
+		out.interpolator = interpolator;
+		out.r_min_nn = r_min_nn;
+		out.data_dim = data_dim;
+		out.ref_dim = ref_dim;
+		out.initZeros(current_size);
+		if (out.r_max > r_max)
+			REPORT_ERROR("Projector::windowFourierTransformMap%%ERROR: cannot window to a larger current_size");
+
+		nr_threads = getTaskNrThreads(nr_threads);
+		int max_r2 = out.r_max * out.r_max * padding_factor * padding_factor;
+		int r = out.r_max * padding_factor;
+		int kr = (ref_dim == 3) ? r : 0;
+
+		// Partial power spectra per z-plane, in the order of the planes in an FFTW transform (as in computeFourierTransformMap)
+		MultidimArray<DOUBLE> slab_spectra, slab_counts;
+		if (do_statistics)
+		{
+			slab_spectra.initZeros(2 * kr + 1, ori_size / 2 + 1);
+			slab_counts.initZeros(2 * kr + 1, ori_size / 2 + 1);
+		}
+
+#pragma omp parallel for num_threads(nr_threads)
+		for (int kk = 0; kk <= 2 * kr; kk++)
+		{
+			int k = (kk <= kr) ? kk : kk - 2 * kr - 1;
+			for (int ii = 0; ii <= 2 * r; ii++)
 			{
-				FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Faux)
+				int i = (ii <= r) ? ii : ii - 2 * r - 1;
+				for (int j = 0; j <= r; j++)
 				{
-					int r2 = kp*kp + ip*ip + jp*jp;
-					// The Fourier Transforms are all "normalised" for 2D transforms of size = ori_size x ori_size
+					int r2 = k*k + i*i + j*j;
 					if (r2 <= max_r2)
 					{
-						int jj = j;
-						int ii = ip < 0 ? YSIZE(data) + ip : ip;
-						int kk = kp < 0 ? ZSIZE(data) + kp : kp;
-						// Set data array
-						DIRECT_A3D_ELEM(data, kk, ii, jj) = DIRECT_A3D_ELEM(Faux, k, i, j) * normfft;
+						const Complex &val = A3D_ELEM(data, k, i, j);
+						A3D_ELEM(out.data, k, i, j) = val;
+						if (do_statistics)
+						{
+							int ires = ROUND(sqrt((DOUBLE)r2) / padding_factor);
+							DIRECT_A2D_ELEM(slab_spectra, kk, ires) += norm(val) / 2.;
+							DIRECT_A2D_ELEM(slab_counts, kk, ires) += 1.;
+						}
 					}
 				}
 			}
 		}
 
-		transformer.cleanup();
+		if (do_statistics)
+			sumPowerSpectrumSlabs(slab_spectra, slab_counts, power_spectrum);
 
+		if (!bricked_data.isEmpty())
+			out.setBrickedLayout(true, nr_threads);
+	}
+
+	void Projector::setHalfPrecision(bool do_half, int nr_threads)
+	{
+		if (do_half && data.getDim() == 3)
+		{
+			half_data.initialise(data, nr_threads);
+			data.clear();
+			bricked_data.clear();
+		}
+		else if (!do_half && !half_data.isEmpty())
+		{
+			half_data.getArray(data, nr_threads);
+			half_data.clear();
+		}
+	}
+
+	void Projector::setBrickedLayout(bool do_bricked, int nr_threads)
+	{
+		if (do_bricked && data.getDim() == 3)
+			bricked_data.initialise(data, nr_threads);
+		else
+			bricked_data.clear();
 	}
 
 	void Projector::griddingCorrect(MultidimArray<DOUBLE> &vol_in)
 	{
 		// Correct real-space map by dividing it by the Fourier transform of the interpolator(s)
 		vol_in.setXmippOrigin();
+
+		TabLinear tab_corr;
+		getGriddingCorrection(vol_in, interpolator, r_min_nn, ori_size * padding_factor, tab_corr);
+
 #pragma omp parallel for
 		for (long int k = STARTINGZ(vol_in); k <= FINISHINGZ(vol_in); k++)
+		{
+			std::vector<DOUBLE> rvals(XSIZE(vol_in)), corrvals(XSIZE(vol_in));
 			for (long int i = STARTINGY(vol_in); i <= FINISHINGY(vol_in); i++)
+			{
 				for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
-				{
-					DOUBLE r = sqrt((DOUBLE)(k*k + i*i + j*j));
-					// if r==0: do nothing (i.e. divide by 1)
-					if (r > 0.)
-					{
-						DOUBLE rval = r / (ori_size * padding_factor);
-						DOUBLE sinc = sin(PI * rval) / (PI * rval);
-						//DOUBLE ftblob = blob_Fourier_val(rval, blob) / blob_Fourier_val(0., blob);
-						// Interpolation (goes with "interpolator") to go from arbitrary to fine grid
-						if (interpolator == NEAREST_NEIGHBOUR && r_min_nn == 0)
-						{
-							// NN interpolation is convolution with a rectangular pulse, which FT is a sinc function
-							A3D_ELEM(vol_in, k, i, j) /= sinc;
-						}
-						else if (interpolator == TRILINEAR || (interpolator == NEAREST_NEIGHBOUR && r_min_nn > 0))
-						{
-							// trilinear interpolation is convolution with a triangular pulse, which FT is a sinc^2 function
-							A3D_ELEM(vol_in, k, i, j) /= sinc * sinc;
-						}
-						else
-							REPORT_ERROR("BUG Projector::griddingCorrect: unrecognised interpolator scheme.");
-						//#define DEBUG_GRIDDING_CORRECT
-		#ifdef DEBUG_GRIDDING_CORRECT
-						if (k==0 && i==0 && j > 0)
-							std::cerr << " j= " << j << " sinc= " << sinc << std::endl;
-		#endif
-					}
-				}
+					rvals[j - STARTINGX(vol_in)] = sqrt((DOUBLE)(k*k + i*i + j*j));
+				tab_corr.getValues(&rvals[0], &corrvals[0], XSIZE(vol_in), true);
+
+				for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
+					A3D_ELEM(vol_in, k, i, j) *= corrvals[j - STARTINGX(vol_in)];
+			}
+		}
 	}
 
 	void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<DOUBLE> &A, bool inv)
 	{
-		DOUBLE fx, fy, fz, xp, yp, zp;
-		int x0, x1, y0, y1, z0, z1, y, y2, r2;
-		bool is_neg_x;
-		Complex d000, d001, d010, d011, d100, d101, d110, d111;
-		Complex dx00, dx01, dx10, dx11, dxy0, dxy1;
-		Matrix2D<DOUBLE> Ainv;
+		project(f2d, Mat33(A), inv);
+	}
+
+	void Projector::project(MultidimArray<Complex > &f2d, const Mat33 &A, bool inv)
+	{
+		INSTRUMENT_TIMER(TIMER_PROJECT);
 
 		// f2d should already be in the right size (ori_size,orihalfdim)
 		// AND the points outside r_max should already be zero...
 		// f2d.initZeros();
 
 		// Use the inverse matrix
-		if (inv)
-			Ainv = A;
-		else
-			Ainv = A.transpose();
+		Mat33 Ainv = (inv) ? A : A.transpose();
 
 		// The f2d image may be smaller than r_max, in that case also make sure not to fill the corners!
 		int my_r_max = XMIPP_MIN(r_max, XSIZE(f2d) - 1);
@@ -302,141 +458,122 @@ namespace relion
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
 
-		for (int i = 0; i < YSIZE(f2d); i++)
-		{
-			// Dont search beyond square with side max_r
-			if (i <= my_r_max)
-			{
-				y = i;
-			}
-			else if (i >= YSIZE(f2d) - my_r_max)
-			{
-				y = i - YSIZE(f2d);
-			}
-			else
-				continue;
+		projectSlice(MULTIDIM_ARRAY(f2d), XSIZE(f2d), YSIZE(f2d), Ainv.data(), my_r_max, max_r2, min_r2_nn);
 
-			y2 = y * y;
-			for (int x = 0; x <= my_r_max; x++)
-			{
-				// Only include points with radius < max_r (exclude points outside circle in square)
-				r2 = x * x + y2;
-				if (r2 > max_r2)
-					continue;
-
-				// Get logical coordinates in the 3D map
-				xp = Ainv(0, 0) * x + Ainv(0, 1) * y;
-				yp = Ainv(1, 0) * x + Ainv(1, 1) * y;
-				zp = Ainv(2, 0) * x + Ainv(2, 1) * y;
-
-				if (interpolator == TRILINEAR || r2 < min_r2_nn)
-				{
-					// Only asymmetric half is stored
-					if (xp < 0)
-					{
-						// Get complex conjugated hermitian symmetry pair
-						xp = -xp;
-						yp = -yp;
-						zp = -zp;
-						is_neg_x = true;
-					}
-					else
-					{
-						is_neg_x = false;
-					}
-
-					// Trilinear interpolation (with physical coords)
-					// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-					// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-					x0 = FLOOR(xp);
-					fx = xp - x0;
-					x1 = x0 + 1;
-
-					y0 = FLOOR(yp);
-					fy = yp - y0;
-					y0 -= STARTINGY(data);
-					y1 = y0 + 1;
+#ifdef DEBUG
+		std::cerr << "done with project..." << std::endl;
+#endif
+	}
 
-					z0 = FLOOR(zp);
-					fz = zp - z0;
-					z0 -= STARTINGZ(data);
-					z1 = z0 + 1;
+	void Projector::projectBatch(MultidimArray<Complex > &f2d, const DOUBLE *A, int nr_A, bool inv, int nr_threads)
+	{
+		INSTRUMENT_TIMER(TIMER_PROJECT);
+		if (ref_dim != 3)
+			REPORT_ERROR("Projector::projectBatch%%ERROR: Dimension of the data array should be 3");
+		if (NSIZE(f2d) < nr_A || ZSIZE(f2d) != 1)
+			REPORT_ERROR("Projector::projectBatch%%ERROR: f2d should be a stack of at least nr_A 2D images");
 
-					// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
-					d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-					d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-					d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-					d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-					d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-					d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-					d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-					d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
-
-					// interpolate in x
-#ifndef FLOAT_PRECISION
-					__m256d __fx = _mm256_set1_pd(fx);
-					__m256d __interpx1 = LIN_INTERP_AVX(_mm256_setr_pd(d000.real, d000.imag, d100.real, d100.imag),
-						_mm256_setr_pd(d001.real, d001.imag, d101.real, d101.imag),
-						__fx);
-					__m256d __interpx2 = LIN_INTERP_AVX(_mm256_setr_pd(d010.real, d010.imag, d110.real, d110.imag),
-						_mm256_setr_pd(d011.real, d011.imag, d111.real, d111.imag),
-						__fx);
-
-					// interpolate in y
-					__m256d __fy = _mm256_set1_pd(fy);
-					__m256d __interpy = LIN_INTERP_AVX(__interpx1, __interpx2, __fy);
-#else
-					__m128 __fx = _mm_set1_ps(fx);
-					__m128 __interpx1 = LIN_INTERP_AVX(_mm_setr_ps(d000.real, d000.imag, d100.real, d100.imag),
-						_mm_setr_ps(d001.real, d001.imag, d101.real, d101.imag),
-						__fx);
-					__m128 __interpx2 = LIN_INTERP_AVX(_mm_setr_ps(d010.real, d010.imag, d110.real, d110.imag),
-						_mm_setr_ps(d011.real, d011.imag, d111.real, d111.imag),
-						__fx);
-
-					// interpolate in y
-					__m128 __fy = _mm_set1_ps(fy);
-					__m128 __interpy = LIN_INTERP_AVX(__interpx1, __interpx2, __fy);
-#endif
-					Complex* interpy = (Complex*)&__interpy;
+		// All slices in the stack have the same size, so the bounds are the same for all orientations
+		int my_r_max = XMIPP_MIN(r_max, XSIZE(f2d) - 1);
+		int max_r2 = my_r_max * my_r_max;
+		int min_r2_nn = r_min_nn * r_min_nn;
+		long int xdim = XSIZE(f2d);
+		long int ydim = YSIZE(f2d);
+		long int slice_size = YXSIZE(f2d);
+		DOUBLE pad = (DOUBLE)padding_factor;
+		nr_threads = getTaskNrThreads(nr_threads);
+
+		// Each orientation writes to its own slice in f2d, so they can be done in parallel
+#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+		for (int n = 0; n < nr_A; n++)
+		{
+			const DOUBLE *An = A + 9 * n;
+			DOUBLE Ainv[9];
 
-					// interpolate in z
-					DIRECT_A2D_ELEM(f2d, i, x) = LIN_INTERP(fz, interpy[0], interpy[1]);
+			// Use the inverse matrix, and take scaling into account directly
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					Ainv[3 * r + c] = pad * (inv ? An[3 * r + c] : An[3 * c + r]);
 
-					// Take complex conjugated for half with negative x
-					if (is_neg_x)
-						DIRECT_A2D_ELEM(f2d, i, x) = conj(DIRECT_A2D_ELEM(f2d, i, x));
+			projectSlice(MULTIDIM_ARRAY(f2d) + n * slice_size, xdim, ydim, Ainv, my_r_max, max_r2, min_r2_nn);
+		}
+	}
 
-				} // endif TRILINEAR
-				else if (interpolator == NEAREST_NEIGHBOUR)
-				{
-					x0 = ROUND(xp);
-					y0 = ROUND(yp);
-					z0 = ROUND(zp);
-					if (x0 < 0)
-						DIRECT_A2D_ELEM(f2d, i, x) = conj(A3D_ELEM(data, -z0, -y0, -x0));
-					else
-						DIRECT_A2D_ELEM(f2d, i, x) = A3D_ELEM(data, z0, y0, x0);
+	void Projector::projectSlice(Complex *f2d, long int xdim, long int ydim, const DOUBLE *Ainv,
+		int my_r_max, int max_r2, int min_r2_nn)
+	{
+		switch (interpolator)
+		{
+		case TRILINEAR:
+			projectSliceRows<TRILINEAR>(f2d, xdim, ydim, Ainv, my_r_max, max_r2, min_r2_nn);
+			break;
+		case NEAREST_NEIGHBOUR:
+			projectSliceRows<NEAREST_NEIGHBOUR>(f2d, xdim, ydim, Ainv, my_r_max, max_r2, min_r2_nn);
+			break;
+		default:
+			REPORT_ERROR("Unrecognized interpolator in Projector::project");
+		}
+	}
 
-				} // endif NEAREST_NEIGHBOUR
-				else
-					REPORT_ERROR("Unrecognized interpolator in Projector::project");
+	template <int INTERPOLATOR>
+	void Projector::projectSliceRows(Complex *f2d, long int xdim, long int ydim, const DOUBLE *Ainv,
+		int my_r_max, int max_r2, int min_r2_nn)
+	{
+		TrilinearRowKernel trilinear_row = getTrilinearRowKernel();
+		BrickedTrilinearRowKernel trilinear_row_bricked = getSimdKernels().trilinear_row_bricked;
+		HalfTrilinearRowKernel trilinear_row_half = getSimdKernels().trilinear_row_half;
+		bool use_bricks = !bricked_data.isEmpty() && trilinear_row_bricked != NULL;
+		bool use_half = !half_data.isEmpty();
+		const HalfFourierVolume &h = half_data;
+
+		for (int i = 0; i < ydim; i++)
+		{
+			// Dont search beyond square with side max_r
+			int y;
+			if (i <= my_r_max)
+				y = i;
+			else if (i >= ydim - my_r_max)
+				y = i - ydim;
+			else
+				continue;
 
-			} // endif x-loop
-		} // endif y-loop
+			// Points x = 0 ... nx-1 of this row lie inside the circle with radius max_r,
+			// the first nx_tri of them are interpolated trilinearly (for NEAREST_NEIGHBOUR: r2 < min_r2_nn)
+			int y2 = y * y;
+			int nx = getRowLength(my_r_max, max_r2 - y2);
+			int nx_tri = (INTERPOLATOR == TRILINEAR) ? nx : XMIPP_MIN(nx, getRowLength(my_r_max, min_r2_nn - 1 - y2));
+			Complex *f2d_row = f2d + i * xdim;
+			INSTRUMENT_COUNT(COUNT_PIXELS_PROJECTED, nx);
 
+			if (use_half)
+			{
+				if (nx_tri > 0)
+					trilinear_row_half(&h.values[0], h.xdim, h.xdim * h.ydim, h.starty, h.startz, h.scale,
+						Ainv[1] * y, Ainv[4] * y, Ainv[7] * y, Ainv[0], Ainv[3], Ainv[6], nx_tri, f2d_row);
+				if (INTERPOLATOR == NEAREST_NEIGHBOUR && nx > nx_tri)
+					nearestRowHalf(&h.values[0], h.xdim, h.xdim * h.ydim, h.starty, h.startz, h.scale,
+						Ainv[0] * nx_tri + Ainv[1] * y, Ainv[3] * nx_tri + Ainv[4] * y, Ainv[6] * nx_tri + Ainv[7] * y,
+						Ainv[0], Ainv[3], Ainv[6], nx - nx_tri, f2d_row + nx_tri);
+				continue;
+			}
 
-#ifdef DEBUG
-		std::cerr << "done with project..." << std::endl;
-#endif
+			if (nx_tri > 0 && use_bricks)
+				trilinear_row_bricked(&bricked_data.bricks[0], &bricked_data.xoff[0], &bricked_data.yoff[0], &bricked_data.zoff[0],
+					bricked_data.starty, bricked_data.startz,
+					Ainv[1] * y, Ainv[4] * y, Ainv[7] * y, Ainv[0], Ainv[3], Ainv[6], nx_tri, f2d_row);
+			else if (nx_tri > 0)
+				trilinear_row(MULTIDIM_ARRAY(data), XSIZE(data), YXSIZE(data), STARTINGY(data), STARTINGZ(data),
+					Ainv[1] * y, Ainv[4] * y, Ainv[7] * y, Ainv[0], Ainv[3], Ainv[6], nx_tri, f2d_row);
+			if (INTERPOLATOR == NEAREST_NEIGHBOUR && nx > nx_tri)
+				nearestRow(MULTIDIM_ARRAY(data), XSIZE(data), YXSIZE(data), STARTINGY(data), STARTINGZ(data),
+					Ainv[0] * nx_tri + Ainv[1] * y, Ainv[3] * nx_tri + Ainv[4] * y, Ainv[6] * nx_tri + Ainv[7] * y,
+					Ainv[0], Ainv[3], Ainv[6], nx - nx_tri, f2d_row + nx_tri);
+		}
 	}
 
 	void Projector::rotate2D(MultidimArray<Complex > &f2d, Matrix2D<DOUBLE> &A, bool inv)
 	{
-		DOUBLE fx, fy, xp, yp;
-		int x0, x1, y0, y1, y, y2, r2;
-		bool is_neg_x;
-		Complex d00, d01, d10, d11, dx0, dx1;
+		INSTRUMENT_TIMER(TIMER_ROTATE);
 		Matrix2D<DOUBLE> Ainv;
 
 		// f2d should already be in the right size (ori_size,orihalfdim)
@@ -466,6 +603,28 @@ namespace relion
 		std::cerr << " max_r= "<< r_max << std::endl;
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
+
+		switch (interpolator)
+		{
+		case TRILINEAR:
+			rotate2DRows<TRILINEAR>(f2d, Ainv, my_r_max, max_r2, min_r2_nn);
+			break;
+		case NEAREST_NEIGHBOUR:
+			rotate2DRows<NEAREST_NEIGHBOUR>(f2d, Ainv, my_r_max, max_r2, min_r2_nn);
+			break;
+		default:
+			REPORT_ERROR("Unrecognized interpolator in Projector::rotate2D");
+		}
+	}
+
+	template <int INTERPOLATOR>
+	void Projector::rotate2DRows(MultidimArray<Complex > &f2d, const Matrix2D<DOUBLE> &Ainv, int my_r_max, int max_r2, int min_r2_nn)
+	{
+		DOUBLE fx, fy, xp, yp;
+		int x0, x1, y0, y1, y, y2, r2;
+		bool is_neg_x;
+		Complex d00, d01, d10, d11, dx0, dx1;
+
 		for (int i = 0; i < YSIZE(f2d); i++)
 		{
 			// Don't search beyond square with side max_r
@@ -490,7 +649,7 @@ namespace relion
 				// Get logical coordinates in the 3D map
 				xp = Ainv(0, 0) * x + Ainv(0, 1) * y;
 				yp = Ainv(1, 0) * x + Ainv(1, 1) * y;
-				if (interpolator == TRILINEAR || r2 < min_r2_nn)
+				if (INTERPOLATOR == TRILINEAR || r2 < min_r2_nn)
 				{
 					// Only asymmetric half is stored
 					if (xp < 0)
@@ -529,7 +688,7 @@ namespace relion
 						_mm256_setr_pd(d01.real, d01.imag, d11.real, d11.imag),
 						_mm256_set1_pd(fx));
 #else
-					__m128 __interpx = LIN_INTERP_AVX(_mm_setr_ps(d00.real, d00.imag, d10.real, d10.imag),
+					__m128 __interpx = LIN_INTERP_SSE(_mm_setr_ps(d00.real, d00.imag, d10.real, d10.imag),
 						_mm_setr_ps(d01.real, d01.imag, d11.real, d11.imag),
 						_mm_set1_ps(fx));
 #endif
@@ -540,7 +699,7 @@ namespace relion
 					if (is_neg_x)
 						DIRECT_A2D_ELEM(f2d, i, x) = conj(DIRECT_A2D_ELEM(f2d, i, x));
 				} // endif TRILINEAR
-				else if (interpolator == NEAREST_NEIGHBOUR)
+				else if (INTERPOLATOR == NEAREST_NEIGHBOUR)
 				{
 					x0 = ROUND(xp);
 					y0 = ROUND(yp);
@@ -549,21 +708,20 @@ namespace relion
 					else
 						DIRECT_A2D_ELEM(f2d, i, x) = A2D_ELEM(data, y0, x0);
 				} // endif NEAREST_NEIGHBOUR
-				else
-					REPORT_ERROR("Unrecognized interpolator in Projector::project");
 			} // endif x-loop
 		} // endif y-loop
 	}
 
 
-	void Projector::rotate3D(MultidimArray<Complex > &f3d, Matrix2D<DOUBLE> &A, bool inv)
+	void Projector::rotate3D(MultidimArray<Complex > &f3d, Matrix2D<DOUBLE> &A, bool inv, int nr_threads)
 	{
-		DOUBLE fx, fy, fz, xp, yp, zp;
-		int x0, x1, y0, y1, z0, z1, y, z, y2, z2, r2;
-		bool is_neg_x;
-		Complex d000, d010, d100, d110, d001, d011, d101, d111, dx00, dx10, dxy0, dx01, dx11, dxy1;
+		INSTRUMENT_TIMER(TIMER_ROTATE);
+		nr_threads = getTaskNrThreads(nr_threads);
 		Matrix2D<DOUBLE> Ainv;
 
+		if (!half_data.isEmpty())
+			REPORT_ERROR("Projector::rotate3D%%ERROR: not possible with half-precision storage, call setHalfPrecision(false) first");
+
 		// f3d should already be in the right size (ori_size,orihalfdim)
 		// AND the points outside max_r should already be zero...
 		// f3d.initZeros();
@@ -591,6 +749,31 @@ namespace relion
 		std::cerr << " max_r= "<< r_max << std::endl;
 		std::cerr << " Ainv= " << Ainv << std::endl;
 #endif
+
+		switch (interpolator)
+		{
+		case TRILINEAR:
+			rotate3DRows<TRILINEAR>(f3d, Ainv, my_r_max, max_r2, min_r2_nn, nr_threads);
+			break;
+		case NEAREST_NEIGHBOUR:
+			rotate3DRows<NEAREST_NEIGHBOUR>(f3d, Ainv, my_r_max, max_r2, min_r2_nn, nr_threads);
+			break;
+		default:
+			REPORT_ERROR("Unrecognized interpolator in Projector::rotate3D");
+		}
+	}
+
+	template <int INTERPOLATOR>
+	void Projector::rotate3DRows(MultidimArray<Complex > &f3d, const Matrix2D<DOUBLE> &Ainv, int my_r_max, int max_r2, int min_r2_nn, int nr_threads)
+	{
+		DOUBLE fx, fy, fz, xp, yp, zp;
+		int x0, x1, y0, y1, z0, z1, y, z, y2, z2, r2;
+		bool is_neg_x;
+		Complex d000, d010, d100, d110, d001, d011, d101, d111, dx00, dx10, dxy0, dx01, dx11, dxy1;
+		TrilinearRowKernel trilinear_row = getTrilinearRowKernel();
+
+		// Every z-plane of f3d is written by a single thread
+#pragma omp parallel for num_threads(nr_threads) schedule(dynamic) private(fx, fy, fz, xp, yp, zp, x0, x1, y0, y1, z0, z1, y, z, y2, z2, r2, is_neg_x, d000, d010, d100, d110, d001, d011, d101, d111, dx00, dx10, dxy0, dx01, dx11, dxy1)
 		for (int k = 0; k < ZSIZE(f3d); k++)
 		{
 			// Don't search beyond square with side max_r
@@ -621,6 +804,17 @@ namespace relion
 					continue;
 				y2 = y * y;
 
+				// Trilinear interpolation of all points on this row inside the sphere with radius max_r in one go
+				if (INTERPOLATOR == TRILINEAR)
+				{
+					int nx = getRowLength(my_r_max, max_r2 - y2 - z2);
+					if (nx > 0)
+						trilinear_row(MULTIDIM_ARRAY(data), XSIZE(data), YXSIZE(data), STARTINGY(data), STARTINGZ(data),
+							Ainv(0, 1) * y + Ainv(0, 2) * z, Ainv(1, 1) * y + Ainv(1, 2) * z, Ainv(2, 1) * y + Ainv(2, 2) * z,
+							Ainv(0, 0), Ainv(1, 0), Ainv(2, 0), nx, &DIRECT_A3D_ELEM(f3d, k, i, 0));
+					continue;
+				}
+
 				for (int x = 0; x <= my_r_max; x++)
 				{
 					// Only include points with radius < max_r (exclude points outside circle in square)
@@ -633,7 +827,7 @@ namespace relion
 					yp = Ainv(1, 0) * x + Ainv(1, 1) * y + Ainv(1, 2) * z;
 					zp = Ainv(2, 0) * x + Ainv(2, 1) * y + Ainv(2, 2) * z;
 
-					if (interpolator == TRILINEAR || r2 < min_r2_nn)
+					if (INTERPOLATOR == TRILINEAR || r2 < min_r2_nn)
 					{
 						// Only asymmetric half is stored
 						if (xp < 0)
@@ -691,17 +885,13 @@ namespace relion
 						__m256d __fy = _mm256_set1_pd(fy);
 						__m256d __interpy = LIN_INTERP_AVX(__interpx1, __interpx2, __fy);
 #else
-						__m128 __fx = _mm_set1_ps(fx);
-						__m128 __interpx1 = LIN_INTERP_AVX(_mm_setr_ps(d000.real, d000.imag, d100.real, d100.imag),
-							_mm_setr_ps(d001.real, d001.imag, d101.real, d101.imag),
-							__fx);
-						__m128 __interpx2 = LIN_INTERP_AVX(_mm_setr_ps(d010.real, d010.imag, d110.real, d110.imag),
-							_mm_setr_ps(d011.real, d011.imag, d111.real, d111.imag),
-							__fx);
+						// All 4 in one register: (y0, z0), (y0, z1) in the low and (y1, z0), (y1, z1) in the high half
+						__m256 __interpx = LIN_INTERP_AVX(_mm256_setr_ps(d000.real, d000.imag, d100.real, d100.imag, d010.real, d010.imag, d110.real, d110.imag),
+							_mm256_setr_ps(d001.real, d001.imag, d101.real, d101.imag, d011.real, d011.imag, d111.real, d111.imag),
+							_mm256_set1_ps(fx));
 
 						// interpolate in y
-						__m128 __fy = _mm_set1_ps(fy);
-						__m128 __interpy = LIN_INTERP_AVX(__interpx1, __interpx2, __fy);
+						__m128 __interpy = LIN_INTERP_SSE(_mm256_castps256_ps128(__interpx), _mm256_extractf128_ps(__interpx, 1), _mm_set1_ps(fy));
 #endif
 
 						Complex* interpy = (Complex*)&__interpy;
@@ -714,7 +904,7 @@ namespace relion
 							DIRECT_A3D_ELEM(f3d, k, i, x) = conj(DIRECT_A3D_ELEM(f3d, k, i, x));
 
 					} // endif TRILINEAR
-					else if (interpolator == NEAREST_NEIGHBOUR)
+					else if (INTERPOLATOR == NEAREST_NEIGHBOUR)
 					{
 						x0 = ROUND(xp);
 						y0 = ROUND(yp);
@@ -726,8 +916,6 @@ namespace relion
 							DIRECT_A3D_ELEM(f3d, k, i, x) = A3D_ELEM(data, z0, y0, x0);
 
 					} // endif NEAREST_NEIGHBOUR
-					else
-						REPORT_ERROR("Unrecognized interpolator in Projector::project");
 				} // endif x-loop
 			} // endif y-loop
 		} // endif z-loop
@@ -24,6 +24,9 @@
 #include "src/multidim_array.h"
 #include "src/image.h"
 #include "src/avx_helper.h"
+#include "src/small_matrix.h"
+#include "src/bricked_volume.h"
+#include "src/half_volume.h"
 
 
 namespace relion
@@ -68,6 +71,12 @@ namespace relion
 		// Dimension of the projections (2 or 3)
 		int data_dim;
 
+		// Optional copy of a 3D data array in bricks, used for the trilinear interpolation of slices (see setBrickedLayout)
+		BrickedFourierVolume bricked_data;
+
+		// The 3D data array in half precision, instead of data (see setHalfPrecision)
+		HalfFourierVolume half_data;
+
 	public:
 
 		/** Empty constructor
@@ -143,6 +152,8 @@ namespace relion
 				padding_factor = op.padding_factor;
 				ref_dim = op.ref_dim;
 				data_dim = op.data_dim;
+				bricked_data = op.bricked_data;
+				half_data = op.half_data;
 			}
 			return *this;
 		}
@@ -166,9 +177,16 @@ namespace relion
 		void clear()
 		{
 			data.clear();
+			bricked_data.clear();
+			half_data.clear();
 			r_max = r_min_nn = interpolator = padding_factor = ref_dim = data_dim = pad_size = 0;
 		}
 
+		/*
+		 * Set r_max and pad_size for the given size (without allocating the data array)
+		 */
+		void initialiseSizes(int current_size = -1);
+
 		/*
 		 * Resize data array to the given size
 		 */
@@ -179,6 +197,23 @@ namespace relion
 		 */
 		void initZeros(int current_size = -1);
 
+		/** Also keep the 3D data array in bricks of 8x8x8 voxels, from which project() and projectBatch() interpolate
+		 *
+		 * This costs a second copy of data, but cuts the cache and TLB misses of oblique slices through large
+		 * (padded) references. computeFourierTransformMap keeps the copy up to date; after any other change of
+		 * data, call this function again. Has no effect on 2D references.
+		 */
+		void setBrickedLayout(bool do_bricked, int nr_threads = 1);
+
+		/** Store the 3D data array in half precision (IEEE fp16, see HalfFourierVolume) instead of in data
+		 *
+		 * Halves the memory of a single-precision reference (and the bandwidth of the interpolation), at a relative
+		 * precision of about 5e-4. data is emptied (and any bricked copy removed): only project() and projectBatch()
+		 * can be used, until setHalfPrecision(false) converts the values back into data.
+		 * computeFourierTransformMap stores its result in half precision again. Has no effect on 2D references.
+		 */
+		void setHalfPrecision(bool do_half, int nr_threads = 1);
+
 		/*
 		 *  Only get the size of the data array
 		 */
@@ -195,6 +230,12 @@ namespace relion
 		*/
 		void computeFourierTransformMap(MultidimArray<DOUBLE> &vol_in, MultidimArray<DOUBLE> &power_spectrum, int current_size = -1, int nr_threads = 1, bool do_gridding = true, bool do_statistics = true, bool output_centered = true);
 
+		/* Window the (centered) Fourier Transform map of this projector to a smaller current_size into out
+		 * The result is the same as computeFourierTransformMap() with that current_size would give, without the padding,
+		 * gridding correction and FFT. With do_statistics, also the radial power spectrum within the new r_max is calculated.
+		 */
+		void windowFourierTransformMap(Projector &out, MultidimArray<DOUBLE> &power_spectrum, int current_size, int nr_threads = 1, bool do_statistics = true) const;
+
 		/* Because we interpolate in Fourier space to make projections and/or reconstructions, we have to correct
 		 * the real-space maps by dividing them by the Fourier Transform of the interpolator
 		 * Note these corrections are made on the not-oversampled, i.e. originally sized real-space map
@@ -235,6 +276,20 @@ namespace relion
 		*/
 		void project(MultidimArray<Complex > &img_out, Matrix2D<DOUBLE> &A, bool inv);
 
+		/*
+		* As above, for a 3x3 rotation matrix without any allocation
+		*/
+		void project(MultidimArray<Complex > &img_out, const Mat33 &A, bool inv);
+
+		/*
+		* Get 2D slices from the 3D map for many orientations in one call (forward projection)
+		* A holds nr_A row-major 3x3 rotation matrices, one after the other.
+		* img_out should already be a stack of (at least) nr_A images of the right size,
+		* with the points outside r_max set to zero; slice n is written into image n.
+		* The orientations are distributed over nr_threads threads.
+		*/
+		void projectBatch(MultidimArray<Complex > &img_out, const DOUBLE *A, int nr_A, bool inv, int nr_threads = 1);
+
 		/*
 		* Get an in-plane rotated version of the 2D map (mere interpolation)
 		*/
@@ -242,9 +297,35 @@ namespace relion
 
 		/*
 		* Get a rotated version of the 3D map (mere interpolation)
+		* The z-planes of img_out are distributed over nr_threads threads.
+		*/
+		void rotate3D(MultidimArray<Complex > &img_out, Matrix2D<DOUBLE> &A, bool inv, int nr_threads = 1);
+
+		/*
+		* rotate2D and rotate3D for a fixed interpolator (TRILINEAR or NEAREST_NEIGHBOUR)
+		* Ainv is the inverse rotation matrix, already multiplied by the padding_factor
 		*/
-		void rotate3D(MultidimArray<Complex > &img_out, Matrix2D<DOUBLE> &A, bool inv);
+		template <int INTERPOLATOR>
+		void rotate2DRows(MultidimArray<Complex > &img_out, const Matrix2D<DOUBLE> &Ainv, int my_r_max, int max_r2, int min_r2_nn);
+
+		template <int INTERPOLATOR>
+		void rotate3DRows(MultidimArray<Complex > &img_out, const Matrix2D<DOUBLE> &Ainv, int my_r_max, int max_r2, int min_r2_nn, int nr_threads = 1);
 
+		/*
+		* Interpolate one 2D slice of size ydim x xdim (FFTW half-complex layout) from the 3D map
+		* Ainv is the row-major 3x3 inverse rotation matrix, already multiplied by the padding_factor
+		* Shared by project() and projectBatch()
+		*/
+		void projectSlice(Complex *img_out, long int xdim, long int ydim, const DOUBLE *Ainv,
+			int my_r_max, int max_r2, int min_r2_nn);
+
+		/*
+		* projectSlice for a fixed interpolator (TRILINEAR or NEAREST_NEIGHBOUR), one row kernel call per
+		* x-range: the points of a row inside r_max, and for NEAREST_NEIGHBOUR the ones inside r_min_nn
+		*/
+		template <int INTERPOLATOR>
+		void projectSliceRows(Complex *img_out, long int xdim, long int ydim, const DOUBLE *Ainv,
+			int my_r_max, int max_r2, int min_r2_nn);
 
 	};
 }
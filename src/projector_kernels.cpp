@@ -0,0 +1,349 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/projector_kernels.h"
+#include "src/simd_kernels.h"
+#include "src/half_volume.h"
+#include "src/avx_helper.h"
+
+namespace relion
+{
+	void trilinearRowScalar(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		for (int x = 0; x < nx; x++)
+		{
+			DOUBLE xp = dx * x + bx;
+			DOUBLE yp = dy * x + by;
+			DOUBLE zp = dz * x + bz;
+
+			// Only asymmetric half is stored
+			bool is_neg_x = xp < 0;
+			if (is_neg_x)
+			{
+				// Get complex conjugated hermitian symmetry pair
+				xp = -xp;
+				yp = -yp;
+				zp = -zp;
+			}
+
+			int x0 = FLOOR(xp);
+			DOUBLE fx = xp - x0;
+			int y0 = FLOOR(yp);
+			DOUBLE fy = yp - y0;
+			y0 -= starty;
+			int z0 = FLOOR(zp);
+			DOUBLE fz = zp - z0;
+			z0 -= startz;
+
+			const Complex *d = data + z0 * yxdim + y0 * xdim + x0;
+			Complex dx00 = LIN_INTERP(fx, d[0], d[1]);
+			Complex dx10 = LIN_INTERP(fx, d[xdim], d[xdim + 1]);
+			Complex dx01 = LIN_INTERP(fx, d[yxdim], d[yxdim + 1]);
+			Complex dx11 = LIN_INTERP(fx, d[yxdim + xdim], d[yxdim + xdim + 1]);
+			Complex dxy0 = LIN_INTERP(fy, dx00, dx10);
+			Complex dxy1 = LIN_INTERP(fy, dx01, dx11);
+
+			out[x] = LIN_INTERP(fz, dxy0, dxy1);
+
+			// Take complex conjugated for half with negative x
+			if (is_neg_x)
+				out[x].imag = -out[x].imag;
+		}
+	}
+
+#ifdef FLOAT_PRECISION
+
+	void trilinearRowAVX(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256 ramp = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		const __m256 __dx = _mm256_set1_ps(dx), __dy = _mm256_set1_ps(dy), __dz = _mm256_set1_ps(dz);
+		const __m256 __bx = _mm256_set1_ps(bx), __by = _mm256_set1_ps(by), __bz = _mm256_set1_ps(bz);
+		const float *fdata = (const float*)data;
+
+		// Real and imaginary parts of the 8 neighbours of the 8 pixels, corner-major
+		float re[8][8], im[8][8];
+		int ix[8], iy[8], iz[8];
+		const long int corner[8] = { 0, 1, xdim, xdim + 1, yxdim, yxdim + 1, yxdim + xdim, yxdim + xdim + 1 };
+
+		int x = 0;
+		for (; x + 8 <= nx; x += 8)
+		{
+			__m256 __x = _mm256_add_ps(ramp, _mm256_set1_ps((float)x));
+			__m256 xp = _mm256_add_ps(_mm256_mul_ps(__dx, __x), __bx);
+			__m256 yp = _mm256_add_ps(_mm256_mul_ps(__dy, __x), __by);
+			__m256 zp = _mm256_add_ps(_mm256_mul_ps(__dz, __x), __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256 neg = _mm256_and_ps(_mm256_cmp_ps(xp, _mm256_setzero_ps(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_ps(xp, neg);
+			yp = _mm256_xor_ps(yp, neg);
+			zp = _mm256_xor_ps(zp, neg);
+
+			__m256 x0 = _mm256_floor_ps(xp);
+			__m256 y0 = _mm256_floor_ps(yp);
+			__m256 z0 = _mm256_floor_ps(zp);
+			__m256 fx = _mm256_sub_ps(xp, x0);
+			__m256 fy = _mm256_sub_ps(yp, y0);
+			__m256 fz = _mm256_sub_ps(zp, z0);
+			_mm256_storeu_si256((__m256i*)ix, _mm256_cvttps_epi32(x0));
+			_mm256_storeu_si256((__m256i*)iy, _mm256_cvttps_epi32(y0));
+			_mm256_storeu_si256((__m256i*)iz, _mm256_cvttps_epi32(z0));
+
+			// No gathers in AVX: fetch the neighbours one by one into SoA order
+			for (int l = 0; l < 8; l++)
+			{
+				const float *d = fdata + 2 * ((iz[l] - startz) * yxdim + (iy[l] - starty) * xdim + ix[l]);
+				for (int c = 0; c < 8; c++)
+				{
+					re[c][l] = d[2 * corner[c]];
+					im[c][l] = d[2 * corner[c] + 1];
+				}
+			}
+
+			// interpolate in x, y and z
+			__m256 rx00 = LIN_INTERP_AVX(_mm256_loadu_ps(re[0]), _mm256_loadu_ps(re[1]), fx);
+			__m256 rx10 = LIN_INTERP_AVX(_mm256_loadu_ps(re[2]), _mm256_loadu_ps(re[3]), fx);
+			__m256 rx01 = LIN_INTERP_AVX(_mm256_loadu_ps(re[4]), _mm256_loadu_ps(re[5]), fx);
+			__m256 rx11 = LIN_INTERP_AVX(_mm256_loadu_ps(re[6]), _mm256_loadu_ps(re[7]), fx);
+			__m256 ix00 = LIN_INTERP_AVX(_mm256_loadu_ps(im[0]), _mm256_loadu_ps(im[1]), fx);
+			__m256 ix10 = LIN_INTERP_AVX(_mm256_loadu_ps(im[2]), _mm256_loadu_ps(im[3]), fx);
+			__m256 ix01 = LIN_INTERP_AVX(_mm256_loadu_ps(im[4]), _mm256_loadu_ps(im[5]), fx);
+			__m256 ix11 = LIN_INTERP_AVX(_mm256_loadu_ps(im[6]), _mm256_loadu_ps(im[7]), fx);
+			__m256 rxy0 = LIN_INTERP_AVX(rx00, rx10, fy);
+			__m256 rxy1 = LIN_INTERP_AVX(rx01, rx11, fy);
+			__m256 ixy0 = LIN_INTERP_AVX(ix00, ix10, fy);
+			__m256 ixy1 = LIN_INTERP_AVX(ix01, ix11, fy);
+			__m256 vre = LIN_INTERP_AVX(rxy0, rxy1, fz);
+			__m256 vim = _mm256_xor_ps(LIN_INTERP_AVX(ixy0, ixy1, fz), neg);
+
+			_avx_store_complex_8(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowScalar(data, xdim, yxdim, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+#else
+
+	void trilinearRowAVX(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256d ramp = _mm256_setr_pd(0., 1., 2., 3.);
+		const __m256d signbit = _mm256_set1_pd(-0.);
+		const __m256d __dx = _mm256_set1_pd(dx), __dy = _mm256_set1_pd(dy), __dz = _mm256_set1_pd(dz);
+		const __m256d __bx = _mm256_set1_pd(bx), __by = _mm256_set1_pd(by), __bz = _mm256_set1_pd(bz);
+		const double *fdata = (const double*)data;
+
+		// Real and imaginary parts of the 8 neighbours of the 4 pixels, corner-major
+		double re[8][4], im[8][4];
+		int ix[4], iy[4], iz[4];
+		const long int corner[8] = { 0, 1, xdim, xdim + 1, yxdim, yxdim + 1, yxdim + xdim, yxdim + xdim + 1 };
+
+		int x = 0;
+		for (; x + 4 <= nx; x += 4)
+		{
+			__m256d __x = _mm256_add_pd(ramp, _mm256_set1_pd((double)x));
+			__m256d xp = _mm256_add_pd(_mm256_mul_pd(__dx, __x), __bx);
+			__m256d yp = _mm256_add_pd(_mm256_mul_pd(__dy, __x), __by);
+			__m256d zp = _mm256_add_pd(_mm256_mul_pd(__dz, __x), __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256d neg = _mm256_and_pd(_mm256_cmp_pd(xp, _mm256_setzero_pd(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_pd(xp, neg);
+			yp = _mm256_xor_pd(yp, neg);
+			zp = _mm256_xor_pd(zp, neg);
+
+			__m256d x0 = _mm256_floor_pd(xp);
+			__m256d y0 = _mm256_floor_pd(yp);
+			__m256d z0 = _mm256_floor_pd(zp);
+			__m256d fx = _mm256_sub_pd(xp, x0);
+			__m256d fy = _mm256_sub_pd(yp, y0);
+			__m256d fz = _mm256_sub_pd(zp, z0);
+			_mm_storeu_si128((__m128i*)ix, _mm256_cvttpd_epi32(x0));
+			_mm_storeu_si128((__m128i*)iy, _mm256_cvttpd_epi32(y0));
+			_mm_storeu_si128((__m128i*)iz, _mm256_cvttpd_epi32(z0));
+
+			// No gathers in AVX: fetch the neighbours one by one into SoA order
+			for (int l = 0; l < 4; l++)
+			{
+				const double *d = fdata + 2 * ((iz[l] - startz) * yxdim + (iy[l] - starty) * xdim + ix[l]);
+				for (int c = 0; c < 8; c++)
+				{
+					re[c][l] = d[2 * corner[c]];
+					im[c][l] = d[2 * corner[c] + 1];
+				}
+			}
+
+			// interpolate in x, y and z
+			__m256d rx00 = LIN_INTERP_AVX(_mm256_loadu_pd(re[0]), _mm256_loadu_pd(re[1]), fx);
+			__m256d rx10 = LIN_INTERP_AVX(_mm256_loadu_pd(re[2]), _mm256_loadu_pd(re[3]), fx);
+			__m256d rx01 = LIN_INTERP_AVX(_mm256_loadu_pd(re[4]), _mm256_loadu_pd(re[5]), fx);
+			__m256d rx11 = LIN_INTERP_AVX(_mm256_loadu_pd(re[6]), _mm256_loadu_pd(re[7]), fx);
+			__m256d ix00 = LIN_INTERP_AVX(_mm256_loadu_pd(im[0]), _mm256_loadu_pd(im[1]), fx);
+			__m256d ix10 = LIN_INTERP_AVX(_mm256_loadu_pd(im[2]), _mm256_loadu_pd(im[3]), fx);
+			__m256d ix01 = LIN_INTERP_AVX(_mm256_loadu_pd(im[4]), _mm256_loadu_pd(im[5]), fx);
+			__m256d ix11 = LIN_INTERP_AVX(_mm256_loadu_pd(im[6]), _mm256_loadu_pd(im[7]), fx);
+			__m256d rxy0 = LIN_INTERP_AVX(rx00, rx10, fy);
+			__m256d rxy1 = LIN_INTERP_AVX(rx01, rx11, fy);
+			__m256d ixy0 = LIN_INTERP_AVX(ix00, ix10, fy);
+			__m256d ixy1 = LIN_INTERP_AVX(ix01, ix11, fy);
+			__m256d vre = LIN_INTERP_AVX(rxy0, rxy1, fz);
+			__m256d vim = _mm256_xor_pd(LIN_INTERP_AVX(ixy0, ixy1, fz), neg);
+
+			_avx_store_complex_4(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowScalar(data, xdim, yxdim, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+#endif
+
+	void trilinearRowBrickedScalar(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		for (int x = 0; x < nx; x++)
+		{
+			DOUBLE xp = dx * x + bx;
+			DOUBLE yp = dy * x + by;
+			DOUBLE zp = dz * x + bz;
+
+			// Only asymmetric half is stored
+			bool is_neg_x = xp < 0;
+			if (is_neg_x)
+			{
+				xp = -xp;
+				yp = -yp;
+				zp = -zp;
+			}
+
+			int x0 = FLOOR(xp);
+			DOUBLE fx = xp - x0;
+			int y0 = FLOOR(yp);
+			DOUBLE fy = yp - y0;
+			y0 -= starty;
+			int z0 = FLOOR(zp);
+			DOUBLE fz = zp - z0;
+			z0 -= startz;
+
+			const Complex *z0y0 = bricks + zoff[z0] + yoff[y0], *z0y1 = bricks + zoff[z0] + yoff[y0 + 1];
+			const Complex *z1y0 = bricks + zoff[z0 + 1] + yoff[y0], *z1y1 = bricks + zoff[z0 + 1] + yoff[y0 + 1];
+			int xo0 = xoff[x0], xo1 = xoff[x0 + 1];
+			Complex dx00 = LIN_INTERP(fx, z0y0[xo0], z0y0[xo1]);
+			Complex dx10 = LIN_INTERP(fx, z0y1[xo0], z0y1[xo1]);
+			Complex dx01 = LIN_INTERP(fx, z1y0[xo0], z1y0[xo1]);
+			Complex dx11 = LIN_INTERP(fx, z1y1[xo0], z1y1[xo1]);
+			Complex dxy0 = LIN_INTERP(fy, dx00, dx10);
+			Complex dxy1 = LIN_INTERP(fy, dx01, dx11);
+			out[x] = LIN_INTERP(fz, dxy0, dxy1);
+			if (is_neg_x)
+				out[x] = conj(out[x]);
+		}
+	}
+
+	TrilinearRowKernel getTrilinearRowKernel()
+	{
+		return getSimdKernels().trilinear_row;
+	}
+
+	void nearestRow(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		for (int x = 0; x < nx; x++)
+		{
+			int x0 = ROUND(dx * x + bx);
+			int y0 = ROUND(dy * x + by);
+			int z0 = ROUND(dz * x + bz);
+			if (x0 < 0)
+				out[x] = conj(data[(-z0 - startz) * yxdim + (-y0 - starty) * xdim - x0]);
+			else
+				out[x] = data[(z0 - startz) * yxdim + (y0 - starty) * xdim + x0];
+		}
+	}
+
+	void trilinearRowHalfScalar(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const long int corner[8] = { 0, 1, xdim, xdim + 1, yxdim, yxdim + 1, yxdim + xdim, yxdim + xdim + 1 };
+		for (int x = 0; x < nx; x++)
+		{
+			DOUBLE xp = dx * x + bx;
+			DOUBLE yp = dy * x + by;
+			DOUBLE zp = dz * x + bz;
+
+			// Only asymmetric half is stored
+			bool is_neg_x = xp < 0;
+			if (is_neg_x)
+			{
+				xp = -xp;
+				yp = -yp;
+				zp = -zp;
+			}
+
+			int x0 = FLOOR(xp);
+			DOUBLE fx = xp - x0;
+			int y0 = FLOOR(yp);
+			DOUBLE fy = yp - y0;
+			y0 -= starty;
+			int z0 = FLOOR(zp);
+			DOUBLE fz = zp - z0;
+			z0 -= startz;
+
+			const unsigned short *d = data + 2 * (z0 * yxdim + y0 * xdim + x0);
+			Complex c[8];
+			for (int i = 0; i < 8; i++)
+				c[i] = Complex(halfToFloat(d[2 * corner[i]]), halfToFloat(d[2 * corner[i] + 1]));
+			Complex dxy0 = LIN_INTERP(fy, LIN_INTERP(fx, c[0], c[1]), LIN_INTERP(fx, c[2], c[3]));
+			Complex dxy1 = LIN_INTERP(fy, LIN_INTERP(fx, c[4], c[5]), LIN_INTERP(fx, c[6], c[7]));
+			out[x] = LIN_INTERP(fz, dxy0, dxy1) * scale;
+			if (is_neg_x)
+				out[x] = conj(out[x]);
+		}
+	}
+
+	void nearestRowHalf(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		for (int x = 0; x < nx; x++)
+		{
+			int x0 = ROUND(dx * x + bx);
+			int y0 = ROUND(dy * x + by);
+			int z0 = ROUND(dz * x + bz);
+			bool is_neg_x = x0 < 0;
+			if (is_neg_x)
+			{
+				x0 = -x0;
+				y0 = -y0;
+				z0 = -z0;
+			}
+			const unsigned short *d = data + 2 * ((z0 - startz) * yxdim + (y0 - starty) * xdim + x0);
+			out[x] = Complex(scale * halfToFloat(d[0]), scale * halfToFloat(d[1]));
+			if (is_neg_x)
+				out[x] = conj(out[x]);
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PROJECTOR_KERNELS_H
+#define PROJECTOR_KERNELS_H
+
+#include <math.h>
+#include "src/complex.h"
+
+namespace relion
+{
+	// Number of points x = 0, 1, ... with x*x <= max_x2, but no more than my_r_max + 1
+	static inline int getRowLength(int my_r_max, int max_x2)
+	{
+		if (max_x2 < 0)
+			return 0;
+		int xmax = (int)sqrt((double)max_x2);
+		while ((xmax + 1) * (xmax + 1) <= max_x2)
+			xmax++;
+		while (xmax * xmax > max_x2)
+			xmax--;
+		return XMIPP_MIN(xmax, my_r_max) + 1;
+	}
+
+	/* Trilinear interpolation of one row of nx output pixels (x = 0 ... nx-1) from a half-complex
+	 * Fourier volume with row length xdim and slice size yxdim, whose logical origin is at (startz, starty, 0).
+	 * Pixel x is interpolated at the logical coordinates (bx + x * dx, by + x * dy, bz + x * dz),
+	 * points with negative x are taken as the complex conjugate of their Friedel mate.
+	 * All coordinates (and their +1 neighbours) should lie inside the volume.
+	 */
+	typedef void (*TrilinearRowKernel)(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// Reference implementation, one pixel at a time
+	void trilinearRowScalar(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// AVX: 8 (float) or 4 (double) pixels at a time, with scalar loads of the 8 neighbours
+	void trilinearRowAVX(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// AVX2 + FMA: as above, but the neighbours are fetched with hardware gathers
+	// (lives in projector_kernels_avx2.cpp, which is the only file compiled for AVX2)
+	void trilinearRowAVX2(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// AVX-512: 16 pixels at a time (projector_kernels_avx512.cpp, compiled for AVX-512; the AVX2 kernel in double precision)
+	void trilinearRowAVX512(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// The fastest of the above for the instruction-set level in use (see getSimdKernels)
+	TrilinearRowKernel getTrilinearRowKernel();
+
+	/* As TrilinearRowKernel, for a volume in bricks (see BrickedFourierVolume): the index of physical voxel
+	 * (z, y, x) in bricks is zoff[z] + yoff[y] + xoff[x]
+	 */
+	typedef void (*BrickedTrilinearRowKernel)(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// One pixel at a time
+	void trilinearRowBrickedScalar(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// AVX2 + FMA, with hardware gathers of the offsets and the neighbours (projector_kernels_avx2.cpp; scalar in double precision)
+	void trilinearRowBrickedAVX2(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	/* As TrilinearRowKernel, for a volume in half precision (see HalfFourierVolume): data holds the real and
+	 * imaginary parts of every voxel as IEEE half floats, which are multiplied by scale
+	 */
+	typedef void (*HalfTrilinearRowKernel)(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// One pixel at a time
+	void trilinearRowHalfScalar(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// AVX2 + F16C: gathers of the half-precision pairs, converted in registers (projector_kernels_avx2.cpp; scalar in double precision)
+	void trilinearRowHalfAVX2(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	// Nearest-neighbour interpolation of one row of a half-precision volume
+	void nearestRowHalf(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+
+	/* Nearest-neighbour interpolation of one row, with the same arguments as the trilinear kernels
+	 * (the nearest point is taken before the Friedel flip, as in Projector::project)
+	 */
+	void nearestRow(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out);
+}
+
+#endif
@@ -0,0 +1,317 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/projector_kernels.h"
+#include "src/avx_helper.h"
+
+namespace relion
+{
+#ifdef FLOAT_PRECISION
+
+	void trilinearRowAVX2(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256 ramp = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		const __m256 __dx = _mm256_set1_ps(dx), __dy = _mm256_set1_ps(dy), __dz = _mm256_set1_ps(dz);
+		const __m256 __bx = _mm256_set1_ps(bx), __by = _mm256_set1_ps(by), __bz = _mm256_set1_ps(bz);
+		const __m256i __xdim = _mm256_set1_epi32((int)xdim), __yxdim = _mm256_set1_epi32((int)yxdim);
+		const __m256i __starty = _mm256_set1_epi32((int)starty), __startz = _mm256_set1_epi32((int)startz);
+
+		// Offsets in floats of the 8 neighbours, relative to the lowest corner
+		const int corner[8] = { 0, 2, 2 * (int)xdim, 2 * (int)xdim + 2,
+			2 * (int)yxdim, 2 * (int)yxdim + 2, 2 * (int)(yxdim + xdim), 2 * (int)(yxdim + xdim) + 2 };
+		const float *fdata = (const float*)data;
+
+		int x = 0;
+		for (; x + 8 <= nx; x += 8)
+		{
+			__m256 __x = _mm256_add_ps(ramp, _mm256_set1_ps((float)x));
+			__m256 xp = _mm256_fmadd_ps(__dx, __x, __bx);
+			__m256 yp = _mm256_fmadd_ps(__dy, __x, __by);
+			__m256 zp = _mm256_fmadd_ps(__dz, __x, __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256 neg = _mm256_and_ps(_mm256_cmp_ps(xp, _mm256_setzero_ps(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_ps(xp, neg);
+			yp = _mm256_xor_ps(yp, neg);
+			zp = _mm256_xor_ps(zp, neg);
+
+			__m256 x0 = _mm256_floor_ps(xp);
+			__m256 y0 = _mm256_floor_ps(yp);
+			__m256 z0 = _mm256_floor_ps(zp);
+			__m256 fx = _mm256_sub_ps(xp, x0);
+			__m256 fy = _mm256_sub_ps(yp, y0);
+			__m256 fz = _mm256_sub_ps(zp, z0);
+
+			// Index (in floats) of the lowest corner
+			__m256i idx = _mm256_add_epi32(
+				_mm256_add_epi32(
+					_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_cvttps_epi32(z0), __startz), __yxdim),
+					_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_cvttps_epi32(y0), __starty), __xdim)),
+				_mm256_cvttps_epi32(x0));
+			idx = _mm256_slli_epi32(idx, 1);
+
+			__m256 re[8], im[8];
+			for (int c = 0; c < 8; c++)
+			{
+				re[c] = _mm256_i32gather_ps(fdata + corner[c], idx, 4);
+				im[c] = _mm256_i32gather_ps(fdata + corner[c] + 1, idx, 4);
+			}
+
+			// interpolate in x, y and z
+			__m256 rxy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[0], re[1], fx), LIN_INTERP_FMA(re[2], re[3], fx), fy);
+			__m256 rxy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[4], re[5], fx), LIN_INTERP_FMA(re[6], re[7], fx), fy);
+			__m256 ixy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[0], im[1], fx), LIN_INTERP_FMA(im[2], im[3], fx), fy);
+			__m256 ixy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[4], im[5], fx), LIN_INTERP_FMA(im[6], im[7], fx), fy);
+			__m256 vre = LIN_INTERP_FMA(rxy0, rxy1, fz);
+			__m256 vim = _mm256_xor_ps(LIN_INTERP_FMA(ixy0, ixy1, fz), neg);
+
+			_avx_store_complex_8(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowScalar(data, xdim, yxdim, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+	void trilinearRowBrickedAVX2(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256 ramp = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		const __m256 __dx = _mm256_set1_ps(dx), __dy = _mm256_set1_ps(dy), __dz = _mm256_set1_ps(dz);
+		const __m256 __bx = _mm256_set1_ps(bx), __by = _mm256_set1_ps(by), __bz = _mm256_set1_ps(bz);
+		const __m256i __starty = _mm256_set1_epi32((int)starty), __startz = _mm256_set1_epi32((int)startz);
+		const float *fdata = (const float*)bricks;
+
+		int x = 0;
+		for (; x + 8 <= nx; x += 8)
+		{
+			__m256 __x = _mm256_add_ps(ramp, _mm256_set1_ps((float)x));
+			__m256 xp = _mm256_fmadd_ps(__dx, __x, __bx);
+			__m256 yp = _mm256_fmadd_ps(__dy, __x, __by);
+			__m256 zp = _mm256_fmadd_ps(__dz, __x, __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256 neg = _mm256_and_ps(_mm256_cmp_ps(xp, _mm256_setzero_ps(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_ps(xp, neg);
+			yp = _mm256_xor_ps(yp, neg);
+			zp = _mm256_xor_ps(zp, neg);
+
+			__m256 x0 = _mm256_floor_ps(xp);
+			__m256 y0 = _mm256_floor_ps(yp);
+			__m256 z0 = _mm256_floor_ps(zp);
+			__m256 fx = _mm256_sub_ps(xp, x0);
+			__m256 fy = _mm256_sub_ps(yp, y0);
+			__m256 fz = _mm256_sub_ps(zp, z0);
+
+			// Offsets of the lower and upper neighbours along each axis
+			__m256i ix = _mm256_cvttps_epi32(x0);
+			__m256i iy = _mm256_sub_epi32(_mm256_cvttps_epi32(y0), __starty);
+			__m256i iz = _mm256_sub_epi32(_mm256_cvttps_epi32(z0), __startz);
+			__m256i xo[2] = { _mm256_i32gather_epi32(xoff, ix, 4), _mm256_i32gather_epi32(xoff + 1, ix, 4) };
+			__m256i yo[2] = { _mm256_i32gather_epi32(yoff, iy, 4), _mm256_i32gather_epi32(yoff + 1, iy, 4) };
+			__m256i zo[2] = { _mm256_i32gather_epi32(zoff, iz, 4), _mm256_i32gather_epi32(zoff + 1, iz, 4) };
+
+			__m256 re[8], im[8];
+			for (int c = 0; c < 8; c++)
+			{
+				// Index (in floats) of corner c = (dz, dy, dx) in binary
+				__m256i idx = _mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(zo[c >> 2], yo[(c >> 1) & 1]), xo[c & 1]), 1);
+				re[c] = _mm256_i32gather_ps(fdata, idx, 4);
+				im[c] = _mm256_i32gather_ps(fdata + 1, idx, 4);
+			}
+
+			// interpolate in x, y and z
+			__m256 rxy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[0], re[1], fx), LIN_INTERP_FMA(re[2], re[3], fx), fy);
+			__m256 rxy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[4], re[5], fx), LIN_INTERP_FMA(re[6], re[7], fx), fy);
+			__m256 ixy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[0], im[1], fx), LIN_INTERP_FMA(im[2], im[3], fx), fy);
+			__m256 ixy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[4], im[5], fx), LIN_INTERP_FMA(im[6], im[7], fx), fy);
+			__m256 vre = LIN_INTERP_FMA(rxy0, rxy1, fz);
+			__m256 vim = _mm256_xor_ps(LIN_INTERP_FMA(ixy0, ixy1, fz), neg);
+
+			_avx_store_complex_8(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowBrickedScalar(bricks, xoff, yoff, zoff, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+	void trilinearRowHalfAVX2(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256 ramp = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		const __m256 __scale = _mm256_set1_ps(scale);
+		const __m256 __dx = _mm256_set1_ps(dx), __dy = _mm256_set1_ps(dy), __dz = _mm256_set1_ps(dz);
+		const __m256 __bx = _mm256_set1_ps(bx), __by = _mm256_set1_ps(by), __bz = _mm256_set1_ps(bz);
+		const __m256i __xdim = _mm256_set1_epi32((int)xdim), __yxdim = _mm256_set1_epi32((int)yxdim);
+		const __m256i __starty = _mm256_set1_epi32((int)starty), __startz = _mm256_set1_epi32((int)startz);
+		const __m256i lo16 = _mm256_set1_epi32(0xffff);
+
+		// Offsets in voxels (32-bit pairs of halves) of the 8 neighbours, relative to the lowest corner
+		const int corner[8] = { 0, 1, (int)xdim, (int)xdim + 1, (int)yxdim, (int)yxdim + 1, (int)(yxdim + xdim), (int)(yxdim + xdim) + 1 };
+		const int *pairs = (const int*)data;
+
+		int x = 0;
+		for (; x + 8 <= nx; x += 8)
+		{
+			__m256 __x = _mm256_add_ps(ramp, _mm256_set1_ps((float)x));
+			__m256 xp = _mm256_fmadd_ps(__dx, __x, __bx);
+			__m256 yp = _mm256_fmadd_ps(__dy, __x, __by);
+			__m256 zp = _mm256_fmadd_ps(__dz, __x, __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256 neg = _mm256_and_ps(_mm256_cmp_ps(xp, _mm256_setzero_ps(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_ps(xp, neg);
+			yp = _mm256_xor_ps(yp, neg);
+			zp = _mm256_xor_ps(zp, neg);
+
+			__m256 x0 = _mm256_floor_ps(xp);
+			__m256 y0 = _mm256_floor_ps(yp);
+			__m256 z0 = _mm256_floor_ps(zp);
+			__m256 fx = _mm256_sub_ps(xp, x0);
+			__m256 fy = _mm256_sub_ps(yp, y0);
+			__m256 fz = _mm256_sub_ps(zp, z0);
+
+			// Index (in voxels) of the lowest corner
+			__m256i idx = _mm256_add_epi32(
+				_mm256_add_epi32(
+					_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_cvttps_epi32(z0), __startz), __yxdim),
+					_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_cvttps_epi32(y0), __starty), __xdim)),
+				_mm256_cvttps_epi32(x0));
+
+			__m256 re[8], im[8];
+			for (int c = 0; c < 8; c++)
+			{
+				// One gather of the (real, imaginary) pairs, then separate and convert the halves:
+				// after the in-lane pack and the cross-lane permute the low 128 bits hold the 8 real parts
+				__m256i pair = _mm256_i32gather_epi32(pairs + corner[c], idx, 4);
+				__m256i packed = _mm256_packus_epi32(_mm256_and_si256(pair, lo16), _mm256_srli_epi32(pair, 16));
+				packed = _mm256_permute4x64_epi64(packed, 0xD8);
+				re[c] = _mm256_cvtph_ps(_mm256_castsi256_si128(packed));
+				im[c] = _mm256_cvtph_ps(_mm256_extracti128_si256(packed, 1));
+			}
+
+			// interpolate in x, y and z
+			__m256 rxy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[0], re[1], fx), LIN_INTERP_FMA(re[2], re[3], fx), fy);
+			__m256 rxy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[4], re[5], fx), LIN_INTERP_FMA(re[6], re[7], fx), fy);
+			__m256 ixy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[0], im[1], fx), LIN_INTERP_FMA(im[2], im[3], fx), fy);
+			__m256 ixy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[4], im[5], fx), LIN_INTERP_FMA(im[6], im[7], fx), fy);
+			__m256 vre = _mm256_mul_ps(LIN_INTERP_FMA(rxy0, rxy1, fz), __scale);
+			__m256 vim = _mm256_xor_ps(_mm256_mul_ps(LIN_INTERP_FMA(ixy0, ixy1, fz), __scale), neg);
+
+			_avx_store_complex_8(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowHalfScalar(data, xdim, yxdim, starty, startz, scale,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+#else
+
+	void trilinearRowAVX2(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m256d ramp = _mm256_setr_pd(0., 1., 2., 3.);
+		const __m256d signbit = _mm256_set1_pd(-0.);
+		const __m256d __dx = _mm256_set1_pd(dx), __dy = _mm256_set1_pd(dy), __dz = _mm256_set1_pd(dz);
+		const __m256d __bx = _mm256_set1_pd(bx), __by = _mm256_set1_pd(by), __bz = _mm256_set1_pd(bz);
+		const __m128i __xdim = _mm_set1_epi32((int)xdim), __yxdim = _mm_set1_epi32((int)yxdim);
+		const __m128i __starty = _mm_set1_epi32((int)starty), __startz = _mm_set1_epi32((int)startz);
+
+		// Offsets in doubles of the 8 neighbours, relative to the lowest corner
+		const int corner[8] = { 0, 2, 2 * (int)xdim, 2 * (int)xdim + 2,
+			2 * (int)yxdim, 2 * (int)yxdim + 2, 2 * (int)(yxdim + xdim), 2 * (int)(yxdim + xdim) + 2 };
+		const double *fdata = (const double*)data;
+
+		int x = 0;
+		for (; x + 4 <= nx; x += 4)
+		{
+			__m256d __x = _mm256_add_pd(ramp, _mm256_set1_pd((double)x));
+			__m256d xp = _mm256_fmadd_pd(__dx, __x, __bx);
+			__m256d yp = _mm256_fmadd_pd(__dy, __x, __by);
+			__m256d zp = _mm256_fmadd_pd(__dz, __x, __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__m256d neg = _mm256_and_pd(_mm256_cmp_pd(xp, _mm256_setzero_pd(), _CMP_LT_OQ), signbit);
+			xp = _mm256_xor_pd(xp, neg);
+			yp = _mm256_xor_pd(yp, neg);
+			zp = _mm256_xor_pd(zp, neg);
+
+			__m256d x0 = _mm256_floor_pd(xp);
+			__m256d y0 = _mm256_floor_pd(yp);
+			__m256d z0 = _mm256_floor_pd(zp);
+			__m256d fx = _mm256_sub_pd(xp, x0);
+			__m256d fy = _mm256_sub_pd(yp, y0);
+			__m256d fz = _mm256_sub_pd(zp, z0);
+
+			// Index (in doubles) of the lowest corner
+			__m128i idx = _mm_add_epi32(
+				_mm_add_epi32(
+					_mm_mullo_epi32(_mm_sub_epi32(_mm256_cvttpd_epi32(z0), __startz), __yxdim),
+					_mm_mullo_epi32(_mm_sub_epi32(_mm256_cvttpd_epi32(y0), __starty), __xdim)),
+				_mm256_cvttpd_epi32(x0));
+			idx = _mm_slli_epi32(idx, 1);
+
+			__m256d re[8], im[8];
+			for (int c = 0; c < 8; c++)
+			{
+				re[c] = _mm256_i32gather_pd(fdata + corner[c], idx, 8);
+				im[c] = _mm256_i32gather_pd(fdata + corner[c] + 1, idx, 8);
+			}
+
+			// interpolate in x, y and z
+			__m256d rxy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[0], re[1], fx), LIN_INTERP_FMA(re[2], re[3], fx), fy);
+			__m256d rxy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(re[4], re[5], fx), LIN_INTERP_FMA(re[6], re[7], fx), fy);
+			__m256d ixy0 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[0], im[1], fx), LIN_INTERP_FMA(im[2], im[3], fx), fy);
+			__m256d ixy1 = LIN_INTERP_FMA(LIN_INTERP_FMA(im[4], im[5], fx), LIN_INTERP_FMA(im[6], im[7], fx), fy);
+			__m256d vre = LIN_INTERP_FMA(rxy0, rxy1, fz);
+			__m256d vim = _mm256_xor_pd(LIN_INTERP_FMA(ixy0, ixy1, fz), neg);
+
+			_avx_store_complex_4(out + x, vre, vim);
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowScalar(data, xdim, yxdim, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+	void trilinearRowBrickedAVX2(const Complex *bricks, const int *xoff, const int *yoff, const int *zoff,
+		long int starty, long int startz, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		trilinearRowBrickedScalar(bricks, xoff, yoff, zoff, starty, startz, bx, by, bz, dx, dy, dz, nx, out);
+	}
+
+	void trilinearRowHalfAVX2(const unsigned short *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE scale, DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		trilinearRowHalfScalar(data, xdim, yxdim, starty, startz, scale, bx, by, bz, dx, dy, dz, nx, out);
+	}
+
+#endif
+}
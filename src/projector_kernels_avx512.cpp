@@ -0,0 +1,115 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/projector_kernels.h"
+#include <immintrin.h>
+
+namespace relion
+{
+#ifdef FLOAT_PRECISION
+
+#define LIN_INTERP_FMA16(l, r, a) _mm512_fmadd_ps(_mm512_sub_ps(r, l), a, l)
+
+	void trilinearRowAVX512(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		const __m512 ramp = _mm512_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f, 8.f, 9.f, 10.f, 11.f, 12.f, 13.f, 14.f, 15.f);
+		const __m512 zero = _mm512_setzero_ps();
+		const __m512 __dx = _mm512_set1_ps(dx), __dy = _mm512_set1_ps(dy), __dz = _mm512_set1_ps(dz);
+		const __m512 __bx = _mm512_set1_ps(bx), __by = _mm512_set1_ps(by), __bz = _mm512_set1_ps(bz);
+		const __m512i __xdim = _mm512_set1_epi32((int)xdim), __yxdim = _mm512_set1_epi32((int)yxdim);
+		const __m512i __starty = _mm512_set1_epi32((int)starty), __startz = _mm512_set1_epi32((int)startz);
+
+		// Offsets in floats of the 8 neighbours, relative to the lowest corner
+		const int corner[8] = { 0, 2, 2 * (int)xdim, 2 * (int)xdim + 2,
+			2 * (int)yxdim, 2 * (int)yxdim + 2, 2 * (int)(yxdim + xdim), 2 * (int)(yxdim + xdim) + 2 };
+		const float *fdata = (const float*)data;
+
+		int x = 0;
+		for (; x + 16 <= nx; x += 16)
+		{
+			__m512 __x = _mm512_add_ps(ramp, _mm512_set1_ps((float)x));
+			__m512 xp = _mm512_fmadd_ps(__dx, __x, __bx);
+			__m512 yp = _mm512_fmadd_ps(__dy, __x, __by);
+			__m512 zp = _mm512_fmadd_ps(__dz, __x, __bz);
+
+			// Flip the points with negative x onto their Friedel mate
+			__mmask16 neg = _mm512_cmp_ps_mask(xp, zero, _CMP_LT_OQ);
+			xp = _mm512_mask_sub_ps(xp, neg, zero, xp);
+			yp = _mm512_mask_sub_ps(yp, neg, zero, yp);
+			zp = _mm512_mask_sub_ps(zp, neg, zero, zp);
+
+			__m512 x0 = _mm512_roundscale_ps(xp, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+			__m512 y0 = _mm512_roundscale_ps(yp, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+			__m512 z0 = _mm512_roundscale_ps(zp, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+			__m512 fx = _mm512_sub_ps(xp, x0);
+			__m512 fy = _mm512_sub_ps(yp, y0);
+			__m512 fz = _mm512_sub_ps(zp, z0);
+
+			// Index (in floats) of the lowest corner
+			__m512i idx = _mm512_add_epi32(
+				_mm512_add_epi32(
+					_mm512_mullo_epi32(_mm512_sub_epi32(_mm512_cvttps_epi32(z0), __startz), __yxdim),
+					_mm512_mullo_epi32(_mm512_sub_epi32(_mm512_cvttps_epi32(y0), __starty), __xdim)),
+				_mm512_cvttps_epi32(x0));
+			idx = _mm512_slli_epi32(idx, 1);
+
+			__m512 re[8], im[8];
+			for (int c = 0; c < 8; c++)
+			{
+				re[c] = _mm512_i32gather_ps(idx, fdata + corner[c], 4);
+				im[c] = _mm512_i32gather_ps(idx, fdata + corner[c] + 1, 4);
+			}
+
+			// interpolate in x, y and z
+			__m512 rxy0 = LIN_INTERP_FMA16(LIN_INTERP_FMA16(re[0], re[1], fx), LIN_INTERP_FMA16(re[2], re[3], fx), fy);
+			__m512 rxy1 = LIN_INTERP_FMA16(LIN_INTERP_FMA16(re[4], re[5], fx), LIN_INTERP_FMA16(re[6], re[7], fx), fy);
+			__m512 ixy0 = LIN_INTERP_FMA16(LIN_INTERP_FMA16(im[0], im[1], fx), LIN_INTERP_FMA16(im[2], im[3], fx), fy);
+			__m512 ixy1 = LIN_INTERP_FMA16(LIN_INTERP_FMA16(im[4], im[5], fx), LIN_INTERP_FMA16(im[6], im[7], fx), fy);
+			__m512 vre = LIN_INTERP_FMA16(rxy0, rxy1, fz);
+			__m512 vim = LIN_INTERP_FMA16(ixy0, ixy1, fz);
+			vim = _mm512_mask_sub_ps(vim, neg, zero, vim);
+
+			// Interleave into 16 consecutive Complex (unpack works within 128-bit lanes)
+			__m512 lo = _mm512_unpacklo_ps(vre, vim);
+			__m512 hi = _mm512_unpackhi_ps(vre, vim);
+			__m512 t0 = _mm512_shuffle_f32x4(lo, hi, _MM_SHUFFLE(1, 0, 1, 0));
+			__m512 t1 = _mm512_shuffle_f32x4(lo, hi, _MM_SHUFFLE(3, 2, 3, 2));
+			_mm512_storeu_ps((float*)(out + x), _mm512_shuffle_f32x4(t0, t0, _MM_SHUFFLE(3, 1, 2, 0)));
+			_mm512_storeu_ps((float*)(out + x + 8), _mm512_shuffle_f32x4(t1, t1, _MM_SHUFFLE(3, 1, 2, 0)));
+		}
+
+		// Remainder of the row
+		if (x < nx)
+			trilinearRowAVX2(data, xdim, yxdim, starty, startz,
+				bx + x * dx, by + x * dy, bz + x * dz, dx, dy, dz, nx - x, out + x);
+	}
+
+#else
+
+	// Double precision: only 8 values per register, use the AVX2 kernel
+	void trilinearRowAVX512(const Complex *data, long int xdim, long int yxdim, long int starty, long int startz,
+		DOUBLE bx, DOUBLE by, DOUBLE bz, DOUBLE dx, DOUBLE dy, DOUBLE dz, int nx, Complex *out)
+	{
+		trilinearRowAVX2(data, xdim, yxdim, starty, startz, bx, by, bz, dx, dy, dz, nx, out);
+	}
+
+#endif
+}
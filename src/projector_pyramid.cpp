@@ -0,0 +1,114 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/projector_pyramid.h"
+
+namespace relion
+{
+	// 64-bit FNV-1a over the 32-bit words of the map
+	static unsigned long long getMapChecksum(const MultidimArray<DOUBLE> &vol)
+	{
+		const unsigned int *words = (const unsigned int*)MULTIDIM_ARRAY(vol);
+		size_t nr_words = NZYXSIZE(vol) * sizeof(DOUBLE) / sizeof(unsigned int);
+		unsigned long long checksum = 14695981039346656037ULL;
+		for (size_t i = 0; i < nr_words; i++)
+		{
+			checksum ^= words[i];
+			checksum *= 1099511628211ULL;
+		}
+		return checksum;
+	}
+
+	ProjectorPyramid::ProjectorPyramid(int ori_size, int interpolator, int padding_factor_3d, int r_min_nn, int data_dim)
+	{
+		full.projector = Projector(ori_size, interpolator, padding_factor_3d, r_min_nn, data_dim);
+		has_reference = reference_gridding = false;
+		reference_checksum = 0;
+		reference_size = 0;
+	}
+
+	void ProjectorPyramid::clear()
+	{
+		std::lock_guard<std::mutex> lock(levels_mutex);
+		levels.clear();
+		full.projector.data.clear();
+		full.power_spectrum.clear();
+		has_reference = false;
+	}
+
+	bool ProjectorPyramid::setReference(const MultidimArray<DOUBLE> &vol_in, int nr_threads, bool do_gridding)
+	{
+		unsigned long long checksum = getMapChecksum(vol_in);
+		if (has_reference && reference_gridding == do_gridding && reference_size == NZYXSIZE(vol_in) &&
+			reference_checksum == checksum)
+			return false;
+
+		clear();
+
+		// computeFourierTransformMap applies the gridding correction to its input
+		MultidimArray<DOUBLE> vol(vol_in);
+		full.projector.computeFourierTransformMap(vol, full.power_spectrum, -1, nr_threads, do_gridding);
+
+		has_reference = true;
+		reference_gridding = do_gridding;
+		reference_checksum = checksum;
+		reference_size = NZYXSIZE(vol_in);
+		return true;
+	}
+
+	ProjectorPyramid::Level& ProjectorPyramid::getLevel(int current_size, int nr_threads)
+	{
+		if (!has_reference)
+			REPORT_ERROR("ProjectorPyramid::getLevel%%ERROR: no reference has been set");
+
+		int ori_size = full.projector.ori_size;
+		int r_max = XMIPP_MIN((current_size < 0) ? ori_size / 2 : current_size / 2, ori_size / 2);
+		if (r_max == full.projector.r_max)
+			return full;
+
+		// Levels are made under the lock: callers asking for the same new level wait for the first one
+		Level *level;
+		{
+			std::lock_guard<std::mutex> lock(levels_mutex);
+			std::map<int, Level>::iterator it = levels.find(r_max);
+			if (it != levels.end())
+				return it->second;
+			level = &levels[r_max];
+			full.projector.windowFourierTransformMap(level->projector, level->power_spectrum, current_size, nr_threads);
+		}
+		return *level;
+	}
+
+	Projector& ProjectorPyramid::getProjector(int current_size, int nr_threads)
+	{
+		return getLevel(current_size, nr_threads).projector;
+	}
+
+	const MultidimArray<DOUBLE>& ProjectorPyramid::getPowerSpectrum(int current_size, int nr_threads)
+	{
+		return getLevel(current_size, nr_threads).power_spectrum;
+	}
+
+	int ProjectorPyramid::getNrLevels()
+	{
+		std::lock_guard<std::mutex> lock(levels_mutex);
+		return has_reference ? levels.size() + 1 : 0;
+	}
+}
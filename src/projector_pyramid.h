@@ -0,0 +1,96 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PROJECTOR_PYRAMID_H
+#define PROJECTOR_PYRAMID_H
+
+#include <map>
+#include <mutex>
+#include "src/projector.h"
+
+namespace relion
+{
+	/** A reference with its padded Fourier Transform map at several current_sizes, for coarse-to-fine searches
+	 *
+	 * Projector::computeFourierTransformMap() does the gridding correction, padding, full FFT and power spectrum
+	 * every time, even if only current_size changes. The pyramid does this once, at the full size, and windows the
+	 * map (see Projector::windowFourierTransformMap) for every smaller current_size that is asked for. The levels are
+	 * kept until the reference changes: setReference() with the same map (and settings) does not recompute anything.
+	 *
+	 * @code
+	 * ProjectorPyramid pyramid(ori_size, TRILINEAR, padding_factor);
+	 * pyramid.setReference(vol, nr_threads);
+	 * Projector &coarse = pyramid.getProjector(coarse_size);
+	 * Projector &fine = pyramid.getProjector(current_size);
+	 * @endcode
+	 */
+	class ProjectorPyramid
+	{
+	public:
+		ProjectorPyramid(int ori_size, int interpolator = TRILINEAR, int padding_factor_3d = 2, int r_min_nn = 10, int data_dim = 2);
+
+		/// Forget the reference and all levels
+		void clear();
+
+		/** Set the reference map (which is not changed, unlike in computeFourierTransformMap)
+		 * Returns false if the map and do_gridding are the same as last time, in which case all levels are kept.
+		 */
+		bool setReference(const MultidimArray<DOUBLE> &vol_in, int nr_threads = 1, bool do_gridding = true);
+
+		/** The projector at current_size (-1 for the full size), made when first asked for
+		 * May be called from several threads at once. The reference stays valid until the next setReference() or clear();
+		 * the projector is shared, so it should only be projected from (not changed).
+		 */
+		Projector& getProjector(int current_size = -1, int nr_threads = 1);
+
+		/// The radial power spectrum of the reference within the r_max of current_size
+		const MultidimArray<DOUBLE>& getPowerSpectrum(int current_size = -1, int nr_threads = 1);
+
+		/// The number of levels made so far (including the full one)
+		int getNrLevels();
+
+	private:
+		struct Level
+		{
+			Projector projector;
+			MultidimArray<DOUBLE> power_spectrum;
+		};
+
+		// The full map, with the settings of the pyramid
+		Level full;
+		bool has_reference, reference_gridding;
+
+		// Checksum and size of the last reference map
+		unsigned long long reference_checksum;
+		long int reference_size;
+
+		// Windowed levels by their r_max
+		std::map<int, Level> levels;
+		std::mutex levels_mutex;
+
+		Level& getLevel(int current_size, int nr_threads);
+
+		// Not copyable
+		ProjectorPyramid(const ProjectorPyramid&);
+		ProjectorPyramid& operator=(const ProjectorPyramid&);
+	};
+}
+
+#endif
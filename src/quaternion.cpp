@@ -0,0 +1,128 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/quaternion.h"
+#include "src/euler.h"
+
+namespace relion
+{
+	// The Euler matrix Rz(psi) * Ry(tilt) * Rz(rot) is the product of the quaternions of the three rotations,
+	// (cos(rot/2), 0, 0, -sin(rot/2)), (cos(tilt/2), 0, -sin(tilt/2), 0) and (cos(psi/2), 0, 0, -sin(psi/2))
+	static inline void eulerHalfAnglesToQuaternion(DOUBLE rot, DOUBLE tilt, DOUBLE psi,
+		DOUBLE &w, DOUBLE &x, DOUBLE &y, DOUBLE &z)
+	{
+		DOUBLE half_sum = DEG2RAD(0.5 * (rot + psi));
+		DOUBLE half_diff = DEG2RAD(0.5 * (rot - psi));
+		DOUBLE half_tilt = DEG2RAD(0.5 * tilt);
+		DOUBLE ct = cos(half_tilt), st = sin(half_tilt);
+		w = ct * cos(half_sum);
+		x = st * sin(half_diff);
+		y = -st * cos(half_diff);
+		z = -ct * sin(half_sum);
+	}
+
+	Quaternion eulerToQuaternion(DOUBLE rot, DOUBLE tilt, DOUBLE psi)
+	{
+		Quaternion q;
+		eulerHalfAnglesToQuaternion(rot, tilt, psi, q.w, q.x, q.y, q.z);
+		return q;
+	}
+
+	void quaternionToEuler(const Quaternion &q, DOUBLE &rot, DOUBLE &tilt, DOUBLE &psi)
+	{
+		Euler_matrix2angles(q.toMatrix(), rot, tilt, psi);
+	}
+
+	void eulerToQuaternions(const DOUBLE *rot, const DOUBLE *tilt, const DOUBLE *psi, long int n, QuaternionArray &q)
+	{
+		q.resize(n);
+		DOUBLE *qw = q.w.data(), *qx = q.x.data(), *qy = q.y.data(), *qz = q.z.data();
+		for (long int i = 0; i < n; i++)
+			eulerHalfAnglesToQuaternion(rot[i], tilt[i], psi[i], qw[i], qx[i], qy[i], qz[i]);
+	}
+
+	void quaternionsToEuler(const QuaternionArray &q, DOUBLE *rot, DOUBLE *tilt, DOUBLE *psi)
+	{
+		for (long int i = 0; i < q.size(); i++)
+			quaternionToEuler(q.get(i), rot[i], tilt[i], psi[i]);
+	}
+
+	void transformQuaternions(const Quaternion &qL, const QuaternionArray &q, const Quaternion &qR, QuaternionArray &qout)
+	{
+		long int n = q.size();
+		qout.resize(n);
+		const DOUBLE *qw = q.w.data(), *qx = q.x.data(), *qy = q.y.data(), *qz = q.z.data();
+		DOUBLE *ow = qout.w.data(), *ox = qout.x.data(), *oy = qout.y.data(), *oz = qout.z.data();
+		for (long int i = 0; i < n; i++)
+		{
+			// a = qL * q[i]
+			DOUBLE aw = qL.w * qw[i] - qL.x * qx[i] - qL.y * qy[i] - qL.z * qz[i];
+			DOUBLE ax = qL.w * qx[i] + qL.x * qw[i] + qL.y * qz[i] - qL.z * qy[i];
+			DOUBLE ay = qL.w * qy[i] - qL.x * qz[i] + qL.y * qw[i] + qL.z * qx[i];
+			DOUBLE az = qL.w * qz[i] + qL.x * qy[i] - qL.y * qx[i] + qL.z * qw[i];
+			// a * qR
+			ow[i] = aw * qR.w - ax * qR.x - ay * qR.y - az * qR.z;
+			ox[i] = aw * qR.x + ax * qR.w + ay * qR.z - az * qR.y;
+			oy[i] = aw * qR.y - ax * qR.z + ay * qR.w + az * qR.x;
+			oz[i] = aw * qR.z + ax * qR.y - ay * qR.x + az * qR.w;
+		}
+	}
+
+	void quaternionAbsDots(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out)
+	{
+		long int n = q.size();
+		const DOUBLE *qw = q.w.data(), *qx = q.x.data(), *qy = q.y.data(), *qz = q.z.data();
+		for (long int i = 0; i < n; i++)
+			out[i] = ABS(q0.w * qw[i] + q0.x * qx[i] + q0.y * qy[i] + q0.z * qz[i]);
+	}
+
+	void quaternionAngularDistances(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out)
+	{
+		quaternionAbsDots(q0, q, out);
+		for (long int i = 0; i < q.size(); i++)
+			out[i] = RAD2DEG(2. * acos(XMIPP_MIN(out[i], (DOUBLE)1.)));
+	}
+
+	void quaternionAxesDistances(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out)
+	{
+		long int n = q.size();
+		const DOUBLE *qw = q.w.data(), *qx = q.x.data(), *qy = q.y.data(), *qz = q.z.data();
+		for (long int i = 0; i < n; i++)
+		{
+			// Vector part of q0 * conj(q[i]); the axes distance does not depend on the scalar part
+			DOUBLE x = -q0.w * qx[i] + q0.x * qw[i] - q0.y * qz[i] + q0.z * qy[i];
+			DOUBLE y = -q0.w * qy[i] + q0.x * qz[i] + q0.y * qw[i] - q0.z * qx[i];
+			DOUBLE z = -q0.w * qz[i] - q0.x * qy[i] + q0.y * qx[i] + q0.z * qw[i];
+			out[i] = quaternionAxesDistance(Quaternion(0., x, y, z));
+		}
+	}
+
+	void eulerToDirections(const DOUBLE *rot, const DOUBLE *tilt, long int n, DOUBLE *x, DOUBLE *y, DOUBLE *z)
+	{
+		for (long int i = 0; i < n; i++)
+		{
+			DOUBLE a = DEG2RAD(rot[i]), b = DEG2RAD(tilt[i]);
+			DOUBLE sb = sin(b);
+			x[i] = sb * cos(a);
+			y[i] = sb * sin(a);
+			z[i] = cos(b);
+		}
+	}
+}
@@ -0,0 +1,220 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef QUATERNION_H
+#define QUATERNION_H
+
+#include <math.h>
+#include <vector>
+#include "src/small_matrix.h"
+
+namespace relion
+{
+	/** @defgroup Quaternions Unit quaternions for rotations
+	 * @ingroup DataLibrary
+	 *
+	 * The rotation of a Mat33 R (acting on column vectors, x' = R x) as a unit quaternion (w, x, y, z).
+	 * q and -q are the same rotation.
+	 */
+	//@{
+	class Quaternion
+	{
+	public:
+		DOUBLE w, x, y, z;
+
+		/** The identity rotation
+		 */
+		constexpr Quaternion(): w(1.), x(0.), y(0.), z(0.)
+		{
+		}
+
+		constexpr Quaternion(DOUBLE _w, DOUBLE _x, DOUBLE _y, DOUBLE _z): w(_w), x(_x), y(_y), z(_z)
+		{
+		}
+
+		/** The quaternion of rotation matrix R (Shepperd's method, stable for all angles)
+		 */
+		static Quaternion fromMatrix(const Mat33 &R)
+		{
+			Quaternion q;
+			DOUBLE trace = R(0, 0) + R(1, 1) + R(2, 2);
+			if (trace > 0.)
+			{
+				DOUBLE s = 2. * sqrt(1. + trace);
+				q.w = 0.25 * s;
+				q.x = (R(2, 1) - R(1, 2)) / s;
+				q.y = (R(0, 2) - R(2, 0)) / s;
+				q.z = (R(1, 0) - R(0, 1)) / s;
+			}
+			else if (R(0, 0) > R(1, 1) && R(0, 0) > R(2, 2))
+			{
+				DOUBLE s = 2. * sqrt(1. + R(0, 0) - R(1, 1) - R(2, 2));
+				q.w = (R(2, 1) - R(1, 2)) / s;
+				q.x = 0.25 * s;
+				q.y = (R(0, 1) + R(1, 0)) / s;
+				q.z = (R(0, 2) + R(2, 0)) / s;
+			}
+			else if (R(1, 1) > R(2, 2))
+			{
+				DOUBLE s = 2. * sqrt(1. + R(1, 1) - R(0, 0) - R(2, 2));
+				q.w = (R(0, 2) - R(2, 0)) / s;
+				q.x = (R(0, 1) + R(1, 0)) / s;
+				q.y = 0.25 * s;
+				q.z = (R(1, 2) + R(2, 1)) / s;
+			}
+			else
+			{
+				DOUBLE s = 2. * sqrt(1. + R(2, 2) - R(0, 0) - R(1, 1));
+				q.w = (R(1, 0) - R(0, 1)) / s;
+				q.x = (R(0, 2) + R(2, 0)) / s;
+				q.y = (R(1, 2) + R(2, 1)) / s;
+				q.z = 0.25 * s;
+			}
+			return q;
+		}
+
+		/** The rotation matrix of this (unit) quaternion
+		 */
+		Mat33 toMatrix() const
+		{
+			return Mat33(1. - 2. * (y * y + z * z), 2. * (x * y - z * w), 2. * (x * z + y * w),
+						 2. * (x * y + z * w), 1. - 2. * (x * x + z * z), 2. * (y * z - x * w),
+						 2. * (x * z - y * w), 2. * (y * z + x * w), 1. - 2. * (x * x + y * y));
+		}
+
+		/** Composition: the rotation this * q first applies q, then this
+		 */
+		inline Quaternion operator*(const Quaternion &q) const
+		{
+			return Quaternion(w * q.w - x * q.x - y * q.y - z * q.z,
+							  w * q.x + x * q.w + y * q.z - z * q.y,
+							  w * q.y - x * q.z + y * q.w + z * q.x,
+							  w * q.z + x * q.y - y * q.x + z * q.w);
+		}
+
+		/** The inverse rotation
+		 */
+		inline Quaternion conj() const
+		{
+			return Quaternion(w, -x, -y, -z);
+		}
+
+		inline DOUBLE dot(const Quaternion &q) const
+		{
+			return w * q.w + x * q.x + y * q.y + z * q.z;
+		}
+	};
+
+	/** Angle (in degrees) of the rotation that takes q1 to q2
+	 */
+	inline DOUBLE quaternionAngularDistance(const Quaternion &q1, const Quaternion &q2)
+	{
+		DOUBLE d = ABS(q1.dot(q2));
+		return RAD2DEG(2. * acos(XMIPP_MIN(d, 1.)));
+	}
+
+	/** Mean angle (in degrees) between the X, Y and Z axes of two orientations, given their relative rotation q
+	 *
+	 * For q = q1 * q2.conj() this is the "distance based on Euler axes" of HealpixSampling::calculateAngularDistance:
+	 * the axes are the rows of the Euler matrices, and their dot products are the diagonal of the matrix of q.
+	 */
+	inline DOUBLE quaternionAxesDistance(const Quaternion &q)
+	{
+		DOUBLE xx = 2. * q.x * q.x, yy = 2. * q.y * q.y, zz = 2. * q.z * q.z;
+		return (ACOSD(CLIP(1. - yy - zz, -1., 1.)) + ACOSD(CLIP(1. - xx - zz, -1., 1.)) + ACOSD(CLIP(1. - xx - yy, -1., 1.))) / 3.;
+	}
+
+	/** Quaternion of the Euler matrix of (rot, tilt, psi) (in degrees), see Euler_angles2matrix
+	 *
+	 * This needs 3 sines and cosines of half angles and no matrix.
+	 */
+	Quaternion eulerToQuaternion(DOUBLE rot, DOUBLE tilt, DOUBLE psi);
+
+	/** Euler angles (in degrees) of the rotation q, as Euler_matrix2angles
+	 */
+	void quaternionToEuler(const Quaternion &q, DOUBLE &rot, DOUBLE &tilt, DOUBLE &psi);
+
+	/** Many quaternions, stored as a structure of arrays
+	 *
+	 * The batched functions below loop over the components with unit stride, so that the compiler can vectorise them.
+	 */
+	class QuaternionArray
+	{
+	public:
+		std::vector<DOUBLE> w, x, y, z;
+
+		long int size() const
+		{
+			return w.size();
+		}
+
+		void resize(long int n)
+		{
+			w.resize(n);
+			x.resize(n);
+			y.resize(n);
+			z.resize(n);
+		}
+
+		void set(long int i, const Quaternion &q)
+		{
+			w[i] = q.w;
+			x[i] = q.x;
+			y[i] = q.y;
+			z[i] = q.z;
+		}
+
+		Quaternion get(long int i) const
+		{
+			return Quaternion(w[i], x[i], y[i], z[i]);
+		}
+	};
+
+	/** Quaternions of n Euler angle triplets (in degrees); q is resized to n
+	 */
+	void eulerToQuaternions(const DOUBLE *rot, const DOUBLE *tilt, const DOUBLE *psi, long int n, QuaternionArray &q);
+
+	/** Euler angles (in degrees) of all quaternions in q
+	 */
+	void quaternionsToEuler(const QuaternionArray &q, DOUBLE *rot, DOUBLE *tilt, DOUBLE *psi);
+
+	/** qout[i] = qL * q[i] * qR for all i (qout may be q)
+	 */
+	void transformQuaternions(const Quaternion &qL, const QuaternionArray &q, const Quaternion &qR, QuaternionArray &qout);
+
+	/** out[i] = ABS(q0.dot(q[i])): the cosine of half the angle between q0 and each q[i]
+	 */
+	void quaternionAbsDots(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out);
+
+	/** out[i] = quaternionAngularDistance(q0, q[i]) (in degrees)
+	 */
+	void quaternionAngularDistances(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out);
+
+	/** out[i] = quaternionAxesDistance(q0 * q[i].conj()) (in degrees)
+	 */
+	void quaternionAxesDistances(const Quaternion &q0, const QuaternionArray &q, DOUBLE *out);
+
+	/** Unit direction vectors (x, y, z) of n (rot, tilt) pairs (in degrees), as Euler_angles2direction
+	 */
+	void eulerToDirections(const DOUBLE *rot, const DOUBLE *tilt, long int n, DOUBLE *x, DOUBLE *y, DOUBLE *z);
+	//@}
+}
+
+#endif
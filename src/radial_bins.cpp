@@ -0,0 +1,259 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <list>
+#include <mutex>
+#include "src/radial_bins.h"
+
+// Number of shell maps kept in memory, and the default memory for them
+#define SHELL_MAP_CACHE_SIZE 8
+#define SHELL_MAP_CACHE_BYTES ((size_t)64 << 20)
+
+namespace relion
+{
+	// Cached maps, most recently used first
+	static std::list< std::shared_ptr<const ShellIndexMap> > shell_map_cache;
+	static size_t shell_map_cache_bytes = 0, shell_map_cache_budget = SHELL_MAP_CACHE_BYTES;
+	static std::mutex shell_map_mutex;
+
+	static size_t getMapBytes(const ShellIndexMap &map)
+	{
+		return NZYXSIZE(map.shell) * sizeof(short);
+	}
+
+	// Remove the least recently used maps until they fit into the budget (call with shell_map_mutex locked)
+	static void shrinkShellMapCache()
+	{
+		while (!shell_map_cache.empty() &&
+			(shell_map_cache.size() > SHELL_MAP_CACHE_SIZE || shell_map_cache_bytes > shell_map_cache_budget))
+		{
+			shell_map_cache_bytes -= getMapBytes(*shell_map_cache.back());
+			shell_map_cache.pop_back();
+		}
+	}
+
+	// Cached map with the parameters of key, moved to the front of the cache (call with shell_map_mutex locked)
+	static std::shared_ptr<const ShellIndexMap> findShellMap(const ShellIndexMap &key)
+	{
+		for (std::list< std::shared_ptr<const ShellIndexMap> >::iterator it = shell_map_cache.begin(); it != shell_map_cache.end(); it++)
+		{
+			const ShellIndexMap &map = **it;
+			if (map.layout == key.layout && map.zdim == key.zdim && map.ydim == key.ydim && map.xdim == key.xdim &&
+				map.zinit == key.zinit && map.yinit == key.yinit && map.xinit == key.xinit &&
+				map.nr_shells == key.nr_shells && map.max_r2 == key.max_r2 && map.padding_factor == key.padding_factor)
+			{
+				shell_map_cache.splice(shell_map_cache.begin(), shell_map_cache, it);
+				return shell_map_cache.front();
+			}
+		}
+		return std::shared_ptr<const ShellIndexMap>();
+	}
+
+	void ShellIndexMap::setCacheBudget(size_t max_bytes)
+	{
+		std::unique_lock<std::mutex> lock(shell_map_mutex);
+		shell_map_cache_budget = max_bytes;
+		shrinkShellMapCache();
+	}
+
+	void ShellIndexMap::clearCache()
+	{
+		std::unique_lock<std::mutex> lock(shell_map_mutex);
+		shell_map_cache.clear();
+		shell_map_cache_bytes = 0;
+	}
+
+	std::shared_ptr<const ShellIndexMap> ShellIndexMap::get(Layout layout, long int zdim, long int ydim, long int xdim,
+		long int zinit, long int yinit, long int xinit, int nr_shells, long int max_r2, int padding_factor)
+	{
+		if (nr_shells < 0 || nr_shells > 32767)
+			REPORT_ERROR("ShellIndexMap::get: number of shells does not fit in the map");
+		if (padding_factor < 1)
+			REPORT_ERROR("ShellIndexMap::get: padding factor should be at least 1");
+		if (layout == FFTW_LAYOUT)
+			zinit = yinit = xinit = 0;
+		if (max_r2 < 0)
+			max_r2 = -1;
+
+		std::shared_ptr<ShellIndexMap> map(new ShellIndexMap());
+		map->layout = layout;
+		map->zdim = zdim;
+		map->ydim = ydim;
+		map->xdim = xdim;
+		map->zinit = zinit;
+		map->yinit = yinit;
+		map->xinit = xinit;
+		map->nr_shells = nr_shells;
+		map->max_r2 = max_r2;
+		map->padding_factor = padding_factor;
+
+		std::unique_lock<std::mutex> lock(shell_map_mutex);
+		std::shared_ptr<const ShellIndexMap> cached = findShellMap(*map);
+		if (cached)
+			return cached;
+		lock.unlock();
+
+		map->calculate();
+
+		// Maps that are still in use are kept alive by their users when they drop out of the cache
+		lock.lock();
+		cached = findShellMap(*map);
+		if (cached)
+			return cached; // meanwhile calculated by another thread
+		if (getMapBytes(*map) <= shell_map_cache_budget)
+		{
+			shell_map_cache.push_front(map);
+			shell_map_cache_bytes += getMapBytes(*map);
+			shrinkShellMapCache();
+		}
+		return map;
+	}
+
+	void ShellIndexMap::calculate()
+	{
+		MemoryCategoryScope memory_category(MEMORY_SHELL_MAPS);
+		shell.resize(zdim, ydim, xdim);
+		short *s = MULTIDIM_ARRAY(shell);
+		for (long int k = 0; k < zdim; k++)
+		{
+			long int kp = (layout == FFTW_LAYOUT) ? ((k < xdim) ? k : k - zdim) : zinit + k;
+			for (long int i = 0; i < ydim; i++)
+			{
+				long int ip = (layout == FFTW_LAYOUT) ? ((i < xdim) ? i : i - ydim) : yinit + i;
+				for (long int j = 0; j < xdim; j++, s++)
+				{
+					long int jp = (layout == FFTW_LAYOUT) ? j : xinit + j;
+					long int r2 = kp * kp + ip * ip + jp * jp;
+					long int idx = ROUND(sqrt((DOUBLE)r2) / padding_factor);
+					*s = ((max_r2 >= 0 && r2 >= max_r2) || idx >= nr_shells) ? -1 : (short)idx;
+				}
+			}
+		}
+	}
+
+	void ShellSums::compute(const ShellIndexMap &map, const MultidimArray<Complex> &F1, const MultidimArray<Complex> *F2,
+		bool do_abs, int nr_threads)
+	{
+		if (!map.fits(F1) || (F2 != NULL && !F1.sameShape(*F2)))
+			REPORT_ERROR("ShellSums::compute: arrays do not have the shape of the shell map");
+
+		long int nr_shells = map.nr_shells;
+		count.initZeros(nr_shells);
+		sum_abs1.initZeros(nr_shells);
+		sum_norm1.initZeros(nr_shells);
+		sum_norm2.initZeros(nr_shells);
+		sum_cross.initZeros(nr_shells);
+		if (nr_shells == 0)
+			return;
+
+		nr_threads = XMIPP_MAX(1, nr_threads);
+		long int nr_elems = NZYXSIZE(F1);
+		const short *shell = MULTIDIM_ARRAY(map.shell);
+		const Complex *f1 = MULTIDIM_ARRAY(F1);
+		const Complex *f2 = (F2 != NULL) ? MULTIDIM_ARRAY(*F2) : NULL;
+
+		// Thread-private sums: count, |F1|, |F1|^2, |F2|^2 and cross term for every shell
+		std::vector<DOUBLE> partial(5 * nr_shells * nr_threads, 0.);
+#pragma omp parallel for num_threads(nr_threads)
+		for (int thread = 0; thread < nr_threads; thread++)
+		{
+			DOUBLE *c = &partial[5 * nr_shells * thread];
+			DOUBLE *a1 = c + nr_shells;
+			DOUBLE *n1 = a1 + nr_shells;
+			DOUBLE *n2 = n1 + nr_shells;
+			DOUBLE *x12 = n2 + nr_shells;
+			long int first = nr_elems * thread / nr_threads;
+			long int last = nr_elems * (thread + 1) / nr_threads;
+			for (long int n = first; n < last; n++)
+			{
+				int s = shell[n];
+				if (s < 0)
+					continue;
+				Complex z1 = f1[n];
+				c[s] += 1.;
+				n1[s] += norm(z1);
+				if (do_abs)
+					a1[s] += abs(z1);
+				if (f2 != NULL)
+				{
+					Complex z2 = f2[n];
+					n2[s] += norm(z2);
+					x12[s] += (conj(z1) * z2).real;
+				}
+			}
+		}
+
+		for (int thread = 0; thread < nr_threads; thread++)
+		{
+			const DOUBLE *c = &partial[5 * nr_shells * thread];
+			for (long int s = 0; s < nr_shells; s++)
+			{
+				DIRECT_A1D_ELEM(count, s) += c[s];
+				DIRECT_A1D_ELEM(sum_abs1, s) += c[nr_shells + s];
+				DIRECT_A1D_ELEM(sum_norm1, s) += c[2 * nr_shells + s];
+				DIRECT_A1D_ELEM(sum_norm2, s) += c[3 * nr_shells + s];
+				DIRECT_A1D_ELEM(sum_cross, s) += c[4 * nr_shells + s];
+			}
+		}
+	}
+
+	void ShellSums::getFSC(MultidimArray<DOUBLE> &fsc) const
+	{
+		fsc.initZeros(sum_cross);
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc)
+		{
+			DOUBLE den = DIRECT_A1D_ELEM(sum_norm1, i) * DIRECT_A1D_ELEM(sum_norm2, i);
+			if (den > 0.)
+				DIRECT_A1D_ELEM(fsc, i) = DIRECT_A1D_ELEM(sum_cross, i) / sqrt(den);
+		}
+	}
+
+	void multiplyByShellValues(const ShellIndexMap &map, MultidimArray<Complex> &F, const MultidimArray<DOUBLE> &values,
+		int nr_threads)
+	{
+		if (!map.fits(F))
+			REPORT_ERROR("multiplyByShellValues: array does not have the shape of the shell map");
+		long int nr_values = XSIZE(values);
+		if (nr_values == 0)
+			return;
+
+		const short *shell = MULTIDIM_ARRAY(map.shell);
+		Complex *f = MULTIDIM_ARRAY(F);
+		const DOUBLE *v = MULTIDIM_ARRAY(values);
+		long int nr_elems = NZYXSIZE(F);
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int n = 0; n < nr_elems; n++)
+		{
+			int s = shell[n];
+			if (s >= 0)
+				f[n] *= v[XMIPP_MIN(s, nr_values - 1)];
+		}
+	}
+
+	void getSquaredRadiusShells(long int max_r2, bool rounding, std::vector<int> &shell_of_r2)
+	{
+		shell_of_r2.resize(max_r2 + 1);
+		for (long int r2 = 0; r2 <= max_r2; r2++)
+		{
+			DOUBLE r = sqrt((DOUBLE)r2);
+			shell_of_r2[r2] = rounding ? (int)ROUND(r) : (int)floor(r);
+		}
+	}
+}
@@ -0,0 +1,125 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef RADIAL_BINS_H
+#define RADIAL_BINS_H
+
+#include <vector>
+#include <memory>
+#include "src/multidim_array.h"
+#include "src/complex.h"
+
+namespace relion
+{
+	/** Radial bin of every element of an array in Fourier space
+	 *
+	 * shell[n] is ROUND(sqrt(kp*kp + ip*ip + jp*jp) / padding_factor) for element n (in direct order) of an array of the
+	 * mapped shape, or -1 if that element is outside the map: at r2 >= max_r2 (if max_r2 >= 0), or in a shell >= nr_shells.
+	 * With a padding_factor, the map of a padded transform gives the shells of the original size.
+	 * (kp, ip, jp) are the frequencies of FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM for FFTW_LAYOUT, and the logical indices of
+	 * FOR_ALL_ELEMENTS_IN_ARRAY3D for LOGICAL_LAYOUT (i.e. for centered transforms such as the ones of the BackProjector).
+	 *
+	 * Maps are only calculated once for every shape: get() returns a cached one if possible.
+	 * At a cost of 2 bytes per element, this takes the sqrt out of all later passes over arrays of that shape.
+	 * The maps are accounted to MEMORY_SHELL_MAPS (see setMemoryTracking).
+	 */
+	class ShellIndexMap
+	{
+	public:
+		enum Layout { FFTW_LAYOUT, LOGICAL_LAYOUT };
+
+		Layout layout;
+		long int zdim, ydim, xdim;
+		long int zinit, yinit, xinit; // logical origin (for LOGICAL_LAYOUT)
+		long int max_r2;
+		int nr_shells;
+		int padding_factor;
+		MultidimArray<short> shell;
+
+		/** Map for arrays of the shape (and for LOGICAL_LAYOUT: the origin) of F
+		 * nr_shells should be at most 32767 and max_r2 = -1 does not limit the radius.
+		 */
+		template<typename T>
+		static std::shared_ptr<const ShellIndexMap> get(const MultidimArray<T> &F, Layout layout, int nr_shells,
+			long int max_r2 = -1, int padding_factor = 1)
+		{
+			return get(layout, ZSIZE(F), YSIZE(F), XSIZE(F), STARTINGZ(F), STARTINGY(F), STARTINGX(F), nr_shells, max_r2, padding_factor);
+		}
+
+		static std::shared_ptr<const ShellIndexMap> get(Layout layout, long int zdim, long int ydim, long int xdim,
+			long int zinit, long int yinit, long int xinit, int nr_shells, long int max_r2 = -1, int padding_factor = 1);
+
+		/** Memory for the cached maps (default 64 MB); maps that do not fit are calculated on every call
+		 * A budget of 0 switches the cache off.
+		 */
+		static void setCacheBudget(size_t max_bytes);
+
+		/** Remove all maps from the cache
+		 * Maps that are still in use are only freed by their last user.
+		 */
+		static void clearCache();
+
+		/// Check that F has the shape of this map
+		template<typename T>
+		bool fits(const MultidimArray<T> &F) const
+		{
+			return NSIZE(F) == 1 && ZSIZE(F) == zdim && YSIZE(F) == ydim && XSIZE(F) == xdim;
+		}
+
+	private:
+		void calculate();
+	};
+
+	/** Sums over the shells of a ShellIndexMap
+	 *
+	 * One pass over one or two Fourier transforms gives the number of elements, the summed power |F1|^2 and |F2|^2,
+	 * the summed cross term Re(conj(F1) * F2) and (optionally) the summed amplitude |F1| of all shells,
+	 * i.e. everything needed for spectra and Fourier shell correlations.
+	 * Each thread sums a contiguous part of the array, and the partial sums are added in a fixed order,
+	 * so that the results do not depend on the scheduling (with nr_threads = 1 they are those of a plain loop).
+	 */
+	class ShellSums
+	{
+	public:
+		MultidimArray<DOUBLE> count, sum_abs1, sum_norm1, sum_norm2, sum_cross;
+
+		/** Sum F1 (and F2, if not NULL) over all shells of map
+		 * sum_abs1 is only calculated if do_abs, and sum_norm2 and sum_cross only with F2.
+		 */
+		void compute(const ShellIndexMap &map, const MultidimArray<Complex> &F1, const MultidimArray<Complex> *F2 = NULL,
+			bool do_abs = false, int nr_threads = 1);
+
+		/// Fourier shell correlation from the sums of two transforms (0 for shells without power)
+		void getFSC(MultidimArray<DOUBLE> &fsc) const;
+	};
+
+	/** Multiply every element of F by the value of its shell
+	 * Elements in shells beyond the end of values get the last value, elements outside the map are left untouched.
+	 */
+	void multiplyByShellValues(const ShellIndexMap &map, MultidimArray<Complex> &F, const MultidimArray<DOUBLE> &values,
+		int nr_threads = 1);
+
+	/** Radial bin of every squared distance up to max_r2 in real space
+	 * shell_of_r2[r2] is ROUND(sqrt(r2)) if rounding, and floor(sqrt(r2)) otherwise (as in radialAverage()).
+	 */
+	void getSquaredRadiusShells(long int max_r2, bool rounding, std::vector<int> &shell_of_r2);
+}
+
+#endif
@@ -0,0 +1,208 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/random.h"
+#include "src/thread_pool.h"
+
+namespace relion
+{
+	// Philox4x32 constants
+	#define PHILOX_M0 0xD2511F53U
+	#define PHILOX_M1 0xCD9E8D57U
+	#define PHILOX_W0 0x9E3779B9U
+	#define PHILOX_W1 0xBB67AE85U
+
+	// Blocks are made this many at a time, with loops the compiler can vectorise
+	#define PHILOX_LANES 16
+
+	/* The blocks counter ... counter + nr - 1 (nr <= PHILOX_LANES) of a stream, into out (4 numbers per block)
+	 * The counter is the low half, the stream the high half of the 128-bit Philox counter; the seed is the key.
+	 */
+	static void philoxBlocks(unsigned long long seed, unsigned long long stream, unsigned long long counter, int nr, unsigned int *out)
+	{
+		unsigned int c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+		for (int l = 0; l < PHILOX_LANES; l++)
+		{
+			unsigned long long c = counter + l;
+			c0[l] = (unsigned int)c;
+			c1[l] = (unsigned int)(c >> 32);
+			c2[l] = (unsigned int)stream;
+			c3[l] = (unsigned int)(stream >> 32);
+		}
+		unsigned int k0 = (unsigned int)seed, k1 = (unsigned int)(seed >> 32);
+		for (int round = 0; round < 10; round++)
+		{
+			for (int l = 0; l < PHILOX_LANES; l++)
+			{
+				unsigned long long p0 = (unsigned long long)PHILOX_M0 * c0[l];
+				unsigned long long p1 = (unsigned long long)PHILOX_M1 * c2[l];
+				unsigned int n0 = (unsigned int)(p1 >> 32) ^ c1[l] ^ k0;
+				unsigned int n2 = (unsigned int)(p0 >> 32) ^ c3[l] ^ k1;
+				c0[l] = n0;
+				c1[l] = (unsigned int)p1;
+				c2[l] = n2;
+				c3[l] = (unsigned int)p0;
+			}
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+		for (int l = 0; l < nr; l++)
+		{
+			out[4 * l] = c0[l];
+			out[4 * l + 1] = c1[l];
+			out[4 * l + 2] = c2[l];
+			out[4 * l + 3] = c3[l];
+		}
+	}
+
+	// Uniform in [0, 1) and (0, 1] from the upper 24 bits
+	static inline double getUniform(unsigned int x)
+	{
+		return (x >> 8) * (1. / 16777216.);
+	}
+
+	static inline double getUniformNonZero(unsigned int x)
+	{
+		return ((x >> 8) + 1) * (1. / 16777216.);
+	}
+
+	// Box-Muller: two Gaussian numbers from two uniform ones
+	static inline void getGaussians(unsigned int x0, unsigned int x1, double &g0, double &g1)
+	{
+		double r = sqrt(-2. * log(getUniformNonZero(x0)));
+		double phi = 2. * PI * getUniform(x1);
+		g0 = r * cos(phi);
+		g1 = r * sin(phi);
+	}
+
+	RandomGenerator::RandomGenerator(unsigned long long _seed, unsigned long long _stream)
+	{
+		setSeed(_seed, _stream);
+	}
+
+	void RandomGenerator::setSeed(unsigned long long _seed, unsigned long long _stream)
+	{
+		seed = _seed;
+		stream = _stream;
+		setPosition(0);
+	}
+
+	void RandomGenerator::setPosition(unsigned long long n)
+	{
+		counter = n / 4;
+		nr_left = 0;
+		has_gaussian = false;
+		if (n % 4 != 0)
+		{
+			nextBlock();
+			nr_left = 4 - n % 4;
+		}
+	}
+
+	void RandomGenerator::nextBlock()
+	{
+		getBlock(seed, stream, counter++, block);
+		nr_left = 4;
+	}
+
+	void RandomGenerator::getBlock(unsigned long long seed, unsigned long long stream, unsigned long long counter, unsigned int *out)
+	{
+		philoxBlocks(seed, stream, counter, 1, out);
+	}
+
+	DOUBLE RandomGenerator::uniform(DOUBLE a, DOUBLE b)
+	{
+		return a + (b - a) * getUniform(nextInt());
+	}
+
+	DOUBLE RandomGenerator::gaussian(DOUBLE mu, DOUBLE sigma)
+	{
+		if (has_gaussian)
+		{
+			has_gaussian = false;
+			return mu + sigma * next_gaussian;
+		}
+		// Use numbers 2m and 2m + 1
+		if (nr_left % 2 != 0)
+			nextInt();
+		unsigned int x0 = nextInt();
+		unsigned int x1 = nextInt();
+		double g0;
+		getGaussians(x0, x1, g0, next_gaussian);
+		has_gaussian = true;
+		return mu + sigma * g0;
+	}
+
+	// Elements first ... first + count - 1 of v come from numbers at the same positions in the stream
+	static void fillRandomRange(DOUBLE *v, long int first, long int count, bool is_gaussian, DOUBLE a, DOUBLE b,
+		unsigned long long seed, unsigned long long stream)
+	{
+		unsigned int numbers[4 * PHILOX_LANES];
+		long int last = first + count;
+		for (long int block_start = first - first % (4 * PHILOX_LANES); block_start < last; block_start += 4 * PHILOX_LANES)
+		{
+			philoxBlocks(seed, stream, block_start / 4, PHILOX_LANES, numbers);
+			long int n0 = XMIPP_MAX(first, block_start), n1 = XMIPP_MIN(last, block_start + 4 * PHILOX_LANES);
+			if (is_gaussian)
+			{
+				for (long int n = n0 - n0 % 2; n < n1; n += 2)
+				{
+					double g0, g1;
+					getGaussians(numbers[n - block_start], numbers[n - block_start + 1], g0, g1);
+					if (n >= n0)
+						v[n] = a + b * g0;
+					if (n + 1 < n1)
+						v[n + 1] = a + b * g1;
+				}
+			}
+			else
+			{
+				for (long int n = n0; n < n1; n++)
+					v[n] = a + (b - a) * getUniform(numbers[n - block_start]);
+			}
+		}
+	}
+
+	static void fillRandom(MultidimArray<DOUBLE> &v, bool is_gaussian, DOUBLE a, DOUBLE b, unsigned long long seed,
+		unsigned long long stream, int nr_threads)
+	{
+		long int size = MULTIDIM_SIZE(v);
+		if (size == 0)
+			return;
+		nr_threads = getTaskNrThreads(nr_threads);
+		long int chunk = 4096;
+		long int nr_chunks = (size + chunk - 1) / chunk;
+#pragma omp parallel for num_threads(nr_threads)
+		for (long int c = 0; c < nr_chunks; c++)
+			fillRandomRange(MULTIDIM_ARRAY(v), c * chunk, XMIPP_MIN(chunk, size - c * chunk), is_gaussian, a, b, seed, stream);
+	}
+
+	void fillRandomUniform(MultidimArray<DOUBLE> &v, DOUBLE a, DOUBLE b, unsigned long long seed, unsigned long long stream,
+		int nr_threads)
+	{
+		fillRandom(v, false, a, b, seed, stream, nr_threads);
+	}
+
+	void fillRandomGaussian(MultidimArray<DOUBLE> &v, DOUBLE mu, DOUBLE sigma, unsigned long long seed, unsigned long long stream,
+		int nr_threads)
+	{
+		fillRandom(v, true, mu, sigma, seed, stream, nr_threads);
+	}
+}
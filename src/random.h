@@ -0,0 +1,97 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include "src/multidim_array.h"
+
+namespace relion
+{
+	/** Counter-based random numbers (Philox4x32-10, Salmon et al., SC 2011)
+	 *
+	 * Unlike rnd_unif and rnd_gaus, which share the state of rand(), a RandomGenerator has no hidden state: number n
+	 * of stream (seed, stream) is a fixed function of seed, stream and n. Every thread (or better: every particle,
+	 * class, ...) can have its own stream, so parallel code gets the same random numbers whatever the number of
+	 * threads or their scheduling. A generator is 48 bytes and cheap to make.
+	 *
+	 * @code
+	 * #pragma omp parallel for num_threads(nr_threads)
+	 * for (long int ipart = 0; ipart < nr_particles; ipart++)
+	 * {
+	 *     RandomGenerator rng(seed, ipart);
+	 *     DOUBLE shift = rng.gaussian(0., sigma);
+	 * }
+	 * @endcode
+	 */
+	class RandomGenerator
+	{
+	public:
+		RandomGenerator(unsigned long long seed = 0, unsigned long long stream = 0);
+
+		/// Start at number 0 of stream (seed, stream)
+		void setSeed(unsigned long long seed, unsigned long long stream = 0);
+
+		/// Continue at number n (of 32 bits) of the stream
+		void setPosition(unsigned long long n);
+
+		/// The next 32 random bits
+		unsigned int nextInt()
+		{
+			if (nr_left == 0)
+				nextBlock();
+			return block[4 - nr_left--];
+		}
+
+		/// Uniform random number in [a, b)
+		DOUBLE uniform(DOUBLE a = 0., DOUBLE b = 1.);
+
+		/** Gaussian random number (Box-Muller on two uniform numbers)
+		 * Started at position 0, the k-th call gives element k of fillRandomGaussian with the same seed and stream.
+		 */
+		DOUBLE gaussian(DOUBLE mu = 0., DOUBLE sigma = 1.);
+
+		/// The four 32-bit numbers of block number counter (numbers 4 * counter ... 4 * counter + 3) of a stream
+		static void getBlock(unsigned long long seed, unsigned long long stream, unsigned long long counter, unsigned int *out);
+
+	private:
+		unsigned long long seed, stream, counter;
+		unsigned int block[4];
+		int nr_left;
+		bool has_gaussian;
+		double next_gaussian;
+
+		void nextBlock();
+	};
+
+	/** Fill v with uniform random numbers in [a, b)
+	 * Element n is number n of stream (seed, stream), whatever nr_threads.
+	 */
+	void fillRandomUniform(MultidimArray<DOUBLE> &v, DOUBLE a, DOUBLE b, unsigned long long seed, unsigned long long stream = 0,
+		int nr_threads = 1);
+
+	/** Fill v with Gaussian random numbers with mean mu and standard deviation sigma
+	 * Elements 2m and 2m + 1 come from numbers 2m and 2m + 1 of stream (seed, stream), whatever nr_threads.
+	 */
+	void fillRandomGaussian(MultidimArray<DOUBLE> &v, DOUBLE mu, DOUBLE sigma, unsigned long long seed, unsigned long long stream = 0,
+		int nr_threads = 1);
+}
+
+#endif
@@ -0,0 +1,129 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/rotated_reference_cache.h"
+#include "src/thread_pool.h"
+
+namespace relion
+{
+	RotatedReferenceCache::RotatedReferenceCache()
+	{
+		clear();
+	}
+
+	void RotatedReferenceCache::clear()
+	{
+		nr_references = nr_rotations = current_size = 0;
+		nr_points = 0;
+		row_index.clear();
+		row_length.clear();
+		row_start.clear();
+		packed.clear();
+	}
+
+	void RotatedReferenceCache::initialise(const std::vector<Projector*> &references, const DOUBLE *A, int nr_A, bool inv,
+		int _current_size, int nr_threads)
+	{
+		clear();
+		if (references.size() == 0 || nr_A <= 0)
+			return;
+
+		nr_references = references.size();
+		nr_rotations = nr_A;
+		current_size = _current_size;
+		long int xdim = current_size / 2 + 1;
+		long int ydim = current_size;
+
+		// The same points as rotate2D fills (all references should have the same r_max)
+		int r_max = references[0]->r_max;
+		for (int iref = 0; iref < nr_references; iref++)
+		{
+			if (references[iref]->ref_dim != 2)
+				REPORT_ERROR("RotatedReferenceCache::initialise%%ERROR: the references should be 2D");
+			if (references[iref]->r_max != r_max)
+				REPORT_ERROR("RotatedReferenceCache::initialise%%ERROR: all references should have the same r_max");
+		}
+		int my_r_max = XMIPP_MIN(r_max, xdim - 1);
+		int max_r2 = my_r_max * my_r_max;
+		for (int i = 0; i < ydim; i++)
+		{
+			int y;
+			if (i <= my_r_max)
+				y = i;
+			else if (i >= ydim - my_r_max)
+				y = i - ydim;
+			else
+				continue;
+			int nx = 0;
+			while (nx <= my_r_max && nx * nx + y * y <= max_r2)
+				nx++;
+			if (nx == 0)
+				continue;
+			row_index.push_back(i);
+			row_length.push_back(nx);
+			row_start.push_back(nr_points);
+			nr_points += nx;
+		}
+
+		packed.resize((long int)nr_references * nr_rotations * nr_points);
+
+		nr_threads = getTaskNrThreads(nr_threads);
+		long int nr_jobs = (long int)nr_references * nr_rotations;
+#pragma omp parallel num_threads(nr_threads)
+		{
+			MultidimArray<Complex > f2d;
+			Matrix2D<DOUBLE> Ai(3, 3);
+#pragma omp for schedule(dynamic)
+			for (long int job = 0; job < nr_jobs; job++)
+			{
+				int iref = job / nr_rotations;
+				int irot = job % nr_rotations;
+				for (int r = 0; r < 3; r++)
+					for (int c = 0; c < 3; c++)
+						MAT_ELEM(Ai, r, c) = A[9 * irot + 3 * r + c];
+				f2d.initZeros(ydim, xdim);
+				references[iref]->rotate2D(f2d, Ai, inv);
+				packImage(f2d, &packed[job * nr_points]);
+			}
+		}
+	}
+
+	void RotatedReferenceCache::getRotated(int iref, int irot, MultidimArray<Complex > &f2d) const
+	{
+		f2d.initZeros(current_size, current_size / 2 + 1);
+		unpackImage(getPacked(iref, irot), f2d);
+	}
+
+	void RotatedReferenceCache::packImage(const MultidimArray<Complex > &f2d, Complex *out) const
+	{
+		if (YSIZE(f2d) != current_size || XSIZE(f2d) != current_size / 2 + 1)
+			REPORT_ERROR("RotatedReferenceCache::packImage%%ERROR: the image does not have the size of the cache");
+		for (size_t irow = 0; irow < row_index.size(); irow++)
+			memcpy(out + row_start[irow], &DIRECT_A2D_ELEM(f2d, row_index[irow], 0), row_length[irow] * sizeof(Complex));
+	}
+
+	void RotatedReferenceCache::unpackImage(const Complex *in, MultidimArray<Complex > &f2d) const
+	{
+		if (YSIZE(f2d) != current_size || XSIZE(f2d) != current_size / 2 + 1)
+			REPORT_ERROR("RotatedReferenceCache::unpackImage%%ERROR: the image does not have the size of the cache");
+		for (size_t irow = 0; irow < row_index.size(); irow++)
+			memcpy(&DIRECT_A2D_ELEM(f2d, row_index[irow], 0), in + row_start[irow], row_length[irow] * sizeof(Complex));
+	}
+}
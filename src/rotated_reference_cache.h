@@ -0,0 +1,109 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef ROTATED_REFERENCE_CACHE_H
+#define ROTATED_REFERENCE_CACHE_H
+
+#include <vector>
+#include "src/projector.h"
+
+namespace relion
+{
+	/** In-plane rotations of 2D references, computed once (e.g. per iteration) instead of once per particle
+	 *
+	 * Projector::rotate2D interpolates the whole reference for every in-plane angle of every particle, while the
+	 * rotated references are the same for all particles of an iteration. The cache rotates every reference for every
+	 * rotation once, in parallel, and keeps only the points within r_max (row by row, in the order rotate2D fills them).
+	 * It costs getMemorySize() bytes: about nr_refs * nr_rotations * 1.6 r_max^2 complex numbers.
+	 *
+	 * getRotated() gives exactly the image rotate2D would have made. To compare images with the rotated references
+	 * without unpacking, pack the images once with packImage() and compare them point by point with getPacked().
+	 *
+	 * @code
+	 * RotatedReferenceCache cache;
+	 * cache.initialise(references, A, nr_psi, false, current_size, nr_threads); // A: nr_psi row-major 3x3 matrices
+	 * cache.packImage(Fimg, Fimg_packed);
+	 * for (int iref ...) for (int ipsi ...)
+	 *     diff2 += ... cache.getPacked(iref, ipsi)[n] - Fimg_packed[n] ...
+	 * @endcode
+	 */
+	class RotatedReferenceCache
+	{
+	public:
+		RotatedReferenceCache();
+
+		void clear();
+
+		/** Rotate all 2D references by all nr_A rotations (row-major 3x3 matrices, as in Projector::projectBatch)
+		 * The rotated images are current_size x (current_size / 2 + 1) Fourier transforms, as passed to rotate2D.
+		 */
+		void initialise(const std::vector<Projector*> &references, const DOUBLE *A, int nr_A, bool inv, int current_size,
+			int nr_threads = 1);
+
+		int getNrReferences() const
+		{
+			return nr_references;
+		}
+
+		int getNrRotations() const
+		{
+			return nr_rotations;
+		}
+
+		/// The number of points stored of each rotated reference
+		long int getNrPoints() const
+		{
+			return nr_points;
+		}
+
+		/// The memory used by the cache in bytes
+		long int getMemorySize() const
+		{
+			return packed.size() * sizeof(Complex);
+		}
+
+		/// The getNrPoints() stored points of reference iref rotated by rotation irot
+		const Complex* getPacked(int iref, int irot) const
+		{
+			return &packed[((long int)iref * nr_rotations + irot) * nr_points];
+		}
+
+		/// Reference iref rotated by rotation irot, as Projector::rotate2D would give it (f2d is resized and zeroed)
+		void getRotated(int iref, int irot, MultidimArray<Complex > &f2d) const;
+
+		/// The points of a current_size Fourier transform in the order of getPacked() (out holds getNrPoints() points)
+		void packImage(const MultidimArray<Complex > &f2d, Complex *out) const;
+
+		/// Inverse of packImage (the points of f2d that are not stored are not changed)
+		void unpackImage(const Complex *in, MultidimArray<Complex > &f2d) const;
+
+	private:
+		int nr_references, nr_rotations, current_size;
+		long int nr_points;
+
+		// Rows of the image that are stored: their index i in the image, number of points and first point
+		std::vector<int> row_index, row_length;
+		std::vector<long int> row_start;
+
+		std::vector<Complex> packed;
+	};
+}
+
+#endif
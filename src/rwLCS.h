@@ -0,0 +1,91 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+/*
+        Reading and writing of compressed stacks (see compressed_stack.h)
+        This file is included inside the Image class, like rwMRC.h
+*/
+
+#ifndef RWLCS_H
+#define RWLCS_H
+
+	/** Compressed stack reader
+	  * @ingroup LCS
+	*/
+	int readLCS(long int img_select)
+	{
+		CompressedStackFile stack;
+		stack.open(fimg, filename);
+
+		long int _nDim = stack.getStackSize();
+		replaceNsize = _nDim;
+		if (img_select >= _nDim)
+		{
+			std::stringstream Num, Num2;
+			Num << img_select;
+			Num2 << _nDim;
+			REPORT_ERROR((std::string)"readLCS: Image number " + Num.str() + " exceeds stack size " + Num2.str());
+		}
+
+		long int imgStart = (img_select == -1) ? 0 : img_select;
+		long int nr_images = (img_select == -1) ? _nDim : 1;
+		data.setDimensions(stack.getXdim(), stack.getYdim(), stack.getZdim(), nr_images);
+		offset = 0;
+		if (dataflag < 1)
+			return 0;
+
+		// The data cannot be mapped, they are always decompressed into memory
+		mmapOn = false;
+		data.coreAllocateReuse();
+		std::vector<float> page(nr_images * stack.getImageSize());
+		if (page.size() > 0)
+		{
+			stack.read(imgStart, nr_images, &page[0]);
+			castPage2T((char*)&page[0], MULTIDIM_ARRAY(data), Float, page.size(), 0);
+		}
+		return 0;
+	}
+
+	/** Compressed stack writer
+	  * The images are compressed without any loss. Images can be appended, but not replaced.
+	  * @ingroup LCS
+	*/
+	int writeLCS(long int img_select, int mode = WRITE_OVERWRITE)
+	{
+		if (mode == WRITE_REPLACE)
+			REPORT_ERROR("writeLCS: images in a compressed stack cannot be replaced");
+
+		CompressedStackFile stack;
+		if (mode == WRITE_APPEND && _exists)
+			stack.open(fimg, filename);
+		else
+			stack.create(fimg, filename, XSIZE(data), YSIZE(data), ZSIZE(data));
+
+		size_t datasize_n = NZYXSIZE(data);
+		std::vector<float> page(datasize_n);
+		if (datasize_n > 0)
+		{
+			castPage2Datatype(MULTIDIM_ARRAY(data), (char*)&page[0], Float, datasize_n);
+			stack.append(&page[0], NSIZE(data));
+		}
+		stack.close();
+		return 0;
+	}
+
+#endif
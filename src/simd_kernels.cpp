@@ -0,0 +1,127 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+// The AVX kernels
+#define SIMD_KERNEL(name) name##AVX
+#include "src/simd_kernels_impl.h"
+#undef SIMD_KERNEL
+
+namespace relion
+{
+	void ctfRowScalar(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out)
+	{
+		for (long int i = 0; i < n; i++)
+			out[i] = getCTFValue(p, u2[i], c2[i], s2[i]);
+	}
+
+	void phaseShiftRowScalar(const Complex *in, Complex *out, long int n, double phase0, double dphase)
+	{
+		for (long int j = 0; j < n; j++)
+		{
+			double a = cos(phase0 + j * dphase), b = sin(phase0 + j * dphase);
+			DOUBLE c = in[j].real, d = in[j].imag;
+			out[j] = Complex(a * c - b * d, a * d + b * c);
+		}
+	}
+
+	// The work buffer of the SIMD kernels is not needed here: the scalar kernel adds straight into out.
+	// It is kept in the signature so that all kernels fit the same SimdKernels slot.
+	void phaseGridRowScalar(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE * /*work*/, double *out)
+	{
+		for (long int j = 0; j < n; j++)
+		{
+			double rre = z_re[j], rim = z_im[j];
+			for (int ky = 0; ky < ny; ky++)
+			{
+				double qre = rre, qim = rim;
+				for (int kx = 0; kx < nx; kx++)
+				{
+					out[ky * nx + kx] += qre;
+					double t = qre * sx_re[j] - qim * sx_im[j];
+					qim = qre * sx_im[j] + qim * sx_re[j];
+					qre = t;
+				}
+				double t = rre * sy_re[j] - rim * sy_im[j];
+				rim = rre * sy_im[j] + rim * sy_re[j];
+				rre = t;
+			}
+		}
+	}
+
+	static SimdKernels makeSimdKernels(SimdLevel level)
+	{
+		SimdKernels kernels;
+		kernels.level = level;
+		switch (level)
+		{
+		case SIMD_SCALAR:
+			kernels.trilinear_row = trilinearRowScalar;
+			kernels.trilinear_row_bricked = trilinearRowBrickedScalar;
+			kernels.trilinear_row_half = trilinearRowHalfScalar;
+			kernels.ctf_row = ctfRowScalar;
+			kernels.phase_shift_row = phaseShiftRowScalar;
+			kernels.phase_grid_row = phaseGridRowScalar;
+			break;
+		case SIMD_AVX:
+			kernels.trilinear_row = trilinearRowAVX;
+			kernels.trilinear_row_bricked = NULL; // without gathers the row-major AVX kernel is faster
+			kernels.trilinear_row_half = trilinearRowHalfScalar;
+			kernels.ctf_row = ctfRowAVX;
+			kernels.phase_shift_row = phaseShiftRowAVX;
+			kernels.phase_grid_row = phaseGridRowAVX;
+			break;
+		case SIMD_AVX2:
+			kernels.trilinear_row = trilinearRowAVX2;
+			kernels.trilinear_row_bricked = trilinearRowBrickedAVX2;
+			kernels.trilinear_row_half = trilinearRowHalfAVX2;
+			kernels.ctf_row = ctfRowAVX2;
+			kernels.phase_shift_row = phaseShiftRowAVX2;
+			kernels.phase_grid_row = phaseGridRowAVX2;
+			break;
+		default:
+			kernels.trilinear_row = trilinearRowAVX512;
+			kernels.trilinear_row_bricked = trilinearRowBrickedAVX2;
+			kernels.trilinear_row_half = trilinearRowHalfAVX2;
+			kernels.ctf_row = ctfRowAVX512;
+			kernels.phase_shift_row = phaseShiftRowAVX512;
+			kernels.phase_grid_row = phaseGridRowAVX512;
+			break;
+		}
+		return kernels;
+	}
+
+	static SimdKernels& simdKernelTable()
+	{
+		// (thread-safe initialisation)
+		static SimdKernels kernels = makeSimdKernels(getSimdLevel());
+		return kernels;
+	}
+
+	const SimdKernels& getSimdKernels()
+	{
+		return simdKernelTable();
+	}
+
+	void updateSimdKernels()
+	{
+		simdKernelTable() = makeSimdKernels(getSimdLevel());
+	}
+}
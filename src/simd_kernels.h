@@ -0,0 +1,121 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include "src/complex.h"
+#include "src/macros.h"
+#include "src/cpu_features.h"
+#include "src/projector_kernels.h"
+
+namespace relion
+{
+	/** Everything the CTF of a frequency depends on, besides its terms u2, c2 and s2 (see CTF::getCTFs) */
+	struct CTFRowParams
+	{
+		DOUBLE K1, K2, K4, defocus_average, defocus_deviation;
+		DOUBLE cos2az, sin2az, rad_phaseshift, amplitude_phase, scale;
+		bool do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping;
+	};
+
+	// CTF value of one frequency (as CTF::getCTF)
+	inline DOUBLE getCTFValue(const CTFRowParams &p, DOUBLE u2, DOUBLE c2, DOUBLE s2)
+	{
+		DOUBLE deltaf = p.defocus_average + p.defocus_deviation * (c2 * p.cos2az + s2 * p.sin2az);
+		DOUBLE argument = p.K1 * deltaf * u2 + p.K2 * u2 * u2 - p.rad_phaseshift;
+		DOUBLE retval;
+		if (p.do_intact_until_first_peak && ABS(argument) < PI / 2.)
+			retval = 1.;
+		else
+			retval = sin(p.amplitude_phase - argument);
+		if (p.do_damping)
+			retval *= exp(p.K4 * u2);
+		if (p.do_abs)
+			retval = ABS(retval);
+		else if (p.do_only_flip_phases)
+			retval = (retval < 0.) ? -1. : 1.;
+		return p.scale * retval;
+	}
+
+	/* CTF values of n frequencies, given by their terms u2, c2 and s2 */
+	typedef void (*CTFRowKernel)(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out);
+
+	/* out[j] = in[j] * exp(i * (phase0 + j * dphase)) for j = 0 ... n-1 (in and out may be the same) */
+	typedef void (*PhaseShiftRowKernel)(const Complex *in, Complex *out, long int n, double phase0, double dphase);
+
+	/* Grid of nx * ny phase trials on the n pixels of a row (see computeBeamTiltDifferences in fftw.h):
+	 * out[ky * nx + kx] += sum_j Re(z[j] * sy[j]^ky * sx[j]^kx), where z, sx and sy are given by their real and imaginary parts.
+	 * The powers are calculated by recurrence, so sx and sy should have unit magnitude.
+	 * work is scratch space for (at least) 16 * nx * ny values.
+	 */
+	typedef void (*PhaseGridRowKernel)(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out);
+
+	/** Dispatch table with the kernels for the instruction-set level in use (see getSimdLevel)
+	 *
+	 * @code
+	 * getSimdKernels().phase_shift_row(in, out, n, phase0, dphase);
+	 * @endcode
+	 */
+	struct SimdKernels
+	{
+		SimdLevel level;
+		TrilinearRowKernel trilinear_row;
+		BrickedTrilinearRowKernel trilinear_row_bricked; // NULL if bricks do not pay off at this level
+		HalfTrilinearRowKernel trilinear_row_half;
+		CTFRowKernel ctf_row;
+		PhaseShiftRowKernel phase_shift_row;
+		PhaseGridRowKernel phase_grid_row;
+	};
+
+	/// The kernels for the current level (filled at the first call)
+	const SimdKernels& getSimdKernels();
+
+	/// Refill the table after a change of level (called by setSimdLevel)
+	void updateSimdKernels();
+
+	// One value at a time (reference implementations)
+	void ctfRowScalar(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out);
+	void phaseShiftRowScalar(const Complex *in, Complex *out, long int n, double phase0, double dphase);
+	void phaseGridRowScalar(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out);
+
+	// AVX: 8 (float) or 4 (double) values at a time
+	void ctfRowAVX(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out);
+	void phaseShiftRowAVX(const Complex *in, Complex *out, long int n, double phase0, double dphase);
+	void phaseGridRowAVX(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out);
+
+	// The same with FMA instructions (simd_kernels_avx2.cpp, compiled for AVX2 + FMA)
+	void ctfRowAVX2(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out);
+	void phaseShiftRowAVX2(const Complex *in, Complex *out, long int n, double phase0, double dphase);
+	void phaseGridRowAVX2(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out);
+
+	// AVX-512: 16 floats at a time (simd_kernels_avx512.cpp and projector_kernels_avx512.cpp, compiled for AVX-512)
+	// In double-precision builds these are the AVX2 kernels.
+	void ctfRowAVX512(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out);
+	void phaseShiftRowAVX512(const Complex *in, Complex *out, long int n, double phase0, double dphase);
+	void phaseGridRowAVX512(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out);
+}
+
+#endif
@@ -0,0 +1,253 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/simd_kernels.h"
+#include <immintrin.h>
+
+namespace relion
+{
+#ifdef FLOAT_PRECISION
+
+	// 16-wide versions of _avx_sin_8 and _avx_exp_8 (see avx_helper.h)
+	static inline __m512 _avx512_sin_16(__m512 x)
+	{
+		const __m512 signbit = _mm512_set1_ps(-0.f);
+		__m512 sign = _mm512_and_ps(x, signbit);
+		x = _mm512_andnot_ps(signbit, x);
+
+		// Octant j (made even) such that x - j * pi/4 lies in [-pi/4, pi/4]
+		__m512 j = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.27323954473516f)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		j = _mm512_add_ps(j, _mm512_sub_ps(j, _mm512_mul_ps(_mm512_set1_ps(2.f),
+			_mm512_roundscale_ps(_mm512_mul_ps(j, _mm512_set1_ps(0.5f)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC))));
+		__m512 j8 = _mm512_sub_ps(j, _mm512_mul_ps(_mm512_set1_ps(8.f),
+			_mm512_roundscale_ps(_mm512_mul_ps(j, _mm512_set1_ps(0.125f)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)));
+		// j8 = 0: sin, 2: cos, 4: -sin, 6: -cos
+		__mmask16 use_cos = _mm512_cmp_ps_mask(j8, _mm512_set1_ps(2.f), _CMP_EQ_OQ) | _mm512_cmp_ps_mask(j8, _mm512_set1_ps(6.f), _CMP_EQ_OQ);
+		sign = _mm512_mask_xor_ps(sign, _mm512_cmp_ps_mask(j8, _mm512_set1_ps(4.f), _CMP_GE_OQ), sign, signbit);
+
+		// Extended precision x - j * pi/4
+		x = _mm512_fnmadd_ps(j, _mm512_set1_ps(0.78515625f), x);
+		x = _mm512_fnmadd_ps(j, _mm512_set1_ps(2.4187564849853515625e-4f), x);
+		x = _mm512_fnmadd_ps(j, _mm512_set1_ps(3.77489497744594108e-8f), x);
+		__m512 z = _mm512_mul_ps(x, x);
+
+		__m512 c = _mm512_fmadd_ps(_mm512_set1_ps(2.443315711809948e-5f), z, _mm512_set1_ps(-1.388731625493765e-3f));
+		c = _mm512_fmadd_ps(c, z, _mm512_set1_ps(4.166664568298827e-2f));
+		c = _mm512_mul_ps(_mm512_mul_ps(c, z), z);
+		c = _mm512_add_ps(_mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, c), _mm512_set1_ps(1.f));
+
+		__m512 s = _mm512_fmadd_ps(_mm512_set1_ps(-1.9515295891e-4f), z, _mm512_set1_ps(8.3321608736e-3f));
+		s = _mm512_fmadd_ps(s, z, _mm512_set1_ps(-1.6666654611e-1f));
+		s = _mm512_fmadd_ps(_mm512_mul_ps(s, z), x, x);
+
+		return _mm512_xor_ps(_mm512_mask_blend_ps(use_cos, s, c), sign);
+	}
+
+	static inline __m512 _avx512_exp_16(__m512 x)
+	{
+		x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.3f)), _mm512_set1_ps(88.3f));
+		__m512 n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504088896341f), _mm512_set1_ps(0.5f)),
+			_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		x = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+		x = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), x);
+		__m512 z = _mm512_mul_ps(x, x);
+
+		__m512 y = _mm512_fmadd_ps(_mm512_set1_ps(1.9875691500e-4f), x, _mm512_set1_ps(1.3981999507e-3f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073e-3f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894e-2f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459e-1f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201e-1f));
+		y = _mm512_add_ps(_mm512_fmadd_ps(y, z, x), _mm512_set1_ps(1.f));
+
+		// 2^n, built in the exponent bits
+		__m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+		return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+	}
+
+	// Product of 8 interleaved complex numbers
+	static inline __m512 _avx512_complex_mul_16(__m512 a, __m512 b)
+	{
+		__m512 b_re = _mm512_moveldup_ps(b);
+		__m512 b_im = _mm512_movehdup_ps(b);
+		__m512 a_swap = _mm512_permute_ps(a, 0xB1);
+		return _mm512_fmaddsub_ps(a, b_re, _mm512_mul_ps(a_swap, b_im));
+	}
+
+	void ctfRowAVX512(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out)
+	{
+		const __m512 signbit = _mm512_set1_ps(-0.f);
+		const __m512 one = _mm512_set1_ps(1.f);
+		const __m512 __K1 = _mm512_set1_ps(p.K1), __K2 = _mm512_set1_ps(p.K2), __K4 = _mm512_set1_ps(p.K4);
+		const __m512 __avg = _mm512_set1_ps(p.defocus_average), __dev = _mm512_set1_ps(p.defocus_deviation);
+		const __m512 __cos2az = _mm512_set1_ps(p.cos2az), __sin2az = _mm512_set1_ps(p.sin2az);
+		const __m512 __phaseshift = _mm512_set1_ps(p.rad_phaseshift), __amplitude_phase = _mm512_set1_ps(p.amplitude_phase);
+		const __m512 __scale = _mm512_set1_ps(p.scale);
+		long int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m512 __u2 = _mm512_loadu_ps(u2 + i);
+			__m512 deltaf = _mm512_fmadd_ps(__dev,
+				_mm512_fmadd_ps(_mm512_loadu_ps(c2 + i), __cos2az, _mm512_mul_ps(_mm512_loadu_ps(s2 + i), __sin2az)), __avg);
+			__m512 argument = _mm512_sub_ps(_mm512_fmadd_ps(_mm512_mul_ps(__K1, deltaf), __u2,
+				_mm512_mul_ps(__K2, _mm512_mul_ps(__u2, __u2))), __phaseshift);
+			__m512 phase = _mm512_sub_ps(__amplitude_phase, argument);
+
+			// The polynomial sin is only accurate for |phase| < 8192: leave (extremely defocused) larger ones to libm
+			if (_mm512_cmp_ps_mask(_mm512_abs_ps(phase), _mm512_set1_ps(8192.f), _CMP_NLT_UQ))
+			{
+				for (int k = 0; k < 16; k++)
+					out[i + k] = getCTFValue(p, u2[i + k], c2[i + k], s2[i + k]);
+				continue;
+			}
+
+			__m512 retval = _avx512_sin_16(phase);
+			if (p.do_intact_until_first_peak)
+				retval = _mm512_mask_blend_ps(
+					_mm512_cmp_ps_mask(_mm512_abs_ps(argument), _mm512_set1_ps(PI / 2.), _CMP_LT_OQ), retval, one);
+			if (p.do_damping)
+				retval = _mm512_mul_ps(retval, _avx512_exp_16(_mm512_mul_ps(__K4, __u2))); // B-factor decay (K4 = -Bfac/4)
+			if (p.do_abs)
+				retval = _mm512_andnot_ps(signbit, retval);
+			else if (p.do_only_flip_phases)
+				retval = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(retval, _mm512_setzero_ps(), _CMP_LT_OQ), one, _mm512_set1_ps(-1.f));
+			_mm512_storeu_ps(out + i, _mm512_mul_ps(__scale, retval));
+		}
+
+		// Remainder of the row
+		if (i < n)
+			ctfRowAVX2(p, u2 + i, c2 + i, s2 + i, n - i, out + i);
+	}
+
+	// As phaseShiftRowAVX, but advancing 16 pixels per step
+	void phaseShiftRowAVX512(const Complex *in, Complex *out, long int n, double phase0, double dphase)
+	{
+		const long int block = 256;
+		// exp(i * k dphase) for the 16 pixels of a step, and exp(i * 16 dphase)
+		double wre[16], wim[16];
+		for (int k = 0; k < 16; k++)
+		{
+			wre[k] = cos(k * dphase);
+			wim[k] = sin(k * dphase);
+		}
+		float step[16];
+		for (int k = 0; k < 16; k += 2)
+		{
+			step[k] = cos(16 * dphase);
+			step[k + 1] = sin(16 * dphase);
+		}
+		const __m512 __step = _mm512_loadu_ps(step);
+		for (long int j0 = 0; j0 < n; j0 += block)
+		{
+			long int nj = XMIPP_MIN(block, n - j0);
+			double phase = phase0 + j0 * dphase;
+			long int j = 0;
+			if (nj >= 16)
+			{
+				// Seeds from a single sincos per block
+				double a = cos(phase), b = sin(phase);
+				float seed[32];
+				for (int k = 0; k < 16; k++)
+				{
+					seed[2 * k] = a * wre[k] - b * wim[k];
+					seed[2 * k + 1] = a * wim[k] + b * wre[k];
+				}
+				__m512 p0 = _mm512_loadu_ps(seed), p1 = _mm512_loadu_ps(seed + 16);
+				for (; j + 16 <= nj; j += 16)
+				{
+					const float *src = (const float*)(in + j0 + j);
+					float *dest = (float*)(out + j0 + j);
+					_mm512_storeu_ps(dest, _avx512_complex_mul_16(_mm512_loadu_ps(src), p0));
+					_mm512_storeu_ps(dest + 16, _avx512_complex_mul_16(_mm512_loadu_ps(src + 16), p1));
+					p0 = _avx512_complex_mul_16(p0, __step);
+					p1 = _avx512_complex_mul_16(p1, __step);
+				}
+			}
+			// Remainder of the block
+			if (j < nj)
+				phaseShiftRowAVX2(in + j0 + j, out + j0 + j, nj - j, phase + j * dphase, dphase);
+		}
+	}
+
+	// As phaseGridRowAVX, but 16 pixels per register
+	void phaseGridRowAVX512(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out)
+	{
+		const long int ntrials = (long int)nx * ny;
+		long int j = 0;
+		if (n >= 16)
+		{
+			for (long int k = 0; k < 16 * ntrials; k++)
+				work[k] = 0.f;
+			for (; j + 16 <= n; j += 16)
+			{
+				__m512 rre = _mm512_loadu_ps(z_re + j), rim = _mm512_loadu_ps(z_im + j);
+				const __m512 xre = _mm512_loadu_ps(sx_re + j), xim = _mm512_loadu_ps(sx_im + j);
+				const __m512 yre = _mm512_loadu_ps(sy_re + j), yim = _mm512_loadu_ps(sy_im + j);
+				float *acc = work;
+				for (int ky = 0; ky < ny; ky++)
+				{
+					__m512 qre = rre, qim = rim;
+					for (int kx = 0; kx < nx; kx++, acc += 16)
+					{
+						_mm512_storeu_ps(acc, _mm512_add_ps(_mm512_loadu_ps(acc), qre));
+						__m512 t = _mm512_fmsub_ps(qre, xre, _mm512_mul_ps(qim, xim));
+						qim = _mm512_fmadd_ps(qre, xim, _mm512_mul_ps(qim, xre));
+						qre = t;
+					}
+					__m512 t = _mm512_fmsub_ps(rre, yre, _mm512_mul_ps(rim, yim));
+					rim = _mm512_fmadd_ps(rre, yim, _mm512_mul_ps(rim, yre));
+					rre = t;
+				}
+			}
+			for (long int k = 0; k < ntrials; k++)
+			{
+				const float *acc = work + 16 * k;
+				double sum = 0.;
+				for (int l = 0; l < 16; l++)
+					sum += acc[l];
+				out[k] += sum;
+			}
+		}
+		// Remaining pixels
+		if (j < n)
+			phaseGridRowAVX2(z_re + j, z_im + j, sx_re + j, sx_im + j, sy_re + j, sy_im + j, n - j, nx, ny, work, out);
+	}
+
+#else
+
+	// Double precision: only 8 values per register, use the AVX2 kernels
+	void ctfRowAVX512(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out)
+	{
+		ctfRowAVX2(p, u2, c2, s2, n, out);
+	}
+
+	void phaseShiftRowAVX512(const Complex *in, Complex *out, long int n, double phase0, double dphase)
+	{
+		phaseShiftRowAVX2(in, out, n, phase0, dphase);
+	}
+
+	void phaseGridRowAVX512(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out)
+	{
+		phaseGridRowAVX2(z_re, z_im, sx_re, sx_im, sy_re, sy_im, n, nx, ny, work, out);
+	}
+
+#endif
+}
@@ -0,0 +1,218 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/* Bodies of the 256-bit kernels, compiled twice: for AVX (simd_kernels.cpp) and for AVX2 + FMA (simd_kernels_avx2.cpp)
+ * The including file defines SIMD_KERNEL(name) (appending the level to name) before including this file.
+ * No include guard on purpose.
+ */
+
+#include "src/simd_kernels.h"
+#include "src/avx_helper.h"
+
+#ifdef __FMA__
+#define SIMD_FMADD_PS(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define SIMD_FMADD_PD(a, b, c) _mm256_fmadd_pd(a, b, c)
+#else
+#define SIMD_FMADD_PS(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#define SIMD_FMADD_PD(a, b, c) _mm256_add_pd(_mm256_mul_pd(a, b), c)
+#endif
+
+namespace relion
+{
+	void SIMD_KERNEL(ctfRow)(const CTFRowParams &p, const DOUBLE *u2, const DOUBLE *c2, const DOUBLE *s2, long int n, DOUBLE *out)
+	{
+		long int i = 0;
+	#ifdef FLOAT_PRECISION
+		const __m256 signbit = _mm256_set1_ps(-0.f);
+		const __m256 one = _mm256_set1_ps(1.f);
+		const __m256 __K1 = _mm256_set1_ps(p.K1), __K2 = _mm256_set1_ps(p.K2), __K4 = _mm256_set1_ps(p.K4);
+		const __m256 __avg = _mm256_set1_ps(p.defocus_average), __dev = _mm256_set1_ps(p.defocus_deviation);
+		const __m256 __cos2az = _mm256_set1_ps(p.cos2az), __sin2az = _mm256_set1_ps(p.sin2az);
+		const __m256 __phaseshift = _mm256_set1_ps(p.rad_phaseshift), __amplitude_phase = _mm256_set1_ps(p.amplitude_phase);
+		const __m256 __scale = _mm256_set1_ps(p.scale);
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 __u2 = _mm256_loadu_ps(u2 + i);
+			__m256 deltaf = SIMD_FMADD_PS(__dev,
+				SIMD_FMADD_PS(_mm256_loadu_ps(c2 + i), __cos2az, _mm256_mul_ps(_mm256_loadu_ps(s2 + i), __sin2az)), __avg);
+			__m256 argument = _mm256_sub_ps(SIMD_FMADD_PS(_mm256_mul_ps(__K1, deltaf), __u2,
+				_mm256_mul_ps(__K2, _mm256_mul_ps(__u2, __u2))), __phaseshift);
+			__m256 phase = _mm256_sub_ps(__amplitude_phase, argument);
+
+			// The polynomial sin is only accurate for |phase| < 8192: leave (extremely defocused) larger ones to libm
+			if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(signbit, phase), _mm256_set1_ps(8192.f), _CMP_NLT_UQ)))
+			{
+				for (int k = 0; k < 8; k++)
+					out[i + k] = getCTFValue(p, u2[i + k], c2[i + k], s2[i + k]);
+				continue;
+			}
+
+			__m256 retval = _avx_sin_8(phase);
+			if (p.do_intact_until_first_peak)
+				retval = _mm256_blendv_ps(retval, one,
+					_mm256_cmp_ps(_mm256_andnot_ps(signbit, argument), _mm256_set1_ps(PI / 2.), _CMP_LT_OQ));
+			if (p.do_damping)
+				retval = _mm256_mul_ps(retval, _avx_exp_8(_mm256_mul_ps(__K4, __u2))); // B-factor decay (K4 = -Bfac/4)
+			if (p.do_abs)
+				retval = _mm256_andnot_ps(signbit, retval);
+			else if (p.do_only_flip_phases)
+				retval = _mm256_blendv_ps(one, _mm256_set1_ps(-1.f), _mm256_cmp_ps(retval, _mm256_setzero_ps(), _CMP_LT_OQ));
+			_mm256_storeu_ps(out + i, _mm256_mul_ps(__scale, retval));
+		}
+	#endif
+		for (; i < n; i++)
+			out[i] = getCTFValue(p, u2[i], c2[i], s2[i]);
+	}
+
+	/* The phase factors are calculated by recurrence, multiplying by exp(i * 8 dphase) per 8 pixels (4 in double precision),
+	 * and re-seeded with sincos every 256 pixels to limit the accumulation of rounding errors.
+	 */
+	void SIMD_KERNEL(phaseShiftRow)(const Complex *in, Complex *out, long int n, double phase0, double dphase)
+	{
+		const long int block = 256;
+		for (long int j0 = 0; j0 < n; j0 += block)
+		{
+			long int nj = XMIPP_MIN(block, n - j0);
+			double phase = phase0 + j0 * dphase;
+			long int j = 0;
+	#ifdef FLOAT_PRECISION
+			if (nj >= 8)
+			{
+				float seed[16];
+				for (int k = 0; k < 8; k++)
+				{
+					seed[2 * k] = cos(phase + k * dphase);
+					seed[2 * k + 1] = sin(phase + k * dphase);
+				}
+				__m256 p0 = _mm256_loadu_ps(seed), p1 = _mm256_loadu_ps(seed + 8);
+				const __m256 step = _mm256_setr_ps(cos(8 * dphase), sin(8 * dphase), cos(8 * dphase), sin(8 * dphase),
+					cos(8 * dphase), sin(8 * dphase), cos(8 * dphase), sin(8 * dphase));
+				for (; j + 8 <= nj; j += 8)
+				{
+					const float *src = (const float*)(in + j0 + j);
+					float *dest = (float*)(out + j0 + j);
+					_mm256_storeu_ps(dest, _avx_complex_mul_8(_mm256_loadu_ps(src), p0));
+					_mm256_storeu_ps(dest + 8, _avx_complex_mul_8(_mm256_loadu_ps(src + 8), p1));
+					p0 = _avx_complex_mul_8(p0, step);
+					p1 = _avx_complex_mul_8(p1, step);
+				}
+			}
+	#else
+			if (nj >= 4)
+			{
+				__m256d p0 = _mm256_setr_pd(cos(phase), sin(phase), cos(phase + dphase), sin(phase + dphase));
+				__m256d p1 = _mm256_setr_pd(cos(phase + 2 * dphase), sin(phase + 2 * dphase), cos(phase + 3 * dphase), sin(phase + 3 * dphase));
+				const __m256d step = _mm256_setr_pd(cos(4 * dphase), sin(4 * dphase), cos(4 * dphase), sin(4 * dphase));
+				for (; j + 4 <= nj; j += 4)
+				{
+					const double *src = (const double*)(in + j0 + j);
+					double *dest = (double*)(out + j0 + j);
+					_mm256_storeu_pd(dest, _avx_complex_mul_4(_mm256_loadu_pd(src), p0));
+					_mm256_storeu_pd(dest + 4, _avx_complex_mul_4(_mm256_loadu_pd(src + 4), p1));
+					p0 = _avx_complex_mul_4(p0, step);
+					p1 = _avx_complex_mul_4(p1, step);
+				}
+			}
+	#endif
+			// Remainder of the block
+			phaseShiftRowScalar(in + j0 + j, out + j0 + j, nj - j, phase + j * dphase, dphase);
+		}
+	}
+
+	/* 8 (float) or 4 (double) pixels per register, the trial sums are kept per lane in work
+	 * and only added up across the lanes at the end of the row.
+	 */
+	void SIMD_KERNEL(phaseGridRow)(const DOUBLE *z_re, const DOUBLE *z_im, const DOUBLE *sx_re, const DOUBLE *sx_im,
+		const DOUBLE *sy_re, const DOUBLE *sy_im, long int n, int nx, int ny, DOUBLE *work, double *out)
+	{
+		const long int ntrials = (long int)nx * ny;
+		long int j = 0;
+	#ifdef FLOAT_PRECISION
+		if (n >= 8)
+		{
+			for (long int k = 0; k < 8 * ntrials; k++)
+				work[k] = 0.f;
+			for (; j + 8 <= n; j += 8)
+			{
+				__m256 rre = _mm256_loadu_ps(z_re + j), rim = _mm256_loadu_ps(z_im + j);
+				const __m256 xre = _mm256_loadu_ps(sx_re + j), xim = _mm256_loadu_ps(sx_im + j);
+				const __m256 yre = _mm256_loadu_ps(sy_re + j), yim = _mm256_loadu_ps(sy_im + j);
+				float *acc = work;
+				for (int ky = 0; ky < ny; ky++)
+				{
+					__m256 qre = rre, qim = rim;
+					for (int kx = 0; kx < nx; kx++, acc += 8)
+					{
+						_mm256_storeu_ps(acc, _mm256_add_ps(_mm256_loadu_ps(acc), qre));
+						__m256 t = _mm256_sub_ps(_mm256_mul_ps(qre, xre), _mm256_mul_ps(qim, xim));
+						qim = SIMD_FMADD_PS(qre, xim, _mm256_mul_ps(qim, xre));
+						qre = t;
+					}
+					__m256 t = _mm256_sub_ps(_mm256_mul_ps(rre, yre), _mm256_mul_ps(rim, yim));
+					rim = SIMD_FMADD_PS(rre, yim, _mm256_mul_ps(rim, yre));
+					rre = t;
+				}
+			}
+			for (long int k = 0; k < ntrials; k++)
+			{
+				const float *acc = work + 8 * k;
+				out[k] += ((double)acc[0] + acc[1] + acc[2] + acc[3]) + ((double)acc[4] + acc[5] + acc[6] + acc[7]);
+			}
+		}
+	#else
+		if (n >= 4)
+		{
+			for (long int k = 0; k < 4 * ntrials; k++)
+				work[k] = 0.;
+			for (; j + 4 <= n; j += 4)
+			{
+				__m256d rre = _mm256_loadu_pd(z_re + j), rim = _mm256_loadu_pd(z_im + j);
+				const __m256d xre = _mm256_loadu_pd(sx_re + j), xim = _mm256_loadu_pd(sx_im + j);
+				const __m256d yre = _mm256_loadu_pd(sy_re + j), yim = _mm256_loadu_pd(sy_im + j);
+				double *acc = work;
+				for (int ky = 0; ky < ny; ky++)
+				{
+					__m256d qre = rre, qim = rim;
+					for (int kx = 0; kx < nx; kx++, acc += 4)
+					{
+						_mm256_storeu_pd(acc, _mm256_add_pd(_mm256_loadu_pd(acc), qre));
+						__m256d t = _mm256_sub_pd(_mm256_mul_pd(qre, xre), _mm256_mul_pd(qim, xim));
+						qim = SIMD_FMADD_PD(qre, xim, _mm256_mul_pd(qim, xre));
+						qre = t;
+					}
+					__m256d t = _mm256_sub_pd(_mm256_mul_pd(rre, yre), _mm256_mul_pd(rim, yim));
+					rim = SIMD_FMADD_PD(rre, yim, _mm256_mul_pd(rim, yre));
+					rre = t;
+				}
+			}
+			for (long int k = 0; k < ntrials; k++)
+			{
+				const double *acc = work + 4 * k;
+				out[k] += (acc[0] + acc[1]) + (acc[2] + acc[3]);
+			}
+		}
+	#endif
+		// Remaining pixels
+		phaseGridRowScalar(z_re + j, z_im + j, sx_re + j, sx_im + j, sy_re + j, sy_im + j, n - j, nx, ny, work, out);
+	}
+}
+
+#undef SIMD_FMADD_PS
+#undef SIMD_FMADD_PD
@@ -0,0 +1,328 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef SMALL_MATRIX_H
+#define SMALL_MATRIX_H
+
+#include <immintrin.h>
+#include "src/matrix2d.h"
+
+namespace relion
+{
+	/** @defgroup SmallMatrices Fixed-size 3x3 and 4x4 matrices
+	 * @ingroup DataLibrary
+	 *
+	 * Mat33 (rotations) and Mat44 (homogeneous transformations, as in SymList) keep their elements
+	 * row-major in the object itself, so that they can be created, copied and multiplied without
+	 * any heap allocation, and their element access is not bounds-checked.
+	 * They convert from and to Matrix2D<DOUBLE> for the code that needs the general matrices.
+	 *
+	 * @code
+	 * Mat33 A;
+	 * Euler_angles2matrix(rot, tilt, psi, A);
+	 * projector.project(Fref, A, false);
+	 * @endcode
+	 */
+	//@{
+
+	/** 3x3 matrix of DOUBLEs
+	 */
+	class Mat33
+	{
+	public:
+		// Row-major elements: (i, j) is m[3 * i + j]
+		DOUBLE m[9];
+
+		/** Zero matrix
+		 */
+		constexpr Mat33(): m{0., 0., 0., 0., 0., 0., 0., 0., 0.}
+		{
+		}
+
+		/** Matrix with the given elements (row by row)
+		 */
+		constexpr Mat33(DOUBLE a00, DOUBLE a01, DOUBLE a02,
+						DOUBLE a10, DOUBLE a11, DOUBLE a12,
+						DOUBLE a20, DOUBLE a21, DOUBLE a22):
+			m{a00, a01, a02, a10, a11, a12, a20, a21, a22}
+		{
+		}
+
+		/** The upper-left 3x3 block of A (which should be at least 3x3)
+		 */
+		explicit Mat33(const Matrix2D<DOUBLE> &A)
+		{
+			if (MAT_XSIZE(A) < 3 || MAT_YSIZE(A) < 3)
+				REPORT_ERROR("Mat33: the matrix should be at least 3x3");
+			for (int i = 0; i < 3; i++)
+				for (int j = 0; j < 3; j++)
+					m[3 * i + j] = MAT_ELEM(A, i, j);
+		}
+
+		static constexpr Mat33 identity()
+		{
+			return Mat33(1., 0., 0., 0., 1., 0., 0., 0., 1.);
+		}
+
+		/** Copy into a 3x3 Matrix2D
+		 */
+		void toMatrix2D(Matrix2D<DOUBLE> &A) const
+		{
+			if (MAT_XSIZE(A) != 3 || MAT_YSIZE(A) != 3)
+				A.resize(3, 3);
+			for (int i = 0; i < 3; i++)
+				for (int j = 0; j < 3; j++)
+					MAT_ELEM(A, i, j) = m[3 * i + j];
+		}
+
+		inline DOUBLE& operator()(int i, int j)
+		{
+			return m[3 * i + j];
+		}
+
+		constexpr DOUBLE operator()(int i, int j) const
+		{
+			return m[3 * i + j];
+		}
+
+		/** The 9 row-major elements, as taken by Projector::projectSlice and BackProjector::addSlice
+		 */
+		inline const DOUBLE* data() const
+		{
+			return m;
+		}
+
+		inline Mat33 transpose() const
+		{
+			return Mat33(m[0], m[3], m[6], m[1], m[4], m[7], m[2], m[5], m[8]);
+		}
+
+		inline Mat33 operator*(const Mat33 &B) const
+		{
+			Mat33 C;
+			for (int i = 0; i < 3; i++)
+				for (int j = 0; j < 3; j++)
+					C.m[3 * i + j] = m[3 * i] * B.m[j] + m[3 * i + 1] * B.m[3 + j] + m[3 * i + 2] * B.m[6 + j];
+			return C;
+		}
+
+		inline Mat33 operator*(DOUBLE k) const
+		{
+			Mat33 C;
+			for (int n = 0; n < 9; n++)
+				C.m[n] = m[n] * k;
+			return C;
+		}
+
+		inline void operator*=(DOUBLE k)
+		{
+			for (int n = 0; n < 9; n++)
+				m[n] *= k;
+		}
+
+		/** out = this * v
+		 */
+		inline void multiply(const DOUBLE *v, DOUBLE *out) const
+		{
+			for (int i = 0; i < 3; i++)
+				out[i] = m[3 * i] * v[0] + m[3 * i + 1] * v[1] + m[3 * i + 2] * v[2];
+		}
+
+		inline DOUBLE det() const
+		{
+			return m[0] * (m[4] * m[8] - m[5] * m[7])
+				 - m[1] * (m[3] * m[8] - m[5] * m[6])
+				 + m[2] * (m[3] * m[7] - m[4] * m[6]);
+		}
+
+		/** Are all elements within accuracy of those of op? (as Matrix2D::equal)
+		 */
+		inline bool equal(const Mat33 &op, DOUBLE accuracy = XMIPP_EQUAL_ACCURACY) const
+		{
+			for (int n = 0; n < 9; n++)
+				if (ABS(m[n] - op.m[n]) > accuracy)
+					return false;
+			return true;
+		}
+
+		/** Is this the identity matrix? (as Matrix2D::isIdentity)
+		 */
+		inline bool isIdentity() const
+		{
+			return equal(identity());
+		}
+	};
+
+	/** 4x4 matrix of DOUBLEs, with a vectorised multiplication
+	 */
+	class Mat44
+	{
+	public:
+		// Row-major elements: (i, j) is m[4 * i + j]
+		DOUBLE m[16];
+
+		/** Zero matrix
+		 */
+		constexpr Mat44(): m{0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0., 0.}
+		{
+		}
+
+		/** Homogeneous matrix with rotation R and translation t (or no translation)
+		 */
+		constexpr Mat44(const Mat33 &R, DOUBLE tx = 0., DOUBLE ty = 0., DOUBLE tz = 0.):
+			m{R.m[0], R.m[1], R.m[2], tx, R.m[3], R.m[4], R.m[5], ty, R.m[6], R.m[7], R.m[8], tz, 0., 0., 0., 1.}
+		{
+		}
+
+		/** Copy of a 4x4 Matrix2D (a 3x3 one is taken as a rotation without translation)
+		 */
+		explicit Mat44(const Matrix2D<DOUBLE> &A)
+		{
+			if (MAT_XSIZE(A) == 3 && MAT_YSIZE(A) == 3)
+			{
+				*this = Mat44(Mat33(A));
+				return;
+			}
+			if (MAT_XSIZE(A) != 4 || MAT_YSIZE(A) != 4)
+				REPORT_ERROR("Mat44: the matrix should be 3x3 or 4x4");
+			for (int n = 0; n < 16; n++)
+				m[n] = A.mdata[n];
+		}
+
+		static constexpr Mat44 identity()
+		{
+			return Mat44(Mat33::identity());
+		}
+
+		/** Copy into a 4x4 Matrix2D
+		 */
+		void toMatrix2D(Matrix2D<DOUBLE> &A) const
+		{
+			if (MAT_XSIZE(A) != 4 || MAT_YSIZE(A) != 4)
+				A.resize(4, 4);
+			for (int n = 0; n < 16; n++)
+				A.mdata[n] = m[n];
+		}
+
+		inline DOUBLE& operator()(int i, int j)
+		{
+			return m[4 * i + j];
+		}
+
+		constexpr DOUBLE operator()(int i, int j) const
+		{
+			return m[4 * i + j];
+		}
+
+		/** The upper-left 3x3 block (the rotation of a homogeneous matrix)
+		 */
+		inline Mat33 rotation() const
+		{
+			return Mat33(m[0], m[1], m[2], m[4], m[5], m[6], m[8], m[9], m[10]);
+		}
+
+		inline Mat44 transpose() const
+		{
+			Mat44 C;
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+					C.m[4 * i + j] = m[4 * j + i];
+			return C;
+		}
+
+		/** Product, row i of the result is the sum of the rows of B weighted by row i of this
+		 * The terms are added in the same order as in Matrix2D::operator*.
+		 */
+		inline Mat44 operator*(const Mat44 &B) const
+		{
+			Mat44 C;
+#if defined(FLOAT_PRECISION) && defined(__SSE__)
+			for (int i = 0; i < 4; i++)
+			{
+				__m128 __r = _mm_mul_ps(_mm_set1_ps(m[4 * i]), _mm_loadu_ps(B.m));
+				for (int k = 1; k < 4; k++)
+					__r = _mm_add_ps(__r, _mm_mul_ps(_mm_set1_ps(m[4 * i + k]), _mm_loadu_ps(B.m + 4 * k)));
+				_mm_storeu_ps(C.m + 4 * i, __r);
+			}
+#elif !defined(FLOAT_PRECISION) && defined(__AVX__)
+			for (int i = 0; i < 4; i++)
+			{
+				__m256d __r = _mm256_mul_pd(_mm256_set1_pd(m[4 * i]), _mm256_loadu_pd(B.m));
+				for (int k = 1; k < 4; k++)
+					__r = _mm256_add_pd(__r, _mm256_mul_pd(_mm256_set1_pd(m[4 * i + k]), _mm256_loadu_pd(B.m + 4 * k)));
+				_mm256_storeu_pd(C.m + 4 * i, __r);
+			}
+#else
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+				{
+					DOUBLE sum = m[4 * i] * B.m[j];
+					for (int k = 1; k < 4; k++)
+						sum += m[4 * i + k] * B.m[4 * k + j];
+					C.m[4 * i + j] = sum;
+				}
+#endif
+			return C;
+		}
+
+		/** Are all elements within accuracy of those of op? (as Matrix2D::equal)
+		 */
+		inline bool equal(const Mat44 &op, DOUBLE accuracy = XMIPP_EQUAL_ACCURACY) const
+		{
+			for (int n = 0; n < 16; n++)
+				if (ABS(m[n] - op.m[n]) > accuracy)
+					return false;
+			return true;
+		}
+
+		/** Is this the identity matrix? (as Matrix2D::isIdentity)
+		 */
+		inline bool isIdentity() const
+		{
+			return equal(identity());
+		}
+
+		/** Set the elements with ABS(val) < accuracy to zero
+		 */
+		inline void setSmallValuesToZero(DOUBLE accuracy = XMIPP_EQUAL_ACCURACY)
+		{
+			for (int n = 0; n < 16; n++)
+				if (ABS(m[n]) < accuracy)
+					m[n] = 0.;
+		}
+	};
+
+	inline std::ostream& operator<<(std::ostream &ostrm, const Mat33 &A)
+	{
+		for (int i = 0; i < 3; i++)
+			ostrm << A(i, 0) << " " << A(i, 1) << " " << A(i, 2) << std::endl;
+		return ostrm;
+	}
+
+	inline std::ostream& operator<<(std::ostream &ostrm, const Mat44 &A)
+	{
+		for (int i = 0; i < 4; i++)
+			ostrm << A(i, 0) << " " << A(i, 1) << " " << A(i, 2) << " " << A(i, 3) << std::endl;
+		return ostrm;
+	}
+	//@}
+}
+
+#endif
@@ -0,0 +1,227 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <algorithm>
+#include "src/stack_handle_cache.h"
+
+namespace relion
+{
+	StackHandleCache::StackHandleCache(int _max_open)
+	{
+		max_open = XMIPP_MAX(1, _max_open);
+	}
+
+	StackHandleCache::~StackHandleCache()
+	{
+		for (std::map<std::string, Handle*>::iterator it = handles.begin(); it != handles.end(); ++it)
+			delete it->second;
+	}
+
+	void StackHandleCache::setMaxOpen(int _max_open)
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		max_open = XMIPP_MAX(1, _max_open);
+		evict();
+	}
+
+	int StackHandleCache::getNrOpen()
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		return handles.size();
+	}
+
+	void StackHandleCache::clear()
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		std::list<Handle*>::iterator it = lru.begin();
+		while (it != lru.end())
+		{
+			Handle *handle = *it;
+			if (handle->nr_users > 0)
+			{
+				++it;
+				continue;
+			}
+			it = lru.erase(it);
+			handles.erase(handle->fn_stack);
+			delete handle;
+		}
+	}
+
+	void StackHandleCache::evict()
+	{
+		std::list<Handle*>::iterator it = lru.end();
+		while ((int)handles.size() > max_open && it != lru.begin())
+		{
+			--it;
+			Handle *handle = *it;
+			if (handle->nr_users > 0)
+				continue;
+			it = lru.erase(it);
+			handles.erase(handle->fn_stack);
+			delete handle;
+		}
+	}
+
+	StackHandleCache::Handle* StackHandleCache::acquire(const FileName &fn_stack)
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		Handle *handle;
+		std::map<std::string, Handle*>::iterator it = handles.find(fn_stack);
+		if (it != handles.end())
+		{
+			handle = it->second;
+			lru.splice(lru.begin(), lru, handle->lru_position);
+		}
+		else
+		{
+			handle = new Handle();
+			handle->fn_stack = fn_stack;
+			handle->nr_users = 0;
+			lru.push_front(handle);
+			handle->lru_position = lru.begin();
+			handles[fn_stack] = handle;
+		}
+		handle->nr_users++;
+		return handle;
+	}
+
+	void StackHandleCache::release(Handle *handle)
+	{
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		handle->nr_users--;
+		evict();
+	}
+
+	void StackHandleCache::read(const FileName &fn_stack, long int first, long int count, MultidimArray<DOUBLE> &stack)
+	{
+		Handle *handle = acquire(fn_stack);
+		try
+		{
+			// Stacks are opened by their first reader, outside the cache lock
+			std::unique_lock<std::mutex> lock(handle->mutex);
+			if (!handle->reader.isOpen())
+				handle->reader.open(fn_stack);
+			handle->reader.read(first, count, stack);
+		}
+		catch (RelionError &error)
+		{
+			release(handle);
+			throw;
+		}
+		release(handle);
+	}
+
+	void StackHandleCache::read(const FileName &fn_stack, long int index, MultidimArray<DOUBLE> &img)
+	{
+		read(fn_stack, index, 1, img);
+		img.resize(YSIZE(img), XSIZE(img));
+	}
+
+	void StackHandleCache::read(const FileName &fn_img, MultidimArray<DOUBLE> &img)
+	{
+		long int no;
+		std::string fn_stack;
+		fn_img.decompose(no, fn_stack);
+		read(fn_stack, XMIPP_MAX(0L, no - 1), img);
+	}
+
+	long int StackHandleCache::getStackSize(const FileName &fn_stack)
+	{
+		Handle *handle = acquire(fn_stack);
+		long int size;
+		try
+		{
+			std::unique_lock<std::mutex> lock(handle->mutex);
+			if (!handle->reader.isOpen())
+				handle->reader.open(fn_stack);
+			size = handle->reader.getStackSize();
+		}
+		catch (RelionError &error)
+		{
+			release(handle);
+			throw;
+		}
+		release(handle);
+		return size;
+	}
+
+	StackHandleCache& getStackHandleCache()
+	{
+		static StackHandleCache cache;
+		return cache;
+	}
+
+	// One image of getStackReadRuns: where it is, and which object refers to it
+	struct StackImageRef
+	{
+		std::string fn_stack;
+		long int index, object;
+
+		bool operator<(const StackImageRef &other) const
+		{
+			int cmp = fn_stack.compare(other.fn_stack);
+			if (cmp != 0)
+				return cmp < 0;
+			if (index != other.index)
+				return index < other.index;
+			return object < other.object;
+		}
+	};
+
+	void getStackReadRuns(const MetaDataTable &MD, std::vector<StackReadRun> &runs, long int max_count, EMDLabel label)
+	{
+		runs.clear();
+		max_count = XMIPP_MAX(1L, max_count);
+
+		std::vector<StackImageRef> refs;
+		refs.reserve(MD.numberOfObjects());
+		for (long int i = 0; i < MD.numberOfObjects(); i++)
+		{
+			FileName fn_img;
+			if (!MD.getValue(label, fn_img, i))
+				continue;
+			StackImageRef ref;
+			fn_img.decompose(ref.index, ref.fn_stack);
+			if (ref.index < 1)
+				continue;
+			ref.index--;
+			ref.object = i;
+			refs.push_back(ref);
+		}
+		std::sort(refs.begin(), refs.end());
+
+		// Another stack, a gap (or the same image again) starts a new run
+		for (size_t i = 0; i < refs.size(); i++)
+		{
+			bool do_new_run = runs.empty() || runs.back().fn_stack != refs[i].fn_stack ||
+				refs[i].index != runs.back().first + runs.back().count || runs.back().count >= max_count;
+			if (do_new_run)
+			{
+				runs.push_back(StackReadRun());
+				runs.back().fn_stack = refs[i].fn_stack;
+				runs.back().first = refs[i].index;
+				runs.back().count = 0;
+			}
+			runs.back().count++;
+			runs.back().objects.push_back(refs[i].object);
+		}
+	}
+}
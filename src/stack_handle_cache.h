@@ -0,0 +1,149 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef STACK_HANDLE_CACHE_H
+#define STACK_HANDLE_CACHE_H
+
+#include <list>
+#include <map>
+#include <vector>
+#include <mutex>
+#include "src/image_stack_reader.h"
+#include "src/metadata_table.h"
+
+namespace relion
+{
+	/** Bounded LRU cache of open MRC stacks, for reading images given as "N@stack.mrcs"
+	 *
+	 * Image::read opens the stack, parses its header and closes it again for every image. On network filesystems
+	 * this open/close latency dominates reading a particle. The cache keeps at most max_open stacks open (as
+	 * ImageStackReaders, which keep the parsed header), closing the least recently used one when another is needed.
+	 * It may be shared between threads: the cache itself and each stack have their own lock, so threads only wait
+	 * for each other when they read from the same stack. Stacks that are being read from are never closed.
+	 *
+	 * Only MRC stacks are read this way; the images are returned as they are stored (no Xmipp origin is set).
+	 *
+	 * @code
+	 * StackHandleCache &cache = getStackHandleCache();
+	 * std::vector<StackReadRun> runs;
+	 * getStackReadRuns(MDimg, runs);
+	 * for (size_t irun = 0; irun < runs.size(); irun++)
+	 * {
+	 *     cache.read(runs[irun].fn_stack, runs[irun].first, runs[irun].count, batch);
+	 *     // image n of batch belongs to object runs[irun].objects[n] of MDimg
+	 * }
+	 * @endcode
+	 */
+	class StackHandleCache
+	{
+	public:
+		StackHandleCache(int max_open = 64);
+
+		~StackHandleCache();
+
+		/// Change the maximum number of open stacks (closing the least recently used ones that are not in use)
+		void setMaxOpen(int max_open);
+
+		int getMaxOpen() const
+		{
+			return max_open;
+		}
+
+		/// The number of stacks that are open now
+		int getNrOpen();
+
+		/// Close all stacks that are not in use
+		void clear();
+
+		/// Read image index (counting from 0) of fn_stack into img (YSIZE x XSIZE)
+		void read(const FileName &fn_stack, long int index, MultidimArray<DOUBLE> &img);
+
+		/// Read an image given as "N@stack.mrcs" (N counting from 1) into img
+		void read(const FileName &fn_img, MultidimArray<DOUBLE> &img);
+
+		/// Read count consecutive images from first on (counting from 0) into stack (count x 1 x YSIZE x XSIZE)
+		void read(const FileName &fn_stack, long int first, long int count, MultidimArray<DOUBLE> &stack);
+
+		/// The number of images in fn_stack (opening it if needed)
+		long int getStackSize(const FileName &fn_stack);
+
+	private:
+		struct Handle
+		{
+			FileName fn_stack;
+			ImageStackReader reader;
+
+			// Serialises the reads from this stack
+			std::mutex mutex;
+
+			// Threads that are using the handle (guarded by the cache mutex)
+			int nr_users;
+
+			// Position in lru
+			std::list<Handle*>::iterator lru_position;
+		};
+
+		int max_open;
+
+		// Guards handles, lru and the nr_users of all handles
+		std::mutex cache_mutex;
+		std::map<std::string, Handle*> handles;
+
+		// Most recently used first
+		std::list<Handle*> lru;
+
+		// Find or open the handle of fn_stack, and register the calling thread as a user
+		Handle* acquire(const FileName &fn_stack);
+
+		// Unregister a user, and close stacks beyond max_open
+		void release(Handle *handle);
+
+		// Close least recently used handles without users until at most max_open are open (with cache_mutex locked)
+		void evict();
+
+		// Not copyable
+		StackHandleCache(const StackHandleCache&);
+		StackHandleCache& operator=(const StackHandleCache&);
+	};
+
+	/// The cache shared by the whole program
+	StackHandleCache& getStackHandleCache();
+
+	/// Consecutive images of one stack that are referenced by a MetaDataTable
+	struct StackReadRun
+	{
+		FileName fn_stack;
+
+		// Images first ... first + count - 1 of the stack (counting from 0)
+		long int first, count;
+
+		// The object of the MetaDataTable for each image of the run
+		std::vector<long int> objects;
+	};
+
+	/** Group the images of all objects of MD (given as "N@stack" by label) into runs of at most max_count consecutive images
+	 * The runs are sorted by stack name and image number, so that reading them one after the other reads every
+	 * stack sequentially. Objects without a (stack) image name are left out.
+	 */
+	void getStackReadRuns(const MetaDataTable &MD, std::vector<StackReadRun> &runs, long int max_count = 256,
+		EMDLabel label = EMDL_IMAGE_NAME);
+}
+
+#endif
@@ -45,6 +45,7 @@
 #include <stdio.h>
 
 #include "src/symmetries.h"
+#include "src/projector.h"
 
 
 namespace relion
@@ -192,6 +193,7 @@ namespace relion
 		}
 
 		compute_subgroup();
+		update_cache();
 
 		return pgGroup;
 	}
@@ -211,6 +213,38 @@ namespace relion
 			}
 	}
 
+	void SymList::get_matrices(int i, Mat44 &L, Mat44 &R) const
+	{
+		for (int k = 0; k < 4; k++)
+			for (int l = 0; l < 4; l++)
+			{
+				L(k, l) = MAT_ELEM(__L, 4 * i + k, l);
+				R(k, l) = MAT_ELEM(__R, 4 * i + k, l);
+			}
+	}
+
+	// Operator cache =========================================================
+	void SymList::update_cache()
+	{
+		int nr_syms = SymsNo();
+		__R33.resize(nr_syms);
+		__R33t.resize(nr_syms);
+		__L33.resize(nr_syms);
+		__Rq.resize(nr_syms);
+		for (int isym = 0; isym < nr_syms; isym++)
+		{
+			for (int k = 0; k < 3; k++)
+				for (int l = 0; l < 3; l++)
+				{
+					__R33[isym](k, l) = MAT_ELEM(__R, 4 * isym + k, l);
+					__L33[isym](k, l) = MAT_ELEM(__L, 4 * isym + k, l);
+				}
+			__R33t[isym] = __R33[isym].transpose();
+			// Mirrors and inversions are -1 times a proper rotation
+			__Rq[isym] = Quaternion::fromMatrix((__R33[isym].det() < 0.) ? __R33[isym] * -1. : __R33[isym]);
+		}
+	}
+
 	// Set matrix ==============================================================
 	void SymList::set_matrices(int i, const Matrix2D<DOUBLE> &L,
 		const Matrix2D<DOUBLE> &R)
@@ -222,6 +256,7 @@ namespace relion
 				__L(k, l) = L(k - 4 * i, l);
 				__R(k, l) = R(k - 4 * i, l);
 			}
+		update_cache();
 	}
 
 	// Add matrix ==============================================================
@@ -275,9 +310,8 @@ namespace relion
 	//#define DEBUG
 	void SymList::compute_subgroup()
 	{
-		Matrix2D<DOUBLE> I(4, 4);
-		I.initIdentity();
-		Matrix2D<DOUBLE> L1(4, 4), R1(4, 4), L2(4, 4), R2(4, 4), newL(4, 4), newR(4, 4);
+		Mat44 L1, R1, L2, R2, newL, newR;
+		Matrix2D<DOUBLE> newL2D, newR2D;
 		Matrix2D<int>    tried(true_symNo, true_symNo);
 		int i, j;
 		int new_chain_length;
@@ -290,9 +324,7 @@ namespace relion
 			newL = L1 * L2;
 			newR = R1 * R2;
 			new_chain_length = __chain_length(i) + __chain_length(j);
-			Matrix2D<DOUBLE> newR3 = newR;
-			newR3.resize(3, 3);
-			if (newL.isIdentity() && newR3.isIdentity()) continue;
+			if (newL.isIdentity() && newR.rotation().isIdentity()) continue;
 
 			// Try to find it in current ones
 			bool found;
@@ -319,7 +351,9 @@ namespace relion
 #undef DEBUG
 				newR.setSmallValuesToZero();
 				newL.setSmallValuesToZero();
-				add_matrices(newL, newR, new_chain_length);
+				newL.toMatrix2D(newL2D);
+				newR.toMatrix2D(newR2D);
+				add_matrices(newL2D, newR2D, new_chain_length);
 				tried.resize(MAT_YSIZE(tried) + 1, MAT_XSIZE(tried) + 1);
 			}
 		}
@@ -896,31 +930,107 @@ namespace relion
 		}
 	}
 
-	void symmetriseMap(MultidimArray<DOUBLE> &img, FileName &fn_sym, bool do_wrap)
+	void symmetriseMap(MultidimArray<DOUBLE> &img, FileName &fn_sym, bool do_wrap, int nr_threads, bool do_fourier)
 	{
 
 		if (img.getDim() != 3)
 			REPORT_ERROR("symmetriseMap ERROR: symmetriseMap can only be run on 3D maps!");
+		if (do_fourier && (XSIZE(img) != YSIZE(img) || XSIZE(img) != ZSIZE(img)))
+			REPORT_ERROR("symmetriseMap ERROR: symmetrising in Fourier space requires a cubic map!");
+		// The rotated transforms have no wrapped equivalent, so rather than silently ignoring do_wrap:
+		if (do_fourier && do_wrap)
+			REPORT_ERROR("symmetriseMap ERROR: symmetrising in Fourier space cannot wrap the map, do not combine do_fourier with do_wrap!");
 
 		img.setXmippOrigin();
 
 		SymList SL;
 		SL.read_sym_file(fn_sym);
 
-		Matrix2D<DOUBLE> L(4, 4), R(4, 4); // A matrix from the list
-		MultidimArray<DOUBLE> sum, aux;
+		// The first operator is the identity
+		MultidimArray<DOUBLE> sum;
 		sum = img;
-		aux.resize(img);
 
+		// Only the non-identity operators need any interpolation
+		Matrix2D<DOUBLE> L(4, 4), R(4, 4); // A matrix from the list
+		std::vector<int> operators;
 		for (int isym = 0; isym < SL.SymsNo(); isym++)
 		{
 			SL.get_matrices(isym, L, R);
-			applyGeometry(img, aux, R, IS_INV, do_wrap);
+			if (R.isIdentity())
+				sum += img;
+			else
+				operators.push_back(isym);
+		}
+
+		if (operators.size() > 0 && do_fourier)
+		{
+			int ori_size = XSIZE(img);
+			Projector projector(ori_size, TRILINEAR, 2, 10, 3);
+			projector.ref_dim = 3;
+			FourierTransformer transformer;
+			transformer.setThreadsNumber(nr_threads);
+
+			// Gridding-correct img (which is overwritten below anyway), pad it with zeros and centre its transform
+			projector.griddingCorrect(img);
+			int padoridim = projector.padding_factor * ori_size;
+			MultidimArray<DOUBLE> Mpad;
+			Mpad.initZeros(padoridim, padoridim, padoridim);
+			Mpad.setXmippOrigin();
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(img)
+			{
+				A3D_ELEM(Mpad, k, i, j) = A3D_ELEM(img, k, i, j);
+			}
+			CenterFFT(Mpad, true);
+			MultidimArray<Complex > Fpad;
+			transformer.FourierTransform(Mpad, Fpad, false);
+			Mpad.clear();
+
+			// The oversampled transform within r_max, normalised as by Projector::computeFourierTransformMap
+			projector.initZeros();
+			DOUBLE normfft = (DOUBLE)(projector.padding_factor * projector.padding_factor * projector.padding_factor);
+			long int max_r2 = (long int)projector.r_max * projector.r_max * projector.padding_factor * projector.padding_factor;
+			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fpad)
+			{
+				if (kp * kp + ip * ip + jp * jp <= max_r2)
+					A3D_ELEM(projector.data, kp, ip, jp) = DIRECT_A3D_ELEM(Fpad, k, i, j) * normfft;
+			}
+			Fpad.clear();
+
+			// Sum the rotated transforms: the rotation of each operator is its R, as applyGeometry(..., R, IS_INV, ...) below
+			MultidimArray<Complex > Fsum, Frot;
+			Fsum.initZeros(ori_size, ori_size, ori_size / 2 + 1);
+			Frot.initZeros(Fsum);
+			Matrix2D<DOUBLE> A;
+			for (size_t iop = 0; iop < operators.size(); iop++)
+			{
+				SL.get_rotations()[operators[iop]].toMatrix2D(A);
+				projector.rotate3D(Frot, A, true, nr_threads);
+#pragma omp parallel for num_threads(nr_threads)
+				for (long int n = 0; n < NZYXSIZE(Fsum); n++)
+					DIRECT_MULTIDIM_ELEM(Fsum, n) += DIRECT_MULTIDIM_ELEM(Frot, n);
+			}
+			Frot.clear();
+
+			MultidimArray<DOUBLE> aux(ori_size, ori_size, ori_size);
+			transformer.inverseFourierTransform(Fsum, aux);
+			CenterFFT(aux, false);
+			aux.setXmippOrigin();
 			sum += aux;
 		}
+		else if (operators.size() > 0)
+		{
+			MultidimArray<DOUBLE> aux;
+			aux.resize(img);
+			for (size_t iop = 0; iop < operators.size(); iop++)
+			{
+				SL.get_matrices(operators[iop], L, R);
+				applyGeometry(img, aux, R, IS_INV, do_wrap, (DOUBLE)0., nr_threads);
+				sum += aux;
+			}
+		}
 
 		// Overwrite the input
-		img = sum / (SL.SymsNo() + 1);
+		img = sum / (DOUBLE)(SL.SymsNo() + 1);
 
 	}
-}
\ No newline at end of file
+}
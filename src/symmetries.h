@@ -49,6 +49,8 @@
 
 #include "src/matrix1d.h"
 #include "src/matrix2d.h"
+#include "src/small_matrix.h"
+#include "src/quaternion.h"
 #include "src/euler.h"
 #include "src/funcs.h"
 
@@ -147,6 +149,16 @@ namespace relion
 		// Number of Axis, mirrors, ...
 		int              __sym_elements;
 
+	private:
+		// Cache of all SymsNo() operators, see get_rotations
+		// It is rebuilt whenever the matrices change, so that the (const) getters
+		// never write to it and can be called from several threads.
+		std::vector<Mat33> __R33, __R33t, __L33;
+		std::vector<Quaternion> __Rq;
+
+		// Rebuild the cache from __L and __R
+		void update_cache();
+
 	public:
 		/** Create an empty list.
 			The 2D matrices are 0x0.
@@ -190,6 +202,43 @@ namespace relion
 			@endcode */
 		void get_matrices(int i, Matrix2D<DOUBLE> &L, Matrix2D<DOUBLE> &R) const;
 
+		/** Get a couple of matrices in the symmetry list, without any allocation
+			As above. */
+		void get_matrices(int i, Mat44 &L, Mat44 &R) const;
+
+		/** The 3x3 R matrices of all SymsNo() operators, one after the other.
+			They are computed once when the list is read (or after it has been changed),
+			so that loops over the operators do not need to copy the matrices out one by one.
+			\\ Ex:
+			@code
+			const std::vector<Mat33> &Rs = SL.get_rotations();
+			for (int isym = 0; isym < SL.SymsNo(); isym++)
+				x_sym = Rs[isym] * x;
+			@endcode */
+		const std::vector<Mat33>& get_rotations() const
+		{
+			return __R33;
+		}
+
+		/** The transposes (the inverses) of the R matrices of get_rotations */
+		const std::vector<Mat33>& get_transposed_rotations() const
+		{
+			return __R33t;
+		}
+
+		/** The 3x3 L matrices of all SymsNo() operators */
+		const std::vector<Mat33>& get_L_rotations() const
+		{
+			return __L33;
+		}
+
+		/** The R matrices of get_rotations as unit quaternions, for angular distances
+			For improper operators (mirror planes, inversion) this is the quaternion of -R. */
+		const std::vector<Quaternion>& get_quaternions() const
+		{
+			return __Rq;
+		}
+
 		/** Set a couple of matrices in the symmetry list.
 			The number of matrices inside the list is given by SymsNo.
 			This function sets the 4x4 transformation matrices associated to
@@ -267,8 +316,16 @@ namespace relion
 	};
 
 
-	// Symmetrise a 3D map according to the specified symmetry
-	void symmetriseMap(MultidimArray<DOUBLE> &img, FileName &fn_sym, bool do_wrap = false);
+	/* Symmetrise a 3D map according to the specified symmetry
+	 *
+	 * By default every symmetry operator is applied in real space with (linear) applyGeometry.
+	 * With do_fourier, the (cubic) map is Fourier transformed once, and all operators are applied as Projector::rotate3D
+	 * (trilinear, 2x padded, gridding-corrected) interpolations of its transform, which are summed before a single
+	 * inverse transform; this is much faster for large maps and groups, but removes the frequencies beyond Nyquist
+	 * in the corners of the transform of the rotated copies, and cannot wrap (do_wrap together with do_fourier is an error).
+	 * Identity operators are never interpolated. The FFTs and the interpolations use nr_threads threads.
+	 */
+	void symmetriseMap(MultidimArray<DOUBLE> &img, FileName &fn_sym, bool do_wrap = false, int nr_threads = 1, bool do_fourier = false);
 }
 //@}
 #endif
@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/tabfuncs.h"
+#include "src/avx_helper.h"
 
 
 namespace relion
@@ -67,6 +68,109 @@ namespace relion
 		return DIRECT_A1D_ELEM(tabulatedValues, idx % XSIZE(tabulatedValues));
 	}
 
+	void TabLinear::setTable(const std::vector<DOUBLE> &values, DOUBLE _sampling)
+	{
+		sampling = _sampling;
+		nr_elem = values.size();
+
+		// At least two zero entries after the last value (for the interpolation up to and beyond the end),
+		// and a whole number of cache lines
+		long int padded_size = (nr_elem + 2 + 15) / 16 * 16;
+		tabulatedValues.initZeros(padded_size);
+		for (int i = 0; i < nr_elem; i++)
+			DIRECT_A1D_ELEM(tabulatedValues, i) = values[i];
+	}
+	// Value access
+	DOUBLE TabLinear::operator()(DOUBLE val) const
+	{
+		int idx = (int)(ABS(val) / sampling);
+		if (idx >= nr_elem)
+			return 0.;
+		else
+			return DIRECT_A1D_ELEM(tabulatedValues, idx);
+	}
+	// Batched value access, optionally with linear interpolation
+	void TabLinear::getValues(const DOUBLE *val, DOUBLE *out, int n, bool do_interpolate) const
+	{
+		const DOUBLE *tab = MULTIDIM_ARRAY(tabulatedValues);
+		const DOUBLE inv_sampling = 1. / sampling;
+		int i = 0;
+
+#ifdef FLOAT_PRECISION
+		const __m256 __inv = _mm256_set1_ps(inv_sampling);
+		const __m256 __sampling = _mm256_set1_ps(sampling);
+		const __m256 __max = _mm256_set1_ps((float)nr_elem);
+		const __m256 __sign = _mm256_set1_ps(-0.f);
+		int idx[8];
+		float lo[8], hi[8];
+		for (; i + 8 <= n; i += 8)
+		{
+			// Beyond the end of the table, both neighbours are zero
+			__m256 x = _mm256_andnot_ps(__sign, _mm256_loadu_ps(val + i));
+			// Without interpolation, divide as operator() does, so that the same entries are found
+			x = _mm256_min_ps((do_interpolate) ? _mm256_mul_ps(x, __inv) : _mm256_div_ps(x, __sampling), __max);
+			__m256 x0 = _mm256_floor_ps(x);
+			_mm256_storeu_si256((__m256i*)idx, _mm256_cvttps_epi32(x0));
+			if (do_interpolate)
+			{
+				for (int l = 0; l < 8; l++)
+				{
+					lo[l] = tab[idx[l]];
+					hi[l] = tab[idx[l] + 1];
+				}
+				_mm256_storeu_ps(out + i, LIN_INTERP_AVX(_mm256_loadu_ps(lo), _mm256_loadu_ps(hi), _mm256_sub_ps(x, x0)));
+			}
+			else
+			{
+				for (int l = 0; l < 8; l++)
+					out[i + l] = tab[idx[l]];
+			}
+		}
+#else
+		const __m256d __inv = _mm256_set1_pd(inv_sampling);
+		const __m256d __sampling = _mm256_set1_pd(sampling);
+		const __m256d __max = _mm256_set1_pd((double)nr_elem);
+		const __m256d __sign = _mm256_set1_pd(-0.);
+		int idx[4];
+		double lo[4], hi[4];
+		for (; i + 4 <= n; i += 4)
+		{
+			// Beyond the end of the table, both neighbours are zero
+			__m256d x = _mm256_andnot_pd(__sign, _mm256_loadu_pd(val + i));
+			// Without interpolation, divide as operator() does, so that the same entries are found
+			x = _mm256_min_pd((do_interpolate) ? _mm256_mul_pd(x, __inv) : _mm256_div_pd(x, __sampling), __max);
+			__m256d x0 = _mm256_floor_pd(x);
+			_mm_storeu_si128((__m128i*)idx, _mm256_cvttpd_epi32(x0));
+			if (do_interpolate)
+			{
+				for (int l = 0; l < 4; l++)
+				{
+					lo[l] = tab[idx[l]];
+					hi[l] = tab[idx[l] + 1];
+				}
+				_mm256_storeu_pd(out + i, LIN_INTERP_AVX(_mm256_loadu_pd(lo), _mm256_loadu_pd(hi), _mm256_sub_pd(x, x0)));
+			}
+			else
+			{
+				for (int l = 0; l < 4; l++)
+					out[i + l] = tab[idx[l]];
+			}
+		}
+#endif
+
+		for (; i < n; i++)
+		{
+			if (do_interpolate)
+			{
+				DOUBLE x = XMIPP_MIN(ABS(val[i]) * inv_sampling, (DOUBLE)nr_elem);
+				int x0 = (int)x;
+				out[i] = LIN_INTERP(x - x0, tab[x0], tab[x0 + 1]);
+			}
+			else
+				out[i] = TabLinear::operator()(val[i]);
+		}
+	}
+
 	void TabBlob::initialise(DOUBLE _radius, DOUBLE _alpha, int _order, const int _nr_elem)
 	{
 		radius = _radius;
@@ -78,21 +182,18 @@ namespace relion
 	//Pre-calculate table values
 	void TabBlob::fillTable(const int _nr_elem)
 	{
-		tabulatedValues.resize(_nr_elem);
+		std::vector<DOUBLE> values(_nr_elem);
 		for (int i = 0; i < _nr_elem; i++)
 		{
 			DOUBLE xx = (DOUBLE)i * sampling;
-			tabulatedValues(i) = kaiser_value(xx, radius, alpha, order);
+			values[i] = kaiser_value(xx, radius, alpha, order);
 		}
+		setTable(values, sampling);
 	}
 	// Value access
 	DOUBLE TabBlob::operator()(DOUBLE val) const
 	{
-		int idx = (int)(ABS(val) / sampling);
-		if (idx >= XSIZE(tabulatedValues))
-			return 0.;
-		else
-			return DIRECT_A1D_ELEM(tabulatedValues, idx);
+		return TabLinear::operator()(val);
 	}
 
 	void TabFtBlob::initialise(DOUBLE _radius, DOUBLE _alpha, int _order, const int _nr_elem)
@@ -106,20 +207,17 @@ namespace relion
 	//Pre-calculate table values
 	void TabFtBlob::fillTable(const int _nr_elem)
 	{
-		tabulatedValues.resize(_nr_elem);
+		std::vector<DOUBLE> values(_nr_elem);
 		for (int i = 0; i < _nr_elem; i++)
 		{
 			DOUBLE xx = (DOUBLE)i * sampling;
-			tabulatedValues(i) = kaiser_Fourier_value(xx, radius, alpha, order);
+			values[i] = kaiser_Fourier_value(xx, radius, alpha, order);
 		}
+		setTable(values, sampling);
 	}
 	// Value access
 	DOUBLE TabFtBlob::operator()(DOUBLE val) const
 	{
-		int idx = (int)(ABS(val) / sampling);
-		if (idx >= XSIZE(tabulatedValues))
-			return 0.;
-		else
-			return DIRECT_A1D_ELEM(tabulatedValues, idx);
+		return TabLinear::operator()(val);
 	}
 }
\ No newline at end of file
@@ -21,6 +21,7 @@
 #ifndef TABFUNCS_H_
 #define TABFUNCS_H_
 
+#include <vector>
 #include "src/multidim_array.h"
 #include "src/funcs.h"
 
@@ -107,7 +108,32 @@ namespace relion
 
 	};
 
-	class TabBlob : public TabFunction
+	// Tabulated function of a non-negative argument, which is zero beyond the end of its table
+	// Values can also be looked up in batches, optionally with linear interpolation between the table entries
+	class TabLinear : public TabFunction
+	{
+
+	protected:
+		// Number of valid entries (the table itself is zero-padded to a whole number of 64-byte cache lines)
+		int nr_elem;
+
+	public:
+		// Empty constructor
+		TabLinear() : nr_elem(0) {}
+
+		// Set the table: the function value at i * _sampling is values[i]
+		void setTable(const std::vector<DOUBLE> &values, DOUBLE _sampling);
+
+		// Value access, without interpolation
+		DOUBLE operator()(DOUBLE val) const;
+
+		// Values of val[0] ... val[n-1] into out (vectorised): the same as operator() for each of them,
+		// or if do_interpolate linearly interpolated between the table entries
+		void getValues(const DOUBLE *val, DOUBLE *out, int n, bool do_interpolate = false) const;
+
+	};
+
+	class TabBlob : public TabLinear
 	{
 
 	private:
@@ -130,7 +156,7 @@ namespace relion
 
 	};
 
-	class TabFtBlob : public TabFunction
+	class TabFtBlob : public TabLinear
 	{
 
 	private:
@@ -0,0 +1,423 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "src/thread_pool.h"
+#include "src/macros.h"
+#include "src/error.h"
+#include "src/memory.h"
+
+namespace relion
+{
+	// The chunks next ... last - 1 that a participant of a job still has to do (others may steal from the end)
+	struct ThreadPoolRange
+	{
+		std::mutex mutex;
+		long int next, last;
+	};
+
+	// One parallelFor() call
+	struct ThreadPoolJob
+	{
+		ParallelForBody body;
+		void *arg;
+		long int begin, end, grain;
+
+		// Threads divided over the participants for getTaskNrThreads()
+		int nr_threads;
+
+		// Memory category of the calling thread, for the allocations of all participants
+		MemoryCategory memory_category;
+
+		// One range of chunks per participant
+		std::vector<ThreadPoolRange> ranges;
+
+		// Participants that have joined but not finished, and the next participant number (guarded by the pool mutex)
+		int nr_active, next_participant;
+		std::condition_variable finished;
+
+		std::atomic<bool> has_error;
+		std::mutex error_mutex;
+		std::vector<RelionError> errors;
+
+		ThreadPoolJob(int nr_participants) : ranges(nr_participants), has_error(false)
+		{
+			nr_active = next_participant = 0;
+		}
+	};
+
+	class ThreadPool
+	{
+	public:
+		// Guards everything below, and the nr_active and next_participant of the queued jobs
+		std::mutex mutex;
+		std::condition_variable work_available;
+
+		// Jobs that still have participant numbers free
+		std::deque<ThreadPoolJob*> jobs;
+
+		std::vector<std::thread*> workers;
+		bool do_stop;
+
+		// Including the threads that call parallelFor()
+		std::atomic<int> size;
+
+		// Serialises setThreadPoolSize()
+		std::mutex resize_mutex;
+
+		ThreadPool() : do_stop(false), size(getDefaultSize())
+		{
+		}
+
+		~ThreadPool()
+		{
+			stopWorkers();
+		}
+
+		// RELION_NUM_THREADS, or the number of OpenMP (or hardware) threads
+		static int getDefaultSize()
+		{
+			const char *env = getenv("RELION_NUM_THREADS");
+			if (env != NULL && atoi(env) > 0)
+				return atoi(env);
+#ifdef _OPENMP
+			return XMIPP_MAX(1, omp_get_max_threads());
+#else
+			return XMIPP_MAX(1, (int)std::thread::hardware_concurrency());
+#endif
+		}
+
+		// Start the missing workers (with the mutex locked)
+		void startWorkers()
+		{
+			while (!do_stop && (int)workers.size() < size - 1)
+				workers.push_back(new std::thread(workerThread, this));
+		}
+
+		// Let all workers finish their current task and join them
+		void stopWorkers()
+		{
+			std::vector<std::thread*> old_workers;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				do_stop = true;
+				old_workers.swap(workers);
+			}
+			work_available.notify_all();
+			for (size_t i = 0; i < old_workers.size(); i++)
+			{
+				old_workers[i]->join();
+				delete old_workers[i];
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			do_stop = false;
+		}
+
+		static void workerThread(ThreadPool *pool);
+	};
+
+	static ThreadPool& getThreadPool()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	// Threads of the task the calling thread is running, 0 outside parallelFor() tasks
+	static thread_local int task_nr_threads = 0;
+
+	// Participant number in the outermost parallelFor() task of the calling thread
+	static thread_local int task_thread_id = 0;
+
+	static bool inOpenMPParallel()
+	{
+#ifdef _OPENMP
+		return omp_in_parallel() != 0;
+#else
+		return false;
+#endif
+	}
+
+	// The next chunk for participant p: from its own range, or else stolen from the end of the range of another one
+	static bool takeChunk(ThreadPoolJob *job, int p, long int &chunk)
+	{
+		ThreadPoolRange &own = job->ranges[p];
+		{
+			std::unique_lock<std::mutex> lock(own.mutex);
+			if (own.next < own.last)
+			{
+				chunk = own.next++;
+				return true;
+			}
+		}
+
+		int nr_participants = job->ranges.size();
+		for (int i = 1; i < nr_participants; i++)
+		{
+			ThreadPoolRange &victim = job->ranges[(p + i) % nr_participants];
+			long int first, last;
+			{
+				std::unique_lock<std::mutex> lock(victim.mutex);
+				long int remaining = victim.last - victim.next;
+				if (remaining <= 0)
+					continue;
+				last = victim.last;
+				first = last - (remaining + 1) / 2;
+				victim.last = first;
+			}
+			chunk = first;
+			if (first + 1 < last)
+			{
+				std::unique_lock<std::mutex> lock(own.mutex);
+				own.next = first + 1;
+				own.last = last;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	static void recordError(ThreadPoolJob *job, const RelionError &error)
+	{
+		std::unique_lock<std::mutex> lock(job->error_mutex);
+		job->errors.push_back(error);
+		job->has_error = true;
+	}
+
+	static void runParticipant(ThreadPoolJob *job, int p)
+	{
+		int nr_participants = job->ranges.size();
+		int previous_nr_threads = task_nr_threads;
+		int previous_thread_id = task_thread_id;
+		if (previous_nr_threads == 0)
+			task_thread_id = p;
+		task_nr_threads = XMIPP_MAX(1, job->nr_threads / nr_participants + ((p < job->nr_threads % nr_participants) ? 1 : 0));
+		MemoryCategoryScope memory_category(job->memory_category);
+
+		long int chunk;
+		while (!job->has_error && takeChunk(job, p, chunk))
+		{
+			long int first = job->begin + chunk * job->grain;
+			try
+			{
+				job->body(first, XMIPP_MIN(first + job->grain, job->end), job->arg);
+			}
+			catch (RelionError &error)
+			{
+				recordError(job, error);
+			}
+			catch (std::exception &error)
+			{
+				recordError(job, RelionError((std::string)"parallelFor: " + error.what(), __FILE__, __LINE__));
+			}
+		}
+
+		task_nr_threads = previous_nr_threads;
+		task_thread_id = previous_thread_id;
+	}
+
+	void ThreadPool::workerThread(ThreadPool *pool)
+	{
+		std::unique_lock<std::mutex> lock(pool->mutex);
+		while (true)
+		{
+			while (!pool->do_stop && pool->jobs.empty())
+				pool->work_available.wait(lock);
+			if (pool->do_stop)
+				return;
+
+			ThreadPoolJob *job = pool->jobs.front();
+			int p = job->next_participant++;
+			if (job->next_participant >= (int)job->ranges.size())
+				pool->jobs.pop_front();
+			job->nr_active++;
+
+			lock.unlock();
+			runParticipant(job, p);
+			lock.lock();
+
+			if (--job->nr_active == 0)
+				job->finished.notify_all();
+		}
+	}
+
+	void setThreadPoolSize(int nr_threads)
+	{
+		ThreadPool &pool = getThreadPool();
+		std::unique_lock<std::mutex> resize_lock(pool.resize_mutex);
+		pool.stopWorkers();
+		pool.size = XMIPP_MAX(1, nr_threads);
+	}
+
+	int getThreadPoolSize()
+	{
+		return getThreadPool().size;
+	}
+
+	int getTaskNrThreads(int nr_threads)
+	{
+		if (task_nr_threads > 0)
+			return XMIPP_MAX(1, XMIPP_MIN(nr_threads, task_nr_threads));
+		if (inOpenMPParallel())
+			return 1;
+		return nr_threads;
+	}
+
+	int getTaskThreadId()
+	{
+		return task_thread_id;
+	}
+
+	void parallelFor(long int begin, long int end, long int grain, ParallelForBody body, void *arg, int nr_threads)
+	{
+		if (end <= begin)
+			return;
+		grain = XMIPP_MAX(1L, grain);
+		long int nr_chunks = (end - begin + grain - 1) / grain;
+
+		ThreadPool &pool = getThreadPool();
+		if (nr_threads <= 0)
+			nr_threads = pool.size;
+		nr_threads = getTaskNrThreads(nr_threads);
+
+		// Nested calls run on the calling thread only
+		int nr_participants = (int)XMIPP_MIN((long int)XMIPP_MIN(nr_threads, (int)pool.size), nr_chunks);
+		if (task_nr_threads > 0 || inOpenMPParallel())
+			nr_participants = 1;
+
+		ThreadPoolJob job(nr_participants);
+		job.body = body;
+		job.arg = arg;
+		job.begin = begin;
+		job.end = end;
+		job.grain = grain;
+		job.nr_threads = nr_threads;
+		job.memory_category = getMemoryCategory();
+		for (int p = 0; p < nr_participants; p++)
+		{
+			job.ranges[p].next = nr_chunks * p / nr_participants;
+			job.ranges[p].last = nr_chunks * (p + 1) / nr_participants;
+		}
+
+		// The calling thread is participant 0; the workers that are free take the others
+		if (nr_participants > 1)
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.startWorkers();
+			job.next_participant = 1;
+			job.nr_active = 1;
+			pool.jobs.push_back(&job);
+		}
+		for (int p = 1; p < nr_participants; p++)
+			pool.work_available.notify_one();
+
+		runParticipant(&job, 0);
+
+		if (nr_participants > 1)
+		{
+			// No worker may join after this; the chunks of participants that never started have been stolen
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			std::deque<ThreadPoolJob*>::iterator it = std::find(pool.jobs.begin(), pool.jobs.end(), &job);
+			if (it != pool.jobs.end())
+				pool.jobs.erase(it);
+			job.nr_active--;
+			while (job.nr_active > 0)
+				job.finished.wait(lock);
+		}
+
+		if (!job.errors.empty())
+			throw job.errors[0];
+	}
+
+	// Items of parallelForWeighted() in the order they are handed to parallelFor()
+	struct WeightedItems
+	{
+		std::vector<long int> order;
+		ParallelForBody body;
+		void *arg;
+	};
+
+	struct CompareCosts
+	{
+		const std::vector<long int> *costs;
+		bool operator()(long int a, long int b) const
+		{
+			return (*costs)[a] > (*costs)[b] || ((*costs)[a] == (*costs)[b] && a < b);
+		}
+	};
+
+	static void runWeightedItems(long int begin, long int end, void *arg)
+	{
+		WeightedItems *items = (WeightedItems*)arg;
+		for (long int i = begin; i < end; i++)
+			items->body(items->order[i], items->order[i] + 1, items->arg);
+	}
+
+	void parallelForWeighted(const std::vector<long int> &costs, ParallelForBody body, void *arg, int nr_threads)
+	{
+		long int nr_items = costs.size();
+		if (nr_items == 0)
+			return;
+
+		std::vector<long int> sorted(nr_items);
+		for (long int i = 0; i < nr_items; i++)
+			sorted[i] = i;
+		CompareCosts compare;
+		compare.costs = &costs;
+		std::sort(sorted.begin(), sorted.end(), compare);
+
+		// parallelFor() gives participant p the p-th contiguous part of the range and steals from the upper ends:
+		// deal the sorted items round-robin over those parts, so every part runs from expensive to cheap
+		if (nr_threads <= 0)
+			nr_threads = getThreadPoolSize();
+		int nr_parts = (int)XMIPP_MIN((long int)XMIPP_MIN(getTaskNrThreads(nr_threads), getThreadPoolSize()), nr_items);
+		if (task_nr_threads > 0 || inOpenMPParallel())
+			nr_parts = 1;
+
+		WeightedItems items;
+		items.order.resize(nr_items);
+		items.body = body;
+		items.arg = arg;
+		std::vector<long int> fill(nr_parts), last(nr_parts);
+		for (int p = 0; p < nr_parts; p++)
+		{
+			fill[p] = nr_items * p / nr_parts;
+			last[p] = nr_items * (p + 1) / nr_parts;
+		}
+		for (long int k = 0, p = 0; k < nr_items; k++, p = (p + 1) % nr_parts)
+		{
+			while (fill[p] == last[p])
+				p = (p + 1) % nr_parts;
+			items.order[fill[p]++] = sorted[k];
+		}
+
+		parallelFor(0, nr_items, 1, runWeightedItems, (void*)&items, nr_threads);
+	}
+}
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include "src/error.h"
+
+namespace relion
+{
+	/** @name ThreadPool Shared work-stealing thread pool
+	 *
+	 * One pool of worker threads for the whole library, created on first use and re-used by every parallelFor().
+	 * Its size is getThreadPoolSize(): the environment variable RELION_NUM_THREADS, or the number of OpenMP threads
+	 * (hardware threads without OpenMP), unless set with setThreadPoolSize().
+	 *
+	 * parallelFor() cuts a range into chunks of grain items. Every participating thread (the calling thread is
+	 * always one of them) starts on its own contiguous part of the chunks; a thread that runs out steals the upper
+	 * half of the remaining chunks of another one. Calls from inside a parallelFor() body or inside an OpenMP
+	 * parallel region run directly on the calling thread, so nesting never deadlocks nor oversubscribes.
+	 *
+	 * The OpenMP code in the library asks getTaskNrThreads() how many threads it may use: the number it was given,
+	 * limited to the share of the current pool task (or 1 inside an OpenMP parallel region). MultidimArray, the
+	 * FourierTransformer, projection, insertion, reconstruction and masking do so, so that they can be called from
+	 * parallel tasks with the usual nr_threads.
+	 *
+	 * @code
+	 * struct ScaleRows
+	 * {
+	 *     MultidimArray<DOUBLE> *img;
+	 *     void operator()(long int begin, long int end)
+	 *     {
+	 *         for (long int i = begin; i < end; i++)
+	 *             scaleRow(*img, i);
+	 *     }
+	 * };
+	 * ScaleRows scale;
+	 * scale.img = &img;
+	 * parallelFor(0, YSIZE(img), 16, scale, nr_threads);
+	 * @endcode
+	 */
+	//@{
+
+	/// Body of parallelFor(): processes the items begin ... end - 1 of the range
+	typedef void (*ParallelForBody)(long int begin, long int end, void *arg);
+
+	/// Resize the shared pool to nr_threads threads (including the calling thread); waits for the old workers to finish
+	void setThreadPoolSize(int nr_threads);
+
+	/// The number of threads of the shared pool
+	int getThreadPoolSize();
+
+	/** The number of threads an operation that was asked to use nr_threads may start on the calling thread
+	 * nr_threads itself, limited to the share of the current parallelFor() task when called from one,
+	 * and 1 inside an OpenMP parallel region
+	 */
+	int getTaskNrThreads(int nr_threads);
+
+	/** The number of the participant of the outermost parallelFor() the calling thread is working for
+	 * 0 ... nr_threads - 1, and 0 outside parallelFor(). Nested calls keep the number of the outer task, so it can
+	 * index per-thread scratch objects (see ThreadScratch) at any depth.
+	 */
+	int getTaskThreadId();
+
+	/** body(first, last, arg) for consecutive chunks of grain items of begin ... end - 1, on at most nr_threads
+	 * threads of the shared pool (all of them if nr_threads <= 0)
+	 * Every chunk is passed exactly once, but chunks run in no fixed order or thread. The first RelionError (or other
+	 * std::exception) thrown by a body is re-thrown after all threads have stopped; chunks that had not started are
+	 * then skipped. The share of the threads that getTaskNrThreads() gives a task is nr_threads divided over the
+	 * participating threads.
+	 */
+	void parallelFor(long int begin, long int end, long int grain, ParallelForBody body, void *arg, int nr_threads = -1);
+
+	/** body(item, item + 1, arg) for every item = 0 ... costs.size() - 1, scheduled by cost
+	 * For loops over independent items of very different size (micrographs with different numbers of particles,
+	 * say). The items are dealt out in order of decreasing cost, so that every thread starts with the most
+	 * expensive ones it has and the cheap ones are left to be stolen at the end. Errors are passed on as by
+	 * parallelFor().
+	 */
+	void parallelForWeighted(const std::vector<long int> &costs, ParallelForBody body, void *arg, int nr_threads = -1);
+
+	/// Calls body(first, last) of a functor from parallelFor()
+	template <typename F>
+	void callParallelForFunctor(long int begin, long int end, void *arg)
+	{
+		(*(F*)arg)(begin, end);
+	}
+
+	/// parallelFor() with a functor that has void operator()(long int begin, long int end)
+	template <typename F>
+	void parallelFor(long int begin, long int end, long int grain, F &body, int nr_threads = -1)
+	{
+		parallelFor(begin, end, grain, callParallelForFunctor<F>, (void*)&body, nr_threads);
+	}
+
+	/// parallelForWeighted() with a functor that has void operator()(long int begin, long int end)
+	template <typename F>
+	void parallelForWeighted(const std::vector<long int> &costs, F &body, int nr_threads = -1)
+	{
+		parallelForWeighted(costs, callParallelForFunctor<F>, (void*)&body, nr_threads);
+	}
+
+	/** One scratch object per thread of the shared pool
+	 * get() returns the object of getTaskThreadId(), so that the bodies of one parallelFor() never share one. The
+	 * objects are made with the default constructor when the scratch is made, and keep their buffers (FFTW plans,
+	 * images) between calls.
+	 */
+	template <typename T>
+	class ThreadScratch
+	{
+	public:
+		std::vector<T> objects;
+
+		ThreadScratch() : objects(getThreadPoolSize())
+		{
+		}
+
+		T& get()
+		{
+			int id = getTaskThreadId();
+			if (id >= (int)objects.size())
+				REPORT_ERROR("ThreadScratch::get: the thread pool has grown since this scratch was made");
+			return objects[id];
+		}
+	};
+
+	//@}
+}
+
+#endif
@@ -223,4 +223,46 @@ namespace relion
 		MAT_ELEM(result, 1, 1) = YY(sc);
 		MAT_ELEM(result, 2, 2) = ZZ(sc);
 	}
-}
\ No newline at end of file
+
+	void GeometryAxisTable::fill(int size_out, int cen_out, DOUBLE scale, DOUBLE shift, int size_in, bool wrap, bool wrap_i2, bool incremental)
+	{
+		int cen_in = (int)(size_in / 2);
+		DOUBLE minp = -cen_in;
+		DOUBLE maxp = size_in - cen_in - 1;
+
+		i1.resize(size_out);
+		i2.resize(size_out);
+		w.resize(size_out);
+		inside.resize(size_out);
+		has_i2.resize(size_out);
+
+		DOUBLE p = -cen_out * scale + shift;
+		for (int j = 0; j < size_out; j++)
+		{
+			if (!incremental)
+				p = (j - cen_out) * scale + shift;
+
+			// The same steps as for each voxel in applyGeometry
+			inside[j] = true;
+			if (p < minp - XMIPP_EQUAL_ACCURACY || p > maxp + XMIPP_EQUAL_ACCURACY)
+			{
+				if (wrap)
+					p = realWRAP(p, minp - 0.5, maxp + 0.5);
+				else
+					inside[j] = false;
+			}
+
+			DOUBLE wp = p + cen_in;
+			int p1 = (int)wp;
+			int p2 = p1 + 1;
+			if (wrap && wrap_i2 && p2 >= size_in)
+				p2 = 0;
+			i1[j] = p1;
+			i2[j] = p2;
+			w[j] = wp - p1;
+			has_i2[j] = (p2 < size_in);
+
+			p += scale;
+		}
+	}
+}
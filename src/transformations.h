@@ -48,6 +48,7 @@
 
 #include "src/multidim_array.h"
 #include "src/euler.h"
+#include "src/radial_bins.h"
 
 
 
@@ -177,6 +178,30 @@ namespace relion
 	void scale3DMatrix(const Matrix1D< DOUBLE >& sc, Matrix2D< DOUBLE > &m,
 		bool homogeneous = true);
 
+	/** Interpolation positions along one axis of applyGeometry
+	 * @ingroup GeometricalTransformations
+	 *
+	 * For a transformation without rotation or shear (a scaling and/or translation), the input coordinate along
+	 * each axis only depends on the output coordinate along that axis, so the linear interpolation positions and
+	 * weights can be tabulated once per axis instead of once per voxel.
+	 */
+	class GeometryAxisTable
+	{
+	public:
+		// First and second input index, and weight of the second one, for each output index
+		std::vector<int> i1, i2;
+		std::vector<DOUBLE> w;
+		// Whether the output index falls inside the input, and whether its second input index exists
+		std::vector<char> inside, has_i2;
+
+		/** Fill the table for size_out output indices, with the tolerances and the wrapping of applyGeometry
+		 * The (centered) input coordinate of output index j is (j - cen_out) * scale + shift. With incremental, it is
+		 * instead stepped by scale from the first index on, as applyGeometry does along x. With wrap_i2, a second
+		 * index beyond the input is wrapped to 0 (as for 2D images).
+		 */
+		void fill(int size_out, int cen_out, DOUBLE scale, DOUBLE shift, int size_in, bool wrap, bool wrap_i2, bool incremental);
+	};
+
 	/** Applies a geometrical transformation.
 	 * @ingroup GeometricalTransformations
 	 *
@@ -244,6 +269,9 @@ namespace relion
 	 *
 	 * Although you can also use the constants IS_INV, or WRAP.
 	 *
+	 * The rows of the output are distributed over nr_threads threads. Transformations without
+	 * rotation or shear (scalings and translations) tabulate the interpolation positions per axis.
+	 *
 	 * @code
 	 * Matrix2D< DOUBLE > A(4,4);
 	 * A.initIdentity;
@@ -256,7 +284,8 @@ namespace relion
 		const Matrix2D< DOUBLE > A,
 		bool inv,
 		bool wrap,
-		T outside = 0)
+		T outside = 0,
+		int nr_threads = 1)
 	{
 
 		if (&V1 == &V2)
@@ -279,12 +308,30 @@ namespace relion
 			V2.clear();
 			return;
 		}
+		nr_threads = getTaskNrThreads(nr_threads);
 
 		Matrix2D<DOUBLE> Ainv;
 		const Matrix2D<DOUBLE> * Aptr = &A;
 		if (!inv)
 		{
-			Ainv = A.inv();
+			// Scalings and translations are inverted exactly, so that they take the separable paths below
+			int dim = MAT_XSIZE(A) - 1;
+			bool is_diagonal = true;
+			for (int i = 0; i < dim; i++)
+				for (int j = 0; j < dim; j++)
+					if ((i != j && MAT_ELEM(A, i, j) != 0.) || (i == j && MAT_ELEM(A, i, j) == 0.))
+						is_diagonal = false;
+			if (is_diagonal)
+			{
+				Ainv.initIdentity(dim + 1);
+				for (int i = 0; i < dim; i++)
+				{
+					MAT_ELEM(Ainv, i, i) = 1. / MAT_ELEM(A, i, i);
+					MAT_ELEM(Ainv, i, dim) = -MAT_ELEM(A, i, dim) / MAT_ELEM(A, i, i);
+				}
+			}
+			else
+				Ainv = A.inv();
 			Aptr = &Ainv;
 		}
 		const Matrix2D<DOUBLE> &Aref = *Aptr;
@@ -299,11 +346,8 @@ namespace relion
 		{
 			// 2D transformation
 
-			int m1, n1, m2, n2;
-			DOUBLE x, y, xp, yp;
 			DOUBLE minxp, minyp, maxxp, maxyp;
 			int cen_x, cen_y, cen_xp, cen_yp;
-			DOUBLE wx, wy;
 			int Xdim, Ydim;
 
 			// Find center and limits of image
@@ -318,11 +362,6 @@ namespace relion
 			Xdim = XSIZE(V1);
 			Ydim = YSIZE(V1);
 
-			// Now we go from the output image to the input image, ie, for any pixel
-			// in the output image we calculate which are the corresponding ones in
-			// the original image, make an interpolation with them and put this value
-			// at the output pixel
-
 #ifdef DEBUG_APPLYGEO
 			std::cout << "A\n" << Aref << std::endl
 				<< "(cen_x ,cen_y )=(" << cen_x  << "," << cen_y  << ")\n"
@@ -331,8 +370,54 @@ namespace relion
 				<< "(max_xp,max_yp)=(" << maxxp  << "," << maxyp  << ")\n";
 #endif
 
+			// Without rotation or shear, the interpolation is separable: tabulate the positions along x and y
+			if (Aref(0, 1) == 0. && Aref(1, 0) == 0.)
+			{
+				GeometryAxisTable tx, ty;
+				tx.fill(XSIZE(V2), cen_x, Aref(0, 0), Aref(0, 2), Xdim, wrap, wrap, true);
+				ty.fill(YSIZE(V2), cen_y, Aref(1, 1), Aref(1, 2), Ydim, wrap, wrap, false);
+
+#pragma omp parallel for num_threads(nr_threads)
+				for (int i = 0; i < YSIZE(V2); i++)
+				{
+					int n1 = ty.i1[i], n2 = ty.i2[i];
+					DOUBLE wy = ty.w[i];
+					for (int j = 0; j < XSIZE(V2); j++)
+					{
+						if (!ty.inside[i] || !tx.inside[j])
+						{
+							dAij(V2, i, j) = outside;
+							continue;
+						}
+						int m1 = tx.i1[j], m2 = tx.i2[j];
+						DOUBLE wx = tx.w[j];
+						T tmp = (T)((1 - wy) * (1 - wx) * DIRECT_A2D_ELEM(V1, n1, m1));
+						if (tx.has_i2[j])
+							tmp += (T)((1 - wy) * wx * DIRECT_A2D_ELEM(V1, n1, m2));
+						if (ty.has_i2[i])
+						{
+							tmp += (T)(wy * (1 - wx) * DIRECT_A2D_ELEM(V1, n2, m1));
+							if (tx.has_i2[j])
+								tmp += (T)(wy * wx * DIRECT_A2D_ELEM(V1, n2, m2));
+						}
+						dAij(V2, i, j) = tmp;
+					}
+				}
+				return;
+			}
+
+			// Now we go from the output image to the input image, ie, for any pixel
+			// in the output image we calculate which are the corresponding ones in
+			// the original image, make an interpolation with them and put this value
+			// at the output pixel
+			// Each row is independent of all others
+#pragma omp parallel for num_threads(nr_threads)
 			for (int i = 0; i < YSIZE(V2); i++)
 			{
+				int m1, n1, m2, n2;
+				DOUBLE x, y, xp, yp;
+				DOUBLE wx, wy;
+
 				// Calculate position of the beginning of the row in the output image
 				x = -cen_x;
 				y = i - cen_y;
@@ -341,6 +426,7 @@ namespace relion
 				// geometrical transformation
 				// they are related by
 				// coords_output(=x,y) = A * coords_input (=xp,yp)
+				// Along the row, the position is stepped incrementally
 				xp = x * Aref(0, 0) + y * Aref(0, 1) + Aref(0, 2);
 				yp = x * Aref(1, 0) + y * Aref(1, 1) + Aref(1, 2);
 
@@ -349,13 +435,6 @@ namespace relion
 					bool interp;
 					T tmp;
 
-#ifdef DEBUG_APPLYGEO
-
-					std::cout << "Computing (" << i << "," << j << ")\n";
-					std::cout << "   (y, x) =(" << y << "," << x << ")\n"
-						<< "   before wrapping (y',x')=(" << yp << "," << xp << ") "
-						<< std::endl;
-#endif
 					// If the point is outside the image, apply a periodic extension
 					// of the image, what exits by one side enters by the other
 					interp = true;
@@ -381,14 +460,6 @@ namespace relion
 							interp = false;
 					}
 
-#ifdef DEBUG_APPLYGEO
-					std::cout << "   after wrapping (y',x')=(" << yp << "," << xp << ") "
-						<< std::endl;
-					std::cout << "   Interp = " << interp << std::endl;
-					// The following line sounds dangerous...
-					//x++;
-#endif
-
 					if (interp)
 					{
 						// Linear interpolation
@@ -415,12 +486,6 @@ namespace relion
 								n2 = 0;
 						}
 
-#ifdef DEBUG_APPLYGEO
-						std::cout << "   From (" << n1 << "," << m1 << ") and ("
-							<< n2 << "," << m2 << ")\n";
-						std::cout << "   wx= " << wx << " wy= " << wy << std::endl;
-#endif
-
 						// Perform interpolation
 						// if wx == 0 means that the rightest point is useless for this
 						// interpolation, and even it might not be defined if m1=xdim-1
@@ -439,9 +504,6 @@ namespace relion
 						}
 
 						dAij(V2, i, j) = tmp;
-#ifdef DEBUG_APPYGEO
-						std::cout << "   val= " << dAij(V2, i, j) << std::endl;
-#endif
 
 					} // if interp
 					else
@@ -457,11 +519,8 @@ namespace relion
 		{
 			// 3D transformation
 
-			int m1, n1, o1, m2, n2, o2;
-			DOUBLE x, y, z, xp, yp, zp;
 			DOUBLE minxp, minyp, maxxp, maxyp, minzp, maxzp;
 			int cen_x, cen_y, cen_z, cen_xp, cen_yp, cen_zp;
-			DOUBLE wx, wy, wz;
 
 			// Find center of MultidimArray
 			cen_z = (int)(V2.zdim / 2);
@@ -490,15 +549,87 @@ namespace relion
 				;
 #endif
 
+			// Without rotation or shear, the interpolation is separable: tabulate the positions along x, y and z
+			if (Aref(0, 1) == 0. && Aref(0, 2) == 0. && Aref(1, 0) == 0. &&
+				Aref(1, 2) == 0. && Aref(2, 0) == 0. && Aref(2, 1) == 0.)
+			{
+				GeometryAxisTable tx, ty, tz;
+				tx.fill(V2.xdim, cen_x, Aref(0, 0), Aref(0, 3), V1.xdim, wrap, false, true);
+				ty.fill(V2.ydim, cen_y, Aref(1, 1), Aref(1, 3), V1.ydim, wrap, false, false);
+				tz.fill(V2.zdim, cen_z, Aref(2, 2), Aref(2, 3), V1.zdim, wrap, false, false);
+
+#pragma omp parallel for num_threads(nr_threads)
+				for (int k = 0; k < V2.zdim; k++)
+					for (int i = 0; i < V2.ydim; i++)
+					{
+						T* out = &dAkij(V2, k, i, 0);
+						if (!tz.inside[k] || !ty.inside[i])
+						{
+							for (int j = 0; j < V2.xdim; j++)
+								out[j] = outside;
+							continue;
+						}
+
+						// The weights of the 4 input rows (in the order in which applyGeometry multiplies them)
+						DOUBLE wz = tz.w[k], wy = ty.w[i];
+						DOUBLE c00 = (1 - wz) * (1 - wy), c01 = (1 - wz) * wy, c10 = wz * (1 - wy), c11 = wz * wy;
+						bool has_y2 = ty.has_i2[i], has_z2 = tz.has_i2[k];
+						const T* r00 = &DIRECT_A3D_ELEM(V1, tz.i1[k], ty.i1[i], 0);
+						const T* r01 = has_y2 ? &DIRECT_A3D_ELEM(V1, tz.i1[k], ty.i2[i], 0) : r00;
+						const T* r10 = has_z2 ? &DIRECT_A3D_ELEM(V1, tz.i2[k], ty.i1[i], 0) : r00;
+						const T* r11 = (has_y2 && has_z2) ? &DIRECT_A3D_ELEM(V1, tz.i2[k], ty.i2[i], 0) : r00;
+						for (int j = 0; j < V2.xdim; j++)
+						{
+							if (!tx.inside[j])
+							{
+								out[j] = outside;
+								continue;
+							}
+							int m1 = tx.i1[j], m2 = tx.i2[j];
+							DOUBLE wx = tx.w[j];
+							bool has_x2 = tx.has_i2[j];
+							T tmp = (T)(c00 * (1 - wx) * r00[m1]);
+							if (has_x2)
+								tmp += (T)(c00 * wx * r00[m2]);
+							if (has_y2)
+							{
+								tmp += (T)(c01 * (1 - wx) * r01[m1]);
+								if (has_x2)
+									tmp += (T)(c01 * wx * r01[m2]);
+							}
+							if (has_z2)
+							{
+								tmp += (T)(c10 * (1 - wx) * r10[m1]);
+								if (has_x2)
+									tmp += (T)(c10 * wx * r10[m2]);
+								if (has_y2)
+								{
+									tmp += (T)(c11 * (1 - wx) * r11[m1]);
+									if (has_x2)
+										tmp += (T)(c11 * wx * r11[m2]);
+								}
+							}
+							out[j] = tmp;
+						}
+					}
+				return;
+			}
+
 			// Now we go from the output MultidimArray to the input MultidimArray, ie, for any
 			// voxel in the output MultidimArray we calculate which are the corresponding
 			// ones in the original MultidimArray, make an interpolation with them and put
 			// this value at the output voxel
 
 			// V2 is not initialised to 0 because all its pixels are rewritten
+			// Each row is independent of all others
+#pragma omp parallel for num_threads(nr_threads)
 			for (int k = 0; k < V2.zdim; k++)
 				for (int i = 0; i < V2.ydim; i++)
 				{
+					int m1, n1, o1, m2, n2, o2;
+					DOUBLE x, y, z, xp, yp, zp;
+					DOUBLE wx, wy, wz;
+
 					// Calculate position of the beginning of the row in the output
 					// MultidimArray
 					x = -cen_x;
@@ -508,6 +639,7 @@ namespace relion
 					// Calculate this position in the input image according to the
 					// geometrical transformation they are related by
 					// coords_output(=x,y) = A * coords_input (=xp,yp)
+					// Along the row, the position is stepped incrementally
 					xp = x * Aref(0, 0) + y * Aref(0, 1) + z * Aref(0, 2) + Aref(0, 3);
 					yp = x * Aref(1, 0) + y * Aref(1, 1) + z * Aref(1, 2) + Aref(1, 3);
 					zp = x * Aref(2, 0) + y * Aref(2, 1) + z * Aref(2, 2) + Aref(2, 3);
@@ -517,19 +649,6 @@ namespace relion
 						bool interp;
 						T tmp;
 
-#ifdef DEBUG
-
-						bool show_debug = false;
-						if ((i == 0 && j == 0 && k == 0) ||
-							(i == V2.ydim - 1 && j == V2.xdim - 1 && k == V2.zdim - 1))
-							show_debug = true;
-
-						if (show_debug)
-							std::cout << "(x,y,z)-->(xp,yp,zp)= "
-							<< "(" << x  << "," << y  << "," << z  << ") "
-							<< "(" << xp << "," << yp << "," << zp << ")\n";
-#endif
-
 						// If the point is outside the volume, apply a periodic
 						// extension of the volume, what exits by one side enters by
 						// the other
@@ -586,20 +705,6 @@ namespace relion
 							wz = wz - o1;
 							o2 = o1 + 1;
 
-#ifdef DEBUG
-
-							if (show_debug)
-							{
-								std::cout << "After wrapping(xp,yp,zp)= "
-									<< "(" << xp << "," << yp << "," << zp << ")\n";
-								std::cout << "(m1,n1,o1)-->(m2,n2,o2)="
-									<< "(" << m1 << "," << n1 << "," << o1 << ") "
-									<< "(" << m2 << "," << n2 << "," << o2 << ")\n";
-								std::cout << "(wx,wy,wz)="
-									<< "(" << wx << "," << wy << "," << wz << ")\n";
-							}
-#endif
-
 							// Perform interpolation
 							// if wx == 0 means that the rightest point is useless for
 							// this interpolation, and even it might not be defined if
@@ -630,33 +735,6 @@ namespace relion
 								}
 							}
 
-#ifdef DEBUG
-							if (show_debug)
-								std::cout <<
-								"tmp1=" << DIRECT_A3D_ELEM(V1, o1, n1, m1) << " "
-								<< (T)((1 - wz) *(1 - wy) *(1 - wx) * DIRECT_A3D_ELEM(V1, o1, n1, m1))
-								<< std::endl <<
-								"tmp2=" << DIRECT_A3D_ELEM(V1, o1, n1, m2) << " "
-								<< (T)((1 - wz) *(1 - wy) * wx * DIRECT_A3D_ELEM(V1, o1, n1, m2))
-								<< std::endl <<
-								"tmp3=" << DIRECT_A3D_ELEM(V1, o1, n2, m1) << " "
-								<< (T)((1 - wz) * wy *(1 - wx) * DIRECT_A3D_ELEM(V1, o1, n2, m1))
-								<< std::endl <<
-								"tmp4=" << DIRECT_A3D_ELEM(V1, o1, n2, m2) << " "
-								<< (T)((1 - wz) * wy * wx * DIRECT_A3D_ELEM(V1, o2, n1, m1))
-								<< std::endl <<
-								"tmp6=" << DIRECT_A3D_ELEM(V1, o2, n1, m2) << " "
-								<< (T)(wz * (1 - wy) * wx * DIRECT_A3D_ELEM(V1, o2, n1, m2))
-								<< std::endl <<
-								"tmp7=" << DIRECT_A3D_ELEM(V1, o2, n2, m1) << " "
-								<< (T)(wz * wy *(1 - wx) * DIRECT_A3D_ELEM(V1, o2, n2, m1))
-								<< std::endl <<
-								"tmp8=" << DIRECT_A3D_ELEM(V1, o2, n2, m2) << " "
-								<< (T)(wz * wy * wx * DIRECT_A3D_ELEM(V1, o2, n2, m2))
-								<< std::endl <<
-								"tmp= " << tmp << std::endl;
-#endif
-
 							dAkij(V2, k, i, j) = tmp;
 						}
 						else
@@ -679,11 +757,11 @@ namespace relion
 	template<typename T>
 	void selfApplyGeometry(MultidimArray<T>& V1,
 		const Matrix2D< DOUBLE > A, bool inv,
-		bool wrap, T outside = 0)
+		bool wrap, T outside = 0, int nr_threads = 1)
 	{
 		MultidimArray<T> aux = V1;
 		V1.initZeros();
-		applyGeometry(aux, V1, A, inv, wrap, outside);
+		applyGeometry(aux, V1, A, inv, wrap, outside, nr_threads);
 	}
 
 	/** Rotate an array around a given system axis.
@@ -701,7 +779,7 @@ namespace relion
 	void rotate(const MultidimArray<T>& V1,
 		MultidimArray<T>& V2,
 		DOUBLE ang, char axis = 'Z',
-		bool wrap = DONT_WRAP, T outside = 0)
+		bool wrap = DONT_WRAP, T outside = 0, int nr_threads = 1)
 	{
 		Matrix2D< DOUBLE > tmp;
 		if (V1.getDim() == 2)
@@ -715,7 +793,7 @@ namespace relion
 		else
 			REPORT_ERROR("rotate ERROR: rotate only valid for 2D or 3D arrays");
 
-		applyGeometry(V1, V2, tmp, IS_NOT_INV, wrap, outside);
+		applyGeometry(V1, V2, tmp, IS_NOT_INV, wrap, outside, nr_threads);
 	}
 
 	/** Rotate an array around a given system axis.
@@ -726,10 +804,10 @@ namespace relion
 	template<typename T>
 	void selfRotate(MultidimArray<T>& V1,
 		DOUBLE ang, char axis = 'Z',
-		bool wrap = DONT_WRAP, T outside = 0)
+		bool wrap = DONT_WRAP, T outside = 0, int nr_threads = 1)
 	{
 		MultidimArray<T> aux = V1;
-		rotate(aux, V1, ang, axis, wrap, outside);
+		rotate(aux, V1, ang, axis, wrap, outside, nr_threads);
 	}
 
 	/** Translate a array.
@@ -747,7 +825,7 @@ namespace relion
 	void translate(const MultidimArray<T> &V1,
 		MultidimArray<T> &V2,
 		const Matrix1D< DOUBLE >& v,
-		bool wrap = WRAP, T outside = 0)
+		bool wrap = WRAP, T outside = 0, int nr_threads = 1)
 	{
 		Matrix2D< DOUBLE > tmp;
 		if (V1.getDim() == 2)
@@ -757,7 +835,7 @@ namespace relion
 		else
 			REPORT_ERROR("translate ERROR: translate only valid for 2D or 3D arrays");
 
-		applyGeometry(V1, V2, tmp, IS_NOT_INV, wrap, outside);
+		applyGeometry(V1, V2, tmp, IS_NOT_INV, wrap, outside, nr_threads);
 	}
 
 	/** Translate an array.
@@ -768,10 +846,10 @@ namespace relion
 	template<typename T>
 	void selfTranslate(MultidimArray<T>& V1,
 		const Matrix1D< DOUBLE >& v,
-		bool wrap = WRAP, T outside = 0)
+		bool wrap = WRAP, T outside = 0, int nr_threads = 1)
 	{
 		MultidimArray<T> aux = V1;
-		translate(aux, V1, v, wrap, outside);
+		translate(aux, V1, v, wrap, outside, nr_threads);
 	}
 
 	/** Translate center of mass to center
@@ -820,7 +898,7 @@ namespace relion
 	template<typename T>
 	void scaleToSize(const MultidimArray<T> &V1,
 		MultidimArray<T> &V2,
-		int Xdim, int Ydim, int Zdim = 1)
+		int Xdim, int Ydim, int Zdim = 1, int nr_threads = 1)
 	{
 
 		Matrix2D< DOUBLE > tmp;
@@ -842,7 +920,7 @@ namespace relion
 		else
 			REPORT_ERROR("scaleToSize ERROR: scaleToSize only valid for 2D or 3D arrays");
 
-		applyGeometry(V1, V2, tmp, IS_NOT_INV, WRAP, (T)0);
+		applyGeometry(V1, V2, tmp, IS_NOT_INV, WRAP, (T)0, nr_threads);
 	}
 
 	/** Scales to a new size.
@@ -852,10 +930,10 @@ namespace relion
 	 */
 	template<typename T>
 	void selfScaleToSize(MultidimArray<T> &V1,
-		int Xdim, int Ydim, int Zdim = 1)
+		int Xdim, int Ydim, int Zdim = 1, int nr_threads = 1)
 	{
 		MultidimArray<T> aux = V1;
-		scaleToSize(aux, V1, Xdim, Ydim, Zdim);
+		scaleToSize(aux, V1, Xdim, Ydim, Zdim, nr_threads);
 	}
 
 	/** Does a radial average of a 2D/3D image, around the voxel where is the origin.
@@ -885,8 +963,6 @@ namespace relion
 		MultidimArray< int >& radial_count,
 		const bool& rounding = false)
 	{
-		Matrix1D< DOUBLE > idx(3);
-
 		// If center_of_rot was written for 2D image
 		if (center_of_rot.size() < 3)
 			center_of_rot.resize(3);
@@ -932,26 +1008,39 @@ namespace relion
 		radial_count.resize(dim);
 		radial_count.initZeros();
 
+		// Distance (bin) of every squared distance to the center, up to the farthest corner
+		long int max_r2 = 0;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			long int dz = ((corner & 4) ? FINISHINGZ(m) : STARTINGZ(m)) - ZZ(center_of_rot);
+			long int dy = ((corner & 2) ? FINISHINGY(m) : STARTINGY(m)) - YY(center_of_rot);
+			long int dx = ((corner & 1) ? FINISHINGX(m) : STARTINGX(m)) - XX(center_of_rot);
+			max_r2 = XMIPP_MAX(max_r2, dz * dz + dy * dy + dx * dx);
+		}
+		std::vector<int> shell_of_r2;
+		getSquaredRadiusShells(max_r2, rounding, shell_of_r2);
+
 		// Perform the radial sum and count pixels that contribute to every
 		// distance
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(m)
+		for (long int k = STARTINGZ(m); k <= FINISHINGZ(m); k++)
 		{
-			ZZ(idx) = k - ZZ(center_of_rot);
-			YY(idx) = i - YY(center_of_rot);
-			XX(idx) = j - XX(center_of_rot);
-
-			// Determine distance to the center
-			int distance;
-			if (rounding)
-				distance = (int)ROUND(idx.module());
-			else
-				distance = (int)floor(idx.module());
+			long int dz = k - ZZ(center_of_rot);
+			for (long int i = STARTINGY(m); i <= FINISHINGY(m); i++)
+			{
+				long int dy = i - YY(center_of_rot);
+				long int r2_zy = dz * dz + dy * dy;
+				for (long int j = STARTINGX(m); j <= FINISHINGX(m); j++)
+				{
+					long int dx = j - XX(center_of_rot);
+					int distance = shell_of_r2[r2_zy + dx * dx];
 
-			// Sum te value to the pixels with the same distance
-			radial_mean(distance) += A3D_ELEM(m, k, i, j);
+					// Sum te value to the pixels with the same distance
+					radial_mean(distance) += A3D_ELEM(m, k, i, j);
 
-			// Count the pixel
-			radial_count(distance)++;
+					// Count the pixel
+					radial_count(distance)++;
+				}
+			}
 		}
 
 		// Perform the mean
@@ -0,0 +1,96 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * FourierTransformer and the FFTW plan cache
+ *
+ * fftw_test
+ *
+ * Exits with status 1 if a check fails.
+ */
+
+#include <cmath>
+#include <string>
+#include <iostream>
+#include "src/fftw.h"
+
+using namespace relion;
+
+static int nr_failed = 0;
+
+static void check(bool ok, const std::string &what)
+{
+	std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+	if (!ok)
+		nr_failed++;
+}
+
+static DOUBLE maxDifference(const MultidimArray<Complex > &a, const MultidimArray<Complex > &b)
+{
+	DOUBLE max_diff = 0.;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(a)
+	{
+		Complex d = DIRECT_MULTIDIM_ELEM(a, n) - DIRECT_MULTIDIM_ELEM(b, n);
+		max_diff = XMIPP_MAX(max_diff, sqrt(d.real * d.real + d.imag * d.imag));
+	}
+	return max_diff;
+}
+
+// A transformer that has its (cached) plans already keeps working after another one of the same size is cleaned up
+static void testTransformAfterOtherCleanup()
+{
+	MultidimArray<DOUBLE> img(32, 32), img_copy;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+	{
+		DIRECT_MULTIDIM_ELEM(img, n) = sin(0.1 * n) + cos(0.37 * n);
+	}
+	img_copy = img;
+
+	FourierTransformer transformer, other;
+	MultidimArray<Complex > Fimg, Fother;
+	transformer.FourierTransform(img, Fimg, true);
+	MultidimArray<Complex > Fref = Fimg;
+
+	other.FourierTransform(img_copy, Fother, false);
+	other.cleanup();
+
+	// Same arrays, so transformer re-uses the plans it got before the cleanup
+	transformer.FourierTransform(img, Fimg, true);
+	check(Fimg.sameShape(Fref) && maxDifference(Fimg, Fref) < 1e-4, "transform after the cleanup of another transformer");
+
+	MultidimArray<Complex > Fagain;
+	other.FourierTransform(img_copy, Fagain, true);
+	check(Fagain.sameShape(Fref) && maxDifference(Fagain, Fref) < 1e-4, "transform with a transformer after its own cleanup");
+}
+
+int main()
+{
+	try
+	{
+		testTransformAfterOtherCleanup();
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return 1;
+	}
+
+	return (nr_failed > 0) ? 1 : 0;
+}
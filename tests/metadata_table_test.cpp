@@ -0,0 +1,88 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * Reading of STAR files by MetaDataTable
+ *
+ * metadata_table_test <scratch directory>
+ *
+ * Exits with status 1 if a check fails.
+ */
+
+#include <cstdio>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include "src/metadata_table.h"
+
+using namespace relion;
+
+static int nr_failed = 0;
+
+static void check(bool ok, const std::string &what)
+{
+	std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+	if (!ok)
+		nr_failed++;
+}
+
+// Both data blocks of one file read from the same ifstream, the first table being followed by another block
+static void testTwoBlocksFromOneStream(const std::string &dir)
+{
+	std::string fn = dir + "/two_blocks.star";
+	{
+		std::ofstream out(fn.c_str());
+		out << "\ndata_first\n\nloop_\n_rlnImageName #1\n_rlnDefocusU #2\n"
+			<< "1@a.mrcs 10000.\n2@a.mrcs 11000.\n\n"
+			<< "data_second\n\nloop_\n_rlnImageName #1\n_rlnDefocusU #2\n"
+			<< "1@b.mrcs 20000.\n2@b.mrcs 21000.\n3@b.mrcs 22000.\n";
+	}
+
+	std::ifstream in(fn.c_str(), std::ios_base::in);
+	MetaDataTable MDfirst, MDsecond;
+	MDfirst.readStar(in, "first");
+	MDsecond.readStar(in, "second");
+	in.close();
+	std::remove(fn.c_str());
+
+	check(MDfirst.numberOfObjects() == 2, "readStar of the first block of a stream");
+	check(MDsecond.numberOfObjects() == 3, "readStar of the second block of the same stream");
+
+	DOUBLE defocus = 0.;
+	MDsecond.getValue(EMDL_CTF_DEFOCUSU, defocus, 2);
+	check(defocus == 22000., "values of the second block");
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = (argc > 1) ? argv[1] : ".";
+
+	try
+	{
+		testTwoBlocksFromOneStream(dir);
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return 1;
+	}
+
+	return (nr_failed > 0) ? 1 : 0;
+}
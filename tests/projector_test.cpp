@@ -0,0 +1,108 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+/*
+ * Copies of Projector and BackProjector
+ *
+ * projector_test
+ *
+ * Exits with status 1 if a check fails.
+ */
+
+#include <string>
+#include <iostream>
+#include "src/backprojector.h"
+
+using namespace relion;
+
+static int nr_failed = 0;
+
+static void check(bool ok, const std::string &what)
+{
+	std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+	if (!ok)
+		nr_failed++;
+}
+
+static void fillData(Projector &projector)
+{
+	projector.initZeros();
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(projector.data)
+	{
+		DIRECT_MULTIDIM_ELEM(projector.data, n) = Complex(0.25 * (n % 7), -0.5 * (n % 5));
+	}
+}
+
+static bool sameData(const MultidimArray<Complex > &a, const MultidimArray<Complex > &b)
+{
+	if (!a.sameShape(b))
+		return false;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(a)
+	{
+		if (DIRECT_MULTIDIM_ELEM(a, n).real != DIRECT_MULTIDIM_ELEM(b, n).real ||
+			DIRECT_MULTIDIM_ELEM(a, n).imag != DIRECT_MULTIDIM_ELEM(b, n).imag)
+			return false;
+	}
+	return true;
+}
+
+// An assigned BackProjector has the half-precision data of the original
+static void testAssignHalfPrecision()
+{
+	BackProjector BP(16, 3, "C1");
+	fillData(BP);
+	MultidimArray<Complex > ref = BP.data;
+	BP.setHalfPrecision(true);
+
+	BackProjector copy(8, 3, "C1");
+	copy = BP;
+	check(!copy.half_data.isEmpty(), "half-precision data of an assigned BackProjector");
+	copy.setHalfPrecision(false);
+	check(sameData(copy.data, ref), "values of the half-precision data of an assigned BackProjector");
+}
+
+// An assigned BackProjector has the bricked copy of the data of the original
+static void testAssignBricked()
+{
+	BackProjector BP(16, 3, "C1");
+	fillData(BP);
+	BP.setBrickedLayout(true);
+
+	BackProjector copy(8, 3, "C1");
+	copy = BP;
+	check(!copy.bricked_data.isEmpty(), "bricked data of an assigned BackProjector");
+	check(sameData(copy.data, BP.data), "data of an assigned BackProjector");
+}
+
+int main()
+{
+	try
+	{
+		testAssignHalfPrecision();
+		testAssignBricked();
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return 1;
+	}
+
+	return (nr_failed > 0) ? 1 : 0;
+}